@@ -0,0 +1,214 @@
+#include "bench/main.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "frontend/frontend.hpp"
+#include "util/file.hpp"
+#include "util/misc.hpp"
+#include "util/version.hpp"
+
+namespace bench {
+
+namespace {
+using Clock = std::chrono::steady_clock;
+
+double Seconds(Clock::time_point from, Clock::time_point to) {
+  return std::chrono::duration<double>(to - from).count();
+}
+
+// Durations of a phase of the executions, in seconds.
+class Latencies {
+ public:
+  void Add(double seconds) { samples_.push_back(seconds); }
+
+  void Print(const char* phase) {
+    if (samples_.empty()) return;
+    std::sort(samples_.begin(), samples_.end());
+    printf("  %-14s p50 %8.3fs  p90 %8.3fs  p99 %8.3fs  max %8.3fs\n", phase,
+           Percentile(0.5), Percentile(0.9), Percentile(0.99),
+           samples_.back());
+  }
+
+ private:
+  double Percentile(double p) const {
+    return samples_[static_cast<size_t>(p * (samples_.size() - 1))];
+  }
+
+  std::vector<double> samples_;
+};
+
+// What the frontend sees of an execution.
+struct Timing {
+  bool started = false;
+  bool done = false;
+  Clock::time_point start;
+  Clock::time_point end;
+  float cpu_time = 0;
+  float wall_time = 0;
+};
+
+// Contents that are different for every seed, so that the server never has
+// them in its store already.
+std::string Contents(size_t size, const std::string& seed) {
+  std::seed_seq seq(seed.begin(), seed.end());
+  std::mt19937_64 random(seq);
+  std::string contents = seed + "\n";
+  contents.reserve(size);
+  while (contents.size() < size) {
+    contents.push_back('a' + random() % 26);
+    if (contents.size() % 64 == 0) contents.back() = '\n';
+  }
+  contents.resize(std::max(size, seed.size() + 1));
+  return contents;
+}
+}  // namespace
+
+kj::MainBuilder::Validity Main::Run() {
+  if (program.empty()) return "--program is required";
+  try {
+    std::stod(cpu_time);
+  } catch (std::exception& e) {
+    return "--cpu-time must be a number of seconds";
+  }
+  frontend::Frontend frontend(server, port);
+  std::string nonce = std::to_string(
+      std::chrono::system_clock::now().time_since_epoch().count());
+  uint64_t sent = util::File::Size(program);
+  uint64_t received = 0;
+  frontend::File* executable = frontend.provideFile(program, program, true);
+  std::vector<frontend::File*> inputs;
+  for (uint32_t t = 0; t < testcases; t++) {
+    std::string contents =
+        Contents(input_size * 1024ULL, nonce + "-" + std::to_string(t));
+    sent += contents.size();
+    inputs.push_back(frontend.provideFileContent(
+        contents, "input " + std::to_string(t), false));
+  }
+
+  // Each solution on each testcase is a pair of executions: the solution and
+  // the program that checks its output, or the manager of its group.
+  std::vector<Timing> timings(2ULL * testcases * solutions);
+  size_t next = 0;
+  size_t failed = 0;
+  size_t errored = 0;
+  auto track = [&](frontend::Execution* execution) {
+    Timing* timing = &timings[next++];
+    execution->notifyStart([timing]() {
+      timing->started = true;
+      timing->start = Clock::now();
+    });
+    execution->getResult(
+        [timing, &failed](frontend::Result result) {
+          timing->done = true;
+          timing->end = Clock::now();
+          timing->cpu_time = result.resources.cpu_time;
+          timing->wall_time = result.resources.wall_time;
+          if (result.status != capnproto::ProcessResult::Status::SUCCESS) {
+            failed++;
+          }
+        },
+        [&errored]() { errored++; });
+  };
+  auto busywait = [&](frontend::Execution* execution, uint32_t t) {
+    execution->setExecutable("busywait", executable);
+    execution->setArgs({cpu_time});
+    execution->setStdin(inputs[t]);
+    if (!cache) execution->disableCache();
+    track(execution);
+  };
+  for (uint32_t s = 0; s < solutions; s++) {
+    for (uint32_t t = 0; t < testcases; t++) {
+      std::string name =
+          "solution " + std::to_string(s) + " on " + std::to_string(t);
+      if (groups) {
+        frontend::ExecutionGroup* group = frontend.addExecutionGroup(name);
+        frontend::Fifo* fifo = group->createFifo();
+        frontend::Execution* solution = group->addExecution("solution");
+        frontend::Execution* manager = group->addExecution("manager");
+        solution->addFifo("fifo", fifo);
+        manager->addFifo("fifo", fifo);
+        busywait(solution, t);
+        busywait(manager, t);
+        continue;
+      }
+      frontend::Execution* solution = frontend.addExecution(name);
+      busywait(solution, t);
+      // Copies the input back, so that the frontend receives as many bytes
+      // as it sends.
+      frontend::Execution* checker = frontend.addExecution("check " + name);
+      checker->setExecutablePath("/bin/cat");
+      checker->setStdin(inputs[t]);
+      checker->addInput("output", solution->getStdout(false));
+      if (!cache) checker->disableCache();
+      checker->getStdout(false)->getContentsChunks(
+          [&received](util::File::Chunk chunk) { received += chunk.size(); });
+      track(checker);
+    }
+  }
+
+  Clock::time_point start = Clock::now();
+  frontend.evaluate();
+  Clock::time_point end = Clock::now();
+
+  Latencies until_start, run, total, cpu, wall;
+  size_t done = 0;
+  for (const Timing& timing : timings) {
+    if (!timing.done) continue;
+    done++;
+    total.Add(Seconds(start, timing.end));
+    cpu.Add(timing.cpu_time);
+    wall.Add(timing.wall_time);
+    if (!timing.started) continue;
+    until_start.Add(Seconds(start, timing.start));
+    run.Add(Seconds(timing.start, timing.end));
+  }
+  double elapsed = Seconds(start, end);
+  printf("%zu of %zu executions done in %.3fs, %zu failed, %zu errored\n",
+         done, timings.size(), elapsed, failed, errored);
+  printf("%.1f executions/s\n", elapsed > 0 ? done / elapsed : 0);
+  printf("%.1f MiB sent, %.1f MiB received\n", sent / 1048576.0,
+         received / 1048576.0);
+  printf("Latencies since the start of the evaluation:\n");
+  until_start.Print("until start");
+  run.Print("start to end");
+  total.Print("until end");
+  printf("Resources used on the workers:\n");
+  cpu.Print("cpu time");
+  wall.Print("wall time");
+  return true;
+}
+
+kj::MainFunc Main::getMain() {
+  return kj::MainBuilder(context, "Task-Maker Bench (" + util::version + ")",
+                         "Sends a synthetic DAG to a server and reports the "
+                         "throughput and the latency of the executions")
+      .addOptionWithArg({'s', "server"}, util::setString(&server),
+                        "<ADDRESS>", "Address of the server")
+      .addOptionWithArg({'p', "port"}, util::setInt(&port), "<PORT>",
+                        "Port of the server")
+      .addOptionWithArg({'x', "program"}, util::setString(&program), "<PATH>",
+                        "Program that uses as many seconds of CPU time as "
+                        "its argument, like busywait_arg1 of the sandbox "
+                        "tests")
+      .addOptionWithArg({'t', "testcases"}, util::setUint(&testcases), "<N>",
+                        "Number of testcases")
+      .addOptionWithArg({'n', "solutions"}, util::setUint(&solutions), "<N>",
+                        "Number of solutions, each is run on every testcase")
+      .addOptionWithArg({"input-size"}, util::setUint(&input_size), "<KiB>",
+                        "Size of each input")
+      .addOptionWithArg({"cpu-time"}, util::setString(&cpu_time), "<SECS>",
+                        "CPU time used by each execution")
+      .addOption({'g', "groups"}, util::setBool(&groups),
+                 "Run each solution in a group with a manager, connected by "
+                 "a FIFO, instead of checking its output")
+      .addOption({"cache"}, util::setBool(&cache),
+                 "Allow the server to reuse the results of previous runs")
+      .callAfterParsing(KJ_BIND_METHOD(*this, Run))
+      .build();
+}
+}  // namespace bench
@@ -0,0 +1,33 @@
+#ifndef BENCH_MAIN_HPP
+#define BENCH_MAIN_HPP
+#include <kj/main.h>
+#include <string>
+
+namespace bench {
+
+// Load generator: sends to a running server a synthetic DAG with a
+// configurable shape, and reports the throughput and the latency of the
+// executions.
+class Main {
+ public:
+  explicit Main(kj::ProcessContext* context) : context(*context) {}
+  kj::MainBuilder::Validity Run();
+  kj::MainFunc getMain();
+
+ private:
+  kj::ProcessContext& context;
+  std::string server = "127.0.0.1";
+  int port = 7070;
+  // A program that uses as many seconds of CPU time as its first argument,
+  // like sandbox/test/busywait_arg1.
+  std::string program;
+  uint32_t testcases = 100;
+  uint32_t solutions = 10;
+  // Size of each input, in KiB.
+  uint32_t input_size = 64;
+  std::string cpu_time = "0.1";
+  bool groups = false;
+  bool cache = false;
+};
+}  // namespace bench
+#endif
@@ -0,0 +1,155 @@
+#include <benchmark/benchmark.h>
+#include <kj/async-io.h>
+#include <kj/debug.h>
+#include <kj/main.h>
+#include <kj/vector.h>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include "sandbox/main.hpp"
+#include "sandbox/sandbox.hpp"
+#include "worker/sandbox_pool.hpp"
+
+// The programs of sandbox/test are in SANDBOX_TEST_DIR.
+#ifndef SANDBOX_TEST_DIR
+#define SANDBOX_TEST_DIR "sandbox/test"
+#endif
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+sandbox::ExecutionOptions Options(const char* program, const char* arg) {
+  sandbox::ExecutionOptions options(SANDBOX_TEST_DIR, program);
+  options.SetArgs({arg});
+  return options;
+}
+
+// Decodes the output of a helper, in the format of "sandbox --bin".
+sandbox::ExecutionInfo Parse(const worker::SandboxPool::Outcome& outcome) {
+  KJ_ASSERT(outcome.status == 0, "Sandbox failed");
+  KJ_ASSERT(outcome.data.size() >= sizeof(size_t));
+  const char* data = outcome.data.asChars().begin();
+  size_t error = *reinterpret_cast<const size_t*>(data);  // NOLINT
+  std::string message(data + sizeof(size_t),
+                      outcome.data.size() - sizeof(size_t));
+  KJ_ASSERT(error == 0, message);
+  sandbox::ExecutionInfo info;
+  KJ_ASSERT(info.Parse(message), "Invalid sandbox outcome");
+  return info;
+}
+
+// Runs a program that exits right away, in the sandbox of this process: the
+// fork, the setup of the limits, the wait and the result.
+void BM_Execute(benchmark::State& state) {
+  std::unique_ptr<sandbox::Sandbox> sandbox = sandbox::Sandbox::Create();
+  auto options = Options("return_arg1", "0");
+  options.cpu_limit_millis = 1000;
+  options.wall_limit_millis = 1000;
+  options.memory_limit_kb = 64 * 1024;
+  for (auto _ : state) {
+    sandbox::ExecutionInfo info;
+    std::string error;
+    if (!sandbox->Execute(options, &info, &error)) {
+      state.SkipWithError(error.c_str());
+      break;
+    }
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_Execute)->ThreadRange(1, 16)->UseRealTime();
+
+// Runs state.range(0) executions at a time through the helpers of a
+// SandboxPool, as the worker does. The overhead is the time measured here
+// minus the wall time reported by the sandbox. check compares the reported
+// resources with the ones the program is known to use.
+template <typename Check>
+void RunPooled(benchmark::State& state,
+               const sandbox::ExecutionOptions& options, Check check) {
+  auto io = kj::setupAsyncIo();
+  size_t concurrency = state.range(0);
+  worker::SandboxPool pool(io.lowLevelProvider.get(), concurrency);
+  for (auto _ : state) {
+    kj::Vector<kj::Promise<void>> running(concurrency);
+    for (size_t i = 0; i < concurrency; i++) {
+      Clock::time_point start = Clock::now();
+      running.add(pool.Run(options, [](int) {})
+                      .then([&state, &check, start](auto outcome) {
+                        double wall = std::chrono::duration<double>(
+                                          Clock::now() - start)
+                                          .count();
+                        sandbox::ExecutionInfo info = Parse(outcome);
+                        state.counters["overhead_ms"] +=
+                            wall * 1000 - info.wall_time_millis;
+                        check(&state, info);
+                      }));
+    }
+    kj::joinPromises(running.releaseAsArray()).wait(io.waitScope);
+  }
+  state.SetItemsProcessed(state.iterations() * concurrency);
+  for (auto& counter : state.counters) {
+    counter.second = benchmark::Counter(
+        counter.second / (state.iterations() * concurrency));
+  }
+}
+
+void BM_PooledExecute(benchmark::State& state) {
+  RunPooled(state, Options("return_arg1", "0"),
+            [](benchmark::State*, const sandbox::ExecutionInfo&) {});
+}
+BENCHMARK(BM_PooledExecute)->RangeMultiplier(2)->Range(1, 16)->UseRealTime();
+
+void BM_CpuTimeAccuracy(benchmark::State& state) {
+  RunPooled(state, Options("busywait_arg1", "0.1"),
+            [](benchmark::State* state, const sandbox::ExecutionInfo& info) {
+              state->counters["cpu_error_ms"] += info.cpu_time_millis - 100;
+            });
+}
+BENCHMARK(BM_CpuTimeAccuracy)
+    ->RangeMultiplier(2)
+    ->Range(1, 16)
+    ->UseRealTime()
+    ->Unit(benchmark::kMillisecond);
+
+void BM_WallTimeAccuracy(benchmark::State& state) {
+  RunPooled(state, Options("wait_arg1", "0.1"),
+            [](benchmark::State* state, const sandbox::ExecutionInfo& info) {
+              state->counters["sleep_error_ms"] +=
+                  info.wall_time_millis - 100;
+            });
+}
+BENCHMARK(BM_WallTimeAccuracy)
+    ->RangeMultiplier(2)
+    ->Range(1, 16)
+    ->UseRealTime()
+    ->Unit(benchmark::kMillisecond);
+
+// malloc_arg1 allocates 4 MiB for each unit of its argument.
+void BM_MemoryAccuracy(benchmark::State& state) {
+  RunPooled(state, Options("malloc_arg1", "16"),
+            [](benchmark::State* state, const sandbox::ExecutionInfo& info) {
+              state->counters["memory_error_kb"] +=
+                  info.memory_usage_kb - 4 * 16 * 1024;
+            });
+}
+BENCHMARK(BM_MemoryAccuracy)
+    ->RangeMultiplier(2)
+    ->Range(1, 16)
+    ->UseRealTime()
+    ->Unit(benchmark::kMillisecond);
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  // The helpers of the pool are started as "<this program> sandbox --zygote".
+  if (argc > 1 && std::string(argv[1]) == "sandbox") {
+    kj::TopLevelProcessContext context(argv[0]);
+    sandbox::Main main(&context);
+    return kj::runMainAndExit(context, main.getMain(), argc - 1, argv + 1);
+  }
+  benchmark::Initialize(&argc, argv);
+  if (benchmark::ReportUnrecognizedArguments(argc, argv)) return 1;
+  benchmark::RunSpecifiedBenchmarks();
+  return 0;
+}
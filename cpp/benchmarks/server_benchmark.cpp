@@ -0,0 +1,211 @@
+#include <benchmark/benchmark.h>
+#include <capnp/message.h>
+#include <kj/async.h>
+#include <kj/vector.h>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include "server/cache.hpp"
+#include "server/dispatcher.hpp"
+#include "util/file.hpp"
+#include "util/flags.hpp"
+
+namespace {
+
+// A request with a few inputs and outputs, made unique by its argument.
+class Requests {
+ public:
+  explicit Requests(size_t count) {
+    input_ = util::File::IngestContents(Contents("input"), 0);
+    output_ = util::File::IngestContents(Contents("output"), 0);
+    requests_list_ = builder_.getOrphanage().newOrphan<
+        capnp::List<capnproto::Request>>(count);
+    results_list_ = builder_.getOrphanage().newOrphan<
+        capnp::List<capnproto::Result>>(count);
+    for (size_t i = 0; i < count; i++) {
+      auto process = requests_list_.get()[i].initProcesses(1)[0];
+      process.initExecutable().setSystem("/usr/bin/solution");
+      process.initArgs(2);
+      process.getArgs().set(0, "--seed");
+      process.getArgs().set(1, std::to_string(i));
+      auto inputs = process.initInputFiles(2);
+      for (size_t j = 0; j < inputs.size(); j++) {
+        inputs[j].setName("input" + std::to_string(j));
+        input_.ToCapnp(inputs[j].initHash());
+      }
+      process.initOutputFiles(1).set(0, "output");
+      process.setStdout(0);
+      process.getLimits().setCpuTime(1);
+      auto result = results_list_.get()[i].initProcesses(1)[0];
+      result.getStatus().setSuccess();
+      result.initResourceUsage().setCpuTime(1);
+      output_.ToCapnp(result.initStdout());
+      auto outputs = result.initOutputFiles(1);
+      outputs[0].setName("output");
+      output_.ToCapnp(outputs[0].initHash());
+    }
+  }
+
+  capnproto::Request::Reader Request(size_t i) {
+    return requests_list_.getReader()[i];
+  }
+  capnproto::Result::Reader Result(size_t i) {
+    return results_list_.getReader()[i];
+  }
+
+ private:
+  static kj::ArrayPtr<const uint8_t> Contents(const char* text) {
+    return kj::StringPtr(text).asBytes();
+  }
+
+  util::SHA256_t input_ = util::SHA256_t::ZERO;
+  util::SHA256_t output_ = util::SHA256_t::ZERO;
+  capnp::MallocMessageBuilder builder_;
+  capnp::Orphan<capnp::List<capnproto::Request>> requests_list_;
+  capnp::Orphan<capnp::List<capnproto::Result>> results_list_;
+};
+
+// A store in a temporary directory, for the duration of a benchmark.
+class Store {
+ public:
+  Store() : tmp_("/tmp") {
+    previous_ = Flags::store_directory;
+    Flags::store_directory = util::File::JoinPath(tmp_.Path(), "store");
+    util::File::MakeDirs(Flags::store_directory);
+  }
+  ~Store() { Flags::store_directory = previous_; }
+
+  // Removes the files of the cache.
+  void ClearCache() {
+    for (const char* name : {"cache", "cache.snapshot"}) {
+      std::string path = util::File::JoinPath(Flags::store_directory, name);
+      if (util::File::Exists(path)) util::File::Remove(path);
+    }
+  }
+
+ private:
+  util::TempDir tmp_;
+  std::string previous_;
+};
+
+void BM_RequestDigest(benchmark::State& state) {
+  Store store;
+  Requests requests(1);
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(server::RequestDigest(requests.Request(0)));
+  }
+}
+BENCHMARK(BM_RequestDigest);
+
+void BM_CacheSet(benchmark::State& state) {
+  Store store;
+  size_t count = state.range(0);
+  Requests requests(count);
+  for (auto _ : state) {
+    state.PauseTiming();
+    {
+      server::CacheManager cache;
+      state.ResumeTiming();
+      for (size_t i = 0; i < count; i++) {
+        cache.Set(requests.Request(i), requests.Result(i));
+      }
+      // The compaction of the destructor is timed by BM_CacheReplay.
+      state.PauseTiming();
+    }
+    store.ClearCache();
+    state.ResumeTiming();
+  }
+  state.SetItemsProcessed(state.iterations() * count);
+}
+BENCHMARK(BM_CacheSet)->Arg(10000)->Unit(benchmark::kMillisecond);
+
+void BM_CacheLookup(benchmark::State& state) {
+  Store store;
+  size_t count = state.range(0);
+  Requests requests(count);
+  server::CacheManager cache;
+  for (size_t i = 0; i < count; i++) {
+    cache.Set(requests.Request(i), requests.Result(i));
+  }
+  size_t i = 0;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(cache.Lookup(requests.Request(i)));
+    i = (i + 1) % count;
+  }
+}
+BENCHMARK(BM_CacheLookup)->Arg(10000)->Arg(1000000);
+
+// Loading the cache at startup. The case with 1M entries needs a few GiB of
+// memory.
+void BM_CacheReplay(benchmark::State& state) {
+  Store store;
+  size_t count = state.range(0);
+  {
+    Requests requests(count);
+    server::CacheManager cache;
+    for (size_t i = 0; i < count; i++) {
+      cache.Set(requests.Request(i), requests.Result(i));
+    }
+  }
+  for (auto _ : state) {
+    server::CacheManager cache;
+    // Nothing changed, the destructor does not write it again.
+    benchmark::DoNotOptimize(&cache);
+  }
+  state.SetItemsProcessed(state.iterations() * count);
+}
+BENCHMARK(BM_CacheReplay)
+    ->Arg(10000)
+    ->Arg(1000000)
+    ->Unit(benchmark::kMillisecond);
+
+// Answers right away with an empty result.
+class Evaluator : public capnproto::Evaluator::Server {
+ public:
+  kj::Promise<void> evaluate(EvaluateContext context) override {
+    auto process = context.getResults().initResult().initProcesses(1)[0];
+    process.getStatus().setSuccess();
+    return kj::READY_NOW;
+  }
+};
+
+void BM_DispatcherThroughput(benchmark::State& state) {
+  kj::EventLoop loop;
+  kj::WaitScope waitScope(loop);
+  size_t count = state.range(0);
+  capnp::MallocMessageBuilder builder;
+  auto list =
+      builder.getOrphanage().newOrphan<capnp::List<capnproto::Request>>(count);
+  for (size_t i = 0; i < count; i++) {
+    auto process = list.get()[i].initProcesses(1)[0];
+    process.initExecutable().setSystem("/usr/bin/solution");
+    process.initArgs(1).set(0, std::to_string(i));
+  }
+  auto canceled = std::make_shared<bool>(false);
+  capnproto::Evaluator::Client evaluator = kj::heap<Evaluator>();
+  for (auto _ : state) {
+    server::Dispatcher dispatcher;
+    auto slots = dispatcher.AddEvaluator(evaluator, 1, count);
+    kj::Vector<kj::Promise<void>> done(count);
+    for (size_t i = 0; i < count; i++) {
+      server::RequestPriority priority;
+      priority.dependents = i % 7;
+      done.add(dispatcher
+                   .AddRequest(list.getReader()[i],
+                               kj::newPromiseAndFulfiller<void>().fulfiller,
+                               canceled, priority)
+                   .ignoreResult());
+    }
+    kj::joinPromises(done.releaseAsArray()).wait(waitScope);
+    slots.wait(waitScope);
+  }
+  state.SetItemsProcessed(state.iterations() * count);
+}
+BENCHMARK(BM_DispatcherThroughput)
+    ->Range(1 << 8, 1 << 16)
+    ->Unit(benchmark::kMillisecond);
+
+}  // namespace
+
+BENCHMARK_MAIN();
@@ -0,0 +1,136 @@
+#include <benchmark/benchmark.h>
+#include <kj/async.h>
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include "util/file.hpp"
+#include "util/join.hpp"
+#include "util/sha256.hpp"
+#include "util/union_promise.hpp"
+
+namespace {
+
+std::vector<uint8_t> Data(size_t size) {
+  std::vector<uint8_t> data(size);
+  for (size_t i = 0; i < size; i++) data[i] = i * 7 + i / 251;
+  return data;
+}
+
+void BM_SHA256(benchmark::State& state) {
+  auto data = Data(state.range(0));
+  for (auto _ : state) {
+    util::SHA256 hasher;
+    hasher.update(data.data(), data.size());
+    benchmark::DoNotOptimize(hasher.finalize());
+  }
+  state.SetBytesProcessed(state.iterations() * data.size());
+}
+BENCHMARK(BM_SHA256)->Range(64, 16 << 20);
+
+// Files of state.range(0) bytes in a temporary directory.
+class FileBenchmark : public benchmark::Fixture {
+ public:
+  void SetUp(const benchmark::State& state) override {
+    tmp_.reset(new util::TempDir("/tmp"));
+    path_ = util::File::JoinPath(tmp_->Path(), "file");
+    data_ = Data(state.range(0));
+    Write(path_);
+  }
+
+  void TearDown(const benchmark::State& state) override { tmp_.reset(); }
+
+ protected:
+  void Write(const std::string& path) {
+    auto receiver = util::File::Write(path, true);
+    for (size_t pos = 0; pos < data_.size(); pos += util::kChunkSize) {
+      size_t size = std::min<size_t>(util::kChunkSize, data_.size() - pos);
+      receiver(util::File::Chunk(data_.data() + pos, size));
+    }
+    receiver(util::File::Chunk());
+  }
+
+  std::unique_ptr<util::TempDir> tmp_;
+  std::string path_;
+  std::vector<uint8_t> data_;
+};
+
+BENCHMARK_DEFINE_F(FileBenchmark, Hash)(benchmark::State& state) {
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(util::File::Hash(path_));
+  }
+  state.SetBytesProcessed(state.iterations() * data_.size());
+}
+BENCHMARK_REGISTER_F(FileBenchmark, Hash)->Range(1 << 10, 64 << 20);
+
+BENCHMARK_DEFINE_F(FileBenchmark, Read)(benchmark::State& state) {
+  for (auto _ : state) {
+    auto producer = util::File::Read(path_);
+    while (producer().size() != 0) {
+    }
+  }
+  state.SetBytesProcessed(state.iterations() * data_.size());
+}
+BENCHMARK_REGISTER_F(FileBenchmark, Read)->Range(1 << 10, 64 << 20);
+
+BENCHMARK_DEFINE_F(FileBenchmark, Write)(benchmark::State& state) {
+  std::string path = util::File::JoinPath(tmp_->Path(), "written");
+  for (auto _ : state) Write(path);
+  state.SetBytesProcessed(state.iterations() * data_.size());
+}
+BENCHMARK_REGISTER_F(FileBenchmark, Write)->Range(1 << 10, 64 << 20);
+
+BENCHMARK_DEFINE_F(FileBenchmark, Copy)(benchmark::State& state) {
+  std::string path = util::File::JoinPath(tmp_->Path(), "copy");
+  for (auto _ : state) util::File::Copy(path_, path, true);
+  state.SetBytesProcessed(state.iterations() * data_.size());
+}
+BENCHMARK_REGISTER_F(FileBenchmark, Copy)->Range(1 << 10, 64 << 20);
+
+// Waits for state.range(0) promises, that resolve after being added.
+template <typename AddAndFinalize>
+void WaitPromises(benchmark::State& state, AddAndFinalize add_and_finalize) {
+  kj::EventLoop loop;
+  kj::WaitScope waitScope(loop);
+  size_t count = state.range(0);
+  for (auto _ : state) {
+    std::vector<kj::Own<kj::PromiseFulfiller<void>>> fulfillers;
+    fulfillers.reserve(count);
+    std::vector<kj::Promise<void>> promises;
+    promises.reserve(count);
+    for (size_t i = 0; i < count; i++) {
+      auto pf = kj::newPromiseAndFulfiller<void>();
+      promises.push_back(std::move(pf.promise));
+      fulfillers.push_back(std::move(pf.fulfiller));
+    }
+    auto done = add_and_finalize(&promises);
+    for (auto& fulfiller : fulfillers) fulfiller->fulfill();
+    done.wait(waitScope);
+  }
+  state.SetItemsProcessed(state.iterations() * count);
+}
+
+void BM_UnionPromiseBuilder(benchmark::State& state) {
+  WaitPromises(state, [](std::vector<kj::Promise<void>>* promises) {
+    util::UnionPromiseBuilder builder;
+    for (auto& promise : *promises) builder.AddPromise(std::move(promise));
+    return std::move(builder).Finalize();
+  });
+}
+BENCHMARK(BM_UnionPromiseBuilder)
+    ->Range(1 << 10, 1 << 20)
+    ->Unit(benchmark::kMillisecond);
+
+void BM_Join(benchmark::State& state) {
+  WaitPromises(state, [](std::vector<kj::Promise<void>>* promises) {
+    util::Join join;
+    for (auto& promise : *promises) join.AddPromise(std::move(promise));
+    return join.Finalize();
+  });
+}
+BENCHMARK(BM_Join)->Range(1 << 10, 1 << 20)->Unit(benchmark::kMillisecond);
+
+}  // namespace
+
+BENCHMARK_MAIN();
@@ -0,0 +1,48 @@
+#include <benchmark/benchmark.h>
+#include <kj/string.h>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "util/file.hpp"
+#include "util/flags.hpp"
+#include "worker/cache.hpp"
+
+namespace {
+
+// Size of the files registered in the cache.
+const constexpr size_t kFileSize = 4096;
+
+// Registers files in a cache of 1 MiB, that is full after the first 256: from
+// then on every file that is registered evicts an older one.
+void BM_CacheRegister(benchmark::State& state) {
+  util::TempDir tmp("/tmp");
+  std::string previous_store = Flags::store_directory;
+  uint32_t previous_size = Flags::cache_size;
+  Flags::store_directory = util::File::JoinPath(tmp.Path(), "store");
+  Flags::cache_size = 1;
+  util::File::MakeDirs(Flags::store_directory);
+  {
+    worker::Cache cache;
+    std::vector<uint8_t> data(kFileSize);
+    uint64_t counter = 0;
+    for (auto _ : state) {
+      state.PauseTiming();
+      for (size_t i = 0; i < sizeof(counter); i++) {
+        data[i] = counter >> (8 * i);
+      }
+      counter++;
+      auto hash = util::File::IngestContents(
+          kj::ArrayPtr<const uint8_t>(data.data(), data.size()), 0);
+      state.ResumeTiming();
+      cache.Register(hash);
+    }
+  }
+  state.SetItemsProcessed(state.iterations());
+  Flags::store_directory = previous_store;
+  Flags::cache_size = previous_size;
+}
+BENCHMARK(BM_CacheRegister);
+
+}  // namespace
+
+BENCHMARK_MAIN();
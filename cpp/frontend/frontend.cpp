@@ -1,74 +1,83 @@
 #include "frontend/frontend.hpp"
+#include <capnp/message.h>
+#include <capnp/serialize.h>
+#include <kj/debug.h>
+#include <algorithm>
+#include <cstdlib>
 #include "util/file.hpp"
 
 namespace frontend {
 
-template <typename T>
-class FifoInst : public Fifo {
- public:
-  explicit FifoInst(T&& p)
-      : pf(kj::newPromiseAndFulfiller<capnproto::Fifo::Reader>()),
-        promise(std::move(p)) {
-    SetPromise(std::move(pf.promise));
-    promise = promise
-                  .then(
-                      [this](auto res) {
-                        pf.fulfiller->fulfill(res.getFifo());
-                        return std::move(res);
-                      },
-                      [this](kj::Exception exc) {
-                        pf.fulfiller->rejectIfThrows(
-                            []() { KJ_FAIL_ASSERT("Request failed"); });
-                        return exc;
-                      })
-                  .eagerlyEvaluate(nullptr);
+namespace {
+// Returns the token in the token file of a server, or an empty string if it
+// cannot be read, in which case the frontend and the server do not share the
+// filesystem.
+std::string ReadLocalToken(const std::string& path) {
+  std::string contents;
+  KJ_IF_MAYBE(exc, kj::runCatchingExceptions([&]() {
+                auto producer = util::File::Read(path);
+                util::File::Chunk chunk;
+                while ((chunk = producer()).size() != 0) {
+                  contents.append(chunk.asChars().begin(), chunk.size());
+                }
+              })) {
+    return "";
   }
+  return contents;
+}
 
- private:
-  kj::PromiseFulfillerPair<capnproto::Fifo::Reader> pf;
-  T promise;
-};
-
-template <typename T>
-class FileInst : public File {
- public:
-  FileInst(T&& p, Frontend* frontend, bool is_executable)
-      : File(frontend, is_executable),
-        pf(kj::newPromiseAndFulfiller<capnproto::File::Reader>()),
-        promise(std::move(p)) {
-    SetPromise(std::move(pf.promise));
-    promise = promise
-                  .then(
-                      [this](auto res) {
-                        pf.fulfiller->fulfill(res.getFile());
-                        return std::move(res);
-                      },
-                      [this](kj::Exception exc) {
-                        pf.fulfiller->rejectIfThrows(
-                            []() { KJ_FAIL_ASSERT("Request failed"); });
-                        return exc;
-                      })
-                  .eagerlyEvaluate(nullptr);
-  }
+// Returns the absolute path of an existing file, or an empty string.
+std::string AbsolutePath(const std::string& path) {
+  char* resolved = realpath(path.c_str(), nullptr);
+  if (resolved == nullptr) return "";
+  std::string absolute = resolved;
+  free(resolved);  // NOLINT
+  return absolute;
+}
 
- private:
-  kj::PromiseFulfillerPair<capnproto::File::Reader> pf;
-  T promise;
-};
+// Returns true if two entries of a DAG are the same.
+template <typename Reader>
+bool SameEntry(Reader a, Reader b) {
+  kj::Array<capnp::word> first = capnp::canonicalize(a);
+  kj::Array<capnp::word> second = capnp::canonicalize(b);
+  return first.asBytes() == second.asBytes();
+}
 
-template <typename T>
-std::unique_ptr<File> File::New(kj::Promise<T>&& p, Frontend* frontend,
-                                bool is_executable) {
-  return std::make_unique<FileInst<kj::Promise<T>>>(std::move(p), frontend,
-                                                    is_executable);
+// Sets the entries of now that are not the same in base, in the list
+// returned by init.
+template <typename T, typename Init>
+void DiffEntries(typename capnp::List<T>::Reader now,
+                 typename capnp::List<T>::Reader base, Init init) {
+  std::vector<uint32_t> changed;
+  for (uint32_t i = 0; i < now.size(); i++) {
+    if (i >= base.size() || !SameEntry(now[i], base[i])) changed.push_back(i);
+  }
+  auto entries = init(changed.size());
+  for (size_t i = 0; i < changed.size(); i++) {
+    entries[i].setIndex(changed[i]);
+    entries[i].setValue(now[changed[i]]);
+  }
 }
 
-template <typename T>
-std::unique_ptr<Fifo> Fifo::New(kj::Promise<T>&& p) {
-  return std::make_unique<FifoInst<kj::Promise<T>>>(std::move(p));
+// Returns the contents of the session file, or an empty array if there is
+// none.
+kj::Array<capnp::word> ReadSession(const std::string& path) {
+  std::string contents;
+  KJ_IF_MAYBE(exc, kj::runCatchingExceptions([&]() {
+                auto producer = util::File::Read(path);
+                util::File::Chunk chunk;
+                while ((chunk = producer()).size() != 0) {
+                  contents.append(chunk.asChars().begin(), chunk.size());
+                }
+              })) {
+    return nullptr;
+  }
+  auto words =
+      kj::heapArray<capnp::word>(contents.size() / sizeof(capnp::word));
+  memcpy(words.begin(), contents.data(), words.asBytes().size());
+  return words;
 }
 
-namespace {
 class FileProvider : public capnproto::FileSender::Server {
  public:
   explicit FileProvider(std::unordered_map<util::SHA256_t, util::FileWrapper,
@@ -78,8 +87,10 @@ class FileProvider : public capnproto::FileSender::Server {
 
   kj::Promise<void> requestFile(RequestFileContext context) override {
     util::FileWrapper* file = &known_files_.at(context.getParams().getHash());
+    // The transfer may outlive the last reference to the provider.
     return util::File::HandleRequestFile(
-        file, context.getParams().getReceiver(), 0xffffffffffffffff);
+               file, context.getParams().getReceiver(), 0xffffffffffffffff)
+        .attach(thisCap());
   }
 
  private:
@@ -87,33 +98,104 @@ class FileProvider : public capnproto::FileSender::Server {
       known_files_;
 };
 
+class EventReceiver : public capnproto::EventReceiver::Server {
+ public:
+  using Handler =
+      std::function<void(capnp::List<capnproto::ExecutionEvent>::Reader)>;
+  explicit EventReceiver(Handler handler) : handler_(std::move(handler)) {}
+
+  kj::Promise<void> events(EventsContext context) override {
+    handler_(context.getParams().getEvents());
+    return kj::READY_NOW;
+  }
+
+ private:
+  Handler handler_;
+};
+
+Result ToResult(capnproto::ProcessResult::Reader r) {
+  Result result;
+  result.status = r.getStatus().which();
+  if (r.getStatus().isSignal()) {
+    result.signal = r.getStatus().getSignal();
+  }
+  if (r.getStatus().isReturnCode()) {
+    result.return_code = r.getStatus().getReturnCode();
+  }
+  if (r.getStatus().isInternalError()) {
+    result.error = r.getStatus().getInternalError();
+  }
+  if (r.getStatus().isInvalidRequest()) {
+    result.error = r.getStatus().getInvalidRequest();
+  }
+  auto usage = r.getResourceUsage();
+  result.resources.cpu_time = usage.getCpuTime();
+  result.resources.sys_time = usage.getSysTime();
+  result.resources.wall_time = usage.getWallTime();
+  result.resources.memory = usage.getMemory();
+  result.resources.nproc = usage.getNproc();
+  result.resources.nofiles = usage.getNofiles();
+  result.resources.fsize = usage.getFsize();
+  result.resources.memlock = usage.getMemlock();
+  result.resources.stack = usage.getStack();
+  result.resources.instructions = usage.getInstructions();
+  result.was_cached = r.getWasCached();
+  result.was_killed = r.getWasKilled();
+  return result;
+}
+
 }  // namespace
 
 void File::getContentsAsString(
-    const std::function<void(const std::string&)>& callback, uint64_t limit) {
+    const std::function<void(const std::string&)>& callback, uint64_t limit,
+    uint64_t offset, bool from_end) {
+  auto output = std::make_shared<std::string>();
+  getContentsChunks(
+      [this, output, callback](util::File::Chunk data) {
+        if (data.size() == 0) {
+          frontend_.Deliver([output, callback]() { callback(*output); });
+          return;
+        }
+        output->append(data.asChars().begin(), data.size());
+      },
+      limit, offset, from_end);
+}
+
+void File::getContentsChunks(
+    const std::function<void(util::File::Chunk)>& callback, uint64_t limit,
+    uint64_t offset, bool from_end) {
   auto pf = kj::newPromiseAndFulfiller<void>();
   frontend_.builder_.AddPromise(std::move(pf.promise));
   frontend_.finish_builder_.AddPromise(
       forked_promise.addBranch().then(
-          [this, callback, limit,
+          [this, callback, limit, offset, from_end,
            fulfiller = std::move(pf.fulfiller)](auto file) mutable {
             auto req = frontend_.frontend_context_.getFileContentsRequest();
-            auto output = kj::heap<std::string>();
-            auto output_ptr = output.get();
             req.setFile(file);
             req.setReceiver(kj::heap<util::File::Receiver>(
-                [output = std::move(output)](util::File::Chunk data) mutable {
-                  *output += std::string(data.asChars().begin(), data.size());
-                }));
+                [callback](util::File::Chunk data) { callback(data); }));
             req.setAmount(limit);
-            kj::Promise<void> ret = req.send().ignoreResult().then(
-                [output_ptr, callback]() { callback(*output_ptr); });
+            req.setOffset(offset);
+            req.setFromEnd(from_end);
+            kj::Promise<void> ret = req.send().ignoreResult();
             fulfiller->fulfill();
-            return std::move(ret);
+            return ret;
           }),
       "Get file");
 }
 
+kj::Promise<void> File::ReceiveToFile(capnproto::File::Reader file,
+                                      const std::string& path, bool overwrite,
+                                      bool exist_ok) {
+  auto req = frontend_.frontend_context_.getFileContentsRequest();
+  req.setFile(file);
+  req.setReceiver(kj::heap<util::File::Receiver>(
+      util::File::LazyChunkReceiver([path, overwrite, exist_ok]() {
+        return util::File::Write(path, overwrite, exist_ok);
+      })));
+  return req.send().ignoreResult();
+}
+
 void File::getContentsToFile(const std::string& path, bool overwrite,
                              bool exist_ok) {
   auto pf = kj::newPromiseAndFulfiller<void>();
@@ -122,13 +204,31 @@ void File::getContentsToFile(const std::string& path, bool overwrite,
       forked_promise.addBranch().then([this, path, exist_ok, overwrite,
                                        fulfiller = std::move(pf.fulfiller)](
                                           auto file) mutable {
-        auto req = frontend_.frontend_context_.getFileContentsRequest();
-        req.setFile(file);
-        req.setReceiver(kj::heap<util::File::Receiver>(
-            util::File::LazyChunkReceiver([path, overwrite, exist_ok]() {
-              return util::File::Write(path, overwrite, exist_ok);
-            })));
-        kj::Promise<void> ret = req.send().ignoreResult().then([this, path]() {
+        kj::Promise<void> ret = nullptr;
+        if (frontend_.local_store_.empty()) {
+          ret = ReceiveToFile(file, path, overwrite, exist_ok);
+        } else {
+          // The file is copied out of the store of the server, unless it is
+          // not a file of its own there.
+          auto req = frontend_.frontend_context_.getLocalPathRequest();
+          req.setFile(file);
+          ret = req.send().then([this, file, path, overwrite,
+                                 exist_ok](auto res) -> kj::Promise<void> {
+            std::string stored(res.getPath());
+            if (!stored.empty()) {
+              KJ_IF_MAYBE(exc, kj::runCatchingExceptions([&]() {
+                            util::File::Clone(stored, path, overwrite,
+                                              exist_ok);
+                          })) {
+                KJ_LOG(WARNING, "Failed to copy from the store", *exc);
+              } else {
+                return kj::READY_NOW;
+              }
+            }
+            return ReceiveToFile(file, path, overwrite, exist_ok);
+          });
+        }
+        ret = ret.then([this, path]() {
           if (is_executable_) {
             util::File::MakeExecutable(path);
           }
@@ -139,8 +239,10 @@ void File::getContentsToFile(const std::string& path, bool overwrite,
       "Get file");
 }
 
-Frontend::Frontend(const std::string& server, int port)
+Frontend::Frontend(const std::string& server, int port,
+                   const std::string& hash_cache, const std::string& session)
     : client_(server, port),
+      hash_cache_(hash_cache),
       frontend_context_(
           client_.getMain<capnproto::MainServer>()
               .registerFrontendRequest()
@@ -152,295 +254,538 @@ Frontend::Frontend(const std::string& server, int port)
                       return std::move(exc);
                     })
               .wait(client_.getWaitScope())),
+      session_(session),
       finish_builder_(false),
-      stop_request_(kj::READY_NOW) {}
+      stop_request_(kj::READY_NOW) {
+  // Servers that do not know about the local store use RPC for everything.
+  frontend_context_.getLocalStoreRequest()
+      .send()
+      .then(
+          [this](auto res) {
+            local_token_ = ReadLocalToken(std::string(res.getTokenFile()));
+            if (local_token_.empty()) return;
+            local_store_ = std::string(res.getStoreDirectory());
+          },
+          [](kj::Exception /*exc*/) {})
+      .wait(client_.getWaitScope());
+}
+
+void Frontend::ProvideLocalFiles() {
+  std::vector<std::pair<util::SHA256_t, std::string>> local_files;
+  for (const auto& file : known_files_) {
+    const std::string* path = file.second.Path();
+    if (path == nullptr || file.first.hasContents()) continue;
+    // The server does not run in the directory of the frontend.
+    std::string absolute = AbsolutePath(*path);
+    if (!absolute.empty()) local_files.emplace_back(file.first, absolute);
+  }
+  if (local_files.empty()) return;
+  auto req = frontend_context_.provideLocalFilesRequest();
+  req.setToken(local_token_);
+  auto files = req.initFiles(local_files.size());
+  for (size_t i = 0; i < local_files.size(); i++) {
+    local_files[i].first.ToCapnp(files[i].initHash());
+    files[i].setPath(local_files[i].second);
+  }
+  // The files the server does not take are sent through RPC as usual.
+  builder_.AddPromise(
+      req.send().then([](auto /*res*/) {},
+                      [](kj::Exception exc) {
+                        KJ_LOG(WARNING, "Failed to provide local files", exc);
+                      }),
+      "Provide local files");
+}
 
 File* Frontend::provideFile(const std::string& path,
                             const std::string& description,
                             bool is_executable) {
-  auto req = frontend_context_.provideFileRequest();
-  util::SHA256_t hash = util::File::Hash(path);
+  return provideHashedFile(path, hash_cache_.Hash(path), description,
+                           is_executable);
+}
+
+std::vector<File*> Frontend::provideFiles(
+    const std::vector<std::string>& paths,
+    const std::vector<std::string>& descriptions, bool is_executable) {
+  KJ_REQUIRE(paths.size() == descriptions.size());
+  std::vector<util::SHA256_t> hashes = hash_cache_.Hash(paths);
+  std::vector<File*> files;
+  for (size_t i = 0; i < paths.size(); i++) {
+    files.push_back(provideHashedFile(paths[i], hashes[i], descriptions[i],
+                                      is_executable));
+  }
+  return files;
+}
+
+File* Frontend::provideHashedFile(const std::string& path,
+                                  const util::SHA256_t& hash,
+                                  const std::string& description,
+                                  bool is_executable) {
   known_files_.emplace(hash, util::FileWrapper::FromPath(path));
-  hash.ToCapnp(req.initHash());
-  req.setDescription(description);
-  req.setIsExecutable(is_executable);
-  files_.push_back(File::New(req.send(), this, is_executable));
-  return files_.back().get();
+  detail::FileSpec spec;
+  spec.kind = capnproto::DagFile::PROVIDED;
+  spec.is_executable = is_executable;
+  spec.hash = hash;
+  spec.description = description;
+  return AddFile(std::move(spec));
 }
 
 File* Frontend::provideFileContent(const std::string& content,
                                    const std::string& description,
                                    bool is_executable) {
-  auto req = frontend_context_.provideFileRequest();
   util::SHA256 hasher;
   // NOLINTNEXTLINE
   hasher.update(reinterpret_cast<const unsigned char*>(&content[0]),
                 content.size());
   util::SHA256_t hash = hasher.finalize();
-  known_files_.emplace(hash, util::FileWrapper::FromContent(content));
-  hash.ToCapnp(req.initHash());
-  req.setDescription(description);
-  req.setIsExecutable(is_executable);
-  files_.push_back(File::New(req.send(), this, is_executable));
+  if (content.size() < util::kInlineChunkThresh) {
+    // As in File::Hash, the server gets the contents from the hash itself.
+    hash.setContents(
+        reinterpret_cast<const uint8_t*>(content.data()),  // NOLINT
+        content.size());
+  } else if (known_files_.count(hash) == 0) {
+    known_files_.emplace(
+        hash, util::FileWrapper::FromPath(SpillContent(hash, content)));
+  }
+  detail::FileSpec spec;
+  spec.kind = capnproto::DagFile::PROVIDED;
+  spec.is_executable = is_executable;
+  spec.hash = hash;
+  spec.description = description;
+  return AddFile(std::move(spec));
+}
+
+std::string Frontend::SpillContent(const util::SHA256_t& hash,
+                                   const std::string& content) {
+  if (!spill_dir_) {
+    const char* tmp = getenv("TMPDIR");  // NOLINT
+    spill_dir_ = std::make_unique<util::TempDir>(tmp != nullptr ? tmp : "/tmp");
+  }
+  std::string path = util::File::JoinPath(spill_dir_->Path(), hash.Hex());
+  auto receiver = util::File::Write(path, /*overwrite=*/true);
+  receiver({reinterpret_cast<const kj::byte*>(content.data()),  // NOLINT
+            content.size()});
+  receiver({});
+  return path;
+}
+
+File* Frontend::AddFile(detail::FileSpec spec) {
+  files_.push_back(std::unique_ptr<File>(
+      new File(this, files_.size() + 1, spec.is_executable)));
+  file_specs_.push_back(std::move(spec));
   return files_.back().get();
 }
 
+Execution* Frontend::AddExecution(
+    const std::string& description, uint32_t group,
+    std::vector<std::unique_ptr<Execution>>* owner) {
+  owner->push_back(std::make_unique<Execution>(
+      description, dag_executions_.size(), group, this));
+  dag_executions_.push_back(owner->back().get());
+  return dag_executions_.back();
+}
+
 Execution* Frontend::addExecution(const std::string& description) {
-  auto req = frontend_context_.addExecutionRequest();
-  req.setDescription(description);
-  executions_.push_back(std::make_unique<Execution>(
-      description, req.send().then([](auto r) { return r.getExecution(); }),
-      &files_, &builder_, &finish_builder_, this));
-  return executions_.back().get();
+  return AddExecution(description, 0, &executions_);
 }
 
-ExecutionGroup* Frontend::addExecutionGroup(const std::string& description) {
-  auto req = frontend_context_.addExecutionGroupRequest();
-  req.setDescription(description);
+ExecutionGroup* Frontend::addExecutionGroup(const std::string& description,
+                                            bool batch) {
   groups_.push_back(std::make_unique<ExecutionGroup>(
-      description, req.send().then([](auto r) { return r.getGroup(); }),
-      &files_, &builder_, &finish_builder_, this));
+      description, groups_.size(), batch, this));
   return groups_.back().get();
 }
 
 void Frontend::evaluate() {
-  finish_builder_.AddPromise(std::move(builder_).Finalize().then([this]() {
-    auto req = frontend_context_.startEvaluationRequest();
-    req.setSender(kj::heap<FileProvider>(std::move(known_files_)));
-    return req.send().ignoreResult();
-  }),
-                             "Evaluate");
+  startEvaluation();
   // We don't want the frontend to die if the server closes the connection
   // unexpectedly.
   // TODO: make this no longer necessary. Currently here to avoid death on
   // ctrl-C.
   try {
-    std::move(finish_builder_).Finalize().wait(client_.getWaitScope());
+    evaluation_.wait(client_.getWaitScope());
     stop_request_.wait(client_.getWaitScope());
   } catch (...) {
   };
 }
 
+bool Frontend::poll(bool defer_callbacks) {
+  defer_callbacks_ = defer_callbacks;
+  client_.getWaitScope().poll();
+  defer_callbacks_ = false;
+  return done_;
+}
+
+size_t Frontend::runCallbacks() {
+  std::vector<std::function<void()>> callbacks;
+  std::swap(callbacks, pending_callbacks_);
+  for (const auto& callback : callbacks) callback();
+  return callbacks.size();
+}
+
+void Frontend::Deliver(std::function<void()> callback) {
+  if (defer_callbacks_) {
+    pending_callbacks_.push_back(std::move(callback));
+  } else {
+    callback();
+  }
+}
+
+void Frontend::startEvaluation() {
+  // All the files are provided by now.
+  KJ_IF_MAYBE(exc,
+              kj::runCatchingExceptions([this]() { hash_cache_.Save(); })) {
+    KJ_LOG(WARNING, "Failed to save the hash cache", *exc);
+  }
+  if (!local_store_.empty()) ProvideLocalFiles();
+  // The results of all the executions come through a single subscription,
+  // that the server gets before the DAG.
+  auto subscribe = frontend_context_.subscribeRequest();
+  subscribe.setReceiver(kj::heap<EventReceiver>(
+      [this](capnp::List<capnproto::ExecutionEvent>::Reader events) {
+        for (auto event : events) {
+          KJ_REQUIRE(event.getExecution() < dag_executions_.size(),
+                     "Invalid execution in event", event.getExecution());
+          dag_executions_[event.getExecution()]->OnEvent(event);
+        }
+      }));
+  builder_.AddPromise(subscribe.send().ignoreResult(), "Subscribe");
+  auto message = kj::heap<capnp::MallocMessageBuilder>();
+  auto dag = message->initRoot<capnproto::Dag>();
+  auto files = dag.initFiles(file_specs_.size());
+  for (size_t i = 0; i < file_specs_.size(); i++) {
+    const detail::FileSpec& spec = file_specs_[i];
+    files[i].setIsExecutable(spec.is_executable);
+    switch (spec.kind) {
+      case capnproto::DagFile::PROVIDED:
+        spec.hash.ToCapnp(files[i].initProvided().initHash());
+        files[i].getProvided().setDescription(spec.description);
+        break;
+      case capnproto::DagFile::STDOUT:
+        files[i].setStdout(spec.execution);
+        break;
+      case capnproto::DagFile::STDERR:
+        files[i].setStderr(spec.execution);
+        break;
+      case capnproto::DagFile::OUTPUT:
+        files[i].initOutput().setExecution(spec.execution);
+        files[i].getOutput().setName(spec.name);
+        break;
+    }
+  }
+  auto groups = dag.initGroups(groups_.size());
+  for (size_t i = 0; i < groups_.size(); i++) {
+    groups_[i]->ToCapnp(groups[i]);
+  }
+  auto executions = dag.initExecutions(dag_executions_.size());
+  for (size_t i = 0; i < dag_executions_.size(); i++) {
+    dag_executions_[i]->ToCapnp(executions[i]);
+  }
+  // The files and the executions resolve when the server has built the DAG.
+  builder_.AddPromise(
+      SubmitDag(std::move(message)).then(
+          [this](capnp::Response<capnproto::DagResults> res)
+              -> kj::Promise<void> {
+            // The response keeps the executions alive on the server.
+            dag_results_ = kj::heap(std::move(res));
+            auto files = dag_results_->getFiles();
+            for (size_t i = 0; i < files_.size(); i++) {
+              files_[i]->promise.fulfiller->fulfill(files[i]);
+            }
+            return kj::READY_NOW;
+          },
+          [this](kj::Exception exc) -> kj::Promise<void> {
+            for (auto& file : files_) {
+              file->promise.fulfiller->reject(kj::cp(exc));
+            }
+            return std::move(exc);
+          }),
+      "Submit DAG");
+  finish_builder_.AddPromise(std::move(builder_).Finalize().then([this]() {
+    auto req = frontend_context_.startEvaluationRequest();
+    req.setSender(kj::heap<FileProvider>(std::move(known_files_)));
+    return req.send().ignoreResult();
+  }),
+                             "Evaluate");
+  // The server sends all the events before the end of the evaluation: the
+  // executions that are left did not run.
+  evaluation_ = std::move(finish_builder_)
+                    .Finalize()
+                    .then(
+                        [this]() {
+                          done_ = true;
+                          for (auto ex : dag_executions_) ex->Errored();
+                        },
+                        [this](kj::Exception exc) {
+                          done_ = true;
+                          KJ_LOG(INFO, "Evaluation failed", exc);
+                          for (auto ex : dag_executions_) ex->Errored();
+                        })
+                    .eagerlyEvaluate(nullptr);
+}
+
+kj::Promise<capnp::Response<capnproto::DagResults>> Frontend::SubmitDag(
+    kj::Own<capnp::MallocMessageBuilder> message) {
+  using Response = capnp::Response<capnproto::DagResults>;
+  auto dag = message->getRoot<capnproto::Dag>().asReader();
+  if (session_.empty()) {
+    auto req = frontend_context_.submitDagRequest();
+    req.setDag(dag);
+    return req.send();
+  }
+  auto full = [this, dag]() -> kj::Promise<Response> {
+    auto req = frontend_context_.submitSessionDagRequest();
+    req.setSession(session_);
+    req.setDag(dag);
+    return req.send();
+  };
+  kj::Promise<Response> sent = nullptr;
+  kj::Array<capnp::word> previous = ReadSession(session_);
+  KJ_IF_MAYBE(exc, kj::runCatchingExceptions([&]() {
+                if (previous.size() == 0) {
+                  sent = full();
+                  return;
+                }
+                capnp::FlatArrayMessageReader reader(previous);
+                auto kept = reader.getRoot<capnproto::DagSession>();
+                auto base = kept.getDag();
+                auto req = frontend_context_.submitDagPatchRequest();
+                req.setSession(session_);
+                auto patch = req.initPatch();
+                patch.setBase(kept.getRevision());
+                patch.setNumFiles(dag.getFiles().size());
+                patch.setNumGroups(dag.getGroups().size());
+                patch.setNumExecutions(dag.getExecutions().size());
+                DiffEntries<capnproto::DagFile>(
+                    dag.getFiles(), base.getFiles(),
+                    [&patch](size_t n) { return patch.initFiles(n); });
+                DiffEntries<capnproto::DagGroup>(
+                    dag.getGroups(), base.getGroups(),
+                    [&patch](size_t n) { return patch.initGroups(n); });
+                DiffEntries<capnproto::DagExecution>(
+                    dag.getExecutions(), base.getExecutions(),
+                    [&patch](size_t n) { return patch.initExecutions(n); });
+                // The server may not have the DAG of the session anymore.
+                sent = req.send().then(
+                    [](Response res) -> kj::Promise<Response> {
+                      return std::move(res);
+                    },
+                    [full](kj::Exception /*exc*/) { return full(); });
+              })) {
+    KJ_LOG(WARNING, "Invalid session file", session_, *exc);
+    sent = full();
+  }
+  return sent.then([this, message = std::move(message)](Response res) mutable {
+    KJ_IF_MAYBE(exc, kj::runCatchingExceptions([&]() {
+                  capnp::MallocMessageBuilder kept;
+                  auto session = kept.initRoot<capnproto::DagSession>();
+                  session.setRevision(res.getRevision());
+                  session.setDag(message->getRoot<capnproto::Dag>());
+                  auto words = capnp::messageToFlatArray(kept);
+                  auto receiver =
+                      util::File::Write(session_, /*overwrite=*/true);
+                  receiver(words.asBytes());
+                  receiver({});
+                })) {
+      KJ_LOG(WARNING, "Failed to save the session", session_, *exc);
+    }
+    return std::move(res);
+  });
+}
+
 void Frontend::stopEvaluation() {
   stop_request_ =
       frontend_context_.stopEvaluationRequest().send().ignoreResult();
 }
 
+void Frontend::setWeight(float weight) {
+  auto req = frontend_context_.setWeightRequest();
+  req.setWeight(weight);
+  builder_.AddPromise(req.send().ignoreResult());
+}
+
 Execution* ExecutionGroup::addExecution(const std::string& description) {
-  auto req = execution_group_.addExecutionRequest();
-  req.setDescription(description);
-  executions_.push_back(std::make_unique<Execution>(
-      description_ + " of group " + description,
-      req.send().then([](auto r) { return r.getExecution(); }), &files_,
-      &builder_, &finish_builder_, &frontend_));
-  return executions_.back().get();
-}
-
-Fifo* ExecutionGroup::createFifo() {
-  auto req = execution_group_.createFifoRequest();
-  fifos_.push_back(Fifo::New(req.send()));
+  return frontend_.AddExecution(description, index_ + 1, &executions_);
+}
+
+Fifo* ExecutionGroup::createFifo(bool shared, bool stream) {
+  fifos_.push_back(
+      std::unique_ptr<Fifo>(new Fifo(fifos_.size() + 1, shared, stream)));
   return fifos_.back().get();
 }
 
+void ExecutionGroup::ToCapnp(capnproto::DagGroup::Builder builder) const {
+  builder.setDescription(description_);
+  builder.setBatch(batch_);
+  auto fifos = builder.initFifos(fifos_.size());
+  for (size_t i = 0; i < fifos_.size(); i++) {
+    fifos[i].setShared(fifos_[i]->shared_);
+    fifos[i].setStream(fifos_[i]->stream_);
+  }
+}
+
 void Execution::setExecutablePath(const std::string& path) {
-  auto req = execution_.setExecutablePathRequest();
-  req.setPath(path);
-  my_builder_.AddPromise(req.send().ignoreResult());
+  executable_path_ = path;
+  executable_name_.clear();
+  executable_ = 0;
 }
 
 void Execution::setExecutable(const std::string& name, File* file) {
-  my_builder_.AddPromise(
-      file->forked_promise.addBranch().then([this, name](auto file) {
-        auto req = execution_.setExecutableRequest();
-        req.setName(name);
-        req.setFile(file);
-        builder_.AddPromise(req.send().ignoreResult());
-      }));
+  executable_path_.clear();
+  executable_name_ = name;
+  executable_ = file->index_;
 }
 
-void Execution::setStdin(File* file) {
-  my_builder_.AddPromise(
-      file->forked_promise.addBranch().then([this](auto file) {
-        auto req = execution_.setStdinRequest();
-        req.setFile(file);
-        builder_.AddPromise(req.send().ignoreResult());
-      }));
-}
+void Execution::setStdin(File* file) { stdin_ = file->index_; }
 
 void Execution::addInput(const std::string& name, File* file) {
-  my_builder_.AddPromise(
-      file->forked_promise.addBranch().then([this, name](auto file) {
-        auto req = execution_.addInputRequest();
-        req.setName(name);
-        req.setFile(file);
-        builder_.AddPromise(req.send().ignoreResult());
-      }));
+  inputs_.emplace_back(name, file->index_);
 }
 
 void Execution::addFifo(const std::string& name, Fifo* fifo) {
-  my_builder_.AddPromise(
-      fifo->forked_promise.addBranch().then([this, name](auto fifo) {
-        auto req = execution_.addFifoRequest();
-        req.setName(name);
-        req.setFifo(fifo);
-        builder_.AddPromise(req.send().ignoreResult());
-      }));
-}
-void Execution::setStdinFifo(Fifo* fifo) {
-  my_builder_.AddPromise(
-      fifo->forked_promise.addBranch().then([this](auto fifo) {
-        auto req = execution_.setStdinFifoRequest();
-        req.setFifo(fifo);
-        builder_.AddPromise(req.send().ignoreResult());
-      }));
-}
-void Execution::setStdoutFifo(Fifo* fifo) {
-  my_builder_.AddPromise(
-      fifo->forked_promise.addBranch().then([this](auto fifo) {
-        auto req = execution_.setStdoutFifoRequest();
-        req.setFifo(fifo);
-        builder_.AddPromise(req.send().ignoreResult());
-      }));
-}
-void Execution::setStderrFifo(Fifo* fifo) {
-  my_builder_.AddPromise(
-      fifo->forked_promise.addBranch().then([this](auto fifo) {
-        auto req = execution_.setStderrFifoRequest();
-        req.setFifo(fifo);
-        builder_.AddPromise(req.send().ignoreResult());
-      }));
+  fifos_.emplace_back(name, fifo->index_);
 }
+void Execution::setStdinFifo(Fifo* fifo) { stdin_fifo_ = fifo->index_; }
+void Execution::setStdoutFifo(Fifo* fifo) { stdout_fifo_ = fifo->index_; }
+void Execution::setStderrFifo(Fifo* fifo) { stderr_fifo_ = fifo->index_; }
 
 void Execution::setArgs(const std::vector<std::string>& args) {
-  auto req = execution_.setArgsRequest();
-  req.initArgs(args.size());
-  for (size_t i = 0; i < args.size(); i++) {
-    req.getArgs().set(i, args[i]);
-  }
-  my_builder_.AddPromise(req.send().ignoreResult());
+  args_ = args;
 }
 
-void Execution::disableCache() {
-  my_builder_.AddPromise(
-      execution_.disableCacheRequest().send().ignoreResult());
-}
+void Execution::disableCache() { disable_cache_ = true; }
 
-void Execution::makeExclusive() {
-  my_builder_.AddPromise(
-      execution_.makeExclusiveRequest().send().ignoreResult());
-}
+void Execution::makeExclusive() { exclusive_ = true; }
 
 void Execution::setLimits(const Resources& limits) {
-  auto req = execution_.setLimitsRequest();
-  req.getLimits().setCpuTime(limits.cpu_time);
-  req.getLimits().setWallTime(limits.wall_time);
-  req.getLimits().setMemory(limits.memory);
-  req.getLimits().setNproc(limits.nproc);
-  req.getLimits().setNofiles(limits.nofiles);
-  req.getLimits().setFsize(limits.fsize);
-  req.getLimits().setMemlock(limits.memlock);
-  req.getLimits().setStack(limits.stack);
-  my_builder_.AddPromise(req.send().ignoreResult());
+  has_limits_ = true;
+  limits_ = limits;
 }
 
-void Execution::setExtraTime(float extra_time) {
-  auto req = execution_.setExtraTimeRequest();
-  req.setExtraTime(extra_time);
-  my_builder_.AddPromise(req.send().ignoreResult());
+void Execution::setExtraTime(float extra_time) { extra_time_ = extra_time; }
+
+void Execution::setPriority(int32_t priority) {
+  priority_ = priority;
 }
 
+void Execution::setTimed() { timed_ = true; }
+
+void Execution::setStopGroup(uint32_t stop_group) { stop_group_ = stop_group; }
+
 File* Execution::getStdout(bool is_executable) {
-  auto req = execution_.getStdoutRequest();
-  req.setIsExecutable(is_executable);
-  files_.push_back(File::New(req.send(), &frontend_, is_executable));
-  return files_.back().get();
+  detail::FileSpec spec;
+  spec.kind = capnproto::DagFile::STDOUT;
+  spec.is_executable = is_executable;
+  spec.execution = index_;
+  return frontend_.AddFile(std::move(spec));
 }
 
 File* Execution::getStderr(bool is_executable) {
-  auto req = execution_.getStderrRequest();
-  req.setIsExecutable(is_executable);
-  files_.push_back(File::New(req.send(), &frontend_, is_executable));
-  return files_.back().get();
+  detail::FileSpec spec;
+  spec.kind = capnproto::DagFile::STDERR;
+  spec.is_executable = is_executable;
+  spec.execution = index_;
+  return frontend_.AddFile(std::move(spec));
 }
 File* Execution::getOutput(const std::string& name, bool is_executable) {
-  auto req = execution_.getOutputRequest();
-  req.setIsExecutable(is_executable);
-  req.setName(name);
-  files_.push_back(File::New(req.send(), &frontend_, is_executable));
-  return files_.back().get();
+  detail::FileSpec spec;
+  spec.kind = capnproto::DagFile::OUTPUT;
+  spec.is_executable = is_executable;
+  spec.execution = index_;
+  spec.name = name;
+  return frontend_.AddFile(std::move(spec));
+}
+
+void Execution::ToCapnp(capnproto::DagExecution::Builder builder) const {
+  builder.setDescription(description_);
+  builder.setGroup(group_);
+  if (executable_) {
+    auto file = builder.getExecutable().initFile();
+    file.setName(executable_name_);
+    file.setId(executable_);
+  } else if (!executable_path_.empty()) {
+    builder.getExecutable().setPath(executable_path_);
+  }
+  builder.setStdin(stdin_);
+  builder.setStdinFifo(stdin_fifo_);
+  builder.setStdoutFifo(stdout_fifo_);
+  builder.setStderrFifo(stderr_fifo_);
+  auto inputs = builder.initInputs(inputs_.size());
+  for (size_t i = 0; i < inputs_.size(); i++) {
+    inputs[i].setName(inputs_[i].first);
+    inputs[i].setId(inputs_[i].second);
+  }
+  auto fifos = builder.initFifos(fifos_.size());
+  for (size_t i = 0; i < fifos_.size(); i++) {
+    fifos[i].setName(fifos_[i].first);
+    fifos[i].setId(fifos_[i].second);
+  }
+  auto args = builder.initArgs(args_.size());
+  for (size_t i = 0; i < args_.size(); i++) {
+    args.set(i, args_[i]);
+  }
+  if (has_limits_) {
+    auto limits = builder.initLimits();
+    limits.setCpuTime(limits_.cpu_time);
+    limits.setWallTime(limits_.wall_time);
+    limits.setMemory(limits_.memory);
+    limits.setNproc(limits_.nproc);
+    limits.setNofiles(limits_.nofiles);
+    limits.setFsize(limits_.fsize);
+    limits.setMemlock(limits_.memlock);
+    limits.setStack(limits_.stack);
+    limits.setInstructions(limits_.instructions);
+  }
+  builder.setExtraTime(extra_time_);
+  builder.setPriority(priority_);
+  builder.setExclusive(exclusive_);
+  builder.setDisableCache(disable_cache_);
+  builder.setTimed(timed_);
+  builder.setStopGroup(stop_group_);
+  builder.setSubscribed(subscribed_);
+  builder.setNotifyStart(subscribed_ && start_callback_ != nullptr);
 }
 
 void Execution::notifyStart(const std::function<void()>& callback) {
-  finish_builder_.AddPromise(
-      execution_.notifyStartRequest()
-          .send()
-          .ignoreResult()
-          .then([callback]() { callback(); }, [](auto exc) {})
-          .eagerlyEvaluate(nullptr),
-      "Notify start " + description_);
+  start_callback_ = callback;
 }
 
 void Execution::getResult(const std::function<void(Result)>& callback,
                           const std::function<void()>& errored) {
-  auto promise = kj::newPromiseAndFulfiller<void>();
-  builder_.AddPromise(std::move(promise.promise));
-  auto ff = promise.fulfiller.get();
-  finish_builder_.AddPromise(
-      std::move(my_builder_)
-          .Finalize()
-          .then(
-              [this, callback, errored,
-               fulfiller = std::move(promise.fulfiller)]() mutable {
-                fulfiller->fulfill();
-                return execution_.getResultRequest()
-                    .send()
-                    .then(
-                        [callback](auto res) {
-                          auto r = res.getResult();
-                          Result result;
-                          result.status = r.getStatus().which();
-                          if (r.getStatus().isSignal()) {
-                            result.signal = r.getStatus().getSignal();
-                          }
-                          if (r.getStatus().isReturnCode()) {
-                            result.return_code = r.getStatus().getReturnCode();
-                          }
-                          if (r.getStatus().isInternalError()) {
-                            result.error = r.getStatus().getInternalError();
-                          }
-                          if (r.getStatus().isInvalidRequest()) {
-                            result.error = r.getStatus().getInvalidRequest();
-                          }
-                          result.resources.cpu_time =
-                              r.getResourceUsage().getCpuTime();
-                          result.resources.sys_time =
-                              r.getResourceUsage().getSysTime();
-                          result.resources.wall_time =
-                              r.getResourceUsage().getWallTime();
-                          result.resources.memory =
-                              r.getResourceUsage().getMemory();
-                          result.resources.nproc =
-                              r.getResourceUsage().getNproc();
-                          result.resources.nofiles =
-                              r.getResourceUsage().getNofiles();
-                          result.resources.fsize =
-                              r.getResourceUsage().getFsize();
-                          result.resources.memlock =
-                              r.getResourceUsage().getMemlock();
-                          result.resources.stack =
-                              r.getResourceUsage().getStack();
-                          result.was_cached = r.getWasCached();
-                          result.was_killed = r.getWasKilled();
-                          callback(result);
-                        },
-                        [errored](auto exc) {
-                          if (errored) errored();
-                        })
-                    .eagerlyEvaluate(nullptr);
-              },
-              [fulfiller = ff](kj::Exception exc) {
-                fulfiller->reject(std::move(exc));
-              }),
-      "Get result " + description_);
+  subscribed_ = true;
+  result_callback_ = callback;
+  errored_callback_ = errored;
+}
+
+void Execution::OnEvent(capnproto::ExecutionEvent::Reader event) {
+  switch (event.which()) {
+    case capnproto::ExecutionEvent::STARTED:
+      Started();
+      break;
+    case capnproto::ExecutionEvent::RESULT: {
+      // A result from the cache may come before the start.
+      Started();
+      finished_ = true;
+      Result result = ToResult(event.getResult());
+      auto callback = result_callback_;
+      frontend_.Deliver([callback, result]() { callback(result); });
+      break;
+    }
+    case capnproto::ExecutionEvent::FAILED:
+      KJ_LOG(INFO, "Execution " + description_, event.getFailed());
+      Errored();
+      break;
+  }
+}
+
+void Execution::Started() {
+  if (started_ || !start_callback_) return;
+  started_ = true;
+  frontend_.Deliver(start_callback_);
+}
+
+void Execution::Errored() {
+  if (!subscribed_ || finished_) return;
+  finished_ = true;
+  if (errored_callback_) frontend_.Deliver(errored_callback_);
 }
 }  // namespace frontend
@@ -3,12 +3,15 @@
 #include <capnp/ez-rpc.h>
 #include <kj/async.h>
 #include <functional>
+#include <memory>
 #include <string>
 #include <unordered_map>
+#include <utility>
 #include <vector>
 
 #include "capnp/server.capnp.h"
 #include "util/file.hpp"
+#include "util/hash_cache.hpp"
 #include "util/sha256.hpp"
 #include "util/union_promise.hpp"
 
@@ -26,6 +29,7 @@ struct Resources {
   uint64_t fsize;
   uint64_t memlock;
   uint64_t stack;
+  uint64_t instructions;
 };
 
 // Result of an execution.
@@ -41,55 +45,68 @@ struct Result {
 
 class Frontend;
 
-// Represents a Fifo to be passed to an Execution.
+namespace detail {
+// A file of the DAG, as sent to the server by Frontend::evaluate.
+struct FileSpec {
+  capnproto::DagFile::Which kind = capnproto::DagFile::PROVIDED;
+  bool is_executable = false;
+  // Provided files.
+  util::SHA256_t hash = util::SHA256_t::ZERO;
+  std::string description;
+  // Outputs of the execution with this index.
+  uint32_t execution = 0;
+  std::string name;
+};
+}  // namespace detail
+
+// Represents a Fifo to be passed to an Execution of the same group.
 class Fifo {
   friend class Execution;
   friend class ExecutionGroup;
-  kj::Promise<capnproto::Fifo::Reader> promise;
-  kj::ForkedPromise<capnproto::Fifo::Reader> forked_promise;
+  // Index of the FIFO in its group, plus one.
+  uint32_t index_;
+  bool shared_;
+  bool stream_;
 
  protected:
-  void SetPromise(kj::Promise<capnproto::Fifo::Reader>&& prom) {
-    promise = std::move(prom);
-    forked_promise = promise.fork();
-  }
+  Fifo(uint32_t index, bool shared, bool stream)
+      : index_(index), shared_(shared), stream_(stream) {}
 
  public:
-  Fifo() : promise(capnproto::Fifo::Reader()), forked_promise(promise.fork()) {}
   virtual ~Fifo() = default;
   Fifo(const Fifo&) = delete;
-  Fifo(Fifo&&) = default;
+  Fifo(Fifo&&) = delete;
   Fifo& operator=(const Fifo&) = delete;
-  Fifo& operator=(Fifo&&) = default;
-  template <typename T>
-  static std::unique_ptr<Fifo> New(kj::Promise<T>&& p);
+  Fifo& operator=(Fifo&&) = delete;
 };
 
-// Represents a file to be passed to an Execution.
+// Represents a file to be passed to an Execution. Its promise resolves once
+// the DAG is submitted.
 class File {
   friend class Frontend;
   friend class Execution;
-  kj::Promise<capnproto::File::Reader> promise;
+  kj::PromiseFulfillerPair<capnproto::File::Reader> promise;
   kj::ForkedPromise<capnproto::File::Reader> forked_promise;
+  // Index of the file in the DAG, plus one.
+  uint32_t index_;
   bool is_executable_;
 
  protected:
   Frontend& frontend_;
 
-  void SetPromise(kj::Promise<capnproto::File::Reader>&& prom) {
-    promise = std::move(prom);
-    forked_promise = promise.fork();
-  }
-  File(Frontend* frontend, bool is_executable)
-      : promise(capnproto::File::Reader()),
-        forked_promise(promise.fork()),
+  // Writes the contents of file to path, receiving them from the server.
+  kj::Promise<void> ReceiveToFile(capnproto::File::Reader file,
+                                  const std::string& path, bool overwrite,
+                                  bool exist_ok);
+
+  File(Frontend* frontend, uint32_t index, bool is_executable)
+      : promise(kj::newPromiseAndFulfiller<capnproto::File::Reader>()),
+        forked_promise(promise.promise.fork()),
+        index_(index),
         is_executable_(is_executable),
         frontend_(*frontend) {}
 
  public:
-  template <typename T>
-  static std::unique_ptr<File> New(kj::Promise<T>&& p, Frontend* frontend,
-                                   bool is_executable);
   virtual ~File() = default;
   File(const File&) = delete;
   File(File&&) = delete;
@@ -97,31 +114,38 @@ class File {
   File& operator=(File&&) = delete;
 
   // Call the provided callback with the contents of the file as soon as they
-  // are available.
+  // are available. At most limit bytes are read, starting at offset, or at
+  // offset bytes before the end of the file if from_end is set.
   void getContentsAsString(
       const std::function<void(const std::string&)>& callback,
-      uint64_t limit = 0xffffffffffffffff);
+      uint64_t limit = 0xffffffffffffffff, uint64_t offset = 0,
+      bool from_end = false);
+
+  // Same as getContentsAsString, but the callback is called with each chunk
+  // of the contents as soon as it arrives, and with an empty chunk at the
+  // end. The chunks are only valid during the call.
+  void getContentsChunks(const std::function<void(util::File::Chunk)>& callback,
+                         uint64_t limit = 0xffffffffffffffff,
+                         uint64_t offset = 0, bool from_end = false);
 
   // Write the file to path when it is available.
   void getContentsToFile(const std::string& path, bool overwrite,
                          bool exist_ok);
 };
 
-// Class representing a specific execution. Methods are proxies to the ones in
-// the respective capnproto interface. No method of this class should be called
-// after calling getResult. getResult should be called at least once, otherwise
-// the execution will not run.
+// Class representing a specific execution. Its settings are sent to the
+// server with the rest of the DAG by Frontend::evaluate, so no method of this
+// class should be called after it. getResult should be called at least once,
+// otherwise the execution will not run.
 class Execution {
  public:
-  Execution(std::string description, capnproto::Execution::Client execution,
-            std::vector<std::unique_ptr<File>>* files,
-            util::UnionPromiseBuilder* builder,
-            util::UnionPromiseBuilder* finish_builder, Frontend* frontend)
+  // index is the index of the execution in the DAG, group the index of its
+  // group plus one, or 0 if it has a group of its own.
+  Execution(std::string description, uint32_t index, uint32_t group,
+            Frontend* frontend)
       : description_(std::move(description)),
-        execution_(std::move(execution)),
-        files_(*files),
-        builder_(*builder),
-        finish_builder_(*finish_builder),
+        index_(index),
+        group_(group),
         frontend_(*frontend) {}
 
   void setExecutablePath(const std::string& path);
@@ -139,6 +163,12 @@ class Execution {
   void makeExclusive();
   void setLimits(const Resources& limits);
   void setExtraTime(float extra_time);
+  void setPriority(int32_t priority);
+  void setTimed();
+  // Executions with the same non-zero stop group are skipped or stopped once
+  // one of them does not succeed, like the testcases of a subtask. All the
+  // executions of a group must be in the same stop group.
+  void setStopGroup(uint32_t stop_group);
 
   File* getStdout(bool is_executable);
   File* getStderr(bool is_executable);
@@ -150,87 +180,205 @@ class Execution {
                  const std::function<void()>& errored = nullptr);
 
  private:
+  friend class Frontend;
+
+  void ToCapnp(capnproto::DagExecution::Builder builder) const;
+
+  // Delivers an event sent by the server for this execution.
+  void OnEvent(capnproto::ExecutionEvent::Reader event);
+  // Calls the start callback, if it was not called already.
+  void Started();
+  // Calls the errored callback, if there was no result nor failure yet.
+  void Errored();
+
   std::string description_;
-  capnproto::Execution::Client execution_;
-  std::vector<std::unique_ptr<File>>& files_;
-  util::UnionPromiseBuilder& builder_;
-  util::UnionPromiseBuilder& finish_builder_;
-  util::UnionPromiseBuilder my_builder_;
+  uint32_t index_;
+  uint32_t group_;
   Frontend& frontend_;
+  std::string executable_path_;
+  std::string executable_name_;
+  uint32_t executable_ = 0;
+  uint32_t stdin_ = 0;
+  uint32_t stdin_fifo_ = 0;
+  uint32_t stdout_fifo_ = 0;
+  uint32_t stderr_fifo_ = 0;
+  std::vector<std::pair<std::string, uint32_t>> inputs_;
+  std::vector<std::pair<std::string, uint32_t>> fifos_;
+  std::vector<std::string> args_;
+  bool has_limits_ = false;
+  Resources limits_{};
+  float extra_time_ = 0;
+  int32_t priority_ = 0;
+  bool exclusive_ = false;
+  bool disable_cache_ = false;
+  bool timed_ = false;
+  uint32_t stop_group_ = 0;
+  // The results and the starts come as events, see
+  // capnproto::FrontendContext::subscribe.
+  std::function<void()> start_callback_;
+  std::function<void(Result)> result_callback_;
+  std::function<void()> errored_callback_;
+  bool subscribed_ = false;
+  bool started_ = false;
+  bool finished_ = false;
 };
 
-// Class representing a group of executions. Methods are proxies to the ones in
-// the respective capnproto interface.
+// Class representing a group of executions, that is sent to the server with
+// the rest of the DAG.
 class ExecutionGroup {
  public:
-  ExecutionGroup(std::string description,
-                 capnproto::ExecutionGroup::Client execution_group,
-                 std::vector<std::unique_ptr<File>>* files,
-                 util::UnionPromiseBuilder* builder,
-                 util::UnionPromiseBuilder* finish_builder, Frontend* frontend)
+  // index is the index of the group in the DAG.
+  ExecutionGroup(std::string description, uint32_t index, bool batch,
+                 Frontend* frontend)
       : description_(std::move(description)),
-        execution_group_(std::move(execution_group)),
-        files_(*files),
-        builder_(*builder),
-        finish_builder_(*finish_builder),
+        index_(index),
+        batch_(batch),
         frontend_(*frontend) {}
   Execution* addExecution(const std::string& description);
-  Fifo* createFifo();
+  // Shared FIFOs are channels in shared memory, that the programs open with
+  // util/channel.hpp instead of as files. Stream FIFOs go from the standard
+  // output of an execution, that is also kept as a file, to the standard
+  // input of others.
+  Fifo* createFifo(bool shared = false, bool stream = false);
 
  private:
+  friend class Frontend;
+
+  void ToCapnp(capnproto::DagGroup::Builder builder) const;
+
   std::vector<std::unique_ptr<Execution>> executions_;
   std::vector<std::unique_ptr<Fifo>> fifos_;
   std::string description_;
-  capnproto::ExecutionGroup::Client execution_group_;
-  std::vector<std::unique_ptr<File>>& files_;
-  util::UnionPromiseBuilder& builder_;
-  util::UnionPromiseBuilder& finish_builder_;
-  util::UnionPromiseBuilder my_builder_;
+  uint32_t index_;
+  bool batch_;
   Frontend& frontend_;
 };
 
 // Frontend that communicates with a specific server on a given port.
 class Frontend {
   friend class File;
+  friend class Execution;
+  friend class ExecutionGroup;
 
  public:
-  Frontend(const std::string& server, int port);
+  // The hashes of the provided files are remembered in hash_cache, if it is
+  // not empty. If session is not empty, the DAG is saved there, and the next
+  // evaluation of the same session only sends the changes of its DAG to the
+  // server.
+  Frontend(const std::string& server, int port,
+           const std::string& hash_cache = "",
+           const std::string& session = "");
 
   // Defines a file that is provided by the frontend, loading it from the given
   // path.
   File* provideFile(const std::string& path, const std::string& description,
                     bool is_executable);
 
+  // Same as provideFile for each of the paths, but the files are hashed in
+  // parallel. If some file cannot be read, none is provided.
+  std::vector<File*> provideFiles(const std::vector<std::string>& paths,
+                                  const std::vector<std::string>& descriptions,
+                                  bool is_executable);
+
   // Defines a file that is provided by the frontend, loading it from its
-  // content.
+  // content. Small contents are sent with the DAG, larger ones are written
+  // to a temporary directory instead of being kept in memory.
   File* provideFileContent(const std::string& content,
                            const std::string& description, bool is_executable);
 
   // Creates a new execution with the given description.
   Execution* addExecution(const std::string& description);
 
-  // Creates a new execution group with the given description.
-  ExecutionGroup* addExecutionGroup(const std::string& description);
+  // Creates a new execution group with the given description. The executions
+  // of a batch group are items of a single process, see util/batch.hpp.
+  ExecutionGroup* addExecutionGroup(const std::string& description,
+                                    bool batch = false);
 
-  // Starts evaluation and returns when complete. Should only be called after
-  // all the executions are defined.
+  // Sends the whole DAG to the server in a single call, starts evaluation
+  // and returns when complete. Should only be called after all the
+  // executions are defined.
   void evaluate();
 
+  // Same as evaluate, but returns once the evaluation is started. It runs
+  // while poll is called, on the same thread: for example, poll can be called
+  // periodically by an asyncio loop, that processes the results in between.
+  void startEvaluation();
+
+  // Runs the events of the evaluation that are ready, and the callbacks they
+  // trigger, without blocking. Returns true once the evaluation is done.
+  // With defer_callbacks, the callbacks of the results, of the starts and of
+  // the contents as strings are queued instead, for runCallbacks to call them
+  // together: the Python module then takes the GIL once per poll.
+  bool poll(bool defer_callbacks = false);
+
+  // Calls the callbacks queued by poll, in order, and returns their number.
+  size_t runCallbacks();
+
   // Stops the evaluation. This is best-effort: some executions may still run
   // after this method is called.
   void stopEvaluation();
 
+  // Sets the share of the workers this evaluation gets when the server runs
+  // other evaluations at the same time, relative to them.
+  void setWeight(float weight);
+
  private:
+  File* provideHashedFile(const std::string& path, const util::SHA256_t& hash,
+                          const std::string& description, bool is_executable);
+
+  // Writes content to the temporary directory of the provided contents, and
+  // returns its path.
+  std::string SpillContent(const util::SHA256_t& hash,
+                           const std::string& content);
+
+  // Gives the paths of the provided files to the server, if the frontend
+  // shares its filesystem, so that it copies them in its store instead of
+  // asking for them.
+  void ProvideLocalFiles();
+
+  // Sends the DAG in message to the server, as changes of the DAG of the
+  // session if possible, and saves it in the session.
+  kj::Promise<capnp::Response<capnproto::DagResults>> SubmitDag(
+      kj::Own<capnp::MallocMessageBuilder> message);
+
+  // Calls callback, or queues it while poll defers the callbacks.
+  void Deliver(std::function<void()> callback);
+
+  // Adds a file to the DAG.
+  File* AddFile(detail::FileSpec spec);
+  // Adds an execution to the DAG, the executions are owned by their group.
+  Execution* AddExecution(const std::string& description, uint32_t group,
+                          std::vector<std::unique_ptr<Execution>>* owner);
+
+  // The provided contents that are not inlined in their hash. It is created
+  // when first needed, and outlives the connection that reads from it. It is
+  // removed by the destructor: the process usually exits right after, before
+  // a background removal would run.
+  std::unique_ptr<util::TempDir> spill_dir_;
   capnp::EzRpcClient client_;
+  util::HashCache hash_cache_;
   capnproto::FrontendContext::Client frontend_context_;
+  // Store of the server if the frontend shares its filesystem, or empty.
+  std::string local_store_;
+  // Token read from the filesystem of the server, that proves it is shared.
+  std::string local_token_;
+  std::string session_;
   std::unordered_map<util::SHA256_t, util::FileWrapper, util::SHA256_t::Hasher>
       known_files_;
   util::UnionPromiseBuilder builder_;
   util::UnionPromiseBuilder finish_builder_;
+  // The files, executions and groups of the DAG, in order.
   std::vector<std::unique_ptr<File>> files_;
+  std::vector<detail::FileSpec> file_specs_;
   std::vector<std::unique_ptr<Execution>> executions_;
+  std::vector<Execution*> dag_executions_;
   std::vector<std::unique_ptr<ExecutionGroup>> groups_;
+  kj::Own<capnp::Response<capnproto::DagResults>> dag_results_;
   kj::Promise<void> stop_request_;
+  kj::Promise<void> evaluation_ = nullptr;
+  bool done_ = false;
+  bool defer_callbacks_ = false;
+  std::vector<std::function<void()>> pending_callbacks_;
 };
 }  // namespace frontend
 
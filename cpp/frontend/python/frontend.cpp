@@ -31,6 +31,24 @@ DestroyWithGIL<T> destroy_with_gil(T t) {
   return DestroyWithGIL<T>(t);
 }
 
+// Contents of a file, or a chunk of them, that Python reads through the
+// buffer protocol without copying them.
+struct Contents {
+  std::string data;
+};
+
+// Calls the Python callback with the GIL held.
+template <typename T, typename... Args>
+void CallPython(T* callback, Args&&... args) {
+  pybind11::gil_scoped_acquire acquire;
+  try {
+    (**callback)(std::forward<Args>(args)...);
+  } catch (pybind11::error_already_set& exc) {
+    std::cerr << __FILE__ << ":" << __LINE__ << " " << exc.what() << std::endl;
+    _Exit(1);
+  }
+}
+
 // NOLINTNEXTLINE
 PYBIND11_MODULE(task_maker_frontend, m) {
   m.doc() = "Task-maker frontend module";
@@ -44,7 +62,8 @@ PYBIND11_MODULE(task_maker_frontend, m) {
       .def_readwrite("nofiles", &frontend::Resources::nofiles)
       .def_readwrite("fsize", &frontend::Resources::fsize)
       .def_readwrite("memlock", &frontend::Resources::memlock)
-      .def_readwrite("stack", &frontend::Resources::stack);
+      .def_readwrite("stack", &frontend::Resources::stack)
+      .def_readwrite("instructions", &frontend::Resources::instructions);
 
   pybind11::enum_<capnproto::ProcessResult::Status::Which>(m, "ResultStatus")
       .value("SUCCESS", capnproto::ProcessResult::Status::Which::SUCCESS)
@@ -102,41 +121,76 @@ PYBIND11_MODULE(task_maker_frontend, m) {
         return message;
       });
 
+  pybind11::class_<Contents, std::shared_ptr<Contents>>(
+      m, "Contents", pybind11::buffer_protocol())
+      .def_buffer([](Contents& c) {
+        return pybind11::buffer_info(
+            &c.data[0], 1, pybind11::format_descriptor<char>::value, 1,
+            {static_cast<ssize_t>(c.data.size())}, {1});
+      })
+      .def("__len__", [](const Contents& c) { return c.data.size(); });
+
   pybind11::class_<frontend::File>(m, "File")
       .def("getContentsAsString",
            [](frontend::File& f, std::function<void(std::string)> cb,
-              uint64_t limit) {
+              uint64_t limit, uint64_t offset, bool from_end) {
              f.getContentsAsString(
                  [cb = destroy_with_gil(cb)](std::string s) mutable {
-                   pybind11::gil_scoped_acquire acquire;
-                   try {
-                     (*cb)(s);
-                   } catch (pybind11::error_already_set& exc) {
-                     std::cerr << __FILE__ << ":" << __LINE__ << " "
-                               << exc.what() << std::endl;
-                     _Exit(1);
-                   }
+                   CallPython(&cb, s);
                  },
-                 limit);
+                 limit, offset, from_end);
            },
-           "callback"_a, "limit"_a = 0xffffffffffffffff)
+           "callback"_a, "limit"_a = 0xffffffffffffffff, "offset"_a = 0,
+           "from_end"_a = false)
       .def("getContentsAsBytes",
            [](frontend::File& f, std::function<void(pybind11::bytes)> cb,
-              uint64_t limit) {
+              uint64_t limit, uint64_t offset, bool from_end) {
              f.getContentsAsString(
                  [cb = destroy_with_gil(cb)](std::string s) mutable {
-                   pybind11::gil_scoped_acquire acquire;
-                   try {
-                     (*cb)(s);
-                   } catch (pybind11::error_already_set& exc) {
-                     std::cerr << __FILE__ << ":" << __LINE__ << " "
-                               << exc.what() << std::endl;
-                     _Exit(1);
+                   CallPython(&cb, s);
+                 },
+                 limit, offset, from_end);
+           },
+           "callback"_a, "limit"_a = 0xffffffffffffffff, "offset"_a = 0,
+           "from_end"_a = false)
+      // The contents are given as a Contents object, so memoryview and bytes
+      // do not need a copy of a string.
+      .def("getContentsAsBuffer",
+           [](frontend::File& f,
+              std::function<void(std::shared_ptr<Contents>)> cb,
+              uint64_t limit, uint64_t offset, bool from_end) {
+             auto contents = std::make_shared<Contents>();
+             f.getContentsChunks(
+                 [cb = destroy_with_gil(cb),
+                  contents](util::File::Chunk chunk) mutable {
+                   if (chunk.size() != 0) {
+                     contents->data.append(chunk.asChars().begin(),
+                                           chunk.size());
+                     return;
                    }
+                   CallPython(&cb, contents);
                  },
-                 limit);
+                 limit, offset, from_end);
            },
-           "callback"_a, "limit"_a = 0xffffffffffffffff)
+           "callback"_a, "limit"_a = 0xffffffffffffffff, "offset"_a = 0,
+           "from_end"_a = false)
+      // The callback gets each chunk as soon as it arrives, and an empty one
+      // at the end.
+      .def("getContentsChunks",
+           [](frontend::File& f,
+              std::function<void(std::shared_ptr<Contents>)> cb,
+              uint64_t limit, uint64_t offset, bool from_end) {
+             f.getContentsChunks(
+                 [cb = destroy_with_gil(cb)](util::File::Chunk chunk) mutable {
+                   auto contents = std::make_shared<Contents>();
+                   contents->data.assign(chunk.asChars().begin(),
+                                         chunk.size());
+                   CallPython(&cb, contents);
+                 },
+                 limit, offset, from_end);
+           },
+           "callback"_a, "limit"_a = 0xffffffffffffffff, "offset"_a = 0,
+           "from_end"_a = false)
       .def("getContentsToFile", &frontend::File::getContentsToFile, "path"_a,
            "overwrite"_a = true, "exist_ok"_a = true);
 
@@ -158,6 +212,10 @@ PYBIND11_MODULE(task_maker_frontend, m) {
       .def("makeExclusive", &frontend::Execution::makeExclusive)
       .def("setLimits", &frontend::Execution::setLimits, "limits"_a)
       .def("setExtraTime", &frontend::Execution::setExtraTime, "extra_time"_a)
+      .def("setPriority", &frontend::Execution::setPriority, "priority"_a)
+      .def("setTimed", &frontend::Execution::setTimed)
+      .def("setStopGroup", &frontend::Execution::setStopGroup,
+           "stop_group"_a)
       .def("stdout", &frontend::Execution::getStdout,
            pybind11::return_value_policy::reference, "is_executable"_a = false)
       .def("stderr", &frontend::Execution::getStderr,
@@ -210,21 +268,42 @@ PYBIND11_MODULE(task_maker_frontend, m) {
       .def("addExecution", &frontend::ExecutionGroup::addExecution,
            pybind11::return_value_policy::reference, "description"_a)
       .def("createFifo", &frontend::ExecutionGroup::createFifo,
-           pybind11::return_value_policy::reference);
+           pybind11::return_value_policy::reference, "shared"_a = false,
+           "stream"_a = false);
 
   pybind11::class_<frontend::Frontend>(m, "Frontend")
-      .def(pybind11::init<std::string, int>())
+      .def(pybind11::init<std::string, int, std::string, std::string>(),
+           "server"_a, "port"_a, "hash_cache"_a = "", "session"_a = "")
       .def("provideFile", &frontend::Frontend::provideFile,
            pybind11::return_value_policy::reference, "path"_a, "description"_a,
            "is_executable"_a = false)
+      .def("provideFiles", &frontend::Frontend::provideFiles,
+           pybind11::return_value_policy::reference, "paths"_a,
+           "descriptions"_a, "is_executable"_a = false)
       .def("provideFileContent", &frontend::Frontend::provideFileContent,
            pybind11::return_value_policy::reference, "content"_a,
            "description"_a, "is_executable"_a = false)
       .def("addExecution", &frontend::Frontend::addExecution,
            pybind11::return_value_policy::reference, "description"_a)
       .def("addExecutionGroup", &frontend::Frontend::addExecutionGroup,
-           pybind11::return_value_policy::reference)
+           pybind11::return_value_policy::reference, "description"_a,
+           "batch"_a = false)
       .def("evaluate", &frontend::Frontend::evaluate,
            pybind11::call_guard<pybind11::gil_scoped_release>())
-      .def("stopEvaluation", &frontend::Frontend::stopEvaluation);
+      .def("startEvaluation", &frontend::Frontend::startEvaluation,
+           pybind11::call_guard<pybind11::gil_scoped_release>())
+      // The callbacks are called together once the events are processed,
+      // so that the GIL is taken only once.
+      .def("poll",
+           [](frontend::Frontend& f) {
+             bool done;
+             {
+               pybind11::gil_scoped_release release;
+               done = f.poll(/*defer_callbacks=*/true);
+             }
+             f.runCallbacks();
+             return done;
+           })
+      .def("stopEvaluation", &frontend::Frontend::stopEvaluation)
+      .def("setWeight", &frontend::Frontend::setWeight, "weight"_a);
 }
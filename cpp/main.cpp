@@ -1,4 +1,6 @@
+#include "bench/main.hpp"
 #include "sandbox/main.hpp"
+#include "server/cache_main.hpp"
 #include "server/main.hpp"
 #include "util/daemon.hpp"
 #include "util/flags.hpp"
@@ -10,7 +12,12 @@ class TaskMakerMain {
  public:
   // NOLINTNEXTLINE(google-runtime-references)
   explicit TaskMakerMain(kj::ProcessContext& context)
-      : context(context), wm(&context), sm(&context), bm(&context) {}
+      : context(context),
+        wm(&context),
+        sm(&context),
+        bm(&context),
+        lm(&context),
+        cm(&context) {}
   kj::MainFunc getMain() {
     static std::string version = "Task-Maker (" + util::version + ")";
     return kj::MainBuilder(context, version, "The new cmsMake!")
@@ -18,6 +25,10 @@ class TaskMakerMain {
         .addSubCommand("server", KJ_BIND_METHOD(sm, getMain), "run the server")
         .addSubCommand("sandbox", KJ_BIND_METHOD(bm, getMain),
                        "run the sandbox")
+        .addSubCommand("bench", KJ_BIND_METHOD(lm, getMain),
+                       "send a synthetic load to a server")
+        .addSubCommand("cache", KJ_BIND_METHOD(cm, getMain),
+                       "export or import cache bundles")
         .build();
   }
 
@@ -26,6 +37,8 @@ class TaskMakerMain {
   worker::Main wm;
   server::Main sm;
   sandbox::Main bm;
+  bench::Main lm;
+  server::CacheMain cm;
 };
 
 KJ_MAIN(TaskMakerMain);
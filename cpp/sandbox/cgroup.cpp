@@ -0,0 +1,181 @@
+#include "sandbox/cgroup.hpp"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <set>
+#include <thread>
+
+namespace {
+
+// Returns the directory of the cgroup v2 of this process, or an empty string
+// if there is none.
+std::string OwnCGroup() {
+  std::ifstream mounts("/proc/self/mounts");
+  std::string device;
+  std::string dir;
+  std::string type;
+  std::string rest;
+  std::string mount;
+  while (mounts >> device >> dir >> type && std::getline(mounts, rest)) {
+    if (type == "cgroup2") {
+      mount = dir;
+      break;
+    }
+  }
+  if (mount.empty()) return "";
+  std::ifstream cgroup("/proc/self/cgroup");
+  std::string line;
+  while (std::getline(cgroup, line)) {
+    if (line.compare(0, 3, "0::") == 0) return mount + line.substr(3);
+  }
+  return "";
+}
+
+// Returns the cgroup in which the cgroups of the executions are created, or
+// an empty string if it cannot be used.
+std::string BaseCGroup() {
+  std::string own = OwnCGroup();
+  if (own.empty()) return "";
+  // Only the root cgroup, which has no cgroup.type, can have both processes
+  // and child cgroups with controllers, so the executions usually go next to
+  // the cgroup of the sandbox.
+  std::string base = own;
+  while (base.size() > 1 && base.back() == '/') base.pop_back();
+  if (access((base + "/cgroup.type").c_str(), F_OK) == 0) {
+    base = base.substr(0, base.rfind('/'));
+  }
+  if (access(base.c_str(), W_OK) != 0) return "";
+  std::ifstream in(base + "/cgroup.subtree_control");
+  std::set<std::string> controllers;
+  std::string controller;
+  while (in >> controller) controllers.insert(controller);
+  if (!controllers.count("memory") || !controllers.count("pids")) return "";
+  return base;
+}
+
+bool WriteValue(const std::string& path, const std::string& value) {
+  int fd = open(path.c_str(), O_WRONLY | O_CLOEXEC);  // NOLINT
+  if (fd == -1) return false;
+  bool ok = write(fd, value.c_str(), value.size()) ==
+            static_cast<ssize_t>(value.size());
+  close(fd);
+  return ok;
+}
+
+// Reads the value of key from a flat keyed file like cpu.stat, or the value
+// of a single value file like memory.peak if key is empty.
+bool ReadValue(const std::string& path, const std::string& key,
+               int64_t* value) {
+  std::ifstream in(path);
+  if (key.empty()) return static_cast<bool>(in >> *value);
+  std::string k;
+  int64_t v = 0;
+  while (in >> k >> v) {
+    if (k == key) {
+      *value = v;
+      return true;
+    }
+  }
+  return false;
+}
+
+}  // namespace
+
+namespace sandbox {
+
+int CGroup::Score() { return BaseCGroup().empty() ? -1 : 3; }
+
+bool CGroup::ExecuteInternal(const ExecutionOptions& options,
+                             ExecutionInfo* info, std::string* error_msg) {
+  auto fail = [this, error_msg](const std::string& what) {
+    *error_msg = what + " " + path_ + ": " + strerror(errno);
+    Remove();
+    return false;
+  };
+  path_ = BaseCGroup() + "/task-maker-" + std::to_string(getpid());
+  // Left behind by a sandbox that had the same pid.
+  Remove();
+  if (mkdir(path_.c_str(), S_IRWXU) == -1) return fail("mkdir");
+  if (options.memory_limit_kb &&
+      !WriteValue(path_ + "/memory.max",
+                  std::to_string(options.memory_limit_kb * 1024))) {
+    return fail("memory.max");
+  }
+  // Memory that is swapped out would not count towards the limit.
+  WriteValue(path_ + "/memory.swap.max", "0");
+  if (options.max_procs &&
+      !WriteValue(path_ + "/pids.max", std::to_string(options.max_procs))) {
+    return fail("pids.max");
+  }
+  procs_fd_ = open((path_ + "/cgroup.procs").c_str(),  // NOLINT
+                   O_WRONLY | O_CLOEXEC);
+  if (procs_fd_ == -1) return fail("open cgroup.procs");
+
+  // The cgroup enforces the limits on the memory and on the processes, the
+  // rlimits would only limit the address space and the processes of the
+  // user.
+  ExecutionOptions unlimited = options;
+  unlimited.memory_limit_kb = 0;
+  unlimited.max_procs = 0;
+  bool ok = Unix::ExecuteInternal(unlimited, info, error_msg);
+  close(procs_fd_);
+  procs_fd_ = -1;
+  Remove();
+  return ok;
+}
+
+bool CGroup::OnChild(char* error_msg, size_t buflen) {
+  if (write(procs_fd_, "0", 1) != 1) {
+    snprintf(error_msg, buflen, "cgroup.procs: %s", strerror(errno));
+    return false;
+  }
+  return true;
+}
+
+void CGroup::OnFinish(ExecutionInfo* info) {
+  int64_t value = 0;
+  if (ReadValue(path_ + "/memory.peak", "", &value)) {
+    info->memory_usage_kb = value / 1024;
+  }
+  if (ReadValue(path_ + "/cpu.stat", "user_usec", &value)) {
+    info->cpu_time_millis = value / 1000;
+  }
+  if (ReadValue(path_ + "/cpu.stat", "system_usec", &value)) {
+    info->sys_time_millis = value / 1000;
+  }
+  if (ReadValue(path_ + "/memory.events", "oom_kill", &value) && value > 0) {
+    info->killed = true;
+  }
+}
+
+// Unlike the cpu clock of the child, it includes the processes it started.
+bool CGroup::CpuTimeMillis(int64_t* millis) {
+  int64_t value = 0;
+  if (!ReadValue(path_ + "/cpu.stat", "usage_usec", &value)) return false;
+  *millis = value / 1000;
+  return true;
+}
+
+void CGroup::Remove() {
+  if (path_.empty() || access(path_.c_str(), F_OK) != 0) return;
+  // The processes that the program left behind are killed, and the cgroup
+  // can be removed once they are gone.
+  WriteValue(path_ + "/cgroup.kill", "1");
+  for (int i = 0; i < 100; i++) {
+    if (rmdir(path_.c_str()) == 0 || errno == ENOENT) return;
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+}
+
+namespace {
+Sandbox::Register<CGroup> r;  // NOLINT
+}  // namespace
+
+}  // namespace sandbox
@@ -0,0 +1,42 @@
+#ifndef SANDBOX_CGROUP_HPP
+#define SANDBOX_CGROUP_HPP
+#include <string>
+#include "sandbox/unix.hpp"
+
+namespace sandbox {
+
+// Sandbox for Linux that runs each execution in its own cgroup v2, which
+// enforces the memory and process limits on the actual memory used instead
+// of the address space, and accounts for the memory and cpu time of all the
+// processes of the execution.
+//
+// The cgroups of the executions are created next to the cgroup of the
+// sandbox, so the parent of the latter must be writable and have the memory
+// and pids controllers enabled for its children. For example, the worker can
+// be started in the worker/ child of a systemd unit with Delegate=yes. If
+// this is not the case, the Unix sandbox is used instead.
+class CGroup : public Unix {
+ public:
+  static Sandbox* Create() { return new CGroup(); }
+  static int Score();
+
+ protected:
+  bool ExecuteInternal(const ExecutionOptions& options, ExecutionInfo* info,
+                       std::string* error_msg) override;
+  bool OnChild(char* error_msg, size_t buflen) override;
+  void OnFinish(ExecutionInfo* info) override;
+  bool CpuTimeMillis(int64_t* millis) override;
+  CGroup() = default;
+
+ private:
+  // Kills the processes left in the cgroup of the execution and removes it.
+  void Remove();
+
+  // Directory of the cgroup of the current execution.
+  std::string path_;
+  // cgroup.procs of the cgroup of the execution, for the child to join it.
+  int procs_fd_ = -1;
+};
+
+}  // namespace sandbox
+#endif
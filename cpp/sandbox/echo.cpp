@@ -9,7 +9,6 @@ bool Echo::ExecuteInternal(const ExecutionOptions& options, ExecutionInfo* info,
   std::cout << "[FAKE] Executing ";
   std::cout << options.executable;
   for (const auto& arg : options.args) {
-    if (!arg[0]) break;
     std::cout << " " << arg;
   }
   std::cout << std::endl;
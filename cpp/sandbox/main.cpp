@@ -1,7 +1,12 @@
 #include "sandbox/main.hpp"
 #include <capnp/ez-rpc.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <unistd.h>
 #include <thread>
+#include <vector>
 
+#include <kj/debug.h>
 #include <kj/io.h>
 #include <util/flags.hpp>
 #include "capnp/server.capnp.h"
@@ -9,32 +14,101 @@
 #include "util/version.hpp"
 
 namespace sandbox {
+namespace {
+
+// Executes the options in a new sandbox and writes the outcome to fd.
+void Execute(const ExecutionOptions& options, int fd) {
+  sandbox::ExecutionInfo outcome;
+  std::string error_msg;
+  std::unique_ptr<sandbox::Sandbox> sb = sandbox::Sandbox::Create();
+  kj::FdOutputStream out(fd);
+  if (!sb->Execute(options, &outcome, &error_msg)) {
+    size_t sz = error_msg.size();
+    out.write(&sz, sizeof(sz));
+    out.write(error_msg.c_str(), sz + 1);
+  } else {
+    size_t sz = 0;
+    out.write(&sz, sizeof(sz));
+    std::string data = outcome.Serialize();
+    out.write(data.data(), data.size());
+  }
+}
+
+// Reads options encoded by ExecutionOptions::Serialize, preceded by their
+// size. Returns false if the input ended.
+bool ReadOptions(kj::InputStream* in, ExecutionOptions* options) {
+  uint64_t size = 0;
+  if (in->tryRead(&size, sizeof(size), sizeof(size)) != sizeof(size)) {
+    return false;
+  }
+  std::string data(size, '\0');
+  in->read(&data[0], size);
+  KJ_ASSERT(options->Parse(data), "Invalid options");
+  return true;
+}
+
+}  // namespace
+
 kj::MainBuilder::Validity Main::Run() {
+  if (zygote) return RunZygote();
   kj::FdInputStream in(fileno(stdin));
   ExecutionOptions options("", "");
   if (read_binary) {
-    in.read(&options, sizeof(options), sizeof(options));
+    KJ_ASSERT(ReadOptions(&in, &options), "Missing options");
   } else {
     KJ_FAIL_ASSERT("Not implemented");
   }
-  sandbox::ExecutionInfo outcome;
-  std::string error_msg;
-  std::unique_ptr<sandbox::Sandbox> sb = sandbox::Sandbox::Create();
+  Execute(options, fileno(stdout));
+  return true;
+}
+
+kj::MainBuilder::Validity Main::RunZygote() {
+  kj::FdInputStream in(fileno(stdin));
   kj::FdOutputStream out(fileno(stdout));
-  bool ok = sb->Execute(options, &outcome, &error_msg);
-  if (read_binary) {
-    if (!ok) {
-      size_t sz = error_msg.size();
-      out.write(&sz, sizeof(sz));
-      out.write(error_msg.c_str(), sz + 1);
-    } else {
-      size_t sz = 0;
-      out.write(&sz, sizeof(sz));
-      out.write(&outcome, sizeof(outcome));
-      // TODO: think about outcome.message
+  ExecutionOptions options("", "");
+  while (ReadOptions(&in, &options)) {
+    // The outcome is written by the child only: the sandboxed process must
+    // not inherit the pipe, nor the pipes to the worker, or it could forge
+    // its own outcome.
+    int result_pipe[2];
+    KJ_SYSCALL(util::PipeCloexec(result_pipe));
+    int pid = fork();
+    KJ_ASSERT(pid != -1, strerror(errno));
+    if (pid == 0) {
+      close(result_pipe[0]);
+      int null_fd = open("/dev/null", O_RDWR | O_CLOEXEC);  // NOLINT
+      if (null_fd == -1 || dup2(null_fd, fileno(stdin)) == -1 ||
+          dup2(null_fd, fileno(stdout)) == -1) {
+        _exit(1);
+      }
+      close(null_fd);
+      bool ok = false;
+      KJ_IF_MAYBE(exc, kj::runCatchingExceptions([&]() {
+                    Execute(options, result_pipe[1]);
+                    ok = true;
+                  })) {
+        KJ_LOG(ERROR, "Sandbox failed", *exc);
+      }
+      _exit(ok ? 0 : 1);
     }
-  } else {
-    KJ_FAIL_ASSERT("Not implemented");
+    close(result_pipe[1]);
+    int32_t child = pid;
+    out.write(&child, sizeof(child));
+
+    kj::FdInputStream result(kj::AutoCloseFd{result_pipe[0]});
+    std::vector<char> data;
+    char buf[4096];
+    size_t n;
+    while ((n = result.tryRead(buf, 1, sizeof(buf))) > 0) {
+      data.insert(data.end(), buf, buf + n);
+    }
+    int status = 0;
+    while (waitpid(pid, &status, 0) == -1) {
+      KJ_ASSERT(errno == EINTR, strerror(errno));
+    }
+    ZygoteResult header{status, data.size()};
+    out.write(&header, sizeof(header));
+    if (!data.empty()) out.write(data.data(), data.size());
   }
   return true;
 }
@@ -56,6 +130,9 @@ kj::MainFunc Main::getMain() {
                         "Path where the sandboxes should be crated")
       .addOption({'b', "bin"}, util::setBool(&read_binary),
                  "Read/write options/results in binary.")
+      .addOption({"zygote"}, util::setBool(&zygote),
+                 "Keep running, forking a sandbox for each set of binary "
+                 "options read.")
       // TODO: allow to specify options from the command line
       .callAfterParsing(KJ_BIND_METHOD(*this, Run))
       .build();
@@ -5,6 +5,15 @@
 
 namespace sandbox {
 
+// Sent by a sandbox helper started with --zygote after each execution, after
+// the pid of the sandbox and before size bytes of its output, in the same
+// format as the output of a sandbox started with --bin.
+struct ZygoteResult {
+  // Exit status of the sandbox, as returned by waitpid.
+  int32_t status;
+  uint64_t size;
+};
+
 class Main {
  public:
   explicit Main(kj::ProcessContext* context) : context(*context) {}
@@ -12,8 +21,13 @@ class Main {
   kj::MainFunc getMain();
 
  private:
+  // Forks a new sandbox for each set of options read from stdin, until stdin
+  // is closed.
+  kj::MainBuilder::Validity RunZygote();
+
   kj::ProcessContext& context;
   bool read_binary = false;
+  bool zygote = false;
 };
 }  // namespace sandbox
 #endif
@@ -1,9 +1,283 @@
 #include "sandbox/sandbox.hpp"
 
+#include <fcntl.h>
+#include <kj/string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <iostream>
+#include <type_traits>
+#ifdef __linux__
+#include <sched.h>
+#include <sys/mount.h>
+#include <sys/statvfs.h>
+#endif
+
+namespace {
+
+// Encodes values in a buffer: numbers in their native representation, since
+// the buffer is only exchanged between processes on the same machine, and
+// strings and lists prefixed by their size.
+class Writer {
+ public:
+  template <typename T>
+  void Put(T value) {
+    static_assert(std::is_arithmetic<T>::value, "Not a number");
+    out_.append(reinterpret_cast<const char*>(&value),  // NOLINT
+                sizeof(value));
+  }
+  void PutString(const std::string& value) {
+    Put<uint32_t>(value.size());
+    out_ += value;
+  }
+  std::string Release() { return std::move(out_); }
+
+ private:
+  std::string out_;
+};
+
+// Decodes what was encoded by Writer, failing if the buffer ends too early.
+class Reader {
+ public:
+  explicit Reader(const std::string& data) : data_(data) {}
+  template <typename T>
+  bool Get(T* value) {
+    static_assert(std::is_arithmetic<T>::value, "Not a number");
+    if (data_.size() - pos_ < sizeof(T)) return false;
+    memcpy(value, data_.data() + pos_, sizeof(T));
+    pos_ += sizeof(T);
+    return true;
+  }
+  bool GetString(std::string* value) {
+    uint32_t size = 0;
+    if (!Get(&size) || data_.size() - pos_ < size) return false;
+    value->assign(data_, pos_, size);
+    pos_ += size;
+    return true;
+  }
+  // Number of elements of a list, which are at least min_size bytes each.
+  bool GetSize(uint32_t* size, size_t min_size) {
+    return Get(size) && (data_.size() - pos_) / min_size >= *size;
+  }
+  bool Done() const { return pos_ == data_.size(); }
+
+ private:
+  const std::string& data_;
+  size_t pos_ = 0;
+};
+
+#ifdef __linux__
+bool WriteProcFile(const char* path, const std::string& contents) {
+  int fd = open(path, O_WRONLY | O_CLOEXEC);  // NOLINT
+  if (fd == -1) return false;
+  bool ok = write(fd, contents.data(), contents.size()) ==
+            static_cast<ssize_t>(contents.size());
+  close(fd);
+  return ok;
+}
+#endif
+
+// Moves the process to a new mount namespace, owned by a new user namespace
+// if the process is not privileged. Returns false if namespaces are not
+// available.
+bool EnterMountNamespace() {
+#ifdef __linux__
+  uid_t uid = getuid();
+  gid_t gid = getgid();
+  if (uid == 0) {
+    if (unshare(CLONE_NEWNS) == -1) return false;
+  } else {
+    if (unshare(CLONE_NEWUSER | CLONE_NEWNS) == -1) return false;
+    // The ids stay the same, so the files written in the sandbox have the
+    // usual owner.
+    if (!WriteProcFile("/proc/self/setgroups", "deny") ||
+        !WriteProcFile("/proc/self/uid_map", kj::str(uid, " ", uid, " 1")
+                                                 .cStr()) ||
+        !WriteProcFile("/proc/self/gid_map",
+                       kj::str(gid, " ", gid, " 1").cStr())) {
+      return false;
+    }
+  }
+  // The mounts must not propagate to the namespace of the worker.
+  return mount(nullptr, "/", nullptr, MS_REC | MS_PRIVATE, nullptr) == 0;
+#else
+  return false;
+#endif
+}
+
+// Mounts source read-only on an empty file created at target.
+bool BindReadOnly(const std::string& source, const std::string& target) {
+#ifdef __linux__
+  struct statvfs st {};
+  if (statvfs(source.c_str(), &st) == -1) return false;
+  int fd = open(target.c_str(),  // NOLINT
+                O_WRONLY | O_CREAT | O_CLOEXEC, S_IRUSR);
+  if (fd == -1) return false;
+  close(fd);
+  if (mount(source.c_str(), target.c_str(), nullptr, MS_BIND, nullptr) == -1) {
+    return false;
+  }
+  // The flags of the filesystem of the source cannot be dropped in a user
+  // namespace, so they are kept.
+  unsigned long flags = MS_BIND | MS_REMOUNT | MS_RDONLY;  // NOLINT
+  if (st.f_flag & ST_NOSUID) flags |= MS_NOSUID;
+  if (st.f_flag & ST_NODEV) flags |= MS_NODEV;
+  if (st.f_flag & ST_NOEXEC) flags |= MS_NOEXEC;
+  if (st.f_flag & ST_NOATIME) flags |= MS_NOATIME;
+  if (st.f_flag & ST_NODIRATIME) flags |= MS_NODIRATIME;
+  if (st.f_flag & ST_RELATIME) flags |= MS_RELATIME;
+  if (mount(nullptr, target.c_str(), nullptr, flags, nullptr) == 0) return true;
+  umount2(target.c_str(), MNT_DETACH);
+  return false;
+#else
+  return false;
+#endif
+}
+
+}  // namespace
 
 namespace sandbox {
 
+std::string ExecutionOptions::Serialize() const {
+  Writer writer;
+  writer.Put(cpu_limit_millis);
+  writer.Put(wall_limit_millis);
+  writer.Put(memory_limit_kb);
+  writer.Put(max_procs);
+  writer.Put(max_files);
+  writer.Put(max_file_size_kb);
+  writer.Put(max_mlock_kb);
+  writer.Put(max_stack_kb);
+  writer.Put<uint8_t>(prepare_executable);
+  writer.Put<uint32_t>(cpus.size());
+  for (int32_t cpu : cpus) writer.Put(cpu);
+  writer.Put<uint8_t>(count_instructions);
+  writer.PutString(stdin_file);
+  writer.PutString(stdout_file);
+  writer.PutString(stderr_file);
+  writer.Put<uint8_t>(capture_stdout);
+  writer.Put<uint8_t>(capture_stderr);
+  writer.Put(capture_limit);
+  writer.PutString(root);
+  writer.PutString(executable);
+  writer.Put<uint32_t>(args.size());
+  for (const std::string& arg : args) writer.PutString(arg);
+  writer.Put<uint32_t>(mounts.size());
+  for (const Mount& mount : mounts) {
+    writer.PutString(mount.source);
+    writer.PutString(mount.target);
+    writer.Put<uint8_t>(mount.executable);
+  }
+  return writer.Release();
+}
+
+bool ExecutionOptions::Parse(const std::string& data) {
+  Reader reader(data);
+  uint8_t prepare = 0;
+  uint32_t num_cpus = 0;
+  uint32_t num_args = 0;
+  uint8_t capture_out = 0;
+  uint8_t capture_err = 0;
+  if (!reader.Get(&cpu_limit_millis) || !reader.Get(&wall_limit_millis) ||
+      !reader.Get(&memory_limit_kb) || !reader.Get(&max_procs) ||
+      !reader.Get(&max_files) || !reader.Get(&max_file_size_kb) ||
+      !reader.Get(&max_mlock_kb) || !reader.Get(&max_stack_kb) ||
+      !reader.Get(&prepare) || !reader.GetSize(&num_cpus, sizeof(int32_t))) {
+    return false;
+  }
+  prepare_executable = prepare;
+  cpus.resize(num_cpus);
+  for (int32_t& cpu : cpus) {
+    if (!reader.Get(&cpu)) return false;
+  }
+  uint8_t count = 0;
+  if (!reader.Get(&count)) return false;
+  count_instructions = count;
+  if (!reader.GetString(&stdin_file) || !reader.GetString(&stdout_file) ||
+      !reader.GetString(&stderr_file) || !reader.Get(&capture_out) ||
+      !reader.Get(&capture_err) || !reader.Get(&capture_limit) ||
+      !reader.GetString(&root) ||
+      !reader.GetString(&executable) ||
+      !reader.GetSize(&num_args, sizeof(uint32_t))) {
+    return false;
+  }
+  capture_stdout = capture_out;
+  capture_stderr = capture_err;
+  args.resize(num_args);
+  for (std::string& arg : args) {
+    if (!reader.GetString(&arg)) return false;
+  }
+  uint32_t num_mounts = 0;
+  if (!reader.GetSize(&num_mounts, 2 * sizeof(uint32_t) + 1)) return false;
+  mounts.resize(num_mounts);
+  for (Mount& mount : mounts) {
+    uint8_t executable = 0;
+    if (!reader.GetString(&mount.source) || !reader.GetString(&mount.target) ||
+        !reader.Get(&executable)) {
+      return false;
+    }
+    mount.executable = executable;
+  }
+  return reader.Done();
+}
+
+std::string ExecutionInfo::Serialize() const {
+  Writer writer;
+  writer.Put(cpu_time_millis);
+  writer.Put(sys_time_millis);
+  writer.Put(wall_time_millis);
+  writer.Put(memory_usage_kb);
+  writer.Put(instructions);
+  writer.Put(status_code);
+  writer.Put(signal);
+  writer.Put<uint8_t>(killed_external);
+  writer.Put<uint8_t>(killed);
+  writer.PutString(message);
+  writer.Put<uint8_t>(stdout_captured);
+  writer.Put<uint8_t>(stderr_captured);
+  writer.PutString(stdout_data);
+  writer.PutString(stderr_data);
+  return writer.Release();
+}
+
+bool ExecutionInfo::Parse(const std::string& data) {
+  Reader reader(data);
+  uint8_t external = 0;
+  uint8_t by_limits = 0;
+  uint8_t out_captured = 0;
+  uint8_t err_captured = 0;
+  if (!reader.Get(&cpu_time_millis) || !reader.Get(&sys_time_millis) ||
+      !reader.Get(&wall_time_millis) || !reader.Get(&memory_usage_kb) ||
+      !reader.Get(&instructions) || !reader.Get(&status_code) ||
+      !reader.Get(&signal) || !reader.Get(&external) ||
+      !reader.Get(&by_limits) || !reader.GetString(&message) ||
+      !reader.Get(&out_captured) || !reader.Get(&err_captured) ||
+      !reader.GetString(&stdout_data) || !reader.GetString(&stderr_data)) {
+    return false;
+  }
+  killed_external = external;
+  killed = by_limits;
+  stdout_captured = out_captured;
+  stderr_captured = err_captured;
+  return reader.Done();
+}
+
+bool Sandbox::MountInputs(const std::vector<ExecutionOptions::Mount>& mounts,
+                          std::string* error_msg) {
+  bool isolated = EnterMountNamespace();
+  for (const auto& mount : mounts) {
+    if (isolated && BindReadOnly(mount.source, mount.target)) continue;
+    try {
+      util::File::Copy(mount.source, mount.target, /*overwrite=*/true);
+      if (!mount.executable) util::File::MakeImmutable(mount.target);
+    } catch (const std::exception& e) {
+      *error_msg = std::string("Cannot prepare ") + mount.target + ": " +
+                   e.what();
+      return false;
+    }
+  }
+  return true;
+}
+
 Sandbox::store_t* Sandbox::Boxes_() {
   static auto boxes = std::make_unique<store_t>();
   return boxes.get();
@@ -1,7 +1,10 @@
 #ifndef SANDBOX_SANDBOX_HPP
 #define SANDBOX_SANDBOX_HPP
 
+#include <algorithm>
+#include <cstdint>
 #include <cstring>
+#include <initializer_list>
 #include <stdexcept>
 #include <functional>
 #include <memory>
@@ -13,9 +16,6 @@ namespace sandbox {
 
 // Settings to execute the program in the sandbox.
 struct ExecutionOptions {
-  static const constexpr size_t str_len = 1024;
-  static const constexpr size_t narg = 16;
-
   // Optional values
   int64_t cpu_limit_millis = 0;
   int64_t wall_limit_millis = 0;
@@ -25,43 +25,58 @@ struct ExecutionOptions {
   int64_t max_file_size_kb = 0;
   int64_t max_mlock_kb = 0;
   int64_t max_stack_kb = 0;
-
-  char stdin_file[str_len] = {};
-  char stdout_file[str_len] = {};
-  char stderr_file[str_len] = {};
-  char args[narg][str_len] = {};
+  // If cpus is not empty, the process may only run on the given cpus.
+  std::vector<int32_t> cpus;
+  // Whether to count the user-space instructions that the program retires,
+  // which do not depend on the load of the machine as the times do.
+  bool count_instructions = false;
+
+  std::string stdin_file;
+  std::string stdout_file;
+  std::string stderr_file;
+  // If capture_limit is not zero, the captured streams are read through a
+  // pipe and returned in ExecutionInfo, and their file is only written if
+  // they are longer than capture_limit bytes.
+  bool capture_stdout = false;
+  bool capture_stderr = false;
+  int64_t capture_limit = 0;
+  // The first argument is the executable.
+  std::vector<std::string> args;
+
+  // Files that appear read-only at target, an absolute path inside root,
+  // during the execution only. See Sandbox::Execute.
+  struct Mount {
+    std::string source;
+    std::string target;
+    bool executable = false;
+  };
+  std::vector<Mount> mounts;
 
   // Required values
-  char root[str_len] = {};
-  char executable[str_len] = {};
+  std::string root;
+  std::string executable;
   bool prepare_executable = false;
-  ExecutionOptions(const std::string& root_, const std::string& executable_) {
-    memset(this, 0, sizeof(*this));
-    stringcpy(root, root_);
-    stringcpy(executable, executable_);
-    strncpy(&args[0][0], executable, str_len);
-  }
+  ExecutionOptions(const std::string& root_, const std::string& executable_)
+      : args{executable_}, root(root_), executable(executable_) {}
   template <typename T>
   void SetArgs(const T& a_) {
-    size_t i = 1;
-    for (const std::string& s : a_) {
-      stringcpy(&args[i][0], s);
-      if (i++ >= narg) throw std::runtime_error("Too many arguments");
-    }
+    args.resize(1);
+    for (const std::string& s : a_) args.push_back(s);
   }
   void SetArgs(const std::initializer_list<const char*>& a_) {
-    size_t i = 1;
-    for (const char* s : a_) {
-      if (strlen(s) >= str_len) throw std::runtime_error("string too long");
-      strncpy(&args[i][0], s, str_len);
-      if (i++ >= narg) throw std::runtime_error("Too many arguments");
-    }
+    args.resize(1);
+    for (const char* s : a_) args.emplace_back(s);
   }
 
-  static void stringcpy(char* dst, const std::string& s) {
-    if (s.size() >= str_len) throw std::runtime_error("string too long");
-    strncpy(dst, s.c_str(), str_len - 1);
+  void SetCpus(const std::vector<int>& cpus_) {
+    cpus.assign(cpus_.begin(), cpus_.end());
   }
+
+  // Encodes the options for the sandbox helpers. The encoding is only meant
+  // to be read by the same binary, with Parse.
+  std::string Serialize() const;
+  // Returns false if data is not a valid encoding of options.
+  bool Parse(const std::string& data);
 };
 
 // Results of the execution.
@@ -70,11 +85,22 @@ struct ExecutionInfo {
   int64_t sys_time_millis = 0;
   int64_t wall_time_millis = 0;
   int64_t memory_usage_kb = 0;
+  // 0 if the instructions were not counted.
+  int64_t instructions = 0;
   int32_t status_code = 0;
   int32_t signal = 0;
   bool killed_external = false;
   bool killed = false;
-  char message[8192] = {};
+  std::string message;
+  // Contents of the captured streams that were not written to their file.
+  bool stdout_captured = false;
+  bool stderr_captured = false;
+  std::string stdout_data;
+  std::string stderr_data;
+
+  // Same as the ones of ExecutionOptions.
+  std::string Serialize() const;
+  bool Parse(const std::string& data);
 };
 
 // Sandbox interface. Implementations need to register themselves by creating a
@@ -94,9 +120,14 @@ class Sandbox {
 
   // Runs the specified command. Returns true if the program was started,
   // and sets fields in info. Otherwise, returns false and sets error_msg.
-  // Implementations of this function may not be thread safe.
+  // Implementations of this function may not be thread safe. The mounts of
+  // the options are made in a new mount namespace of the calling process,
+  // that should not be used for anything else afterwards.
   bool Execute(const ExecutionOptions& options, ExecutionInfo* info,
                std::string* error_msg) {
+    if (!options.mounts.empty() && !MountInputs(options.mounts, error_msg)) {
+      return false;
+    }
     if (options.prepare_executable) {
       if (!PrepareForExecution(
               util::File::JoinPath(options.root, options.executable),
@@ -135,6 +166,12 @@ class Sandbox {
  private:
   using store_t = std::vector<std::pair<create_t, score_t>>;
   static store_t* Boxes_();
+  // Bind-mounts the files read-only on empty files at their target, in a
+  // private mount namespace that is released with the last process that uses
+  // it. When namespaces are not available, the files are linked or copied
+  // instead, as immutable files.
+  static bool MountInputs(const std::vector<ExecutionOptions::Mount>& mounts,
+                          std::string* error_msg);
   static void Register_(create_t, score_t);
   template <typename T>
   friend class Register;
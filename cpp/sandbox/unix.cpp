@@ -1,6 +1,9 @@
 #include "sandbox/unix.hpp"
 
 #include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
 #include <spawn.h>
 #include <sys/resource.h>
 #include <sys/stat.h>
@@ -8,6 +11,11 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
+#include <algorithm>
 #include <atomic>
 #include <cerrno>
 #include <chrono>
@@ -16,6 +24,9 @@
 #include <csignal>
 #include <cstdlib>
 #include <cstring>
+#include <ctime>
+#include <memory>
+#include <string>
 #include <thread>
 
 #include <kj/debug.h>
@@ -147,6 +158,12 @@ bool Unix::ExecuteInternal(const ExecutionOptions& options, ExecutionInfo* info,
 }
 
 bool Unix::Setup(std::string* error_msg) {
+  // The child cannot allocate memory.
+  argv_.clear();
+  for (const std::string& arg : options_->args) {
+    argv_.push_back(const_cast<char*>(arg.c_str()));  // NOLINT
+  }
+  argv_.push_back(nullptr);
   char buf[kStrErrorBufSize] = {};
   if (pipe(pipe_fds_) == -1) {  // NOLINT
     *error_msg = "pipe2: ";
@@ -159,6 +176,29 @@ bool Unix::Setup(std::string* error_msg) {
     *error_msg += mystrerror(errno, buf, kStrErrorBufSize);  // NOLINT
     return false;
   }
+  start_fds_[0] = start_fds_[1] = -1;
+  if (options_->count_instructions &&
+      (pipe(start_fds_) == -1 ||  // NOLINT
+       fcntl(start_fds_[0], F_SETFD, FD_CLOEXEC) == -1 ||
+       fcntl(start_fds_[1], F_SETFD, FD_CLOEXEC) == -1)) {
+    *error_msg = "start pipe: ";
+    *error_msg += mystrerror(errno, buf, kStrErrorBufSize);  // NOLINT
+    return false;
+  }
+  bool capture[2] = {
+      options_->capture_stdout && !options_->stdout_file.empty(),
+      options_->capture_stderr && !options_->stderr_file.empty()};
+  for (int i = 0; i < 2; i++) {
+    capture_fds_[i][0] = capture_fds_[i][1] = -1;
+    if (!capture[i] || options_->capture_limit == 0) continue;
+    if (pipe(capture_fds_[i]) == -1 ||  // NOLINT
+        fcntl(capture_fds_[i][0], F_SETFD, FD_CLOEXEC) == -1 ||
+        fcntl(capture_fds_[i][1], F_SETFD, FD_CLOEXEC) == -1) {
+      *error_msg = "capture pipe: ";
+      *error_msg += mystrerror(errno, buf, kStrErrorBufSize);  // NOLINT
+      return false;
+    }
+  }
   return true;
 }
 
@@ -203,38 +243,31 @@ void Unix::Child() {
   int stdin_fd = -1;
   int stdout_fd = -1;
   int stderr_fd = -1;
-  // fprintf(stderr, "%s\n", options_->stdin_file);
-  if (options_->stdin_file[0]) {
-    stdin_fd = open(options_->stdin_file, O_RDONLY | O_CLOEXEC);
+  if (!options_->stdin_file.empty()) {
+    stdin_fd = open(options_->stdin_file.c_str(), O_RDONLY | O_CLOEXEC);
     if (stdin_fd == -1) die("open", errno);
   }
-  if (options_->stdout_file[0]) {
+  if (capture_fds_[0][1] != -1) {
+    stdout_fd = capture_fds_[0][1];
+  } else if (!options_->stdout_file.empty()) {
     stdout_fd =
-        open(options_->stdout_file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
-             S_IRUSR | S_IWUSR);
+        open(options_->stdout_file.c_str(),
+             O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR);
     if (stdout_fd == -1) die("open", errno);
   }
-  if (options_->stderr_file[0]) {
+  if (capture_fds_[1][1] != -1) {
+    stderr_fd = capture_fds_[1][1];
+  } else if (!options_->stderr_file.empty()) {
     stderr_fd =
-        open(options_->stderr_file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
-             S_IRUSR | S_IWUSR);
+        open(options_->stderr_file.c_str(),
+             O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR);
     if (stderr_fd == -1) die("open", errno);
   }
 
-  if (chdir(options_->root) == -1) {
+  if (chdir(options_->root.c_str()) == -1) {
     die("chdir", errno);
   }
 
-  decltype(options_->args) args = {};
-  memcpy(args, options_->args, sizeof(args));
-  char* argsp[ExecutionOptions::narg + 1] = {};
-  size_t narg = 0;
-  // NOLINTNEXTLINE
-  for (size_t i = 0; i < ExecutionOptions::narg; i++) {
-    if (!args[i][0]) break;
-    argsp[narg++] = &args[i][0];
-  }
-
   // Handle I/O redirection.
 #define DUP(field, fd)                          \
   if (field##_fd != -1) {                       \
@@ -279,11 +312,31 @@ void Unix::Child() {
 #endif
 #undef SET_RLIM
 
+  // CPU affinity is not supported on MAC.
+#ifndef __APPLE__
+  if (!options_->cpus.empty()) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    for (int32_t cpu : options_->cpus) {
+      CPU_SET(cpu, &cpus);  // NOLINT
+    }
+    if (sched_setaffinity(0, sizeof(cpus), &cpus) == -1) {
+      die("sched_setaffinity", errno);
+    }
+  }
+#endif
+
   char buf[kStrErrorBufSize] = {};
   if (!OnChild(buf, kStrErrorBufSize)) {  // NOLINT
     die2("OnChild", buf);                 // NOLINT
   }
-  execv(options_->executable, argsp);
+  if (start_fds_[0] != -1) {
+    close(start_fds_[1]);
+    char start = 0;
+    while (read(start_fds_[0], &start, 1) == -1 && errno == EINTR) {
+    }
+  }
+  execv(options_->executable.c_str(), argv_.data());
   die("exec", errno);
   // [[noreturn]] does not work on lambdas...
   _Exit(1);
@@ -295,15 +348,198 @@ sig_atomic_t have_signal = 0;
 void sig_hdl(int /*sig*/, siginfo_t* /*siginfo*/, void* /*context*/) {
   have_signal = 1;
 }
+
+// Returns a file descriptor that becomes readable when the process exits, or
+// -1 if the kernel does not support it.
+int OpenPidFd(int pid) {
+#if defined(__linux__)
+#ifndef __NR_pidfd_open
+#define __NR_pidfd_open 434
+#endif
+  return syscall(__NR_pidfd_open, pid, 0);
+#else
+  return -1;
+#endif
+}
+
+// Reads a captured stream of the child on its own thread. The stream is kept
+// in memory until it is longer than the capture limit, and is then written
+// to its file.
+class Capture {
+ public:
+  Capture(int fd, const std::string& path, size_t limit, size_t max_size,
+          int pid)
+      : fd_(fd), path_(path), limit_(limit), max_size_(max_size), pid_(pid) {
+    // The signals must reach the thread that waits for the child.
+    sigset_t all;
+    sigset_t old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    thread_ = std::thread([this]() { Run(); });
+    pthread_sigmask(SIG_SETMASK, &old, nullptr);
+  }
+  ~Capture() { Stop(); }
+
+  Capture(const Capture&) = delete;
+  Capture& operator=(const Capture&) = delete;
+
+  // Reads what is left in the pipe and waits for the thread. The child must
+  // have been waited for, so that what it wrote is in the pipe already, and
+  // processes that it left behind cannot keep the thread alive.
+  void Stop() {
+    done_ = true;
+    if (thread_.joinable()) thread_.join();
+  }
+
+  // Whether the whole stream is in Data() and its file was not written.
+  bool Captured() const { return !spilled_; }
+  std::string& Data() { return data_; }
+
+ private:
+  void Run() {
+    char buf[64 * 1024];
+    bool reading = true;
+    while (reading) {
+      bool done = done_;
+      struct pollfd pfd {};
+      pfd.fd = fd_;
+      pfd.events = POLLIN;
+      int ret = poll(&pfd, 1, done ? 0 : 50);
+      if (ret == 0 && done) break;
+      if (ret <= 0) continue;
+      ssize_t n = read(fd_, buf, sizeof(buf));
+      if (n == -1 && errno == EINTR) continue;
+      if (n <= 0) break;
+      reading = Append(buf, n);
+    }
+    close(fd_);
+    if (out_fd_ != -1) close(out_fd_);
+  }
+
+  // Returns false once the stream is longer than max_size_: the child gets
+  // SIGXFSZ, as it would with RLIMIT_FSIZE, and the rest is not read.
+  bool Append(const char* data, size_t size) {
+    bool fits = max_size_ == 0 || size_ + size <= max_size_;
+    if (!fits) size = max_size_ - size_;
+    size_ += size;
+    if (!spilled_ && size_ <= limit_) {
+      data_.append(data, size);
+    } else {
+      if (!spilled_) {
+        spilled_ = true;
+        out_fd_ = open(path_.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                       S_IRUSR | S_IWUSR);
+        Write(data_.data(), data_.size());
+        data_.clear();
+      }
+      Write(data, size);
+    }
+    if (!fits && !done_) kill(pid_, SIGXFSZ);
+    return fits;
+  }
+
+  void Write(const char* data, size_t size) {
+    while (out_fd_ != -1 && size > 0) {
+      ssize_t n = write(out_fd_, data, size);
+      if (n == -1 && errno == EINTR) continue;
+      if (n <= 0) return;
+      data += n;
+      size -= n;
+    }
+  }
+
+  int fd_;
+  std::string path_;
+  size_t limit_;
+  size_t max_size_;
+  int pid_;
+  std::atomic<bool> done_{false};
+  std::thread thread_;
+  std::string data_;
+  size_t size_ = 0;
+  bool spilled_ = false;
+  int out_fd_ = -1;
+};
+
+// Returns a counter of the user-space instructions retired by the process
+// and by the processes and threads it creates, starting from its next exec.
+// Returns -1 if the counter is not available.
+int OpenInstructionCounter(int pid) {
+#if defined(__linux__)
+  struct perf_event_attr attr {};
+  attr.size = sizeof(attr);
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+  attr.disabled = 1;
+  attr.enable_on_exec = 1;
+  attr.inherit = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  return syscall(SYS_perf_event_open, &attr, pid, -1, -1,
+                 PERF_FLAG_FD_CLOEXEC);
+#else
+  return -1;
+#endif
+}
+
+// Waits until pidfd is readable, a signal is received or timeout_ms
+// milliseconds pass, if timeout_ms is not negative. mask is the signal mask
+// while waiting.
+void WaitPidFd(int pidfd, int64_t timeout_ms, const sigset_t* mask) {
+#if defined(__linux__)
+  struct pollfd pfd {};
+  pfd.fd = pidfd;
+  pfd.events = POLLIN;
+  struct timespec timeout {};
+  timeout.tv_sec = timeout_ms / 1000;
+  timeout.tv_nsec = timeout_ms % 1000 * 1000000;
+  ppoll(&pfd, 1, timeout_ms < 0 ? nullptr : &timeout, mask);
+#endif
+}
 }  // namespace
 
+bool Unix::CpuTimeMillis(int64_t* millis) {
+#if defined(__linux__)
+  clockid_t clock;
+  struct timespec time {};
+  if (clock_getcpuclockid(child_pid_, &clock) != 0 ||
+      clock_gettime(clock, &time) == -1) {
+    return false;
+  }
+  *millis = time.tv_sec * 1000LL + time.tv_nsec / 1000000;
+  return true;
+#else
+  return false;
+#endif
+}
+
 bool Unix::Wait(ExecutionInfo* info, std::string* error_msg) {
   close(pipe_fds_[1]);
+  int counter_fd = -1;
+  if (start_fds_[0] != -1) {
+    close(start_fds_[0]);
+    counter_fd = OpenInstructionCounter(child_pid_);
+    // Without a counter the program still runs, and no count is reported.
+    close(start_fds_[1]);
+    start_fds_[0] = start_fds_[1] = -1;
+  }
+  const std::string* capture_files[2] = {&options_->stdout_file,
+                                         &options_->stderr_file};
+  std::unique_ptr<Capture> captures[2];
+  for (int i = 0; i < 2; i++) {
+    if (capture_fds_[i][0] == -1) continue;
+    close(capture_fds_[i][1]);
+    captures[i] = std::make_unique<Capture>(
+        capture_fds_[i][0], *capture_files[i], options_->capture_limit,
+        options_->max_file_size_kb * 1024, child_pid_);
+    capture_fds_[i][0] = capture_fds_[i][1] = -1;
+  }
   ssize_t error_len = 0;
   if (read(pipe_fds_[0], &error_len, sizeof(error_len)) == sizeof(error_len)) {
     char error[PIPE_BUF] = {};
     KJ_SYSCALL(read(pipe_fds_[0], error, error_len), "Failed to read from fd");
     *error_msg = error;
+    if (counter_fd != -1) close(counter_fd);
     return false;
   }
   std::atomic<int64_t> memory_usage{0};
@@ -332,16 +568,38 @@ bool Unix::Wait(ExecutionInfo* info, std::string* error_msg) {
     exit(1);
   }
 
+  // If the exit of the child can be waited for, SIGINT and SIGTERM are only
+  // received while waiting, so that they cannot be missed between the check
+  // of have_signal and the wait.
+  int pidfd = OpenPidFd(child_pid_);
+  sigset_t wait_mask;
+  if (pidfd != -1) {
+    sigset_t blocked;
+    sigemptyset(&blocked);
+    sigaddset(&blocked, SIGINT);
+    sigaddset(&blocked, SIGTERM);
+    sigprocmask(SIG_BLOCK, &blocked, &wait_mask);
+  }
+
   int child_status = 0;
   bool has_exited = false;
+  bool cpu_exceeded = false;
   struct rusage rusage {};
   int64_t limit = options_->wall_limit_millis;
+  // RLIMIT_CPU is in whole seconds, the child is killed as soon as it is seen
+  // going over the limit in milliseconds.
+  int64_t cpu_limit = options_->cpu_limit_millis;
+  int64_t cpu_time = 0;
   while (!limit || elapsed_millis() < limit) {
     if (have_signal) limit = 1;
     if (options_->memory_limit_kb != 0 &&
         memory_usage > options_->memory_limit_kb) {
       break;
     }
+    if (cpu_limit != 0 && CpuTimeMillis(&cpu_time) && cpu_time >= cpu_limit) {
+      cpu_exceeded = true;
+      break;
+    }
 #ifdef __APPLE__
     struct rusage rusage_prewait {};
     getrusage(RUSAGE_CHILDREN, &rusage_prewait);
@@ -362,6 +620,18 @@ bool Unix::Wait(ExecutionInfo* info, std::string* error_msg) {
       has_exited = true;
       break;
     }
+    if (pidfd != -1) {
+      int64_t timeout =
+          limit ? std::max<int64_t>(limit - elapsed_millis(), 0) : -1;
+      // The child cannot use less wall time than the cpu time it has left,
+      // unless it has many threads: then it is stopped a bit later.
+      if (cpu_limit != 0) {
+        int64_t cpu_left = std::max<int64_t>(cpu_limit - cpu_time, 1);
+        if (timeout < 0 || cpu_left < timeout) timeout = cpu_left;
+      }
+      WaitPidFd(pidfd, timeout, &wait_mask);
+      continue;
+    }
     std::this_thread::sleep_for(std::chrono::milliseconds(10));
 #ifdef __APPLE__
     int64_t mem;
@@ -370,13 +640,18 @@ bool Unix::Wait(ExecutionInfo* info, std::string* error_msg) {
     }
 #endif
   }
+  if (pidfd != -1) {
+    close(pidfd);
+    sigprocmask(SIG_SETMASK, &wait_mask, nullptr);
+  }
   if (!has_exited) {
 #ifdef __APPLE__
     struct rusage rusage_prewait {};
     getrusage(RUSAGE_CHILDREN, &rusage_prewait);
 #endif
-    if (limit != 0 || (options_->memory_limit_kb != 0 &&
-                       memory_usage > options_->memory_limit_kb)) {
+    if (limit != 0 || cpu_exceeded ||
+        (options_->memory_limit_kb != 0 &&
+         memory_usage > options_->memory_limit_kb)) {
       if (kill(child_pid_, SIGKILL) == -1) {
         // This should never happen.
         perror("kill");
@@ -395,6 +670,24 @@ bool Unix::Wait(ExecutionInfo* info, std::string* error_msg) {
 #endif
     wall_time = elapsed_millis();
   }
+  for (auto& capture : captures) {
+    if (capture) capture->Stop();
+  }
+  if (counter_fd != -1) {
+    uint64_t count = 0;
+    if (read(counter_fd, &count, sizeof(count)) == sizeof(count)) {
+      info->instructions = count;
+    }
+    close(counter_fd);
+  }
+  if (captures[0] && captures[0]->Captured()) {
+    info->stdout_captured = true;
+    info->stdout_data = std::move(captures[0]->Data());
+  }
+  if (captures[1] && captures[1]->Captured()) {
+    info->stderr_captured = true;
+    info->stderr_data = std::move(captures[1]->Data());
+  }
 #ifdef __APPLE__
   info->memory_usage_kb = memory_usage;
 #else
@@ -411,13 +704,13 @@ bool Unix::Wait(ExecutionInfo* info, std::string* error_msg) {
   info->sys_time_millis =
       rusage.ru_stime.tv_sec * 1000LL + rusage.ru_stime.tv_usec / 1000;
   if (info->signal != 0) {
-    strncpy(info->message, strsignal(info->signal), sizeof(info->message));
+    info->message = strsignal(info->signal);
   } else if (info->status_code != 0) {
-    strncpy(info->message, "Non-zero return code", sizeof(info->message));
+    info->message = "Non-zero return code";
   }
   if (have_signal) {
     info->killed_external = true;
-    strncpy(info->message, "Killed by external signal", sizeof(info->message));
+    info->message = "Killed by external signal";
   }
   OnFinish(info);
   return true;
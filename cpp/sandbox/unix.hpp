@@ -1,5 +1,6 @@
 #ifndef SANDBOX_UNIX_HPP
 #define SANDBOX_UNIX_HPP
+#include <vector>
 #include "sandbox/sandbox.hpp"
 
 namespace sandbox {
@@ -45,9 +46,20 @@ class Unix : public Sandbox {
   // "better" values, or perform clean up.
   virtual void OnFinish(ExecutionInfo* info) {}
 
+  // Cpu time, user and system, used so far by the running child. Returns
+  // false if it cannot be known, in which case only RLIMIT_CPU applies.
+  virtual bool CpuTimeMillis(int64_t* millis);
+
   int pipe_fds_[2] = {};
+  // Pipes of the captured standard output and error, or -1.
+  int capture_fds_[2][2] = {{-1, -1}, {-1, -1}};
+  // When counting instructions, the child waits on this pipe for the counter
+  // to be attached to it before calling exec.
+  int start_fds_[2] = {-1, -1};
   int child_pid_ = 0;
   const ExecutionOptions* options_ = nullptr;
+  // Arguments of the program, in the form taken by exec.
+  std::vector<char*> argv_;
 };
 
 }  // namespace sandbox
@@ -1,8 +1,12 @@
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <unistd.h>
+#include <cstdio>
 #include <cstdlib>
 #include <memory>
+#include <string>
+#include <vector>
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
 #include "sandbox/sandbox.hpp"
@@ -12,6 +16,7 @@ namespace {
 const char* test_tmpdir = "/tmp/task_maker_testdir";
 
 using ::testing::AnyOf;
+using ::testing::ElementsAre;
 using ::testing::Eq;
 using ::testing::StartsWith;
 
@@ -220,23 +225,35 @@ TEST(UnixTest, TestCpuLimitNotOk) {
   EXPECT_LE(info.cpu_time_millis + info.sys_time_millis, 1500);
 }
 
+// NOLINTNEXTLINE
+TEST(UnixTest, TestCpuLimitMillis) {
+  std::unique_ptr<Sandbox> sandbox = Sandbox::Create();
+  ASSERT_TRUE(sandbox);
+  ExecutionOptions options("sandbox/test", "busywait_arg1");
+  options.SetArgs({"10"});
+  // RLIMIT_CPU alone would stop it after 2 seconds.
+  options.cpu_limit_millis = 1200;
+  ExecutionInfo info;
+  std::string error_msg;
+  EXPECT_TRUE(sandbox->Execute(options, &info, &error_msg));
+  EXPECT_EQ(error_msg, "");
+  EXPECT_THAT(info.signal, AnyOf(Eq(SIGKILL), Eq(SIGXCPU)));
+  EXPECT_GE(info.cpu_time_millis + info.sys_time_millis, 1100);
+  EXPECT_LE(info.cpu_time_millis + info.sys_time_millis, 1600);
+}
+
 // NOLINTNEXTLINE
 TEST(UnixTest, TestIORedirect) {
   std::unique_ptr<Sandbox> sandbox = Sandbox::Create();
   ASSERT_TRUE(sandbox);
   ExecutionOptions options("sandbox/test", "copy_int");
   mkdir(test_tmpdir, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
-  strncpy(options.stdin_file, test_tmpdir, ExecutionOptions::str_len);
-  strncat(options.stdin_file, "/in", ExecutionOptions::str_len - 1);
-
-  strncpy(options.stdout_file, test_tmpdir, ExecutionOptions::str_len);
-  strncat(options.stdout_file, "/out", ExecutionOptions::str_len - 1);
-
-  strncpy(options.stderr_file, test_tmpdir, ExecutionOptions::str_len);
-  strncat(options.stderr_file, "/err", ExecutionOptions::str_len - 1);
+  options.stdin_file = std::string(test_tmpdir) + "/in";
+  options.stdout_file = std::string(test_tmpdir) + "/out";
+  options.stderr_file = std::string(test_tmpdir) + "/err";
 
   {
-    FILE* in = fopen(options.stdin_file, "w");  // NOLINT
+    FILE* in = fopen(options.stdin_file.c_str(), "w");  // NOLINT
     EXPECT_TRUE(in);
     EXPECT_EQ(fprintf(in, "10"), 2);
     EXPECT_EQ(fclose(in), 0);  // NOLINT
@@ -253,8 +270,8 @@ TEST(UnixTest, TestIORedirect) {
   int err = 0;
 
   {
-    FILE* fout = fopen(options.stdout_file, "r");  // NOLINT
-    FILE* ferr = fopen(options.stderr_file, "r");  // NOLINT
+    FILE* fout = fopen(options.stdout_file.c_str(), "r");  // NOLINT
+    FILE* ferr = fopen(options.stderr_file.c_str(), "r");  // NOLINT
     EXPECT_TRUE(fout);
     EXPECT_TRUE(ferr);
     EXPECT_EQ(fscanf(fout, "%d", &out), 1);
@@ -267,4 +284,112 @@ TEST(UnixTest, TestIORedirect) {
   EXPECT_EQ(err, 20);
 }
 
+// NOLINTNEXTLINE
+TEST(UnixTest, TestCapture) {
+  std::unique_ptr<Sandbox> sandbox = Sandbox::Create();
+  ASSERT_TRUE(sandbox);
+  ExecutionOptions options("sandbox/test", "copy_int");
+  mkdir(test_tmpdir, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
+  options.stdin_file = std::string(test_tmpdir) + "/in";
+  options.stdout_file = std::string(test_tmpdir) + "/captured_out";
+  options.stderr_file = std::string(test_tmpdir) + "/captured_err";
+  options.capture_stdout = true;
+  options.capture_stderr = true;
+  // The standard error is too long to be kept in memory.
+  options.capture_limit = 5;
+  remove(options.stdout_file.c_str());  // NOLINT
+  remove(options.stderr_file.c_str());  // NOLINT
+
+  {
+    FILE* in = fopen(options.stdin_file.c_str(), "w");  // NOLINT
+    EXPECT_TRUE(in);
+    EXPECT_EQ(fprintf(in, "5000"), 4);
+    EXPECT_EQ(fclose(in), 0);  // NOLINT
+  }
+
+  ExecutionInfo info;
+  std::string error_msg;
+  EXPECT_TRUE(sandbox->Execute(options, &info, &error_msg));
+  EXPECT_EQ(error_msg, "");
+  EXPECT_EQ(info.status_code, 0);
+  EXPECT_TRUE(info.stdout_captured);
+  EXPECT_EQ(info.stdout_data, "5000\n");
+  EXPECT_NE(access(options.stdout_file.c_str(), F_OK), 0);
+  EXPECT_FALSE(info.stderr_captured);
+
+  int err = 0;
+  FILE* ferr = fopen(options.stderr_file.c_str(), "r");  // NOLINT
+  ASSERT_TRUE(ferr);
+  EXPECT_EQ(fscanf(ferr, "%d", &err), 1);
+  EXPECT_EQ(fclose(ferr), 0);  // NOLINT
+  EXPECT_EQ(err, 10000);
+}
+
+// NOLINTNEXTLINE
+TEST(UnixTest, TestManyArgs) {
+  std::unique_ptr<Sandbox> sandbox = Sandbox::Create();
+  ASSERT_TRUE(sandbox);
+  ExecutionOptions options("sandbox/test", "return_arg1");
+  std::vector<std::string> args(100, "0");
+  args[0] = "7";
+  options.SetArgs(args);
+  ExecutionInfo info;
+  std::string error_msg;
+  EXPECT_TRUE(sandbox->Execute(options, &info, &error_msg));
+  EXPECT_EQ(error_msg, "");
+  EXPECT_EQ(info.status_code, 7);
+}
+
+// NOLINTNEXTLINE
+TEST(UnixTest, SerializeOptions) {
+  ExecutionOptions options("root", "exe");
+  options.SetArgs({"a", "b"});
+  options.SetCpus({1, 3});
+  options.stdin_file = "in";
+  options.memory_limit_kb = 1234;
+  options.prepare_executable = true;
+  options.count_instructions = true;
+  options.mounts.push_back({"store/a", "root/a", true});
+  ExecutionOptions parsed("", "");
+  ASSERT_TRUE(parsed.Parse(options.Serialize()));
+  EXPECT_EQ(parsed.root, "root");
+  EXPECT_EQ(parsed.executable, "exe");
+  EXPECT_THAT(parsed.args, ElementsAre("exe", "a", "b"));
+  EXPECT_THAT(parsed.cpus, ElementsAre(1, 3));
+  EXPECT_EQ(parsed.stdin_file, "in");
+  EXPECT_EQ(parsed.stdout_file, "");
+  EXPECT_EQ(parsed.memory_limit_kb, 1234);
+  EXPECT_TRUE(parsed.prepare_executable);
+  EXPECT_TRUE(parsed.count_instructions);
+  ASSERT_EQ(parsed.mounts.size(), 1);
+  EXPECT_EQ(parsed.mounts[0].source, "store/a");
+  EXPECT_EQ(parsed.mounts[0].target, "root/a");
+  EXPECT_TRUE(parsed.mounts[0].executable);
+  std::string data = options.Serialize();
+  EXPECT_FALSE(parsed.Parse(data.substr(0, data.size() - 1)));
+}
+
+// NOLINTNEXTLINE
+TEST(UnixTest, SerializeInfo) {
+  ExecutionInfo info;
+  info.cpu_time_millis = 10;
+  info.signal = 9;
+  info.instructions = 12345;
+  info.killed = true;
+  info.message = "Killed";
+  info.stdout_captured = true;
+  info.stdout_data = "out";
+  ExecutionInfo parsed;
+  ASSERT_TRUE(parsed.Parse(info.Serialize()));
+  EXPECT_EQ(parsed.cpu_time_millis, 10);
+  EXPECT_EQ(parsed.signal, 9);
+  EXPECT_EQ(parsed.instructions, 12345);
+  EXPECT_TRUE(parsed.killed);
+  EXPECT_FALSE(parsed.killed_external);
+  EXPECT_EQ(parsed.message, "Killed");
+  EXPECT_TRUE(parsed.stdout_captured);
+  EXPECT_EQ(parsed.stdout_data, "out");
+  EXPECT_FALSE(parsed.stderr_captured);
+}
+
 }  // namespace
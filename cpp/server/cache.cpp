@@ -2,319 +2,639 @@
 #include <capnp/message.h>
 #include <capnp/serialize.h>
 #include <kj/debug.h>
+#include <string.h>
 #include <algorithm>
+#include <atomic>
+#include <exception>
 #include <fstream>
+#include <numeric>
 #include <stdexcept>
-#include "capnp/cache.capnp.h"
+#include <thread>
+#include <unordered_set>
 #include "util/file.hpp"
 #include "util/flags.hpp"
+#include "util/journal.hpp"
+#include "util/metrics.hpp"
+#include "util/reclaimer.hpp"
 
 namespace server {
 namespace detail {
-template <class T>
-inline void hash_combine(std::size_t* hash, const T& v) {
-  std::hash<T> hasher;
-  *hash ^= hasher(v) + 0x9e3779b9 + (*hash << 6) + (*hash >> 2);
+// Feeds a canonical encoding of request fields to a SHA256 hasher. Variable
+// length fields are prefixed by their length, so that distinct sequences of
+// fields never produce the same byte stream.
+class DigestBuilder {
+ public:
+  void Add(uint64_t value) {
+    uint8_t buf[sizeof(value)];
+    for (size_t i = 0; i < sizeof(value); i++) buf[i] = value >> (8 * i);
+    hasher_.update(buf, sizeof(buf));
+  }
+
+  void Add(float value) {
+    uint32_t bits;
+    static_assert(sizeof(bits) == sizeof(value), "Unexpected float size");
+    memcpy(&bits, &value, sizeof(bits));
+    Add(static_cast<uint64_t>(bits));
+  }
+
+  void Add(kj::StringPtr str) {
+    Add(static_cast<uint64_t>(str.size()));
+    hasher_.update(reinterpret_cast<const unsigned char*>(str.begin()),
+                   str.size());
+  }
+
+  void Add(capnproto::SHA256::Reader hash) {
+    Add(hash.getData0());
+    Add(hash.getData1());
+    Add(hash.getData2());
+    Add(hash.getData3());
+  }
+
+  void Add(capnproto::FileInfo::Reader info) {
+    Add(info.getName());
+    Add(info.getHash());
+    Add(static_cast<uint64_t>(info.getExecutable()));
+  }
+
+  util::SHA256_t Finalize() { return hasher_.finalize(); }
+
+ private:
+  util::SHA256 hasher_;
+};
+
+// Returns the indices of the elements of the list, sorted by name.
+template <typename List, typename GetName>
+std::vector<uint32_t> SortedByName(List list, GetName get_name) {
+  std::vector<uint32_t> indices(list.size());
+  std::iota(indices.begin(), indices.end(), 0);
+  std::sort(indices.begin(), indices.end(), [&](uint32_t a, uint32_t b) {
+    return get_name(list[a]) < get_name(list[b]);
+  });
+  return indices;
 }
 
-uint64_t RequestHasher::operator()(capnproto::Request::Reader reader_) const {
-  size_t hash = reader_.getProcesses().size();
-  for (auto reader : reader_.getProcesses()) {
-    hash_combine(&hash, static_cast<int>(reader.getExecutable().which()));
-    switch (reader.getExecutable().which()) {
-      case capnproto::ProcessRequest::Executable::SYSTEM:
-        hash_combine(&hash, std::string(reader.getExecutable().getSystem()));
-        break;
-      case capnproto::ProcessRequest::Executable::LOCAL_FILE:
-        hash_combine(
-            &hash,
-            std::string(reader.getExecutable().getLocalFile().getName()));
-        hash_combine(&hash, util::SHA256_t(
-                                reader.getExecutable().getLocalFile().getHash())
-                                .Hex());
-        break;
-    }
-    for (std::string arg : reader.getArgs()) {
-      hash_combine(&hash, arg);
-    }
-    hash_combine(&hash, static_cast<int>(reader.getStdin().which()));
-    switch (reader.getStdin().which()) {
-      case capnproto::ProcessRequest::Stdin::FIFO:
-        hash_combine(&hash, reader.getStdin().getFifo());
-        break;
-      case capnproto::ProcessRequest::Stdin::HASH:
-        hash_combine(&hash, util::SHA256_t(reader.getStdin().getHash()).Hex());
-        break;
-    }
-    hash_combine(&hash, reader.getStdout());
-    hash_combine(&hash, reader.getStderr());
-    // TODO: be consistent if the files are permuted.
-    for (auto in : reader.getInputFiles()) {
-      hash_combine(&hash, std::string(in.getName()));
-      hash_combine(&hash, util::SHA256_t(in.getHash()).Hex());
-      hash_combine(&hash, in.getExecutable());
+// Returns the hashes of the files referenced by the request, followed by the
+// ones of the files produced by the result.
+std::vector<util::SHA256_t> Hashes(capnproto::Request::Reader req_,
+                                   capnproto::Result::Reader res_,
+                                   size_t* num_inputs) {
+  std::vector<util::SHA256_t> ans;
+  auto add = [&ans](util::SHA256_t hash) {
+    if (!hash.isZero()) ans.push_back(hash);
+  };
+  for (auto req : req_.getProcesses()) {
+    if (req.getStdin().isHash()) {
+      add(req.getStdin().getHash());
     }
-    for (std::string out : reader.getOutputFiles()) {
-      hash_combine(&hash, out);
+    if (req.getExecutable().isLocalFile()) {
+      add(req.getExecutable().getLocalFile().getHash());
     }
-    for (auto in : reader.getFifos()) {
-      hash_combine(&hash, std::string(in.getName()));
-      hash_combine(&hash, in.getId());
+    for (auto f : req.getInputFiles()) add(f.getHash());
+  }
+  *num_inputs = ans.size();
+  for (auto res : res_.getProcesses()) {
+    add(res.getStdout());
+    add(res.getStderr());
+    for (auto f : res.getOutputFiles()) add(f.getHash());
+    for (auto item : res.getBatch()) {
+      add(item.getStdout());
+      add(item.getStderr());
     }
-    hash_combine(&hash, reader.getLimits().getCpuTime());
-    hash_combine(&hash, reader.getLimits().getWallTime());
-    hash_combine(&hash, reader.getLimits().getMemory());
-    hash_combine(&hash, reader.getLimits().getNproc());
-    hash_combine(&hash, reader.getLimits().getNofiles());
-    hash_combine(&hash, reader.getLimits().getFsize());
-    hash_combine(&hash, reader.getLimits().getMemlock());
-    hash_combine(&hash, reader.getLimits().getStack());
-    hash_combine(&hash, reader.getExtraTime());
-  }
-  hash_combine(&hash, reader_.getExclusive());
-  return hash;
+  }
+  return ans;
+};
+
+// Returns the time in seconds that is needed to compute the result again. All
+// the processes of a request have to be executed again to produce any of its
+// outputs.
+double Cost(capnproto::Result::Reader res_) {
+  double cost = 0;
+  for (auto res : res_.getProcesses()) {
+    auto usage = res.getResourceUsage();
+    cost += std::max(usage.getCpuTime() + usage.getSysTime(),
+                     usage.getWallTime());
+  }
+  return cost;
 }
-bool RequestComparator::operator()(capnproto::Request::Reader a_,
-                                   capnproto::Request::Reader b_) const {
-  if (a_.getProcesses().size() != b_.getProcesses().size()) return false;
-  if (a_.getExclusive() != b_.getExclusive()) return false;
-  for (size_t i = 0; i < a_.getProcesses().size(); i++) {
-    auto a = a_.getProcesses()[i];
-    auto b = b_.getProcesses()[i];
-    if (a.getExecutable().which() != b.getExecutable().which()) return false;
-    switch (a.getExecutable().which()) {
+
+}  // namespace detail
+
+util::SHA256_t RequestDigest(capnproto::Request::Reader req) {
+  detail::DigestBuilder digest;
+  digest.Add(static_cast<uint64_t>(req.getExclusive()));
+  digest.Add(static_cast<uint64_t>(req.getProcesses().size()));
+  for (auto process : req.getProcesses()) {
+    auto executable = process.getExecutable();
+    digest.Add(static_cast<uint64_t>(executable.which()));
+    switch (executable.which()) {
       case capnproto::ProcessRequest::Executable::SYSTEM:
-        if (a.getExecutable().getSystem() != b.getExecutable().getSystem()) {
-          return false;
-        }
+        digest.Add(executable.getSystem());
         break;
       case capnproto::ProcessRequest::Executable::LOCAL_FILE:
-        if (a.getExecutable().getLocalFile().getName() !=
-            b.getExecutable().getLocalFile().getName()) {
-          return false;
-        }
-        if (util::SHA256_t(a.getExecutable().getLocalFile().getHash()).Hex() !=
-            util::SHA256_t(b.getExecutable().getLocalFile().getHash()).Hex()) {
-          return false;
-        }
+        digest.Add(executable.getLocalFile());
         break;
     }
-    auto aargs = a.getArgs();
-    auto bargs = b.getArgs();
-    for (size_t i = 0; i < aargs.size(); i++) {
-      if (aargs[i] != bargs[i]) return false;
+    digest.Add(static_cast<uint64_t>(process.getArgs().size()));
+    for (auto arg : process.getArgs()) {
+      digest.Add(arg);
     }
-    if (a.getStdin().which() != b.getStdin().which()) {
-      return false;
-    }
-    switch (a.getStdin().which()) {
+    digest.Add(static_cast<uint64_t>(process.getStdin().which()));
+    switch (process.getStdin().which()) {
       case capnproto::ProcessRequest::Stdin::FIFO:
-        if (a.getStdin().getFifo() != b.getStdin().getFifo()) {
-          return false;
-        }
+        digest.Add(static_cast<uint64_t>(process.getStdin().getFifo()));
         break;
       case capnproto::ProcessRequest::Stdin::HASH:
-        if (util::SHA256_t(a.getStdin().getHash()).Hex() !=
-            util::SHA256_t(b.getStdin().getHash()).Hex()) {
-          return false;
-        }
+        digest.Add(process.getStdin().getHash());
         break;
     }
-    if (a.getStdout() != b.getStdout()) return false;
-    if (a.getStderr() != b.getStderr()) return false;
-    std::vector<std::tuple<std::string, std::string, bool>> ainput;
-    std::vector<std::tuple<std::string, std::string, bool>> binput;
-    for (auto in : a.getInputFiles()) {
-      ainput.emplace_back(in.getName(), util::SHA256_t(in.getHash()).Hex(),
-                          in.getExecutable());
-    }
-    for (auto in : b.getInputFiles()) {
-      binput.emplace_back(in.getName(), util::SHA256_t(in.getHash()).Hex(),
-                          in.getExecutable());
-    }
-    std::sort(ainput.begin(), ainput.end());
-    std::sort(binput.begin(), binput.end());
-    if (ainput != binput) return false;
-    std::vector<std::tuple<std::string, uint32_t>> afifo;
-    std::vector<std::tuple<std::string, uint32_t>> bfifo;
-    for (auto f : a.getFifos()) {
-      afifo.emplace_back(f.getName(), f.getId());
-    }
-    for (auto f : b.getFifos()) {
-      bfifo.emplace_back(f.getName(), f.getId());
-    }
-    std::sort(afifo.begin(), afifo.end());
-    std::sort(bfifo.begin(), bfifo.end());
-    if (afifo != bfifo) return false;
-    std::vector<std::string> aoutput;
-    std::vector<std::string> boutput;
-    for (auto out : a.getOutputFiles()) {
-      aoutput.emplace_back(out);
-    }
-    for (auto out : b.getOutputFiles()) {
-      boutput.emplace_back(out);
-    }
-    std::sort(aoutput.begin(), aoutput.end());
-    std::sort(boutput.begin(), boutput.end());
-    if (aoutput != boutput) return false;
-    if (a.getLimits().getCpuTime() != b.getLimits().getCpuTime()) {
-      return false;
-    }
-    if (a.getLimits().getWallTime() != b.getLimits().getWallTime()) {
-      return false;
-    }
-    if (a.getLimits().getMemory() != b.getLimits().getMemory()) {
-      return false;
-    }
-    if (a.getLimits().getNproc() != b.getLimits().getNproc()) {
-      return false;
+    digest.Add(static_cast<uint64_t>(process.getStdout()));
+    digest.Add(static_cast<uint64_t>(process.getStderr()));
+
+    auto inputs = process.getInputFiles();
+    digest.Add(static_cast<uint64_t>(inputs.size()));
+    auto input_name = [](capnproto::FileInfo::Reader f) { return f.getName(); };
+    for (uint32_t i : detail::SortedByName(inputs, input_name)) {
+      digest.Add(inputs[i]);
     }
-    if (a.getLimits().getNofiles() != b.getLimits().getNofiles()) {
-      return false;
+    auto outputs = process.getOutputFiles();
+    digest.Add(static_cast<uint64_t>(outputs.size()));
+    auto output_name = [](capnp::Text::Reader name) { return name; };
+    for (uint32_t i : detail::SortedByName(outputs, output_name)) {
+      digest.Add(outputs[i]);
     }
-    if (a.getLimits().getFsize() != b.getLimits().getFsize()) {
-      return false;
+    auto fifos = process.getFifos();
+    digest.Add(static_cast<uint64_t>(fifos.size()));
+    auto fifo_name = [](capnproto::FifoInfo::Reader f) { return f.getName(); };
+    for (uint32_t i : detail::SortedByName(fifos, fifo_name)) {
+      digest.Add(fifos[i].getName());
+      digest.Add(static_cast<uint64_t>(fifos[i].getId()));
+      digest.Add(static_cast<uint64_t>(fifos[i].getShared()));
     }
-    if (a.getLimits().getMemory() != b.getLimits().getMemory()) {
-      return false;
+    auto batch = process.getBatch();
+    digest.Add(static_cast<uint64_t>(batch.size()));
+    for (auto item : batch) {
+      digest.Add(static_cast<uint64_t>(item.size()));
+      for (auto arg : item) digest.Add(arg);
     }
-    if (a.getLimits().getStack() != b.getLimits().getStack()) {
-      return false;
+
+    auto limits = process.getLimits();
+    digest.Add(limits.getCpuTime());
+    digest.Add(limits.getWallTime());
+    digest.Add(limits.getMemory());
+    digest.Add(static_cast<uint64_t>(limits.getNproc()));
+    digest.Add(static_cast<uint64_t>(limits.getNofiles()));
+    digest.Add(limits.getFsize());
+    digest.Add(limits.getMemlock());
+    digest.Add(limits.getStack());
+    digest.Add(limits.getInstructions());
+    digest.Add(process.getExtraTime());
+  }
+  digest.Add(static_cast<uint64_t>(req.getStreams().size()));
+  for (uint32_t stream : req.getStreams()) {
+    digest.Add(static_cast<uint64_t>(stream));
+  }
+  return digest.Finalize();
+}
+
+namespace {
+// Minimum number of entries in the log before it is compacted.
+const constexpr size_t kMinCompactionEntries = 1024;
+// Words allocated for a new entry on top of the sizes of its parts, that are
+// dropped if they are not used.
+const constexpr size_t kEntrySlackWords = 8;
+
+capnp::ReaderOptions EntryReaderOptions() {
+  capnp::ReaderOptions options;
+  // Entries are read many times during the lifetime of the server.
+  options.traversalLimitInWords = kj::maxValue;
+  return options;
+}
+
+kj::ArrayPtr<const capnp::word> AsWords(kj::ArrayPtr<const kj::byte> data) {
+  return kj::ArrayPtr<const capnp::word>(
+      reinterpret_cast<const capnp::word*>(data.begin()),  // NOLINT
+      data.size() / sizeof(capnp::word));
+}
+
+// Calls f with the serialized form and a reader of every message in data,
+// which are either bare or in util::Journal records. Everything from the
+// first truncated or corrupted message on is ignored.
+template <typename F>
+void ForEachMessage(kj::ArrayPtr<const kj::byte> data, F f) {
+  while (data.size() > 0) {
+    kj::ArrayPtr<const capnp::word> words = AsWords(data);
+    size_t record_size = 0;
+    if (util::Journal::IsRecord(data)) {
+      KJ_IF_MAYBE(payload, util::Journal::ReadRecord(data, &record_size)) {
+        words = AsWords(*payload);
+      } else {
+        KJ_LOG(WARNING, "Truncated or corrupted cache entry");
+        break;
+      }
     }
-    if (a.getExtraTime() != b.getExtraTime()) {
-      return false;
+    kj::Own<capnp::FlatArrayMessageReader> reader;
+    KJ_IF_MAYBE(exc, kj::runCatchingExceptions([&]() {
+                  reader = kj::heap<capnp::FlatArrayMessageReader>(
+                      words, EntryReaderOptions());
+                  // Make sure that the message is valid.
+                  reader->getRoot<capnproto::CacheEntry>().totalSize();
+                })) {
+      KJ_LOG(WARNING, "Invalid cache entry", *exc);
+      break;
     }
+    size_t size = reader->getEnd() - words.begin();
+    f(words.slice(0, size), std::move(reader));
+    if (record_size == 0) record_size = size * sizeof(capnp::word);
+    data = data.slice(record_size, data.size());
   }
-  return true;
 }
+}  // namespace
 
-std::vector<util::SHA256_t> Hashes(capnproto::Request::Reader req_,
-                                   capnproto::Result::Reader res_) {
-  std::vector<util::SHA256_t> ans;
-  auto add = [&ans](util::SHA256_t hash) {
-    if (!hash.isZero()) ans.push_back(hash);
+CacheManager::CacheManager() {
+  size_t load_order = 0;
+  auto load = [this, &load_order](kj::ArrayPtr<const capnp::word> words,
+                                  kj::Own<capnp::MessageReader> reader) {
+    Entry entry;
+    entry.words = words;
+    entry.entry = reader->getRoot<capnproto::CacheEntry>();
+    entry.reader = std::move(reader);
+    entry.files = detail::Hashes(entry.entry.getRequest(),
+                                 entry.entry.getResult(), &entry.num_inputs);
+    entry.cost = detail::Cost(entry.entry.getResult());
+    entry.last_used = load_order++;
+    util::SHA256_t digest = entry.entry.hasDigest()
+                                ? util::SHA256_t(entry.entry.getDigest())
+                                : RequestDigest(entry.entry.getRequest());
+    // Later entries replace earlier ones with the same digest.
+    data_[digest.Key()] = std::move(entry);
   };
-  for (auto req : req_.getProcesses()) {
-    if (req.getStdin().isHash()) {
-      add(req.getStdin().getHash());
-    }
-    if (req.getExecutable().isLocalFile()) {
-      add(req.getExecutable().getLocalFile().getHash());
-    }
-    for (auto f : req.getInputFiles()) add(f.getHash());
+  if (util::File::Exists(SnapshotPath())) {
+    mappings_.push_back(kj::heap<util::MappedFile>(SnapshotPath()));
+    ForEachMessage(mappings_.back()->Data(), load);
   }
-  for (auto res : res_.getProcesses()) {
-    add(res.getStdout());
-    add(res.getStderr());
-    for (auto f : res.getOutputFiles()) add(f.getHash());
+  if (util::File::Exists(Path())) {
+    mappings_.push_back(kj::heap<util::MappedFile>(Path()));
+    ForEachMessage(mappings_.back()->Data(),
+                   [this, &load](kj::ArrayPtr<const capnp::word> words,
+                                 kj::Own<capnp::MessageReader> reader) {
+                     log_entries_++;
+                     load(words, std::move(reader));
+                   });
   }
-  return ans;
-};
 
-}  // namespace detail
-
-CacheManager::CacheManager() {
-  std::ifstream fin(Path());
-  if (fin) {
-    kj::std::StdInputStream is(fin);
-    while (true) {
-      try {
-        builders_.emplace_back(kj::heap<capnp::MallocMessageBuilder>());
-        capnp::readMessageCopy(is, *builders_.back());
-        auto entry = builders_.back()->getRoot<capnproto::CacheEntry>();
-        bool missing_files = false;
-        for (const auto& hash :
-             detail::Hashes(entry.getRequest(), entry.getResult())) {
-          int64_t fsz;
-          if ((fsz = util::File::Size(util::File::PathForHash(hash))) < 0) {
-            missing_files = true;
-            break;
-          }
-        }
-        if (missing_files) continue;
-        for (const auto& hash :
-             detail::Hashes(entry.getRequest(), entry.getResult())) {
-          size_t fsz = util::File::Size(util::File::PathForHash(hash));
-          if (!file_sizes_.count(hash)) {
-            file_sizes_.emplace(hash, fsz);
-            total_size_ += fsz;
-          }
-          file_access_times_[hash] = last_access_time_++;
-        }
-        for (const auto& kv : file_access_times_) {
-          sorted_files_.emplace(kv.second, kv.first);
-        }
-        data_.emplace(entry.getRequest(), entry.getResult());
-      } catch (kj::Exception& exc) {
+  // Only check once per file if it is still present, dropping entries that
+  // refer to files that are not in the store anymore.
+  std::unordered_map<util::SHA256_t, size_t, util::SHA256_t::Hasher> sizes;
+  std::vector<std::pair<size_t, Entry*>> live;
+  for (auto it = data_.begin(); it != data_.end();) {
+    bool missing_files = false;
+    for (const auto& hash : it->second.files) {
+      if (sizes.count(hash)) continue;
+      int64_t fsz = files_.StoreSize(hash);
+      if (fsz < 0) {
+        missing_files = true;
         break;
       }
+      sizes.emplace(hash, fsz);
+    }
+    if (missing_files) {
+      it = data_.erase(it);
+      continue;
     }
-    fin.close();
+    live.emplace_back(it->second.last_used, &it->second);
+    ++it;
+  }
+  std::sort(live.begin(), live.end());
+  for (const auto& kv : live) {
+    kv.second->last_used = last_access_time_++;
+    AddFiles(*kv.second, sizes);
   }
   util::File::MakeDirs(Flags::store_directory);
-  fout_.open(Path(), std::ios_base::out | std::ios_base::app);
+  journal_ = kj::heap<util::Journal>(Path());
+  MaybeCompact();
 }
 
-bool CacheManager::Has(capnproto::Request::Reader req) {
-  if (!data_.count(req)) return false;
-  for (const auto& hash : detail::Hashes(req, data_.at(req))) {
-    if (!file_sizes_.count(hash)) return false;
+CacheManager::~CacheManager() {
+  if (log_entries_ == 0 && pending_.empty()) return;
+  KJ_IF_MAYBE(exc, kj::runCatchingExceptions([this]() { Compact(); })) {
+    KJ_LOG(WARNING, "Failed to compact the cache", *exc);
+  }
+}
+
+kj::Maybe<capnproto::Result::Reader> CacheManager::Lookup(
+    capnproto::Request::Reader req) {
+  static util::Counter* hits =
+      util::Metrics::GetCounter("cache_hits_total", "Cache lookups that hit");
+  static util::Counter* misses = util::Metrics::GetCounter(
+      "cache_misses_total", "Cache lookups that missed");
+  FlushDurable();
+  auto it = data_.find(RequestDigest(req).Key());
+  if (it == data_.end() || !HasFiles(it->second)) {
+    misses->Add();
+    return nullptr;
+  }
+  hits->Add();
+  it->second.last_used = last_access_time_++;
+  for (const auto& hash : it->second.files) {
+    files_.Touch(hash);
+  }
+  return it->second.entry.getResult();
+}
+
+void CacheManager::AddFiles(
+    const Entry& entry,
+    const std::unordered_map<util::SHA256_t, size_t, util::SHA256_t::Hasher>&
+        sizes) {
+  for (size_t i = 0; i < entry.files.size(); i++) {
+    const auto& hash = entry.files[i];
+    // Inputs are provided by the frontends, so the only way to get them back
+    // is copying them again.
+    files_.Add(hash, sizes.at(hash), i < entry.num_inputs ? 0 : entry.cost);
   }
-  return true;
 }
 
-capnproto::Result::Reader CacheManager::Get(capnproto::Request::Reader req) {
-  for (const auto& hash : detail::Hashes(req, data_.at(req))) {
-    sorted_files_.erase(file_access_times_.at(hash));
-    file_access_times_[hash] = last_access_time_++;
-    sorted_files_.emplace(file_access_times_[hash], hash);
+bool CacheManager::HasFiles(const Entry& entry) const {
+  for (size_t i = entry.num_inputs; i < entry.files.size(); i++) {
+    if (!files_.Contains(entry.files[i])) return false;
   }
-  return data_.at(req);
+  return true;
+}
+
+void CacheManager::AddStored(const util::SHA256_t& hash) {
+  int64_t size = files_.StoreSize(hash);
+  if (size < 0) return;
+  files_.Add(hash, size);
+  files_.Evict();
 }
 
 void CacheManager::Set(capnproto::Request::Reader req,
                        capnproto::Result::Reader res) {
-  if (Has(req)) return;
-  for (const auto& hash : detail::Hashes(req, res)) {
-    if (!file_sizes_.count(hash)) {
-      size_t sz = util::File::Size(util::File::PathForHash(hash));
-      total_size_ += sz;
-      file_sizes_.emplace(hash, sz);
-    } else {
-      sorted_files_.erase(file_access_times_.at(hash));
+  util::SHA256_t digest = RequestDigest(req);
+  auto it = data_.find(digest.Key());
+  if (it != data_.end() && HasFiles(it->second)) return;
+  Entry entry;
+  entry.files = detail::Hashes(req, res, &entry.num_inputs);
+  entry.cost = detail::Cost(res);
+  entry.last_used = last_access_time_++;
+  std::unordered_map<util::SHA256_t, size_t, util::SHA256_t::Hasher> sizes;
+  size_t output_size = 0;
+  for (size_t i = 0; i < entry.files.size(); i++) {
+    const auto& hash = entry.files[i];
+    if (sizes.count(hash)) continue;
+    int64_t sz = files_.StoreSize(hash);
+    if (sz < 0) {
+      KJ_LOG(WARNING, "File missing from the store", hash.Hex());
+      return;
     }
-    file_access_times_[hash] = last_access_time_++;
-    sorted_files_.emplace(file_access_times_[hash], hash);
-  }
-  while (Flags::cache_size != 0 &&
-         total_size_ > 1024ULL * 1024 * Flags::cache_size) {
-    KJ_ASSERT(!sorted_files_.empty());
-    auto to_del = sorted_files_.begin()->second;
-    try {
-      util::File::Remove(util::File::PathForHash(to_del));
-    } catch (...) {
-      // If we could not remove the file, skip shrinking the cache.
-      break;
+    sizes.emplace(hash, sz);
+    if (i >= entry.num_inputs) output_size += sz;
+  }
+  // The files are tracked even if the entry is not admitted, since they are
+  // in the store anyway.
+  AddFiles(entry, sizes);
+  files_.Evict();
+  // Do not admit results that are cheaper to compute again than to read back
+  // from the store.
+  if (entry.cost < util::EvictionQueue::MinCost(output_size)) return;
+  KJ_ASSERT(HasFiles(entry), "Cache size is too small!");
+  {
+    // The entry is built directly in its serialized form, a single segment
+    // that the sizes of the request and of the result bound, instead of being
+    // copied once more by messageToFlatArray.
+    size_t size = 1 + capnp::sizeInWords<capnproto::CacheEntry>() +
+                  req.totalSize().wordCount + res.totalSize().wordCount +
+                  capnp::sizeInWords<capnproto::SHA256>() + kEntrySlackWords;
+    entry.owned = kj::heapArray<capnp::word>(1 + size);
+    memset(entry.owned.begin(), 0, entry.owned.asBytes().size());
+    capnp::FlatMessageBuilder message(entry.owned.slice(1, 1 + size));
+    auto builder = message.initRoot<capnproto::CacheEntry>();
+    builder.setRequest(req);
+    builder.setResult(res);
+    digest.ToCapnp(builder.initDigest());
+    size_t used = message.getSegmentsForOutput()[0].size();
+    // The segment table of a single segment is a zero and the size of the
+    // segment, both 32 bits little endian.
+    kj::byte* table = entry.owned.asBytes().begin();
+    for (size_t i = 0; i < 4; i++) table[4 + i] = (used >> (8 * i)) & 0xff;
+    entry.words = entry.owned.slice(0, 1 + used);
+  }
+  entry.reader = kj::heap<capnp::FlatArrayMessageReader>(entry.words,
+                                                         EntryReaderOptions());
+  entry.entry = entry.reader->getRoot<capnproto::CacheEntry>();
+  data_[digest.Key()] = std::move(entry);
+  pending_.emplace_back(util::File::WriteEpoch(), digest.Key());
+  FlushDurable();
+  MaybeCompact();
+}
+
+void CacheManager::FlushDurable() {
+  uint64_t durable = util::File::DurableEpoch();
+  while (!pending_.empty() && pending_.front().first <= durable) {
+    auto it = data_.find(pending_.front().second);
+    pending_.pop_front();
+    if (it == data_.end()) continue;
+    journal_->Append(it->second.words.asBytes());
+    log_entries_++;
+  }
+}
+
+void CacheManager::MaybeCompact() {
+  // Compacting after at least as many new entries as there are live ones
+  // keeps the amortized cost of compaction constant per entry.
+  if (log_entries_ < std::max(kMinCompactionEntries, data_.size())) return;
+  Compact();
+}
+
+void CacheManager::Compact() {
+  std::vector<std::pair<size_t, Entry*>> live;
+  for (auto it = data_.begin(); it != data_.end();) {
+    if (!HasFiles(it->second)) {
+      it = data_.erase(it);
+      continue;
+    }
+    live.emplace_back(it->second.last_used, &it->second);
+    ++it;
+  }
+  std::sort(live.begin(), live.end());
+  auto snapshot = util::File::Write(SnapshotPath(), /*overwrite=*/true);
+  for (const auto& kv : live) {
+    snapshot(kv.second->words.asBytes());
+  }
+  snapshot({});
+  // The snapshot and the files of all the entries must be on disk before the
+  // log is truncated.
+  util::File::Sync();
+  pending_.clear();
+
+  // Make all the entries point inside the new snapshot, so that the old
+  // mappings and the owned copies can be released.
+  auto mapping = kj::heap<util::MappedFile>(SnapshotPath());
+  size_t pos = 0;
+  ForEachMessage(mapping->Data(),
+                 [&live, &pos](kj::ArrayPtr<const capnp::word> words,
+                               kj::Own<capnp::MessageReader> reader) {
+                   KJ_ASSERT(pos < live.size(), "Corrupted snapshot");
+                   Entry* entry = live[pos++].second;
+                   entry->words = words;
+                   entry->entry = reader->getRoot<capnproto::CacheEntry>();
+                   entry->reader = std::move(reader);
+                   entry->owned = nullptr;
+                 });
+  KJ_ASSERT(pos == live.size(), "Corrupted snapshot");
+  mappings_.clear();
+  mappings_.push_back(std::move(mapping));
+
+  // A crash here only leaves duplicate entries in the log, that are
+  // discarded when loading.
+  journal_ = nullptr;
+  journal_ = kj::heap<util::Journal>(Path(), /*truncate=*/true);
+  log_entries_ = 0;
+}
+
+size_t CacheManager::Export(const std::string& path,
+                            const std::vector<util::SHA256_t>& roots) {
+  std::vector<std::pair<size_t, const Entry*>> live;
+  for (const auto& kv : data_) {
+    if (HasFiles(kv.second)) live.emplace_back(kv.second.last_used, &kv.second);
+  }
+  std::sort(live.begin(), live.end());
+  std::vector<bool> selected(live.size(), roots.empty());
+  if (!roots.empty()) {
+    // The outputs of the selected entries are the inputs of the next ones,
+    // like the compiled solutions are of their evaluations.
+    std::unordered_set<util::SHA256_t, util::SHA256_t::Hasher> reached(
+        roots.begin(), roots.end());
+    for (bool changed = true; changed;) {
+      changed = false;
+      for (size_t i = 0; i < live.size(); i++) {
+        const Entry& entry = *live[i].second;
+        if (selected[i]) continue;
+        auto inputs_end = entry.files.begin() + entry.num_inputs;
+        if (std::none_of(entry.files.begin(), inputs_end,
+                         [&reached](const util::SHA256_t& hash) {
+                           return reached.count(hash) != 0;
+                         })) {
+          continue;
+        }
+        selected[i] = changed = true;
+        reached.insert(inputs_end, entry.files.end());
+      }
+    }
+  }
+
+  std::vector<const Entry*> entries;
+  std::vector<std::pair<util::SHA256_t, uint64_t>> files;
+  std::unordered_set<util::SHA256_t, util::SHA256_t::Hasher> seen;
+  for (size_t i = 0; i < live.size(); i++) {
+    if (!selected[i]) continue;
+    const Entry& entry = *live[i].second;
+    std::vector<std::pair<util::SHA256_t, uint64_t>> entry_files;
+    bool missing_files = false;
+    for (const auto& hash : entry.files) {
+      if (seen.count(hash)) continue;
+      // The inputs are not tracked by the cache, and may be gone.
+      int64_t size = util::File::StoreSize(hash);
+      if (size < 0) {
+        missing_files = true;
+        break;
+      }
+      entry_files.emplace_back(hash, size);
     }
-    sorted_files_.erase(sorted_files_.begin());
-    total_size_ -= file_sizes_.at(to_del);
-    file_sizes_.erase(to_del);
-    file_access_times_.erase(to_del);
-  }
-  for (const auto& hash : detail::Hashes(req, res)) {
-    KJ_ASSERT(file_sizes_.count(hash), "Cache size is too small!");
-  }
-  builders_.emplace_back(kj::heap<capnp::MallocMessageBuilder>());
-  auto entry = builders_.back()->getRoot<capnproto::CacheEntry>();
-  entry.setRequest(req);
-  entry.setResult(res);
-  data_.emplace(entry.getRequest(), entry.getResult());
-  capnp::writeMessage(os_, *builders_.back());
-  fout_.flush();
+    if (missing_files) continue;
+    entries.push_back(&entry);
+    for (auto& file : entry_files) {
+      if (seen.insert(file.first).second) files.push_back(std::move(file));
+    }
+  }
+
+  capnp::MallocMessageBuilder builder;
+  auto bundle = builder.initRoot<capnproto::CacheBundle>();
+  auto bundle_entries = bundle.initEntries(entries.size());
+  for (size_t i = 0; i < entries.size(); i++) {
+    bundle_entries.setWithCaveats(i, entries[i]->entry);
+  }
+  auto bundle_files = bundle.initFiles(files.size());
+  for (size_t i = 0; i < files.size(); i++) {
+    files[i].first.ToCapnp(bundle_files[i].initHash());
+    bundle_files[i].setSize(files[i].second);
+  }
+  auto receiver = util::File::Write(path, /*overwrite=*/true);
+  receiver(capnp::messageToFlatArray(builder).asBytes());
+  for (const auto& file : files) {
+    uint64_t written = 0;
+    auto producer = util::File::ReadFromStore(file.first);
+    for (util::File::Chunk chunk = producer(); chunk.size() != 0;
+         chunk = producer()) {
+      written += chunk.size();
+      receiver(chunk);
+    }
+    KJ_ASSERT(written == file.second, "File changed in the store",
+              file.first.Hex());
+  }
+  receiver({});
+  return entries.size();
+}
+
+size_t CacheManager::Import(const std::string& path, size_t num_threads) {
+  util::MappedFile mapping(path);
+  kj::ArrayPtr<const kj::byte> data = mapping.Data();
+  capnp::FlatArrayMessageReader reader(
+      kj::ArrayPtr<const capnp::word>(
+          reinterpret_cast<const capnp::word*>(data.begin()),  // NOLINT
+          data.size() / sizeof(capnp::word)),
+      EntryReaderOptions());
+  auto bundle = reader.getRoot<capnproto::CacheBundle>();
+  // The contents of the files follow the message.
+  size_t offset =
+      reinterpret_cast<const kj::byte*>(reader.getEnd()) -  // NOLINT
+      data.begin();
+  std::vector<std::pair<util::SHA256_t, kj::ArrayPtr<const kj::byte>>> files;
+  for (auto file : bundle.getFiles()) {
+    KJ_REQUIRE(file.getSize() <= data.size() - offset, "Truncated bundle",
+               path);
+    files.emplace_back(file.getHash(),
+                       data.slice(offset, offset + file.getSize()));
+    offset += file.getSize();
+  }
+
+  std::vector<std::exception_ptr> errors(files.size());
+  std::atomic<size_t> next{0};
+  auto work = [&]() {
+    size_t i;
+    while ((i = next++) < files.size()) {
+      try {
+        const util::SHA256_t& hash = files[i].first;
+        util::Reclaimer::Get().Cancel(hash);
+        if (util::File::InStore(hash)) continue;
+        auto receiver = util::File::WriteToStore(hash);
+        if (files[i].second.size() != 0) receiver(files[i].second);
+        receiver({});
+      } catch (...) {
+        errors[i] = std::current_exception();
+      }
+    }
+  };
+  num_threads = std::min(std::max<size_t>(num_threads, 1), files.size());
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < num_threads; i++) threads.emplace_back(work);
+  work();
+  for (auto& thread : threads) thread.join();
+  for (auto& error : errors) {
+    if (error) std::rethrow_exception(error);
+  }
+
+  for (auto entry : bundle.getEntries()) {
+    Set(entry.getRequest(), entry.getResult());
+  }
+  return bundle.getEntries().size();
 }
 
 std::string CacheManager::Path() {
   return util::File::JoinPath(Flags::store_directory, "cache");
 }
 
+std::string CacheManager::SnapshotPath() {
+  return util::File::JoinPath(Flags::store_directory, "cache.snapshot");
+}
+
 }  // namespace server
@@ -1,53 +1,113 @@
 #ifndef SERVER_CACHE_HPP
 #define SERVER_CACHE_HPP
-#include <kj/std/iostream.h>
-#include <fstream>
-#include <map>
+#include <capnp/message.h>
+#include <deque>
+#include <string>
 #include <unordered_map>
+#include <vector>
+#include "capnp/cache.capnp.h"
 #include "server/dispatcher.hpp"
+#include "util/content_store.hpp"
+#include "util/file.hpp"
+#include "util/journal.hpp"
 #include "util/sha256.hpp"
 
 namespace server {
-namespace detail {
-struct RequestHasher {
-  uint64_t operator()(capnproto::Request::Reader reader_) const;
-};
-struct RequestComparator {
-  bool operator()(capnproto::Request::Reader a_,
-                  capnproto::Request::Reader b_) const;
-};
-}  // namespace detail
+
+// Computes a canonical digest of the request. The digest does not depend on
+// the order of input files, fifos and output files, nor on the evaluation the
+// request belongs to, and it is stable across runs.
+util::SHA256_t RequestDigest(capnproto::Request::Reader req);
 
 // Manages a cache of executions.
 class CacheManager {
  public:
   CacheManager();
+  ~CacheManager();
+  KJ_DISALLOW_COPY(CacheManager);
 
-  // Returns true if the request is in cache.
-  bool Has(capnproto::Request::Reader req);
-
-  // Returns the result of the given request.
-  capnproto::Result::Reader Get(capnproto::Request::Reader req);
+  // Returns the cached result of the given request, if any, and marks all the
+  // files it references as recently used.
+  kj::Maybe<capnproto::Result::Reader> Lookup(capnproto::Request::Reader req);
 
   // Saves a request, result pair in cache.
   void Set(capnproto::Request::Reader req, capnproto::Result::Reader res);
 
+  // Tracks a file that was added to the store without being part of a
+  // result, so that it counts toward the size of the cache and can be
+  // evicted.
+  void AddStored(const util::SHA256_t& hash);
+
+  // The files tracked by the cache. A worker running in the same process
+  // tracks its files there too, so that the store has a single size limit.
+  util::ContentStore* Files() { return &files_; }
+
+  // Writes to path a bundle with the live entries and all the files they
+  // reference. If roots is not empty, only the entries whose request uses
+  // one of the roots, or an output of another selected entry, are written.
+  // Returns the number of entries written.
+  size_t Export(const std::string& path,
+                const std::vector<util::SHA256_t>& roots);
+
+  // Adds the entries of a bundle written by Export, writing its files to the
+  // store with num_threads threads. The contents of each file are checked
+  // against its hash. Returns the number of entries read.
+  size_t Import(const std::string& path, size_t num_threads);
+
  private:
-  std::unordered_map<capnproto::Request::Reader, capnproto::Result::Reader,
-                     detail::RequestHasher, detail::RequestComparator>
-      data_;
-  std::unordered_map<util::SHA256_t, size_t, util::SHA256_t::Hasher>
-      file_sizes_;
-  std::unordered_map<util::SHA256_t, size_t, util::SHA256_t::Hasher>
-      file_access_times_;
-  std::map<size_t, util::SHA256_t> sorted_files_;
-  size_t total_size_ = 0;
+  struct Entry {
+    // Serialized entry, pointing inside one of the mapped files or owned.
+    kj::ArrayPtr<const capnp::word> words;
+    kj::Array<capnp::word> owned;
+    kj::Own<capnp::MessageReader> reader;
+    capnproto::CacheEntry::Reader entry;
+    // All the files referenced by the request, followed by the ones produced
+    // by the result.
+    std::vector<util::SHA256_t> files;
+    size_t num_inputs;
+    // Seconds needed to compute the result again.
+    double cost;
+    // Used to write the entries in least-recently-used order.
+    size_t last_used;
+  };
+
+  // Starts tracking the files of the entry, or records an access to them.
+  void AddFiles(
+      const Entry& entry,
+      const std::unordered_map<util::SHA256_t, size_t, util::SHA256_t::Hasher>&
+          sizes);
+
+  // Returns true if the files produced by the result of the entry are
+  // present. The inputs are only needed to compute the result again, and the
+  // frontends send them again when a request misses the cache.
+  bool HasFiles(const Entry& entry) const;
+
+  // Appends to the log the pending entries whose files are on disk.
+  void FlushDurable();
+
+  // Rewrites the snapshot with only the live entries and truncates the log,
+  // if the log has grown enough to make it worthwhile.
+  void MaybeCompact();
+  void Compact();
+
+  std::unordered_map<util::SHA256Key, Entry, util::SHA256Key::Hasher> data_;
+  util::ContentStore files_;
   size_t last_access_time_ = 0;
-  std::vector<kj::Own<capnp::MessageBuilder>> builders_;
-  std::ofstream fout_;
-  kj::std::StdOutputStream os_{fout_};
+  // Mappings of the snapshot and of the log, which the loaded entries point
+  // into.
+  std::vector<kj::Own<util::MappedFile>> mappings_;
+  // Number of entries appended to the log since the last compaction.
+  size_t log_entries_ = 0;
+  // Entries that are not in the log yet, since their files may not be on
+  // disk, with the util::File::WriteEpoch() of the moment they were set.
+  std::deque<std::pair<uint64_t, util::SHA256Key>> pending_;
+  // Appends to the log in the background.
+  kj::Own<util::Journal> journal_;
 
+  // The cache is stored as a compacted snapshot followed by a log of the
+  // entries added after the snapshot was written.
   static std::string Path();
+  static std::string SnapshotPath();
 };
 }  // namespace server
 
@@ -0,0 +1,84 @@
+#include "server/cache_main.hpp"
+#include <thread>
+
+#include "server/cache.hpp"
+#include "util/file.hpp"
+#include "util/flags.hpp"
+#include "util/misc.hpp"
+#include "util/version.hpp"
+
+namespace server {
+
+kj::MainBuilder::Validity CacheMain::Export() {
+  // The entries that use a file of the tasks, like their sources or their
+  // official inputs, and the ones that use their outputs.
+  std::vector<util::SHA256_t> roots;
+  for (const std::string& task : tasks) {
+    if (util::File::Size(task) < 0) {
+      return kj::str("Missing task directory ", task.c_str());
+    }
+    for (const std::string& path : util::File::ListFiles(task)) {
+      roots.push_back(util::File::Hash(path));
+    }
+  }
+  CacheManager cache;
+  size_t count = cache.Export(bundle, roots);
+  context.warning(kj::str("Exported ", count, " entries"));
+  return true;
+}
+
+kj::MainBuilder::Validity CacheMain::Import() {
+  if (!util::File::Exists(bundle)) {
+    return kj::str("Missing bundle ", bundle.c_str());
+  }
+  if (threads == 0) threads = std::thread::hardware_concurrency();
+  CacheManager cache;
+  size_t count = cache.Import(bundle, threads);
+  context.warning(kj::str("Imported ", count, " entries"));
+  return true;
+}
+
+kj::MainFunc CacheMain::getExport() {
+  return kj::MainBuilder(context, "Task-Maker Cache (" + util::version + ")",
+                         "Writes the live entries of the cache and their "
+                         "files to a bundle")
+      .addOptionWithArg({'t', "task"},
+                        [this](kj::StringPtr task) {
+                          tasks.emplace_back(task);
+                          return true;
+                        },
+                        "<DIR>",
+                        "Only export the entries that depend on the files "
+                        "of this task. Can be repeated")
+      .expectArg("<BUNDLE>", util::setString(&bundle))
+      .callAfterParsing(KJ_BIND_METHOD(*this, Export))
+      .build();
+}
+
+kj::MainFunc CacheMain::getImport() {
+  return kj::MainBuilder(context, "Task-Maker Cache (" + util::version + ")",
+                         "Adds the entries of a bundle to the cache, and "
+                         "their files to the store")
+      .addOptionWithArg({'j', "threads"}, util::setUint(&threads), "<N>",
+                        "Threads that write the files. 0 means one per core")
+      .expectArg("<BUNDLE>", util::setString(&bundle))
+      .callAfterParsing(KJ_BIND_METHOD(*this, Import))
+      .build();
+}
+
+kj::MainFunc CacheMain::getMain() {
+  return kj::MainBuilder(context, "Task-Maker Cache (" + util::version + ")",
+                         "Moves cache entries between servers")
+      .addOptionWithArg({'S', "store-dir"},
+                        util::setString(&Flags::store_directory), "<DIR>",
+                        "Path of the store of the server")
+      .addOptionWithArg(
+          {'c', "cache-size"}, util::setUint(&Flags::cache_size), "<SZ>",
+          "Maximum size of the cache, in MiB. 0 means unlimited")
+      .addSubCommand("export", KJ_BIND_METHOD(*this, getExport),
+                     "export entries to a bundle")
+      .addSubCommand("import", KJ_BIND_METHOD(*this, getImport),
+                     "import the entries of a bundle")
+      .build();
+}
+}  // namespace server
@@ -0,0 +1,32 @@
+#ifndef SERVER_CACHE_MAIN_HPP
+#define SERVER_CACHE_MAIN_HPP
+#include <kj/main.h>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace server {
+
+// Exports some entries of the cache of a server, with the files they
+// reference, to a single compacted bundle, and imports them in the cache of
+// another one, e.g. to ship the results of a contest to the analysis
+// machines. The server should not be running on the same store.
+class CacheMain {
+ public:
+  explicit CacheMain(kj::ProcessContext* context) : context(*context) {}
+  kj::MainFunc getMain();
+
+ private:
+  kj::MainFunc getExport();
+  kj::MainFunc getImport();
+  kj::MainBuilder::Validity Export();
+  kj::MainBuilder::Validity Import();
+
+  kj::ProcessContext& context;
+  std::string bundle;
+  // Directories of the tasks whose entries are exported. Empty means all.
+  std::vector<std::string> tasks;
+  uint32_t threads = 0;
+};
+}  // namespace server
+#endif
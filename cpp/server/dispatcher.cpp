@@ -1,175 +1,1156 @@
 #include "server/dispatcher.hpp"
+#include <kj/vector.h>
+#include <algorithm>
+#include <cmath>
+#include <iterator>
+#include <tuple>
+#include <utility>
+#include <vector>
 
 #include "util/file.hpp"
+#include "util/flags.hpp"
+#include "util/metrics.hpp"
 #include "util/sha256.hpp"
+#include "util/trace.hpp"
 #include "util/union_promise.hpp"
+#include "util/which.hpp"
 
 namespace server {
 
-kj::Promise<capnp::Response<capnproto::Evaluator::EvaluateResults>>
-Dispatcher::HandleRequest(capnproto::Evaluator::Client evaluator,
-                          capnproto::Request::Reader request) {
+namespace {
+// A request is duplicated when it runs for kHedgeFactor times its expected
+// time, and at least for kMinHedgeMillis.
+const constexpr int64_t kHedgeFactor = 3;
+const constexpr int64_t kMinHedgeMillis = 10000;
+// A worker that fails kMaxWorkerFailures requests in a row gets no requests
+// for kBlacklistMillis, doubled up to kMaxDoublings times when it fails again.
+const constexpr size_t kMaxWorkerFailures = 3;
+const constexpr int64_t kBlacklistMillis = 60000;
+const constexpr size_t kMaxDoublings = 4;
+// A failed request is queued again after kRetryMillis, doubled for each
+// previous failure.
+const constexpr int64_t kRetryMillis = 500;
+
+struct DispatcherMetrics {
+  util::Counter* requests = util::Metrics::GetCounter(
+      "dispatcher_requests_total", "Requests added to the queue");
+  util::Counter* retries = util::Metrics::GetCounter(
+      "dispatcher_retries_total", "Requests sent again after a failure");
+  util::Counter* failures = util::Metrics::GetCounter(
+      "dispatcher_failures_total", "Requests that failed on a worker");
+  util::Counter* hedged = util::Metrics::GetCounter(
+      "dispatcher_hedged_total", "Requests duplicated on another worker");
+  util::Counter* prefetched = util::Metrics::GetCounter(
+      "dispatcher_prefetched_files_total",
+      "Files hinted to the workers before their requests were dispatched");
+  util::Counter* workers_lost = util::Metrics::GetCounter(
+      "dispatcher_workers_lost_total",
+      "Workers that stopped answering the heartbeats");
+  util::Counter* cpu_millis = util::Metrics::GetCounter(
+      "dispatcher_cpu_milliseconds_total",
+      "Cpu time used by the processes of the requests");
+  util::Counter* wall_millis = util::Metrics::GetCounter(
+      "dispatcher_wall_milliseconds_total",
+      "Wall time used by the processes of the requests");
+  util::Counter* sent_bytes = util::Metrics::GetCounter(
+      "dispatcher_sent_input_bytes_total",
+      "Bytes of inputs sent to workers that did not have them");
+  util::Histogram* queue_millis = util::Metrics::GetHistogram(
+      "dispatcher_queue_milliseconds",
+      "Time between the arrival of a request and its dispatch");
+  util::Histogram* run_millis = util::Metrics::GetHistogram(
+      "dispatcher_run_milliseconds",
+      "Time between the dispatch of a request and its result");
+};
+
+DispatcherMetrics& Metrics() {
+  static DispatcherMetrics metrics;
+  return metrics;
+}
+}  // namespace
+
+std::vector<util::SHA256_t> Dispatcher::Outputs(
+    capnproto::Result::Reader result) {
+  std::vector<util::SHA256_t> outputs;
+  for (const auto& process_result : result.getProcesses()) {
+    for (const auto& output : process_result.getOutputFiles()) {
+      outputs.emplace_back(output.getHash());
+    }
+    outputs.emplace_back(process_result.getStderr());
+    outputs.emplace_back(process_result.getStdout());
+    for (const auto& item : process_result.getBatch()) {
+      outputs.emplace_back(item.getStderr());
+      outputs.emplace_back(item.getStdout());
+    }
+  }
+  return outputs;
+}
+
+kj::Promise<Dispatcher::Response> Dispatcher::HandleRequest(
+    capnproto::Evaluator::Client evaluator, uint64_t worker,
+    capnproto::Request::Reader request, uint64_t request_id) {
   auto req = evaluator.evaluateRequest();
   req.setRequest(request);
-  size_t client = client_cnt_++;
-  running_[client] = std::make_unique<capnproto::Evaluator::Client>(evaluator);
+  req.setRequestId(request_id);
+  // The trace shows how long the outputs take to be pulled back.
+  bool trace = request.getTrace();
+  uint32_t evaluation = request.getEvaluationId();
   return req.send().then(
-      [evaluator, client, this](auto res) mutable {
-        running_.erase(client);
-        auto result = res.getResult();
-        kj::Promise<void> load_files = kj::READY_NOW;
-        {
-          util::UnionPromiseBuilder builder;
-          for (const auto& process_result : result.getProcesses()) {
-            for (const auto& output : process_result.getOutputFiles()) {
-              builder.AddPromise(
-                  util::File::MaybeGet(output.getHash(), evaluator));
-            }
-            builder.AddPromise(
-                util::File::MaybeGet(process_result.getStderr(), evaluator));
-            builder.AddPromise(
-                util::File::MaybeGet(process_result.getStdout(), evaluator));
+      [this, evaluator, worker, trace, evaluation,
+       request_id](auto res) mutable -> kj::Promise<Response> {
+        std::vector<util::SHA256_t> outputs = Outputs(res.getResult());
+        if (Flags::lazy_outputs) {
+          // Intermediate files are often consumed on the same worker, and
+          // the others are fetched only when somebody needs them.
+          for (const util::SHA256_t& hash : outputs) {
+            if (hash.isZero() || hash.hasContents()) continue;
+            if (util::File::InStore(hash)) continue;
+            locations_.erase(hash);
+            locations_.emplace(hash, FileLocation{worker, evaluator});
           }
-          load_files = std::move(builder).Finalize();
+          return std::move(res);
         }
-        return load_files.then(
-            [res = std::move(res)]() mutable { return std::move(res); });
-      },
-      [client, this](kj::Exception exc) {
-        running_.erase(client);
-        return kj::Promise<
-            capnp::Response<capnproto::Evaluator::EvaluateResults>>(
-            std::move(exc));
+        // All the outputs are fetched with a single call, most of them are
+        // small.
+        uint64_t start = util::Tracer::NowMicros();
+        return util::File::MaybeGetAll(outputs, evaluator)
+            .then([res = std::move(res), trace, evaluation, request_id,
+                   start]() mutable {
+              if (trace) {
+                util::Tracer::Add(evaluation,
+                                  {"fetch outputs", "server",
+                                   "request " + std::to_string(request_id),
+                                   start, util::Tracer::NowMicros() - start});
+              }
+              return std::move(res);
+            });
       });
 }
 
-kj::Promise<void> Dispatcher::AddEvaluator(
-    capnproto::Evaluator::Client evaluator) {
-  std::remove_reference_t<decltype(requests_.back())> request_info;
-  do {
-    if (requests_.empty()) {
-      auto evaluator_promise = kj::newPromiseAndFulfiller<void>();
-      evaluators_.emplace_back(evaluator);
-      fulfillers_.push_back(std::move(evaluator_promise.fulfiller));
-      return std::move(evaluator_promise.promise);
-    }
-    request_info = std::move(requests_.front());
-    requests_.pop();
-  } while (*std::get<3>(request_info));
-  auto p = HandleRequest(evaluator, std::get<0>(request_info));
+kj::Promise<void> Dispatcher::Fetch(
+    const std::vector<util::SHA256_t>& hashes) {
+  std::unordered_map<uint64_t, std::vector<util::SHA256_t>> by_worker;
+  for (const util::SHA256_t& hash : hashes) {
+    auto it = locations_.find(hash);
+    if (it != locations_.end()) by_worker[it->second.worker].push_back(hash);
+  }
+  util::UnionPromiseBuilder builder;
+  for (const auto& kv : by_worker) {
+    const std::vector<util::SHA256_t>& files = kv.second;
+    capnproto::Evaluator::Client evaluator = locations_.at(files[0]).evaluator;
+    builder.AddPromise(
+        util::File::MaybeGetAll(files, evaluator).then([this, files]() {
+          for (const util::SHA256_t& hash : files) locations_.erase(hash);
+        }));
+  }
+  return std::move(builder).Finalize();
+}
+
+void Dispatcher::UpdateInventory(uint64_t worker,
+                                 util::BloomFilter inventory) {
+  inventories_[worker] =
+      std::make_shared<const util::BloomFilter>(std::move(inventory));
+  // The prefetched files are in the inventory now, if they are still there.
+  workers_[worker].prefetched.clear();
+}
+
+void Dispatcher::ReleaseWorker(uint64_t worker) {
+  auto it = workers_.find(worker);
+  if (it == workers_.end()) return;
+  if (--it->second.num_evaluators != 0) return;
+  workers_.erase(it);
+  // The outputs that were left on the worker cannot be fetched anymore.
+  for (auto loc = locations_.begin(); loc != locations_.end();) {
+    if (loc->second.worker == worker) {
+      loc = locations_.erase(loc);
+    } else {
+      ++loc;
+    }
+  }
+}
+
+std::vector<std::pair<util::SHA256_t, size_t>> Dispatcher::Inputs(
+    capnproto::Request::Reader request) {
+  std::vector<std::pair<util::SHA256_t, size_t>> inputs;
+  auto add = [&inputs](const util::SHA256_t& hash) {
+    if (hash.isZero()) return;
+    int64_t size = util::File::StoreSize(hash);
+    inputs.emplace_back(hash, std::max<int64_t>(size, 0));
+  };
+  for (auto process : request.getProcesses()) {
+    for (auto input : process.getInputFiles()) add(input.getHash());
+    if (process.getStdin().isHash()) add(process.getStdin().getHash());
+    if (process.getExecutable().isLocalFile()) {
+      add(process.getExecutable().getLocalFile().getHash());
+    }
+  }
+  return inputs;
+}
+
+size_t Dispatcher::Score(
+    uint64_t worker,
+    const std::vector<std::pair<util::SHA256_t, size_t>>& inputs) {
+  auto it = workers_.find(worker);
+  if (it == workers_.end()) return 0;
+  const WorkerState& state = it->second;
+  auto inventory = inventories_.find(worker);
+  const util::BloomFilter* filter =
+      inventory != inventories_.end() ? inventory->second.get() : nullptr;
+  size_t score = 0;
+  for (const auto& input : inputs) {
+    if ((filter && filter->MayContain(input.first)) ||
+        state.prefetched.count(input.first)) {
+      score += input.second;
+    }
+  }
+  return score;
+}
+
+std::vector<std::string> Dispatcher::Programs(
+    capnproto::Request::Reader request) {
+  const std::vector<std::string>& known = util::KnownPrograms();
+  std::vector<std::string> programs;
+  for (auto process : request.getProcesses()) {
+    if (!process.getExecutable().isSystem()) continue;
+    std::string name = process.getExecutable().getSystem();
+    name = name.substr(name.rfind('/') + 1);
+    if (std::find(known.begin(), known.end(), name) == known.end()) continue;
+    if (std::find(programs.begin(), programs.end(), name) != programs.end()) {
+      continue;
+    }
+    programs.push_back(name);
+  }
+  return programs;
+}
+
+bool Dispatcher::Timed(capnproto::Request::Reader request) {
+  return request.getTimed() || request.getExclusive();
+}
+
+bool Dispatcher::Allowed(uint64_t worker,
+                         const PendingRequest& request) const {
+  return !IsPeer(worker) ||
+         !peer_frontends_.count(request.request.getEvaluationId());
+}
+
+bool Dispatcher::Compatible(uint64_t worker, const PendingRequest& request) {
+  if (!Allowed(worker, request)) return false;
+  auto it = workers_.find(worker);
+  if (it == workers_.end()) return true;
+  const WorkerState& state = it->second;
+  if (state.programs) {
+    for (const std::string& program : request.programs) {
+      if (!state.programs->count(program)) return false;
+    }
+  }
+  if (!state.speed || !Timed(request.request)) return true;
+  auto frontend = frontends_.find(request.request.getEvaluationId());
+  if (frontend == frontends_.end() || !frontend->second.speed) return true;
+  double speed = frontend->second.speed;
+  return std::abs(state.speed - speed) <=
+         speed * Flags::speed_tolerance / 100.0;
+}
+
+bool Dispatcher::AnyCompatible(const PendingRequest& request) {
+  for (const auto& kv : workers_) {
+    if (!kv.second.lost && Compatible(kv.first, request)) return true;
+  }
+  return false;
+}
+
+void Dispatcher::SetPrograms(uint64_t worker,
+                             std::unordered_set<std::string> programs) {
+  workers_[worker].programs =
+      std::make_shared<const std::unordered_set<std::string>>(
+          std::move(programs));
+}
+
+void Dispatcher::SetSpeed(uint64_t worker, double speed) {
+  workers_[worker].speed = speed;
+}
+
+uint64_t Dispatcher::Memory(capnproto::Request::Reader request) {
+  uint64_t memory = 0;
+  for (auto process : request.getProcesses()) {
+    memory += process.getLimits().getMemory();
+  }
+  return memory;
+}
+
+bool Dispatcher::Fits(uint64_t worker, uint64_t memory) {
+  auto it = workers_.find(worker);
+  if (it == workers_.end() || !it->second.memory) return true;
+  return memory <= it->second.memory;
+}
+
+void Dispatcher::SetMemory(uint64_t worker, uint64_t memory) {
+  workers_[worker].memory = memory;
+}
+
+void Dispatcher::SetPeer(uint64_t worker) { workers_[worker].peer = true; }
+
+void Dispatcher::SetPeerFrontend(uint32_t frontend_id) {
+  peer_frontends_.insert(frontend_id);
+}
+
+bool Dispatcher::IsPeer(uint64_t worker) const {
+  auto it = workers_.find(worker);
+  return it != workers_.end() && it->second.peer;
+}
+
+size_t Dispatcher::IdleWorkers() const {
+  size_t idle = 0;
+  for (const auto& evaluator : evaluators_) idle += !IsPeer(evaluator.worker);
+  return idle;
+}
+
+size_t Dispatcher::QueuedRequests() const {
+  size_t queued = 0;
+  for (const auto& kv : frontends_) queued += kv.second.requests.size();
+  return queued;
+}
+
+Dispatcher::RequestQueue::iterator Dispatcher::PickRequest(
+    RequestQueue* queue, uint64_t worker) {
+  auto best = queue->end();
+  std::tuple<bool, bool, bool, size_t> best_score;
+  size_t seen = 0;
+  for (auto it = queue->begin(); it != queue->end() && seen < kLookahead;) {
+    PendingRequest& pending = it->second;
+    if (*pending.canceled) {
+      it = queue->erase(it);
+      continue;
+    }
+    // Requests that the worker can run, that did not fail on it and that fit
+    // in its memory come first.
+    auto score = std::make_tuple(Compatible(worker, pending),
+                                 !FailedOn(pending, worker),
+                                 Fits(worker, pending.memory),
+                                 Score(worker, pending.inputs));
+    if (best == queue->end()) {
+      best = it;
+      best_score = score;
+      // The first request waited long enough for a better worker, unless it
+      // cannot run on this one at all.
+      if (pending.skips >= kMaxSkips && std::get<0>(score)) break;
+    } else if (score > best_score) {
+      best = it;
+      best_score = score;
+    }
+    ++it;
+    seen++;
+  }
+  for (auto it = queue->begin(); it != best; ++it) it->second.skips++;
+  return best;
+}
+
+std::map<uint32_t, Dispatcher::FrontendState>::iterator
+Dispatcher::NextFrontend(const std::unordered_set<uint32_t>& skipped) {
+  auto best = frontends_.end();
+  for (auto it = frontends_.begin(); it != frontends_.end(); ++it) {
+    const FrontendState& frontend = it->second;
+    if (frontend.requests.empty() || skipped.count(it->first)) continue;
+    if (Flags::frontend_requests != 0 &&
+        frontend.running >= Flags::frontend_requests) {
+      continue;
+    }
+    // The frontends over their quota go last.
+    if (best == frontends_.end() ||
+        std::make_pair(OverQuota(frontend), frontend.pass) <
+            std::make_pair(OverQuota(best->second), best->second.pass)) {
+      best = it;
+    }
+  }
+  return best;
+}
+
+void Dispatcher::Enqueue(PendingRequest request) {
+  FrontendState& frontend = frontends_[request.request.getEvaluationId()];
+  if (frontend.requests.empty() && frontend.running == 0 &&
+      frontend.retrying == 0) {
+    frontend.pass = std::max(frontend.pass, virtual_time_);
+  }
+  QueueKey key(request.priority, last_request_++);
+  frontend.requests.emplace(key, std::move(request));
+}
+
+void Dispatcher::Pump() {
+  // The frontends whose next request waits for a compatible worker.
+  std::unordered_set<uint32_t> waiting;
+  while (!evaluators_.empty()) {
+    auto frontend = NextFrontend(waiting);
+    if (frontend == frontends_.end()) break;
+    RequestQueue& queue = frontend->second.requests;
+    auto evaluator = std::prev(evaluators_.end());
+    RequestQueue::iterator request;
+    if (evaluators_.size() == 1) {
+      // Workers are scarce: the worker picks the request with the best
+      // locality.
+      request = PickRequest(&queue, evaluator->worker);
+    } else {
+      // Requests are scarce: the first request picks the worker with the
+      // best locality, preferring the workers of this server and the most
+      // recently registered ones. A request that no idle worker can run,
+      // like a timed one waiting for a worker of its speed, lets the next
+      // ones go first.
+      while (!queue.empty() && *queue.begin()->second.canceled) {
+        queue.erase(queue.begin());
+      }
+      request = queue.begin();
+      size_t seen = 0;
+      for (auto it = queue.begin(); it != queue.end() && seen < kLookahead;
+           ++it, ++seen) {
+        if (*it->second.canceled) continue;
+        bool runnable = false;
+        for (const IdleEvaluator& idle : evaluators_) {
+          if (Compatible(idle.worker, it->second)) {
+            runnable = true;
+            break;
+          }
+        }
+        if (runnable) {
+          request = it;
+          break;
+        }
+      }
+      if (request != queue.end()) {
+        const PendingRequest& pending = request->second;
+        auto best_score =
+            std::make_tuple(Compatible(evaluator->worker, pending),
+                            !FailedOn(pending, evaluator->worker),
+                            !IsPeer(evaluator->worker),
+                            Fits(evaluator->worker, pending.memory),
+                            Score(evaluator->worker, pending.inputs));
+        for (auto it = evaluators_.begin(); it != std::prev(evaluators_.end());
+             ++it) {
+          auto score = std::make_tuple(Compatible(it->worker, pending),
+                                       !FailedOn(pending, it->worker),
+                                       !IsPeer(it->worker),
+                                       Fits(it->worker, pending.memory),
+                                       Score(it->worker, pending.inputs));
+          if (score > best_score) {
+            evaluator = it;
+            best_score = score;
+          }
+        }
+      }
+    }
+    if (request == queue.end()) {
+      // Only canceled requests were left.
+      MaybeRemoveFrontend(frontend);
+      continue;
+    }
+    // The request waits for a compatible worker, if one is connected.
+    // Otherwise it is sent anyway: it fails there if it misses a program.
+    // Meanwhile the idle workers go to the other frontends.
+    if (!Allowed(evaluator->worker, request->second) ||
+        (!Compatible(evaluator->worker, request->second) &&
+         AnyCompatible(request->second))) {
+      waiting.insert(frontend->first);
+      continue;
+    }
+    PendingRequest pending = std::move(request->second);
+    queue.erase(request);
+    IdleEvaluator idle = std::move(*evaluator);
+    evaluators_.erase(evaluator);
+    frontend->second.running++;
+    frontend->second.pass += 1.0 / frontend->second.weight;
+    virtual_time_ = frontend->second.pass;
+    Dispatch(std::move(idle), std::move(pending));
+  }
+  Prefetch();
+}
+
+void Dispatcher::Prefetch() {
+  if (Flags::prefetch_requests == 0) return;
+  // The k-th queued request of a frontend is dispatched when the pass of the
+  // frontend reaches pass + k / weight, after the frontends that are not over
+  // their quota, as in NextFrontend.
+  std::vector<std::pair<std::pair<bool, double>, const PendingRequest*>> next;
+  for (const auto& kv : frontends_) {
+    const FrontendState& frontend = kv.second;
+    size_t k = 0;
+    for (const auto& request : frontend.requests) {
+      if (k == Flags::prefetch_requests) break;
+      if (*request.second.canceled) continue;
+      next.emplace_back(std::make_pair(OverQuota(frontend),
+                                       frontend.pass + (k++) / frontend.weight),
+                        &request.second);
+    }
+  }
+  std::stable_sort(
+      next.begin(), next.end(),
+      [](const auto& a, const auto& b) { return a.first < b.first; });
+  if (next.size() > Flags::prefetch_requests) {
+    next.resize(Flags::prefetch_requests);
+  }
+  for (const auto& kv : next) {
+    const PendingRequest& request = *kv.second;
+    auto best = workers_.end();
+    std::tuple<bool, bool, bool, size_t> best_score;
+    for (auto it = workers_.begin(); it != workers_.end(); ++it) {
+      uint64_t worker = it->first;
+      if (it->second.lost || it->second.peer || Blacklisted(worker) ||
+          it->second.evaluator == nullptr) {
+        continue;
+      }
+      auto score = std::make_tuple(Compatible(worker, request),
+                                   !FailedOn(request, worker),
+                                   Fits(worker, request.memory),
+                                   Score(worker, request.inputs));
+      if (best == workers_.end() || score > best_score) {
+        best = it;
+        best_score = score;
+      }
+    }
+    if (best == workers_.end()) return;
+    WorkerState& state = best->second;
+    // The worker that will probably get the request is still fetching other
+    // files: it gets the hint with the next ones.
+    if (state.prefetching) continue;
+    auto inventory = inventories_.find(best->first);
+    const util::BloomFilter* filter =
+        inventory != inventories_.end() ? inventory->second.get() : nullptr;
+    std::vector<util::SHA256_t> missing;
+    uint64_t bytes = 0;
+    for (const auto& input : request.inputs) {
+      if (input.first.hasContents()) continue;
+      if (filter && filter->MayContain(input.first)) continue;
+      if (!state.prefetched.insert(input.first).second) continue;
+      missing.push_back(input.first);
+      bytes += input.second;
+    }
+    if (missing.empty()) continue;
+    uint64_t worker = best->first;
+    KJ_IF_MAYBE(evaluator, state.evaluator) {
+      state.prefetching = true;
+      Metrics().prefetched->Add(missing.size());
+      // Score counts these inputs as present when the request is sent, so
+      // they are charged to the frontend now.
+      auto frontend = frontends_.find(request.request.getEvaluationId());
+      if (frontend != frontends_.end()) frontend->second.usage.bytes += bytes;
+      auto req = evaluator->prefetchRequest();
+      auto hashes = req.initHashes(missing.size());
+      for (size_t i = 0; i < missing.size(); i++) {
+        missing[i].ToCapnp(hashes[i]);
+      }
+      req.send()
+          .then(
+              [this, worker](auto) {
+                auto it = workers_.find(worker);
+                if (it == workers_.end()) return;
+                it->second.prefetching = false;
+                Prefetch();
+              },
+              [this, worker](kj::Exception exc) {
+                KJ_LOG(WARNING, "Prefetch failed", exc.getDescription());
+                auto it = workers_.find(worker);
+                if (it == workers_.end()) return;
+                it->second.prefetching = false;
+                // Some of the files may not have arrived.
+                it->second.prefetched.clear();
+              })
+          .detach([](kj::Exception exc) {
+            KJ_LOG(WARNING, "Prefetch failed", exc.getDescription());
+          });
+    }
+  }
+}
+
+void Dispatcher::Dispatch(IdleEvaluator evaluator, PendingRequest request) {
   // Signal execution started
-  if (std::get<2>(request_info)) {
-    std::get<2>(request_info)->fulfill();
+  if (request.notify) {
+    request.notify->fulfill();
   }
-  auto ff = std::get<1>(request_info).get();
-  return p
+  Metrics().queue_millis->Observe(NowMillis() - request.enqueued);
+  if (Timed(request.request)) {
+    FrontendState& frontend = frontends_[request.request.getEvaluationId()];
+    auto worker = workers_.find(evaluator.worker);
+    if (!frontend.speed && worker != workers_.end()) {
+      frontend.speed = worker->second.speed;
+    }
+  }
+  uint64_t id = ++last_request_id_;
+  auto running = kj::heap<RunningRequest>(
+      RunningRequest{std::move(request), id, NowMillis()});
+  RunningRequest* ptr = running.get();
+  frontends_[ptr->request.request.getEvaluationId()].running_requests.insert(
+      id);
+  running_requests_.emplace(id, std::move(running));
+  StartAttempt(ptr, std::move(evaluator));
+}
+
+void Dispatcher::StartAttempt(RunningRequest* running,
+                              IdleEvaluator evaluator) {
+  uint64_t id = running->id;
+  size_t attempt = running->next_attempt++;
+  uint64_t missing = 0;
+  for (const auto& input : running->request.inputs) missing += input.second;
+  missing -= std::min<uint64_t>(
+      missing, Score(evaluator.worker, running->request.inputs));
+  Metrics().sent_bytes->Add(missing);
+  auto frontend = frontends_.find(running->request.request.getEvaluationId());
+  if (frontend != frontends_.end()) frontend->second.usage.bytes += missing;
+  auto promise = HandleRequest(evaluator.evaluator, evaluator.worker,
+                               running->request.request, running->id);
+  running->attempts.push_back(Attempt{attempt, evaluator.worker, NowMillis(),
+                                      std::move(evaluator.evaluator),
+                                      std::move(evaluator.fulfiller)});
+  promise
       .then(
-          [fulfiller = ff](auto res) -> kj::Promise<void> {
-            fulfiller->fulfill(std::move(res));
-            return kj::READY_NOW;
+          [this, id, attempt](Response res) {
+            AttemptDone(id, attempt, std::move(res));
           },
-          [this, request = std::get<0>(request_info),
-           fulfiller = std::move(std::get<1>(request_info)),
-           canceled = std::get<3>(request_info),
-           retries = std::get<4>(request_info)](
-              kj::Exception exc) mutable -> kj::Promise<void> {
-            KJ_LOG(WARNING, "Worker failed");
-            if (*canceled) {
-              fulfiller->reject(kj::cp(exc));
-              KJ_LOG(INFO, "Request canceled");
-              return exc;
-            }
-            if (retries == 0) {
-              fulfiller->reject(kj::cp(exc));
-              KJ_LOG(WARNING, "Retries exhausted");
-              return exc;
-            }
-            kj::PromiseFulfillerPair<void> dummy_start =
-                kj::newPromiseAndFulfiller<void>();
-            dummy_start.promise.then([]() { KJ_LOG(INFO, "Retrying..."); })
-                .detach([](kj::Exception exc) {
-                  KJ_LOG(WARNING, "dummy_start rejected", exc.getDescription());
-                });
-            auto ff = fulfiller.get();
-            return AddRequest(request, std::move(dummy_start.fulfiller),
-                              canceled, retries - 1)
-                .then(
-                    [fulfiller = std::move(fulfiller)](auto res) mutable {
-                      fulfiller->fulfill(std::move(res));
-                    },
-                    [fulfiller = ff](kj::Exception exc) {
-                      fulfiller->reject(kj::cp(exc));
-                      return exc;
-                    });
+          [this, id, attempt](kj::Exception exc) {
+            AttemptFailed(id, attempt, std::move(exc));
           })
-      .eagerlyEvaluate(nullptr);
+      .detach([](kj::Exception exc) {
+        KJ_LOG(WARNING, "Dispatch failed", exc.getDescription());
+      });
+}
+
+kj::Maybe<Dispatcher::Attempt> Dispatcher::TakeAttempt(RunningRequest* running,
+                                                       size_t attempt) {
+  for (auto it = running->attempts.begin(); it != running->attempts.end();
+       ++it) {
+    if (it->id != attempt) continue;
+    Attempt taken = std::move(*it);
+    running->attempts.erase(it);
+    return std::move(taken);
+  }
+  return nullptr;
 }
 
-kj::Promise<capnp::Response<capnproto::Evaluator::EvaluateResults>>
-Dispatcher::AddRequest(capnproto::Request::Reader request,
-                       kj::Own<kj::PromiseFulfiller<void>> notify,
-                       const std::shared_ptr<bool>& canceled, size_t retries) {
+void Dispatcher::AttemptDone(uint64_t id, size_t attempt, Response res) {
+  auto it = running_requests_.find(id);
+  // The attempt was already failed because its worker stopped responding.
+  if (it == running_requests_.end()) return;
+  RunningRequest& running = *it->second;
+  uint32_t frontend_id = running.request.request.getEvaluationId();
+  KJ_IF_MAYBE(taken, TakeAttempt(&running, attempt)) {
+    taken->fulfiller->fulfill();
+    WorkerSucceeded(taken->worker);
+  } else {
+    return;
+  }
+  // The copies that finish after the first one used their workers too.
+  Account(frontend_id, res.getResult());
+  if (!running.done) {
+    running.done = true;
+    Metrics().run_millis->Observe(NowMillis() - running.start);
+    if (!running.hedged) RecordDuration(NowMillis() - running.start);
+    auto frontend = frontends_.find(frontend_id);
+    if (frontend != frontends_.end()) frontend->second.usage.requests++;
+    running.request.fulfiller->fulfill(std::move(res));
+    // The other copies of the request are not needed anymore.
+    for (auto& other : running.attempts) {
+      auto req = other.evaluator.cancelRequestRequest();
+      req.setEvaluationId(frontend_id);
+      req.setRequestId(id);
+      req.send().detach([](kj::Exception exc) {
+        KJ_LOG(WARNING, "Failed to cancel request", exc.getDescription());
+      });
+    }
+  }
+  if (running.attempts.empty()) EraseRunning(it);
+  RequestDone(frontend_id);
+}
+
+void Dispatcher::AttemptFailed(uint64_t id, size_t attempt,
+                               kj::Exception exc) {
+  auto it = running_requests_.find(id);
+  if (it == running_requests_.end()) return;
+  RunningRequest& running = *it->second;
+  uint32_t frontend_id = running.request.request.getEvaluationId();
+  KJ_IF_MAYBE(taken, TakeAttempt(&running, attempt)) {
+    KJ_LOG(WARNING, "Worker failed", exc.getDescription());
+    Metrics().failures->Add();
+    AccountFailed(frontend_id, NowMillis() - taken->start);
+    taken->fulfiller->reject(kj::cp(exc));
+    if (!running.done && !*running.request.canceled &&
+        !canceled_evaluations_.count(frontend_id)) {
+      WorkerFailed(taken->worker);
+      running.request.failed_workers.push_back(taken->worker);
+    }
+  } else {
+    return;
+  }
+  // Wait for the other copies, if there are any.
+  if (!running.attempts.empty()) {
+    RequestDone(frontend_id);
+    return;
+  }
+  bool retry = false;
+  PendingRequest& pending = running.request;
+  if (running.done) {
+    // The request was already completed by another copy.
+  } else if (*pending.canceled || canceled_evaluations_.count(frontend_id)) {
+    KJ_LOG(INFO, "Request canceled");
+    pending.fulfiller->reject(std::move(exc));
+  } else if (pending.retries == 0) {
+    KJ_LOG(WARNING, "Retries exhausted");
+    pending.fulfiller->reject(std::move(exc));
+  } else {
+    KJ_LOG(INFO, "Retrying...");
+    Metrics().retries->Add();
+    pending.retries--;
+    pending.skips = 0;
+    pending.notify = nullptr;
+    retry = true;
+  }
+  auto running_request = std::move(it->second);
+  EraseRunning(it);
+  if (retry) Retry(std::move(running_request->request));
+  RequestDone(frontend_id);
+}
+
+void Dispatcher::Retry(PendingRequest request) {
+  // The backoff needs the timer.
+  if (!timer_ || request.failed_workers.empty()) {
+    Enqueue(std::move(request));
+    return;
+  }
+  uint32_t frontend_id = request.request.getEvaluationId();
+  size_t doublings =
+      std::min(request.failed_workers.size() - 1, kMaxDoublings);
+  frontends_[frontend_id].retrying++;
+  timer_->afterDelay((kRetryMillis << doublings) * kj::MILLISECONDS)
+      .then([this, frontend_id,
+             request = kj::heap<PendingRequest>(std::move(request))]() {
+        auto frontend = frontends_.find(frontend_id);
+        KJ_ASSERT(frontend != frontends_.end());
+        frontend->second.retrying--;
+        if (*request->canceled || canceled_evaluations_.count(frontend_id)) {
+          request->fulfiller->reject(KJ_EXCEPTION(FAILED, "Request canceled"));
+          MaybeRemoveFrontend(frontend);
+          return;
+        }
+        Enqueue(std::move(*request));
+        Pump();
+      })
+      .detach([](kj::Exception exc) {
+        KJ_LOG(WARNING, "Retry failed", exc.getDescription());
+      });
+}
+
+void Dispatcher::EraseRunning(RunningMap::iterator it) {
+  auto frontend =
+      frontends_.find(it->second->request.request.getEvaluationId());
+  if (frontend != frontends_.end()) {
+    frontend->second.running_requests.erase(it->first);
+  }
+  running_requests_.erase(it);
+}
+
+int64_t Dispatcher::NowMillis() const {
+  if (!timer_) return 0;
+  return (timer_->now() - kj::origin<kj::TimePoint>()) / kj::MILLISECONDS;
+}
+
+void Dispatcher::RecordDuration(int64_t millis) {
+  recent_durations_.push_back(millis);
+  if (recent_durations_.size() > kRecentDurations) {
+    recent_durations_.pop_front();
+  }
+}
+
+int64_t Dispatcher::ExpectedMillis(capnproto::Request::Reader request) const {
+  int64_t expected = 0;
+  for (auto process : request.getProcesses()) {
+    auto limits = process.getLimits();
+    float limit = std::max(limits.getWallTime(), limits.getCpuTime());
+    if (limit == 0) {
+      expected = -1;
+      break;
+    }
+    expected = std::max(expected, static_cast<int64_t>(
+                                      (limit * 1.2 + process.getExtraTime()) *
+                                      1000));
+  }
+  if (expected >= 0) return expected;
+  // Without limits, compare with the median of the recent requests.
+  if (recent_durations_.empty()) return 0;
+  std::vector<int64_t> durations(recent_durations_.begin(),
+                                 recent_durations_.end());
+  std::nth_element(durations.begin(), durations.begin() + durations.size() / 2,
+                   durations.end());
+  return durations[durations.size() / 2];
+}
+
+void Dispatcher::MaybeHedge() {
+  // Only use the workers that would be idle anyway.
+  if (evaluators_.empty() || NextFrontend() != frontends_.end()) return;
+  int64_t now = NowMillis();
+  std::vector<std::pair<int64_t, RunningRequest*>> late;
+  for (auto& kv : running_requests_) {
+    RunningRequest& running = *kv.second;
+    if (running.hedged || running.done) continue;
+    // The resource usage of timed executions depends on the worker, and the
+    // exclusive ones need whole cores.
+    if (Timed(running.request.request)) continue;
+    int64_t expected = ExpectedMillis(running.request.request);
+    if (expected <= 0) continue;
+    int64_t threshold = std::max(kMinHedgeMillis, kHedgeFactor * expected);
+    if (now - running.start > threshold) {
+      late.emplace_back(now - running.start - threshold, &running);
+    }
+  }
+  std::sort(late.begin(), late.end(),
+            [](const std::pair<int64_t, RunningRequest*>& a,
+               const std::pair<int64_t, RunningRequest*>& b) {
+              return a.first > b.first;
+            });
+  for (const auto& candidate : late) {
+    RunningRequest* running = candidate.second;
+    // The copy should run on a different worker, that has its programs.
+    auto evaluator = evaluators_.begin();
+    for (; evaluator != evaluators_.end(); ++evaluator) {
+      if (!Compatible(evaluator->worker, running->request)) continue;
+      bool same_worker = false;
+      for (const auto& attempt : running->attempts) {
+        same_worker = same_worker || attempt.worker == evaluator->worker;
+      }
+      if (!same_worker) break;
+    }
+    if (evaluator == evaluators_.end()) continue;
+    KJ_LOG(INFO, "Hedging request", running->id, now - running->start);
+    Metrics().hedged->Add();
+    running->hedged = true;
+    IdleEvaluator idle = std::move(*evaluator);
+    evaluators_.erase(evaluator);
+    auto frontend =
+        frontends_.find(running->request.request.getEvaluationId());
+    if (frontend != frontends_.end()) frontend->second.running++;
+    StartAttempt(running, std::move(idle));
+    if (evaluators_.empty()) break;
+  }
+}
+
+kj::Promise<void> Dispatcher::HedgeLoop() {
+  return timer_->afterDelay(1 * kj::SECONDS).then([this]() {
+    MaybeHedge();
+    return HedgeLoop();
+  });
+}
+
+void Dispatcher::Heartbeat() {
+  int64_t now = NowMillis();
+  std::vector<uint64_t> lost;
+  for (auto& kv : workers_) {
+    uint64_t worker = kv.first;
+    WorkerState& state = kv.second;
+    if (state.lost) continue;
+    if (state.ping_pending) {
+      if (now - state.last_seen > Flags::heartbeat_timeout * 1000) {
+        lost.push_back(worker);
+      }
+      continue;
+    }
+    KJ_IF_MAYBE(evaluator, state.evaluator) {
+      state.ping_pending = true;
+      evaluator->heartbeatRequest()
+          .send()
+          .then([this, worker](auto) {
+            auto it = workers_.find(worker);
+            if (it == workers_.end()) return;
+            it->second.ping_pending = false;
+            it->second.last_seen = NowMillis();
+          })
+          .detach([](kj::Exception exc) {
+            KJ_LOG(WARNING, "Heartbeat failed", exc.getDescription());
+          });
+    }
+  }
+  for (uint64_t worker : lost) WorkerLost(worker);
+  Unbench();
+}
+
+kj::Promise<void> Dispatcher::HeartbeatLoop() {
+  uint32_t interval = std::max<uint32_t>(Flags::heartbeat_interval, 1);
+  return timer_->afterDelay(interval * kj::SECONDS).then([this]() {
+    Heartbeat();
+    return HeartbeatLoop();
+  });
+}
+
+void Dispatcher::WorkerLost(uint64_t worker) {
+  KJ_LOG(WARNING, "Worker is not responding", worker);
+  Metrics().workers_lost->Add();
+  workers_[worker].lost = true;
+  // Stop sending requests to it.
+  for (auto* list : {&evaluators_, &benched_}) {
+    for (auto it = list->begin(); it != list->end();) {
+      if (it->worker != worker) {
+        ++it;
+        continue;
+      }
+      it->fulfiller->reject(
+          KJ_EXCEPTION(DISCONNECTED, "Worker is not responding"));
+      it = list->erase(it);
+    }
+  }
+  // The requests it was running are retried on the other workers.
+  std::vector<std::pair<uint64_t, size_t>> attempts;
+  for (const auto& kv : running_requests_) {
+    for (const auto& attempt : kv.second->attempts) {
+      if (attempt.worker == worker) attempts.emplace_back(kv.first, attempt.id);
+    }
+  }
+  for (const auto& attempt : attempts) {
+    AttemptFailed(attempt.first, attempt.second,
+                  KJ_EXCEPTION(DISCONNECTED, "Worker is not responding"));
+  }
+}
+
+void Dispatcher::WorkerSucceeded(uint64_t worker) {
+  auto it = health_.find(worker);
+  if (it != health_.end() && !Blacklisted(worker)) health_.erase(it);
+}
+
+void Dispatcher::WorkerFailed(uint64_t worker) {
+  // Blacklisting needs the timer to end.
+  if (!timer_) return;
+  WorkerHealth& health = health_[worker];
+  size_t max_failures = health.blacklistings ? 1 : kMaxWorkerFailures;
+  if (++health.failures < max_failures) return;
+  int64_t duration = kBlacklistMillis
+                     << std::min(health.blacklistings, kMaxDoublings);
+  KJ_LOG(WARNING, "Blacklisting worker", worker, health.failures, duration);
+  health.failures = 0;
+  health.blacklistings++;
+  health.blacklisted_until = NowMillis() + duration;
+  for (auto it = evaluators_.begin(); it != evaluators_.end();) {
+    if (it->worker != worker) {
+      ++it;
+      continue;
+    }
+    benched_.push_back(std::move(*it));
+    it = evaluators_.erase(it);
+  }
+}
+
+bool Dispatcher::FailedOn(const PendingRequest& request, uint64_t worker) {
+  return std::find(request.failed_workers.begin(),
+                   request.failed_workers.end(),
+                   worker) != request.failed_workers.end();
+}
+
+bool Dispatcher::Blacklisted(uint64_t worker) const {
+  auto it = health_.find(worker);
+  return it != health_.end() && it->second.blacklisted_until > NowMillis();
+}
+
+void Dispatcher::Unbench() {
+  bool unbenched = false;
+  for (auto it = benched_.begin(); it != benched_.end();) {
+    if (Blacklisted(it->worker)) {
+      ++it;
+      continue;
+    }
+    evaluators_.push_back(std::move(*it));
+    it = benched_.erase(it);
+    unbenched = true;
+  }
+  if (unbenched) Pump();
+}
+
+void Dispatcher::SetTimer(kj::Timer* timer) {
+  timer_ = timer;
+  if (Flags::hedge) hedge_loop_ = HedgeLoop().eagerlyEvaluate(nullptr);
+  if (Flags::heartbeat_timeout) {
+    heartbeat_loop_ = HeartbeatLoop().eagerlyEvaluate(nullptr);
+  }
+}
+
+void Dispatcher::ExportMetrics() {
+  size_t queued = 0;
+  for (const auto& kv : frontends_) queued += kv.second.requests.size();
+  util::Metrics::SetGauge("dispatcher_queued_requests",
+                          "Requests waiting for a worker", queued);
+  util::Metrics::SetGauge("dispatcher_running_requests",
+                          "Requests running on the workers",
+                          running_requests_.size());
+  util::Metrics::SetGauge("dispatcher_idle_evaluators",
+                          "Evaluators waiting for a request",
+                          evaluators_.size());
+  util::Metrics::SetGauge("dispatcher_benched_evaluators",
+                          "Evaluators of blacklisted workers", benched_.size());
+  util::Metrics::SetGauge("dispatcher_workers", "Connected workers",
+                          workers_.size());
+  util::Metrics::SetGauge("dispatcher_frontends", "Active frontends",
+                          frontends_.size());
+}
+
+void Dispatcher::Account(uint32_t frontend_id,
+                         capnproto::Result::Reader result) {
+  auto it = frontends_.find(frontend_id);
+  if (it == frontends_.end()) return;
+  Usage& usage = it->second.usage;
+  for (const auto& process : result.getProcesses()) {
+    if (process.getWasCached()) continue;
+    auto resources = process.getResourceUsage();
+    double cpu_time = resources.getCpuTime() + resources.getSysTime();
+    usage.cpu_time += cpu_time;
+    usage.wall_time += resources.getWallTime();
+    usage.memory_time += resources.getMemory() * resources.getWallTime();
+    Metrics().cpu_millis->Add(std::llround(cpu_time * 1000));
+    Metrics().wall_millis->Add(std::llround(resources.getWallTime() * 1000));
+  }
+}
+
+void Dispatcher::AccountFailed(uint32_t frontend_id, int64_t millis) {
+  auto it = frontends_.find(frontend_id);
+  if (it == frontends_.end()) return;
+  Usage& usage = it->second.usage;
+  usage.cpu_time += millis / 1000.0;
+  usage.wall_time += millis / 1000.0;
+}
+
+bool Dispatcher::OverQuota(const FrontendState& frontend) {
+  return Flags::frontend_cpu_quota != 0 &&
+         frontend.usage.cpu_time > Flags::frontend_cpu_quota;
+}
+
+Dispatcher::Usage Dispatcher::GetUsage(uint32_t frontend_id) const {
+  auto it = frontends_.find(frontend_id);
+  if (it == frontends_.end()) return {};
+  return it->second.usage;
+}
+
+void Dispatcher::RequestDone(uint32_t frontend_id) {
+  auto it = frontends_.find(frontend_id);
+  if (it != frontends_.end()) {
+    it->second.running--;
+    MaybeRemoveFrontend(it);
+  }
+  // The frontend may be below its limit of running requests again.
+  Pump();
+}
+
+void Dispatcher::MaybeRemoveFrontend(
+    std::map<uint32_t, FrontendState>::iterator it) {
+  const FrontendState& frontend = it->second;
+  if (frontend.removed && frontend.requests.empty() && frontend.running == 0 &&
+      frontend.retrying == 0) {
+    const Usage& usage = frontend.usage;
+    KJ_LOG(INFO, "Frontend done", it->first, usage.requests, usage.cpu_time,
+           usage.wall_time, usage.memory_time, usage.bytes);
+    frontends_.erase(it);
+  }
+}
+
+void Dispatcher::SetWeight(uint32_t frontend_id, float weight) {
+  frontends_[frontend_id].weight = std::max(weight, 1e-3f);
+}
+
+void Dispatcher::RemoveFrontend(uint32_t frontend_id) {
+  peer_frontends_.erase(frontend_id);
+  auto it = frontends_.find(frontend_id);
+  if (it == frontends_.end()) return;
+  it->second.removed = true;
+  MaybeRemoveFrontend(it);
+}
+
+kj::Promise<void> Dispatcher::AddEvaluator(
+    capnproto::Evaluator::Client evaluator, uint64_t worker,
+    uint32_t credits) {
+  credits = std::max<uint32_t>(credits, 1);
+  WorkerState& state = workers_[worker];
+  // A registration proves that the worker is alive.
+  state.last_seen = NowMillis();
+  state.ping_pending = false;
+  state.lost = false;
+  state.evaluator = evaluator;
+  // Requests are sent to blacklisted workers only after a while.
+  auto& idle = Blacklisted(worker) ? benched_ : evaluators_;
+  kj::Vector<kj::Promise<void>> slots(credits);
+  for (uint32_t i = 0; i < credits; i++) {
+    workers_[worker].num_evaluators++;
+    auto release = kj::defer([this, worker]() { ReleaseWorker(worker); });
+    auto evaluator_promise = kj::newPromiseAndFulfiller<void>();
+    idle.push_back(IdleEvaluator{
+        evaluator, std::move(evaluator_promise.fulfiller), worker});
+    slots.add(evaluator_promise.promise.attach(std::move(release)));
+  }
+  Pump();
+  return kj::joinPromises(slots.releaseAsArray());
+}
+
+kj::Promise<Dispatcher::Response> Dispatcher::AddRequest(
+    capnproto::Request::Reader request,
+    kj::Own<kj::PromiseFulfiller<void>> notify,
+    const std::shared_ptr<bool>& canceled, RequestPriority priority,
+    size_t retries) {
   if (*canceled || canceled_evaluations_.count(request.getEvaluationId())) {
     return KJ_EXCEPTION(FAILED, "Enqueueing canceled request");
   }
-  if (evaluators_.empty()) {
-    auto request_promise = kj::newPromiseAndFulfiller<
-        capnp::Response<capnproto::Evaluator::EvaluateResults>>();
-    requests_.emplace(request, std::move(request_promise.fulfiller),
-                      std::move(notify), canceled, retries);
-    return std::move(request_promise.promise);
-  }
-  auto evaluator = std::move(evaluators_.back());
-  evaluators_.pop_back();
-  auto evaluator_fulfiller = std::move(fulfillers_.back());
-  fulfillers_.pop_back();
-  notify->fulfill();
-  auto p = HandleRequest(evaluator, request);
-  auto ff = evaluator_fulfiller.get();
-  return p
-      .then(
-          [fulfiller = ff](auto result) mutable
-          -> kj::Promise<
-              capnp::Response<capnproto::Evaluator::EvaluateResults>> {
-            fulfiller->fulfill();
-            return std::move(result);
-          },
-          [this, request, canceled, retries,
-           fulfiller =
-               std::move(evaluator_fulfiller)](kj::Exception exc) mutable
-          -> kj::Promise<
-              capnp::Response<capnproto::Evaluator::EvaluateResults>> {
-            KJ_LOG(WARNING, "Worker failed");
-            fulfiller->reject(KJ_EXCEPTION(FAILED, kj::cp(exc)));
-            if (retries == 0) {
-              KJ_LOG(WARNING, "Retries exhausted");
-              return exc;
-            }
-            if (*canceled ||
-                canceled_evaluations_.count(request.getEvaluationId())) {
-              return KJ_EXCEPTION(FAILED, "Enqueueing canceled request");
-            }
-            kj::PromiseFulfillerPair<void> dummy_start =
-                kj::newPromiseAndFulfiller<void>();
-            dummy_start.promise.then([]() { KJ_LOG(INFO, "Retrying..."); })
-                .detach([](kj::Exception exc) {
-                  KJ_LOG(WARNING, "dummy_start rejected", exc.getDescription());
-                });
-            return AddRequest(request, std::move(dummy_start.fulfiller),
-                              canceled, retries - 1);
-          })
-      .eagerlyEvaluate(nullptr);
+  auto request_promise = kj::newPromiseAndFulfiller<Response>();
+  PendingRequest pending{request, std::move(request_promise.fulfiller),
+                         std::move(notify), canceled, priority, retries,
+                         Inputs(request), Memory(request), Programs(request)};
+  pending.enqueued = NowMillis();
+  Metrics().requests->Add();
+  Enqueue(std::move(pending));
+  Pump();
+  return std::move(request_promise.promise);
 }
 
 kj::Promise<void> Dispatcher::Cancel(uint32_t frontend_id) {
   canceled_evaluations_.insert(frontend_id);
+  auto frontend = frontends_.find(frontend_id);
+  if (frontend == frontends_.end()) return kj::READY_NOW;
+  // Queued requests will never run.
+  for (auto& kv : frontend->second.requests) {
+    kv.second.fulfiller->reject(KJ_EXCEPTION(FAILED, "Request canceled"));
+  }
+  frontend->second.requests.clear();
+  // A single message per worker cancels all its requests of the evaluation.
+  std::unordered_map<uint64_t, capnproto::Evaluator::Client> workers;
+  for (uint64_t id : frontend->second.running_requests) {
+    auto running = running_requests_.find(id);
+    if (running == running_requests_.end()) continue;
+    for (const auto& attempt : running->second->attempts) {
+      workers.emplace(attempt.worker, attempt.evaluator);
+    }
+  }
   util::UnionPromiseBuilder builder;
-  for (auto& kv : running_) {
-    auto req = kv.second->cancelRequestRequest();
+  for (auto& kv : workers) {
+    auto req = kv.second.cancelRequestRequest();
     req.setEvaluationId(frontend_id);
     builder.AddPromise(req.send().ignoreResult());
   }
+  MaybeRemoveFrontend(frontend);
   return std::move(builder).Finalize();
 }
 
+void Dispatcher::CancelRequests(uint32_t frontend_id,
+                                const std::shared_ptr<bool>& canceled) {
+  *canceled = true;
+  auto frontend = frontends_.find(frontend_id);
+  if (frontend == frontends_.end()) return;
+  RequestQueue& queue = frontend->second.requests;
+  for (auto it = queue.begin(); it != queue.end();) {
+    if (it->second.canceled != canceled) {
+      ++it;
+      continue;
+    }
+    it->second.fulfiller->reject(KJ_EXCEPTION(FAILED, "Request canceled"));
+    it = queue.erase(it);
+  }
+  for (uint64_t id : frontend->second.running_requests) {
+    auto running = running_requests_.find(id);
+    if (running == running_requests_.end()) continue;
+    if (running->second->request.canceled != canceled) continue;
+    for (auto& attempt : running->second->attempts) {
+      auto req = attempt.evaluator.cancelRequestRequest();
+      req.setEvaluationId(frontend_id);
+      req.setRequestId(id);
+      req.send().detach([](kj::Exception exc) {
+        KJ_LOG(WARNING, "Failed to cancel request", exc.getDescription());
+      });
+    }
+  }
+  MaybeRemoveFrontend(frontend);
+}
+
 }  // namespace server
@@ -2,27 +2,102 @@
 #define SERVER_DISPATCHER_HPP
 
 #include <kj/async.h>
+#include <kj/timer.h>
+#include <deque>
+#include <list>
+#include <map>
 #include <memory>
-#include <queue>
 #include <set>
+#include <string>
+#include <tuple>
 #include <unordered_map>
+#include <unordered_set>
+#include <utility>
 #include <vector>
 #include "capnp/evaluation.capnp.h"
+#include "util/bloom_filter.hpp"
+#include "util/sha256.hpp"
 
 namespace server {
 
-// Class to dispatch execution requests to workers.
+// Requests with a higher priority are dispatched first. The explicit
+// priority set by the frontend comes first, then the length of the longest
+// chain of requests that depend on this one and the number of requests that
+// directly depend on it.
+struct RequestPriority {
+  int32_t explicit_priority = 0;
+  uint32_t critical_path = 0;
+  uint32_t dependents = 0;
+
+  bool operator<(const RequestPriority& other) const {
+    return std::tie(explicit_priority, critical_path, dependents) <
+           std::tie(other.explicit_priority, other.critical_path,
+                    other.dependents);
+  }
+};
+
+// Class to dispatch execution requests to workers. Each frontend has its own
+// queue, and free workers are shared between the frontends with stride
+// scheduling: every dispatched request advances the pass of its frontend by
+// the inverse of its weight, and the frontend with the lowest pass goes next.
+// Flags::frontend_requests optionally caps the number of running requests of
+// each frontend. Inside a queue requests are considered in order of priority,
+// and are preferably sent to the workers that already have most of their
+// inputs, according to the inventories they advertise: a request can be
+// skipped in favour of a later one with better locality at most kMaxSkips
+// times. A request that fails is queued again after a delay that doubles with
+// each failure, and goes preferably to the workers it did not fail on.
+// Requests that run a compiler or an interpreter wait for a worker that has
+// it, see SetPrograms, and the timed requests of an evaluation wait for the
+// workers as fast as the first one that ran one of them, see SetSpeed. While
+// requests wait for a worker, the inputs of the ones that should be
+// dispatched first are pushed ahead of time to the workers that will most
+// likely get them, see Prefetch. The worker time used by each frontend is
+// accounted, see GetUsage: the frontends that used more cpu time than
+// Flags::frontend_cpu_quota get a worker only when no other frontend wants
+// it.
 class Dispatcher {
-  template <typename T, typename U>
-  using Queue = std::queue<std::tuple<T, kj::Own<kj::PromiseFulfiller<U>>,
-                                      kj::Own<kj::PromiseFulfiller<void>>,
-                                      std::shared_ptr<bool>, size_t>>;
+  using Response = capnp::Response<capnproto::Evaluator::EvaluateResults>;
 
  public:
-  // Adds a new evaluator to the worker queue. Returns a promise that will
-  // resolve when the worker has executed a request.
-  kj::Promise<void> AddEvaluator(capnproto::Evaluator::Client evaluator)
-      KJ_WARN_UNUSED_RESULT;
+  // Adds a new evaluator, registered by the given worker, to the worker
+  // queue. The evaluator can run up to credits requests. Returns a promise that
+  // will resolve when the worker has executed all of them.
+  kj::Promise<void> AddEvaluator(capnproto::Evaluator::Client evaluator,
+                                 uint64_t worker,
+                                 uint32_t credits = 1) KJ_WARN_UNUSED_RESULT;
+
+  // Records the inventory of the store of a worker. It is kept when the worker
+  // has no evaluators left, since the worker sends it again only after it
+  // changes.
+  void UpdateInventory(uint64_t worker, util::BloomFilter inventory);
+
+  // Marks the worker as another server that lends its workers. Its
+  // evaluators get requests only when no other worker is idle.
+  void SetPeer(uint64_t worker);
+
+  // Marks the evaluation as the requests of another server. They never go to
+  // the workers of a peer, or they could bounce between the servers.
+  void SetPeerFrontend(uint32_t frontend_id);
+
+  // Number of idle evaluators, not counting the ones of the peers.
+  size_t IdleWorkers() const;
+  size_t QueuedRequests() const;
+
+  // Records the memory available to the requests on a worker, in KiB.
+  // Requests are sent to the workers they fit in whenever possible.
+  void SetMemory(uint64_t worker, uint64_t memory);
+
+  // Records the programs of util::KnownPrograms() that a worker has. The
+  // requests that run one of them are sent only to the workers that have it,
+  // as long as one is connected.
+  void SetPrograms(uint64_t worker, std::unordered_set<std::string> programs);
+
+  // Records the calibrated speed of a worker, 0 if unknown. The timed or
+  // exclusive requests of an evaluation are sent to the workers whose speed
+  // is within Flags::speed_tolerance percent of the first worker that ran
+  // one of them, as long as one is connected.
+  void SetSpeed(uint64_t worker, double speed);
 
   // Adds a new request to the request queue. Returns a promise that will
   // resolve when some worker has finished running the request. When a worker
@@ -32,33 +107,327 @@ class Dispatcher {
   //  - otherwise, notify->fulfill() will be called, the request will be
   //    dispatched to the worker and the promise will resolve when the worker
   //    completes the execution.
-  kj::Promise<capnp::Response<capnproto::Evaluator::EvaluateResults>>
-  AddRequest(capnproto::Request::Reader request,
-             kj::Own<kj::PromiseFulfiller<void>> notify,
-             const std::shared_ptr<bool>& canceled,
-             size_t retries = 3) KJ_WARN_UNUSED_RESULT;
+  kj::Promise<Response> AddRequest(capnproto::Request::Reader request,
+                                   kj::Own<kj::PromiseFulfiller<void>> notify,
+                                   const std::shared_ptr<bool>& canceled,
+                                   RequestPriority priority = {},
+                                   size_t retries = 3) KJ_WARN_UNUSED_RESULT;
+
+  // Sets the share of the workers that the frontend gets, relative to the
+  // other frontends. The default weight is 1.
+  void SetWeight(uint32_t frontend_id, float weight);
+
+  // Resources used on the workers by the requests of a frontend, counting
+  // every attempt: the hedged, failed and canceled ones too.
+  struct Usage {
+    // Requests that completed.
+    size_t requests = 0;
+    // User and system time of the processes, in seconds.
+    double cpu_time = 0;
+    double wall_time = 0;
+    // Memory of the processes multiplied by their wall time, in KiB * s.
+    double memory_time = 0;
+    // Bytes of inputs sent to workers that did not have them, including the
+    // ones sent ahead by Prefetch.
+    uint64_t bytes = 0;
+  };
+
+  // Returns the resources used so far by the requests of the frontend. The
+  // results that come from a cache are not counted.
+  Usage GetUsage(uint32_t frontend_id) const;
+
+  // Forgets about a frontend as soon as it has no queued or running requests.
+  void RemoveFrontend(uint32_t frontend_id);
 
   // Cancel all running evaluations with the given frontend id.
   kj::Promise<void> Cancel(uint32_t frontend_id);
 
+  // Sets *canceled, and cancels the queued and running requests of the
+  // frontend that were added with it.
+  void CancelRequests(uint32_t frontend_id,
+                      const std::shared_ptr<bool>& canceled);
+
+  // Sets the timer used to measure running times. If Flags::hedge is set,
+  // requests that run for much longer than expected are duplicated on the
+  // otherwise idle workers, and the first result is used.
+  void SetTimer(kj::Timer* timer);
+
+  // Updates the gauges that describe the state of the dispatcher.
+  void ExportMetrics();
+
+  // With Flags::lazy_outputs, the outputs of the requests are left on the
+  // workers that produced them. Returns a promise that resolves when the
+  // given files that are still on a worker are in the store too.
+  kj::Promise<void> Fetch(const std::vector<util::SHA256_t>& hashes)
+      KJ_WARN_UNUSED_RESULT;
+
+  // Returns the files produced by the processes of the result.
+  static std::vector<util::SHA256_t> Outputs(capnproto::Result::Reader result);
+
+  // Whether the resource usage of the request is part of its result.
+  static bool Timed(capnproto::Request::Reader request);
+
  private:
-  size_t client_cnt_ = 0;
+  // Number of queued requests that are considered when a worker is free.
+  static const constexpr size_t kLookahead = 64;
+  // Number of times a request can be skipped for locality.
+  static const constexpr size_t kMaxSkips = 8;
+
+  struct PendingRequest {
+    capnproto::Request::Reader request;
+    kj::Own<kj::PromiseFulfiller<Response>> fulfiller;
+    kj::Own<kj::PromiseFulfiller<void>> notify;
+    std::shared_ptr<bool> canceled;
+    RequestPriority priority;
+    size_t retries;
+    // Hashes and sizes of the files the request needs.
+    std::vector<std::pair<util::SHA256_t, size_t>> inputs;
+    // Sum of the memory limits of the processes, in KiB.
+    uint64_t memory;
+    // Programs of util::KnownPrograms() that the processes run.
+    std::vector<std::string> programs;
+    size_t skips = 0;
+    // Time of the arrival of the request, in milliseconds.
+    int64_t enqueued = 0;
+    // Workers the request failed on.
+    std::vector<uint64_t> failed_workers = {};
+  };
+
+  // Requests are sorted by decreasing priority, and then by arrival.
+  using QueueKey = std::pair<RequestPriority, size_t>;
+  struct QueueOrder {
+    bool operator()(const QueueKey& a, const QueueKey& b) const {
+      if (b.first < a.first) return true;
+      if (a.first < b.first) return false;
+      return a.second < b.second;
+    }
+  };
+  using RequestQueue = std::map<QueueKey, PendingRequest, QueueOrder>;
+
+  struct IdleEvaluator {
+    capnproto::Evaluator::Client evaluator;
+    kj::Own<kj::PromiseFulfiller<void>> fulfiller;
+    uint64_t worker;
+  };
+
+  struct WorkerState {
+    size_t num_evaluators = 0;
+    // Memory available to the requests, in KiB. 0 if unknown.
+    uint64_t memory = 0;
+    // Evaluator used to check that the worker is alive.
+    kj::Maybe<capnproto::Evaluator::Client> evaluator;
+    // Time of the last answer to a heartbeat.
+    int64_t last_seen = 0;
+    bool ping_pending = false;
+    bool lost = false;
+    bool peer = false;
+    // Programs of util::KnownPrograms() that the worker has, or null if
+    // unknown.
+    std::shared_ptr<const std::unordered_set<std::string>> programs;
+    // Score of the calibration benchmark, 0 if unknown.
+    double speed = 0;
+    // Whether the worker is fetching the files of a prefetch hint.
+    bool prefetching = false;
+    // Files hinted to the worker since its inventory was last updated.
+    std::unordered_set<util::SHA256_t, util::SHA256_t::Hasher> prefetched;
+  };
 
-  kj::Promise<capnp::Response<capnproto::Evaluator::EvaluateResults>>
-  HandleRequest(capnproto::Evaluator::Client evaluator,
-                capnproto::Request::Reader request);
+  // A worker that fails too many requests in a row is blacklisted for a
+  // while. Until it succeeds again, a single failure blacklists it again, for
+  // twice as long.
+  struct WorkerHealth {
+    // Number of consecutive failed requests.
+    size_t failures = 0;
+    // Number of times the worker was blacklisted since its last success.
+    size_t blacklistings = 0;
+    int64_t blacklisted_until = 0;
+  };
 
-  std::unordered_map<size_t, std::unique_ptr<capnproto::Evaluator::Client>>
-      running_;
+  struct Attempt {
+    size_t id;
+    uint64_t worker;
+    int64_t start;
+    capnproto::Evaluator::Client evaluator;
+    kj::Own<kj::PromiseFulfiller<void>> fulfiller;
+  };
+
+  struct RunningRequest {
+    PendingRequest request;
+    uint64_t id;
+    int64_t start;
+    std::list<Attempt> attempts = {};
+    size_t next_attempt = 0;
+    bool hedged = false;
+    // Set when the first result was received.
+    bool done = false;
+  };
+
+  struct FrontendState {
+    RequestQueue requests;
+    size_t running = 0;
+    float weight = 1;
+    double pass = 0;
+    bool removed = false;
+    // Number of failed requests waiting to be queued again.
+    size_t retrying = 0;
+    // Ids of the requests that are currently running.
+    std::unordered_set<uint64_t> running_requests;
+    // Speed of the first worker that ran a timed request of the frontend, or
+    // 0 if none did.
+    double speed = 0;
+    Usage usage;
+  };
+
+  using RunningMap = std::unordered_map<uint64_t, kj::Own<RunningRequest>>;
+
+  // Worker that holds an output that was not fetched yet.
+  struct FileLocation {
+    uint64_t worker;
+    capnproto::Evaluator::Client evaluator;
+  };
+
+  kj::Promise<Response> HandleRequest(capnproto::Evaluator::Client evaluator,
+                                      uint64_t worker,
+                                      capnproto::Request::Reader request,
+                                      uint64_t request_id);
+
+  void ReleaseWorker(uint64_t worker);
+
+  // Returns the inputs of the request, with their sizes.
+  static std::vector<std::pair<util::SHA256_t, size_t>> Inputs(
+      capnproto::Request::Reader request);
+
+  // Returns the number of bytes of inputs that the worker already has, or
+  // that were hinted to it.
+  size_t Score(uint64_t worker,
+               const std::vector<std::pair<util::SHA256_t, size_t>>& inputs);
+
+  // Returns the memory needed by the request, in KiB.
+  static uint64_t Memory(capnproto::Request::Reader request);
+
+  // Whether a request that needs memory KiB fits in the worker.
+  bool Fits(uint64_t worker, uint64_t memory);
+
+  // Returns the programs of util::KnownPrograms() that the request runs.
+  static std::vector<std::string> Programs(capnproto::Request::Reader request);
+  // Whether the worker has all the programs of the request and, if the
+  // request is timed, the speed of its frontend. Workers that did not tell
+  // their programs or their speed are assumed to match. Requests are never
+  // compatible with a worker they may not run on, see Allowed.
+  bool Compatible(uint64_t worker, const PendingRequest& request);
+  // Whether the request may run on the worker at all, even if no compatible
+  // one is connected.
+  bool Allowed(uint64_t worker, const PendingRequest& request) const;
+  // Whether some connected worker is compatible with the request.
+  bool AnyCompatible(const PendingRequest& request);
+
+  void Enqueue(PendingRequest request);
+  // Queues again a request that failed, after the backoff.
+  void Retry(PendingRequest request);
+
+  // Returns the queued request that should be sent to the worker, dropping
+  // the canceled ones, or queue->end() if there is none.
+  RequestQueue::iterator PickRequest(RequestQueue* queue, uint64_t worker);
+
+  // Returns the frontend that should get the next free worker, or
+  // frontends_.end() if no frontend can run requests. The frontends in
+  // skipped are not considered.
+  std::map<uint32_t, FrontendState>::iterator NextFrontend(
+      const std::unordered_set<uint32_t>& skipped = {});
+
+  // Sends queued requests to idle evaluators, as long as possible.
+  void Pump();
+
+  // Sends to the workers that are not fetching anything else the inputs they
+  // miss of the first Flags::prefetch_requests queued requests, in the order
+  // in which they should be dispatched. Each request is assigned to the
+  // worker that already has the most of its inputs.
+  void Prefetch();
+
+  // Sends the request to the evaluator, retrying on other evaluators in case
+  // of failures.
+  void Dispatch(IdleEvaluator evaluator, PendingRequest request);
+
+  // Sends a copy of the running request to the evaluator.
+  void StartAttempt(RunningRequest* running, IdleEvaluator evaluator);
+  // Forgets about a copy of the request, returning it if it was still
+  // running.
+  kj::Maybe<Attempt> TakeAttempt(RunningRequest* running, size_t attempt);
+  void AttemptDone(uint64_t id, size_t attempt, Response res);
+  void AttemptFailed(uint64_t id, size_t attempt, kj::Exception exc);
+  // Forgets about a running request.
+  void EraseRunning(RunningMap::iterator it);
+
+  int64_t NowMillis() const;
+  void RecordDuration(int64_t millis);
+  // Returns how long the request is expected to run, or 0 if it is unknown.
+  int64_t ExpectedMillis(capnproto::Request::Reader request) const;
+  // Duplicates the requests that run for too long on idle workers.
+  void MaybeHedge();
+  kj::Promise<void> HedgeLoop();
+
+  // Sends a heartbeat to all the workers, and gives up on the ones that did
+  // not answer the previous one for Flags::heartbeat_timeout seconds.
+  void Heartbeat();
+  kj::Promise<void> HeartbeatLoop();
+  // Rejects the evaluators of the worker, and retries its requests.
+  void WorkerLost(uint64_t worker);
+  void WorkerSucceeded(uint64_t worker);
+  void WorkerFailed(uint64_t worker);
+  bool Blacklisted(uint64_t worker) const;
+  bool IsPeer(uint64_t worker) const;
+  static bool FailedOn(const PendingRequest& request, uint64_t worker);
+  // Makes the evaluators of the workers that are not blacklisted anymore
+  // available again.
+  void Unbench();
+
+  // Adds the resources used by the processes of the result to the usage of
+  // the frontend.
+  void Account(uint32_t frontend_id, capnproto::Result::Reader result);
+  // Adds to the usage of the frontend an attempt that held its worker for
+  // millis without giving a result. Its processes are assumed to have used
+  // one core for all that time.
+  void AccountFailed(uint32_t frontend_id, int64_t millis);
+  // Whether the frontend used more than Flags::frontend_cpu_quota.
+  static bool OverQuota(const FrontendState& frontend);
+
+  // Called when a request of the frontend is not running anymore.
+  void RequestDone(uint32_t frontend_id);
+
+  // Removes the frontend if it is not used anymore.
+  void MaybeRemoveFrontend(std::map<uint32_t, FrontendState>::iterator it);
 
   std::set<uint32_t> canceled_evaluations_;
 
-  // TODO: I could not make a Queue<Evaluator, void> work, for some reason
-  std::vector<capnproto::Evaluator::Client> evaluators_;
-  std::vector<kj::Own<kj::PromiseFulfiller<void>>> fulfillers_;
-  Queue<capnproto::Request::Reader,
-        capnp::Response<capnproto::Evaluator::EvaluateResults>>
-      requests_;
+  std::unordered_map<uint64_t, WorkerState> workers_;
+
+  RunningMap running_requests_;
+  std::unordered_map<util::SHA256_t, FileLocation, util::SHA256_t::Hasher>
+      locations_;
+  uint64_t last_request_id_ = 0;
+  // Number of durations of completed requests that are kept.
+  static const constexpr size_t kRecentDurations = 256;
+  std::deque<int64_t> recent_durations_;
+  kj::Timer* timer_ = nullptr;
+  kj::Promise<void> hedge_loop_ = kj::READY_NOW;
+  kj::Promise<void> heartbeat_loop_ = kj::READY_NOW;
+  // Not removed with the worker, so that blacklisting survives registrations.
+  std::unordered_map<uint64_t, WorkerHealth> health_;
+  // Not removed with the worker either, see UpdateInventory.
+  std::unordered_map<uint64_t, std::shared_ptr<const util::BloomFilter>>
+      inventories_;
+  // Evaluators of blacklisted workers.
+  std::list<IdleEvaluator> benched_;
+
+  std::list<IdleEvaluator> evaluators_;
+  std::map<uint32_t, FrontendState> frontends_;
+  // The frontends of SetPeerFrontend, that outlive their FrontendState.
+  std::unordered_set<uint32_t> peer_frontends_;
+  size_t last_request_ = 0;
+  // Pass of the last frontend that got a request dispatched. Frontends that
+  // become active again start from here, so that they cannot accumulate
+  // credit while idle.
+  double virtual_time_ = 0;
 };
 
 }  // namespace server
@@ -0,0 +1,341 @@
+#include "server/federation.hpp"
+#include <capnp/message.h>
+#include <kj/debug.h>
+#include <cstring>
+#include <memory>
+#include <unordered_map>
+#include <utility>
+
+#include "server/server.hpp"
+#include "util/file.hpp"
+#include "util/flags.hpp"
+#include "util/misc.hpp"
+#include "util/sha256.hpp"
+
+namespace server {
+
+namespace {
+
+uint64_t Point(const std::string& text) {
+  util::SHA256 hasher;
+  hasher.update(reinterpret_cast<const unsigned char*>(text.data()),
+                text.size());
+  util::SHA256_t hash = hasher.finalize();
+  uint64_t point;
+  memcpy(&point, hash.getDigest().data(), sizeof(point));
+  return point;
+}
+
+std::vector<util::SHA256_t> Inputs(capnproto::Request::Reader request) {
+  std::vector<util::SHA256_t> inputs;
+  for (auto process : request.getProcesses()) {
+    for (auto input : process.getInputFiles()) {
+      inputs.emplace_back(input.getHash());
+    }
+    if (process.getStdin().isHash()) {
+      inputs.emplace_back(process.getStdin().getHash());
+    }
+    if (process.getExecutable().isLocalFile()) {
+      inputs.emplace_back(process.getExecutable().getLocalFile().getHash());
+    }
+  }
+  return inputs;
+}
+
+// Send the files of the store, fetching them first from the workers that
+// still have them.
+kj::Promise<void> SendFile(
+    Dispatcher* dispatcher,
+    capnproto::FileSender::Server::RequestFileContext context) {
+  util::SHA256_t hash = context.getParams().getHash();
+  return dispatcher->Fetch({hash}).then([context]() mutable {
+    return util::File::HandleRequestFile(context);
+  });
+}
+
+kj::Promise<void> SendFiles(
+    Dispatcher* dispatcher,
+    capnproto::FileSender::Server::RequestFilesContext context) {
+  std::vector<util::SHA256_t> hashes;
+  for (auto hash : context.getParams().getHashes()) hashes.emplace_back(hash);
+  return dispatcher->Fetch(hashes).then([context]() mutable {
+    return util::File::HandleRequestFiles(context);
+  });
+}
+
+// Sends the outputs of the results stored in the cache of a peer.
+class StoreSender : public capnproto::FileSender::Server {
+ public:
+  explicit StoreSender(Dispatcher* dispatcher) : dispatcher_(dispatcher) {}
+
+  kj::Promise<void> requestFile(RequestFileContext context) override {
+    return SendFile(dispatcher_, context);
+  }
+  kj::Promise<void> requestFiles(RequestFilesContext context) override {
+    return SendFiles(dispatcher_, context);
+  }
+
+ private:
+  Dispatcher* dispatcher_;
+};
+
+// Registered on a peer, runs its requests on the workers of this server as
+// if they came from a frontend of its own. The peer fetches the outputs from
+// it as from any worker.
+class PeerEvaluator : public capnproto::Evaluator::Server {
+ public:
+  PeerEvaluator(Dispatcher* dispatcher, capnproto::MainServer::Client peer)
+      : dispatcher_(*dispatcher), peer_(std::move(peer)) {
+    dispatcher_.SetPeerFrontend(evaluation_id_);
+  }
+  ~PeerEvaluator() {
+    for (auto& kv : requests_) *kv.second.second = true;
+    dispatcher_.RemoveFrontend(evaluation_id_);
+  }
+  KJ_DISALLOW_COPY(PeerEvaluator);
+
+  kj::Promise<void> evaluate(EvaluateContext context) override {
+    auto message = kj::heap<capnp::MallocMessageBuilder>();
+    message->setRoot(context.getParams().getRequest());
+    auto request = message->getRoot<capnproto::Request>();
+    uint32_t origin = request.getEvaluationId();
+    request.setEvaluationId(evaluation_id_);
+    uint64_t request_id = context.getParams().getRequestId();
+    auto canceled = std::make_shared<bool>(false);
+    if (request_id) requests_[request_id] = {origin, canceled};
+    // The inputs provided by the frontends of the peer are in its store.
+    return util::File::MaybeGetAll(Inputs(request), peer_)
+        .then([this, request, canceled]() {
+          return dispatcher_.AddRequest(
+              request, kj::newPromiseAndFulfiller<void>().fulfiller,
+              canceled);
+        })
+        .then([context](auto response) mutable {
+          context.getResults().setResult(response.getResult());
+        })
+        .attach(std::move(message), kj::defer([this, request_id]() {
+                  requests_.erase(request_id);
+                }));
+  }
+
+  kj::Promise<void> cancelRequest(CancelRequestContext context) override {
+    uint32_t origin = context.getParams().getEvaluationId();
+    uint64_t request_id = context.getParams().getRequestId();
+    // The requests that already run on a worker are left to complete.
+    for (auto& kv : requests_) {
+      if (kv.second.first != origin) continue;
+      if (request_id && kv.first != request_id) continue;
+      *kv.second.second = true;
+    }
+    return kj::READY_NOW;
+  }
+
+  kj::Promise<void> heartbeat(HeartbeatContext /*context*/) override {
+    return kj::READY_NOW;
+  }
+
+  kj::Promise<void> requestFile(RequestFileContext context) override {
+    return SendFile(&dispatcher_, context);
+  }
+  kj::Promise<void> requestFiles(RequestFilesContext context) override {
+    return SendFiles(&dispatcher_, context);
+  }
+
+ private:
+  Dispatcher& dispatcher_;
+  capnproto::MainServer::Client peer_;
+  // The requests of the peer share an evaluation of this server.
+  uint32_t evaluation_id_ = FrontendContext::NewId();
+  // Evaluation on the peer and cancellation flag of the running requests.
+  std::unordered_map<uint64_t, std::pair<uint32_t, std::shared_ptr<bool>>>
+      requests_;
+};
+
+}  // namespace
+
+Federation::Federation(Dispatcher* dispatcher, CacheManager* cache_manager)
+    : dispatcher_(*dispatcher), cache_manager_(*cache_manager) {
+  if (!Flags::remote_cache.empty()) {
+    remote_.reset(new Peer{Flags::remote_cache, nullptr});
+  }
+  if (Flags::peers.empty()) return;
+  bool found = false;
+  for (const std::string& address : util::split(Flags::peers, ',')) {
+    if (address.empty()) continue;
+    int index = -1;
+    if (address == Flags::peer_address) {
+      found = true;
+    } else {
+      index = peers_.size();
+      peers_.push_back(Peer{address, nullptr});
+    }
+    for (size_t i = 0; i < kRingPoints; i++) {
+      ring_[Point(address + "/" + std::to_string(i))] = index;
+    }
+  }
+  KJ_REQUIRE(found, "The peers should include --peer-address",
+             Flags::peer_address);
+  // Distinct from the ids of the workers, which are random.
+  worker_id_ = Point("peer " + Flags::peer_address);
+}
+
+void Federation::Start(kj::Timer* timer) {
+  timer_ = timer;
+  if (peers_.empty()) return;
+  lend_loop_ = LendLoop().eagerlyEvaluate(nullptr);
+}
+
+Federation::Peer* Federation::Owner(capnproto::Request::Reader request) {
+  if (peers_.empty()) return nullptr;
+  uint64_t point;
+  memcpy(&point, RequestDigest(request).getDigest().data(), sizeof(point));
+  auto it = ring_.lower_bound(point);
+  if (it == ring_.end()) it = ring_.begin();
+  if (it->second == -1) return nullptr;
+  return &peers_[it->second];
+}
+
+capnproto::MainServer::Client Federation::Connect(Peer* peer) {
+  if (!peer->client) {
+    peer->client = kj::heap<capnp::EzRpcClient>(peer->address, Flags::port);
+  }
+  return peer->client->getMain<capnproto::MainServer>();
+}
+
+void Federation::Disconnect(Peer* peer, const kj::Exception& exc) {
+  KJ_LOG(WARNING, "Peer failed", peer->address, exc.getDescription());
+  if (exc.getType() == kj::Exception::Type::DISCONNECTED) {
+    peer->client = nullptr;
+  }
+}
+
+kj::Promise<bool> Federation::Lookup(capnproto::Request::Reader request) {
+  Peer* peer = Owner(request);
+  kj::Promise<bool> found = false;
+  if (peer != nullptr) found = LookupOn(peer, request);
+  if (!remote_) return found;
+  return found.then([this, request](bool found) -> kj::Promise<bool> {
+    if (found) return true;
+    return LookupOn(remote_.get(), request);
+  });
+}
+
+void Federation::Store(capnproto::Request::Reader request,
+                       capnproto::Result::Reader result) {
+  Peer* peer = Owner(request);
+  if (peer != nullptr) StoreOn(peer, request, result);
+  // The resource usage of a timed result is only meaningful on the workers
+  // of this server.
+  if (remote_ && Flags::remote_cache_write && !Dispatcher::Timed(request)) {
+    StoreOn(remote_.get(), request, result);
+  }
+}
+
+kj::Promise<bool> Federation::LookupOn(Peer* peer,
+                                       capnproto::Request::Reader request) {
+  kj::Promise<bool> found = FetchFrom(peer, request);
+  if (timer_ == nullptr) return found;
+  // A peer that does not answer must not hold the request back: it is
+  // evaluated here instead.
+  return found.exclusiveJoin(
+      timer_->afterDelay(kLookupTimeoutMillis * kj::MILLISECONDS)
+          .then([peer]() {
+            KJ_LOG(WARNING, "Cache lookup timed out", peer->address);
+            return false;
+          }));
+}
+
+kj::Promise<bool> Federation::FetchFrom(Peer* peer,
+                                        capnproto::Request::Reader request) {
+  auto server = Connect(peer);
+  auto req = server.lookupCacheRequest();
+  req.setRequest(request);
+  return req.send()
+      .then([this, request, server](auto response) mutable
+            -> kj::Promise<bool> {
+        if (!response.getFound()) return false;
+        // The outputs are needed for the result to be cached here.
+        auto outputs = Dispatcher::Outputs(response.getResult());
+        return util::File::MaybeGetAll(outputs, server)
+            .then([this, request, response = std::move(response)]() {
+              cache_manager_.Set(request, response.getResult());
+              return true;
+            });
+      })
+      .then([](bool found) { return found; },
+            [this, peer](kj::Exception exc) {
+              // The request is evaluated again instead.
+              Disconnect(peer, exc);
+              return false;
+            });
+}
+
+void Federation::StoreOn(Peer* peer, capnproto::Request::Reader request,
+                         capnproto::Result::Reader result) {
+  auto req = Connect(peer).storeCacheRequest();
+  req.setRequest(request);
+  req.setResult(result);
+  req.setSender(kj::heap<StoreSender>(&dispatcher_));
+  req.send().detach(
+      [this, peer](kj::Exception exc) { Disconnect(peer, exc); });
+}
+
+kj::Promise<void> Federation::HandleLookup(
+    capnproto::MainServer::LookupCacheContext context) {
+  KJ_IF_MAYBE(result, cache_manager_.Lookup(context.getParams().getRequest())) {
+    context.getResults().setFound(true);
+    context.getResults().setResult(*result);
+  }
+  return kj::READY_NOW;
+}
+
+kj::Promise<void> Federation::HandleStore(
+    capnproto::MainServer::StoreCacheContext context) {
+  auto params = context.getParams();
+  auto outputs = Dispatcher::Outputs(params.getResult());
+  return util::File::MaybeGetAll(outputs, params.getSender())
+      .then([this, context]() mutable {
+        auto params = context.getParams();
+        cache_manager_.Set(params.getRequest(), params.getResult());
+      });
+}
+
+void Federation::Lend() {
+  // The workers are lent only when nothing waits for them here, so that the
+  // requests do not bounce between the servers.
+  size_t idle = dispatcher_.IdleWorkers();
+  if (idle == 0 || dispatcher_.QueuedRequests() != 0) return;
+  uint32_t credits = std::max<size_t>(idle / peers_.size(), 1);
+  for (Peer& peer : peers_) {
+    if (peer.lending) continue;
+    peer.lending = true;
+    auto server = Connect(&peer);
+    auto req = server.registerEvaluatorRequest();
+    req.setName("peer " + Flags::peer_address);
+    req.setEvaluator(kj::heap<PeerEvaluator>(&dispatcher_, server));
+    req.setCredits(credits);
+    auto worker = req.initWorker();
+    worker.setId(worker_id_);
+    worker.setPeer(true);
+    Peer* ptr = &peer;
+    req.send()
+        .then([ptr](auto) { ptr->lending = false; },
+              [this, ptr](kj::Exception exc) {
+                ptr->lending = false;
+                Disconnect(ptr, exc);
+              })
+        .detach([](kj::Exception exc) {
+          KJ_LOG(WARNING, "Lending failed", exc.getDescription());
+        });
+  }
+}
+
+kj::Promise<void> Federation::LendLoop() {
+  return timer_->afterDelay(kLendIntervalMillis * kj::MILLISECONDS)
+      .then([this]() {
+        Lend();
+        return LendLoop();
+      });
+}
+
+}  // namespace server
@@ -0,0 +1,97 @@
+#ifndef SERVER_FEDERATION_HPP
+#define SERVER_FEDERATION_HPP
+#include <capnp/ez-rpc.h>
+#include <kj/async.h>
+#include <kj/timer.h>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include "capnp/server.capnp.h"
+#include "server/cache.hpp"
+#include "server/dispatcher.hpp"
+
+namespace server {
+
+// The servers listed in Flags::peers share their caches and their workers.
+// Every request digest is owned by one of them, chosen by consistent hashing:
+// the results are also stored in the cache of the owner, and the lookups
+// that miss the local cache ask it. A server that has idle workers and no
+// queued requests lends them to the others, by registering on them as an
+// evaluator that runs the requests on its workers.
+//
+// Flags::remote_cache is a server shared by every federation, like the one
+// of the CI, that is asked after the owner. It only receives the untimed
+// results, and only with Flags::remote_cache_write.
+class Federation {
+ public:
+  Federation(Dispatcher* dispatcher, CacheManager* cache_manager);
+  KJ_DISALLOW_COPY(Federation);
+
+  // Starts lending the idle workers to the peers, if there are any.
+  void Start(kj::Timer* timer);
+
+  // Looks up the request in the cache of its owner, if it is another server,
+  // and then in the remote cache, and copies the result and its outputs in
+  // the local cache. Resolves to whether the result was found.
+  kj::Promise<bool> Lookup(capnproto::Request::Reader request);
+
+  // Stores the result in the cache of the owner of the request, if it is
+  // another server, and in the remote cache if allowed. They fetch the
+  // outputs from this one in the background.
+  void Store(capnproto::Request::Reader request,
+             capnproto::Result::Reader result);
+
+  // Answer the calls of the peers.
+  kj::Promise<void> HandleLookup(
+      capnproto::MainServer::LookupCacheContext context);
+  kj::Promise<void> HandleStore(
+      capnproto::MainServer::StoreCacheContext context);
+
+ private:
+  // Points of each server on the ring of the consistent hashing.
+  static const constexpr size_t kRingPoints = 64;
+  // Interval between the checks for idle workers to lend.
+  static const constexpr int64_t kLendIntervalMillis = 1000;
+  // Time after which a lookup is considered a miss, including the transfer
+  // of the outputs.
+  static const constexpr int64_t kLookupTimeoutMillis = 10000;
+
+  struct Peer {
+    std::string address;
+    // Connected when first needed, and again after a failure.
+    kj::Own<capnp::EzRpcClient> client;
+    // Whether some idle workers are registered on the peer.
+    bool lending = false;
+  };
+
+  // Returns the peer that owns the request, or nullptr if it is this server.
+  Peer* Owner(capnproto::Request::Reader request);
+  capnproto::MainServer::Client Connect(Peer* peer);
+  // Forgets the connection to the peer after a failure.
+  void Disconnect(Peer* peer, const kj::Exception& exc);
+  // Looks the request up on the peer, giving up after kLookupTimeoutMillis.
+  kj::Promise<bool> LookupOn(Peer* peer, capnproto::Request::Reader request);
+  kj::Promise<bool> FetchFrom(Peer* peer, capnproto::Request::Reader request);
+  void StoreOn(Peer* peer, capnproto::Request::Reader request,
+               capnproto::Result::Reader result);
+
+  void Lend();
+  kj::Promise<void> LendLoop();
+
+  Dispatcher& dispatcher_;
+  CacheManager& cache_manager_;
+  std::vector<Peer> peers_;
+  std::unique_ptr<Peer> remote_;
+  // Maps the points of the ring to the index of their peer, or -1 for this
+  // server.
+  std::map<uint64_t, int> ring_;
+  // Identifies the workers of this server on the peers.
+  uint64_t worker_id_ = 0;
+  kj::Timer* timer_ = nullptr;
+  kj::Promise<void> lend_loop_ = kj::READY_NOW;
+};
+
+}  // namespace server
+
+#endif
@@ -5,19 +5,45 @@
 
 #include "server/server.hpp"
 #include "util/daemon.hpp"
+#include "util/file.hpp"
 #include "util/flags.hpp"
+#include "util/io_pool.hpp"
 #include "util/log_manager.hpp"
 #include "util/misc.hpp"
+#include "util/transfer_scheduler.hpp"
 #include "util/version.hpp"
+#include "worker/main.hpp"
 
 namespace server {
 kj::MainBuilder::Validity Main::Run() {
   if (Flags::daemon) {
     util::daemonize("server", Flags::pidfile);
   }
+  if (!util::File::ValidDurability(Flags::durability)) {
+    return "--durability must be file, batch or none";
+  }
   util::LogManager log_manager(&context);
-  capnp::EzRpcServer server(kj::heap<server::Server>(), Flags::listen_address,
-                            Flags::port);
+  util::File::RecoverStore();
+  auto main = kj::heap<server::Server>();
+  server::Server* main_ptr = main.get();
+  capnproto::MainServer::Client main_client = std::move(main);
+  capnp::EzRpcServer server(main_client, Flags::listen_address, Flags::port);
+  main_ptr->SetTimer(&server.getIoProvider().getTimer());
+  util::TransferScheduler& transfers = util::TransferScheduler::Get();
+  transfers.SetTimer(&server.getIoProvider().getTimer());
+  transfers.SetBulkBandwidth(Flags::bulk_bandwidth * 1024ULL * 1024);
+  // Reading the files that are sent would otherwise stall the scheduling of
+  // every frontend and worker.
+  util::IoPool send_pool(&server.getLowLevelIoProvider(), Flags::send_threads);
+  if (Flags::send_threads != 0) util::File::SetSendPool(&send_pool);
+  if (Flags::embedded_worker) {
+    // The worker calls the server without going through the network, and
+    // the outputs it stores are already in the store of the server, which
+    // tracks them for eviction.
+    worker::RunEmbedded(std::move(main_client), &server.getLowLevelIoProvider(),
+                        &server.getIoProvider().getTimer(),
+                        &server.getWaitScope(), main_ptr->Files());
+  }
   kj::NEVER_DONE.wait(server.getWaitScope());
 }
 
@@ -26,6 +52,13 @@ kj::MainFunc Main::getMain() {
                          "Receives evaluations and dispatches them to workers")
       .addOptionWithArg({'L', "logfile"}, util::setString(&Flags::log_file),
                         "<LOGFILE>", "Path where the log file should be stored")
+      .addOptionWithArg({"log-levels"}, util::setString(&Flags::log_levels),
+                        "<LEVELS>",
+                        "Severity of the messages of each subsystem, like "
+                        "server=INFO,util=WARNING")
+      .addOptionWithArg({"log-rate"}, util::setUint(&Flags::log_rate), "<N>",
+                        "Maximum INFO messages per second of a line of code. "
+                        "0 means unlimited")
       .addOption({'d', "daemon"}, util::setBool(&Flags::daemon),
                  "Become a daemon")
       .addOptionWithArg({'P', "pidfile"}, util::setString(&Flags::pidfile),
@@ -33,6 +66,17 @@ kj::MainFunc Main::getMain() {
       .addOptionWithArg({'S', "store-dir"},
                         util::setString(&Flags::store_directory), "<DIR>",
                         "Path where the files should be stored")
+      .addOptionWithArg({"durability"}, util::setString(&Flags::durability),
+                        "<MODE>",
+                        "When stored files are flushed to disk: file (each "
+                        "file), batch (periodically) or none")
+      .addOptionWithArg({"sync-interval"},
+                        util::setUint(&Flags::sync_interval), "<MS>",
+                        "Interval between flushes with batch durability")
+      .addOptionWithArg({"pack-threshold"},
+                        util::setUint(&Flags::pack_threshold), "<KiB>",
+                        "Store the files smaller than this in pack files "
+                        "instead of a file each. 0 means never")
       .addOptionWithArg({'T', "temp-dir"},
                         util::setString(&Flags::temp_directory), "<DIR>",
                         "Path where the sandboxes should be crated")
@@ -44,6 +88,96 @@ kj::MainFunc Main::getMain() {
       .addOptionWithArg(
           {'c', "cache-size"}, util::setUint(&Flags::cache_size), "<SZ>",
           "Maximum size of the cache, in MiB. 0 means unlimited")
+      .addOptionWithArg({"frontend-requests"},
+                        util::setUint(&Flags::frontend_requests), "<N>",
+                        "Maximum number of running requests of a single "
+                        "frontend. 0 means unlimited")
+      .addOptionWithArg({"frontend-cpu-quota"},
+                        util::setUint(&Flags::frontend_cpu_quota), "<SECONDS>",
+                        "Cpu time after which a frontend gets workers only "
+                        "when no other frontend wants them. 0 means unlimited")
+      .addOptionWithArg({"queued-requests"},
+                        util::setUint(&Flags::queued_requests), "<N>",
+                        "Maximum number of requests waiting for a worker. 0 "
+                        "means unlimited")
+      .addOptionWithArg({"queued-mib"}, util::setUint(&Flags::queued_mib),
+                        "<MiB>",
+                        "Maximum size of the requests waiting for a worker. "
+                        "0 means unlimited")
+      .addOptionWithArg({"frontend-queued-requests"},
+                        util::setUint(&Flags::frontend_queued_requests),
+                        "<N>",
+                        "Maximum number of requests of a single frontend "
+                        "waiting for a worker. 0 means unlimited")
+      .addOptionWithArg({"frontend-queued-mib"},
+                        util::setUint(&Flags::frontend_queued_mib), "<MiB>",
+                        "Maximum size of the requests of a single frontend "
+                        "waiting for a worker. 0 means unlimited")
+      .addOption({"hedge"}, util::setBool(&Flags::hedge),
+                 "Run a copy of the requests that take too long on idle "
+                 "workers")
+      .addOption({"lazy-outputs"}, util::setBool(&Flags::lazy_outputs),
+                 "Leave the outputs on the workers until they are needed "
+                 "elsewhere. They are lost if the worker goes away first")
+      .addOptionWithArg({"prefetch-requests"},
+                        util::setUint(&Flags::prefetch_requests), "<N>",
+                        "Number of queued requests whose inputs are sent "
+                        "ahead of time to the workers likely to run them. 0 "
+                        "disables prefetching")
+      .addOptionWithArg({"speed-tolerance"},
+                        util::setUint(&Flags::speed_tolerance), "<PERCENT>",
+                        "Maximum difference between the calibrated speeds of "
+                        "the workers that run the timed requests of an "
+                        "evaluation")
+      .addOptionWithArg({"bulk-bandwidth"},
+                        util::setUint(&Flags::bulk_bandwidth), "<MiB/s>",
+                        "Maximum bandwidth used to send files to the "
+                        "frontends. 0 means unlimited")
+      .addOptionWithArg({"heartbeat-interval"},
+                        util::setUint(&Flags::heartbeat_interval), "<SECS>",
+                        "Interval between heartbeats sent to the workers")
+      .addOptionWithArg({"heartbeat-timeout"},
+                        util::setUint(&Flags::heartbeat_timeout), "<SECS>",
+                        "Time after which a worker that does not answer the "
+                        "heartbeats is considered dead. 0 disables heartbeats")
+      .addOptionWithArg({"send-threads"}, util::setUint(&Flags::send_threads),
+                        "<N>",
+                        "Threads that read the files sent by the server. 0 "
+                        "means that they are read by the main thread")
+      .addOptionWithArg({"trace-dir"},
+                        util::setString(&Flags::trace_directory), "<DIR>",
+                        "Write a trace of each evaluation in this directory, "
+                        "in the Chrome trace format")
+      .addOptionWithArg({"peers"}, util::setString(&Flags::peers),
+                        "<ADDRESSES>",
+                        "Comma separated host:port of the servers of the "
+                        "federation, including this one, that share their "
+                        "caches and their workers")
+      .addOptionWithArg({"peer-address"},
+                        util::setString(&Flags::peer_address), "<ADDRESS>",
+                        "Address of this server in --peers")
+      .addOptionWithArg({"remote-cache"},
+                        util::setString(&Flags::remote_cache), "<ADDRESS>",
+                        "host:port of a server whose cache is shared, asked "
+                        "when a result is not in the local cache")
+      .addOption({"remote-cache-write"},
+                 util::setBool(&Flags::remote_cache_write),
+                 "Also send the new untimed results to the remote cache")
+      .addOption({"embedded-worker"}, util::setBool(&Flags::embedded_worker),
+                 "Also run a worker in this process, that shares the store "
+                 "and the event loop of the server")
+      .addOptionWithArg({'n', "num-cores"}, util::setInt(&Flags::num_cores),
+                        "<N>", "Number of cores of the embedded worker")
+      .addOptionWithArg({'m', "memory"}, util::setUint(&Flags::memory),
+                        "<MiB>",
+                        "Memory available to the executions of the embedded "
+                        "worker, in MiB. 0 means all the physical memory")
+      .addOptionWithArg({'r', "pending-requests"},
+                        util::setInt(&Flags::pending_requests), "<REQS>",
+                        "Maximum number of pending requests of the embedded "
+                        "worker. -1 adapts it to the executions")
+      .addOption({'k', "keep_sandboxes"}, util::setBool(&Flags::keep_sandboxes),
+                 "Keep the sandboxes of the embedded worker after evaluation")
       .callAfterParsing(KJ_BIND_METHOD(*this, Run))
       .build();
 }
@@ -1,29 +1,197 @@
 #include "server/server.hpp"
+#include "util/compare.hpp"
 #include "util/file.hpp"
+#include "util/flags.hpp"
+#include "util/io_pool.hpp"
+#include "util/log_manager.hpp"
+#include "util/metrics.hpp"
+#include "util/trace.hpp"
 
 #include <kj/debug.h>
+#include <kj/vector.h>
 
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <random>
 #include <string>
+#include <unordered_map>
+#include <unordered_set>
 
 namespace server {
 namespace {
-uint32_t AddFileInfo(uint32_t* last_file_id,
-                     std::unordered_map<uint32_t, detail::FileInfo>* info,
-                     capnproto::File::Builder builder, bool executable,
-                     const std::string& description) {
-  uint32_t id = (*last_file_id)++;
-  (*info)[id].id = id;
-  (*info)[id].description = description;
-  (*info)[id].executable = executable;
-  builder.setId(id);
-  return id;
+// Largest total size of the files that the builtin comparison compares on the
+// server, since it blocks the event loop.
+const constexpr int64_t kMaxLocalCompareBytes = 16 * 1024 * 1024;
+
+// Absolute path of the store, that the frontends on the same host use
+// directly.
+const std::string& StoreDirectory() {
+  static const std::string dir = []() {
+    util::File::MakeDirs(Flags::store_directory);
+    char* path = realpath(Flags::store_directory.c_str(), nullptr);
+    KJ_ASSERT(path != nullptr, Flags::store_directory, strerror(errno));
+    std::string dir = path;
+    free(path);  // NOLINT
+    return dir;
+  }();
+  return dir;
+}
+
+std::string LocalTokenFile() {
+  return util::File::JoinPath(StoreDirectory(), "local_token");
+}
+
+// Random token written in the store when the first frontend asks for it. The
+// frontends that read the same token share the filesystem of the server.
+const std::string& LocalToken() {
+  static const std::string token = []() {
+    std::random_device random;
+    char buf[17];
+    snprintf(buf, sizeof(buf), "%08x%08x", random(), random());  // NOLINT
+    std::string token = buf;                                      // NOLINT
+    auto receiver = util::File::Write(LocalTokenFile(), /*overwrite=*/true);
+    receiver({reinterpret_cast<const kj::byte*>(token.data()),  // NOLINT
+              token.size()});
+    receiver({});
+    return token;
+  }();
+  return token;
 }
+
 }  // namespace
 
-void ExecutionGroup::Register(Execution* ex) { executions_.push_back(ex); }
+namespace detail {
+kj::Promise<void> FileInfo::Ready() {
+  switch (state_) {
+    case State::READY:
+      return kj::READY_NOW;
+    case State::FAILED:
+      return kj::cp(*failure_);
+    case State::PENDING:
+      break;
+  }
+  KJ_IF_MAYBE(ready, ready_) { return ready->addBranch(); }
+  auto pf = kj::newPromiseAndFulfiller<void>();
+  fulfiller_ = std::move(pf.fulfiller);
+  ready_ = pf.promise.fork();
+  return KJ_ASSERT_NONNULL(ready_).addBranch();
+}
+
+bool FileInfo::Fulfill() {
+  if (state_ != State::PENDING) return false;
+  state_ = State::READY;
+  if (fulfiller_) fulfiller_->fulfill();
+  return true;
+}
+
+bool FileInfo::Reject(kj::Exception exc) {
+  if (state_ != State::PENDING) return false;
+  state_ = State::FAILED;
+  if (fulfiller_) fulfiller_->reject(kj::cp(exc));
+  failure_ = std::make_unique<kj::Exception>(std::move(exc));
+  return true;
+}
+
+util::Join FileInfo::Propagation() {
+  KJ_IF_MAYBE(join, propagated_) { return *join; }
+  util::Join join;
+  propagated_ = join;
+  return join;
+}
+
+kj::Promise<void> FileInfo::Propagated() {
+  KJ_IF_MAYBE(join, propagated_) {
+    auto promise = join->Finalize();
+    propagated_ = nullptr;
+    return promise;
+  }
+  return kj::READY_NOW;
+}
+
+bool NameMap::Less(const Entry& a, const Entry& b) {
+  return std::less<const std::string*>()(a.first, b.first);
+}
+
+bool NameMap::Add(const std::string* name, uint32_t id) {
+  auto it =
+      std::lower_bound(entries_.begin(), entries_.end(), Entry{name, 0}, Less);
+  if (it != entries_.end() && it->first == name) return false;
+  entries_.insert(it, Entry{name, id});
+  return true;
+}
+
+uint32_t NameMap::Find(const std::string* name) const {
+  auto it =
+      std::lower_bound(entries_.begin(), entries_.end(), Entry{name, 0}, Less);
+  if (it == entries_.end() || it->first != name) return 0;
+  return it->second;
+}
+}  // namespace detail
+
+size_t ExecutionGroup::Register(Execution* ex) {
+  executions_.push_back(ex);
+  // The existing requests are moved only if the list cannot grow in place,
+  // and then only their pointers are copied.
+  processes_.truncate(executions_.size());
+  return executions_.size() - 1;
+}
 
 void ExecutionGroup::setExclusive() { request_.setExclusive(true); }
 void ExecutionGroup::disableCache() { cache_enabled_ = false; }
+void ExecutionGroup::setTimed() { request_.setTimed(true); }
+void ExecutionGroup::SetStopGroup(uint32_t stop_group) {
+  KJ_REQUIRE(stop_group_ == 0 || stop_group_ == stop_group,
+             "The executions of a group are in different stop groups",
+             description_);
+  stop_group_ = stop_group;
+  canceled_ = frontend_context_.StopGroupCanceled(stop_group);
+}
+void ExecutionGroup::setPriority(int32_t priority) {
+  priority_ = priority_set_ ? std::max(priority_, priority) : priority;
+  priority_set_ = true;
+}
+void ExecutionGroup::SetBatchExecutable(const std::string& executable) {
+  if (batch_executable_.empty()) batch_executable_ = executable;
+  KJ_REQUIRE(batch_executable_ == executable,
+             "The items of a batch must have the same executable");
+}
+
+uint32_t ExecutionGroup::CriticalPath() {
+  if (critical_path_) return critical_path_;
+  // Stops the recursion if the graph has a loop, that would stall anyway.
+  critical_path_ = 1;
+  uint32_t longest = 0;
+  for (auto ex : executions_) {
+    for (uint32_t id : ex->outputFiles()) {
+      for (auto consumer : frontend_context_.Info(id).consumers) {
+        longest = std::max(longest, consumer->CriticalPath());
+      }
+    }
+  }
+  critical_path_ = longest + 1;
+  return critical_path_;
+}
+
+RequestPriority ExecutionGroup::Priority() {
+  std::unordered_set<ExecutionGroup*> dependents;
+  for (auto ex : executions_) {
+    for (uint32_t id : ex->outputFiles()) {
+      for (auto consumer : frontend_context_.Info(id).consumers) {
+        dependents.insert(consumer);
+      }
+    }
+  }
+  RequestPriority priority;
+  priority.explicit_priority = priority_;
+  priority.critical_path = CriticalPath();
+  priority.dependents = dependents.size();
+  return priority;
+}
 kj::Promise<void> ExecutionGroup::notifyStart() {
   return forked_start_.addBranch()
       .then([this]() {
@@ -32,173 +200,688 @@ kj::Promise<void> ExecutionGroup::notifyStart() {
       .exclusiveJoin(frontend_context_.forked_early_stop_.addBranch());
 }
 
+kj::Own<Execution> ExecutionGroup::AddExecution(
+    const std::string& description) {
+  KJ_LOG(INFO, "Adding execution " + description + " to group " + description_);
+  return kj::heap<Execution>(&frontend_context_,
+                             description + " of group " + description_, this);
+}
+
+uint32_t ExecutionGroup::CreateFifo(bool shared, bool stream) {
+  KJ_REQUIRE(!batch_, "Batches cannot have FIFOs");
+  KJ_REQUIRE(!shared || !stream, "Stream FIFOs cannot be shared");
+  KJ_LOG(INFO, "Creating FIFO " + std::to_string(next_fifo_) + " in group " +
+                   description_);
+  if (shared) shared_fifos_.insert(next_fifo_);
+  if (stream) stream_fifos_.insert(next_fifo_);
+  return next_fifo_++;
+}
+
 kj::Promise<void> ExecutionGroup::addExecution(AddExecutionContext context) {
-  KJ_LOG(INFO, "Adding execution " +
-                   std::string(context.getParams().getDescription()) +
-                   " to group " + description_);
   context.getResults().setExecution(
-      kj::heap<Execution>(&frontend_context_,
-                          std::string(context.getParams().getDescription()) +
-                              " of group " + description_,
-                          this));
+      AddExecution(context.getParams().getDescription()));
   return kj::READY_NOW;
 }
 
 kj::Promise<void> ExecutionGroup::createFifo(CreateFifoContext context) {
-  KJ_LOG(INFO, "Creating FIFO " + std::to_string(next_fifo_) + " in group " +
-                   description_);
-  context.getResults().getFifo().setId(next_fifo_++);
+  bool shared = context.getParams().getShared();
+  bool stream = context.getParams().getStream();
+  context.getResults().getFifo().setId(CreateFifo(shared, stream));
+  context.getResults().getFifo().setShared(shared);
+  context.getResults().getFifo().setStream(stream);
   return kj::READY_NOW;
 }
 
-kj::Promise<void> ExecutionGroup::Finalize(Execution* ex) {
+void ExecutionGroup::Seal() {
   request_.setEvaluationId(frontend_context_.frontend_id_);
   if (!finalized_) {
     finalized_ = true;
+    phase_start_ = util::Tracer::NowMicros();
+    KJ_REQUIRE(written_streams_ == stream_fifos_, "Stream FIFOs need a writer",
+               description_);
     KJ_LOG(INFO, "Execution group " + description_,
            "Creating dependency edges");
-    util::UnionPromiseBuilder dependencies;
-    dependencies.AddPromise(
-        frontend_context_.forked_evaluation_start_.addBranch(),
-        description_ + " evaluation start");
-    for (auto ex : executions_) {
-      ex->addDependencies(&dependencies);
+    util::Join dependencies;
+    if (batch_) {
+      dependencies.AddPromise(BatchDependencies());
+    } else {
+      dependencies.AddPromise(
+          frontend_context_.forked_evaluation_start_.addBranch());
+      for (auto ex : executions_) {
+        ex->addDependencies(&dependencies);
+      }
     }
     done_ =
-        std::move(dependencies)
-            .Finalize()
+        dependencies.Finalize()
             .then(
                 [this]() -> kj::Promise<void> {
-                  request_.initProcesses(executions_.size());
-                  for (size_t i = 0; i < executions_.size(); i++) {
-                    executions_[i]->prepareRequest();
-                    request_.getProcesses().setWithCaveats(
-                        i, executions_[i]->request_);
-                  }
-                  KJ_LOG(INFO, "Execution group " + description_, request_);
+                  Trace("dependencies", phase_start_);
+                  phase_start_ = util::Tracer::NowMicros();
+                  PrepareRequest();
                   return kj::READY_NOW;
                 },
                 [this](kj::Exception exc) -> kj::Promise<void> {
                   start_.fulfiller->reject(kj::cp(exc));
                   for (auto ex : executions_) {
+                    // The items of a batch are marked as failed one by one.
+                    if (ex->dependencies_failure_ != nullptr) continue;
                     ex->onDependenciesFailure(kj::cp(exc));
                   }
                   return kj::Promise<void>(std::move(exc));
                 })
             .eagerlyEvaluate(nullptr)
-            .then([this]() mutable {
-              if (cache_enabled_ &&
-                  frontend_context_.cache_manager_.Has(request_)) {
-                auto res = frontend_context_.cache_manager_.Get(request_);
+            .then([this]() mutable -> kj::Promise<void> {
+              KJ_IF_MAYBE(results, cached_results_) {
+                uint64_t propagation_start = util::Tracer::NowMicros();
+                auto propagated = std::move(*results);
+                cached_results_ = nullptr;
+                return propagated.then([this, propagation_start]() {
+                  ResultsPropagated(propagation_start);
+                });
+              }
+              kj::Maybe<capnproto::Result::Reader> cached = nullptr;
+              // Looked up again even after a miss of MaybeResolveFromCache:
+              // the result may have been stored since, for example by an
+              // identical group of another frontend.
+              if (cache_enabled_) {
+                cached = frontend_context_.cache_manager_.Lookup(request_);
+              }
+              KJ_IF_MAYBE(cached_result, cached) {
                 start_.fulfiller->fulfill();
-                util::UnionPromiseBuilder dependencies_propagated;
-                for (size_t i = 0; i < executions_.size(); i++) {
-                  executions_[i]->processResult(res.getProcesses()[i],
-                                                &dependencies_propagated, true);
-                }
-                return std::move(dependencies_propagated)
-                    .Finalize()
-                    .then([this]() {
-                      for (auto ex : executions_) {
-                        ex->onDependenciesPropagated();
-                      }
-                    })
-                    .eagerlyEvaluate(nullptr);
+                return ProcessResults(*cached_result, true);
               }
-
-              return frontend_context_.dispatcher_
-                  .AddRequest(request_, std::move(start_.fulfiller),
-                              frontend_context_.canceled_)
-                  .then(
-                      [this](
-                          capnp::Response<capnproto::Evaluator::EvaluateResults>
-                              results) mutable {
-                        auto res = results.getResult();
-                        util::UnionPromiseBuilder dependencies_propagated;
-                        if (cache_enabled_) {
-                          frontend_context_.cache_manager_.Set(request_, res);
-                        }
-                        for (size_t i = 0; i < executions_.size(); i++) {
-                          executions_[i]->processResult(
-                              res.getProcesses()[i], &dependencies_propagated);
-                        }
-                        return std::move(dependencies_propagated)
-                            .Finalize()
-                            .then([this]() {
-                              for (auto ex : executions_) {
-                                ex->onDependenciesPropagated();
-                              }
-                            })
-                            .eagerlyEvaluate(nullptr);
-                      },
-                      [this](kj::Exception exc) {
-                        for (auto ex : executions_) {
-                          ex->finish_promise_.fulfiller->reject(kj::cp(exc));
-                        }
-                        return kj::Promise<void>(std::move(exc));
-                      })
-                  .eagerlyEvaluate(nullptr);
+              if (!cache_enabled_) return Evaluate();
+              // The result may be in the cache of another server.
+              return frontend_context_.federation_.Lookup(request_).then(
+                  [this](bool found) -> kj::Promise<void> {
+                    if (found) {
+                      KJ_IF_MAYBE(cached_result,
+                                  frontend_context_.cache_manager_.Lookup(
+                                      request_)) {
+                        start_.fulfiller->fulfill();
+                        return ProcessResults(*cached_result, true);
+                      }
+                    }
+                    return Evaluate();
+                  });
             })
             .exclusiveJoin(frontend_context_.forked_early_stop_.addBranch())
             .eagerlyEvaluate(nullptr);
     forked_done_ = done_.fork();
+    if (frontend_context_.started_) {
+      frontend_context_.ResolveFromCache({this});
+    } else {
+      frontend_context_.finalized_groups_.push_back(this);
+    }
   }
+}
+
+kj::Promise<void> ExecutionGroup::Finalize(Execution* ex) {
+  Seal();
   for (const auto& execution : executions_) {
     if (execution == ex) {
-      return forked_done_.addBranch();
+      if (!batch_) return forked_done_.addBranch();
+      // The skipped items fail, even if the batch is run.
+      return forked_done_.addBranch().then([ex]() {
+        KJ_IF_MAYBE(exc, ex->dependencies_failure_) {
+          kj::throwRecoverableException(kj::cp(*exc));
+        }
+      });
     }
   }
   KJ_FAIL_ASSERT("Invalid execution for this group!");
 }  // namespace server
 
+void ExecutionGroup::PrepareRequest() {
+  if (request_prepared_) return;
+  if (batch_) {
+    PrepareBatch();
+  } else {
+    for (auto ex : executions_) ex->prepareRequest();
+    request_.adoptProcesses(std::move(processes_));
+    auto streams = request_.initStreams(stream_fifos_.size());
+    size_t i = 0;
+    for (uint32_t id : stream_fifos_) streams.set(i++, id);
+  }
+  // The processes were moved in the request, see Execution::request().
+  request_prepared_ = true;
+  UTIL_LOG(INFO, "Execution group " + description_, request_);
+}
+
+void ExecutionGroup::MaybeResolveFromCache() {
+  // The items of a batch are only known once their dependencies settle, and
+  // the results of the executions need somewhere to go.
+  if (!finalized_ || looked_up_ || batch_ || !cache_enabled_) {
+    return;
+  }
+  for (auto ex : executions_) {
+    if (ex->context_ == nullptr && !ex->subscribed_) return;
+    for (uint32_t id : ex->inputFiles()) {
+      if (!frontend_context_.Info(id).IsReady()) return;
+    }
+  }
+  looked_up_ = true;
+  PrepareRequest();
+  auto cached = frontend_context_.cache_manager_.Lookup(request_);
+  KJ_IF_MAYBE(cached_result, cached) {
+    start_.fulfiller->fulfill();
+    // The rest of the group, see Finalize, waits for the dependencies as
+    // usual.
+    cached_results_ = PassResults(*cached_result, true);
+  }
+}
+
+kj::Promise<void> ExecutionGroup::Evaluate() {
+  size_t bytes = request_.totalSize().wordCount * sizeof(capnp::word);
+  return frontend_context_.admission_
+      .Admit(frontend_context_.frontend_id_, bytes)
+      .then([this](kj::Own<util::AdmissionControl::Ticket> ticket) {
+        admission_ = std::move(ticket);
+        admission_released_ =
+            forked_start_.addBranch()
+                .then([this]() { admission_ = nullptr; },
+                      [this](kj::Exception) { admission_ = nullptr; })
+                .eagerlyEvaluate(nullptr);
+        return FetchAndDispatch();
+      });
+}
+
+kj::Promise<void> ExecutionGroup::FetchAndDispatch() {
+  // The dispatcher rejects the requests of a stopped group.
+  if (canceled_ && *canceled_) return Dispatch();
+  // Only the requests that miss the cache need the contents of the files
+  // provided by the frontend.
+  std::vector<uint32_t> inputs;
+  for (auto ex : batch_ ? batch_items_ : executions_) {
+    for (uint32_t id : ex->inputFiles()) inputs.push_back(id);
+  }
+  return frontend_context_.FetchProvided(inputs).then(
+      [this]() {
+        Trace("fetch provided files", phase_start_);
+        return Dispatch();
+      },
+      [this](kj::Exception exc) {
+        start_.fulfiller->reject(kj::cp(exc));
+        for (auto ex : executions_) {
+          ex->finish_promise_.fulfiller->reject(kj::cp(exc));
+        }
+        return kj::Promise<void>(std::move(exc));
+      });
+}
+
+kj::Promise<void> ExecutionGroup::Dispatch() {
+  // Comparisons of files that are already here are not worth a round-trip to
+  // a worker.
+  capnp::MallocMessageBuilder local_builder;
+  auto local = local_builder.initRoot<capnproto::ProcessResult>();
+  if (CompareLocally(local)) {
+    start_.fulfiller->fulfill();
+    util::Join dependencies_propagated;
+    executions_[0]->processResult(local.asReader(), &dependencies_propagated);
+    return dependencies_propagated.Finalize()
+        .then([this]() { executions_[0]->onDependenciesPropagated(); })
+        .eagerlyEvaluate(nullptr);
+  }
+
+  if (frontend_context_.traced_) {
+    request_.setTrace(true);
+    phase_start_ = util::Tracer::NowMicros();
+    traced_start_ = forked_start_.addBranch()
+                        .then(
+                            [this]() {
+                              Trace("queued", phase_start_);
+                              started_at_ = util::Tracer::NowMicros();
+                            },
+                            [](kj::Exception) {})
+                        .eagerlyEvaluate(nullptr);
+  }
+  return frontend_context_.dispatcher_
+      .AddRequest(request_, std::move(start_.fulfiller),
+                  canceled_ ? canceled_ : frontend_context_.canceled_,
+                  Priority())
+      .then(
+          [this](capnp::Response<capnproto::Evaluator::EvaluateResults>
+                     results) mutable {
+            auto res = results.getResult();
+            if (started_at_ != 0) Trace("evaluate", started_at_);
+            // res stays valid, the message is owned by the moved response.
+            if (cache_enabled_) StoreInCache(std::move(results));
+            return ProcessResults(res);
+          },
+          [this](kj::Exception exc) {
+            for (auto ex : executions_) {
+              ex->finish_promise_.fulfiller->reject(kj::cp(exc));
+            }
+            return kj::Promise<void>(std::move(exc));
+          })
+      .eagerlyEvaluate(nullptr);
+}
+
+kj::Promise<void> ExecutionGroup::BatchDependencies() {
+  kj::Vector<kj::Promise<bool>> items(executions_.size());
+  for (auto ex : executions_) {
+    util::Join dependencies;
+    dependencies.AddPromise(
+        frontend_context_.forked_evaluation_start_.addBranch());
+    ex->addDependencies(&dependencies);
+    items.add(dependencies.Finalize()
+                  .then([]() { return true; },
+                        [ex](kj::Exception exc) {
+                          ex->onDependenciesFailure(std::move(exc));
+                          return false;
+                        }));
+  }
+  return kj::joinPromises(items.releaseAsArray())
+      .then([this](kj::Array<bool> ready) -> kj::Promise<void> {
+        for (size_t i = 0; i < executions_.size(); i++) {
+          if (ready[i]) batch_items_.push_back(executions_[i]);
+        }
+        if (batch_items_.empty()) {
+          return KJ_EXCEPTION(FAILED,
+                              "All the items of " + description_ + " failed");
+        }
+        return kj::READY_NOW;
+      });
+}
+
+void ExecutionGroup::PrepareBatch() {
+  std::vector<capnproto::ProcessRequest::Reader> items;
+  for (auto item : batch_items_) {
+    item->prepareRequest();
+    items.push_back(item->request().asReader());
+  }
+  auto first = items[0];
+
+  // The inputs that are the same for all the items, such as the script of an
+  // interpreted checker, are given once.
+  std::unordered_map<std::string, util::SHA256_t> shared;
+  for (auto input : first.getInputFiles()) {
+    shared.emplace(input.getName(), input.getHash());
+  }
+  for (auto item : items) {
+    std::unordered_set<std::string> found;
+    for (auto input : item.getInputFiles()) {
+      auto it = shared.find(input.getName());
+      if (it != shared.end() && it->second == input.getHash()) {
+        found.insert(input.getName());
+      }
+    }
+    for (auto it = shared.begin(); it != shared.end();) {
+      it = found.count(it->first) ? std::next(it) : shared.erase(it);
+    }
+  }
+  auto own_input = [&shared](capnproto::ProcessRequest::Reader item,
+                             capnp::Text::Reader name) {
+    if (shared.count(name)) return false;
+    for (auto input : item.getInputFiles()) {
+      if (input.getName() == name) return true;
+    }
+    return false;
+  };
+  auto item_path = [](size_t i, capnp::Text::Reader name) {
+    return std::to_string(i) + "/" + std::string(name);
+  };
+
+  // The arguments that all the items start with, up to the first name of an
+  // input of their own, are given to the process.
+  size_t num_args = first.getArgs().size();
+  for (auto item : items) {
+    auto args = item.getArgs();
+    size_t i = 0;
+    while (i < num_args && i < args.size() && args[i] == first.getArgs()[i] &&
+           !own_input(item, args[i])) {
+      i++;
+    }
+    num_args = i;
+  }
+
+  auto process = request_.initProcesses(1)[0];
+  auto executable = first.getExecutable();
+  if (executable.isSystem()) {
+    process.getExecutable().setSystem(executable.getSystem());
+  } else {
+    process.getExecutable().setLocalFile(executable.getLocalFile());
+  }
+  auto args = process.initArgs(num_args);
+  for (size_t i = 0; i < num_args; i++) args.set(i, first.getArgs()[i]);
+  size_t num_inputs = shared.size();
+  for (auto item : items) {
+    num_inputs += item.getInputFiles().size() - shared.size();
+  }
+  auto inputs = process.initInputFiles(num_inputs);
+  size_t next_input = 0;
+  for (auto input : first.getInputFiles()) {
+    if (shared.count(input.getName())) {
+      inputs.setWithCaveats(next_input++, input);
+    }
+  }
+  auto batch = process.initBatch(items.size());
+  for (size_t i = 0; i < items.size(); i++) {
+    for (auto input : items[i].getInputFiles()) {
+      if (shared.count(input.getName())) continue;
+      auto copy = inputs[next_input++];
+      copy.setName(item_path(i, input.getName()));
+      copy.setHash(input.getHash());
+      copy.setExecutable(input.getExecutable());
+    }
+    auto item_args = items[i].getArgs();
+    auto batch_args = batch.init(i, item_args.size() - num_args);
+    for (size_t j = num_args; j < item_args.size(); j++) {
+      if (own_input(items[i], item_args[j])) {
+        batch_args.set(j - num_args, item_path(i, item_args[j]));
+      } else {
+        batch_args.set(j - num_args, item_args[j]);
+      }
+    }
+  }
+
+  // The limits of an item apply to each of them.
+  process.setLimits(first.getLimits());
+  auto limits = process.getLimits();
+  limits.setCpuTime(limits.getCpuTime() * items.size());
+  limits.setWallTime(limits.getWallTime() * items.size());
+  process.setExtraTime(first.getExtraTime());
+}
+
+kj::Promise<void> ExecutionGroup::ProcessResults(
+    capnproto::Result::Reader result, bool from_cache) {
+  uint64_t propagation_start = util::Tracer::NowMicros();
+  return PassResults(result, from_cache)
+      .then([this, propagation_start]() {
+        ResultsPropagated(propagation_start);
+      })
+      .eagerlyEvaluate(nullptr);
+}
+
+kj::Promise<void> ExecutionGroup::PassResults(capnproto::Result::Reader result,
+                                              bool from_cache) {
+  if (frontend_context_.traced_ && !from_cache) {
+    for (auto phase : result.getPhases()) {
+      util::Tracer::Add(frontend_context_.frontend_id_,
+                        {phase.getName(), "worker", description_,
+                         phase.getStart(), phase.getDuration()});
+    }
+  }
+  util::Join dependencies_propagated;
+  if (batch_) {
+    auto process = result.getProcesses()[0];
+    auto items = process.getBatch();
+    for (size_t i = 0; i < batch_items_.size(); i++) {
+      // The requests that fail before the process starts have no results for
+      // the items.
+      batch_items_[i]->processResult(i < items.size() ? items[i] : process,
+                                     &dependencies_propagated, from_cache);
+    }
+  } else {
+    for (size_t i = 0; i < executions_.size(); i++) {
+      executions_[i]->processResult(result.getProcesses()[i],
+                                    &dependencies_propagated, from_cache);
+    }
+  }
+  if (stop_group_ != 0) {
+    bool failed = false;
+    for (auto process : result.getProcesses()) {
+      failed = failed || !process.getStatus().isSuccess();
+      for (auto item : process.getBatch()) {
+        failed = failed || !item.getStatus().isSuccess();
+      }
+    }
+    if (failed) frontend_context_.Stop(stop_group_);
+  }
+  return dependencies_propagated.Finalize();
+}
+
+void ExecutionGroup::ResultsPropagated(uint64_t propagation_start) {
+  Trace("propagation", propagation_start);
+  for (auto ex : batch_ ? batch_items_ : executions_) {
+    ex->onDependenciesPropagated();
+  }
+}
+
+void ExecutionGroup::Trace(const char* phase, uint64_t start) {
+  if (!frontend_context_.traced_) return;
+  util::Tracer::Add(frontend_context_.frontend_id_,
+                    {phase, "server", description_, start,
+                     util::Tracer::NowMicros() - start});
+}
+
+bool ExecutionGroup::CompareLocally(capnproto::ProcessResult::Builder result) {
+  if (request_.getProcesses().size() != 1) return false;
+  auto process = request_.getProcesses()[0];
+  util::SHA256_t first = util::SHA256_t::ZERO;
+  util::SHA256_t second = util::SHA256_t::ZERO;
+  if (!util::IsBuiltinCompare(process) ||
+      !util::BuiltinCompareInputs(process, &first, &second)) {
+    return false;
+  }
+  int64_t first_size = util::File::StoreSize(first);
+  int64_t second_size = util::File::StoreSize(second);
+  if (first_size < 0 || second_size < 0 ||
+      first_size + second_size > kMaxLocalCompareBytes) {
+    return false;
+  }
+  bool equal = false;
+  KJ_IF_MAYBE(exc, kj::runCatchingExceptions([&]() {
+                equal = util::StoredFilesEqual(first, second);
+              })) {
+    KJ_LOG(WARNING, "Comparison failed, sending it to a worker", *exc);
+    return false;
+  }
+  util::SetBuiltinCompareResult(equal, result);
+  return true;
+}
+
+void ExecutionGroup::StoreInCache(
+    capnp::Response<capnproto::Evaluator::EvaluateResults> results) {
+  // The outputs may still be only on the worker, but the cache needs them.
+  std::vector<util::SHA256_t> outputs =
+      Dispatcher::Outputs(results.getResult());
+  cache_store_ =
+      frontend_context_.dispatcher_.Fetch(outputs)
+          .then([this, results = std::move(results)]() mutable {
+            frontend_context_.cache_manager_.Set(request_, results.getResult());
+            frontend_context_.federation_.Store(request_, results.getResult());
+          })
+          .eagerlyEvaluate([](kj::Exception exc) {
+            KJ_LOG(WARNING, "Result not cached", exc);
+          });
+}
+
 Execution::Execution(FrontendContext* frontend_context, std::string description,
                      ExecutionGroup* group)
     : frontend_context_(*frontend_context),
       description_(std::move(description)),
       group_(*group) {
-  group_.Register(this);
+  index_ = group_.Register(this);
 }
 
-kj::Promise<void> Execution::setExecutablePath(
-    SetExecutablePathContext context) {
+capnproto::ProcessRequest::Builder Execution::request() {
+  KJ_REQUIRE(!group_.RequestPrepared(),
+             "The request of the group is already prepared");
+  return group_.Process(index_);
+}
+
+void Execution::SetExecutablePath(kj::StringPtr path) {
   KJ_LOG(INFO, "Execution " + description_,
-         "Setting exacutable path to " +
-             std::string(context.getParams().getPath()));
-  request_.getExecutable().setSystem(context.getParams().getPath());
+         "Setting exacutable path to " + std::string(path));
+  if (group_.IsBatch()) {
+    group_.SetBatchExecutable("path " + std::string(path));
+  }
+  request().getExecutable().setSystem(path);
   executable_ = 0;
+}
+void Execution::SetExecutable(kj::StringPtr name, uint32_t id) {
+  auto log = kj::str("Setting exacutable to ", name, " id ", id);
+  KJ_LOG(INFO, "Execution " + description_, log);
+  executable_ = id;
+  if (group_.IsBatch()) {
+    group_.SetBatchExecutable("file " + std::to_string(executable_) + " " +
+                              std::string(name));
+  }
+  addConsumer(executable_);
+  request().getExecutable().initLocalFile().setName(name);
+}
+void Execution::SetStdin(uint32_t id) {
+  KJ_ASSERT(!stdin_ && !stdin_fifo_);
+  KJ_REQUIRE(!group_.IsBatch(), "The standard input of a batch is its items");
+  KJ_LOG(INFO, "Execution " + description_,
+         "Setting stdin file with id " + std::to_string(id));
+  stdin_ = id;
+  addConsumer(stdin_);
+}
+void Execution::AddInput(kj::StringPtr name, uint32_t id) {
+  KJ_LOG(INFO, "Execution " + description_,
+         "Adding file with id " + std::to_string(id) + " as input " +
+             std::string(name));
+  inputs_.Add(frontend_context_.Intern(name), id);
+  addConsumer(id);
+}
+void Execution::SetArgs(capnp::List<capnp::Text>::Reader args) {
+  std::string log;
+  for (auto s : args) log += " " + std::string(s);
+  KJ_LOG(INFO, "Execution " + description_, "Setting args to" + log);
+  request().setArgs(args);
+}
+void Execution::SetLimits(capnproto::Resources::Reader limits) {
+  KJ_LOG(INFO, "Execution " + description_,
+         kj::str("Setting limits to ", limits.toString().flatten()));
+  request().setLimits(limits);
+}
+void Execution::SetExtraTime(float extra_time) {
+  KJ_LOG(INFO, "Execution " + description_,
+         kj::str("Setting extra time to ", std::to_string(extra_time)));
+  request().setExtraTime(extra_time);
+}
+// TODO: check that this FIFO is from the correct execution group
+void Execution::AddFifo(kj::StringPtr name, uint32_t id) {
+  KJ_REQUIRE(!group_.IsBatch(), "Batches cannot have FIFOs");
+  KJ_REQUIRE(!group_.IsStreamFifo(id),
+             "Stream FIFOs can only be used as stdin and stdout");
+  KJ_LOG(INFO, "Execution " + description_,
+         "Adding FIFO with id " + std::to_string(id) + " as " +
+             std::string(name));
+  fifos_.Add(frontend_context_.Intern(name), id);
+}
+void Execution::SetStdinFifo(uint32_t id) {
+  KJ_ASSERT(!stdin_ && !stdin_fifo_);
+  KJ_REQUIRE(!group_.IsSharedFifo(id), "Shared FIFOs cannot be used as stdin");
+  KJ_LOG(INFO, "Execution " + description_,
+         "Adding FIFO with id " + std::to_string(id) + " as stdin");
+  stdin_fifo_ = id;
+}
+void Execution::SetStdoutFifo(uint32_t id) {
+  // The standard output file of the writer of a stream is the stream.
+  KJ_ASSERT(!stdout_fifo_ && (!stdout_ || group_.IsStreamFifo(id)));
+  KJ_REQUIRE(!group_.IsSharedFifo(id), "Shared FIFOs cannot be used as stdout");
+  KJ_REQUIRE(!group_.IsStreamFifo(id) || group_.AddStreamWriter(id),
+             "Stream FIFOs can only have one writer");
+  KJ_LOG(INFO, "Execution " + description_,
+         "Addoutg FIFO with id " + std::to_string(id) + " as stdout");
+  stdout_fifo_ = id;
+}
+void Execution::SetStderrFifo(uint32_t id) {
+  KJ_ASSERT(!stderr_ && !stderr_fifo_);
+  KJ_REQUIRE(!group_.IsSharedFifo(id), "Shared FIFOs cannot be used as stderr");
+  KJ_REQUIRE(!group_.IsStreamFifo(id), "Stream FIFOs cannot be used as stderr");
+  KJ_LOG(INFO, "Execution " + description_,
+         "Adderrg FIFO with id " + std::to_string(id) + " as stderr");
+  stderr_fifo_ = id;
+}
+uint32_t Execution::GetStdout(bool executable, capnproto::File::Builder file) {
+  KJ_ASSERT(!stdout_ &&
+            (!stdout_fifo_ || group_.IsStreamFifo(stdout_fifo_)));
+  stdout_ = frontend_context_.AddFile(
+      file, executable, "Standard output of execution " + description_);
+  KJ_LOG(INFO, "Execution " + description_,
+         "Creating stdout file with id " + std::to_string(stdout_));
+  return stdout_;
+}
+uint32_t Execution::GetStderr(bool executable, capnproto::File::Builder file) {
+  KJ_ASSERT(!stderr_ && !stderr_fifo_);
+  stderr_ = frontend_context_.AddFile(
+      file, executable, "Standard error of execution " + description_);
+  KJ_LOG(INFO, "Execution " + description_,
+         "Creating stderr file with id " + std::to_string(stderr_));
+  return stderr_;
+}
+uint32_t Execution::GetOutput(kj::StringPtr name, bool executable,
+                              capnproto::File::Builder file) {
+  KJ_REQUIRE(!group_.IsBatch(), "Items of a batch cannot have output files");
+  uint32_t id = frontend_context_.AddFile(
+      file, executable,
+      "Output " + std::string(name) + " of execution " + description_);
+  auto log = kj::str("Creating output file ", name, " with id ", id);
+  KJ_LOG(INFO, "Execution " + description_, log);
+  outputs_.Add(frontend_context_.Intern(name), id);
+  return id;
+}
+
+void Execution::Configure(capnproto::DagExecution::Reader execution,
+                          const std::vector<uint32_t>& files,
+                          const std::vector<uint32_t>& fifos) {
+  auto file = [&files](uint32_t index) {
+    KJ_REQUIRE(index <= files.size(), "Invalid file in DAG", index);
+    return index == 0 ? 0 : files[index - 1];
+  };
+  auto fifo = [&fifos](uint32_t index) {
+    KJ_REQUIRE(index <= fifos.size(), "Invalid FIFO in DAG", index);
+    return index == 0 ? 0 : fifos[index - 1];
+  };
+  auto executable = execution.getExecutable();
+  if (executable.isPath()) {
+    SetExecutablePath(executable.getPath());
+  } else if (executable.isFile()) {
+    KJ_REQUIRE(executable.getFile().getId() != 0, "Missing executable");
+    SetExecutable(executable.getFile().getName(),
+                  file(executable.getFile().getId()));
+  }
+  if (execution.getStdin()) SetStdin(file(execution.getStdin()));
+  if (execution.getStdinFifo()) SetStdinFifo(fifo(execution.getStdinFifo()));
+  if (execution.getStdoutFifo()) {
+    SetStdoutFifo(fifo(execution.getStdoutFifo()));
+  }
+  if (execution.getStderrFifo()) {
+    SetStderrFifo(fifo(execution.getStderrFifo()));
+  }
+  for (auto input : execution.getInputs()) {
+    KJ_REQUIRE(input.getId() != 0, "Missing input", input.getName());
+    AddInput(input.getName(), file(input.getId()));
+  }
+  for (auto input : execution.getFifos()) {
+    KJ_REQUIRE(input.getId() != 0, "Missing FIFO", input.getName());
+    AddFifo(input.getName(), fifo(input.getId()));
+  }
+  SetArgs(execution.getArgs());
+  if (execution.hasLimits()) SetLimits(execution.getLimits());
+  if (execution.getExtraTime() != 0) SetExtraTime(execution.getExtraTime());
+  group_.setPriority(execution.getPriority());
+  if (execution.getExclusive()) group_.setExclusive();
+  if (execution.getDisableCache()) group_.disableCache();
+  if (execution.getTimed()) group_.setTimed();
+  if (execution.getStopGroup()) group_.SetStopGroup(execution.getStopGroup());
+}
+
+kj::Promise<void> Execution::setExecutablePath(
+    SetExecutablePathContext context) {
+  SetExecutablePath(context.getParams().getPath());
   return kj::READY_NOW;
 }
 kj::Promise<void> Execution::setExecutable(SetExecutableContext context) {
-  auto log = kj::str("Setting exacutable to ", context.getParams().getName(),
-                     " id ", context.getParams().getFile().getId());
-  KJ_LOG(INFO, "Execution " + description_, log);
-  executable_ = context.getParams().getFile().getId();
-  request_.getExecutable().initLocalFile().setName(
-      context.getParams().getName());
+  SetExecutable(context.getParams().getName(),
+                context.getParams().getFile().getId());
   return kj::READY_NOW;
 }
 kj::Promise<void> Execution::setStdin(SetStdinContext context) {
-  KJ_ASSERT(!stdin_ && !stdin_fifo_);
-  KJ_LOG(INFO, "Execution " + description_,
-         "Setting stdin file with id " +
-             std::to_string(context.getParams().getFile().getId()));
-  stdin_ = context.getParams().getFile().getId();
+  SetStdin(context.getParams().getFile().getId());
   return kj::READY_NOW;
 }
 kj::Promise<void> Execution::addInput(AddInputContext context) {
-  KJ_LOG(INFO, "Execution " + description_,
-         "Adding file with id " +
-             std::to_string(context.getParams().getFile().getId()) +
-             " as input " + std::string(context.getParams().getName()));
-  inputs_.emplace(context.getParams().getName(),
-                  context.getParams().getFile().getId());
+  AddInput(context.getParams().getName(),
+           context.getParams().getFile().getId());
   return kj::READY_NOW;
 }
 kj::Promise<void> Execution::setArgs(SetArgsContext context) {
-  std::string args;
-  for (auto s : context.getParams().getArgs()) args += " " + std::string(s);
-  KJ_LOG(INFO, "Execution " + description_, "Setting args to" + args);
-  request_.setArgs(context.getParams().getArgs());
+  SetArgs(context.getParams().getArgs());
   return kj::READY_NOW;
 }
 kj::Promise<void> Execution::disableCache(DisableCacheContext /*context*/) {
@@ -212,86 +895,56 @@ kj::Promise<void> Execution::makeExclusive(MakeExclusiveContext /*context*/) {
   return kj::READY_NOW;
 }
 kj::Promise<void> Execution::setLimits(SetLimitsContext context) {
-  KJ_LOG(INFO, "Execution " + description_,
-         kj::str("Setting limits to ",
-                 context.getParams().getLimits().toString().flatten()));
-  request_.setLimits(context.getParams().getLimits());
+  SetLimits(context.getParams().getLimits());
   return kj::READY_NOW;
 }
 kj::Promise<void> Execution::setExtraTime(SetExtraTimeContext context) {
-  KJ_LOG(INFO, "Execution " + description_,
-         kj::str("Setting extra time to ",
-                 std::to_string(context.getParams().getExtraTime())));
-  request_.setExtraTime(context.getParams().getExtraTime());
+  SetExtraTime(context.getParams().getExtraTime());
   return kj::READY_NOW;
 }
-// TODO: check that this FIFO is from the correct execution group
 kj::Promise<void> Execution::addFifo(AddFifoContext context) {
-  KJ_LOG(INFO, "Execution " + description_,
-         "Adding FIFO with id " +
-             std::to_string(context.getParams().getFifo().getId()) + " as " +
-             std::string(context.getParams().getName()));
-  fifos_.emplace(context.getParams().getName(),
-                 context.getParams().getFifo().getId());
+  AddFifo(context.getParams().getName(),
+          context.getParams().getFifo().getId());
   return kj::READY_NOW;
 }
 kj::Promise<void> Execution::setStdinFifo(SetStdinFifoContext context) {
-  KJ_ASSERT(!stdin_ && !stdin_fifo_);
-  KJ_LOG(INFO, "Execution " + description_,
-         "Adding FIFO with id " +
-             std::to_string(context.getParams().getFifo().getId()) +
-             " as stdin");
-  stdin_fifo_ = context.getParams().getFifo().getId();
+  SetStdinFifo(context.getParams().getFifo().getId());
   return kj::READY_NOW;
 }
 kj::Promise<void> Execution::setStdoutFifo(SetStdoutFifoContext context) {
-  KJ_ASSERT(!stdout_ && !stdout_fifo_);
-  KJ_LOG(INFO, "Execution " + description_,
-         "Addoutg FIFO with id " +
-             std::to_string(context.getParams().getFifo().getId()) +
-             " as stdout");
-  stdout_fifo_ = context.getParams().getFifo().getId();
+  SetStdoutFifo(context.getParams().getFifo().getId());
   return kj::READY_NOW;
 }
 kj::Promise<void> Execution::setStderrFifo(SetStderrFifoContext context) {
-  KJ_ASSERT(!stderr_ && !stderr_fifo_);
-  KJ_LOG(INFO, "Execution " + description_,
-         "Adderrg FIFO with id " +
-             std::to_string(context.getParams().getFifo().getId()) +
-             " as stderr");
-  stderr_fifo_ = context.getParams().getFifo().getId();
+  SetStderrFifo(context.getParams().getFifo().getId());
   return kj::READY_NOW;
 }
 kj::Promise<void> Execution::getStdout(GetStdoutContext context) {
-  KJ_ASSERT(!stdout_ && !stdout_fifo_);
-  stdout_ = AddFileInfo(
-      &frontend_context_.last_file_id_, &frontend_context_.file_info_,
-      context.getResults().initFile(), context.getParams().getIsExecutable(),
-      "Standard output of execution " + description_);
-  KJ_LOG(INFO, "Execution " + description_,
-         "Creating stdout file with id " + std::to_string(stdout_));
+  GetStdout(context.getParams().getIsExecutable(),
+            context.getResults().initFile());
   return kj::READY_NOW;
 }
 kj::Promise<void> Execution::getStderr(GetStderrContext context) {
-  KJ_ASSERT(!stderr_ && !stderr_fifo_);
-  stderr_ = AddFileInfo(
-      &frontend_context_.last_file_id_, &frontend_context_.file_info_,
-      context.getResults().initFile(), context.getParams().getIsExecutable(),
-      "Standard error of execution " + description_);
-  KJ_LOG(INFO, "Execution " + description_,
-         "Creating stderr file with id " + std::to_string(stderr_));
+  GetStderr(context.getParams().getIsExecutable(),
+            context.getResults().initFile());
   return kj::READY_NOW;
 }
 kj::Promise<void> Execution::getOutput(GetOutputContext context) {
-  uint32_t id = AddFileInfo(
-      &frontend_context_.last_file_id_, &frontend_context_.file_info_,
-      context.getResults().initFile(), context.getParams().getIsExecutable(),
-      "Output " + std::string(context.getParams().getName()) +
-          " of execution " + description_);
-  auto log = kj::str("Creating output file ", context.getParams().getName(),
-                     " with id ", id);
-  KJ_LOG(INFO, "Execution " + description_, log);
-  outputs_.emplace(context.getParams().getName(), id);
+  GetOutput(context.getParams().getName(),
+            context.getParams().getIsExecutable(),
+            context.getResults().initFile());
+  return kj::READY_NOW;
+}
+kj::Promise<void> Execution::setPriority(SetPriorityContext context) {
+  KJ_LOG(INFO, "Execution " + description_,
+         "Setting priority to " +
+             std::to_string(context.getParams().getPriority()));
+  group_.setPriority(context.getParams().getPriority());
+  return kj::READY_NOW;
+}
+kj::Promise<void> Execution::setTimed(SetTimedContext /*context*/) {
+  KJ_LOG(INFO, "Execution " + description_, "Timed");
+  group_.setTimed();
   return kj::READY_NOW;
 }
 kj::Promise<void> Execution::notifyStart(NotifyStartContext /*context*/) {
@@ -299,13 +952,31 @@ kj::Promise<void> Execution::notifyStart(NotifyStartContext /*context*/) {
   return group_.notifyStart();
 }
 
-void Execution::addDependencies(util::UnionPromiseBuilder* dependencies) {
+void Execution::addConsumer(uint32_t id) {
+  frontend_context_.Info(id).consumers.push_back(&group_);
+}
+
+std::vector<uint32_t> Execution::inputFiles() const {
+  std::vector<uint32_t> ids;
+  if (executable_) ids.push_back(executable_);
+  if (stdin_) ids.push_back(stdin_);
+  for (const auto& input : inputs_) ids.push_back(input.second);
+  return ids;
+}
+
+std::vector<uint32_t> Execution::outputFiles() const {
+  std::vector<uint32_t> ids;
+  if (stdout_) ids.push_back(stdout_);
+  if (stderr_) ids.push_back(stderr_);
+  for (const auto& output : outputs_) ids.push_back(output.second);
+  return ids;
+}
+
+void Execution::addDependencies(util::Join* dependencies) {
   auto add_dep = [&dependencies, this](uint32_t id) {
     KJ_ASSERT(id != 0);
-    frontend_context_.file_info_[id].dependencies_propagated_.AddPromise(
-        dependencies->AddPromise(
-            frontend_context_.file_info_[id].forked_promise.addBranch(),
-            description_ + " dep to " + std::to_string(id)));
+    detail::FileInfo& info = frontend_context_.Info(id);
+    dependencies->AddPromise(info.Ready(), info.Propagation());
   };
   if (executable_) add_dep(executable_);
   if (stdin_) add_dep(stdin_);
@@ -326,47 +997,49 @@ void Execution::addDependencies(util::UnionPromiseBuilder* dependencies) {
 void Execution::prepareRequest() {
   auto get_hash = [this](uint32_t id, capnproto::SHA256::Builder builder) {
     KJ_ASSERT(id != 0);
-    auto hash = frontend_context_.file_info_[id].hash;
+    auto hash = frontend_context_.Info(id).hash;
     KJ_ASSERT(!hash.isZero(), id);
     hash.ToCapnp(builder);
   };
+  auto out = request();
   if (stdin_) {
-    get_hash(stdin_, request_.initStdin().initHash());
+    get_hash(stdin_, out.initStdin().initHash());
   } else if (stdin_fifo_) {
-    request_.initStdin().setFifo(stdin_fifo_);
+    out.initStdin().setFifo(stdin_fifo_);
   }
   if (stdout_fifo_) {
-    request_.setStdout(stdout_fifo_);
+    out.setStdout(stdout_fifo_);
   }
   if (stderr_fifo_) {
-    request_.setStderr(stderr_fifo_);
+    out.setStderr(stderr_fifo_);
   }
   if (executable_) {
-    get_hash(executable_, request_.getExecutable().getLocalFile().initHash());
+    get_hash(executable_, out.getExecutable().getLocalFile().initHash());
   }
-  request_.initFifos(fifos_.size());
+  out.initFifos(fifos_.size());
   {
     size_t i = 0;
     for (auto& fifo : fifos_) {
-      request_.getFifos()[i].setName(fifo.first);
-      request_.getFifos()[i].setId(fifo.second);
+      out.getFifos()[i].setName(*fifo.first);
+      out.getFifos()[i].setId(fifo.second);
+      out.getFifos()[i].setShared(group_.IsSharedFifo(fifo.second));
       i++;
     }
   }
-  request_.initInputFiles(inputs_.size());
+  out.initInputFiles(inputs_.size());
   {
     size_t i = 0;
     for (auto& input : inputs_) {
-      request_.getInputFiles()[i].setName(input.first);
-      get_hash(input.second, request_.getInputFiles()[i].getHash());
+      out.getInputFiles()[i].setName(*input.first);
+      get_hash(input.second, out.getInputFiles()[i].getHash());
       i++;
     }
   }
-  request_.initOutputFiles(outputs_.size());
+  out.initOutputFiles(outputs_.size());
   {
     size_t i = 0;
     for (auto& output : outputs_) {
-      request_.getOutputFiles().set(i, output.first);
+      out.getOutputFiles().set(i, *output.first);
       i++;
     }
   }
@@ -374,12 +1047,16 @@ void Execution::prepareRequest() {
 
 void Execution::processResult(
     capnproto::ProcessResult::Reader result,
-    util::UnionPromiseBuilder* dependencies_propagated, bool from_cache) {
+    util::Join* dependencies_propagated, bool from_cache) {
   KJ_IF_MAYBE(ctx, context_) {
     ctx->getResults().setResult(result);
     ctx->getResults().getResult().setWasCached(from_cache);
+  } else if (subscribed_) {
+    auto event = frontend_context_.AddEvent(event_index_);
+    event.setResult(result);
+    event.getResult().setWasCached(from_cache);
   }
-  KJ_LOG(INFO, "Execution " + description_, result);
+  UTIL_LOG(INFO, "Execution " + description_, result);
   if (result.getStatus().isInternalError()) {
     frontend_context_.evaluation_early_stop_.fulfiller->reject(
         KJ_EXCEPTION(FAILED, result.getStatus().getInternalError()));
@@ -387,13 +1064,14 @@ void Execution::processResult(
   }
   auto set_hash = [this, &result](uint32_t id, const util::SHA256_t& hash) {
     KJ_ASSERT(id != 0);
-    frontend_context_.file_info_[id].hash = hash;
+    frontend_context_.Info(id).hash = hash;
     if (!result.getStatus().isSuccess()) {
       KJ_LOG(INFO, "Marking file as failed", id, description_);
-      frontend_context_.file_info_[id].promise.fulfiller->reject(KJ_EXCEPTION(
-          FAILED, "File generation failed caused by " + description_));
+      frontend_context_.FileFailed(
+          id, KJ_EXCEPTION(FAILED,
+                           "File generation failed caused by " + description_));
     } else {
-      frontend_context_.file_info_[id].promise.fulfiller->fulfill();
+      frontend_context_.FileReady(id);
     }
   };
   if (stdout_) {
@@ -403,22 +1081,16 @@ void Execution::processResult(
     set_hash(stderr_, result.getStderr());
   }
   for (auto output : result.getOutputFiles()) {
-    std::string name = output.getName();
-    KJ_REQUIRE(outputs_.count(output.getName()), output.getName(),
-               "Unexpected output!");
-    set_hash(outputs_[output.getName()], output.getHash());
+    uint32_t id = outputs_.Find(frontend_context_.FindName(output.getName()));
+    KJ_REQUIRE(id != 0, output.getName(), "Unexpected output!");
+    set_hash(id, output.getHash());
   }
   // Reject all the non-fulfilled promises.
-  util::UnionPromiseBuilder builder;
   for (const auto& f : outputs_) {
-    auto& ff = frontend_context_.file_info_[f.second].promise.fulfiller;
-    if (ff) {
-      ff->reject(KJ_EXCEPTION(FAILED, "Missing file"));
-    }
+    frontend_context_.FileFailed(f.second,
+                                 KJ_EXCEPTION(FAILED, "Missing file"));
     dependencies_propagated->AddPromise(
-        std::move(
-            frontend_context_.file_info_[f.second].dependencies_propagated_)
-            .Finalize());
+        frontend_context_.Info(f.second).Propagated());
   }
 }
 
@@ -439,40 +1111,133 @@ void Execution::onDependenciesPropagated() {
 void Execution::onDependenciesFailure(kj::Exception exc) {
   KJ_LOG(INFO, "Marking execution as failed because its dependencies failed",
          description_);
+  dependencies_failure_ = kj::cp(exc);
+  if (subscribed_) {
+    frontend_context_.AddEvent(event_index_)
+        .setFailed(exc.getDescription().cStr());
+  }
   finish_promise_.fulfiller->reject(kj::cp(exc));
   auto mark_as_failed = [this](std::string name, int id) {
     KJ_LOG(INFO, description_, "Marking as failed", name, id);
     KJ_ASSERT(id != 0);
-    auto& ff = frontend_context_.file_info_[id].promise.fulfiller;
-    if (ff) {
-      ff->reject(KJ_EXCEPTION(FAILED, "Dependency failed: " + description_));
-    }
+    frontend_context_.FileFailed(
+        id, KJ_EXCEPTION(FAILED, "Dependency failed: " + description_));
   };
   if (stdout_) mark_as_failed("stdout", stdout_);
   if (stderr_) mark_as_failed("stdout", stderr_);
   for (const auto& f : outputs_) {
-    mark_as_failed(f.first, f.second);
+    mark_as_failed(*f.first, f.second);
   }
 }
 
 kj::Promise<void> Execution::getResult(GetResultContext context) {
   context_ = context;
   frontend_context_.scheduled_tasks_++;
-  frontend_context_.builder_.AddPromise(std::move(finish_promise_.promise),
-                                        description_ + " finish_promise_");
+  frontend_context_.builder_.AddPromise(std::move(finish_promise_.promise));
   return group_.Finalize(this).exclusiveJoin(
       frontend_context_.forked_early_stop_.addBranch());
 }
 
-kj::Promise<void> FrontendContext::provideFile(ProvideFileContext context) {
-  std::string descr = context.getParams().getDescription();
-  uint32_t id =
-      AddFileInfo(&last_file_id_, &file_info_, context.getResults().initFile(),
-                  context.getParams().getIsExecutable(), descr);
-  KJ_LOG(INFO, "Generating file with id " + std::to_string(id), "" + descr);
+void Execution::Subscribe(uint32_t index, bool notify_start) {
+  subscribed_ = true;
+  event_index_ = index;
+  frontend_context_.scheduled_tasks_++;
+  frontend_context_.builder_.AddPromise(std::move(finish_promise_.promise));
+  if (notify_start) {
+    FrontendContext* frontend = &frontend_context_;
+    frontend_context_.start_events_.add(
+        group_.notifyStart()
+            .then(
+                [frontend, index]() { frontend->AddEvent(index).setStarted(); },
+                [](kj::Exception) {})
+            .eagerlyEvaluate(nullptr));
+  }
+  // The result and the failures are sent by processResult and
+  // onDependenciesFailure.
+  group_.Seal();
+}
+
+uint32_t FrontendContext::ProvideFile(const util::SHA256_t& hash,
+                                      const std::string& description,
+                                      bool executable,
+                                      capnproto::File::Builder file) {
+  uint32_t id = AddFile(file, executable, description);
+  KJ_LOG(INFO, "Generating file with id " + std::to_string(id),
+         "" + description);
   KJ_ASSERT(id != 0);
-  file_info_[id].provided = true;
-  file_info_[id].hash = context.getParams().getHash();
+  Info(id).provided = true;
+  Info(id).hash = hash;
+  return id;
+}
+
+uint32_t FrontendContext::AddFile(capnproto::File::Builder file,
+                                  bool executable, std::string description) {
+  file_info_.emplace_back();
+  detail::FileInfo& info = file_info_.back();
+  info.id = static_cast<uint32_t>(file_info_.size());
+  info.description = std::move(description);
+  info.executable = executable;
+  unsettled_files_++;
+  file.setId(info.id);
+  return info.id;
+}
+
+detail::FileInfo& FrontendContext::Info(uint32_t id) {
+  KJ_REQUIRE(id != 0 && id <= file_info_.size(), "Unknown file", id);
+  return file_info_[id - 1];
+}
+
+void FrontendContext::FileReady(uint32_t id) {
+  if (!Info(id).Fulfill()) return;
+  if (--unsettled_files_ == 0 && files_settled_) files_settled_->fulfill();
+  if (started_) ResolveFromCache(Info(id).consumers);
+}
+
+void FrontendContext::FileFailed(uint32_t id, kj::Exception exc) {
+  if (!Info(id).Reject(std::move(exc))) return;
+  if (--unsettled_files_ == 0 && files_settled_) files_settled_->fulfill();
+}
+
+void FrontendContext::ResolveFromCache(
+    const std::vector<ExecutionGroup*>& groups) {
+  to_resolve_.insert(to_resolve_.end(), groups.begin(), groups.end());
+  // The groups resolved from the cache make their consumers ready, which are
+  // queued here instead of recursing along the chain.
+  if (resolving_) return;
+  resolving_ = true;
+  while (!to_resolve_.empty()) {
+    ExecutionGroup* group = to_resolve_.back();
+    to_resolve_.pop_back();
+    // The group still runs as usual once its dependencies are ready.
+    KJ_IF_MAYBE(exc, kj::runCatchingExceptions(
+                         [group]() { group->MaybeResolveFromCache(); })) {
+      KJ_LOG(WARNING, "Failed to resolve from the cache", *exc);
+    }
+  }
+  resolving_ = false;
+}
+
+kj::Promise<void> FrontendContext::FilesSettled() {
+  if (unsettled_files_ == 0) return kj::READY_NOW;
+  auto pf = kj::newPromiseAndFulfiller<void>();
+  files_settled_ = std::move(pf.fulfiller);
+  return std::move(pf.promise);
+}
+
+const std::string* FrontendContext::Intern(kj::StringPtr name) {
+  return &*names_.emplace(name.cStr(), name.size()).first;
+}
+
+const std::string* FrontendContext::FindName(kj::StringPtr name) const {
+  auto it = names_.find(std::string(name.cStr(), name.size()));
+  return it == names_.end() ? nullptr : &*it;
+}
+
+kj::Promise<void> FrontendContext::provideFile(ProvideFileContext context) {
+  ProvideFile(context.getParams().getHash(),
+              context.getParams().getDescription(),
+              context.getParams().getIsExecutable(),
+              context.getResults().initFile());
   return kj::READY_NOW;
 }
 
@@ -486,81 +1251,364 @@ kj::Promise<void> FrontendContext::addExecution(AddExecutionContext context) {
   return kj::READY_NOW;
 }
 
+namespace {
+// Fills out with the entries of changes, and with the ones of base at the
+// other indices.
+template <typename T>
+void ApplyPatch(typename capnp::List<T>::Reader base, uint32_t size,
+                typename capnp::List<capnproto::DagEntry<T>>::Reader changes,
+                typename capnp::List<T>::Builder out) {
+  std::vector<bool> changed(size);
+  for (auto entry : changes) {
+    KJ_REQUIRE(entry.getIndex() < size, "Invalid DAG patch", entry.getIndex());
+    out.setWithCaveats(entry.getIndex(), entry.getValue());
+    changed[entry.getIndex()] = true;
+  }
+  for (uint32_t i = 0; i < size; i++) {
+    if (changed[i]) continue;
+    KJ_REQUIRE(i < base.size(), "Invalid DAG patch", i);
+    out.setWithCaveats(i, base[i]);
+  }
+}
+
+}  // namespace
+
+uint64_t DagSessions::Set(const std::string& session,
+                          kj::Own<capnp::MallocMessageBuilder> dag) {
+  if (next_revision_ == 0) {
+    next_revision_ =
+        std::random_device()() * (1ULL << 32) + std::random_device()() + 1;
+  }
+  if (sessions_.count(session) == 0 && sessions_.size() >= kMaxSessions) {
+    auto oldest = sessions_.begin();
+    for (auto it = sessions_.begin(); it != sessions_.end(); ++it) {
+      if (it->second.last_use < oldest->second.last_use) oldest = it;
+    }
+    sessions_.erase(oldest);
+  }
+  Session& kept = sessions_[session];
+  kept.revision = next_revision_++;
+  kept.last_use = uses_++;
+  kept.dag = std::move(dag);
+  return kept.revision;
+}
+
+kj::Maybe<capnproto::Dag::Reader> DagSessions::Get(const std::string& session,
+                                                   uint64_t base) {
+  auto it = sessions_.find(session);
+  if (it == sessions_.end() || it->second.revision != base) return nullptr;
+  it->second.last_use = uses_++;
+  return it->second.dag->getRoot<capnproto::Dag>().asReader();
+}
+
+kj::Promise<void> FrontendContext::submitDag(SubmitDagContext context) {
+  AddDag(context.getParams().getDag(), context.getResults());
+  return kj::READY_NOW;
+}
+
+kj::Promise<void> FrontendContext::submitSessionDag(
+    SubmitSessionDagContext context) {
+  auto message = kj::heap<capnp::MallocMessageBuilder>();
+  message->setRoot(context.getParams().getDag());
+  AddDag(message->getRoot<capnproto::Dag>().asReader(), context.getResults());
+  context.getResults().setRevision(
+      sessions_.Set(context.getParams().getSession(), std::move(message)));
+  return kj::READY_NOW;
+}
+
+kj::Promise<void> FrontendContext::submitDagPatch(
+    SubmitDagPatchContext context) {
+  std::string session = context.getParams().getSession();
+  auto patch = context.getParams().getPatch();
+  auto base = KJ_REQUIRE_NONNULL(sessions_.Get(session, patch.getBase()),
+                                 "Unknown DAG revision", session);
+  auto message = kj::heap<capnp::MallocMessageBuilder>();
+  auto dag = message->initRoot<capnproto::Dag>();
+  ApplyPatch<capnproto::DagFile>(base.getFiles(), patch.getNumFiles(),
+                                 patch.getFiles(),
+                                 dag.initFiles(patch.getNumFiles()));
+  ApplyPatch<capnproto::DagGroup>(base.getGroups(), patch.getNumGroups(),
+                                  patch.getGroups(),
+                                  dag.initGroups(patch.getNumGroups()));
+  ApplyPatch<capnproto::DagExecution>(
+      base.getExecutions(), patch.getNumExecutions(), patch.getExecutions(),
+      dag.initExecutions(patch.getNumExecutions()));
+  KJ_LOG(INFO, kj::str("Patched DAG with ", patch.getFiles().size(), " files, ",
+                       patch.getGroups().size(), " groups and ",
+                       patch.getExecutions().size(), " executions"));
+  AddDag(dag.asReader(), context.getResults());
+  context.getResults().setRevision(sessions_.Set(session, std::move(message)));
+  return kj::READY_NOW;
+}
+
+void FrontendContext::AddDag(capnproto::Dag::Reader dag,
+                             capnproto::DagResults::Builder out) {
+  KJ_LOG(INFO, kj::str("Submitting DAG with ", dag.getFiles().size(),
+                       " files and ", dag.getExecutions().size(),
+                       " executions"));
+  // The groups of the DAG are owned by the frontend context, the executions
+  // by the frontend, as the ones added one by one.
+  std::vector<ExecutionGroup*> groups;
+  std::vector<std::vector<uint32_t>> fifos(dag.getGroups().size() + 1);
+  for (auto group : dag.getGroups()) {
+    groups_.push_back(kj::heap<ExecutionGroup>(this, group.getDescription(),
+                                               group.getBatch()));
+    groups.push_back(groups_.back());
+    for (auto fifo : group.getFifos()) {
+      fifos[groups.size()].push_back(
+          groups.back()->CreateFifo(fifo.getShared(), fifo.getStream()));
+    }
+  }
+  std::vector<Execution*> executions;
+  auto execution_clients = out.initExecutions(dag.getExecutions().size());
+  for (size_t i = 0; i < dag.getExecutions().size(); i++) {
+    auto execution = dag.getExecutions()[i];
+    std::string description = execution.getDescription();
+    uint32_t group = execution.getGroup();
+    KJ_REQUIRE(group <= groups.size(), "Invalid group in DAG", group);
+    kj::Own<Execution> own;
+    if (group == 0) {
+      groups_.push_back(kj::heap<ExecutionGroup>(this, description));
+      own = kj::heap<Execution>(this, description, groups_.back());
+    } else {
+      own = groups[group - 1]->AddExecution(description);
+    }
+    executions.push_back(own.get());
+    execution_clients.set(i, std::move(own));
+  }
+  std::vector<uint32_t> files;
+  auto file_results = out.initFiles(dag.getFiles().size());
+  for (size_t i = 0; i < dag.getFiles().size(); i++) {
+    auto file = dag.getFiles()[i];
+    bool executable = file.getIsExecutable();
+    auto execution = [&executions](uint32_t index) {
+      KJ_REQUIRE(index < executions.size(), "Invalid execution in DAG", index);
+      return executions[index];
+    };
+    switch (file.which()) {
+      case capnproto::DagFile::PROVIDED:
+        files.push_back(ProvideFile(file.getProvided().getHash(),
+                                    file.getProvided().getDescription(),
+                                    executable, file_results[i]));
+        break;
+      case capnproto::DagFile::STDOUT:
+        files.push_back(execution(file.getStdout())
+                            ->GetStdout(executable, file_results[i]));
+        break;
+      case capnproto::DagFile::STDERR:
+        files.push_back(execution(file.getStderr())
+                            ->GetStderr(executable, file_results[i]));
+        break;
+      case capnproto::DagFile::OUTPUT:
+        files.push_back(execution(file.getOutput().getExecution())
+                            ->GetOutput(file.getOutput().getName(), executable,
+                                        file_results[i]));
+        break;
+    }
+  }
+  for (size_t i = 0; i < executions.size(); i++) {
+    auto execution = dag.getExecutions()[i];
+    executions[i]->Configure(execution, files, fifos[execution.getGroup()]);
+  }
+  // The groups are only sealed once all their executions are configured.
+  for (size_t i = 0; i < executions.size(); i++) {
+    auto execution = dag.getExecutions()[i];
+    if (!execution.getSubscribed()) continue;
+    KJ_REQUIRE(receiver_ != nullptr, "Subscribed execution without receiver",
+               execution.getDescription());
+    executions[i]->Subscribe(i, execution.getNotifyStart());
+  }
+}
+
+kj::Promise<void> FrontendContext::subscribe(SubscribeContext context) {
+  receiver_ = context.getParams().getReceiver();
+  return kj::READY_NOW;
+}
+
+kj::Promise<void> FrontendContext::getUsage(GetUsageContext context) {
+  Dispatcher::Usage usage = dispatcher_.GetUsage(frontend_id_);
+  auto result = context.getResults().initUsage();
+  result.setRequests(usage.requests);
+  result.setCpuTime(usage.cpu_time);
+  result.setWallTime(usage.wall_time);
+  result.setMemoryTime(usage.memory_time);
+  result.setBytes(usage.bytes);
+  return kj::READY_NOW;
+}
+
+capnproto::ExecutionEvent::Builder FrontendContext::AddEvent(
+    uint32_t execution) {
+  events_.add(
+      events_message_->getOrphanage().newOrphan<capnproto::ExecutionEvent>());
+  auto event = events_.back().get();
+  event.setExecution(execution);
+  // The events of the same turn of the event loop go in the same batch.
+  if (!sending_events_) {
+    sending_events_ = true;
+    events_sent_ = kj::evalLater([this]() { return SendEvents(); })
+                       .eagerlyEvaluate(nullptr);
+  }
+  return event;
+}
+
+kj::Promise<void> FrontendContext::SendEvents() {
+  if (events_.empty()) {
+    sending_events_ = false;
+    if (all_events_sent_) all_events_sent_->fulfill();
+    return kj::READY_NOW;
+  }
+  auto req = KJ_ASSERT_NONNULL(receiver_).eventsRequest();
+  auto events = req.initEvents(events_.size());
+  for (size_t i = 0; i < events_.size(); i++) {
+    events.setWithCaveats(i, events_[i].getReader());
+  }
+  events_.clear();
+  events_message_ = kj::heap<capnp::MallocMessageBuilder>();
+  return req.send().ignoreResult().then(
+      [this]() { return SendEvents(); },
+      [this](kj::Exception exc) {
+        // The frontend is gone, nobody waits for the rest.
+        KJ_LOG(WARNING, "Failed to send the events", exc);
+        events_.clear();
+        events_message_ = kj::heap<capnp::MallocMessageBuilder>();
+        sending_events_ = false;
+        if (all_events_sent_) all_events_sent_->fulfill();
+      });
+}
+
+kj::Promise<void> FrontendContext::EventsSent() {
+  if (!sending_events_) return kj::READY_NOW;
+  auto pf = kj::newPromiseAndFulfiller<void>();
+  all_events_sent_ = std::move(pf.fulfiller);
+  return std::move(pf.promise);
+}
+
 kj::Promise<void> FrontendContext::addExecutionGroup(
     AddExecutionGroupContext context) {
   KJ_LOG(INFO, "Adding execution group " +
                    std::string(context.getParams().getDescription()));
   context.getResults().setGroup(
-      kj::heap<ExecutionGroup>(this, context.getParams().getDescription()));
+      kj::heap<ExecutionGroup>(this, context.getParams().getDescription(),
+                               context.getParams().getBatch()));
   return kj::READY_NOW;
 }
 kj::Promise<void> FrontendContext::startEvaluation(
     StartEvaluationContext context) {
   KJ_LOG(INFO, "Starting evaluation");
-  util::UnionPromiseBuilder provided_files_ready_;
+  sender_ = context.getParams().getSender();
+  if (!Flags::trace_directory.empty()) {
+    traced_ = true;
+    util::Tracer::Start(frontend_id_);
+  }
+  util::Join provided_files_ready_;
   for (auto& file : file_info_) {
-    if (file.second.provided) {
-      auto ff = file.second.promise.fulfiller.get();
-      builder_.AddPromise(
-          util::File::MaybeGet(file.second.hash,
-                               context.getParams().getSender())
-              .then(
-                  [id = file.first,
-                   fulfiller =
-                       std::move(file.second.promise.fulfiller)]() mutable {
-                    KJ_LOG(INFO, "Received file with id " + std::to_string(id));
-                    fulfiller->fulfill();
-                  },
-                  [fulfiller = ff](kj::Exception exc) {
-                    fulfiller->reject(kj::cp(exc));
-                    return exc;
-                  })
-              .eagerlyEvaluate(nullptr),
-          "MaybeGet file " + std::to_string(file.first) + " " +
-              file.second.description);
+    if (file.provided) {
+      // The provided files are known by their hash, their contents are only
+      // fetched by the requests that miss the cache, see FetchProvided.
+      FileReady(file.id);
       // Only mark a file as ready when all of its dependencies have been
       // propagated.
-      provided_files_ready_.AddPromise(
-          std::move(file.second.dependencies_propagated_).Finalize());
+      provided_files_ready_.AddPromise(file.Propagated());
     }
-    // Wait for all files to be ready
-    builder_.AddPromise(file.second.forked_promise.addBranch(),
-                        "Input file " + std::to_string(file.first) + " " +
-                            file.second.description);
   }
+  // The groups are looked up once all the provided files are ready.
+  started_ = true;
+  ResolveFromCache(finalized_groups_);
+  finalized_groups_.clear();
+  // Wait for all files to be ready, or failed.
+  builder_.AddPromise(FilesSettled());
   // When the input files are done, start the evaluation.
   builder_.AddPromise(
-      std::move(provided_files_ready_)
-          .Finalize()
-          .then([this]() { evaluation_start_.fulfiller->fulfill(); },
-                [this](kj::Exception exc) {
-                  evaluation_start_.fulfiller->reject(kj::cp(exc));
-                }));
-  return std::move(builder_)
-      .Finalize()
+      provided_files_ready_.Finalize().then(
+          [this]() { evaluation_start_.fulfiller->fulfill(); },
+          [this](kj::Exception exc) {
+            evaluation_start_.fulfiller->reject(kj::cp(exc));
+          }));
+  return builder_.Finalize()
       .then([]() { KJ_LOG(INFO, "Evaluation success"); },
             [](kj::Exception ex) { KJ_LOG(INFO, "Evaluation killed by", ex); })
       .exclusiveJoin(forked_early_stop_.addBranch())
+      .then(
+          [this]() {
+            WriteTrace();
+            return EventsSent();
+          },
+          [this](kj::Exception exc) -> kj::Promise<void> {
+            WriteTrace();
+            return kj::Promise<void>(std::move(exc));
+          })
       .eagerlyEvaluate(nullptr);
 }
+
+void FrontendContext::WriteTrace() {
+  if (!traced_) return;
+  traced_ = false;
+  std::string path = util::File::JoinPath(
+      Flags::trace_directory,
+      "evaluation-" + std::to_string(frontend_id_) + ".json");
+  std::string trace = util::Tracer::Finish(frontend_id_);
+  util::File::MakeDirs(Flags::trace_directory);
+  std::ofstream out(path);
+  out << trace;
+  if (!out) KJ_LOG(WARNING, "Failed to write the trace", path);
+}
+kj::Promise<void> FrontendContext::FetchProvided(
+    const std::vector<uint32_t>& ids) {
+  return local_files_.addBranch().then([this, ids]() {
+    return FetchProvidedNow(ids);
+  });
+}
+
+kj::Promise<void> FrontendContext::FetchProvidedNow(
+    const std::vector<uint32_t>& ids) {
+  kj::Vector<kj::Promise<void>> fetches;
+  for (uint32_t id : ids) {
+    const detail::FileInfo& info = Info(id);
+    if (!info.provided) continue;
+    auto& sender = KJ_REQUIRE_NONNULL(sender_, "The evaluation is not started");
+    // Concurrent fetches of the same file share the transfer.
+    fetches.add(util::File::MaybeGet(info.hash, sender)
+                    .then([id]() {
+                      UTIL_LOG(INFO, "Received file with id " +
+                                         std::to_string(id));
+                    }));
+  }
+  return kj::joinPromises(fetches.releaseAsArray());
+}
+
 kj::Promise<void> FrontendContext::getFileContents(
     GetFileContentsContext context) {
   uint32_t id = context.getParams().getFile().getId();
-  KJ_LOG(INFO, "Requested file with id " + std::to_string(id));
+  UTIL_LOG(INFO, "Requested file with id " + std::to_string(id));
   kj::PromiseFulfillerPair<void> pf = kj::newPromiseAndFulfiller<void>();
   builder_.AddPromise(std::move(pf.promise));
   auto send_file = kj::heap<kj::Function<kj::Promise<void>()>>(
       [id, context, this, fulfiller = std::move(pf.fulfiller)]() mutable {
-        auto hash = file_info_.at(id).hash;
-        KJ_LOG(INFO, "Sending file with id " + std::to_string(id), hash.Hex());
+        auto hash = Info(id).hash;
+        UTIL_LOG(INFO, "Sending file with id " + std::to_string(id),
+                 hash.Hex());
         auto ff = fulfiller.get();
-        return util::File::HandleRequestFile(hash,
-                                             context.getParams().getReceiver(),
-                                             context.getParams().getAmount())
+        return FetchProvided({id})
+            .then([hash, this]() { return dispatcher_.Fetch({hash}); })
+            .then([hash, context, peer = frontend_id_]() mutable {
+              uint64_t offset = context.getParams().getOffset();
+              if (context.getParams().getFromEnd()) {
+                uint64_t size =
+                    hash.hasContents()
+                        ? hash.getContents().size()
+                        : std::max<int64_t>(util::File::StoreSize(hash), 0);
+                offset = size - std::min(size, offset);
+              }
+              // Nothing else waits for the downloads of the frontends.
+              return util::File::HandleRequestFile(
+                  hash, context.getParams().getReceiver(),
+                  context.getParams().getAmount(),
+                  util::TransferPriority::BULK, peer, offset);
+            })
             .then(
                 [id, fulfiller = std::move(fulfiller)]() mutable {
                   fulfiller->fulfill();
-                  KJ_LOG(INFO, "Sent file with id " + std::to_string(id));
+                  UTIL_LOG(INFO, "Sent file with id " + std::to_string(id));
                 },
                 [ff](kj::Exception exc) {
                   ff->reject(kj::cp(exc));
@@ -569,13 +1617,13 @@ kj::Promise<void> FrontendContext::getFileContents(
       });
   auto send_file_ptr = send_file.get();
   KJ_ASSERT(id != 0);
-  return file_info_[id]
-      .forked_promise.addBranch()
+  return Info(id)
+      .Ready()
       .then([send_file =
                  std::move(send_file)]() mutable { return (*send_file)(); },
             [send_file = send_file_ptr, this, id](kj::Exception exc) mutable {
               KJ_ASSERT(id != 0);
-              auto hash = file_info_[id].hash;
+              auto hash = Info(id).hash;
               if (hash.isZero()) {
                 kj::throwRecoverableException(std::move(exc));
               }
@@ -584,29 +1632,189 @@ kj::Promise<void> FrontendContext::getFileContents(
       .exclusiveJoin(forked_early_stop_.addBranch());
 }
 
+kj::Promise<void> FrontendContext::provideLocalFiles(
+    ProvideLocalFilesContext context) {
+  // Otherwise any frontend could probe the files of the server.
+  KJ_REQUIRE(std::string(context.getParams().getToken()) == LocalToken(),
+             "The frontend does not share the filesystem of the server");
+  auto files =
+      std::make_shared<std::vector<std::pair<util::SHA256_t, std::string>>>();
+  for (auto file : context.getParams().getFiles()) {
+    util::SHA256_t hash = file.getHash();
+    if (hash.hasContents() || util::File::StoreSize(hash) >= 0) continue;
+    files->emplace_back(hash, file.getPath());
+  }
+  // The paths are only trusted to be readable by a local frontend: a file is
+  // stored only if it has the contents of its hash.
+  auto ingested = std::make_shared<std::vector<bool>>(files->size());
+  auto ingest = [files, ingested]() {
+    for (size_t i = 0; i < files->size(); i++) {
+      const auto& file = (*files)[i];
+      KJ_IF_MAYBE(exc, kj::runCatchingExceptions([&]() {
+                    (*ingested)[i] =
+                        util::File::IngestChecked(file.second, file.first);
+                  })) {
+        KJ_LOG(WARNING, "Failed to copy a local file", file.second, *exc);
+        continue;
+      }
+      if (!(*ingested)[i]) {
+        KJ_LOG(WARNING, "Local file does not match its hash", file.second);
+      }
+    }
+  };
+  util::IoPool* pool = util::File::SendPool();
+  kj::Promise<void> done = nullptr;
+  if (pool != nullptr) {
+    done = pool->Run(std::move(ingest));
+  } else {
+    ingest();
+    done = kj::READY_NOW;
+  }
+  done = done.then([this, files, ingested]() {
+    for (size_t i = 0; i < files->size(); i++) {
+      if ((*ingested)[i]) cache_manager_.AddStored((*files)[i].first);
+    }
+  });
+  auto previous = local_files_.addBranch();
+  local_files_ = previous.then([done = std::move(done)]() mutable {
+                           return std::move(done);
+                         })
+                     .fork();
+  return local_files_.addBranch();
+}
+
+kj::Promise<void> FrontendContext::getLocalStore(
+    GetLocalStoreContext context) {
+  context.getResults().setStoreDirectory(StoreDirectory());
+  // The token file is written here, but only frontends that can read it
+  // learn the token.
+  LocalToken();
+  context.getResults().setTokenFile(LocalTokenFile());
+  return kj::READY_NOW;
+}
+
+kj::Promise<void> FrontendContext::getLocalPath(GetLocalPathContext context) {
+  uint32_t id = context.getParams().getFile().getId();
+  KJ_ASSERT(id != 0);
+  auto get_path = [id, context, this]() mutable {
+    auto hash = Info(id).hash;
+    return FetchProvided({id})
+        .then([hash, this]() { return dispatcher_.Fetch({hash}); })
+        .then([hash, context]() mutable {
+          // The inlined files and the ones in the packs are not files of
+          // their own.
+          if (hash.hasContents() ||
+              !util::File::Exists(util::File::PathForHash(hash))) {
+            return;
+          }
+          context.getResults().setPath(util::File::JoinPath(
+              StoreDirectory(), util::File::RelativePathForHash(hash)));
+        });
+  };
+  return Info(id)
+      .Ready()
+      .then([get_path]() mutable { return get_path(); },
+            [get_path, this, id](kj::Exception exc) mutable {
+              if (Info(id).hash.isZero()) {
+                kj::throwRecoverableException(std::move(exc));
+              }
+              return get_path();
+            })
+      .exclusiveJoin(forked_early_stop_.addBranch());
+}
+
 kj::Promise<void> FrontendContext::stopEvaluation(
     StopEvaluationContext /*context*/) {
   KJ_LOG(INFO, "Early stop");
   *canceled_ = true;
+  for (auto& kv : stop_groups_) *kv.second = true;
   evaluation_early_stop_.fulfiller->reject(
       KJ_EXCEPTION(FAILED, "Evaluation stopped"));
   return dispatcher_.Cancel(frontend_id_);
 }
 
+const std::shared_ptr<bool>& FrontendContext::StopGroupCanceled(
+    uint32_t stop_group) {
+  auto& canceled = stop_groups_[stop_group];
+  if (!canceled) canceled = std::make_shared<bool>(*canceled_);
+  return canceled;
+}
+
+void FrontendContext::Stop(uint32_t stop_group) {
+  const std::shared_ptr<bool>& canceled = StopGroupCanceled(stop_group);
+  if (*canceled) return;
+  KJ_LOG(INFO, "Stopping the executions of stop group " +
+                   std::to_string(stop_group));
+  dispatcher_.CancelRequests(frontend_id_, canceled);
+}
+
+kj::Promise<void> FrontendContext::setWeight(SetWeightContext context) {
+  KJ_LOG(INFO, "Setting weight to " +
+                   std::to_string(context.getParams().getWeight()));
+  dispatcher_.SetWeight(frontend_id_, context.getParams().getWeight());
+  return kj::READY_NOW;
+}
+
 kj::Promise<void> Server::registerFrontend(RegisterFrontendContext context) {
   context.getResults().setContext(
-      kj::heap<FrontendContext>(&dispatcher_, &cache_manager_));
+      kj::heap<FrontendContext>(&dispatcher_, &admission_, &cache_manager_,
+                                &federation_, &sessions_));
   return kj::READY_NOW;
 }
 
 kj::Promise<void> Server::registerEvaluator(RegisterEvaluatorContext context) {
-  KJ_LOG(INFO,
-         "Worker " + std::string(context.getParams().getName()) + " connected");
-  return dispatcher_.AddEvaluator(context.getParams().getEvaluator());
+  auto worker = context.getParams().getWorker();
+  auto topology = worker.getTopology();
+  KJ_LOG(INFO, "Worker " + std::string(context.getParams().getName()) +
+                   " connected with " +
+                   std::to_string(context.getParams().getCredits()) +
+                   " credits",
+         topology.getNumCpus(), topology.getNumCores(),
+         topology.getNumNodes(), worker.getCpuModel(), worker.getSpeed());
+  if (worker.hasInventory()) {
+    dispatcher_.UpdateInventory(worker.getId(),
+                                util::BloomFilter(worker.getInventory()));
+  }
+  dispatcher_.SetMemory(worker.getId(), worker.getMemory());
+  dispatcher_.SetSpeed(worker.getId(), worker.getSpeed());
+  if (worker.getPeer()) dispatcher_.SetPeer(worker.getId());
+  if (worker.hasPrograms()) {
+    std::unordered_set<std::string> programs;
+    for (auto program : worker.getPrograms()) programs.emplace(program);
+    dispatcher_.SetPrograms(worker.getId(), std::move(programs));
+  }
+  return dispatcher_.AddEvaluator(context.getParams().getEvaluator(),
+                                  worker.getId(),
+                                  context.getParams().getCredits());
 }
 
 kj::Promise<void> Server::requestFile(RequestFileContext context) {
-  return util::File::HandleRequestFile(context);
+  util::SHA256_t hash = context.getParams().getHash();
+  return dispatcher_.Fetch({hash}).then([context]() mutable {
+    return util::File::HandleRequestFile(context);
+  });
+}
+
+kj::Promise<void> Server::requestFiles(RequestFilesContext context) {
+  std::vector<util::SHA256_t> hashes;
+  for (auto hash : context.getParams().getHashes()) hashes.emplace_back(hash);
+  return dispatcher_.Fetch(hashes).then([context]() mutable {
+    return util::File::HandleRequestFiles(context);
+  });
+}
+
+kj::Promise<void> Server::getMetrics(GetMetricsContext context) {
+  dispatcher_.ExportMetrics();
+  context.getResults().setText(util::Metrics::Render());
+  return kj::READY_NOW;
+}
+
+kj::Promise<void> Server::lookupCache(LookupCacheContext context) {
+  return federation_.HandleLookup(context);
+}
+
+kj::Promise<void> Server::storeCache(StoreCacheContext context) {
+  return federation_.HandleStore(context);
 }
 
 uint32_t FrontendContext::num_frontends_ = 0;
@@ -4,32 +4,90 @@
 #include "capnp/server.capnp.h"
 #include "server/cache.hpp"
 #include "server/dispatcher.hpp"
+#include "server/federation.hpp"
+#include "util/admission.hpp"
+#include "util/flags.hpp"
+#include "util/join.hpp"
 #include "util/sha256.hpp"
-#include "util/union_promise.hpp"
 
 #include <capnp/message.h>
+#include <capnp/orphan.h>
+#include <kj/vector.h>
+#include <deque>
 #include <memory>
+#include <set>
+#include <string>
 #include <unordered_map>
+#include <unordered_set>
 
 namespace server {
 
+class ExecutionGroup;
+
 namespace detail {
-struct FileInfo {
+// A file of the DAG of a frontend. Many files are never waited for, like most
+// standard errors, so the promise of the file and the join of its consumers
+// are only created when they are first needed.
+class FileInfo {
+ public:
+  // Resolves once the file is ready, or fails if it cannot be generated.
+  kj::Promise<void> Ready();
+
+  // Resolves or fails the promises of Ready. Only the first call of either
+  // has an effect, the others return false.
+  bool Fulfill();
+  bool Reject(kj::Exception exc);
+  bool IsReady() const { return state_ == State::READY; }
+
+  // The join of the consumers of the file, that settle their dependency once
+  // they got it.
+  util::Join Propagation();
+  // Resolves once the consumers got the file.
+  kj::Promise<void> Propagated();
+
   uint32_t id = 0;
   std::string description;
   bool executable = false;
   bool provided = false;
-  kj::PromiseFulfillerPair<void> promise = kj::newPromiseAndFulfiller<void>();
-  kj::ForkedPromise<void> forked_promise = promise.promise.fork();
   util::SHA256_t hash = util::SHA256_t::ZERO;
-  util::UnionPromiseBuilder dependencies_propagated_;
+  // Groups that use this file as an input.
+  std::vector<ExecutionGroup*> consumers;
+
+ private:
+  enum class State : uint8_t { PENDING, READY, FAILED };
+  State state_ = State::PENDING;
+  std::unique_ptr<kj::Exception> failure_;
+  kj::Own<kj::PromiseFulfiller<void>> fulfiller_;
+  kj::Maybe<kj::ForkedPromise<void>> ready_;
+  kj::Maybe<util::Join> propagated_;
+};
+
+// Files or FIFOs of an execution by name. The names are interned by the
+// frontend, and an execution has few of them, so a sorted vector is much
+// smaller than a map.
+class NameMap {
+ public:
+  using Entry = std::pair<const std::string*, uint32_t>;
+
+  // Returns false, without adding it, if name is already there.
+  bool Add(const std::string* name, uint32_t id);
+  // Returns 0 if name is not there.
+  uint32_t Find(const std::string* name) const;
+
+  size_t size() const { return entries_.size(); }
+  std::vector<Entry>::const_iterator begin() const { return entries_.begin(); }
+  std::vector<Entry>::const_iterator end() const { return entries_.end(); }
+
+ private:
+  static bool Less(const Entry& a, const Entry& b);
+
+  std::vector<Entry> entries_;
 };
 };  // namespace detail
 
 // Implementations of the server interface.
 
 class FrontendContext;
-class ExecutionGroup;
 
 class Execution : public capnproto::Execution::Server {
  public:
@@ -55,24 +113,62 @@ class Execution : public capnproto::Execution::Server {
   kj::Promise<void> getOutput(GetOutputContext context) override;
   kj::Promise<void> notifyStart(NotifyStartContext context) override;
   kj::Promise<void> getResult(GetResultContext context) override;
+  kj::Promise<void> setPriority(SetPriorityContext context) override;
+  kj::Promise<void> setTimed(SetTimedContext context) override;
+
+  // The same as the RPC methods above, also used to build the executions of
+  // a DAG submitted at once.
+  void SetExecutablePath(kj::StringPtr path);
+  void SetExecutable(kj::StringPtr name, uint32_t id);
+  void SetStdin(uint32_t id);
+  void AddInput(kj::StringPtr name, uint32_t id);
+  void SetArgs(capnp::List<capnp::Text>::Reader args);
+  void SetLimits(capnproto::Resources::Reader limits);
+  void SetExtraTime(float extra_time);
+  void AddFifo(kj::StringPtr name, uint32_t id);
+  void SetStdinFifo(uint32_t id);
+  void SetStdoutFifo(uint32_t id);
+  void SetStderrFifo(uint32_t id);
+  uint32_t GetStdout(bool executable, capnproto::File::Builder file);
+  uint32_t GetStderr(bool executable, capnproto::File::Builder file);
+  uint32_t GetOutput(kj::StringPtr name, bool executable,
+                     capnproto::File::Builder file);
+
+  // Applies the settings of an execution of a DAG. files and fifos map the
+  // indices of the DAG to the IDs of the files and of the FIFOs of the group.
+  void Configure(capnproto::DagExecution::Reader execution,
+                 const std::vector<uint32_t>& files,
+                 const std::vector<uint32_t>& fifos);
+
+  // Sends the result, and the start if notify_start is set, as events of the
+  // execution with the given index in the DAG, see
+  // FrontendContext::subscribe. Replaces getResult and notifyStart.
+  void Subscribe(uint32_t index, bool notify_start);
 
  private:
-  void addDependencies(util::UnionPromiseBuilder* dependencies);
+  void addDependencies(util::Join* dependencies);
+  void addConsumer(uint32_t id);
+  // Ids of the files used by this execution.
+  std::vector<uint32_t> inputFiles() const;
+  // Ids of the files produced by this execution.
+  std::vector<uint32_t> outputFiles() const;
   void prepareRequest();
+  // The request of this execution, in the message of the group. It can only
+  // be used until the group prepares its request.
+  capnproto::ProcessRequest::Builder request();
   void processResult(capnproto::ProcessResult::Reader result,
-                     util::UnionPromiseBuilder* dependencies_propagated,
+                     util::Join* dependencies_propagated,
                      bool from_cache = false);
   void onDependenciesFailure(kj::Exception exc);
   void onDependenciesPropagated();
 
   FrontendContext& frontend_context_;
   std::string description_;
-  capnp::MallocMessageBuilder builder_;
-  capnproto::ProcessRequest::Builder request_ =
-      builder_.initRoot<capnproto::ProcessRequest>();
-  std::unordered_map<std::string, uint32_t> inputs_;
-  std::unordered_map<std::string, uint32_t> outputs_;
-  std::unordered_map<std::string, uint32_t> fifos_;
+  // Index of the execution in its group.
+  size_t index_ = 0;
+  detail::NameMap inputs_;
+  detail::NameMap outputs_;
+  detail::NameMap fifos_;
   uint32_t executable_ = 0;
   uint32_t stdin_ = 0;
   uint32_t stdin_fifo_ = 0;
@@ -85,51 +181,226 @@ class Execution : public capnproto::Execution::Server {
   friend class ExecutionGroup;
   ExecutionGroup& group_;
   kj::Maybe<GetResultContext> context_;
+  bool subscribed_ = false;
+  uint32_t event_index_ = 0;
+  // Set if the dependencies failed, for the items of a batch that are
+  // skipped while the others run.
+  kj::Maybe<kj::Exception> dependencies_failure_;
 };
 
 class ExecutionGroup : public capnproto::ExecutionGroup::Server {
  public:
-  void Register(Execution* ex);
-  ExecutionGroup(FrontendContext* frontend_context, std::string description)
+  static const constexpr unsigned kFirstSegmentWords = 64;
+
+  // Returns the index of the execution in the group.
+  size_t Register(Execution* ex);
+  // The request of the execution with the given index. It is invalidated by
+  // the next Register.
+  capnproto::ProcessRequest::Builder Process(size_t index) {
+    return processes_.get()[index];
+  }
+  // Once the request is prepared, the processes are part of it.
+  bool RequestPrepared() const { return request_prepared_; }
+  ExecutionGroup(FrontendContext* frontend_context, std::string description,
+                 bool batch = false)
       : frontend_context_(*frontend_context),
-        description_(std::move(description)) {}
+        description_(std::move(description)),
+        batch_(batch) {}
   void setExclusive();
   void disableCache();
+  void setPriority(int32_t priority);
+  void setTimed();
+  // Puts the group in a stop group of the DAG, see DagExecution.
+  void SetStopGroup(uint32_t stop_group);
 
   kj::Promise<void> addExecution(AddExecutionContext context) override;
   kj::Promise<void> createFifo(CreateFifoContext context) override;
 
+  kj::Own<Execution> AddExecution(const std::string& description);
+  // Returns the ID of the new FIFO.
+  uint32_t CreateFifo(bool shared, bool stream);
+
+  bool IsSharedFifo(uint32_t id) const { return shared_fifos_.count(id); }
+  bool IsStreamFifo(uint32_t id) const { return stream_fifos_.count(id); }
+  bool IsBatch() const { return batch_; }
+  // Returns false if the stream already has a writer.
+  bool AddStreamWriter(uint32_t id) {
+    return written_streams_.insert(id).second;
+  }
+  // Checks that all the items of a batch have the same executable.
+  void SetBatchExecutable(const std::string& executable);
+
   // Utility methods
   kj::Promise<void> notifyStart();
+  // Creates the dependency edges of the group, and starts it, the first time
+  // it is called.
+  void Seal();
+  // Seals the group, and returns a promise for the result of ex.
   kj::Promise<void> Finalize(Execution* ex);
 
+  // Looks the group up in the cache as soon as all its inputs are ready,
+  // without waiting for them to go through the promises of the dependencies,
+  // and passes on the result if it is there. The consumers of its outputs are
+  // then looked up in turn, so that a chain of cached groups is resolved at
+  // once. The group is only looked up once this way.
+  void MaybeResolveFromCache();
+
+  // Only meaningful once the DAG is complete.
+  RequestPriority Priority();
+
  private:
+  // Length of the longest chain of groups that starts with this one.
+  uint32_t CriticalPath();
+
+  // Waits for the dependencies of the items of a batch, skipping the items
+  // whose dependencies fail. The others are in batch_items_ once it resolves.
+  kj::Promise<void> BatchDependencies();
+
+  // Builds a single process for the items of the batch: the inputs of item i
+  // are in the folder "i", and its arguments are on the standard input.
+  void PrepareBatch();
+
+  // Builds the request from the ones of the executions, or of the items of
+  // the batch, the first time it is called.
+  void PrepareRequest();
+
+  // Passes the results to the executions, or to the items of the batch.
+  kj::Promise<void> ProcessResults(capnproto::Result::Reader result,
+                                   bool from_cache = false);
+  // The part of ProcessResults that passes on the results, resolving once
+  // the consumers got the outputs, and the part that runs after that.
+  kj::Promise<void> PassResults(capnproto::Result::Reader result,
+                                bool from_cache);
+  void ResultsPropagated(uint64_t propagation_start);
+
+  // Waits until the request is admitted, see util::AdmissionControl, and
+  // then evaluates it.
+  kj::Promise<void> Evaluate();
+
+  // Fetches the files provided by the frontend, and dispatches the request.
+  kj::Promise<void> FetchAndDispatch();
+
+  // Sends the request to a worker, or runs it here if it is a comparison.
+  kj::Promise<void> Dispatch();
+
+  // Runs the builtin comparison on the server if its files are here and
+  // small enough. Returns false if it should be sent to a worker.
+  bool CompareLocally(capnproto::ProcessResult::Builder result);
+
+  // Stores the result in the cache once its outputs are in the store.
+  void StoreInCache(
+      capnp::Response<capnproto::Evaluator::EvaluateResults> results);
+
+  // Records the phase of the group that started at start, which ends now, if
+  // the evaluation is traced.
+  void Trace(const char* phase, uint64_t start);
+
   FrontendContext& frontend_context_;
   std::string description_;
   std::vector<Execution*> executions_;
+  bool batch_ = false;
+  std::string batch_executable_;
+  // Items of the batch that are run, in the order of executions_.
+  std::vector<Execution*> batch_items_;
   kj::Promise<void> done_ = kj::READY_NOW;
   kj::ForkedPromise<void> forked_done_ = done_.fork();
+  kj::Promise<void> cache_store_ = kj::READY_NOW;
   bool finalized_ = false;
-  capnp::MallocMessageBuilder builder_;
+  bool request_prepared_ = false;
+  // Whether MaybeResolveFromCache looked the group up.
+  bool looked_up_ = false;
+  // Set by MaybeResolveFromCache if it found the result, until the
+  // dependencies are ready.
+  kj::Maybe<kj::Promise<void>> cached_results_;
+  // Most requests are small, the default first segment would be the biggest
+  // part of a group.
+  capnp::MallocMessageBuilder builder_{kFirstSegmentWords};
   capnproto::Request::Builder request_ =
       builder_.initRoot<capnproto::Request>();
+  // The executions build their requests here, in the same message, and
+  // request_ adopts them without copying them once they are complete.
+  capnp::Orphan<capnp::List<capnproto::ProcessRequest>> processes_ =
+      builder_.getOrphanage().newOrphan<capnp::List<capnproto::ProcessRequest>>(
+          0);
   uint32_t cache_enabled_ = true;
   kj::PromiseFulfillerPair<void> start_ = kj::newPromiseAndFulfiller<void>();
   kj::ForkedPromise<void> forked_start_ = start_.promise.fork();
   size_t next_fifo_ = 1;
+  std::unordered_set<uint32_t> shared_fifos_;
+  std::set<uint32_t> stream_fifos_;
+  // Stream FIFOs that are the standard output of an execution.
+  std::set<uint32_t> written_streams_;
+  // Highest priority set on the executions of the group.
+  int32_t priority_ = 0;
+  bool priority_set_ = false;
+  uint32_t critical_path_ = 0;
+  // Start of the phase before the request is sent to a worker, and of the
+  // one on the worker.
+  uint64_t phase_start_ = 0;
+  uint64_t started_at_ = 0;
+  kj::Promise<void> traced_start_ = nullptr;
+  // Held from the moment the request misses the cache until it is sent to a
+  // worker.
+  kj::Own<util::AdmissionControl::Ticket> admission_;
+  kj::Promise<void> admission_released_ = nullptr;
+  uint32_t stop_group_ = 0;
+  // Set when the request should not run anymore: the flag of the stop group,
+  // if any, or else the one of the frontend.
+  std::shared_ptr<bool> canceled_;
+};
+
+// DAGs kept for the sessions of the frontends, so that running the same
+// session again only sends the differences of its DAG. The least recently
+// used sessions are dropped first.
+class DagSessions {
+ public:
+  static const constexpr size_t kMaxSessions = 64;
+
+  // Keeps the root of dag as the DAG of session, and returns its revision.
+  uint64_t Set(const std::string& session,
+               kj::Own<capnp::MallocMessageBuilder> dag);
+
+  // Returns the DAG of session, if its revision is base.
+  kj::Maybe<capnproto::Dag::Reader> Get(const std::string& session,
+                                        uint64_t base);
+
+ private:
+  struct Session {
+    uint64_t revision;
+    uint64_t last_use;
+    kj::Own<capnp::MallocMessageBuilder> dag;
+  };
+  std::unordered_map<std::string, Session> sessions_;
+  // The revisions of different runs of the server are unlikely to match.
+  uint64_t next_revision_ = 0;
+  uint64_t uses_ = 0;
 };
 
 class FrontendContext : public capnproto::FrontendContext::Server {
  public:
-  FrontendContext(Dispatcher* dispatcher, CacheManager* cache_manager)
+  FrontendContext(Dispatcher* dispatcher, util::AdmissionControl* admission,
+                  CacheManager* cache_manager, Federation* federation,
+                  DagSessions* sessions)
       : dispatcher_(*dispatcher),
+        admission_(*admission),
         builder_(false),
-        cache_manager_(*cache_manager) {}
-  ~FrontendContext() { *canceled_ = true; }
+        cache_manager_(*cache_manager),
+        federation_(*federation),
+        sessions_(*sessions) {}
+  ~FrontendContext() {
+    *canceled_ = true;
+    for (auto& kv : stop_groups_) *kv.second = true;
+    dispatcher_.RemoveFrontend(frontend_id_);
+    WriteTrace();
+  }
   FrontendContext(const FrontendContext&) = delete;
   FrontendContext(FrontendContext&&) = delete;
   FrontendContext& operator=(const FrontendContext&) = delete;
   FrontendContext& operator=(FrontendContext&&) = delete;
+
+  // Returns a new evaluation ID, that is used by the dispatcher.
+  static uint32_t NewId() { return num_frontends_++; }
+
   kj::Promise<void> provideFile(ProvideFileContext context) override;
   kj::Promise<void> addExecution(AddExecutionContext context) override;
   kj::Promise<void> addExecutionGroup(
@@ -137,16 +408,82 @@ class FrontendContext : public capnproto::FrontendContext::Server {
   kj::Promise<void> startEvaluation(StartEvaluationContext context) override;
   kj::Promise<void> getFileContents(GetFileContentsContext context) override;
   kj::Promise<void> stopEvaluation(StopEvaluationContext context) override;
+  kj::Promise<void> setWeight(SetWeightContext context) override;
+  kj::Promise<void> submitDag(SubmitDagContext context) override;
+  kj::Promise<void> getLocalStore(GetLocalStoreContext context) override;
+  kj::Promise<void> getLocalPath(GetLocalPathContext context) override;
+  kj::Promise<void> submitSessionDag(SubmitSessionDagContext context) override;
+  kj::Promise<void> submitDagPatch(SubmitDagPatchContext context) override;
+  kj::Promise<void> subscribe(SubscribeContext context) override;
+  kj::Promise<void> getUsage(GetUsageContext context) override;
+  kj::Promise<void> provideLocalFiles(
+      ProvideLocalFilesContext context) override;
 
  private:
+  // Adds the files and the executions of dag, see submitDag.
+  void AddDag(capnproto::Dag::Reader dag, capnproto::DagResults::Builder out);
+
+  // Gets the contents of the files among ids that are provided by the
+  // frontend, unless they are already in the store.
+  kj::Promise<void> FetchProvided(const std::vector<uint32_t>& ids);
+  // Same as FetchProvided, without waiting for provideLocalFiles.
+  kj::Promise<void> FetchProvidedNow(const std::vector<uint32_t>& ids);
+
+  // Adds a file to the DAG, and returns its ID.
+  uint32_t AddFile(capnproto::File::Builder file, bool executable,
+                   std::string description);
+  // The file with the given ID, that must exist.
+  detail::FileInfo& Info(uint32_t id);
+  // Marks the file as ready, or as failed with exc, if it is neither yet.
+  void FileReady(uint32_t id);
+  void FileFailed(uint32_t id, kj::Exception exc);
+  // Resolves once all the files are either ready or failed.
+  kj::Promise<void> FilesSettled();
+  // Queues an event of the execution with the given index in the DAG for the
+  // receiver of subscribe. The events queued while a batch is being sent go
+  // in the next one.
+  capnproto::ExecutionEvent::Builder AddEvent(uint32_t execution);
+  kj::Promise<void> SendEvents();
+  // Resolves once all the queued events are sent.
+  kj::Promise<void> EventsSent();
+
+  // Calls MaybeResolveFromCache on the groups, and on the ones it adds
+  // meanwhile, unless it is already doing it.
+  void ResolveFromCache(const std::vector<ExecutionGroup*>& groups);
+
+  // The same name for all the executions of the frontend.
+  const std::string* Intern(kj::StringPtr name);
+  // Returns nullptr if no execution uses name.
+  const std::string* FindName(kj::StringPtr name) const;
+
+  // Writes the trace of the evaluation in Flags::trace_directory, if it is
+  // traced, and stops tracing it.
+  void WriteTrace();
+
+  // The flag that cancels the requests of a stop group of the DAG.
+  const std::shared_ptr<bool>& StopGroupCanceled(uint32_t stop_group);
+  // Skips the requests of the stop group that did not start yet, and stops
+  // the running ones.
+  void Stop(uint32_t stop_group);
+
+  // Returns the ID of the new file.
+  uint32_t ProvideFile(const util::SHA256_t& hash,
+                       const std::string& description, bool executable,
+                       capnproto::File::Builder file);
+
   friend class Execution;
   friend class ExecutionGroup;
   server::Dispatcher& dispatcher_;
+  util::AdmissionControl& admission_;
   static uint32_t num_frontends_;
-  uint32_t frontend_id_ = num_frontends_++;
-  uint32_t last_file_id_ = 1;
-  std::unordered_map<uint32_t, detail::FileInfo> file_info_;
-  util::UnionPromiseBuilder builder_;
+  uint32_t frontend_id_ = NewId();
+  // The file with ID i is at i - 1. References stay valid as files are
+  // added.
+  std::deque<detail::FileInfo> file_info_;
+  size_t unsettled_files_ = 0;
+  kj::Own<kj::PromiseFulfiller<void>> files_settled_;
+  std::unordered_set<std::string> names_;
+  util::Join builder_;
   kj::PromiseFulfillerPair<void> evaluation_start_ =
       kj::newPromiseAndFulfiller<void>();
   kj::ForkedPromise<void> forked_evaluation_start_ =
@@ -158,8 +495,31 @@ class FrontendContext : public capnproto::FrontendContext::Server {
   uint32_t ready_tasks_ = 0;
   uint32_t scheduled_tasks_ = 0;
   CacheManager& cache_manager_;
+  Federation& federation_;
+  DagSessions& sessions_;
   std::vector<kj::Own<ExecutionGroup>> groups_;
+  // Sender of the provided files, set when the evaluation starts.
+  kj::Maybe<capnproto::FileSender::Client> sender_;
+  // Resolves once the files of provideLocalFiles are in the store.
+  kj::ForkedPromise<void> local_files_ =
+      kj::Promise<void>(kj::READY_NOW).fork();
   std::shared_ptr<bool> canceled_ = std::make_shared<bool>(false);
+  std::unordered_map<uint32_t, std::shared_ptr<bool>> stop_groups_;
+  bool traced_ = false;
+  bool started_ = false;
+  // The groups that were finalized before the evaluation started.
+  std::vector<ExecutionGroup*> finalized_groups_;
+  std::vector<ExecutionGroup*> to_resolve_;
+  bool resolving_ = false;
+  kj::Maybe<capnproto::EventReceiver::Client> receiver_;
+  // The events that are not sent yet, in events_message_.
+  kj::Own<capnp::MallocMessageBuilder> events_message_ =
+      kj::heap<capnp::MallocMessageBuilder>();
+  kj::Vector<capnp::Orphan<capnproto::ExecutionEvent>> events_;
+  bool sending_events_ = false;
+  kj::Promise<void> events_sent_ = kj::READY_NOW;
+  kj::Own<kj::PromiseFulfiller<void>> all_events_sent_;
+  kj::Vector<kj::Promise<void>> start_events_;
 };
 
 class Server : public capnproto::MainServer::Server {
@@ -168,11 +528,31 @@ class Server : public capnproto::MainServer::Server {
   kj::Promise<void> registerEvaluator(
       RegisterEvaluatorContext context) override;
   kj::Promise<void> requestFile(RequestFileContext context) override;
+  kj::Promise<void> requestFiles(RequestFilesContext context) override;
+  kj::Promise<void> getMetrics(GetMetricsContext context) override;
+  kj::Promise<void> lookupCache(LookupCacheContext context) override;
+  kj::Promise<void> storeCache(StoreCacheContext context) override;
   friend class FrontendContext;
 
+  void SetTimer(kj::Timer* timer) {
+    dispatcher_.SetTimer(timer);
+    federation_.Start(timer);
+  }
+
+  // The files in the store of the server, see CacheManager::Files.
+  util::ContentStore* Files() { return cache_manager_.Files(); }
+
  private:
   Dispatcher dispatcher_;
+  // Requests wait here, rather than in the queues of the dispatcher, while
+  // too many of them are queued.
+  util::AdmissionControl admission_{
+      {Flags::queued_requests, Flags::queued_mib * 1024ULL * 1024},
+      {Flags::frontend_queued_requests,
+       Flags::frontend_queued_mib * 1024ULL * 1024}};
   CacheManager cache_manager_;
+  Federation federation_{&dispatcher_, &cache_manager_};
+  DagSessions sessions_;
 };
 
 }  // namespace server
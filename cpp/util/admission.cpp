@@ -0,0 +1,79 @@
+#include "util/admission.hpp"
+
+namespace util {
+
+AdmissionControl::Ticket::~Ticket() { control_->Release(frontend_, bytes_); }
+
+kj::Promise<kj::Own<AdmissionControl::Ticket>> AdmissionControl::Admit(
+    uint64_t frontend, size_t bytes) {
+  auto pf = kj::newPromiseAndFulfiller<kj::Own<Ticket>>();
+  waiting_[frontend].push_back(Waiter{bytes, std::move(pf.fulfiller)});
+  AdmitNext();
+  return std::move(pf.promise);
+}
+
+bool AdmissionControl::Fits(const Usage& usage, const Limits& limits,
+                            size_t bytes) {
+  if (limits.requests != 0 && usage.requests + 1 > limits.requests) {
+    return false;
+  }
+  return limits.bytes == 0 || usage.bytes + bytes <= limits.bytes;
+}
+
+bool AdmissionControl::CanAdmit(uint64_t frontend, size_t bytes) const {
+  auto it = frontends_.find(frontend);
+  if (it == frontends_.end()) return true;
+  return Fits(it->second, frontend_limits_, bytes) &&
+         Fits(total_, total_limits_, bytes);
+}
+
+void AdmissionControl::AdmitNext() {
+  // The frontends are visited in a cycle that starts after the last one that
+  // got a request, until none of them can get one.
+  uint64_t cursor = next_frontend_;
+  size_t idle = 0;
+  while (!waiting_.empty() && idle < waiting_.size()) {
+    auto it = waiting_.lower_bound(cursor);
+    if (it == waiting_.end()) it = waiting_.begin();
+    cursor = it->first + 1;
+    std::deque<Waiter>& queue = it->second;
+    // The requests that were canceled while waiting are dropped.
+    while (!queue.empty() && !queue.front().fulfiller->isWaiting()) {
+      queue.pop_front();
+    }
+    bool admitted = false;
+    if (!queue.empty() && CanAdmit(it->first, queue.front().bytes)) {
+      Waiter waiter = std::move(queue.front());
+      queue.pop_front();
+      Usage& usage = frontends_[it->first];
+      usage.requests++;
+      usage.bytes += waiter.bytes;
+      total_.requests++;
+      total_.bytes += waiter.bytes;
+      waiter.fulfiller->fulfill(
+          kj::heap<Ticket>(this, it->first, waiter.bytes));
+      next_frontend_ = cursor;
+      admitted = true;
+    }
+    if (admitted) {
+      idle = 0;
+    } else if (!queue.empty()) {
+      idle++;
+    }
+    if (queue.empty()) waiting_.erase(it);
+  }
+}
+
+void AdmissionControl::Release(uint64_t frontend, size_t bytes) {
+  auto it = frontends_.find(frontend);
+  if (it != frontends_.end()) {
+    it->second.requests--;
+    it->second.bytes -= bytes;
+    if (it->second.requests == 0) frontends_.erase(it);
+  }
+  total_.requests--;
+  total_.bytes -= bytes;
+  AdmitNext();
+}
+
+}  // namespace util
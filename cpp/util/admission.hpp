@@ -0,0 +1,78 @@
+#ifndef UTIL_ADMISSION_HPP
+#define UTIL_ADMISSION_HPP
+#include <kj/async.h>
+#include <kj/common.h>
+#include <cstdint>
+#include <deque>
+#include <map>
+
+namespace util {
+
+// Limits the number of requests that are admitted at the same time, and the
+// sum of their sizes, both in total and for each frontend. The requests of a
+// frontend are admitted in order, and the frontends that have requests
+// waiting are served in round robin, so that a frontend with many requests
+// cannot starve the others. A frontend with no admitted requests always gets
+// one, even if it goes over the limits, so that it keeps making progress.
+class AdmissionControl {
+ public:
+  // Maximum number of requests and of bytes, 0 means unlimited.
+  struct Limits {
+    size_t requests = 0;
+    size_t bytes = 0;
+  };
+
+  // Releases the share of the limits of a request when destroyed.
+  class Ticket {
+   public:
+    Ticket(AdmissionControl* control, uint64_t frontend, size_t bytes)
+        : control_(control), frontend_(frontend), bytes_(bytes) {}
+    ~Ticket();
+    KJ_DISALLOW_COPY(Ticket);
+
+   private:
+    AdmissionControl* control_;
+    uint64_t frontend_;
+    size_t bytes_;
+  };
+
+  AdmissionControl(Limits total, Limits per_frontend)
+      : total_limits_(total), frontend_limits_(per_frontend) {}
+  KJ_DISALLOW_COPY(AdmissionControl);
+
+  // Returns a promise that resolves with a ticket when a request of the
+  // frontend of the given size can be admitted.
+  kj::Promise<kj::Own<Ticket>> Admit(uint64_t frontend,
+                                     size_t bytes) KJ_WARN_UNUSED_RESULT;
+
+  // Number and size of the requests that hold a ticket.
+  size_t Admitted() const { return total_.requests; }
+  size_t AdmittedBytes() const { return total_.bytes; }
+
+ private:
+  struct Usage {
+    size_t requests = 0;
+    size_t bytes = 0;
+  };
+  struct Waiter {
+    size_t bytes;
+    kj::Own<kj::PromiseFulfiller<kj::Own<Ticket>>> fulfiller;
+  };
+
+  static bool Fits(const Usage& usage, const Limits& limits, size_t bytes);
+  bool CanAdmit(uint64_t frontend, size_t bytes) const;
+  void AdmitNext();
+  void Release(uint64_t frontend, size_t bytes);
+
+  const Limits total_limits_;
+  const Limits frontend_limits_;
+  Usage total_;
+  std::map<uint64_t, Usage> frontends_;
+  std::map<uint64_t, std::deque<Waiter>> waiting_;
+  // Frontends before this one have already been served in the current round.
+  uint64_t next_frontend_ = 0;
+};
+
+}  // namespace util
+
+#endif
@@ -0,0 +1,82 @@
+#include "util/admission.hpp"
+#include <kj/async.h>
+#include <vector>
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+namespace {
+
+using ::testing::ElementsAre;
+using Ticket = kj::Own<util::AdmissionControl::Ticket>;
+
+// Runs the events that are already queued.
+void Drain(kj::WaitScope& wait_scope) {
+  kj::evalLater([]() {}).wait(wait_scope);
+}
+
+kj::Promise<Ticket> Record(kj::Promise<Ticket> promise,
+                           std::vector<int>* admitted, int id) {
+  return promise
+      .then([admitted, id](Ticket ticket) {
+        admitted->push_back(id);
+        return ticket;
+      })
+      .eagerlyEvaluate(nullptr);
+}
+
+// NOLINTNEXTLINE
+TEST(AdmissionControl, FrontendLimits) {
+  kj::EventLoop loop;
+  kj::WaitScope wait_scope(loop);
+  util::AdmissionControl control({}, {2, 100});
+  std::vector<int> admitted;
+  kj::Promise<Ticket> a = Record(control.Admit(1, 10), &admitted, 1);
+  kj::Promise<Ticket> b = Record(control.Admit(1, 10), &admitted, 2);
+  kj::Promise<Ticket> c = Record(control.Admit(1, 10), &admitted, 3);
+  kj::Promise<Ticket> d = Record(control.Admit(2, 200), &admitted, 4);
+  Drain(wait_scope);
+  // The request of the second frontend is too big, but it is its first.
+  EXPECT_THAT(admitted, ElementsAre(1, 2, 4));
+  EXPECT_EQ(control.Admitted(), 3);
+  EXPECT_EQ(control.AdmittedBytes(), 220);
+  a.wait(wait_scope);  // The ticket is released immediately.
+  c.wait(wait_scope);
+  EXPECT_THAT(admitted, ElementsAre(1, 2, 4, 3));
+}
+
+// NOLINTNEXTLINE
+TEST(AdmissionControl, RoundRobin) {
+  kj::EventLoop loop;
+  kj::WaitScope wait_scope(loop);
+  util::AdmissionControl control({2, 0}, {});
+  std::vector<int> admitted;
+  Ticket first = control.Admit(1, 0).wait(wait_scope);
+  Ticket second = control.Admit(2, 0).wait(wait_scope);
+  kj::Promise<Ticket> a = Record(control.Admit(1, 0), &admitted, 1);
+  kj::Promise<Ticket> b = Record(control.Admit(1, 0), &admitted, 2);
+  kj::Promise<Ticket> c = Record(control.Admit(2, 0), &admitted, 3);
+  Drain(wait_scope);
+  EXPECT_THAT(admitted, ElementsAre());
+  first = nullptr;
+  Ticket ticket = a.wait(wait_scope);
+  second = nullptr;
+  ticket = c.wait(wait_scope);
+  EXPECT_THAT(admitted, ElementsAre(1, 3));
+}
+
+// NOLINTNEXTLINE
+TEST(AdmissionControl, Canceled) {
+  kj::EventLoop loop;
+  kj::WaitScope wait_scope(loop);
+  util::AdmissionControl control({1, 0}, {});
+  Ticket first = control.Admit(1, 0).wait(wait_scope);
+  {
+    kj::Promise<Ticket> canceled = control.Admit(2, 0);
+  }
+  kj::Promise<Ticket> waiting = control.Admit(3, 0);
+  first = nullptr;
+  waiting.wait(wait_scope);
+  EXPECT_EQ(control.Admitted(), 0);
+}
+
+}  // namespace
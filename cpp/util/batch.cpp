@@ -0,0 +1,69 @@
+#include "util/batch.hpp"
+
+namespace {
+
+// Parses a decimal number followed by the given separator, advancing pos.
+bool ParseNumber(const std::string& data, size_t* pos, char separator,
+                 uint64_t* value) {
+  size_t start = *pos;
+  *value = 0;
+  while (*pos < data.size() && data[*pos] >= '0' && data[*pos] <= '9') {
+    if (*value > (UINT64_MAX - 9) / 10) return false;
+    *value = *value * 10 + (data[*pos] - '0');
+    ++*pos;
+  }
+  if (*pos == start || *pos == data.size() || data[*pos] != separator) {
+    return false;
+  }
+  ++*pos;
+  return true;
+}
+
+}  // namespace
+
+namespace util {
+
+bool IsValidBatchArg(const std::string& arg) {
+  return !arg.empty() && arg.find_first_of(" \t\n\r\v\f") == std::string::npos;
+}
+
+std::string BatchInput(const std::vector<std::vector<std::string>>& items) {
+  std::string input;
+  for (const auto& args : items) {
+    for (size_t i = 0; i < args.size(); i++) {
+      if (i) input += ' ';
+      input += args[i];
+    }
+    input += '\n';
+  }
+  return input;
+}
+
+std::vector<BatchOutput> ParseBatchOutput(const std::string& data,
+                                          size_t num_items) {
+  std::vector<BatchOutput> outputs;
+  size_t pos = 0;
+  while (outputs.size() < num_items) {
+    uint64_t return_code = 0;
+    uint64_t stdout_size = 0;
+    uint64_t stderr_size = 0;
+    if (!ParseNumber(data, &pos, ' ', &return_code) ||
+        return_code > UINT32_MAX ||
+        !ParseNumber(data, &pos, ' ', &stdout_size) ||
+        !ParseNumber(data, &pos, '\n', &stderr_size) ||
+        stdout_size > data.size() - pos ||
+        stderr_size > data.size() - pos - stdout_size) {
+      break;
+    }
+    BatchOutput output;
+    output.return_code = return_code;
+    output.stdout_data = data.substr(pos, stdout_size);
+    pos += stdout_size;
+    output.stderr_data = data.substr(pos, stderr_size);
+    pos += stderr_size;
+    outputs.push_back(std::move(output));
+  }
+  return outputs;
+}
+
+}  // namespace util
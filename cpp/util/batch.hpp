@@ -0,0 +1,38 @@
+#ifndef UTIL_BATCH_HPP
+#define UTIL_BATCH_HPP
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace util {
+
+// A batch process is started once for many items, for example the checks of
+// the outputs of a solution. Its standard input has a line for each item with
+// the arguments of the item, separated by spaces. For each item, in order, it
+// writes to its standard output a line with the return code of the item and
+// the sizes of its standard output and error, then the two of them.
+
+// Output of an item of a batch process.
+struct BatchOutput {
+  uint32_t return_code = 0;
+  std::string stdout_data;
+  std::string stderr_data;
+};
+
+// Whether the argument can be given to an item. Arguments are not quoted, so
+// they cannot be empty or contain white space.
+bool IsValidBatchArg(const std::string& arg);
+
+// Standard input of a batch process with these items.
+std::string BatchInput(const std::vector<std::vector<std::string>>& items);
+
+// Parses the standard output of a batch process. It stops at the first item
+// whose output is missing or malformed, so that fewer than num_items outputs
+// are returned if the process failed.
+std::vector<BatchOutput> ParseBatchOutput(const std::string& data,
+                                          size_t num_items);
+
+}  // namespace util
+
+#endif
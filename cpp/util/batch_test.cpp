@@ -0,0 +1,40 @@
+#include "util/batch.hpp"
+#include "gtest/gtest.h"
+
+namespace {
+
+// NOLINTNEXTLINE
+TEST(Batch, Input) {
+  EXPECT_EQ(util::BatchInput({}), "");
+  EXPECT_EQ(util::BatchInput({{"0/input", "0/output"}, {}, {"1/input"}}),
+            "0/input 0/output\n\n1/input\n");
+  EXPECT_TRUE(util::IsValidBatchArg("0/input"));
+  EXPECT_FALSE(util::IsValidBatchArg(""));
+  EXPECT_FALSE(util::IsValidBatchArg("a b"));
+  EXPECT_FALSE(util::IsValidBatchArg("a\n"));
+}
+
+// NOLINTNEXTLINE
+TEST(Batch, Output) {
+  auto outputs = util::ParseBatchOutput("0 4 2\n1.0\nok1 0 3\nbad", 2);
+  ASSERT_EQ(outputs.size(), 2u);
+  EXPECT_EQ(outputs[0].return_code, 0u);
+  EXPECT_EQ(outputs[0].stdout_data, "1.0\n");
+  EXPECT_EQ(outputs[0].stderr_data, "ok");
+  EXPECT_EQ(outputs[1].return_code, 1u);
+  EXPECT_EQ(outputs[1].stdout_data, "");
+  EXPECT_EQ(outputs[1].stderr_data, "bad");
+}
+
+// NOLINTNEXTLINE
+TEST(Batch, Truncated) {
+  EXPECT_EQ(util::ParseBatchOutput("", 1).size(), 0u);
+  EXPECT_EQ(util::ParseBatchOutput("0 4 2\n1.0\n", 1).size(), 0u);
+  EXPECT_EQ(util::ParseBatchOutput("0 0 0\n0 x 0\n", 2).size(), 1u);
+  EXPECT_EQ(util::ParseBatchOutput("0 0 0\n0 0 0\n", 1).size(), 1u);
+  EXPECT_EQ(util::ParseBatchOutput("99999999999 0 0\n", 1).size(), 0u);
+  EXPECT_EQ(util::ParseBatchOutput("0 99999999999999999999 0\n", 1).size(),
+            0u);
+}
+
+}  // namespace
@@ -0,0 +1,66 @@
+#include "util/bloom_filter.hpp"
+#include <algorithm>
+#include <cmath>
+
+namespace util {
+
+namespace {
+const constexpr uint32_t kMaxHashes = 16;
+
+uint64_t LoadWord(const uint8_t* ptr) {
+  uint64_t ret = 0;
+  for (size_t i = 0; i < sizeof(uint64_t); i++) ret = ret << 8 | ptr[i];
+  return ret;
+}
+}  // namespace
+
+BloomFilter::BloomFilter(size_t num_items, double false_positive_rate) {
+  num_items = std::max<size_t>(num_items, 1);
+  double ln2 = std::log(2.0);
+  double bits = -std::log(false_positive_rate) * num_items / (ln2 * ln2);
+  bits_.resize(std::max<size_t>(std::ceil(bits / 64), 1));
+  double hashes = std::round(NumBits() * ln2 / num_items);
+  num_hashes_ = std::min<uint32_t>(std::max(hashes, 1.0), kMaxHashes);
+}
+
+BloomFilter::BloomFilter(capnproto::BloomFilter::Reader in)
+    : num_hashes_(std::min(in.getNumHashes(), kMaxHashes)) {
+  bits_.assign(in.getBits().begin(), in.getBits().end());
+}
+
+void BloomFilter::ToCapnp(capnproto::BloomFilter::Builder out) const {
+  out.setNumHashes(num_hashes_);
+  auto bits = out.initBits(bits_.size());
+  for (size_t i = 0; i < bits_.size(); i++) bits.set(i, bits_[i]);
+}
+
+template <typename F>
+void BloomFilter::ForEachBit(const SHA256_t& hash, F f) const {
+  if (bits_.empty()) return;
+  const auto& digest = hash.getDigest();
+  uint64_t h1 = LoadWord(digest.data());
+  // An odd step visits distinct bits as long as the size is a power of two,
+  // and is good enough otherwise.
+  uint64_t h2 = LoadWord(digest.data() + sizeof(uint64_t)) | 1;
+  for (uint32_t i = 0; i < num_hashes_; i++) {
+    uint64_t bit = (h1 + i * h2) % NumBits();
+    f(bit / 64, 1ULL << (bit % 64));
+  }
+}
+
+void BloomFilter::Add(const SHA256_t& hash) {
+  ForEachBit(hash, [this](size_t word, uint64_t mask) {
+    bits_[word] |= mask;
+  });
+}
+
+bool BloomFilter::MayContain(const SHA256_t& hash) const {
+  if (bits_.empty()) return false;
+  bool ret = true;
+  ForEachBit(hash, [this, &ret](size_t word, uint64_t mask) {
+    ret = ret && (bits_[word] & mask);
+  });
+  return ret;
+}
+
+}  // namespace util
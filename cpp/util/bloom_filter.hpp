@@ -0,0 +1,42 @@
+#ifndef UTIL_BLOOM_FILTER_HPP
+#define UTIL_BLOOM_FILTER_HPP
+#include <vector>
+#include "capnp/store.capnp.h"
+#include "util/sha256.hpp"
+
+namespace util {
+
+// Approximate set of hashes, that can report false positives but never false
+// negatives. Since the hashes are already uniformly distributed, the bits to
+// set are taken directly from them.
+class BloomFilter {
+ public:
+  // Creates a filter that can hold num_items hashes while keeping the given
+  // false positive rate.
+  explicit BloomFilter(size_t num_items = 0,
+                       double false_positive_rate = 0.01);
+
+  // Conversion from/to a capnproto BloomFilter message.
+  explicit BloomFilter(capnproto::BloomFilter::Reader in);
+  void ToCapnp(capnproto::BloomFilter::Builder out) const;
+
+  void Add(const SHA256_t& hash);
+
+  // Returns false if the hash was never added to the filter.
+  bool MayContain(const SHA256_t& hash) const;
+
+  // Size of the filter, in bits.
+  size_t NumBits() const { return bits_.size() * 64; }
+
+ private:
+  // Calls f(word, mask) for each of the bits associated with the hash.
+  template <typename F>
+  void ForEachBit(const SHA256_t& hash, F f) const;
+
+  std::vector<uint64_t> bits_;
+  uint32_t num_hashes_;
+};
+
+}  // namespace util
+
+#endif
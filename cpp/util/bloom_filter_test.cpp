@@ -0,0 +1,53 @@
+#include "util/bloom_filter.hpp"
+#include <capnp/message.h>
+#include <string>
+#include "gtest/gtest.h"
+
+namespace {
+
+util::SHA256_t MakeHash(size_t id) {
+  std::string data = std::to_string(id);
+  util::SHA256 hasher;
+  hasher.update(reinterpret_cast<const unsigned char*>(data.c_str()),
+                data.size());
+  return hasher.finalize();
+}
+
+// NOLINTNEXTLINE
+TEST(BloomFilter, NoFalseNegatives) {
+  util::BloomFilter filter(1000);
+  for (size_t i = 0; i < 1000; i++) filter.Add(MakeHash(i));
+  for (size_t i = 0; i < 1000; i++) EXPECT_TRUE(filter.MayContain(MakeHash(i)));
+}
+
+// NOLINTNEXTLINE
+TEST(BloomFilter, FalsePositiveRate) {
+  util::BloomFilter filter(10000, 0.01);
+  for (size_t i = 0; i < 10000; i++) filter.Add(MakeHash(i));
+  size_t false_positives = 0;
+  for (size_t i = 10000; i < 20000; i++) {
+    false_positives += filter.MayContain(MakeHash(i));
+  }
+  EXPECT_LT(false_positives, 200);
+}
+
+// NOLINTNEXTLINE
+TEST(BloomFilter, EmptyFilter) {
+  util::BloomFilter filter;
+  EXPECT_FALSE(filter.MayContain(MakeHash(0)));
+  EXPECT_GE(filter.NumBits(), 64);
+}
+
+// NOLINTNEXTLINE
+TEST(BloomFilter, Capnp) {
+  util::BloomFilter filter(100);
+  for (size_t i = 0; i < 100; i++) filter.Add(MakeHash(i));
+  capnp::MallocMessageBuilder builder;
+  auto message = builder.initRoot<capnproto::BloomFilter>();
+  filter.ToCapnp(message);
+  util::BloomFilter other(message.asReader());
+  EXPECT_EQ(filter.NumBits(), other.NumBits());
+  for (size_t i = 0; i < 100; i++) EXPECT_TRUE(other.MayContain(MakeHash(i)));
+}
+
+}  // namespace
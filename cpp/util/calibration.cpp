@@ -0,0 +1,50 @@
+#include "util/calibration.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <numeric>
+#include <random>
+#include <vector>
+
+namespace {
+const size_t kBufferSize = 1 << 21;  // 2M entries, 8 MiB.
+const size_t kSteps = 1 << 20;
+
+// Walks a random cycle through the buffer, so that the accesses cannot be
+// predicted, and returns a value that depends on every step.
+uint32_t Chase(const std::vector<uint32_t>& next) {
+  uint32_t pos = 0;
+  uint32_t acc = 0;
+  for (size_t i = 0; i < kSteps; i++) {
+    pos = next[pos];
+    acc = (acc ^ pos) * 2654435761u + static_cast<uint32_t>(i);
+  }
+  return acc;
+}
+}  // namespace
+
+namespace util {
+
+double CalibrationScore(size_t rounds) {
+  std::vector<uint32_t> order(kBufferSize);
+  std::iota(order.begin(), order.end(), 0);
+  // A fixed seed keeps the work identical on every machine.
+  std::mt19937 rng(42);
+  std::shuffle(order.begin() + 1, order.end(), rng);
+  std::vector<uint32_t> next(kBufferSize);
+  for (size_t i = 0; i < kBufferSize; i++) {
+    next[order[i]] = order[(i + 1) % kBufferSize];
+  }
+  double best = 0;
+  volatile uint32_t sink = 0;
+  for (size_t round = 0; round < std::max<size_t>(rounds, 1); round++) {
+    auto start = std::chrono::steady_clock::now();
+    sink = sink + Chase(next);
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    if (elapsed.count() > 0) best = std::max(best, 1 / elapsed.count());
+  }
+  return best;
+}
+
+}  // namespace util
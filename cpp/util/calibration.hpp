@@ -0,0 +1,16 @@
+#ifndef UTIL_CALIBRATION_HPP
+#define UTIL_CALIBRATION_HPP
+#include <cstddef>
+
+namespace util {
+
+// Runs a short single-threaded benchmark, a pointer chase through a buffer
+// larger than most caches mixed with integer arithmetic, and returns how many
+// times per second it completes the fastest of rounds runs. Timed executions
+// of the same evaluation are sent to workers with similar scores, so that
+// their times can be compared.
+double CalibrationScore(size_t rounds = 5);
+
+}  // namespace util
+
+#endif
@@ -0,0 +1,12 @@
+#include "util/calibration.hpp"
+#include "gtest/gtest.h"
+
+namespace {
+
+// NOLINTNEXTLINE
+TEST(Calibration, CalibrationScore) {
+  // A round takes milliseconds, not seconds.
+  EXPECT_GT(util::CalibrationScore(2), 1);
+}
+
+}  // namespace
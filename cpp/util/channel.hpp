@@ -0,0 +1,241 @@
+#ifndef UTIL_CHANNEL_HPP
+#define UTIL_CHANNEL_HPP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <system_error>
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+// This header only depends on the standard library and on POSIX, so that it
+// can be copied next to the managers and the stubs of communication tasks.
+
+namespace util {
+
+// One-way channel between two processes, backed by a ring buffer in a file
+// that both of them map in memory. It replaces a FIFO for protocols with many
+// small messages: the data does not go through the kernel, and a side only
+// makes a system call when it needs to sleep or to wake up the other one.
+//
+// There must be a single reader and a single writer. A process that is killed
+// does not close its side: the other one waits until it is killed too.
+class Channel {
+ public:
+  enum Mode { READ, WRITE };
+
+  static const constexpr size_t kHeaderSize = 4096;
+  static const constexpr size_t kDefaultCapacity = 1 << 20;
+
+  // Creates an empty channel at path, with the given capacity in bytes that
+  // must be a power of two. Returns false and sets errno on failure.
+  static bool Create(const std::string& path,
+                     size_t capacity = kDefaultCapacity) {
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC,
+                  S_IRUSR | S_IWUSR);
+    if (fd == -1) return false;
+    bool ok = ftruncate(fd, kHeaderSize + capacity) != -1;
+    int err = errno;
+    close(fd);
+    errno = err;
+    return ok;
+  }
+
+  Channel(const std::string& path, Mode mode) : mode_(mode) {
+    int fd = open(path.c_str(), O_RDWR | O_CLOEXEC);
+    if (fd == -1) {
+      throw std::system_error(errno, std::system_category(), "open " + path);
+    }
+    struct stat info;
+    if (fstat(fd, &info) == -1) {
+      int err = errno;
+      close(fd);
+      throw std::system_error(err, std::system_category(), "fstat " + path);
+    }
+    size_ = info.st_size;
+    capacity_ = size_ > kHeaderSize ? size_ - kHeaderSize : 0;
+    if (capacity_ == 0 || (capacity_ & (capacity_ - 1)) != 0) {
+      close(fd);
+      throw std::system_error(EINVAL, std::system_category(),
+                              "Invalid channel " + path);
+    }
+    void* mem = mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    int err = errno;
+    close(fd);
+    if (mem == MAP_FAILED) {
+      throw std::system_error(err, std::system_category(), "mmap " + path);
+    }
+    shared_ = static_cast<Shared*>(mem);
+    data_ = static_cast<char*>(mem) + kHeaderSize;
+  }
+
+  ~Channel() {
+    Close();
+    munmap(shared_, size_);
+  }
+
+  Channel(const Channel&) = delete;
+  Channel& operator=(const Channel&) = delete;
+
+  // Writes all the data, waiting while the buffer is full. Returns false if
+  // the reader closed the channel.
+  bool Write(const void* data, size_t size) {
+    const char* src = static_cast<const char*>(data);
+    while (size > 0) {
+      uint64_t head = shared_->head.load(std::memory_order_relaxed);
+      uint64_t tail = shared_->tail.load();
+      if (shared_->reader_closed.load()) return false;
+      // The other end shares the memory and may be compromised: a tail
+      // beyond head must not make the writer overrun the buffer.
+      size_t space = capacity_ - std::min<uint64_t>(head - tail, capacity_);
+      if (space == 0) {
+        Wait(&shared_->space_seq, &shared_->writer_waiting, [this, tail]() {
+          return shared_->tail.load() != tail ||
+                 shared_->reader_closed.load() != 0;
+        });
+        continue;
+      }
+      size_t n = std::min(size, space);
+      size_t offset = head & (capacity_ - 1);
+      size_t first = std::min(n, capacity_ - offset);
+      memcpy(data_ + offset, src, first);
+      memcpy(data_, src + first, n - first);
+      shared_->head.store(head + n);
+      if (shared_->reader_waiting.load()) Wake(&shared_->data_seq);
+      src += n;
+      size -= n;
+    }
+    return true;
+  }
+
+  // Reads at most size bytes, waiting until some are available. Returns 0
+  // once the writer closed the channel and all the data was read.
+  size_t Read(void* data, size_t size) {
+    char* dst = static_cast<char*>(data);
+    while (size > 0) {
+      uint64_t tail = shared_->tail.load(std::memory_order_relaxed);
+      uint64_t head = shared_->head.load();
+      if (head == tail) {
+        // The data written before closing must still be read.
+        if (shared_->writer_closed.load() &&
+            shared_->head.load() == tail) {
+          return 0;
+        }
+        Wait(&shared_->data_seq, &shared_->reader_waiting, [this, tail]() {
+          return shared_->head.load() != tail ||
+                 shared_->writer_closed.load() != 0;
+        });
+        continue;
+      }
+      // As in Write, head is not trusted to be at most capacity_ ahead.
+      size_t n = std::min<uint64_t>(size, std::min<uint64_t>(head - tail,
+                                                             capacity_));
+      size_t offset = tail & (capacity_ - 1);
+      size_t first = std::min(n, capacity_ - offset);
+      memcpy(dst, data_ + offset, first);
+      memcpy(dst + first, data_, n - first);
+      shared_->tail.store(tail + n);
+      if (shared_->writer_waiting.load()) Wake(&shared_->space_seq);
+      return n;
+    }
+    return 0;
+  }
+
+  // Reads exactly size bytes. Returns false if the channel was closed before.
+  bool ReadAll(void* data, size_t size) {
+    char* dst = static_cast<char*>(data);
+    while (size > 0) {
+      size_t n = Read(dst, size);
+      if (n == 0) return false;
+      dst += n;
+      size -= n;
+    }
+    return true;
+  }
+
+  // Closes this side of the channel, waking up the other one. It is also
+  // closed by the destructor.
+  void Close() {
+    if (closed_) return;
+    closed_ = true;
+    if (mode_ == WRITE) {
+      shared_->writer_closed.store(1);
+      Wake(&shared_->data_seq);
+    } else {
+      shared_->reader_closed.store(1);
+      Wake(&shared_->space_seq);
+    }
+  }
+
+ private:
+  // Layout of the start of the file, where a zeroed header is an empty
+  // channel. The fields of the reader and of the writer are on different
+  // cache lines.
+  struct Shared {
+    alignas(64) std::atomic<uint64_t> head;
+    std::atomic<uint32_t> data_seq;
+    std::atomic<uint32_t> reader_waiting;
+    std::atomic<uint32_t> writer_closed;
+    alignas(64) std::atomic<uint64_t> tail;
+    std::atomic<uint32_t> space_seq;
+    std::atomic<uint32_t> writer_waiting;
+    std::atomic<uint32_t> reader_closed;
+  };
+  static_assert(sizeof(Shared) <= kHeaderSize, "Channel header too big");
+
+  // Number of times the condition is checked before going to sleep.
+  static const constexpr int kSpins = 256;
+
+  // Waits until ready() is true, or until seq is changed by Wake. Setting
+  // waiting before checking ready() ensures that the other side either sees
+  // it or makes ready() true before it is checked.
+  template <typename Ready>
+  static void Wait(std::atomic<uint32_t>* seq, std::atomic<uint32_t>* waiting,
+                   Ready ready) {
+    for (int i = 0; i < kSpins; i++) {
+      if (ready()) return;
+#if defined(__x86_64__) || defined(__i386__)
+      __builtin_ia32_pause();
+#endif
+    }
+    uint32_t value = seq->load();
+    waiting->store(1);
+    if (!ready()) {
+#ifdef __linux__
+      syscall(SYS_futex, reinterpret_cast<uint32_t*>(seq),  // NOLINT
+              FUTEX_WAIT, value, nullptr, nullptr, 0);
+#else
+      usleep(50);
+#endif
+    }
+    waiting->store(0);
+  }
+
+  static void Wake(std::atomic<uint32_t>* seq) {
+    seq->fetch_add(1);
+#ifdef __linux__
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(seq),  // NOLINT
+            FUTEX_WAKE, 1, nullptr, nullptr, 0);
+#endif
+  }
+
+  Mode mode_;
+  bool closed_ = false;
+  size_t size_ = 0;
+  size_t capacity_ = 0;
+  Shared* shared_ = nullptr;
+  char* data_ = nullptr;
+};
+
+}  // namespace util
+
+#endif
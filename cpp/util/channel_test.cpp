@@ -0,0 +1,118 @@
+#include "util/channel.hpp"
+#include <thread>
+#include <vector>
+#include "gtest/gtest.h"
+#include "util/file.hpp"
+
+namespace {
+
+// NOLINTNEXTLINE
+TEST(Channel, ReadAfterClose) {
+  util::TempDir tmp("/tmp");
+  std::string path = util::File::JoinPath(tmp.Path(), "channel");
+  ASSERT_TRUE(util::Channel::Create(path));
+  util::Channel writer(path, util::Channel::WRITE);
+  util::Channel reader(path, util::Channel::READ);
+  EXPECT_TRUE(writer.Write("hello", 5));
+  writer.Close();
+  char buf[16];
+  EXPECT_EQ(reader.Read(buf, sizeof(buf)), 5);
+  EXPECT_EQ(std::string(buf, 5), "hello");
+  EXPECT_EQ(reader.Read(buf, sizeof(buf)), 0);
+}
+
+// NOLINTNEXTLINE
+TEST(Channel, WriteAfterReaderClose) {
+  util::TempDir tmp("/tmp");
+  std::string path = util::File::JoinPath(tmp.Path(), "channel");
+  ASSERT_TRUE(util::Channel::Create(path, 16));
+  util::Channel writer(path, util::Channel::WRITE);
+  util::Channel reader(path, util::Channel::READ);
+  reader.Close();
+  EXPECT_FALSE(writer.Write("hello", 5));
+}
+
+// NOLINTNEXTLINE
+TEST(Channel, InvalidCapacity) {
+  util::TempDir tmp("/tmp");
+  std::string path = util::File::JoinPath(tmp.Path(), "channel");
+  ASSERT_TRUE(util::Channel::Create(path, 100));
+  EXPECT_THROW(util::Channel(path, util::Channel::READ), std::system_error);
+  EXPECT_FALSE(util::Channel::Create(path));
+}
+
+// NOLINTNEXTLINE
+TEST(Channel, ForgedHead) {
+  util::TempDir tmp("/tmp");
+  std::string path = util::File::JoinPath(tmp.Path(), "channel");
+  ASSERT_TRUE(util::Channel::Create(path, 16));
+  util::Channel reader(path, util::Channel::READ);
+  // The head is the first field of the header.
+  uint64_t head = 1000;
+  int fd = open(path.c_str(), O_WRONLY);  // NOLINT
+  ASSERT_NE(fd, -1);
+  ASSERT_EQ(pwrite(fd, &head, sizeof(head), 0), sizeof(head));
+  close(fd);
+  char buf[64];
+  EXPECT_EQ(reader.Read(buf, sizeof(buf)), 16);
+}
+
+// NOLINTNEXTLINE
+TEST(Channel, PingPong) {
+  util::TempDir tmp("/tmp");
+  std::string to_path = util::File::JoinPath(tmp.Path(), "to");
+  std::string from_path = util::File::JoinPath(tmp.Path(), "from");
+  // A small buffer makes the messages wrap around it.
+  ASSERT_TRUE(util::Channel::Create(to_path, 64));
+  ASSERT_TRUE(util::Channel::Create(from_path, 64));
+  const int kRounds = 10000;
+  std::thread echo([&]() {
+    util::Channel in(to_path, util::Channel::READ);
+    util::Channel out(from_path, util::Channel::WRITE);
+    uint32_t value;
+    while (in.ReadAll(&value, sizeof(value))) {
+      value++;
+      ASSERT_TRUE(out.Write(&value, sizeof(value)));
+    }
+  });
+  {
+    util::Channel out(to_path, util::Channel::WRITE);
+    util::Channel in(from_path, util::Channel::READ);
+    for (uint32_t i = 0; i < kRounds; i++) {
+      ASSERT_TRUE(out.Write(&i, sizeof(i)));
+      uint32_t value;
+      ASSERT_TRUE(in.ReadAll(&value, sizeof(value)));
+      EXPECT_EQ(value, i + 1);
+    }
+  }
+  echo.join();
+}
+
+// NOLINTNEXTLINE
+TEST(Channel, Stream) {
+  util::TempDir tmp("/tmp");
+  std::string path = util::File::JoinPath(tmp.Path(), "channel");
+  ASSERT_TRUE(util::Channel::Create(path, 4096));
+  std::vector<uint8_t> data(1 << 20);
+  for (size_t i = 0; i < data.size(); i++) data[i] = i * 7 + i / 251;
+  std::thread writer([&]() {
+    util::Channel out(path, util::Channel::WRITE);
+    for (size_t pos = 0; pos < data.size(); pos += 1000) {
+      size_t n = std::min<size_t>(1000, data.size() - pos);
+      ASSERT_TRUE(out.Write(data.data() + pos, n));
+    }
+  });
+  std::vector<uint8_t> received;
+  {
+    util::Channel in(path, util::Channel::READ);
+    uint8_t buf[777];
+    size_t n;
+    while ((n = in.Read(buf, sizeof(buf))) != 0) {
+      received.insert(received.end(), buf, buf + n);
+    }
+  }
+  writer.join();
+  EXPECT_EQ(received, data);
+}
+
+}  // namespace
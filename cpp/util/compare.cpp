@@ -0,0 +1,158 @@
+#include "util/compare.hpp"
+#include <memory>
+#include <string>
+#include <vector>
+#include "util/file.hpp"
+#include "util/pack_store.hpp"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace {
+
+bool IsBlank(uint8_t c) {
+  return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+}
+
+// Returns the next character of data that is not blank, starting at *pos, or
+// -1 at the end. A newline is added at the end of files that do not have one.
+int Next(kj::ArrayPtr<const uint8_t> data, size_t* pos) {
+  while (*pos < data.size() && IsBlank(data[*pos])) ++*pos;
+  if (*pos < data.size()) return data[(*pos)++];
+  if (*pos == data.size() && data.size() != 0 &&
+      data[data.size() - 1] != '\n') {
+    ++*pos;
+    return '\n';
+  }
+  return -1;
+}
+
+// Skips the bytes that are the same in both files, that are most of them when
+// the files are equal.
+void SkipEqual(kj::ArrayPtr<const uint8_t> a, kj::ArrayPtr<const uint8_t> b,
+               size_t* i, size_t* j) {
+#ifdef __SSE2__
+  while (*i + 16 <= a.size() && *j + 16 <= b.size()) {
+    __m128i x = _mm_loadu_si128(
+        reinterpret_cast<const __m128i*>(a.begin() + *i));  // NOLINT
+    __m128i y = _mm_loadu_si128(
+        reinterpret_cast<const __m128i*>(b.begin() + *j));  // NOLINT
+    unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(x, y));
+    if (mask != 0xFFFF) {
+      unsigned same = __builtin_ctz(~mask);
+      *i += same;
+      *j += same;
+      return;
+    }
+    *i += 16;
+    *j += 16;
+  }
+#endif
+  while (*i < a.size() && *j < b.size() && a[*i] == b[*j]) {
+    ++*i;
+    ++*j;
+  }
+}
+
+// Contents of a file of the store, that stay mapped in memory if the file is
+// not in a pack.
+class StoredFile {
+ public:
+  explicit StoredFile(const util::SHA256_t& hash) {
+    if (hash.hasContents()) {
+      auto contents = hash.getContents();
+      data_.assign(contents.begin(), contents.end());
+      return;
+    }
+    std::string path = util::File::PathForHash(hash);
+    if (util::File::Exists(path) ||
+        !util::PackStore::Get().Read(hash, &data_)) {
+      mapped_ = std::make_unique<util::MappedFile>(path);
+    }
+  }
+
+  kj::ArrayPtr<const uint8_t> Data() const {
+    if (mapped_) return mapped_->Data();
+    return {data_.data(), data_.size()};
+  }
+
+ private:
+  std::unique_ptr<util::MappedFile> mapped_;
+  std::vector<uint8_t> data_;
+};
+
+util::SHA256_t InlineHash(const std::string& contents) {
+  util::SHA256 hasher;
+  hasher.update(reinterpret_cast<const unsigned char*>(  // NOLINT
+                    contents.data()),
+                contents.size());
+  util::SHA256_t hash = hasher.finalize();
+  hash.setContents(reinterpret_cast<const uint8_t*>(  // NOLINT
+                       contents.data()),
+                   contents.size());
+  return hash;
+}
+
+}  // namespace
+
+namespace util {
+
+bool WhitespaceEqual(kj::ArrayPtr<const uint8_t> a,
+                     kj::ArrayPtr<const uint8_t> b) {
+  size_t i = 0;
+  size_t j = 0;
+  while (true) {
+    SkipEqual(a, b, &i, &j);
+    int x = Next(a, &i);
+    int y = Next(b, &j);
+    if (x != y) return false;
+    if (x == -1) return true;
+  }
+}
+
+bool StoredFilesEqual(const SHA256_t& a, const SHA256_t& b) {
+  if (a == b) return true;
+  StoredFile first(a);
+  StoredFile second(b);
+  return WhitespaceEqual(first.Data(), second.Data());
+}
+
+bool IsBuiltinCompare(capnproto::ProcessRequest::Reader request) {
+  auto executable = request.getExecutable();
+  return executable.isSystem() &&
+         executable.getSystem() == capnproto::BUILTIN_COMPARE.get();
+}
+
+bool BuiltinCompareInputs(capnproto::ProcessRequest::Reader request,
+                          SHA256_t* first, SHA256_t* second) {
+  auto args = request.getArgs();
+  if (args.size() != 2) return false;
+  bool found_first = false;
+  bool found_second = false;
+  for (auto input : request.getInputFiles()) {
+    if (input.getName() == args[0]) {
+      *first = input.getHash();
+      found_first = true;
+    }
+    if (input.getName() == args[1]) {
+      *second = input.getHash();
+      found_second = true;
+    }
+  }
+  return found_first && found_second;
+}
+
+void SetBuiltinCompareResult(bool equal,
+                             capnproto::ProcessResult::Builder out) {
+  if (equal) {
+    out.getStatus().setSuccess();
+  } else {
+    out.getStatus().setReturnCode(1);
+  }
+  out.initResourceUsage();
+  InlineHash(equal ? "" : "Files differ\n").ToCapnp(out.initStdout());
+  InlineHash("").ToCapnp(out.initStderr());
+}
+
+}  // namespace util
@@ -0,0 +1,37 @@
+#ifndef UTIL_COMPARE_HPP
+#define UTIL_COMPARE_HPP
+#include <kj/array.h>
+#include <cstdint>
+#include "capnp/evaluation.capnp.h"
+#include "util/sha256.hpp"
+
+namespace util {
+
+// Whether a and b are equal for "diff -w": they must have the same lines once
+// all the white space but the newlines is removed. A missing newline at the
+// end of a file is not a difference.
+bool WhitespaceEqual(kj::ArrayPtr<const uint8_t> a,
+                     kj::ArrayPtr<const uint8_t> b);
+
+// Same as WhitespaceEqual, for two files of the store. Throws if one of them
+// is not there.
+bool StoredFilesEqual(const SHA256_t& a, const SHA256_t& b);
+
+// Whether the process is the builtin comparison, whose executable is the
+// system program capnproto::BUILTIN_COMPARE. It is run by the workers, or
+// by the server, without a sandbox.
+bool IsBuiltinCompare(capnproto::ProcessRequest::Reader request);
+
+// Finds the two input files that the builtin comparison compares, named by
+// its arguments. Returns false if the request is not valid.
+bool BuiltinCompareInputs(capnproto::ProcessRequest::Reader request,
+                          SHA256_t* first, SHA256_t* second);
+
+// Fills the result of the builtin comparison as for diff: success if the
+// files are equal, and a return code of 1 otherwise. The standard output and
+// error are inlined in the result.
+void SetBuiltinCompareResult(bool equal, capnproto::ProcessResult::Builder out);
+
+}  // namespace util
+
+#endif
@@ -0,0 +1,45 @@
+#include "util/compare.hpp"
+#include <string>
+#include "gtest/gtest.h"
+
+namespace {
+
+bool Equal(const std::string& a, const std::string& b) {
+  return util::WhitespaceEqual(
+      {reinterpret_cast<const uint8_t*>(a.data()), a.size()},  // NOLINT
+      {reinterpret_cast<const uint8_t*>(b.data()), b.size()});  // NOLINT
+}
+
+// NOLINTNEXTLINE
+TEST(Compare, Equal) {
+  EXPECT_TRUE(Equal("", ""));
+  EXPECT_TRUE(Equal("1 2 3\n", "1 2 3\n"));
+  EXPECT_TRUE(Equal("a b\n", "ab\n"));
+  EXPECT_TRUE(Equal("a \t\r\n", "a\n"));
+  EXPECT_TRUE(Equal("a\n", "a"));
+}
+
+// NOLINTNEXTLINE
+TEST(Compare, Different) {
+  EXPECT_FALSE(Equal("1\n", "2\n"));
+  EXPECT_FALSE(Equal("a\n\n", "a\n"));
+  EXPECT_FALSE(Equal("a\n \n", "a\n"));
+  EXPECT_FALSE(Equal("1 2\n", "1\n2\n"));
+  EXPECT_FALSE(Equal("", "\n"));
+  EXPECT_FALSE(Equal("a\n ", "a\n"));
+}
+
+// NOLINTNEXTLINE
+TEST(Compare, Long) {
+  std::string a;
+  for (int i = 0; i < 10000; i++) a += std::to_string(i) + " \n";
+  std::string b = a;
+  EXPECT_TRUE(Equal(a, b));
+  b[b.size() / 2] = ' ';
+  EXPECT_FALSE(Equal(a, b));
+  std::string c;
+  for (int i = 0; i < 10000; i++) c += std::to_string(i) + "\n";
+  EXPECT_TRUE(Equal(a, c));
+}
+
+}  // namespace
@@ -0,0 +1,54 @@
+#include "util/compression.hpp"
+#include <stdexcept>
+
+#ifdef TASK_MAKER_HAS_LZ4
+#include <lz4.h>
+#endif
+
+namespace {
+// Compressed data must be at most this fraction of the original, otherwise
+// the time spent decoding it is not worth the saved bytes.
+const constexpr double kMaxCompressionRatio = 0.9;
+}  // namespace
+
+namespace util {
+
+#ifdef TASK_MAKER_HAS_LZ4
+bool HasLz4() { return true; }
+
+bool Lz4Compress(const uint8_t* data, size_t size, std::vector<uint8_t>* out) {
+  if (size == 0 || size > LZ4_MAX_INPUT_SIZE) return false;
+  int max_size = static_cast<int>(size * kMaxCompressionRatio);
+  out->resize(LZ4_compressBound(size));
+  int compressed = LZ4_compress_default(reinterpret_cast<const char*>(data),
+                                        reinterpret_cast<char*>(out->data()),
+                                        size, out->size());
+  if (compressed <= 0 || compressed > max_size) return false;
+  out->resize(compressed);
+  return true;
+}
+
+void Lz4Decompress(const uint8_t* data, size_t size, size_t decoded_size,
+                   std::vector<uint8_t>* out) {
+  out->resize(decoded_size);
+  int decoded = LZ4_decompress_safe(reinterpret_cast<const char*>(data),
+                                    reinterpret_cast<char*>(out->data()),
+                                    size, decoded_size);
+  if (decoded < 0 || static_cast<size_t>(decoded) != decoded_size) {
+    throw std::runtime_error("Corrupted lz4 data");
+  }
+}
+#else
+bool HasLz4() { return false; }
+
+bool Lz4Compress(const uint8_t* data, size_t size, std::vector<uint8_t>* out) {
+  return false;
+}
+
+void Lz4Decompress(const uint8_t* data, size_t size, size_t decoded_size,
+                   std::vector<uint8_t>* out) {
+  throw std::runtime_error("lz4 support is not available");
+}
+#endif
+
+}  // namespace util
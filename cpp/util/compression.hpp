@@ -0,0 +1,24 @@
+#ifndef UTIL_COMPRESSION_HPP
+#define UTIL_COMPRESSION_HPP
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace util {
+
+// Returns true if the process was built with lz4 support.
+bool HasLz4();
+
+// Compresses size bytes from data into out. Returns false, leaving out in an
+// unspecified state, if lz4 is not available or the data is not compressible
+// enough to be worth decoding on the other side.
+bool Lz4Compress(const uint8_t* data, size_t size, std::vector<uint8_t>* out);
+
+// Decompresses size bytes from data into out, that must become exactly
+// decoded_size bytes long. Throws std::runtime_error on corrupted data.
+void Lz4Decompress(const uint8_t* data, size_t size, size_t decoded_size,
+                   std::vector<uint8_t>* out);
+
+}  // namespace util
+
+#endif
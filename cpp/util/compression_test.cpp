@@ -0,0 +1,35 @@
+#include "util/compression.hpp"
+#include <random>
+#include <stdexcept>
+#include "gtest/gtest.h"
+
+namespace {
+
+// NOLINTNEXTLINE
+TEST(Compression, RoundTrip) {
+  if (!util::HasLz4()) return;
+  std::vector<uint8_t> data;
+  for (int i = 0; i < 100000; i++) data.push_back(i % 7);
+  std::vector<uint8_t> compressed;
+  ASSERT_TRUE(util::Lz4Compress(data.data(), data.size(), &compressed));
+  EXPECT_LT(compressed.size(), data.size());
+  std::vector<uint8_t> decoded;
+  util::Lz4Decompress(compressed.data(), compressed.size(), data.size(),
+                      &decoded);
+  EXPECT_EQ(decoded, data);
+  EXPECT_THROW(util::Lz4Decompress(compressed.data(), compressed.size(),
+                                   data.size() + 1, &decoded),
+               std::runtime_error);
+}
+
+// NOLINTNEXTLINE
+TEST(Compression, Incompressible) {
+  std::mt19937 rng(42);
+  std::vector<uint8_t> data;
+  for (int i = 0; i < 100000; i++) data.push_back(rng());
+  std::vector<uint8_t> compressed;
+  EXPECT_FALSE(util::Lz4Compress(data.data(), data.size(), &compressed));
+  EXPECT_FALSE(util::Lz4Compress(data.data(), 0, &compressed));
+}
+
+}  // namespace
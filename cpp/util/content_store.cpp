@@ -0,0 +1,174 @@
+#include "util/content_store.hpp"
+#include <capnp/message.h>
+#include <capnp/serialize.h>
+#include <algorithm>
+#include <stdexcept>
+#include <thread>
+#include "capnp/store.capnp.h"
+#include "util/file.hpp"
+#include "util/flags.hpp"
+#include "util/pack_store.hpp"
+#include "util/reclaimer.hpp"
+
+namespace util {
+
+namespace {
+// Minimum number of changes before the index is written again.
+const constexpr size_t kMinIndexChanges = 4096;
+
+capnp::ReaderOptions IndexReaderOptions() {
+  capnp::ReaderOptions options;
+  options.traversalLimitInWords = kj::maxValue;
+  return options;
+}
+}  // namespace
+
+ContentStore::ContentStore(std::string index_path)
+    : index_path_(std::move(index_path)) {
+  if (index_path_.empty()) return;
+  LoadIndex();
+  reconciled_ = false;
+  scan_ = std::make_shared<ScanState>();
+  // The scan of a big store may take minutes: do it in the background, and
+  // start serving requests with the files in the index. The thread is
+  // detached so that shutting down does not wait for it, and only touches the
+  // shared state.
+  std::thread([scan = scan_]() {
+    std::vector<std::pair<SHA256_t, size_t>> files;
+    KJ_IF_MAYBE(exc, kj::runCatchingExceptions([&files]() {
+                  for (auto path : File::ListFiles(Flags::store_directory)) {
+                    try {
+                      SHA256_t hash(File::BaseName(path));
+                      if (File::PathForHash(hash) != path) continue;
+                      int64_t sz = File::Size(path);
+                      if (sz >= 0) files.emplace_back(hash, sz);
+                    } catch (std::invalid_argument& e) {
+                      continue;
+                    }
+                  }
+                  for (auto& file : PackStore::Get().List()) {
+                    files.push_back(std::move(file));
+                  }
+                })) {
+      KJ_LOG(WARNING, "Failed to scan the store", *exc);
+      files.clear();
+    }
+    std::lock_guard<std::mutex> lck(scan->mutex);
+    scan->files = std::move(files);
+    scan->done = true;
+  }).detach();
+}
+
+ContentStore::~ContentStore() {
+  KJ_IF_MAYBE(exc, kj::runCatchingExceptions([this]() { SaveIndex(); })) {
+    KJ_LOG(WARNING, "Failed to save the store index", *exc);
+  }
+}
+
+void ContentStore::LoadIndex() {
+  if (!File::Exists(index_path_)) return;
+  KJ_IF_MAYBE(exc, kj::runCatchingExceptions([this]() {
+                MappedFile mapped(index_path_);
+                auto data = mapped.Data();
+                kj::ArrayPtr<const capnp::word> words(
+                    reinterpret_cast<const capnp::word*>(data.begin()),
+                    data.size() / sizeof(capnp::word));
+                capnp::FlatArrayMessageReader reader(words,
+                                                     IndexReaderOptions());
+                auto index = reader.getRoot<capnproto::StoreIndex>();
+                for (auto file : index.getFiles()) {
+                  files_.Add(file.getHash(), file.getSize(), file.getCost());
+                }
+              })) {
+    KJ_LOG(WARNING, "Invalid store index, ignoring it", *exc);
+    files_ = EvictionQueue();
+  }
+}
+
+bool ContentStore::Reconcile() {
+  if (reconciled_) return false;
+  std::vector<std::pair<SHA256_t, size_t>> scanned;
+  {
+    std::lock_guard<std::mutex> lck(scan_->mutex);
+    if (!scan_->done) return false;
+    scanned = std::move(scan_->files);
+  }
+  reconciled_ = true;
+  size_t changes = 0;
+  std::unordered_set<SHA256_t, SHA256_t::Hasher> present;
+  present.reserve(scanned.size());
+  for (auto& file : scanned) {
+    present.insert(file.first);
+    if (files_.Contains(file.first)) continue;
+    // The file may have been evicted after the scan listed it.
+    Reclaimer::Get().Cancel(file.first);
+    if (!File::InStore(file.first)) continue;
+    files_.Add(file.first, file.second);
+    changes++;
+  }
+  std::vector<SHA256_t> missing;
+  files_.ForEach([&](const SHA256_t& hash, size_t size, double cost) {
+    if (!present.count(hash) && !added_during_scan_.count(hash)) {
+      missing.push_back(hash);
+    }
+  });
+  for (const auto& hash : missing) files_.Remove(hash);
+  changes += missing.size();
+  added_during_scan_.clear();
+  changes_ += changes;
+  if (changes_) SaveIndex();
+  return changes != 0;
+}
+
+int64_t ContentStore::StoreSize(const SHA256_t& hash) {
+  if (files_.Contains(hash)) return files_.Size(hash);
+  Reclaimer::Get().Cancel(hash);
+  return File::StoreSize(hash);
+}
+
+bool ContentStore::Add(const SHA256_t& hash, size_t size, double cost) {
+  if (!reconciled_) added_during_scan_.insert(hash);
+  bool added = !files_.Contains(hash);
+  files_.Add(hash, size, cost);
+  // Touching a file only changes its position in the index: it is enough to
+  // save it once in a while.
+  changes_++;
+  MaybeSaveIndex();
+  return added;
+}
+
+size_t ContentStore::Evict() {
+  if (Flags::cache_size == 0) return 0;
+  size_t count = files_.Count();
+  Reclaimer::Get().Evict(&files_, 1024ULL * 1024 * Flags::cache_size);
+  size_t evicted = count - files_.Count();
+  changes_ += evicted;
+  MaybeSaveIndex();
+  return evicted;
+}
+
+void ContentStore::MaybeSaveIndex() {
+  if (changes_ < std::max(kMinIndexChanges, files_.Count() / 8)) return;
+  SaveIndex();
+}
+
+void ContentStore::SaveIndex() {
+  if (index_path_.empty()) return;
+  capnp::MallocMessageBuilder builder;
+  auto files =
+      builder.initRoot<capnproto::StoreIndex>().initFiles(files_.Count());
+  size_t pos = 0;
+  files_.ForEach([&](const SHA256_t& hash, size_t size, double cost) {
+    auto file = files[pos++];
+    hash.ToCapnp(file.initHash());
+    file.setSize(size);
+    file.setCost(cost);
+  });
+  auto words = capnp::messageToFlatArray(builder);
+  auto receiver = File::Write(index_path_, /*overwrite=*/true);
+  receiver(words.asBytes());
+  receiver({});
+  changes_ = 0;
+}
+
+}  // namespace util
@@ -0,0 +1,89 @@
+#ifndef UTIL_CONTENT_STORE_HPP
+#define UTIL_CONTENT_STORE_HPP
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+#include "util/eviction.hpp"
+#include "util/sha256.hpp"
+
+namespace util {
+
+// The files of the store in Flags::store_directory that are tracked for
+// eviction, keeping the total size within Flags::cache_size. Evicted files are
+// deleted in the background by the Reclaimer.
+//
+// If an index path is given, the list of the files is kept there: it is loaded
+// at construction and reconciled with the actual contents of the store, which
+// are scanned in the background.
+class ContentStore {
+ public:
+  explicit ContentStore(std::string index_path = "");
+  ~ContentStore();
+  KJ_DISALLOW_COPY(ContentStore);
+
+  // Returns the size of the file with the given hash, or -1 if it is not in
+  // the store. A pending deletion of the file is canceled.
+  int64_t StoreSize(const SHA256_t& hash);
+
+  // Tracks the file with the given hash, or marks it as used if it is already
+  // tracked. cost is the number of seconds that were needed to produce the
+  // file, if known. Returns true if the file was not tracked.
+  bool Add(const SHA256_t& hash, size_t size, double cost = 0);
+
+  // Evicts files until the store fits in Flags::cache_size. Returns the number
+  // of evicted files.
+  size_t Evict();
+
+  // Merges the result of the scan of the store, if it is complete, adding the
+  // files that are not in the index and removing the ones that are missing.
+  // Returns true if the tracked files changed.
+  bool Reconcile();
+
+  bool Contains(const SHA256_t& hash) const { return files_.Contains(hash); }
+  size_t Size(const SHA256_t& hash) const { return files_.Size(hash); }
+  bool Touch(const SHA256_t& hash) { return files_.Touch(hash); }
+  size_t Count() const { return files_.Count(); }
+
+  // Prevents the file from being evicted while it is used. Calls should be
+  // matched by calls to Unpin.
+  void Pin(const SHA256_t& hash) { files_.Pin(hash); }
+  void Unpin(const SHA256_t& hash) { files_.Unpin(hash); }
+
+  template <typename F>
+  void ForEach(F f) const {
+    files_.ForEach(f);
+  }
+
+  // Writes the index, if there is one.
+  void SaveIndex();
+
+ private:
+  // Result of the scan of the store, shared with the thread doing it.
+  struct ScanState {
+    std::mutex mutex;
+    bool done = false;
+    std::vector<std::pair<SHA256_t, size_t>> files;
+  };
+
+  void LoadIndex();
+
+  // Writes the index if it changed enough since the last time it was written.
+  void MaybeSaveIndex();
+
+  std::string index_path_;
+  EvictionQueue files_;
+  // Number of changes since the last time the index was written.
+  size_t changes_ = 0;
+
+  std::shared_ptr<ScanState> scan_;
+  bool reconciled_ = true;
+  // Files added while the scan was running, that may not be part of its
+  // result.
+  std::unordered_set<SHA256_t, SHA256_t::Hasher> added_during_scan_;
+};
+
+}  // namespace util
+#endif
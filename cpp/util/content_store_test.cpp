@@ -0,0 +1,104 @@
+#include "util/content_store.hpp"
+#include <chrono>
+#include <thread>
+#include "gtest/gtest.h"
+#include "util/file.hpp"
+#include "util/flags.hpp"
+
+namespace {
+
+util::SHA256_t AddFile(const std::string& content) {
+  std::string path = util::File::JoinPath(Flags::temp_directory, "file");
+  auto receiver = util::File::Write(path, /*overwrite=*/true);
+  receiver(kj::ArrayPtr<const kj::byte>(
+      reinterpret_cast<const kj::byte*>(content.data()),  // NOLINT
+      content.size()));
+  receiver({});
+  util::SHA256_t hash = util::File::Hash(path);
+  util::File::Move(path, util::File::PathForHash(hash), /*overwrite=*/true);
+  return hash;
+}
+
+std::string IndexPath() {
+  return util::File::JoinPath(Flags::store_directory, "index");
+}
+
+class ContentStoreTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    Flags::store_directory = "/tmp/task_maker_testdir/content_store/store";
+    Flags::temp_directory = "/tmp/task_maker_testdir/content_store/temp";
+    Flags::cache_size = 0;
+    if (util::File::Exists(Flags::store_directory)) {
+      util::File::RemoveTree(Flags::store_directory);
+    }
+    util::File::MakeDirs(Flags::temp_directory);
+  }
+  void TearDown() override { Flags::cache_size = 0; }
+};
+
+// NOLINTNEXTLINE
+TEST_F(ContentStoreTest, AddAndStoreSize) {
+  util::ContentStore store;
+  util::SHA256_t hash = AddFile("content");
+  EXPECT_FALSE(store.Contains(hash));
+  EXPECT_EQ(7, store.StoreSize(hash));
+  EXPECT_TRUE(store.Add(hash, 7));
+  EXPECT_FALSE(store.Add(hash, 7));
+  EXPECT_TRUE(store.Contains(hash));
+  EXPECT_EQ(1, store.Count());
+  EXPECT_EQ(0, store.Evict());
+  util::SHA256_t missing = AddFile("missing");
+  util::File::Remove(util::File::PathForHash(missing));
+  EXPECT_LT(store.StoreSize(missing), 0);
+}
+
+// NOLINTNEXTLINE
+TEST_F(ContentStoreTest, EvictKeepsPinned) {
+  Flags::cache_size = 1;
+  util::ContentStore store;
+  std::vector<util::SHA256_t> hashes;
+  // Shrinking to the low watermark only needs to evict the second file, since
+  // the first one is pinned.
+  for (size_t size : {512, 256, 384}) {
+    char c = static_cast<char>('a' + hashes.size());
+    hashes.push_back(AddFile(std::string(size * 1024, c)));
+  }
+  store.Add(hashes[0], 512 * 1024);
+  store.Pin(hashes[0]);
+  store.Add(hashes[1], 256 * 1024);
+  store.Add(hashes[2], 384 * 1024);
+  EXPECT_EQ(1, store.Evict());
+  EXPECT_TRUE(store.Contains(hashes[0]));
+  EXPECT_FALSE(store.Contains(hashes[1]));
+  EXPECT_TRUE(store.Contains(hashes[2]));
+  store.Unpin(hashes[0]);
+}
+
+// NOLINTNEXTLINE
+TEST_F(ContentStoreTest, IndexIsReconciled) {
+  util::SHA256_t kept = AddFile("kept");
+  util::SHA256_t removed = AddFile("removed");
+  {
+    util::ContentStore store(IndexPath());
+    store.Add(kept, 4);
+    store.Add(removed, 7);
+  }
+  util::File::Remove(util::File::PathForHash(removed));
+  util::SHA256_t added = AddFile("added");
+
+  util::ContentStore store(IndexPath());
+  EXPECT_TRUE(store.Contains(kept));
+  EXPECT_TRUE(store.Contains(removed));
+  bool reconciled = false;
+  for (int i = 0; i < 1000 && !reconciled; i++) {
+    reconciled = store.Reconcile();
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  EXPECT_TRUE(reconciled);
+  EXPECT_TRUE(store.Contains(kept));
+  EXPECT_FALSE(store.Contains(removed));
+  EXPECT_TRUE(store.Contains(added));
+}
+
+}  // namespace
@@ -0,0 +1,86 @@
+#include "util/eviction.hpp"
+#include <kj/debug.h>
+#include <algorithm>
+
+namespace util {
+
+void EvictionQueue::Add(const SHA256_t& hash, size_t size, double cost) {
+  cost = std::max(cost, MinCost(size));
+  SHA256Key key = hash.Key();
+  FileInfo* info = files_.Find(key);
+  if (!info) {
+    info = files_.Insert(key, FileInfo{size, cost, 1, Key()}).first;
+    total_size_ += size;
+  } else {
+    queue_.erase(info->key);
+    info->cost = std::max(info->cost, cost);
+    info->frequency++;
+  }
+  Enqueue(key, info);
+}
+
+bool EvictionQueue::Touch(const SHA256_t& hash) {
+  SHA256Key key = hash.Key();
+  FileInfo* info = files_.Find(key);
+  if (!info) return false;
+  queue_.erase(info->key);
+  info->frequency++;
+  Enqueue(key, info);
+  return true;
+}
+
+void EvictionQueue::Remove(const SHA256_t& hash) {
+  SHA256Key key = hash.Key();
+  FileInfo* info = files_.Find(key);
+  if (!info) return;
+  queue_.erase(info->key);
+  total_size_ -= info->size;
+  files_.Erase(key);
+}
+
+size_t EvictionQueue::Size(const SHA256_t& hash) const {
+  const FileInfo* info = files_.Find(hash.Key());
+  KJ_ASSERT(info, hash.Hex());
+  return info->size;
+}
+
+void EvictionQueue::Pin(const SHA256_t& hash) {
+  SHA256Key key = hash.Key();
+  if (pins_[key]++) return;
+  FileInfo* info = files_.Find(key);
+  if (info) queue_.erase(info->key);
+}
+
+void EvictionQueue::Unpin(const SHA256_t& hash) {
+  SHA256Key key = hash.Key();
+  size_t* pins = pins_.Find(key);
+  KJ_ASSERT(pins, hash.Hex());
+  if (--*pins) return;
+  pins_.Erase(key);
+  FileInfo* info = files_.Find(key);
+  // The file keeps the priority it had when it was last used.
+  if (info) queue_.emplace(info->key, key);
+}
+
+SHA256_t EvictionQueue::Next() const {
+  KJ_ASSERT(!queue_.empty());
+  return SHA256_t(queue_.begin()->second);
+}
+
+void EvictionQueue::PopNext() {
+  KJ_ASSERT(!queue_.empty());
+  auto it = queue_.begin();
+  inflation_ = it->first.first;
+  total_size_ -= files_.Find(it->second)->size;
+  files_.Erase(it->second);
+  queue_.erase(it);
+}
+
+void EvictionQueue::Enqueue(const SHA256Key& hash, FileInfo* info) {
+  double priority = inflation_ + info->frequency * info->cost /
+                                     std::max<size_t>(info->size, 1);
+  info->key = Key(priority, last_access_++);
+  if (!pins_.Find(hash)) queue_.emplace(info->key, hash);
+}
+
+}  // namespace util
@@ -0,0 +1,111 @@
+#ifndef UTIL_EVICTION_HPP
+#define UTIL_EVICTION_HPP
+#include <map>
+#include <utility>
+#include "util/flat_hash_map.hpp"
+#include "util/sha256.hpp"
+
+namespace util {
+
+// Bandwidth, in bytes per second, at which files are assumed to be copied
+// around. The cost of recreating a file is never lower than the time that is
+// needed to copy it.
+static const constexpr double kCopyBandwidth = 200.0 * 1024 * 1024;
+
+// Orders files for eviction according to the Greedy-Dual-Size-Frequency
+// policy. Every file gets a priority of L + frequency * cost / size, where the
+// inflation value L is the priority of the last evicted file, and the file
+// with the lowest priority is the first to be evicted. This way big files that
+// are cheap to recompute are evicted before small ones that are expensive to
+// recompute, and files that are not used anymore eventually age out.
+class EvictionQueue {
+ public:
+  // Minimum cost in seconds of recreating a file of the given size.
+  static double MinCost(size_t size) { return size / kCopyBandwidth; }
+
+  // Starts tracking a file, or records an access to it if it is already
+  // tracked. cost is the number of seconds needed to recreate the file, and
+  // only replaces the known one if it is higher.
+  void Add(const SHA256_t& hash, size_t size, double cost = 0);
+
+  // Records an access to a file. Returns false if the file is not tracked.
+  bool Touch(const SHA256_t& hash);
+
+  // Stops tracking a file, if it is tracked.
+  void Remove(const SHA256_t& hash);
+
+  // Returns true if the file is tracked.
+  bool Contains(const SHA256_t& hash) const {
+    return files_.Find(hash.Key()) != nullptr;
+  }
+
+  // Returns the size of a tracked file.
+  size_t Size(const SHA256_t& hash) const;
+
+  // Returns true if no files are tracked.
+  bool Empty() const { return files_.Empty(); }
+
+  // Prevents a file from being evicted until a matching call to Unpin. Pins
+  // are counted, and a file can be pinned before it is tracked.
+  void Pin(const SHA256_t& hash);
+  void Unpin(const SHA256_t& hash);
+
+  // Returns true if the file is pinned.
+  bool Pinned(const SHA256_t& hash) const {
+    return pins_.Find(hash.Key()) != nullptr;
+  }
+
+  // Returns true if there is a file that can be evicted.
+  bool Evictable() const { return !queue_.empty(); }
+
+  // Returns the file that should be evicted next. There must be an evictable
+  // file.
+  SHA256_t Next() const;
+
+  // Stops tracking the file returned by Next, ageing all the other files.
+  void PopNext();
+
+  // Total size of the tracked files.
+  size_t TotalSize() const { return total_size_; }
+
+  // Returns the number of tracked files.
+  size_t Count() const { return files_.Size(); }
+
+  // Calls f(hash, size, cost) for all the tracked files, in eviction order.
+  // Pinned files come last.
+  template <typename F>
+  void ForEach(F f) const {
+    for (const auto& kv : queue_) {
+      const FileInfo* info = files_.Find(kv.second);
+      f(SHA256_t(kv.second), info->size, info->cost);
+    }
+    pins_.ForEach([this, &f](const SHA256Key& key, size_t /*count*/) {
+      const FileInfo* info = files_.Find(key);
+      if (info) f(SHA256_t(key), info->size, info->cost);
+    });
+  }
+
+ private:
+  using Key = std::pair<double, size_t>;
+  struct FileInfo {
+    size_t size;
+    double cost;
+    size_t frequency;
+    Key key;
+  };
+
+  void Enqueue(const SHA256Key& hash, FileInfo* info);
+
+  FlatHashMap<FileInfo> files_;
+  // Sorted by priority, breaking ties with the access order. Pinned files are
+  // not in the queue.
+  std::map<Key, SHA256Key> queue_;
+  FlatHashMap<size_t> pins_;
+  double inflation_ = 0;
+  size_t last_access_ = 0;
+  size_t total_size_ = 0;
+};
+
+}  // namespace util
+
+#endif
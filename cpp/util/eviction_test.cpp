@@ -0,0 +1,94 @@
+#include "util/eviction.hpp"
+#include "gtest/gtest.h"
+
+namespace {
+
+util::SHA256_t MakeHash(uint8_t id) {
+  std::array<uint8_t, util::DIGEST_SIZE> hash{};
+  hash[0] = id;
+  return util::SHA256_t(hash);
+}
+
+// NOLINTNEXTLINE
+TEST(EvictionQueue, LeastRecentlyUsedFirst) {
+  util::EvictionQueue queue;
+  queue.Add(MakeHash(1), 100);
+  queue.Add(MakeHash(2), 100);
+  queue.Add(MakeHash(3), 100);
+  EXPECT_TRUE(queue.Touch(MakeHash(1)));
+  EXPECT_EQ(queue.Next(), MakeHash(2));
+  queue.PopNext();
+  EXPECT_EQ(queue.Next(), MakeHash(3));
+  queue.PopNext();
+  EXPECT_EQ(queue.Next(), MakeHash(1));
+  queue.PopNext();
+  EXPECT_TRUE(queue.Empty());
+}
+
+// NOLINTNEXTLINE
+TEST(EvictionQueue, CheapBigFilesFirst) {
+  util::EvictionQueue queue;
+  queue.Add(MakeHash(1), 1000, 20.0);
+  queue.Add(MakeHash(2), 1000000000, 0.1);
+  queue.Add(MakeHash(3), 1000, 20.0);
+  EXPECT_EQ(queue.Next(), MakeHash(2));
+  queue.PopNext();
+  EXPECT_EQ(queue.Next(), MakeHash(1));
+}
+
+// NOLINTNEXTLINE
+TEST(EvictionQueue, OldFilesAgeOut) {
+  util::EvictionQueue queue;
+  queue.Add(MakeHash(1), 1000, 1.75);
+  for (uint8_t i = 2; i < 5; i++) {
+    queue.Add(MakeHash(i), 1000, 0.5);
+    EXPECT_EQ(queue.Next(), MakeHash(i));
+    queue.PopNext();
+  }
+  // The inflation value is now above the initial priority of the first file,
+  // which should be evicted before a new one with the same cost.
+  queue.Add(MakeHash(10), 1000, 0.5);
+  EXPECT_EQ(queue.Next(), MakeHash(1));
+}
+
+// NOLINTNEXTLINE
+TEST(EvictionQueue, TotalSize) {
+  util::EvictionQueue queue;
+  queue.Add(MakeHash(1), 100);
+  queue.Add(MakeHash(2), 200);
+  queue.Add(MakeHash(2), 200);
+  EXPECT_EQ(300, queue.TotalSize());
+  queue.Remove(MakeHash(1));
+  EXPECT_EQ(200, queue.TotalSize());
+  EXPECT_FALSE(queue.Contains(MakeHash(1)));
+  EXPECT_FALSE(queue.Touch(MakeHash(1)));
+  queue.PopNext();
+  EXPECT_EQ(0, queue.TotalSize());
+}
+
+// NOLINTNEXTLINE
+TEST(EvictionQueue, PinnedFilesAreNotEvicted) {
+  util::EvictionQueue queue;
+  queue.Pin(MakeHash(2));
+  queue.Add(MakeHash(1), 100);
+  queue.Add(MakeHash(2), 100);
+  queue.Add(MakeHash(3), 100);
+  queue.Pin(MakeHash(1));
+  queue.Pin(MakeHash(1));
+  EXPECT_TRUE(queue.Pinned(MakeHash(1)));
+  EXPECT_EQ(queue.Next(), MakeHash(3));
+  queue.PopNext();
+  EXPECT_FALSE(queue.Evictable());
+  EXPECT_EQ(200, queue.TotalSize());
+  queue.Unpin(MakeHash(1));
+  EXPECT_FALSE(queue.Evictable());
+  queue.Unpin(MakeHash(1));
+  queue.Unpin(MakeHash(2));
+  EXPECT_FALSE(queue.Pinned(MakeHash(1)));
+  // The files keep their original order.
+  EXPECT_EQ(queue.Next(), MakeHash(1));
+  queue.PopNext();
+  EXPECT_EQ(queue.Next(), MakeHash(2));
+}
+
+}  // namespace
@@ -1,22 +1,45 @@
 #include "util/file.hpp"
+#include "util/compression.hpp"
 #include "util/flags.hpp"
+#include "util/io_pool.hpp"
+#include "util/metrics.hpp"
 #include "util/sha256.hpp"
+#include "util/transfer_scheduler.hpp"
 
 #include <kj/async.h>
 #include <kj/debug.h>
 #include <kj/exception.h>
 #include <kj/io.h>
+#include <kj/vector.h>
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <cstdlib>
+#include <deque>
 #include <fstream>
-#include <queue>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
 #include <system_error>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
 
 #if defined(__unix__) || defined(__linux__) || defined(__APPLE__)
 #include <fcntl.h>
 #include <ftw.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#endif
 
 // if REMOVE_ALSO_MOUNT_POINTS is set remove also the mount points mounted in
 // the sandbox when cleaning
@@ -62,12 +85,59 @@ bool OsRemoveTree(const std::string& path) {
               64, FTW_DEPTH | FTW_PHYS | NFTW_EXTRA_FLAGS) != -1;
 }
 
+// Files copied from the store are usually hard links, whose mode is already
+// the right one; changing it anyway would dirty the inode in the store.
+bool OsSetMode(const std::string& path, mode_t mode) {
+  struct stat st {};
+  if (stat(path.c_str(), &st) != -1 && (st.st_mode & 07777) == mode) {
+    return true;
+  }
+  return chmod(path.c_str(), mode) != -1;
+}
+
 bool OsMakeExecutable(const std::string& path) {
-  return chmod(path.c_str(), S_IRUSR | S_IXUSR) != -1;
+  return OsSetMode(path, S_IRUSR | S_IXUSR);
 }
 
 bool OsMakeImmutable(const std::string& path) {
-  return chmod(path.c_str(), S_IRUSR) != -1;
+  return OsSetMode(path, S_IRUSR);
+}
+
+// Runs the queued jobs, like the removal of temporary directories, in a
+// background thread.
+std::mutex jobs_mutex;
+std::condition_variable jobs_cv;
+std::deque<std::function<void()>> jobs;
+
+void RunInBackground(std::function<void()> job) {
+  static std::once_flag started;
+  std::call_once(started, []() {
+    std::thread([]() {
+      while (true) {
+        std::function<void()> job;
+        {
+          std::unique_lock<std::mutex> lck(jobs_mutex);
+          jobs_cv.wait(lck, []() { return !jobs.empty(); });
+          job = std::move(jobs.front());
+          jobs.pop_front();
+        }
+        KJ_IF_MAYBE(exc, kj::runCatchingExceptions(job)) {
+          KJ_LOG(WARNING, "Background job failed", *exc);
+        }
+      }
+    }).detach();
+  });
+  std::lock_guard<std::mutex> lck(jobs_mutex);
+  jobs.push_back(std::move(job));
+  jobs_cv.notify_one();
+}
+
+void RemoveTreeInBackground(std::string path) {
+  RunInBackground([path]() {
+    if (!OsRemoveTree(path)) {
+      KJ_LOG(WARNING, "Failed to remove " + path, strerror(errno));
+    }
+  });
 }
 
 const size_t max_path_len = 1 << 15;
@@ -126,6 +196,15 @@ bool OsIsLink(const std::string& path) {
   return S_ISLNK(buf.st_mode);
 }
 
+bool OsSameDevice(const std::string& a, const std::string& b) {
+  struct stat buf_a {};
+  struct stat buf_b {};
+  if (stat(a.c_str(), &buf_a) == -1 || stat(b.c_str(), &buf_b) == -1) {
+    return false;
+  }
+  return buf_a.st_dev == buf_b.st_dev;
+}
+
 // Returns errno, or 0 on success.
 int OsAtomicCopy(const std::string& src, const std::string& dst,
                  bool overwrite = false, bool exist_ok = true) {
@@ -145,12 +224,20 @@ util::File::ChunkProducer OsRead(const std::string& path, uint64_t limit) {
   if (fd.get() == -1) {
     throw std::system_error(errno, std::system_category(), "Read " + path);
   }
+  // Small files do not need a whole chunk of buffer. Files whose size is not
+  // known, like the ones in /proc, get a whole chunk.
+  struct stat st {};
+  size_t buf_size = util::kChunkSize;
+  if (fstat(fd, &st) != -1 && st.st_size > 0) {
+    buf_size = std::min<uint64_t>({buf_size, static_cast<uint64_t>(st.st_size),
+                                   std::max<uint64_t>(limit, 1)});
+  }
   std::unique_ptr<size_t> alreadyRead = std::make_unique<size_t>(0);
   return [fd = std::move(fd), path, alreadyRead = std::move(alreadyRead), limit,
-          buf = std::array<kj::byte, util::kChunkSize>()]() mutable {
+          buf = std::vector<kj::byte>(buf_size)]() mutable {
     if (fd.get() == -1) return util::File::Chunk();
     ssize_t amount;
-    size_t toRead = util::kChunkSize;
+    size_t toRead = buf.size();
     if (*alreadyRead + toRead > limit) toRead = limit - *alreadyRead;
     while ((amount = read(fd, buf.data(), toRead))) {  // NOLINT
       if (amount == -1 && errno == EINTR) continue;
@@ -166,6 +253,86 @@ util::File::ChunkProducer OsRead(const std::string& path, uint64_t limit) {
   };
 }
 
+// Maps the whole file in memory. Empty files are not mapped, and data is set to
+// nullptr for them.
+void OsMapFile(const std::string& path, const kj::byte** data, size_t* size) {
+  kj::AutoCloseFd fd{open(path.c_str(), O_CLOEXEC | O_RDONLY)};  // NOLINT
+  struct stat buf {};
+  if (fd.get() == -1 || fstat(fd, &buf) == -1) {
+    throw std::system_error(errno, std::system_category(), "Map " + path);
+  }
+  *data = nullptr;
+  *size = buf.st_size;
+  if (*size == 0) return;
+  void* addr = mmap(nullptr, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (addr == MAP_FAILED) {
+    throw std::system_error(errno, std::system_category(), "Map " + path);
+  }
+  *data = static_cast<const kj::byte*>(addr);
+}
+
+void OsUnmapFile(const kj::byte* data, size_t size) {
+  if (data == nullptr) return;
+  munmap(const_cast<kj::byte*>(data), size);  // NOLINT
+}
+
+// Flushes the filesystem of the store to disk.
+void OsSyncStore() {
+#ifdef __APPLE__
+  sync();
+#else
+  kj::AutoCloseFd fd{open(Flags::store_directory.c_str(),  // NOLINT
+                          O_CLOEXEC | O_RDONLY | O_DIRECTORY)};
+  if (fd.get() == -1 || syncfs(fd) == -1) sync();
+#endif
+}
+
+enum class Durability { FILE, BATCH, NONE };
+
+Durability DurabilityLevel() {
+  if (Flags::durability == "batch") return Durability::BATCH;
+  if (Flags::durability == "none") return Durability::NONE;
+  return Durability::FILE;
+}
+
+// Number of files written without fsync, and how many of them are known to
+// be on disk.
+std::atomic<uint64_t> written_epoch{0};
+std::atomic<uint64_t> durable_epoch{0};
+
+void SyncStore() {
+  uint64_t target = written_epoch.load();
+  OsSyncStore();
+  uint64_t durable = durable_epoch.load();
+  while (durable < target &&
+         !durable_epoch.compare_exchange_weak(durable, target)) {
+  }
+}
+
+// Its presence means that the store may have files that were not flushed to
+// disk, see File::RecoverStore.
+const constexpr char kUnsyncedMarker[] = "unsynced";
+
+std::string UnsyncedMarkerPath() {
+  return util::File::JoinPath(Flags::store_directory, kUnsyncedMarker);
+}
+
+// Group commit: files written since the last sync are flushed together every
+// Flags::sync_interval milliseconds.
+void MarkWrittenBatch() {
+  written_epoch++;
+  static std::once_flag started;
+  std::call_once(started, []() {
+    std::thread([]() {
+      while (true) {
+        uint32_t interval = std::max<uint32_t>(Flags::sync_interval, 1);
+        std::this_thread::sleep_for(std::chrono::milliseconds(interval));
+        if (durable_epoch.load() < written_epoch.load()) SyncStore();
+      }
+    }).detach();
+  });
+}
+
 util::File::ChunkReceiver OsWrite(const std::string& path, bool overwrite,
                                   bool exist_ok) {
   std::string temp_file;
@@ -192,11 +359,14 @@ util::File::ChunkReceiver OsWrite(const std::string& path, bool overwrite,
     if (fd.get() == -1) return;
     if (chunk.size() == 0) {
       *done = true;
-      if (fsync(fd) == -1 ||
+      Durability durability = DurabilityLevel();
+      util::File::PrepareUnsyncedWrite();
+      if ((durability == Durability::FILE && fsync(fd) == -1) ||
           OsAtomicMove(temp_file, path, overwrite, exist_ok)) {
         throw std::system_error(errno, std::system_category(), "Write " + path);
       }
       fd = kj::AutoCloseFd();
+      util::File::MarkWritten();
       return;
     }
     *pos = 0;
@@ -214,6 +384,122 @@ util::File::ChunkReceiver OsWrite(const std::string& path, bool overwrite,
   };
 }
 
+// Ways of copying a file, from the cheapest to the most expensive one.
+enum class CopyMethod { LINK, CLONE, COPY_RANGE, SENDFILE, STREAM };
+
+// The cheapest method that works between the filesystems of a source and of
+// a destination directory, learned on the first copy between them.
+std::mutex copy_methods_mutex;
+std::map<std::pair<dev_t, dev_t>, CopyMethod> copy_methods;
+
+bool IsUnsupported(int err) {
+  return err == EXDEV || err == EOPNOTSUPP || err == ENOTTY ||
+         err == EINVAL || err == ENOSYS || err == EBADF;
+}
+
+// Copies the contents of in to out in the kernel, starting from *method and
+// moving to the next method when one is not supported. Returns errno, or 0
+// on success.
+int OsCopyData(int in, int out, size_t size, CopyMethod* method) {
+#ifdef __linux__
+#ifdef FICLONE
+  if (*method == CopyMethod::CLONE) {
+    if (ioctl(out, FICLONE, in) == 0) return 0;
+    if (!IsUnsupported(errno)) return errno;
+  }
+#endif
+  if (*method == CopyMethod::CLONE) *method = CopyMethod::COPY_RANGE;
+#ifdef __NR_copy_file_range
+  if (*method == CopyMethod::COPY_RANGE) {
+    size_t copied = 0;
+    while (copied < size) {
+      ssize_t n = syscall(__NR_copy_file_range, in, nullptr, out, nullptr,
+                          size - copied, 0);
+      if (n == -1 && errno == EINTR) continue;
+      if (n == -1 && !(copied == 0 && IsUnsupported(errno))) return errno;
+      if (n <= 0) break;
+      copied += n;
+    }
+    if (copied == size) return 0;
+    if (copied != 0) return EIO;
+    *method = CopyMethod::SENDFILE;
+  }
+#endif
+  if (*method <= CopyMethod::SENDFILE) {
+    *method = CopyMethod::SENDFILE;
+    size_t copied = 0;
+    while (copied < size) {
+      ssize_t n = sendfile(out, in, nullptr, size - copied);
+      if (n == -1 && errno == EINTR) continue;
+      if (n == -1 && !(copied == 0 && IsUnsupported(errno))) return errno;
+      if (n <= 0) break;
+      copied += n;
+    }
+    if (copied == size) return 0;
+    if (copied != 0) return EIO;
+  }
+#endif
+  *method = CopyMethod::STREAM;
+  return EOPNOTSUPP;
+}
+
+// Copies src to dst with the cheapest method available between the two
+// filesystems, without going through user space, and without hard links if
+// link is false. Returns errno, or 0 on success; on failure the caller should
+// fall back to streaming the file.
+int OsFastCopy(const std::string& src, const std::string& dst,
+               bool overwrite, bool exist_ok, bool link = true) {
+  struct stat src_st {};
+  struct stat dst_st {};
+  if (stat(src.c_str(), &src_st) == -1) return errno;
+  if (stat(util::File::BaseDir(dst).c_str(), &dst_st) == -1) return errno;
+  auto devices = std::make_pair(src_st.st_dev, dst_st.st_dev);
+  CopyMethod method = CopyMethod::LINK;
+  {
+    std::lock_guard<std::mutex> lck(copy_methods_mutex);
+    auto it = copy_methods.find(devices);
+    if (it != copy_methods.end()) method = it->second;
+  }
+  // A copy without links does not tell if the two filesystems can be linked.
+  bool can_learn = link || method != CopyMethod::LINK;
+  auto learn = [&devices, can_learn](CopyMethod method) {
+    if (!can_learn) return;
+    std::lock_guard<std::mutex> lck(copy_methods_mutex);
+    copy_methods[devices] = method;
+  };
+  if (!link && method == CopyMethod::LINK) method = CopyMethod::CLONE;
+  if (method == CopyMethod::LINK) {
+    int err = OsAtomicCopy(src, dst, overwrite, exist_ok);
+    if (err != EXDEV) {
+      if (err == 0) learn(method);
+      return err;
+    }
+    method = CopyMethod::CLONE;
+  }
+  if (method == CopyMethod::STREAM) return EOPNOTSUPP;
+  if (!overwrite && util::File::Size(dst) >= 0) return exist_ok ? 0 : EEXIST;
+
+  kj::AutoCloseFd in{open(src.c_str(), O_CLOEXEC | O_RDONLY)};  // NOLINT
+  if (in.get() == -1) return errno;
+  std::string temp_file;
+  auto out = OsTempFile(dst, &temp_file);
+  if (out.get() == -1) return errno;
+  int err = OsCopyData(in, out, src_st.st_size, &method);
+  learn(method);
+  Durability durability = DurabilityLevel();
+  if (err == 0 && durability == Durability::FILE && fsync(out) == -1) {
+    err = errno;
+  }
+  util::File::PrepareUnsyncedWrite();
+  if (err == 0) err = OsAtomicMove(temp_file, dst, overwrite, exist_ok);
+  if (err != 0) {
+    OsRemove(temp_file);
+    return err;
+  }
+  util::File::MarkWritten();
+  return 0;
+}
+
 }  // namespace
 #endif
 
@@ -223,9 +509,104 @@ std::vector<std::string> File::ListFiles(const std::string& path) {
   return OsListFiles(path);
 }
 
+uint64_t File::WriteEpoch() { return written_epoch.load(); }
+
+uint64_t File::DurableEpoch() { return durable_epoch.load(); }
+
+void File::Sync() {
+  if (DurabilityLevel() == Durability::BATCH) SyncStore();
+}
+
+bool File::ValidDurability(const std::string& durability) {
+  return durability == "file" || durability == "batch" ||
+         durability == "none";
+}
+
+void File::PrepareUnsyncedWrite() {
+  if (DurabilityLevel() == Durability::FILE) return;
+  static std::once_flag created;
+  std::call_once(created, []() {
+    MakeDirs(Flags::store_directory);
+    std::string marker = UnsyncedMarkerPath();
+    kj::AutoCloseFd fd{open(marker.c_str(),  // NOLINT
+                            O_CREAT | O_WRONLY | O_CLOEXEC, S_IRUSR | S_IWUSR)};
+    if (fd.get() == -1 || fsync(fd) == -1) {
+      throw std::system_error(errno, std::system_category(), "open " + marker);
+    }
+    OsSyncStore();
+    // After a clean exit the store can be trusted again.
+    std::atexit([]() {
+      OsSyncStore();
+      OsRemove(UnsyncedMarkerPath());
+    });
+  });
+}
+
+void File::MarkWritten() {
+  if (DurabilityLevel() == Durability::BATCH) MarkWrittenBatch();
+}
+
+size_t File::RecoverStore() {
+  struct stat marker {};
+  if (stat(UnsyncedMarkerPath().c_str(), &marker) == -1) return 0;
+  KJ_LOG(WARNING, "The store was not closed cleanly, checking its files");
+  size_t removed = 0;
+  for (const auto& path : ListFiles(Flags::store_directory)) {
+    // Only the files written after the marker may not have been flushed.
+    struct stat st {};
+    if (stat(path.c_str(), &st) == -1 || st.st_mtime < marker.st_mtime) {
+      continue;
+    }
+    std::string name = BaseName(path);
+    bool executable = name.size() > 2 && name.substr(name.size() - 2) == ".x";
+    if (executable) name = name.substr(0, name.size() - 2);
+    try {
+      SHA256_t hash(name);
+      // Executable copies are made again when needed.
+      if (!executable) {
+        if (PathForHash(hash) != path || Hash(path) == hash) continue;
+      } else if (JoinPath(Flags::store_directory,
+                          RelativeExecutablePathForHash(hash)) != path) {
+        continue;
+      }
+    } catch (std::invalid_argument& e) {
+      continue;
+    }
+    KJ_LOG(WARNING, "Removing unflushed file", path);
+    OsRemove(path);
+    removed += !executable;
+  }
+  for (const auto& file : PackStore::Get().List()) {
+    std::vector<uint8_t> data;
+    if (!PackStore::Get().Read(file.first, &data)) continue;
+    SHA256 hasher;
+    hasher.update(data.data(), data.size());
+    if (hasher.finalize() == file.first) continue;
+    KJ_LOG(WARNING, "Removing unflushed packed file", file.first.Hex());
+    PackStore::Get().Remove(file.first);
+    removed++;
+  }
+  OsSyncStore();
+  OsRemove(UnsyncedMarkerPath());
+  return removed;
+}
+
 File::ChunkProducer File::Read(const std::string& path, uint64_t limit) {
   return OsRead(path, limit);
 }
+File::ChunkProducer File::Map(const std::string& path, uint64_t limit,
+                              uint64_t offset) {
+  auto file = std::make_unique<MappedFile>(path);
+  size_t pos = std::min<uint64_t>(file->Data().size(), offset);
+  size_t size = pos + std::min<uint64_t>(file->Data().size() - pos, limit);
+  return [file = std::move(file), size, pos]() mutable {
+    size_t amount = std::min<size_t>(size - pos, kChunkSize);
+    Chunk chunk(file->Data().begin() + pos, amount);
+    pos += amount;
+    return chunk;
+  };
+}
+
 File::ChunkReceiver File::Write(const std::string& path, bool overwrite,
                                 bool exist_ok) {
   MakeDirs(BaseDir(path));
@@ -237,10 +618,12 @@ File::ChunkReceiver File::Write(const std::string& path, bool overwrite,
   return OsWrite(path, overwrite, exist_ok);
 }
 
-SHA256_t File::Hash(const std::string& path) {
+namespace {
+// Hashes the chunks of producer, also passing them to sink if it is not null.
+SHA256_t HashChunks(File::ChunkProducer producer, size_t inline_threshold,
+                    File::ChunkReceiver* sink) {
   SHA256 hasher;
-  auto producer = Read(path);
-  Chunk chunk;
+  File::Chunk chunk;
   thread_local std::vector<uint8_t> last_chunk;
   last_chunk.clear();
   size_t num_chunks = 0;
@@ -248,15 +631,113 @@ SHA256_t File::Hash(const std::string& path) {
     hasher.update(chunk.begin(), chunk.size());
     num_chunks++;
     last_chunk.assign(chunk.begin(), chunk.begin() + chunk.size());
+    if (sink) (*sink)(chunk);
   }
+  if (sink) (*sink)(chunk);
   SHA256_t hash = hasher.finalize();
-  if ((num_chunks == 1 && last_chunk.size() < kInlineChunkThresh) ||
+  if ((num_chunks == 1 && last_chunk.size() < inline_threshold) ||
       num_chunks == 0) {
     hash.setContents(last_chunk);
   }
   return hash;
 }
 
+size_t PackThreshold() {
+  return static_cast<size_t>(Flags::pack_threshold) * 1024;
+}
+
+// Copies the file at path to a new staging file of the store while hashing
+// it. The staging file is removed if the copy fails.
+SHA256_t HashToStaging(const std::string& path, size_t inline_threshold,
+                       std::string* staging) {
+  if (OsTempFile(File::JoinPath(Flags::store_directory, "ingest"), staging)
+          .get() == -1) {
+    throw std::system_error(errno, std::system_category(), "Ingest " + path);
+  }
+  try {
+    auto receiver = File::Write(*staging, /*overwrite=*/true);
+    return HashChunks(File::Read(path), inline_threshold, &receiver);
+  } catch (...) {
+    OsRemove(*staging);
+    throw;
+  }
+}
+}  // namespace
+
+SHA256_t File::Hash(const std::string& path, size_t inline_threshold) {
+  return HashChunks(Read(path), inline_threshold, nullptr);
+}
+
+SHA256_t File::Ingest(const std::string& path, size_t inline_threshold) {
+  MakeDirs(Flags::store_directory);
+  int64_t size = Size(path);
+  if (size >= 0 && static_cast<size_t>(size) < PackThreshold()) {
+    std::vector<uint8_t> data;
+    ChunkReceiver sink = [&data](Chunk chunk) {
+      data.insert(data.end(), chunk.begin(), chunk.end());
+    };
+    SHA256_t hash = HashChunks(Read(path), inline_threshold, &sink);
+    StoreContents(hash, {data.data(), data.size()});
+    return hash;
+  }
+  if (!OsIsLink(path) && OsSameDevice(path, Flags::store_directory)) {
+    SHA256_t hash = Hash(path, inline_threshold);
+    Reclaimer::Get().Cancel(hash);
+    Copy(path, PathForHash(hash));
+    return hash;
+  }
+  // The file cannot be linked in the store: copy it to a staging file of the
+  // store while hashing it, and then move the copy in place.
+  std::string staging;
+  SHA256_t hash = HashToStaging(path, inline_threshold, &staging);
+  Reclaimer::Get().Cancel(hash);
+  MakeDirs(BaseDir(PathForHash(hash)));
+  Move(staging, PathForHash(hash));
+  return hash;
+}
+
+bool File::IngestChecked(const std::string& path, const SHA256_t& hash) {
+  MakeDirs(Flags::store_directory);
+  int64_t size = Size(path);
+  if (size >= 0 && static_cast<size_t>(size) < PackThreshold()) {
+    std::vector<uint8_t> data;
+    ChunkReceiver sink = [&data](Chunk chunk) {
+      data.insert(data.end(), chunk.begin(), chunk.end());
+    };
+    if (!(HashChunks(Read(path), kInlineChunkThresh, &sink) == hash)) {
+      return false;
+    }
+    StoreContents(hash, {data.data(), data.size()});
+    return true;
+  }
+  // The file is always copied: a link would let later changes of the file
+  // change the store too.
+  std::string staging;
+  if (!(HashToStaging(path, kInlineChunkThresh, &staging) == hash)) {
+    OsRemove(staging);
+    return false;
+  }
+  Reclaimer::Get().Cancel(hash);
+  MakeDirs(BaseDir(PathForHash(hash)));
+  Move(staging, PathForHash(hash));
+  return true;
+}
+
+SHA256_t File::IngestContents(kj::ArrayPtr<const uint8_t> data,
+                              size_t inline_threshold) {
+  MakeDirs(Flags::store_directory);
+  size_t pos = 0;
+  ChunkProducer producer = [data, pos]() mutable {
+    size_t amount = std::min<size_t>(data.size() - pos, kChunkSize);
+    Chunk chunk(data.begin() + pos, amount);
+    pos += amount;
+    return chunk;
+  };
+  SHA256_t hash = HashChunks(std::move(producer), inline_threshold, nullptr);
+  StoreContents(hash, data);
+  return hash;
+}
+
 void File::MakeDirs(const std::string& path) {
   uint64_t pos = 0;
   while (pos != std::string::npos) {
@@ -282,7 +763,16 @@ void File::HardCopy(const std::string& from, const std::string& to,
 void File::Copy(const std::string& from, const std::string& to, bool overwrite,
                 bool exist_ok) {
   MakeDirs(BaseDir(to));
-  if (OsIsLink(from) || OsAtomicCopy(from, to, overwrite, exist_ok)) {
+  if (OsIsLink(from) || OsFastCopy(from, to, overwrite, exist_ok)) {
+    HardCopy(from, to, overwrite, exist_ok, false);
+  }
+}
+
+void File::Clone(const std::string& from, const std::string& to, bool overwrite,
+                 bool exist_ok) {
+  MakeDirs(BaseDir(to));
+  if (OsIsLink(from) ||
+      OsFastCopy(from, to, overwrite, exist_ok, /*link=*/false)) {
     HardCopy(from, to, overwrite, exist_ok, false);
   }
 }
@@ -320,10 +810,95 @@ void File::MakeImmutable(const std::string& path) {
 }
 
 std::string File::PathForHash(const SHA256_t& hash) {
+  return JoinPath(Flags::store_directory, RelativePathForHash(hash));
+}
+
+int64_t File::StoreSize(const SHA256_t& hash) {
+  int64_t size = Size(PathForHash(hash));
+  if (size >= 0) return size;
+  return PackStore::Get().Size(hash);
+}
+
+File::ChunkProducer File::ReadFromStore(const SHA256_t& hash, uint64_t limit,
+                                        uint64_t offset) {
+  std::string path = PathForHash(hash);
+  auto data = std::make_unique<std::vector<uint8_t>>();
+  // If the file is in neither place, Map throws the usual error.
+  if (Exists(path) || !PackStore::Get().Read(hash, data.get())) {
+    return Map(path, limit, offset);
+  }
+  data->erase(data->begin(),
+              data->begin() + std::min<uint64_t>(data->size(), offset));
+  if (data->size() > limit) data->resize(limit);
+  bool sent = false;
+  return [data = std::move(data), sent]() mutable {
+    if (sent) return Chunk();
+    sent = true;
+    return Chunk(data->data(), data->size());
+  };
+}
+
+void File::CopyFromStore(const SHA256_t& hash, const std::string& path) {
+  std::string stored = PathForHash(hash);
+  std::vector<uint8_t> data;
+  if (Exists(stored) || !PackStore::Get().Read(hash, &data)) {
+    Copy(stored, path);
+    return;
+  }
+  auto receiver = Write(path);
+  if (!data.empty()) receiver({data.data(), data.size()});
+  receiver({});
+}
+
+void File::CopyExecutableFromStore(const SHA256_t& hash,
+                                   const std::string& path) {
+  Copy(StageExecutable(hash), path);
+  // Only needed if the copy is not a link, or if another thread created the
+  // executable copy and did not change its mode yet.
+  MakeExecutable(path);
+}
+
+std::string File::StageExecutable(const SHA256_t& hash) {
+  std::string staged =
+      JoinPath(Flags::store_directory, RelativeExecutablePathForHash(hash));
+  if (Size(staged) < 0) {
+    std::string stored = PathForHash(hash);
+    std::vector<uint8_t> data;
+    if (Exists(stored) || !PackStore::Get().Read(hash, &data)) {
+      // A link would share the mode with the stored file, that is also copied
+      // as a non executable input.
+      Clone(stored, staged, /*overwrite=*/true);
+    } else {
+      auto receiver = Write(staged, /*overwrite=*/true);
+      if (!data.empty()) receiver({data.data(), data.size()});
+      receiver({});
+    }
+    MakeExecutable(staged);
+  }
+  return staged;
+}
+
+void File::StoreContents(const SHA256_t& hash,
+                         kj::ArrayPtr<const uint8_t> data) {
+  // A pending deletion would remove the file right after it is written.
+  Reclaimer::Get().Cancel(hash);
+  if (data.size() < PackThreshold()) {
+    PackStore::Get().Add(hash, data);
+    return;
+  }
+  auto receiver = Write(PathForHash(hash), /*overwrite=*/true);
+  if (data.size() != 0) receiver(data);
+  receiver({});
+}
+
+std::string File::RelativePathForHash(const SHA256_t& hash) {
   std::string path = hash.Hex();
-  return JoinPath(
-      Flags::store_directory,
-      JoinPath(JoinPath(path.substr(0, 2), path.substr(2, 2)), path));
+  return JoinPath(JoinPath(path.substr(0, 2), path.substr(2, 2)), path);
+}
+
+std::string File::RelativeExecutablePathForHash(const SHA256_t& hash) {
+  // The suffix makes the scans of the store skip it.
+  return RelativePathForHash(hash) + ".x";
 }
 
 std::string File::JoinPath(const std::string& first,
@@ -357,6 +932,223 @@ File::ChunkReceiver File::LazyChunkReceiver(kj::Function<ChunkReceiver()> f) {
   };
 }
 
+namespace {
+struct InFlightFetch {
+  // Shared by all the files fetched with the same call.
+  std::shared_ptr<kj::ForkedPromise<void>> promise;
+  uint64_t id;
+};
+
+using InFlightMap =
+    std::unordered_map<util::SHA256_t, InFlightFetch, util::SHA256_t::Hasher>;
+
+InFlightMap& InFlight() {
+  static InFlightMap* in_flight = new InFlightMap();
+  return *in_flight;
+}
+
+// Forgets about a completed fetch. The entries are removed later, as this is
+// called while the forked promise that they own is being resolved.
+void ForgetFetch(std::vector<util::SHA256_t> hashes, uint64_t id) {
+  kj::evalLater([hashes = std::move(hashes), id]() {
+    for (const util::SHA256_t& hash : hashes) {
+      auto it = InFlight().find(hash);
+      if (it != InFlight().end() && it->second.id == id) InFlight().erase(it);
+    }
+  }).detach([](kj::Exception exc) {
+    KJ_LOG(WARNING, "Cannot forget fetch", exc.getDescription());
+  });
+}
+
+// Makes the fetch of the given files available to the other requests for
+// them, until it completes.
+kj::Promise<void> ShareFetch(const std::vector<util::SHA256_t>& hashes,
+                             kj::Promise<void> fetch) {
+  static uint64_t next_id = 0;
+  uint64_t id = next_id++;
+  auto forked = std::make_shared<kj::ForkedPromise<void>>(
+      fetch
+          .then([hashes, id]() { ForgetFetch(hashes, id); },
+                [hashes, id](kj::Exception exc) {
+                  ForgetFetch(hashes, id);
+                  kj::throwRecoverableException(std::move(exc));
+                })
+          .fork());
+  for (const util::SHA256_t& hash : hashes) {
+    InFlight()[hash] = InFlightFetch{forked, id};
+  }
+  return forked->addBranch();
+}
+}  // namespace
+
+kj::Promise<void> File::Get(const util::SHA256_t& hash,
+                            capnproto::FileSender::Client worker) {
+  if (hash.hasContents()) {
+    StoreContents(hash, hash.getContents());
+    return kj::READY_NOW;
+  }
+  auto it = InFlight().find(hash);
+  if (it != InFlight().end()) return it->second.promise->addBranch();
+  auto req = worker.requestFileRequest();
+  hash.ToCapnp(req.initHash());
+  req.setPeer(peer_id);
+  req.setReceiver(kj::heap<util::File::Receiver>(hash));
+  return ShareFetch({hash}, req.send().ignoreResult());
+}
+
+File::ChunkReceiver File::WriteToStore(const util::SHA256_t& hash) {
+  Reclaimer::Get().Cancel(hash);
+  // Files that may go to the packs are kept in memory until their end.
+  return [hash, hasher = SHA256(), buffer = std::vector<uint8_t>(),
+          receiver = std::unique_ptr<ChunkReceiver>()](Chunk chunk) mutable {
+    if (chunk.size() != 0) {
+      hasher.update(chunk.begin(), chunk.size());
+      if (!receiver && buffer.size() + chunk.size() < PackThreshold()) {
+        buffer.insert(buffer.end(), chunk.begin(), chunk.end());
+        return;
+      }
+      if (!receiver) {
+        receiver = std::make_unique<ChunkReceiver>(
+            Write(PathForHash(hash), /*overwrite=*/true));
+        if (!buffer.empty()) (*receiver)({buffer.data(), buffer.size()});
+        buffer = std::vector<uint8_t>();
+      }
+      (*receiver)(chunk);
+      return;
+    }
+    if (!(hasher.finalize() == hash)) {
+      // The temporary file is removed when the receiver is destroyed.
+      throw std::runtime_error("Received file does not match hash " +
+                               hash.Hex());
+    }
+    if (receiver) {
+      (*receiver)(chunk);
+    } else {
+      StoreContents(hash, {buffer.data(), buffer.size()});
+    }
+  };
+}
+
+File::ChunkReceiver File::WriteAll(std::vector<util::SHA256_t> hashes,
+                                   std::function<void(size_t)> done) {
+  std::unique_ptr<File::ChunkReceiver> rec(nullptr);
+  size_t next = 0;
+  return [hashes = std::move(hashes), rec = std::move(rec), next,
+          done = std::move(done)](Chunk chunk) mutable {
+    KJ_REQUIRE(next < hashes.size(), "Received more files than requested");
+    if (!rec) {
+      rec = std::make_unique<File::ChunkReceiver>(WriteToStore(hashes[next]));
+    }
+    (*rec)(chunk);
+    if (chunk.size() == 0) {
+      rec = nullptr;
+      if (done) done(next);
+      next++;
+    }
+  };
+}
+
+kj::Promise<void> File::MaybeGetAll(const std::vector<util::SHA256_t>& hashes,
+                                    capnproto::FileSender::Client sender) {
+  std::vector<util::SHA256_t> missing;
+  std::unordered_set<util::SHA256_t, util::SHA256_t::Hasher> seen;
+  kj::Vector<kj::Promise<void>> fetches;
+  for (const util::SHA256_t& hash : hashes) {
+    if (hash.isZero() || !seen.insert(hash).second) continue;
+    // The file may be in the store only because its deletion is pending.
+    Reclaimer::Get().Cancel(hash);
+    if (InStore(hash)) continue;
+    if (hash.hasContents()) {
+      StoreContents(hash, hash.getContents());
+      continue;
+    }
+    auto in_flight = InFlight().find(hash);
+    if (in_flight != InFlight().end()) {
+      fetches.add(in_flight->second.promise->addBranch());
+      continue;
+    }
+    missing.push_back(hash);
+  }
+  if (!missing.empty()) {
+    auto req = sender.requestFilesRequest();
+    req.setPeer(peer_id);
+    auto list = req.initHashes(missing.size());
+    for (size_t i = 0; i < missing.size(); i++) missing[i].ToCapnp(list[i]);
+    req.setReceiver(kj::heap<util::File::Receiver>(WriteAll(missing)));
+    fetches.add(ShareFetch(missing, req.send().ignoreResult()));
+  }
+  return kj::joinPromises(fetches.releaseAsArray());
+}
+
+kj::Array<kj::Promise<void>> File::MaybeGetEach(
+    const std::vector<util::SHA256_t>& hashes,
+    capnproto::FileSender::Client sender) {
+  using Forked = std::shared_ptr<kj::ForkedPromise<void>>;
+  std::unordered_map<util::SHA256_t, Forked, util::SHA256_t::Hasher> fetches;
+  std::vector<util::SHA256_t> missing;
+  for (const util::SHA256_t& hash : hashes) {
+    if (hash.isZero() || fetches.count(hash)) continue;
+    Reclaimer::Get().Cancel(hash);
+    if (InStore(hash)) continue;
+    if (hash.hasContents()) {
+      StoreContents(hash, hash.getContents());
+      continue;
+    }
+    auto in_flight = InFlight().find(hash);
+    if (in_flight != InFlight().end()) {
+      fetches.emplace(hash, in_flight->second.promise);
+      continue;
+    }
+    missing.push_back(hash);
+  }
+  if (!missing.empty()) {
+    // Each file resolves when its last chunk is stored, and all the ones not
+    // stored yet fail with the call.
+    auto fulfillers =
+        std::make_shared<std::vector<kj::Own<kj::PromiseFulfiller<void>>>>();
+    for (const util::SHA256_t& hash : missing) {
+      auto paf = kj::newPromiseAndFulfiller<void>();
+      fulfillers->push_back(std::move(paf.fulfiller));
+      fetches.emplace(hash,
+                      std::make_shared<kj::ForkedPromise<void>>(
+                          paf.promise.fork()));
+    }
+    auto req = sender.requestFilesRequest();
+    req.setPeer(peer_id);
+    auto list = req.initHashes(missing.size());
+    for (size_t i = 0; i < missing.size(); i++) missing[i].ToCapnp(list[i]);
+    req.setReceiver(kj::heap<util::File::Receiver>(
+        WriteAll(missing, [fulfillers](size_t i) {
+          (*fulfillers)[i]->fulfill();
+        })));
+    auto reject = [fulfillers](kj::Exception exc) {
+      for (auto& fulfiller : *fulfillers) {
+        if (fulfiller->isWaiting()) fulfiller->reject(kj::cp(exc));
+      }
+    };
+    ShareFetch(missing, req.send().ignoreResult())
+        .then(
+            [reject]() {
+              reject(KJ_EXCEPTION(FAILED, "Received fewer files than "
+                                          "requested"));
+            },
+            reject)
+        .detach([](kj::Exception exc) {
+          KJ_LOG(WARNING, "Fetch failed", exc.getDescription());
+        });
+  }
+  kj::Vector<kj::Promise<void>> promises(hashes.size());
+  for (const util::SHA256_t& hash : hashes) {
+    auto it = fetches.find(hash);
+    if (it == fetches.end()) {
+      promises.add(kj::READY_NOW);
+    } else {
+      promises.add(it->second->addBranch());
+    }
+  }
+  return promises.releaseAsArray();
+}
+
 TempDir::TempDir(const std::string& base) {
   File::MakeDirs(base);
   path_ = OsTempDir(base);
@@ -365,82 +1157,409 @@ TempDir::TempDir(const std::string& base) {
   }
 }
 void TempDir::Keep() { keep_ = true; }
+void TempDir::RemoveInBackground() { background_ = true; }
 const std::string& TempDir::Path() const { return path_; }
 TempDir::~TempDir() {  // NOLINT
-  if (!keep_ && !moved_) {
+  if (!keep_ && !moved_ && background_) {
+    RemoveTreeInBackground(path_);
+  } else if (!keep_ && !moved_) {
     kj::UnwindDetector detector;
     detector.catchExceptionsIfUnwinding([&]() { File::RemoveTree(path_); });
   }
 }
 
+struct TempDirPool::State {
+  std::mutex mutex;
+  std::condition_variable refilled;
+  std::vector<TempDir> ready;
+  bool refilling = false;
+  bool stopped = false;
+};
+
+TempDirPool::TempDirPool(std::string base, std::string subdir, size_t size)
+    : base_(std::move(base)),
+      subdir_(std::move(subdir)),
+      size_(size),
+      state_(std::make_shared<State>()) {
+  std::lock_guard<std::mutex> lck(state_->mutex);
+  Refill();
+}
+
+TempDirPool::~TempDirPool() {
+  std::vector<TempDir> ready;
+  {
+    std::unique_lock<std::mutex> lck(state_->mutex);
+    state_->stopped = true;
+    state_->refilled.wait(lck, [this]() { return !state_->refilling; });
+    ready.swap(state_->ready);
+  }
+  // The background thread may not get to them before the process exits.
+  for (auto& dir : ready) {
+    kj::UnwindDetector detector;
+    detector.catchExceptionsIfUnwinding(
+        [&]() { File::RemoveTree(dir.Path()); });
+    dir.Keep();
+  }
+}
+
+TempDir TempDirPool::Create(const std::string& base,
+                            const std::string& subdir) {
+  TempDir dir(base);
+  if (!subdir.empty()) MakeDirs(File::JoinPath(dir.Path(), subdir));
+  dir.RemoveInBackground();
+  return dir;
+}
+
+TempDir TempDirPool::Get() {
+  std::unique_lock<std::mutex> lck(state_->mutex);
+  Refill();
+  if (state_->ready.empty()) {
+    lck.unlock();
+    return Create(base_, subdir_);
+  }
+  TempDir dir = std::move(state_->ready.back());
+  state_->ready.pop_back();
+  return dir;
+}
+
+void TempDirPool::Refill() {
+  if (state_->refilling || state_->stopped) return;
+  state_->refilling = true;
+  RunInBackground(RefillJob());
+}
+
+std::function<void()> TempDirPool::RefillJob() {
+  // The job keeps the state alive, in case the pool is destroyed first.
+  return [state = state_, base = base_, subdir = subdir_, size = size_]() {
+    auto done = kj::defer([&state]() {
+      std::lock_guard<std::mutex> lck(state->mutex);
+      state->refilling = false;
+      state->refilled.notify_all();
+    });
+    while (true) {
+      {
+        std::lock_guard<std::mutex> lck(state->mutex);
+        if (state->ready.size() >= size || state->stopped) return;
+      }
+      TempDir dir = Create(base, subdir);
+      std::lock_guard<std::mutex> lck(state->mutex);
+      state->ready.push_back(std::move(dir));
+    }
+  };
+}
+
+MappedFile::MappedFile(const std::string& path) {
+  OsMapFile(path, &data_, &size_);
+}
+MappedFile::~MappedFile() { OsUnmapFile(data_, size_); }
+
 kj::Promise<void> File::Receiver::sendChunk(SendChunkContext context) {
-  receiver_(context.getParams().getChunk());
+  auto params = context.getParams();
+  if (params.getCodec() == capnproto::Codec::LZ4) {
+    Chunk chunk = params.getChunk();
+    Lz4Decompress(chunk.begin(), chunk.size(), params.getSize(), &buffer_);
+    receiver_(Chunk(buffer_.data(), buffer_.size()));
+  } else {
+    receiver_(params.getChunk());
+  }
+  context.getResults().setCodec(HasLz4() ? capnproto::Codec::LZ4
+                                         : capnproto::Codec::NONE);
   return kj::READY_NOW;
 }
 
 namespace {
-struct HandleRequestFileData {
-  File::ChunkProducer producer;
-  capnproto::FileReceiver::Client receiver;
-  static size_t num_concurrent;
-  static const constexpr size_t max_concurrent = 128;
-  static std::queue<kj::Own<kj::PromiseFulfiller<void>>> waiting;
-};
+util::Counter* SentBytes() {
+  static util::Counter* sent_bytes = util::Metrics::GetCounter(
+      "file_sent_bytes_total", "Bytes of files sent to other processes");
+  return sent_bytes;
+}
+
+IoPool* send_pool = nullptr;
+uint64_t peer_id = 0;
 
-size_t HandleRequestFileData::num_concurrent = 0;
-std::queue<kj::Own<kj::PromiseFulfiller<void>>> HandleRequestFileData::waiting;
-
-kj::Promise<void> next_chunk(HandleRequestFileData data) {
-  File::Chunk chunk = data.producer();
-  auto req = data.receiver.sendChunkRequest();
-  req.setChunk(chunk);
-  return req.send().ignoreResult().then(
-      [sz = chunk.size(),
-       data = std::move(data)]() mutable -> kj::Promise<void> {
-        if (sz) return next_chunk(std::move(data));
-        if (!HandleRequestFileData::waiting.empty()) {
-          HandleRequestFileData::waiting.front()->fulfill();
-          HandleRequestFileData::waiting.pop();
+// Sends the chunks of a file keeping a window of them in flight, instead of
+// waiting a round-trip for each one. Calls on the same capability are
+// delivered in order, so the receiver still gets the chunks in order.
+// The window grows by one chunk per acknowledged chunk, like TCP slow start,
+// and shrinks again when the round-trip time grows, which means that the
+// chunks are queueing somewhere on the way.
+// Once the receiver says it can decode lz4, the chunks are compressed, until
+// one of them turns out not to be compressible enough: that is usually the
+// case for the whole file, like for binaries or archives.
+// Bulk streams pause between chunks when the bulk bandwidth is exhausted.
+// With a pool, the next chunks are read and compressed on its threads while
+// the previous ones are sent.
+class ChunkStream : public std::enable_shared_from_this<ChunkStream> {
+ public:
+  // The producer ends num_files files, each of them with an empty chunk.
+  ChunkStream(File::ChunkProducer producer,
+              capnproto::FileReceiver::Client receiver, size_t num_files,
+              TransferPriority priority, IoPool* pool)
+      : receiver_(std::move(receiver)),
+        num_files_(num_files),
+        priority_(priority),
+        pool_(pool),
+        producer_(std::make_shared<File::ChunkProducer>(std::move(producer))) {}
+
+  kj::Promise<void> Run() {
+    auto pf = kj::newPromiseAndFulfiller<void>();
+    done_ = std::move(pf.fulfiller);
+    Fill();
+    return std::move(pf.promise);
+  }
+
+ private:
+  using Clock = std::chrono::steady_clock;
+  static const constexpr size_t kMinWindow = 2;
+  static const constexpr size_t kMaxWindow = 32;
+  static const constexpr size_t kMinCompressedChunk = 4096;
+  // Chunks read ahead of the ones being sent.
+  static const constexpr size_t kReadAhead = 2;
+
+  enum class Compression { NONE, COMPRESSED, INCOMPRESSIBLE };
+
+  // A chunk read by the pool, compressed if compression says so.
+  struct Prepared {
+    std::vector<kj::byte> data;
+    size_t size = 0;
+    Compression compression = Compression::NONE;
+  };
+
+  // Compresses chunk into out if codec is lz4 and the chunk is big enough.
+  static Compression Compress(File::Chunk chunk, capnproto::Codec codec,
+                              std::vector<kj::byte>* out) {
+    if (codec != capnproto::Codec::LZ4 || chunk.size() < kMinCompressedChunk) {
+      return Compression::NONE;
+    }
+    if (Lz4Compress(chunk.begin(), chunk.size(), out)) {
+      return Compression::COMPRESSED;
+    }
+    return Compression::INCOMPRESSIBLE;
+  }
+
+  void Fill() {
+    while (!finished_ && !paused_ && in_flight_ < window_) {
+      if (pool_ == nullptr) {
+        File::Chunk chunk = (*producer_)();
+        Compression compression = Compress(chunk, codec_, &compressed_);
+        if (compression == Compression::COMPRESSED) {
+          Send(File::Chunk(compressed_.data(), compressed_.size()),
+               chunk.size(), compression);
+        } else {
+          Send(chunk, chunk.size(), compression);
         }
-        HandleRequestFileData::num_concurrent--;
-        return kj::READY_NOW;
+        continue;
+      }
+      if (ready_.empty()) break;
+      // The chunk is copied into the request, so it can go right away.
+      Prepared next = std::move(ready_.front());
+      ready_.pop_front();
+      Send(File::Chunk(next.data.data(), next.data.size()), next.size,
+           next.compression);
+    }
+    if (pool_ != nullptr) ReadNext();
+    if (finished_ && in_flight_ == 0) done_->fulfill();
+  }
+
+  void Send(File::Chunk data, size_t size, Compression compression) {
+    if (size == 0) finished_ = ++files_done_ == num_files_;
+    SentBytes()->Add(size);
+    auto req = receiver_.sendChunkRequest();
+    req.setChunk(data);
+    if (compression == Compression::COMPRESSED) {
+      req.setCodec(capnproto::Codec::LZ4);
+      req.setSize(size);
+    } else if (compression == Compression::INCOMPRESSIBLE) {
+      incompressible_ = true;
+      codec_ = capnproto::Codec::NONE;
+    }
+    in_flight_++;
+    req.send()
+        .then([self = shared_from_this(), sent = Clock::now()](auto res) {
+          self->Ack(Clock::now() - sent, res.getCodec());
+        })
+        .detach([self = shared_from_this()](kj::Exception exc) {
+          if (self->done_->isWaiting()) self->done_->reject(std::move(exc));
+        });
+    if (priority_ == TransferPriority::BULK) MaybePause(size);
+  }
+
+  // Reads the next chunk on the pool, if it is needed. The job only shares
+  // the producer and its result with the stream.
+  void ReadNext() {
+    if (reading_ || files_read_ == num_files_ || ready_.size() >= kReadAhead) {
+      return;
+    }
+    reading_ = true;
+    auto next = std::make_shared<Prepared>();
+    pool_
+        ->Run([producer = producer_, next, codec = codec_]() {
+          File::Chunk chunk = (*producer)();
+          next->size = chunk.size();
+          next->compression = Compress(chunk, codec, &next->data);
+          if (next->compression != Compression::COMPRESSED) {
+            next->data.assign(chunk.begin(), chunk.end());
+          }
+        })
+        .then([self = shared_from_this(), next]() {
+          self->reading_ = false;
+          if (next->size == 0) self->files_read_++;
+          self->ready_.push_back(std::move(*next));
+          if (self->done_->isWaiting()) self->Fill();
+        })
+        .detach([self = shared_from_this()](kj::Exception exc) {
+          if (self->done_->isWaiting()) self->done_->reject(std::move(exc));
+        });
+  }
+
+  void MaybePause(size_t bytes) {
+    TransferScheduler& scheduler = TransferScheduler::Get();
+    int64_t now = std::chrono::duration_cast<std::chrono::microseconds>(
+                      Clock::now().time_since_epoch())
+                      .count();
+    int64_t wait = scheduler.SendBulk(bytes, now);
+    if (wait <= 0 || scheduler.Timer() == nullptr) return;
+    paused_ = true;
+    scheduler.Timer()
+        ->afterDelay(wait * kj::MICROSECONDS)
+        .then([self = shared_from_this()]() {
+          self->paused_ = false;
+          if (self->done_->isWaiting()) self->Fill();
+        })
+        .detach([](kj::Exception exc) {
+          KJ_LOG(WARNING, "Bulk transfer timer failed", exc.getDescription());
+        });
+  }
+
+  void Ack(Clock::duration rtt, capnproto::Codec codec) {
+    in_flight_--;
+    if (!done_->isWaiting()) return;
+    if (!incompressible_ && HasLz4()) codec_ = codec;
+    if (min_rtt_ == Clock::duration::zero() || rtt < min_rtt_) min_rtt_ = rtt;
+    if (rtt > 2 * min_rtt_) {
+      window_ = std::max(kMinWindow, window_ - 1);
+    } else {
+      window_ = std::min(kMaxWindow, window_ + 1);
+    }
+    Fill();
+  }
+
+  capnproto::FileReceiver::Client receiver_;
+  size_t num_files_;
+  size_t files_done_ = 0;
+  TransferPriority priority_;
+  IoPool* pool_;
+  // Shared with the jobs of the pool, that can outlive the stream.
+  std::shared_ptr<File::ChunkProducer> producer_;
+  bool reading_ = false;
+  size_t files_read_ = 0;
+  std::deque<Prepared> ready_;
+  bool paused_ = false;
+  kj::Own<kj::PromiseFulfiller<void>> done_;
+  size_t window_ = kMinWindow;
+  size_t in_flight_ = 0;
+  bool finished_ = false;
+  Clock::duration min_rtt_ = Clock::duration::zero();
+  capnproto::Codec codec_ = capnproto::Codec::NONE;
+  bool incompressible_ = false;
+  std::vector<kj::byte> compressed_;
+};
+
+// Sends the files once the scheduler allows it. open is called only then, so
+// that waiting transfers do not keep files open. The files are read on the
+// send pool if there is one and offload is set.
+kj::Promise<void> SendChunks(kj::Function<File::ChunkProducer()> open,
+                             capnproto::FileReceiver::Client receiver,
+                             size_t num_files, TransferPriority priority,
+                             uint64_t peer, bool offload) {
+  return TransferScheduler::Get()
+      .Acquire(priority, peer)
+      .then([open = std::move(open), receiver, num_files, priority,
+             offload](kj::Own<TransferScheduler::Slot> slot) mutable {
+        auto stream = std::make_shared<ChunkStream>(
+            open(), std::move(receiver), num_files, priority,
+            offload ? send_pool : nullptr);
+        return stream->Run().attach(std::move(slot));
       });
 }
+
+// Concatenates the contents of the files with the given hashes, opening each
+// file only when the previous one is over.
+File::ChunkProducer ReadAll(std::vector<util::SHA256_t> hashes) {
+  std::unique_ptr<File::ChunkProducer> producer(nullptr);
+  size_t next = 0;
+  return [hashes = std::move(hashes), producer = std::move(producer),
+          next]() mutable -> File::Chunk {
+    if (next == hashes.size()) return File::Chunk();
+    if (!producer) {
+      const util::SHA256_t& hash = hashes[next];
+      if (hash.hasContents()) {
+        bool sent = false;
+        producer = std::make_unique<File::ChunkProducer>(
+            [contents = hash.getContents(), sent]() mutable {
+              if (sent) return File::Chunk();
+              sent = true;
+              return contents;
+            });
+      } else {
+        producer = std::make_unique<File::ChunkProducer>(
+            File::ReadFromStore(hash));
+      }
+    }
+    File::Chunk chunk = (*producer)();
+    if (chunk.size() == 0) {
+      producer = nullptr;
+      next++;
+    }
+    return chunk;
+  };
+}
 }  // namespace
 
+void File::SetSendPool(IoPool* pool) { send_pool = pool; }
+IoPool* File::SendPool() { return send_pool; }
+
+void File::SetPeerId(uint64_t id) { peer_id = id; }
+
 kj::Promise<void> File::HandleRequestFile(
     FileWrapper* wrapper, capnproto::FileReceiver::Client receiver,
-    uint64_t amount) {
-  // TODO: see if we can easily avoid the extra round-trips while
-  // still guaranteeing in-order processing (when capnp implements streams?)
-  // Possibly by using UnionPromiseBuilder?
-  if (HandleRequestFileData::num_concurrent <
-      HandleRequestFileData::max_concurrent) {
-    HandleRequestFileData::num_concurrent++;
-    HandleRequestFileData data{wrapper->Read(amount), receiver};
-    return next_chunk(std::move(data));
-  }
-  auto pf = kj::newPromiseAndFulfiller<void>();
-  HandleRequestFileData::waiting.push(std::move(pf.fulfiller));
-  return pf.promise.then([wrapper = wrapper, receiver, amount]() mutable {
-    return File::HandleRequestFile(wrapper, receiver, amount);
-  });
+    uint64_t amount, TransferPriority priority, uint64_t peer) {
+  // The wrapper is kept alive by the caller, and only read from the event
+  // loop.
+  return SendChunks([wrapper, amount]() { return wrapper->Read(amount); },
+                    receiver, 1, priority, peer, false);
 }
 
 kj::Promise<void> File::HandleRequestFile(
     const util::SHA256_t& hash, capnproto::FileReceiver::Client receiver,
-    uint64_t amount) {
+    uint64_t amount, TransferPriority priority, uint64_t peer,
+    uint64_t offset) {
   if (hash.hasContents()) {
     auto req = receiver.sendChunkRequest();
     kj::ArrayPtr<const uint8_t> chunk = hash.getContents();
+    chunk = chunk.slice(std::min<uint64_t>(chunk.size(), offset), chunk.size());
     if (chunk.size() > amount) chunk = {chunk.begin(), amount};
+    SentBytes()->Add(chunk.size());
     req.setChunk(chunk);
     return req.send().ignoreResult().then([receiver]() mutable {
       return receiver.sendChunkRequest().send().ignoreResult();
     });
   }
-  util::FileWrapper wrapper = FileWrapper::FromPath(PathForHash(hash));
-  return HandleRequestFile(&wrapper, receiver, amount);
+  return SendChunks(
+      [hash, amount, offset]() { return ReadFromStore(hash, amount, offset); },
+      receiver, 1, priority, peer, true);
+}
+
+kj::Promise<void> File::HandleRequestFiles(
+    std::vector<util::SHA256_t> hashes,
+    capnproto::FileReceiver::Client receiver, uint64_t peer) {
+  if (hashes.empty()) return kj::READY_NOW;
+  size_t num_files = hashes.size();
+  return SendChunks(
+      [hashes = std::move(hashes)]() mutable {
+        return ReadAll(std::move(hashes));
+      },
+      receiver, num_files, TransferPriority::INPUT, peer, true);
 }
 
 FileWrapper FileWrapper::FromPath(std::string path) {
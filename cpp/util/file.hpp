@@ -1,13 +1,18 @@
 #ifndef UTIL_FILE_HPP
 #define UTIL_FILE_HPP
+#include <functional>
 #include <memory>
+#include <string>
 
 #include <kj/common.h>
 #include <kj/debug.h>
 #include <kj/function.h>
 #include <vector>
 #include "capnp/file.capnp.h"
+#include "util/pack_store.hpp"
+#include "util/reclaimer.hpp"
 #include "util/sha256.hpp"
+#include "util/transfer_scheduler.hpp"
 
 namespace util {
 
@@ -15,6 +20,7 @@ static const constexpr uint32_t kChunkSize = 1024 * 1024;
 static const constexpr uint32_t kInlineChunkThresh = 1024;
 
 class FileWrapper;
+class IoPool;
 
 class File {
  public:
@@ -37,13 +43,75 @@ class File {
   static ChunkProducer Read(const std::string& path,
                             uint64_t limit = 0xffffffffffffffff);
 
+  // Same as Read, but the chunks point into a read-only mapping of the file
+  // instead of being copied in a buffer. The file must not be truncated while
+  // it is read, which is the case for the files in the store. The first
+  // offset bytes are skipped.
+  static ChunkProducer Map(const std::string& path,
+                           uint64_t limit = 0xffffffffffffffff,
+                           uint64_t offset = 0);
+
   // Returns a receiver that writes to the given file, the file ends when an
   // empty chunk is received, and finalizes the write when destroyed.
+  // Flags::durability decides if the file is flushed to disk before being
+  // moved in place ("file"), if all the written files are flushed together
+  // every Flags::sync_interval milliseconds ("batch"), or never ("none").
   static ChunkReceiver Write(const std::string& path, bool overwrite = false,
                              bool exist_ok = true);
 
-  // Computes the hash of the file specified by path.
-  static SHA256_t Hash(const std::string& path);
+  // Returns a receiver that writes the file with the given hash in the store.
+  // The contents are hashed as they arrive, and the file is moved in place
+  // only if they match the hash: otherwise, std::runtime_error is thrown on
+  // EOF.
+  static ChunkReceiver WriteToStore(const util::SHA256_t& hash);
+
+  // With batched durability, all the files written before WriteEpoch()
+  // returned some value are on disk once DurableEpoch() is at least that
+  // value. The two are always equal in the other modes.
+  static uint64_t WriteEpoch();
+  static uint64_t DurableEpoch();
+
+  // Flushes the files written so far to disk, with batched durability.
+  static void Sync();
+
+  // Whether durability is a valid value of Flags::durability.
+  static bool ValidDurability(const std::string& durability);
+
+  // Must be called before a file is moved in place without being flushed to
+  // disk, when Flags::durability is not "file": the store is then marked as
+  // possibly inconsistent until a clean exit.
+  static void PrepareUnsyncedWrite();
+  // Must be called once a file was written without being flushed to disk.
+  // With batched durability, it is flushed within Flags::sync_interval.
+  static void MarkWritten();
+
+  // If the store was not closed cleanly while its files were not flushed,
+  // removes the files written since then whose contents do not match their
+  // hash. It must be called before the store is used. Returns the number of
+  // removed files.
+  static size_t RecoverStore();
+
+  // Computes the hash of the file specified by path. The contents of files
+  // smaller than inline_threshold are stored in the hash, the threshold is
+  // capped at the size of a chunk.
+  static SHA256_t Hash(const std::string& path,
+                       size_t inline_threshold = kInlineChunkThresh);
+
+  // Adds the file specified by path to the store and returns its hash, as
+  // Hash does. The file is read only once: it is added to the packs if it is
+  // small enough, hard linked in the store when possible, and hashed while it
+  // is copied otherwise.
+  static SHA256_t Ingest(const std::string& path,
+                         size_t inline_threshold = kInlineChunkThresh);
+
+  // Copies the file specified by path to the store as the file with the
+  // given hash, if its contents match it, as Ingest would. Returns false and
+  // leaves the store unchanged otherwise.
+  static bool IngestChecked(const std::string& path, const SHA256_t& hash);
+
+  // Same as Ingest, for contents that are already in memory.
+  static SHA256_t IngestContents(kj::ArrayPtr<const uint8_t> data,
+                                 size_t inline_threshold = kInlineChunkThresh);
 
   // Creates all the folders that are needed to write the specified file
   // or, if path is a directory, creates all the folders.
@@ -58,6 +126,12 @@ class File {
                        bool overwrite = false, bool exist_ok = true,
                        bool make_dirs = true);
 
+  // Copies from -> to without hard links, that would let changes to either
+  // file show in the other one, but still with reflinks or in the kernel when
+  // the filesystems allow it.
+  static void Clone(const std::string& from, const std::string& to,
+                    bool overwrite = false, bool exist_ok = true);
+
   // Moves a file to a new position. If overwrite is false and exist_ok
   // is true, the original file is deleted anyway.
   static void Move(const std::string& from, const std::string& to,
@@ -75,9 +149,51 @@ class File {
   // Make a file immutable
   static void MakeImmutable(const std::string& path);
 
-  // Computes the path for a file with the given hash.
+  // Computes the path for a file with the given hash. Files smaller than
+  // Flags::pack_threshold KiB may be in the packs of the store instead, see
+  // PackStore: the functions below find the files wherever they are.
   static std::string PathForHash(const SHA256_t& hash);
 
+  // Returns the size of the file with the given hash, or a negative number if
+  // it is not in the store.
+  static int64_t StoreSize(const SHA256_t& hash);
+
+  // Returns true if the file with the given hash is in the store.
+  static bool InStore(const SHA256_t& hash) { return StoreSize(hash) >= 0; }
+
+  // Reads the file with the given hash from the store, skipping the first
+  // offset bytes.
+  static ChunkProducer ReadFromStore(const SHA256_t& hash,
+                                     uint64_t limit = 0xffffffffffffffff,
+                                     uint64_t offset = 0);
+
+  // Copies the file with the given hash from the store to path.
+  static void CopyFromStore(const SHA256_t& hash, const std::string& path);
+
+  // Copies the file with the given hash from the store to path, as an
+  // executable. The copy is linked, when possible, to an executable copy of
+  // the file that is kept next to it in the store, and created the first time:
+  // neither the mode of the stored file nor the one of the copy has to change
+  // on every run.
+  static void CopyExecutableFromStore(const SHA256_t& hash,
+                                      const std::string& path);
+
+  // Returns the path of the executable copy of the file with the given hash,
+  // creating it if needed.
+  static std::string StageExecutable(const SHA256_t& hash);
+
+  // Stores data as the file with the given hash.
+  static void StoreContents(const SHA256_t& hash,
+                            kj::ArrayPtr<const uint8_t> data);
+
+  // Computes the path for a file with the given hash, relative to the store
+  // directory.
+  static std::string RelativePathForHash(const SHA256_t& hash);
+
+  // Computes the path of the executable copy of the file with the given hash,
+  // relative to the store directory. It is deleted with the file.
+  static std::string RelativeExecutablePathForHash(const SHA256_t& hash);
+
   // Joins two paths.
   static std::string JoinPath(const std::string& first,
                               const std::string& second);
@@ -94,63 +210,106 @@ class File {
   // Returns true if a file exists
   static bool Exists(const std::string& path) { return Size(path) >= 0; }
 
-  // Utility to implement RequestFile methods, given the path and the receiver
+  // Makes the files of the store that are sent be read, and their chunks
+  // compressed, on the threads of pool instead of the event loop, which then
+  // only sends them. pool must outlive the transfers.
+  static void SetSendPool(IoPool* pool);
+  // The pool given to SetSendPool, or nullptr.
+  static IoPool* SendPool();
+
+  // Sets the peer sent with the file requests of this process, see
+  // FileSender in file.capnp.
+  static void SetPeerId(uint64_t id);
+
+  // Utility to implement RequestFile methods, given the path and the receiver.
+  // The transfer is started by TransferScheduler, peer identifies the
+  // requester for fairness. wrapper must stay alive until the returned
+  // promise resolves.
   static kj::Promise<void> HandleRequestFile(
       FileWrapper* wrapper, capnproto::FileReceiver::Client receiver,
-      uint64_t amount);
+      uint64_t amount, TransferPriority priority = TransferPriority::INPUT,
+      uint64_t peer = 0);
+  // The file with the given hash is sent from offset.
   static kj::Promise<void> HandleRequestFile(
       const util::SHA256_t& hash, capnproto::FileReceiver::Client receiver,
-      uint64_t amount);
+      uint64_t amount, TransferPriority priority = TransferPriority::INPUT,
+      uint64_t peer = 0, uint64_t offset = 0);
+
+  // Utility to implement RequestFiles methods, given the hashes and the
+  // receiver.
+  static kj::Promise<void> HandleRequestFiles(
+      std::vector<util::SHA256_t> hashes,
+      capnproto::FileReceiver::Client receiver, uint64_t peer = 0);
 
   // Utility to implement RequestFile methods
   template <typename RequestFileContext>
   static kj::Promise<void> HandleRequestFile(RequestFileContext context) {
     auto hash = context.getParams().getHash();
     auto receiver = context.getParams().getReceiver();
-    return HandleRequestFile(hash, receiver, 0xffffffffffffffff);
+    return HandleRequestFile(hash, receiver, 0xffffffffffffffff,
+                             TransferPriority::INPUT,
+                             context.getParams().getPeer());
   }
 
+  // Utility to implement RequestFiles methods
+  template <typename RequestFilesContext>
+  static kj::Promise<void> HandleRequestFiles(RequestFilesContext context) {
+    std::vector<util::SHA256_t> hashes;
+    for (auto hash : context.getParams().getHashes()) hashes.emplace_back(hash);
+    return HandleRequestFiles(std::move(hashes),
+                              context.getParams().getReceiver(),
+                              context.getParams().getPeer());
+  }
+
+  // Returns a receiver that stores the files with the given hashes, received
+  // one after the other and each terminated by an empty chunk. done, if set,
+  // is called with the index of each file once it is stored.
+  static ChunkReceiver WriteAll(
+      std::vector<util::SHA256_t> hashes,
+      std::function<void(size_t)> done = std::function<void(size_t)>());
+
   // Simple capnproto server implementation to receive a file
   class Receiver : public capnproto::FileReceiver::Server {
    public:
     explicit Receiver(ChunkReceiver receiver)
         : receiver_(std::move(receiver)) {}
-    explicit Receiver(const util::SHA256_t& hash) {
-      receiver_ = Write(PathForHash(hash), /*overwrite=*/true);
-    }
+    explicit Receiver(const util::SHA256_t& hash)
+        : receiver_(WriteToStore(hash)) {}
     kj::Promise<void> sendChunk(SendChunkContext context) override;
 
    private:
     ChunkReceiver receiver_;
+    std::vector<kj::byte> buffer_;
   };
 
-  // Retrieve a file from a FileSender and store it in storage
+  // Retrieve a file from a FileSender and store it in storage. Concurrent
+  // calls for the same file, also from MaybeGetAll, share the transfer.
   static kj::Promise<void> Get(const util::SHA256_t& hash,
                                capnproto::FileSender::Client worker)
-      KJ_WARN_UNUSED_RESULT {
-    if (hash.hasContents()) {
-      auto tmp = Write(PathForHash(hash), /*overwrite=*/true);
-      tmp(hash.getContents());
-      tmp({});
-      return kj::READY_NOW;
-    }
-    auto req = worker.requestFileRequest();
-    hash.ToCapnp(req.initHash());
-    req.setReceiver(kj::heap<util::File::Receiver>(hash));
-    return req.send().ignoreResult().then([]() {}).eagerlyEvaluate(nullptr);
-  }
+      KJ_WARN_UNUSED_RESULT;
 
   // Same as Get, but skip zero files and already present files.
   static kj::Promise<void> MaybeGet(const util::SHA256_t& hash,
                                     capnproto::FileSender::Client worker)
       KJ_WARN_UNUSED_RESULT {
     if (hash.isZero()) return kj::READY_NOW;
-    if (!util::File::Exists(util::File::PathForHash(hash))) {
-      return Get(hash, worker);
-    }
+    // The file may be in the store only because its deletion is pending.
+    Reclaimer::Get().Cancel(hash);
+    if (!util::File::InStore(hash)) return Get(hash, worker);
     return kj::READY_NOW;
   }
 
+  // Same as MaybeGet, but fetches all the missing files with a single call.
+  static kj::Promise<void> MaybeGetAll(
+      const std::vector<util::SHA256_t>& hashes,
+      capnproto::FileSender::Client sender) KJ_WARN_UNUSED_RESULT;
+
+  // Same as MaybeGetAll, but returns a promise for each of the hashes, that
+  // resolves as soon as that file is in the store.
+  static kj::Array<kj::Promise<void>> MaybeGetEach(
+      const std::vector<util::SHA256_t>& hashes,
+      capnproto::FileSender::Client sender) KJ_WARN_UNUSED_RESULT;
+
   // Creates a ChunkReceiver that lazily calls f to do get the actual receiver.
   // This is useful to, for example, create a file for Write only after at least
   // a chunk has been received.
@@ -170,12 +329,17 @@ class TempDir {
   // Disables automatic deletion of the folder.
   void Keep();
 
+  // Makes the destructor return immediately, leaving the deletion of the
+  // folder to a background thread.
+  void RemoveInBackground();
+
   ~TempDir();
 
   TempDir(TempDir&& other) noexcept { *this = std::move(other); }
   TempDir& operator=(TempDir&& other) noexcept {
     path_ = std::move(other.path_);
     keep_ = other.keep_;
+    background_ = other.background_;
     other.moved_ = true;
     return *this;
   }
@@ -184,9 +348,61 @@ class TempDir {
  private:
   std::string path_;
   bool keep_ = false;
+  bool background_ = false;
   bool moved_ = false;
 };
 
+// Temporary directories in base, each with an empty subdir, that are created
+// ahead of time by a background thread so that getting one does not wait for
+// the filesystem. At most size of them are kept ready. The returned
+// directories are removed in the background, the ones still ready when the
+// pool is destroyed are removed by the destructor.
+class TempDirPool {
+ public:
+  TempDirPool(std::string base, std::string subdir, size_t size);
+  ~TempDirPool();
+  KJ_DISALLOW_COPY(TempDirPool);
+
+  TempDir Get();
+
+ private:
+  struct State;
+
+  static TempDir Create(const std::string& base, const std::string& subdir);
+  // Starts refilling the pool, if it is not already being refilled. Must be
+  // called with the mutex of the state held.
+  void Refill();
+  std::function<void()> RefillJob();
+
+  const std::string base_;
+  const std::string subdir_;
+  const size_t size_;
+  std::shared_ptr<State> state_;
+};
+
+// Read-only memory mapping of the whole contents of a file. The file should not
+// be truncated while it is mapped.
+class MappedFile {
+ public:
+  explicit MappedFile(const std::string& path);
+  ~MappedFile();
+
+  MappedFile(MappedFile&& other) noexcept { *this = std::move(other); }
+  MappedFile& operator=(MappedFile&& other) noexcept {
+    std::swap(data_, other.data_);
+    std::swap(size_, other.size_);
+    return *this;
+  }
+  KJ_DISALLOW_COPY(MappedFile);
+
+  // Returns the mapped contents of the file.
+  kj::ArrayPtr<const kj::byte> Data() const { return {data_, size_}; }
+
+ private:
+  const kj::byte* data_ = nullptr;
+  size_t size_ = 0;
+};
+
 // Wrapper around a File, it can be a path to a file or the content of a file.
 class FileWrapper {
   enum class FileWrapperType { PATH = 0, CONTENT = 1 };
@@ -215,6 +431,11 @@ class FileWrapper {
   // Returns a ChunkProducer with the content of the wrapped file
   File::ChunkProducer Read(uint64_t limit);
 
+  // Returns the path of the wrapped file, or nullptr if it wraps contents.
+  const std::string* Path() const {
+    return type_ == FileWrapperType::PATH ? &path_ : nullptr;
+  }
+
  private:
   std::string path_;
   std::string content_;
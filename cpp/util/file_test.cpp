@@ -4,8 +4,11 @@
 #include <ftw.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <unistd.h>
+#include <chrono>
 #include <cstdio>
 #include <fstream>
+#include <thread>
 #include <vector>
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
@@ -14,6 +17,7 @@
 
 namespace {
 
+using ::testing::ElementsAre;
 using ::testing::EndsWith;
 using ::testing::IsEmpty;
 using ::testing::StartsWith;
@@ -200,6 +204,58 @@ TEST(File, ReadNoSuchFile) {
   EXPECT_THROW(util::File::Read(filepath), std::system_error);  // NOLINT
 }
 
+/*
+ * Map
+ */
+
+// NOLINTNEXTLINE
+TEST(File, MapBigFile) {
+  std::string testdir = makeTestDir("map");
+  std::string filepath = testdir + "/bigfile";
+  std::string content(util::kChunkSize * 2 + 1, ' ');
+  for (size_t i = 0; i < content.size(); i++) content[i] = i % 250 + 1;
+
+  writeFile(filepath, content);
+  auto reader = util::File::Map(filepath);
+  EXPECT_EQ(content, readFile(&reader));
+  auto limited = util::File::Map(filepath, util::kChunkSize + 1);
+  std::string realContent = readFile(&limited);
+  EXPECT_EQ(util::kChunkSize + 1, realContent.size());
+  EXPECT_THAT(content, StartsWith(realContent));
+}
+
+// NOLINTNEXTLINE
+TEST(File, MapWithOffset) {
+  std::string testdir = makeTestDir("map");
+  std::string filepath = testdir + "/bigfile";
+  std::string content(util::kChunkSize * 2 + 1, ' ');
+  for (size_t i = 0; i < content.size(); i++) content[i] = i % 250 + 1;
+
+  writeFile(filepath, content);
+  auto reader = util::File::Map(filepath, 0xffffffffffffffff, 10);
+  EXPECT_EQ(content.substr(10), readFile(&reader));
+  auto range = util::File::Map(filepath, util::kChunkSize, util::kChunkSize);
+  EXPECT_EQ(content.substr(util::kChunkSize, util::kChunkSize),
+            readFile(&range));
+  auto past_end = util::File::Map(filepath, 10, content.size() + 10);
+  EXPECT_THAT(readFile(&past_end), IsEmpty());
+}
+
+// NOLINTNEXTLINE
+TEST(File, MapEmptyFile) {
+  std::string testdir = makeTestDir("map");
+  std::string filepath = testdir + "/file";
+  writeFile(filepath, "");
+  auto reader = util::File::Map(filepath);
+  EXPECT_THAT(readFile(&reader), IsEmpty());
+}
+
+// NOLINTNEXTLINE
+TEST(File, MapNoSuchFile) {
+  std::string filepath = "/no/such/file";
+  EXPECT_THROW(util::File::Map(filepath), std::system_error);  // NOLINT
+}
+
 /*
  * Write
  */
@@ -390,6 +446,48 @@ TEST(File, CopyExistNotOk) {
                std::system_error);
 }
 
+// NOLINTNEXTLINE
+TEST(File, CopyAcrossFilesystems) {
+  // /dev/shm is usually a tmpfs, so hard links to it are not possible.
+  std::string testdir = makeTestDir("copy");
+  std::string filepath = testdir + "/file";
+  util::TempDir tmp(access("/dev/shm", W_OK) == 0 ? "/dev/shm/task_maker"
+                                                   : test_tmpdir + "/shm");
+  std::string filepath2 = tmp.Path() + "/file2";
+  std::string content(3 << 20, 'x');
+  writeFile(filepath, content);
+  util::File::Copy(filepath, filepath2);
+  EXPECT_EQ(content, readFile(filepath2));
+  // The second copy between the same filesystems reuses the method that
+  // worked the first time.
+  writeFile(filepath, "hollaaa");
+  util::File::Copy(filepath, filepath2, true);
+  EXPECT_EQ("hollaaa", readFile(filepath2));
+}
+
+/*
+ * Clone
+ */
+
+// NOLINTNEXTLINE
+TEST(File, Clone) {
+  std::string testdir = makeTestDir("clone");
+  std::string filepath = testdir + "/file";
+  std::string filepath2 = testdir + "/file2";
+  writeFile(filepath, "hollaaa");
+  util::File::Clone(filepath, filepath2);
+  EXPECT_EQ("hollaaa", readFile(filepath2));
+  // The copy is not a hard link to the original file.
+  writeFile(filepath2, "changed");
+  EXPECT_EQ("hollaaa", readFile(filepath));
+  // Later copies between the same directories can still be hard links.
+  std::string filepath3 = testdir + "/file3";
+  util::File::Copy(filepath, filepath3);
+  struct stat st {};
+  ASSERT_EQ(stat(filepath.c_str(), &st), 0);
+  EXPECT_EQ(st.st_nlink, static_cast<nlink_t>(2));
+}
+
 /*
  * HardCopy
  */
@@ -616,6 +714,162 @@ TEST(File, PathForHash) {
   EXPECT_THAT(path, EndsWith(hex));
 }
 
+/*
+ * WriteToStore
+ */
+
+// NOLINTNEXTLINE
+TEST(File, WriteToStore) {
+  Flags::store_directory = makeTestDir("store");
+  std::string testdir = makeTestDir("write_to_store");
+  std::string filepath = testdir + "/file";
+  std::string content(util::kChunkSize + 1, 'x');
+  writeFile(filepath, content);
+  util::SHA256_t hash = util::File::Hash(filepath);
+
+  auto receiver = util::File::WriteToStore(hash);
+  writeFile(&receiver, content);
+  EXPECT_EQ(readFile(util::File::PathForHash(hash)), content);
+}
+
+// NOLINTNEXTLINE
+TEST(File, WriteToStoreWrongHash) {
+  Flags::store_directory = makeTestDir("store");
+  util::SHA256_t hash = util::File::Hash("/dev/null");
+  {
+    auto receiver = util::File::WriteToStore(hash);
+    EXPECT_THROW(writeFile(&receiver, "not empty"),  // NOLINT
+                 std::runtime_error);
+  }
+  EXPECT_FALSE(fileExists(util::File::PathForHash(hash)));
+}
+
+// NOLINTNEXTLINE
+TEST(File, RecoverStore) {
+  Flags::store_directory = makeTestDir("store");
+  std::string testdir = makeTestDir("recover_store");
+  // The store was not closed cleanly.
+  writeFile(Flags::store_directory + "/unsynced", "");
+  std::string content(util::kChunkSize + 1, 'x');
+  writeFile(testdir + "/good", content);
+  util::SHA256_t good = util::File::Ingest(testdir + "/good");
+  writeFile(testdir + "/bad", content + "y");
+  util::SHA256_t bad = util::File::Hash(testdir + "/bad");
+  util::File::MakeDirs(util::File::BaseDir(util::File::PathForHash(bad)));
+  writeFile(util::File::PathForHash(bad), content);
+
+  EXPECT_EQ(1, util::File::RecoverStore());
+  EXPECT_EQ(readFile(util::File::PathForHash(good)), content);
+  EXPECT_FALSE(fileExists(util::File::PathForHash(bad)));
+  EXPECT_FALSE(fileExists(Flags::store_directory + "/unsynced"));
+  EXPECT_EQ(0, util::File::RecoverStore());
+}
+
+// NOLINTNEXTLINE
+TEST(File, Ingest) {
+  Flags::store_directory = makeTestDir("store");
+  std::string testdir = makeTestDir("ingest");
+  std::string filepath = testdir + "/file";
+  std::string content(util::kChunkSize + 1, 'x');
+  writeFile(filepath, content);
+  util::SHA256_t hash = util::File::Ingest(filepath);
+  EXPECT_EQ(hash.Hex(), util::File::Hash(filepath).Hex());
+  EXPECT_EQ(readFile(util::File::PathForHash(hash)), content);
+}
+
+// NOLINTNEXTLINE
+TEST(File, IngestCopy) {
+  Flags::store_directory = makeTestDir("store");
+  std::string testdir = makeTestDir("ingest");
+  std::string filepath = testdir + "/file";
+  std::string content{"random content"};
+  writeFile(filepath, content);
+  // Symbolic links cannot be linked in the store, so they are copied.
+  ASSERT_EQ(symlink(filepath.c_str(), (testdir + "/link").c_str()), 0);
+  util::SHA256_t hash = util::File::Ingest(testdir + "/link");
+  EXPECT_TRUE(hash.hasContents());
+  EXPECT_EQ(hash.Hex(), util::File::Hash(filepath).Hex());
+  EXPECT_EQ(readFile(util::File::PathForHash(hash)), content);
+  EXPECT_THAT(util::File::ListFiles(Flags::store_directory),
+              ElementsAre(util::File::PathForHash(hash)));
+}
+
+// NOLINTNEXTLINE
+TEST(File, IngestChecked) {
+  Flags::store_directory = makeTestDir("store");
+  std::string testdir = makeTestDir("ingest");
+  std::string filepath = testdir + "/file";
+  writeFile(filepath, std::string(util::kChunkSize + 1, 'x'));
+  util::SHA256_t hash = util::File::Hash(filepath);
+  writeFile(filepath, std::string(util::kChunkSize + 1, 'y'));
+  EXPECT_FALSE(util::File::IngestChecked(filepath, hash));
+  EXPECT_THAT(util::File::ListFiles(Flags::store_directory), IsEmpty());
+  writeFile(filepath, std::string(util::kChunkSize + 1, 'x'));
+  EXPECT_TRUE(util::File::IngestChecked(filepath, hash));
+  EXPECT_EQ(readFile(util::File::PathForHash(hash)),
+            std::string(util::kChunkSize + 1, 'x'));
+}
+
+// NOLINTNEXTLINE
+TEST(File, IngestContents) {
+  Flags::store_directory = makeTestDir("store");
+  std::string testdir = makeTestDir("ingest");
+  for (size_t size : {0UL, 10UL, util::kChunkSize + 1UL}) {
+    std::string content(size, 'x');
+    writeFile(testdir + "/file", content);
+    util::SHA256_t hash = util::File::IngestContents(
+        {reinterpret_cast<const uint8_t*>(content.data()),  // NOLINT
+         content.size()});
+    util::SHA256_t expected = util::File::Hash(testdir + "/file");
+    EXPECT_EQ(hash.Hex(), expected.Hex());
+    EXPECT_EQ(hash.hasContents(), expected.hasContents());
+    EXPECT_EQ(readFile(util::File::PathForHash(hash)), content);
+  }
+}
+
+// NOLINTNEXTLINE
+TEST(File, StoreInPacks) {
+  Flags::store_directory = makeTestDir("store");
+  Flags::pack_threshold = 1;
+  std::string testdir = makeTestDir("store_in_packs");
+  std::string content{"random content"};
+  writeFile(testdir + "/file", content);
+  util::SHA256_t hash = util::File::Ingest(testdir + "/file");
+  Flags::pack_threshold = 0;
+  EXPECT_FALSE(fileExists(util::File::PathForHash(hash)));
+  EXPECT_EQ(util::File::StoreSize(hash), static_cast<int64_t>(content.size()));
+
+  auto producer = util::File::ReadFromStore(hash);
+  util::File::Chunk chunk = producer();
+  EXPECT_EQ(std::string(chunk.asChars().begin(), chunk.size()), content);
+  EXPECT_EQ(producer().size(), 0);
+
+  util::File::CopyFromStore(hash, testdir + "/copy");
+  EXPECT_EQ(readFile(testdir + "/copy"), content);
+}
+
+// NOLINTNEXTLINE
+TEST(File, CopyExecutableFromStore) {
+  Flags::store_directory = makeTestDir("store");
+  std::string testdir = makeTestDir("copy_executable_from_store");
+  std::string content(util::kChunkSize + 1, 'x');
+  writeFile(testdir + "/file", content);
+  util::SHA256_t hash = util::File::Ingest(testdir + "/file");
+  util::File::CopyFromStore(hash, testdir + "/input");
+  util::File::MakeImmutable(testdir + "/input");
+  for (const char* name : {"/first", "/second"}) {
+    util::File::CopyExecutableFromStore(hash, testdir + name);
+    EXPECT_EQ(readFile(testdir + name), content);
+    struct stat fileStat {};
+    EXPECT_NE(stat((testdir + name).c_str(), &fileStat), -1);
+    EXPECT_NE(fileStat.st_mode & S_IXUSR, 0);
+  }
+  // The stored file keeps the mode of the non executable inputs.
+  struct stat fileStat {};
+  EXPECT_NE(stat(util::File::PathForHash(hash).c_str(), &fileStat), -1);
+  EXPECT_EQ(fileStat.st_mode & S_IXUSR, 0);
+}
+
 /*
  * JoinPath
  */
@@ -750,4 +1004,87 @@ TEST(TempDir, TempDirMove) {
   }
 }
 
+// NOLINTNEXTLINE
+TEST(TempDir, TempDirRemoveInBackground) {
+  std::string testdir = makeTestDir("tempdir");
+  std::string tempdirPath;
+  {
+    util::TempDir tempdir(testdir);
+    tempdir.RemoveInBackground();
+    tempdirPath = tempdir.Path();
+    writeFile(tempdirPath + "/file", "test");
+  }
+  for (int i = 0; i < 1000 && dirExists(tempdirPath); i++) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  EXPECT_FALSE(dirExists(tempdirPath));
+}
+
+// NOLINTNEXTLINE
+TEST(TempDir, TempDirPool) {
+  std::string testdir = makeTestDir("tempdir");
+  util::TempDirPool pool(testdir, "box", 2);
+  std::vector<std::string> paths;
+  {
+    std::vector<util::TempDir> dirs;
+    for (int i = 0; i < 4; i++) dirs.push_back(pool.Get());
+    for (const auto& dir : dirs) {
+      EXPECT_THAT(dir.Path(), StartsWith(testdir));
+      EXPECT_TRUE(dirExists(dir.Path() + "/box"));
+      paths.push_back(dir.Path());
+    }
+  }
+  for (const auto& path : paths) {
+    for (int i = 0; i < 1000 && dirExists(path); i++) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    EXPECT_FALSE(dirExists(path));
+  }
+}
+
+// NOLINTNEXTLINE
+TEST(TempDir, TempDirPoolRemovesReady) {
+  std::string testdir = makeTestDir("tempdir_ready");
+  { util::TempDirPool pool(testdir, "box", 2); }
+  DIR* dir = opendir(testdir.c_str());
+  ASSERT_NE(dir, nullptr);
+  std::vector<std::string> left;
+  while (struct dirent* entry = readdir(dir)) {
+    std::string name = entry->d_name;
+    if (name != "." && name != "..") left.push_back(name);
+  }
+  closedir(dir);
+  EXPECT_THAT(left, IsEmpty());
+}
+
+/*
+ * MappedFile
+ */
+
+// NOLINTNEXTLINE
+TEST(MappedFile, MappedFile) {
+  std::string testdir = makeTestDir("mapped_file");
+  std::string filepath = testdir + "/file";
+  writeFile(filepath, "test");
+  util::MappedFile mapped(filepath);
+  EXPECT_EQ(std::string(mapped.Data().asChars().begin(), mapped.Data().size()),
+            "test");
+}
+
+// NOLINTNEXTLINE
+TEST(MappedFile, MappedFileEmpty) {
+  std::string testdir = makeTestDir("mapped_file");
+  std::string filepath = testdir + "/file";
+  writeFile(filepath, "");
+  util::MappedFile mapped(filepath);
+  EXPECT_EQ(0, mapped.Data().size());
+}
+
+// NOLINTNEXTLINE
+TEST(MappedFile, MappedFileNoSuchFile) {
+  std::string testdir = makeTestDir("mapped_file");
+  std::string filepath = testdir + "/nope";
+  EXPECT_THROW(util::MappedFile{filepath}, std::system_error);  // NOLINT
+}
+
 }  // namespace
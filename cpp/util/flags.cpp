@@ -6,12 +6,42 @@ std::string Flags::store_directory = "files";
 int32_t Flags::port = 7070;
 uint32_t Flags::cache_size = 0;
 std::string Flags::log_file;
+std::string Flags::durability = "file";
+uint32_t Flags::sync_interval = 100;
+uint32_t Flags::pack_threshold = 0;
+std::string Flags::log_levels;
+uint32_t Flags::log_rate = 100;
 
 std::string Flags::server;
 std::string Flags::name = "unnamed_worker";
 int32_t Flags::num_cores = 0;
+uint32_t Flags::memory = 0;
+uint32_t Flags::max_exclusive = 0;
 std::string Flags::temp_directory = "temp";
 bool Flags::keep_sandboxes = false;
-int32_t Flags::pending_requests = 2;
+int32_t Flags::pending_requests = -1;
+uint32_t Flags::inline_outputs = 16;
+bool Flags::count_instructions = false;
+bool Flags::mount_inputs = false;
 
 std::string Flags::listen_address = "0.0.0.0";
+uint32_t Flags::frontend_requests = 0;
+uint32_t Flags::frontend_cpu_quota = 0;
+uint32_t Flags::queued_requests = 0;
+uint32_t Flags::queued_mib = 1024;
+uint32_t Flags::frontend_queued_requests = 0;
+uint32_t Flags::frontend_queued_mib = 0;
+bool Flags::hedge = false;
+bool Flags::lazy_outputs = false;
+uint32_t Flags::prefetch_requests = 16;
+uint32_t Flags::speed_tolerance = 10;
+uint32_t Flags::bulk_bandwidth = 0;
+uint32_t Flags::heartbeat_interval = 2;
+uint32_t Flags::heartbeat_timeout = 20;
+bool Flags::embedded_worker = false;
+uint32_t Flags::send_threads = 4;
+std::string Flags::trace_directory;
+std::string Flags::peers;
+std::string Flags::peer_address;
+std::string Flags::remote_cache;
+bool Flags::remote_cache_write = false;
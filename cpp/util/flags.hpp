@@ -11,17 +11,47 @@ struct Flags {
   static int32_t port;
   static uint32_t cache_size;
   static std::string log_file;
+  static std::string durability;
+  static uint32_t sync_interval;
+  static uint32_t pack_threshold;
+  static std::string log_levels;
+  static uint32_t log_rate;
 
   // Worker-only flags
   static std::string server;
   static std::string name;
   static int32_t num_cores;
+  static uint32_t memory;
+  static uint32_t max_exclusive;
   static bool keep_sandboxes;
   static std::string temp_directory;
   static int32_t pending_requests;
+  static uint32_t inline_outputs;
+  static bool count_instructions;
+  static bool mount_inputs;
 
   // Server-only flags
   static std::string listen_address;
+  static uint32_t frontend_requests;
+  static uint32_t frontend_cpu_quota;
+  static uint32_t queued_requests;
+  static uint32_t queued_mib;
+  static uint32_t frontend_queued_requests;
+  static uint32_t frontend_queued_mib;
+  static bool hedge;
+  static bool lazy_outputs;
+  static uint32_t prefetch_requests;
+  static uint32_t speed_tolerance;
+  static uint32_t bulk_bandwidth;
+  static uint32_t heartbeat_interval;
+  static uint32_t heartbeat_timeout;
+  static bool embedded_worker;
+  static uint32_t send_threads;
+  static std::string trace_directory;
+  static std::string peers;
+  static std::string peer_address;
+  static std::string remote_cache;
+  static bool remote_cache_write;
 };
 
 #endif
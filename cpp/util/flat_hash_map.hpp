@@ -0,0 +1,113 @@
+#ifndef UTIL_FLAT_HASH_MAP_HPP
+#define UTIL_FLAT_HASH_MAP_HPP
+#include <algorithm>
+#include <cstddef>
+#include <utility>
+#include <vector>
+#include "util/sha256.hpp"
+
+namespace util {
+
+// Map from hashes to values, stored in a single array with open addressing
+// and linear probing. Compared to std::unordered_map, there is no allocation
+// per element and lookups touch contiguous memory. Insertions and erasures
+// invalidate the pointers to the values.
+template <typename V>
+class FlatHashMap {
+ public:
+  // Returns the value of the given key, or nullptr if the key is not present.
+  V* Find(const SHA256Key& key) {
+    if (slots_.empty()) return nullptr;
+    Slot& slot = slots_[FindSlot(key)];
+    return slot.used ? &slot.value : nullptr;
+  }
+  const V* Find(const SHA256Key& key) const {
+    return const_cast<FlatHashMap*>(this)->Find(key);
+  }
+
+  // Inserts the value, if the key is not already present. Returns the value of
+  // the key and whether it was inserted.
+  std::pair<V*, bool> Insert(const SHA256Key& key, V value) {
+    if ((size_ + 1) * 4 > slots_.size() * 3) Grow();
+    Slot& slot = slots_[FindSlot(key)];
+    if (slot.used) return {&slot.value, false};
+    slot.key = key;
+    slot.value = std::move(value);
+    slot.used = true;
+    size_++;
+    return {&slot.value, true};
+  }
+
+  // Returns the value of the key, inserting a default one if not present.
+  V& operator[](const SHA256Key& key) { return *Insert(key, V()).first; }
+
+  // Removes a key. Returns false if it was not present.
+  bool Erase(const SHA256Key& key) {
+    if (slots_.empty()) return false;
+    size_t pos = FindSlot(key);
+    if (!slots_[pos].used) return false;
+    // Move back the following keys that would not be found anymore, instead of
+    // leaving a tombstone.
+    size_t mask = slots_.size() - 1;
+    for (size_t next = (pos + 1) & mask; slots_[next].used;
+         next = (next + 1) & mask) {
+      size_t home = Home(slots_[next].key);
+      bool between = pos <= next ? pos < home && home <= next
+                                 : pos < home || home <= next;
+      if (between) continue;
+      slots_[pos] = std::move(slots_[next]);
+      pos = next;
+    }
+    slots_[pos] = Slot();
+    size_--;
+    return true;
+  }
+
+  size_t Size() const { return size_; }
+  bool Empty() const { return size_ == 0; }
+
+  // Calls f(key, value) for all the elements, in no particular order.
+  template <typename F>
+  void ForEach(F f) const {
+    for (const Slot& slot : slots_) {
+      if (slot.used) f(slot.key, slot.value);
+    }
+  }
+
+ private:
+  struct Slot {
+    SHA256Key key;
+    V value;
+    bool used = false;
+  };
+
+  size_t Home(const SHA256Key& key) const {
+    return SHA256Key::Hasher()(key) & (slots_.size() - 1);
+  }
+
+  // Returns the slot of the key, or the empty slot where it would go.
+  size_t FindSlot(const SHA256Key& key) const {
+    size_t mask = slots_.size() - 1;
+    size_t pos = Home(key);
+    while (slots_[pos].used && !(slots_[pos].key == key)) {
+      pos = (pos + 1) & mask;
+    }
+    return pos;
+  }
+
+  void Grow() {
+    std::vector<Slot> old(std::max<size_t>(16, slots_.size() * 2));
+    std::swap(old, slots_);
+    size_ = 0;
+    for (Slot& slot : old) {
+      if (slot.used) Insert(slot.key, std::move(slot.value));
+    }
+  }
+
+  std::vector<Slot> slots_;
+  size_t size_ = 0;
+};
+
+}  // namespace util
+
+#endif
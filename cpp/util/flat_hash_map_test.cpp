@@ -0,0 +1,63 @@
+#include "util/flat_hash_map.hpp"
+#include <random>
+#include <unordered_map>
+#include "gtest/gtest.h"
+
+namespace {
+
+util::SHA256Key MakeKey(uint32_t id) {
+  util::SHA256Key key{};
+  // Only a few buckets are used, to test long probe sequences.
+  key.digest[0] = id % 4;
+  key.digest[1] = id & 0xff;
+  key.digest[2] = id >> 8;
+  return key;
+}
+
+// NOLINTNEXTLINE
+TEST(FlatHashMap, InsertFindErase) {
+  util::FlatHashMap<int> map;
+  EXPECT_EQ(map.Find(MakeKey(1)), nullptr);
+  EXPECT_FALSE(map.Erase(MakeKey(1)));
+  EXPECT_TRUE(map.Insert(MakeKey(1), 10).second);
+  EXPECT_FALSE(map.Insert(MakeKey(1), 20).second);
+  EXPECT_EQ(*map.Find(MakeKey(1)), 10);
+  map[MakeKey(2)] += 5;
+  EXPECT_EQ(*map.Find(MakeKey(2)), 5);
+  EXPECT_EQ(map.Size(), 2);
+  EXPECT_TRUE(map.Erase(MakeKey(1)));
+  EXPECT_EQ(map.Find(MakeKey(1)), nullptr);
+  EXPECT_EQ(map.Size(), 1);
+}
+
+// NOLINTNEXTLINE
+TEST(FlatHashMap, Random) {
+  util::FlatHashMap<uint32_t> map;
+  std::unordered_map<uint32_t, uint32_t> expected;
+  std::mt19937 rng(42);
+  for (int i = 0; i < 100000; i++) {
+    uint32_t id = rng() % 1000;
+    if (rng() % 3 == 0) {
+      EXPECT_EQ(map.Erase(MakeKey(id)), expected.erase(id) == 1);
+    } else {
+      EXPECT_EQ(map.Insert(MakeKey(id), i).second,
+                expected.emplace(id, i).second);
+    }
+  }
+  EXPECT_EQ(map.Size(), expected.size());
+  for (uint32_t id = 0; id < 1000; id++) {
+    const uint32_t* value = map.Find(MakeKey(id));
+    if (expected.count(id)) {
+      ASSERT_NE(value, nullptr);
+      EXPECT_EQ(*value, expected[id]);
+    } else {
+      EXPECT_EQ(value, nullptr);
+    }
+  }
+  size_t count = 0;
+  map.ForEach(
+      [&count](const util::SHA256Key& key, uint32_t value) { count++; });
+  EXPECT_EQ(count, expected.size());
+}
+
+}  // namespace
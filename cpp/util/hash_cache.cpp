@@ -0,0 +1,170 @@
+#include "util/hash_cache.hpp"
+#include <capnp/message.h>
+#include <capnp/serialize.h>
+#include <kj/debug.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <atomic>
+#include <ctime>
+#include <exception>
+#include <system_error>
+#include <thread>
+#include "capnp/store.capnp.h"
+#include "util/file.hpp"
+
+namespace {
+const constexpr int64_t kNsPerSec = 1000000000;
+
+// Files modified this recently may be modified again without changing their
+// modification time, depending on the resolution of the filesystem.
+const constexpr int64_t kRacyNs = 2 * kNsPerSec;
+
+bool Stat(const std::string& path, struct stat* buf) {
+  return stat(path.c_str(), buf) != -1 && S_ISREG(buf->st_mode);
+}
+
+uint64_t MtimeNs(const struct stat& buf) {
+#ifdef __APPLE__
+  const struct timespec& mtime = buf.st_mtimespec;
+#else
+  const struct timespec& mtime = buf.st_mtim;
+#endif
+  return static_cast<uint64_t>(mtime.tv_sec) * kNsPerSec + mtime.tv_nsec;
+}
+
+int64_t NowNs() {
+  struct timespec now {};
+  clock_gettime(CLOCK_REALTIME, &now);
+  return static_cast<int64_t>(now.tv_sec) * kNsPerSec + now.tv_nsec;
+}
+}  // namespace
+
+namespace util {
+
+HashCache::HashCache(std::string path) : path_(std::move(path)) {
+  if (path_.empty() || !File::Exists(path_)) return;
+  KJ_IF_MAYBE(exc, kj::runCatchingExceptions([this]() {
+                MappedFile mapped(path_);
+                auto data = mapped.Data();
+                kj::ArrayPtr<const capnp::word> words(
+                    reinterpret_cast<const capnp::word*>(data.begin()),
+                    data.size() / sizeof(capnp::word));
+                capnp::ReaderOptions options;
+                options.traversalLimitInWords = kj::maxValue;
+                capnp::FlatArrayMessageReader reader(words, options);
+                auto files =
+                    reader.getRoot<capnproto::HashCacheIndex>().getFiles();
+                // The files are saved starting from the most recently used.
+                last_use_ = files.size();
+                uint64_t last_use = files.size();
+                for (auto file : files) {
+                  Key key{file.getDevice(), file.getInode(), file.getSize(),
+                          file.getMtimeNs()};
+                  entries_.emplace(key,
+                                   Entry{SHA256_t(file.getHash()), last_use--});
+                }
+              })) {
+    KJ_LOG(WARNING, "Invalid hash cache, ignoring it", *exc);
+    entries_.clear();
+    last_use_ = 0;
+  }
+}
+
+HashCache::~HashCache() {
+  KJ_IF_MAYBE(exc, kj::runCatchingExceptions([this]() { Save(); })) {
+    KJ_LOG(WARNING, "Failed to save the hash cache", *exc);
+  }
+}
+
+SHA256_t HashCache::Hash(const std::string& path) {
+  struct stat before {};
+  // Small files are cheap to hash, and their hash holds their contents.
+  if (!Stat(path, &before) ||
+      static_cast<uint64_t>(before.st_size) < kInlineChunkThresh) {
+    return File::Hash(path);
+  }
+  Key key{static_cast<uint64_t>(before.st_dev),
+          static_cast<uint64_t>(before.st_ino),
+          static_cast<uint64_t>(before.st_size), MtimeNs(before)};
+  {
+    std::lock_guard<std::mutex> lck(mutex_);
+    auto it = entries_.find(key);
+    if (it != entries_.end()) {
+      it->second.last_use = ++last_use_;
+      changed_ = true;
+      return it->second.hash;
+    }
+  }
+  int64_t start = NowNs();
+  SHA256_t hash = File::Hash(path);
+  struct stat after {};
+  if (!Stat(path, &after) || after.st_dev != before.st_dev ||
+      after.st_ino != before.st_ino || after.st_size != before.st_size ||
+      MtimeNs(after) != std::get<3>(key) ||
+      static_cast<int64_t>(std::get<3>(key)) > start - kRacyNs) {
+    return hash;
+  }
+  std::lock_guard<std::mutex> lck(mutex_);
+  entries_.erase(key);
+  entries_.emplace(key, Entry{hash, ++last_use_});
+  changed_ = true;
+  return hash;
+}
+
+std::vector<SHA256_t> HashCache::Hash(const std::vector<std::string>& paths) {
+  std::vector<SHA256_t> hashes(paths.size(), SHA256_t::ZERO);
+  std::vector<std::exception_ptr> errors(paths.size());
+  std::atomic<size_t> next{0};
+  auto work = [&]() {
+    size_t i;
+    while ((i = next++) < paths.size()) {
+      try {
+        hashes[i] = Hash(paths[i]);
+      } catch (...) {
+        errors[i] = std::current_exception();
+      }
+    }
+  };
+  size_t num_threads = std::min<size_t>(
+      std::max(std::thread::hardware_concurrency(), 1U), paths.size());
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < num_threads; i++) threads.emplace_back(work);
+  work();
+  for (auto& thread : threads) thread.join();
+  for (auto& error : errors) {
+    if (error) std::rethrow_exception(error);
+  }
+  return hashes;
+}
+
+void HashCache::Save() {
+  std::lock_guard<std::mutex> lck(mutex_);
+  if (path_.empty() || !changed_) return;
+  std::vector<std::map<Key, Entry>::const_iterator> order;
+  order.reserve(entries_.size());
+  for (auto it = entries_.begin(); it != entries_.end(); ++it) {
+    order.push_back(it);
+  }
+  std::sort(order.begin(), order.end(), [](const auto& a, const auto& b) {
+    return a->second.last_use > b->second.last_use;
+  });
+  if (order.size() > kMaxEntries) order.resize(kMaxEntries);
+  capnp::MallocMessageBuilder builder;
+  auto files =
+      builder.initRoot<capnproto::HashCacheIndex>().initFiles(order.size());
+  for (size_t i = 0; i < order.size(); i++) {
+    const Key& key = order[i]->first;
+    files[i].setDevice(std::get<0>(key));
+    files[i].setInode(std::get<1>(key));
+    files[i].setSize(std::get<2>(key));
+    files[i].setMtimeNs(std::get<3>(key));
+    order[i]->second.hash.ToCapnp(files[i].initHash());
+  }
+  auto words = capnp::messageToFlatArray(builder);
+  auto receiver = File::Write(path_, /*overwrite=*/true);
+  receiver(words.asBytes());
+  receiver({});
+  changed_ = false;
+}
+
+}  // namespace util
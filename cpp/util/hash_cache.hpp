@@ -0,0 +1,57 @@
+#ifndef UTIL_HASH_CACHE_HPP
+#define UTIL_HASH_CACHE_HPP
+#include <kj/common.h>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <tuple>
+#include <vector>
+#include "util/sha256.hpp"
+
+namespace util {
+
+// Remembers the hashes of the files on the local disk, so that they are
+// computed again only when the files change. A file is considered unchanged
+// while its device, inode, size and modification time are the same. All the
+// methods are thread safe.
+class HashCache {
+ public:
+  // Maximum number of hashes that are saved, the least recently used ones are
+  // dropped first.
+  static const constexpr size_t kMaxEntries = 1 << 20;
+
+  // Loads the hashes saved in path, if any. An empty path disables saving.
+  explicit HashCache(std::string path = "");
+  ~HashCache();
+  KJ_DISALLOW_COPY(HashCache);
+
+  // Same as File::Hash(path).
+  SHA256_t Hash(const std::string& path);
+
+  // Hashes all the files using a thread per core, and returns the hashes in
+  // the same order. If some file cannot be hashed, the first error is thrown
+  // once all the threads are done.
+  std::vector<SHA256_t> Hash(const std::vector<std::string>& paths);
+
+  // Writes the hashes to the path given to the constructor.
+  void Save();
+
+ private:
+  // Device, inode, size and modification time in nanoseconds.
+  using Key = std::tuple<uint64_t, uint64_t, uint64_t, uint64_t>;
+  struct Entry {
+    SHA256_t hash;
+    uint64_t last_use;
+  };
+
+  std::string path_;
+  std::mutex mutex_;
+  std::map<Key, Entry> entries_;
+  uint64_t last_use_ = 0;
+  bool changed_ = false;
+};
+
+}  // namespace util
+
+#endif
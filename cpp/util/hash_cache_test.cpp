@@ -0,0 +1,87 @@
+#include "util/hash_cache.hpp"
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <fstream>
+#include <system_error>
+#include "gtest/gtest.h"
+#include "util/file.hpp"
+
+namespace {
+
+const std::string test_tmpdir = "/tmp/task_maker_testdir";
+
+// Writes the file and sets its modification time to one hour ago, so that it
+// is not considered as recently modified.
+void writeOldFile(const std::string& path, const std::string& content) {
+  {
+    std::ofstream of(path);
+    of << content;
+  }
+  struct timespec times[2];
+  clock_gettime(CLOCK_REALTIME, &times[0]);
+  times[0].tv_sec -= 3600;
+  times[1] = times[0];
+  ASSERT_EQ(utimensat(AT_FDCWD, path.c_str(), times, 0), 0);
+}
+
+// NOLINTNEXTLINE
+TEST(HashCache, Hash) {
+  util::TempDir tmp(test_tmpdir);
+  std::string path = util::File::JoinPath(tmp.Path(), "file");
+  std::string small = util::File::JoinPath(tmp.Path(), "small");
+  writeOldFile(path, std::string(util::kInlineChunkThresh, 'a'));
+  writeOldFile(small, "small");
+  util::HashCache cache;
+  EXPECT_EQ(cache.Hash(path).Hex(), util::File::Hash(path).Hex());
+  EXPECT_TRUE(cache.Hash(small).hasContents());
+  EXPECT_THROW(cache.Hash(tmp.Path() + "/no/such/file"),  // NOLINT
+               std::system_error);
+}
+
+// NOLINTNEXTLINE
+TEST(HashCache, Persistent) {
+  util::TempDir tmp(test_tmpdir);
+  std::string path = util::File::JoinPath(tmp.Path(), "file");
+  std::string index = util::File::JoinPath(tmp.Path(), "hashes");
+  writeOldFile(path, std::string(util::kInlineChunkThresh, 'a'));
+  std::string hash = util::File::Hash(path).Hex();
+  {
+    util::HashCache cache(index);
+    EXPECT_EQ(cache.Hash(path).Hex(), hash);
+  }
+  // Change the contents, but not the size and the modification time.
+  struct stat buf {};
+  ASSERT_EQ(stat(path.c_str(), &buf), 0);
+  writeOldFile(path, std::string(util::kInlineChunkThresh, 'b'));
+  struct timespec times[2] = {buf.st_mtim, buf.st_mtim};
+  ASSERT_EQ(utimensat(AT_FDCWD, path.c_str(), times, 0), 0);
+  {
+    util::HashCache cache(index);
+    EXPECT_EQ(cache.Hash(path).Hex(), hash);
+  }
+  times[0].tv_sec = times[1].tv_sec -= 10;
+  ASSERT_EQ(utimensat(AT_FDCWD, path.c_str(), times, 0), 0);
+  util::HashCache cache(index);
+  EXPECT_EQ(cache.Hash(path).Hex(), util::File::Hash(path).Hex());
+  EXPECT_NE(cache.Hash(path).Hex(), hash);
+}
+
+// NOLINTNEXTLINE
+TEST(HashCache, HashAll) {
+  util::TempDir tmp(test_tmpdir);
+  std::vector<std::string> paths;
+  for (int i = 0; i < 10; i++) {
+    paths.push_back(util::File::JoinPath(tmp.Path(), std::to_string(i)));
+    writeOldFile(paths.back(), std::string(i * 1000, 'x'));
+  }
+  util::HashCache cache;
+  std::vector<util::SHA256_t> hashes = cache.Hash(paths);
+  ASSERT_EQ(hashes.size(), paths.size());
+  for (size_t i = 0; i < paths.size(); i++) {
+    EXPECT_EQ(hashes[i].Hex(), util::File::Hash(paths[i]).Hex());
+  }
+  paths.push_back(tmp.Path() + "/no/such/file");
+  EXPECT_THROW(cache.Hash(paths), std::system_error);  // NOLINT
+}
+
+}  // namespace
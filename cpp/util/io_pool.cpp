@@ -0,0 +1,113 @@
+#include "util/io_pool.hpp"
+
+#include <kj/debug.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <memory>
+#include "util/misc.hpp"
+
+namespace util {
+
+IoPool::IoPool(kj::LowLevelAsyncIoProvider* async_io_provider,
+               size_t num_threads)
+    : async_io_provider_(async_io_provider) {
+  for (size_t i = 0; i < num_threads; i++) {
+    threads_.emplace_back([this]() { Loop(); });
+  }
+}
+
+IoPool::~IoPool() {
+  {
+    std::lock_guard<std::mutex> lck(mutex_);
+    stop_ = true;
+  }
+  cv_.notify_all();
+  for (auto& thread : threads_) thread.join();
+  std::unique_lock<std::mutex> lck(mutex_);
+  dedicated_done_.wait(lck, [this]() { return dedicated_ == 0; });
+}
+
+void IoPool::Loop() {
+  while (true) {
+    std::function<void()> job;
+    {
+      std::unique_lock<std::mutex> lck(mutex_);
+      cv_.wait(lck, [this]() { return stop_ || !jobs_.empty(); });
+      // The queued jobs are completed before stopping, so that all the pipes
+      // get written and closed.
+      if (jobs_.empty()) return;
+      job = std::move(jobs_.front());
+      jobs_.pop_front();
+    }
+    job();
+  }
+}
+
+kj::Promise<void> IoPool::Run(std::function<void()> job) {
+  auto wrapped = Wrap(std::move(job));
+  {
+    std::lock_guard<std::mutex> lck(mutex_);
+    jobs_.push_back(std::move(wrapped.first));
+  }
+  cv_.notify_one();
+  return std::move(wrapped.second);
+}
+
+kj::Promise<void> IoPool::RunDedicated(std::function<void()> job) {
+  auto wrapped = Wrap(std::move(job));
+  {
+    std::lock_guard<std::mutex> lck(mutex_);
+    dedicated_++;
+  }
+  std::thread([this, job = std::move(wrapped.first)]() {
+    job();
+    std::lock_guard<std::mutex> lck(mutex_);
+    dedicated_--;
+    dedicated_done_.notify_all();
+  }).detach();
+  return std::move(wrapped.second);
+}
+
+std::pair<std::function<void()>, kj::Promise<void>> IoPool::Wrap(
+    std::function<void()> job) {
+  int fds[2];
+  // The sandboxes must not inherit the pipe.
+  int ret = PipeCloexec(fds);
+  KJ_ASSERT(ret != -1, "pipe", strerror(errno));
+
+  struct State {
+    std::mutex mutex;
+    kj::Maybe<kj::Exception> exception;
+  };
+  auto state = std::make_shared<State>();
+  std::function<void()> wrapped = [job = std::move(job), state,
+                                   fd = fds[1]]() {
+    KJ_IF_MAYBE(exc, kj::runCatchingExceptions(job)) {
+      std::lock_guard<std::mutex> lck(state->mutex);
+      state->exception = std::move(*exc);
+    }
+    // The read end is closed if the promise was dropped: kj ignores
+    // SIGPIPE, so the write just fails.
+    char done = 0;
+    while (write(fd, &done, 1) == -1 && errno == EINTR) {
+    }
+    close(fd);
+  };
+
+  auto in = async_io_provider_->wrapInputFd(
+      fds[0], kj::LowLevelAsyncIoProvider::TAKE_OWNERSHIP);
+  auto buf = kj::heap<char>(0);
+  auto read = in->tryRead(buf.get(), 1, 1);
+  kj::Promise<void> done =
+      read.then([state](size_t size) -> kj::Promise<void> {
+            KJ_ASSERT(size == 1, "I/O job did not complete");
+            std::lock_guard<std::mutex> lck(state->mutex);
+            KJ_IF_MAYBE(exc, state->exception) { return std::move(*exc); }
+            return kj::READY_NOW;
+          })
+          .attach(std::move(in), std::move(buf));
+  return {std::move(wrapped), std::move(done)};
+}
+
+}  // namespace util
@@ -0,0 +1,56 @@
+#ifndef UTIL_IO_POOL_HPP
+#define UTIL_IO_POOL_HPP
+#include <kj/async-io.h>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace util {
+
+// Pool of threads that run blocking filesystem and hashing operations away
+// from the event loop. The completion of each job is signaled through a pipe
+// that the event loop waits on, since this version of kj cannot fulfill
+// promises from other threads.
+//
+// Jobs run after the promise that waits for them may have been dropped:
+// they should only capture things by value or through shared ownership, and
+// leave anything that is not thread safe to the continuation of the promise.
+class IoPool {
+ public:
+  IoPool(kj::LowLevelAsyncIoProvider* async_io_provider, size_t num_threads);
+  ~IoPool();
+  KJ_DISALLOW_COPY(IoPool);
+
+  // Runs job on one of the threads. Exceptions thrown by the job are
+  // propagated through the returned promise.
+  kj::Promise<void> Run(std::function<void()> job);
+
+  // As Run, but on a new thread of its own, for jobs that block for as long
+  // as another operation lasts and would keep a thread of the pool from the
+  // short jobs. The destructor waits for these jobs too.
+  kj::Promise<void> RunDedicated(std::function<void()> job);
+
+ private:
+  void Loop();
+  // Returns job wrapped to report its outcome to the returned promise.
+  std::pair<std::function<void()>, kj::Promise<void>> Wrap(
+      std::function<void()> job);
+
+  kj::LowLevelAsyncIoProvider* async_io_provider_;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::deque<std::function<void()>> jobs_;
+  bool stop_ = false;
+  std::vector<std::thread> threads_;
+  // Number of dedicated threads still running.
+  size_t dedicated_ = 0;
+  std::condition_variable dedicated_done_;
+};
+
+}  // namespace util
+
+#endif
@@ -0,0 +1,57 @@
+#include "util/io_pool.hpp"
+#include <kj/async-io.h>
+#include <kj/debug.h>
+#include <kj/vector.h>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include "gtest/gtest.h"
+
+namespace {
+
+// NOLINTNEXTLINE
+TEST(IoPool, RunsJobsOnOtherThreads) {
+  auto io = kj::setupAsyncIo();
+  util::IoPool pool(io.lowLevelProvider.get(), 4);
+  auto count = std::make_shared<std::atomic<int>>(0);
+  std::thread::id loop_thread = std::this_thread::get_id();
+  auto other_thread = std::make_shared<std::atomic<bool>>(true);
+  kj::Vector<kj::Promise<void>> jobs;
+  for (int i = 0; i < 100; i++) {
+    jobs.add(pool.Run([count, other_thread, loop_thread]() {
+      if (std::this_thread::get_id() == loop_thread) *other_thread = false;
+      ++*count;
+    }));
+  }
+  kj::joinPromises(jobs.releaseAsArray()).wait(io.waitScope);
+  EXPECT_EQ(*count, 100);
+  EXPECT_TRUE(*other_thread);
+}
+
+// NOLINTNEXTLINE
+TEST(IoPool, PropagatesExceptions) {
+  auto io = kj::setupAsyncIo();
+  util::IoPool pool(io.lowLevelProvider.get(), 1);
+  auto failing = pool.Run([]() { KJ_FAIL_ASSERT("job failed"); });
+  EXPECT_ANY_THROW(failing.wait(io.waitScope));
+  // The pool keeps working after a failure.
+  bool done = false;
+  pool.Run([]() {}).then([&done]() { done = true; }).wait(io.waitScope);
+  EXPECT_TRUE(done);
+}
+
+// NOLINTNEXTLINE
+TEST(IoPool, DedicatedJobsDoNotTakePoolThreads) {
+  auto io = kj::setupAsyncIo();
+  util::IoPool pool(io.lowLevelProvider.get(), 1);
+  auto released = std::make_shared<std::atomic<bool>>(false);
+  // The dedicated job only ends after a job of the pool ran.
+  auto waiting = pool.RunDedicated([released]() {
+    while (!*released) std::this_thread::yield();
+  });
+  pool.Run([released]() { *released = true; }).wait(io.waitScope);
+  waiting.wait(io.waitScope);
+  EXPECT_TRUE(*released);
+}
+
+}  // namespace
@@ -0,0 +1,84 @@
+#include "util/join.hpp"
+#include <kj/debug.h>
+
+namespace util {
+
+Join::Join(bool fatal_failure)
+    : state_(std::make_shared<State>(fatal_failure)) {}
+
+void Join::OnReady(std::function<void()> on_ready) {
+  state_->on_ready = std::move(on_ready);
+}
+
+void Join::OnFailure(std::function<void(kj::Exception)> on_failure) {
+  state_->on_failure = std::move(on_failure);
+}
+
+void Join::State::Done() {
+  pending--;
+  if (!finalized || pending != 0 || settled) return;
+  settled = true;
+  if (fulfiller) fulfiller->fulfill();
+  if (on_ready) on_ready();
+}
+
+void Join::State::Fail(kj::Exception exc) {
+  if (!fatal_failure) {
+    Done();
+    return;
+  }
+  pending--;
+  if (settled) return;
+  settled = true;
+  failure = kj::cp(exc);
+  if (on_failure) on_failure(kj::cp(exc));
+  if (fulfiller) fulfiller->reject(std::move(exc));
+  // The dependencies that are still pending will not be used.
+  for (size_t i = 0; i < thens.size(); i++) Release(i);
+}
+
+void Join::State::Release(size_t index) {
+  std::shared_ptr<State> next = std::move(thens[index]);
+  if (next) next->Done();
+}
+
+void Join::AddPromise(kj::Promise<void> p, kj::Maybe<Join> then) {
+  Add();
+  // The promise is owned by the state, so it does not keep it alive.
+  State* state = state_.get();
+  size_t index = state->thens.size();
+  state->thens.add(nullptr);
+  KJ_IF_MAYBE(next, then) {
+    next->Add();
+    state->thens.back() = next->state_;
+  }
+  state->promises.add(p.then(
+                           [state, index]() {
+                             state->Done();
+                             state->Release(index);
+                           },
+                           [state, index](kj::Exception exc) {
+                             state->Fail(std::move(exc));
+                             state->Release(index);
+                           })
+                          .eagerlyEvaluate(nullptr));
+}
+
+kj::Promise<void> Join::Finalize() {
+  KJ_REQUIRE(!state_->finalized, "Join finalized twice");
+  state_->finalized = true;
+  if (state_->settled) {
+    KJ_IF_MAYBE(exc, state_->failure) { return kj::cp(*exc); }
+    return kj::READY_NOW;
+  }
+  if (state_->pending == 0) {
+    state_->settled = true;
+    if (state_->on_ready) state_->on_ready();
+    return kj::READY_NOW;
+  }
+  auto pf = kj::newPromiseAndFulfiller<void>();
+  state_->fulfiller = std::move(pf.fulfiller);
+  return pf.promise.attach(std::shared_ptr<State>(state_));
+}
+
+}  // namespace util
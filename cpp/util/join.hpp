@@ -0,0 +1,71 @@
+#ifndef UTIL_JOIN_HPP
+#define UTIL_JOIN_HPP
+#include <kj/async.h>
+#include <kj/vector.h>
+#include <functional>
+#include <memory>
+
+namespace util {
+
+// Waits for many dependencies with a counter. It works like
+// UnionPromiseBuilder, but a dependency has no promise, fulfiller or name of
+// its own: adding one costs an increment, plus the promise it is added with,
+// if any.
+//
+// A Join is a handle, and its copies share the same dependencies, so that
+// they can be added and settled through the copies even after Finalize.
+// With fatal_failure the promise of Finalize fails as soon as a dependency
+// fails. Otherwise the failures just count as settled dependencies.
+class Join {
+ public:
+  explicit Join(bool fatal_failure = true);
+
+  // Called synchronously when the promise of Finalize resolves or fails. Only
+  // the last callback of each kind is kept.
+  void OnReady(std::function<void()> on_ready);
+  void OnFailure(std::function<void(kj::Exception)> on_failure);
+
+  // Adds a dependency, that has to be settled with Done or Fail.
+  void Add() { state_->pending++; }
+  void Done() { state_->Done(); }
+  void Fail(kj::Exception exc) { state_->Fail(std::move(exc)); }
+
+  // Adds p as a dependency. If then is given, one of its dependencies is added
+  // now and settled once p is settled, after this join has processed p, or as
+  // soon as this join fails.
+  void AddPromise(kj::Promise<void> p, kj::Maybe<Join> then = nullptr);
+
+  // Returns a promise that resolves once all the dependencies are settled.
+  // Dependencies can still be added until it resolves. Only one handle can
+  // call it, once.
+  kj::Promise<void> Finalize();
+
+ private:
+  struct State {
+    explicit State(bool fatal_failure) : fatal_failure(fatal_failure) {}
+    void Done();
+    void Fail(kj::Exception exc);
+    // Settles the dependency of then of the index-th promise, if any.
+    void Release(size_t index);
+
+    bool fatal_failure;
+    size_t pending = 0;
+    bool finalized = false;
+    // Whether the promise of Finalize resolved or failed.
+    bool settled = false;
+    kj::Maybe<kj::Exception> failure;
+    kj::Own<kj::PromiseFulfiller<void>> fulfiller;
+    std::function<void()> on_ready;
+    std::function<void(kj::Exception)> on_failure;
+    // The promises given to AddPromise, that refer to the state, and the
+    // joins to settle after them.
+    kj::Vector<kj::Promise<void>> promises;
+    kj::Vector<std::shared_ptr<State>> thens;
+  };
+
+  std::shared_ptr<State> state_;
+};
+
+}  // namespace util
+
+#endif
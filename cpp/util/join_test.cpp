@@ -0,0 +1,109 @@
+#include "util/join.hpp"
+#include <kj/async.h>
+#include <kj/debug.h>
+#include <vector>
+#include "gtest/gtest.h"
+
+namespace {
+
+kj::Exception getError() {
+  return kj::Exception(kj::Exception::Type::FAILED, kj::String(), 0,
+                       kj::str("oh no!"));
+}
+
+// NOLINTNEXTLINE
+TEST(Join, NoDependencies) {
+  kj::EventLoop loop;
+  kj::WaitScope waitScope(loop);
+  util::Join join;
+  bool ready = false;
+  join.OnReady([&ready]() { ready = true; });
+  join.Finalize().wait(waitScope);
+  EXPECT_TRUE(ready);
+}
+
+// NOLINTNEXTLINE
+TEST(Join, ManyPromises) {
+  kj::EventLoop loop;
+  kj::WaitScope waitScope(loop);
+  util::Join join;
+  std::vector<kj::Own<kj::PromiseFulfiller<void>>> fulfillers;
+  for (int i = 0; i < 1000; i++) {
+    auto pf = kj::newPromiseAndFulfiller<void>();
+    join.AddPromise(std::move(pf.promise));
+    fulfillers.push_back(std::move(pf.fulfiller));
+  }
+  bool ready = false;
+  auto promise = join.Finalize().then([&ready]() { ready = true; });
+  for (size_t i = 0; i + 1 < fulfillers.size(); i++) fulfillers[i]->fulfill();
+  loop.run();
+  EXPECT_FALSE(ready);
+  fulfillers.back()->fulfill();
+  promise.wait(waitScope);
+  EXPECT_TRUE(ready);
+}
+
+// NOLINTNEXTLINE
+TEST(Join, AddAfterFinalize) {
+  kj::EventLoop loop;
+  kj::WaitScope waitScope(loop);
+  util::Join join;
+  join.Add();
+  util::Join copy = join;
+  bool ready = false;
+  auto promise = join.Finalize().then([&ready]() { ready = true; });
+  copy.Add();
+  copy.Done();
+  loop.run();
+  EXPECT_FALSE(ready);
+  copy.Done();
+  promise.wait(waitScope);
+  EXPECT_TRUE(ready);
+}
+
+// NOLINTNEXTLINE
+TEST(Join, FatalFailure) {
+  kj::EventLoop loop;
+  kj::WaitScope waitScope(loop);
+  util::Join join;
+  auto pf = kj::newPromiseAndFulfiller<void>();
+  join.AddPromise(std::move(pf.promise));
+  join.Add();
+  bool failed = false;
+  join.OnFailure([&failed](kj::Exception) { failed = true; });
+  auto promise = join.Finalize();
+  pf.fulfiller->reject(getError());
+  EXPECT_ANY_THROW(promise.wait(waitScope));
+  EXPECT_TRUE(failed);
+}
+
+// NOLINTNEXTLINE
+TEST(Join, NonFatalFailure) {
+  kj::EventLoop loop;
+  kj::WaitScope waitScope(loop);
+  util::Join join(false);
+  join.AddPromise(kj::Promise<void>(getError()));
+  join.AddPromise(kj::READY_NOW);
+  bool ready = false;
+  join.OnReady([&ready]() { ready = true; });
+  join.Finalize().wait(waitScope);
+  EXPECT_TRUE(ready);
+}
+
+// NOLINTNEXTLINE
+TEST(Join, SettlesThenAfterCallbacks) {
+  kj::EventLoop loop;
+  kj::WaitScope waitScope(loop);
+  util::Join join;
+  util::Join then;
+  std::vector<int> order;
+  join.AddPromise(kj::READY_NOW, then);
+  join.OnReady([&order]() { order.push_back(1); });
+  then.OnReady([&order]() { order.push_back(2); });
+  auto promise = join.Finalize();
+  then.Finalize().wait(waitScope);
+  promise.wait(waitScope);
+  EXPECT_EQ(order, std::vector<int>({1, 2}));
+}
+
+}  // namespace
@@ -0,0 +1,111 @@
+#include "util/journal.hpp"
+
+#include <fcntl.h>
+#include <kj/debug.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <system_error>
+
+namespace {
+void PutLittleEndian(uint64_t value, size_t bytes, kj::byte* out) {
+  for (size_t i = 0; i < bytes; i++) out[i] = (value >> (8 * i)) & 0xff;
+}
+
+uint64_t GetLittleEndian(const kj::byte* in, size_t bytes) {
+  uint64_t value = 0;
+  for (size_t i = 0; i < bytes; i++) value |= uint64_t(in[i]) << (8 * i);
+  return value;
+}
+
+size_t Padded(size_t size) { return (size + 7) / 8 * 8; }
+}  // namespace
+
+namespace util {
+
+Journal::Journal(const std::string& path, bool truncate) {
+  int flags = O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC;
+  if (truncate) flags |= O_TRUNC;
+  fd_ = open(path.c_str(), flags, S_IRUSR | S_IWUSR);
+  if (fd_ == -1) {
+    throw std::system_error(errno, std::system_category(), "open " + path);
+  }
+  thread_ = std::thread([this]() { Loop(); });
+}
+
+Journal::~Journal() {
+  {
+    std::lock_guard<std::mutex> lck(mutex_);
+    stop_ = true;
+  }
+  cv_.notify_one();
+  thread_.join();
+  close(fd_);
+}
+
+void Journal::Append(kj::ArrayPtr<const kj::byte> data) {
+  KJ_REQUIRE(data.size() <= UINT32_MAX, "Record too big", data.size());
+  kj::byte header[kHeaderSize];
+  PutLittleEndian(kMagic, 4, header);
+  PutLittleEndian(data.size(), 4, header + 4);
+  PutLittleEndian(Checksum(data), 8, header + 8);
+  {
+    std::lock_guard<std::mutex> lck(mutex_);
+    buffer_.insert(buffer_.end(), header, header + kHeaderSize);
+    buffer_.insert(buffer_.end(), data.begin(), data.end());
+    buffer_.resize(Padded(buffer_.size()), 0);
+  }
+  cv_.notify_one();
+}
+
+void Journal::Loop() {
+  std::vector<kj::byte> batch;
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lck(mutex_);
+      cv_.wait(lck, [this]() { return stop_ || !buffer_.empty(); });
+      if (buffer_.empty()) return;
+      batch.swap(buffer_);
+    }
+    size_t pos = 0;
+    while (pos < batch.size()) {
+      ssize_t written = write(fd_, batch.data() + pos, batch.size() - pos);
+      if (written == -1 && errno == EINTR) continue;
+      if (written == -1) {
+        KJ_LOG(ERROR, "Failed to write the journal", strerror(errno));
+        break;
+      }
+      pos += written;
+    }
+    batch.clear();
+  }
+}
+
+bool Journal::IsRecord(kj::ArrayPtr<const kj::byte> data) {
+  return data.size() >= 4 && GetLittleEndian(data.begin(), 4) == kMagic;
+}
+
+kj::Maybe<kj::ArrayPtr<const kj::byte>> Journal::ReadRecord(
+    kj::ArrayPtr<const kj::byte> data, size_t* size) {
+  if (data.size() < kHeaderSize || !IsRecord(data)) return nullptr;
+  size_t payload = GetLittleEndian(data.begin() + 4, 4);
+  if (data.size() - kHeaderSize < Padded(payload)) return nullptr;
+  auto contents = data.slice(kHeaderSize, kHeaderSize + payload);
+  if (Checksum(contents) != GetLittleEndian(data.begin() + 8, 8)) {
+    return nullptr;
+  }
+  *size = kHeaderSize + Padded(payload);
+  return contents;
+}
+
+uint64_t Journal::Checksum(kj::ArrayPtr<const kj::byte> data) {
+  // FNV-1a.
+  uint64_t hash = 14695981039346656037ULL;
+  for (kj::byte b : data) {
+    hash ^= b;
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+}  // namespace util
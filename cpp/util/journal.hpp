@@ -0,0 +1,60 @@
+#ifndef UTIL_JOURNAL_HPP
+#define UTIL_JOURNAL_HPP
+#include <kj/common.h>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace util {
+
+// Appends records to a file from a background thread. The records appended
+// while a write is in progress are written together by the next one, so that
+// a burst of records costs a few system calls instead of one per record.
+//
+// Each record is a header of two words, a magic number with the size of the
+// payload and a checksum of the payload, followed by the payload padded to a
+// multiple of 8 bytes. A crash can leave a partial record at the end of the
+// file, which ReadRecord rejects. The magic number cannot start a Cap'n Proto
+// message, so records can follow messages written without a header.
+class Journal {
+ public:
+  static const constexpr uint32_t kMagic = 0x4a4b4d54;
+  static const constexpr size_t kHeaderSize = 16;
+
+  // Opens the file at path for appending, emptying it first if truncate is
+  // set.
+  explicit Journal(const std::string& path, bool truncate = false);
+  // Writes the records that were appended, and closes the file.
+  ~Journal();
+  KJ_DISALLOW_COPY(Journal);
+
+  // Queues a copy of data as a new record.
+  void Append(kj::ArrayPtr<const kj::byte> data);
+
+  // Returns true if data starts with the header of a record, valid or not.
+  static bool IsRecord(kj::ArrayPtr<const kj::byte> data);
+
+  // Returns the payload of the record at the start of data, or nullptr if it
+  // is truncated or its checksum does not match. Sets *size to the size of
+  // the whole record.
+  static kj::Maybe<kj::ArrayPtr<const kj::byte>> ReadRecord(
+      kj::ArrayPtr<const kj::byte> data, size_t* size);
+
+ private:
+  static uint64_t Checksum(kj::ArrayPtr<const kj::byte> data);
+  void Loop();
+
+  int fd_;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::vector<kj::byte> buffer_;
+  bool stop_ = false;
+  std::thread thread_;
+};
+
+}  // namespace util
+
+#endif
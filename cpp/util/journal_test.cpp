@@ -0,0 +1,86 @@
+#include "util/journal.hpp"
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+#include "gtest/gtest.h"
+#include "util/file.hpp"
+
+namespace {
+
+const std::string test_tmpdir = "/tmp/task_maker_testdir";
+
+std::string ReadFile(const std::string& path) {
+  std::ifstream in(path);
+  return std::string(std::istreambuf_iterator<char>(in),
+                     std::istreambuf_iterator<char>());
+}
+
+kj::ArrayPtr<const kj::byte> Bytes(const std::string& data) {
+  return kj::arrayPtr(reinterpret_cast<const kj::byte*>(data.data()),  // NOLINT
+                      data.size());
+}
+
+// Returns the payloads of the valid records at the start of data.
+std::vector<std::string> ReadRecords(const std::string& data) {
+  std::vector<std::string> records;
+  auto bytes = Bytes(data);
+  size_t size = 0;
+  while (bytes.size() > 0) {
+    KJ_IF_MAYBE(payload, util::Journal::ReadRecord(bytes, &size)) {
+      records.emplace_back(
+          reinterpret_cast<const char*>(payload->begin()),  // NOLINT
+          payload->size());
+      bytes = bytes.slice(size, bytes.size());
+    } else {
+      break;
+    }
+  }
+  return records;
+}
+
+// NOLINTNEXTLINE
+TEST(Journal, AppendAndRead) {
+  util::TempDir tmp(test_tmpdir);
+  std::string path = tmp.Path() + "/journal";
+  {
+    util::Journal journal(path);
+    journal.Append(Bytes("first"));
+    journal.Append(Bytes(""));
+    journal.Append(Bytes("the third record"));
+  }
+  {
+    util::Journal journal(path);
+    journal.Append(Bytes("appended"));
+  }
+  std::string data = ReadFile(path);
+  EXPECT_EQ(data.size() % 8, 0);
+  EXPECT_TRUE(util::Journal::IsRecord(Bytes(data)));
+  EXPECT_EQ(ReadRecords(data),
+            std::vector<std::string>(
+                {"first", "", "the third record", "appended"}));
+  {
+    util::Journal journal(path, /*truncate=*/true);
+    journal.Append(Bytes("only"));
+  }
+  EXPECT_EQ(ReadRecords(ReadFile(path)), std::vector<std::string>({"only"}));
+}
+
+// NOLINTNEXTLINE
+TEST(Journal, TornRecords) {
+  util::TempDir tmp(test_tmpdir);
+  std::string path = tmp.Path() + "/journal";
+  {
+    util::Journal journal(path);
+    journal.Append(Bytes("first"));
+    journal.Append(Bytes("second"));
+  }
+  std::string data = ReadFile(path);
+  EXPECT_EQ(ReadRecords(data.substr(0, data.size() - 1)),
+            std::vector<std::string>({"first"}));
+  data[data.size() - 8] ^= 1;
+  EXPECT_EQ(ReadRecords(data), std::vector<std::string>({"first"}));
+  EXPECT_FALSE(util::Journal::IsRecord(Bytes("not a record")));
+}
+
+}  // namespace
@@ -1,7 +1,11 @@
 #include "util/log_manager.hpp"
+#include <string.h>
+#include <unistd.h>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
+#include <sstream>
+#include <utility>
 #include "util/file.hpp"
 #include "util/flags.hpp"
 
@@ -36,52 +40,224 @@ CHECK_MSG(ERROR);
 CHECK_MSG(FATAL);
 CHECK_MSG(DBG);
 
-}  // namespace
+// Messages waiting for the writer. When they are more, the INFO messages are
+// dropped and the others wait.
+const constexpr size_t kQueueSize = 1 << 14;
 
-void LogManager::onRecoverableException(kj::Exception&& exception) {
-  logMessage(kj::LogSeverity::WARNING, exception.getFile(), exception.getLine(),
-             0, kj::heapString(exception.getDescription()));
-  if (::kj::_::Debug::shouldLog(kj::LogSeverity::INFO)) {
-    backward::StackTrace s;
-    s.load_here();
-    backward::Printer p;
-    p.color_mode = backward::ColorMode::always;
-    p.print(s, out);
+// The directory of a source file, like "server" for "cpp/server/server.cpp".
+std::string Subsystem(const char* file) {
+  const char* end = strrchr(file, '/');
+  if (end == nullptr) return "";
+  const char* begin = end;
+  while (begin != file && *(begin - 1) != '/') begin--;
+  return std::string(begin, end);
+}
+
+bool ParseSeverity(const std::string& name, kj::LogSeverity* severity) {
+  for (int i = 0; i < static_cast<int>(sizeof(log_msg) / sizeof(*log_msg));
+       i++) {
+    if (name == log_msg[i]) {
+      *severity = static_cast<kj::LogSeverity>(i);
+      return true;
+    }
   }
+  return false;
+}
+
+}  // namespace
+
+LogManager* LogManager::instance_ = nullptr;
+
+std::string LogManager::Trace() {
+  if (!::kj::_::Debug::shouldLog(kj::LogSeverity::INFO)) return "";
+  backward::StackTrace s;
+  s.load_here();
+  backward::Printer p;
+  p.color_mode = backward::ColorMode::always;
+  std::ostringstream trace;
+  p.print(s, trace);
+  return trace.str();
+}
 
+void LogManager::onRecoverableException(kj::Exception&& exception) {
+  Push({std::time(nullptr), kj::LogSeverity::WARNING, exception.getFile(),
+        exception.getLine(), kj::heapString(exception.getDescription()),
+        Trace()});
   next.onRecoverableException(kj::mv(exception));
 }
+
 void LogManager::onFatalException(kj::Exception&& exception) {
-  logMessage(kj::LogSeverity::FATAL, exception.getFile(), exception.getLine(),
-             0, kj::heapString(exception.getDescription()));
-  if (::kj::_::Debug::shouldLog(kj::LogSeverity::INFO)) {
-    backward::StackTrace s;
-    s.load_here();
-    backward::Printer p;
-    p.color_mode = backward::ColorMode::always;
-    p.print(s, out);
-  }
+  Push({std::time(nullptr), kj::LogSeverity::FATAL, exception.getFile(),
+        exception.getLine(), kj::heapString(exception.getDescription()),
+        Trace()});
   next.onFatalException(kj::mv(exception));
 }
 
-LogManager::LogManager(kj::ProcessContext* context) : out(ChooseOut()) {
+LogManager::LogManager(kj::ProcessContext* context)
+    : out(ChooseOut()), pid_(getpid()), default_level_(kj::LogSeverity::FATAL) {
   if (!out) {
     context->exitError("Invalid log file provided!");
   }
+  for (int i = static_cast<int>(kj::LogSeverity::FATAL); i >= 0; i--) {
+    auto severity = static_cast<kj::LogSeverity>(i);
+    if (::kj::_::Debug::shouldLog(severity)) default_level_ = severity;
+  }
+  kj::LogSeverity lowest = default_level_;
+  std::istringstream levels(Flags::log_levels);
+  std::string item;
+  while (std::getline(levels, item, ',')) {
+    if (item.empty()) continue;
+    size_t eq = item.find('=');
+    kj::LogSeverity severity = kj::LogSeverity::INFO;
+    if (eq == std::string::npos ||
+        !ParseSeverity(item.substr(eq + 1), &severity)) {
+      context->exitError(kj::str("Invalid log level: ", item));
+    }
+    levels_[item.substr(0, eq)] = severity;
+    if (severity < lowest) lowest = severity;
+  }
+  // The other subsystems are filtered by Enabled.
+  ::kj::_::Debug::setLogLevel(lowest);
+  writer_ = std::thread([this]() { Run(); });
+  instance_ = this;
+}
+
+LogManager::~LogManager() {
+  instance_ = nullptr;
+  {
+    std::lock_guard<std::mutex> lck(mutex_);
+    stop_ = true;
+  }
+  queued_.notify_all();
+  writer_.join();
+}
+
+bool LogManager::ShouldLog(kj::LogSeverity severity, const char* file,
+                           int line) {
+  if (!::kj::_::Debug::shouldLog(severity)) return false;
+  LogManager* manager = instance_;
+  if (manager == nullptr) return true;
+  if (!manager->Enabled(severity, file)) return false;
+  if (severity != kj::LogSeverity::INFO || Flags::log_rate == 0) return true;
+  std::lock_guard<std::mutex> lck(manager->mutex_);
+  Site& site = manager->sites_[file][line];
+  if (site.second == std::time(nullptr) && site.count >= Flags::log_rate) {
+    site.suppressed++;
+    return false;
+  }
+  return true;
+}
+
+bool LogManager::Enabled(kj::LogSeverity severity, const char* file) const {
+  if (severity == kj::LogSeverity::DBG) return true;
+  kj::LogSeverity level = default_level_;
+  if (!levels_.empty()) {
+    auto it = levels_.find(Subsystem(file));
+    if (it != levels_.end()) level = it->second;
+  }
+  return severity >= level;
+}
+
+bool LogManager::Limited(const char* file, int line, std::time_t now) {
+  Site& site = sites_[file][line];
+  if (site.second != now) {
+    site.second = now;
+    site.count = 0;
+  }
+  if (site.count >= Flags::log_rate) {
+    site.suppressed++;
+    return true;
+  }
+  site.count++;
+  return false;
 }
 
 void LogManager::logMessage(kj::LogSeverity severity, const char* file,
                             int line, int /* contextDepth */,
                             kj::String&& text) {
-  auto t = std::time(nullptr);
-  auto tm = *std::localtime(&t);
+  if (!Enabled(severity, file)) return;
+  std::time_t now = std::time(nullptr);
+  if (severity == kj::LogSeverity::INFO && Flags::log_rate != 0 &&
+      getpid() == pid_) {
+    std::lock_guard<std::mutex> lck(mutex_);
+    if (Limited(file, line, now)) return;
+    Site& site = sites_[file][line];
+    if (site.suppressed != 0) {
+      text = kj::str(text, " (", site.suppressed,
+                     " messages of this line suppressed)");
+      site.suppressed = 0;
+    }
+  }
+  Push({now, severity, file, line, std::move(text), ""});
+}
+
+void LogManager::Push(Entry entry) {
+  bool urgent = entry.severity == kj::LogSeverity::FATAL;
+  if (getpid() != pid_) {
+    // The writer thread and the state of the locks are not inherited.
+    Write(entry);
+    out.flush();
+    return;
+  }
+  {
+    std::unique_lock<std::mutex> lck(mutex_);
+    if (stop_) {
+      Write(entry);
+      out.flush();
+      return;
+    }
+    if (queue_.size() >= kQueueSize) {
+      if (entry.severity == kj::LogSeverity::INFO) {
+        dropped_++;
+        return;
+      }
+      written_.wait(lck, [this]() { return queue_.size() < kQueueSize; });
+    }
+    queue_.push_back(std::move(entry));
+  }
+  queued_.notify_one();
+  if (urgent) Flush();
+}
+
+void LogManager::Flush() {
+  std::unique_lock<std::mutex> lck(mutex_);
+  written_.wait(lck, [this]() { return queue_.empty() && !writing_; });
+}
+
+void LogManager::Write(const Entry& entry) {
+  auto tm = *std::localtime(&entry.time);
   out << date_color << std::put_time(&tm, "%Y-%m-%d %H:%M:%S") << reset_color
       << " ";
-  out << std::string(colors[static_cast<int>(severity)]) +
-             log_msg[static_cast<int>(severity)][0] + reset_color + " ";
+  out << std::string(colors[static_cast<int>(entry.severity)]) +
+             log_msg[static_cast<int>(entry.severity)][0] + reset_color + " ";
   out << std::left << std::setw(35)
-      << file_color + util::File::BaseName(file) + ":" + std::to_string(line) +
-             reset_color;
-  out << text.cStr() << std::endl;
+      << file_color + util::File::BaseName(entry.file) + ":" +
+             std::to_string(entry.line) + reset_color;
+  out << entry.text.cStr() << '\n' << entry.trace;
+}
+
+void LogManager::Run() {
+  std::deque<Entry> batch;
+  std::unique_lock<std::mutex> lck(mutex_);
+  while (true) {
+    queued_.wait(lck, [this]() { return stop_ || !queue_.empty(); });
+    if (queue_.empty()) break;
+    batch.swap(queue_);
+    uint64_t dropped = dropped_;
+    dropped_ = 0;
+    writing_ = true;
+    lck.unlock();
+    written_.notify_all();
+    for (const Entry& entry : batch) Write(entry);
+    if (dropped != 0) {
+      Write({std::time(nullptr), kj::LogSeverity::WARNING, __FILE__, __LINE__,
+             kj::str(dropped, " messages dropped, the log is too slow"), ""});
+    }
+    out.flush();
+    batch.clear();
+    lck.lock();
+    writing_ = false;
+    written_.notify_all();
+  }
 }
 }  // namespace util
@@ -1,25 +1,93 @@
 #ifndef UTIL_LOG_MANAGER_HPP
 #define UTIL_LOG_MANAGER_HPP
+#include <kj/debug.h>
 #include <kj/exception.h>
 #include <kj/main.h>
+#include <sys/types.h>
+#include <condition_variable>
+#include <ctime>
+#include <deque>
+#include <map>
+#include <mutex>
 #include <ostream>
+#include <string>
+#include <thread>
+#include <unordered_map>
 #include "backward.hpp"
 
+// Like KJ_LOG, but the message is not even formatted if the subsystem of the
+// file does not log the severity, or if the line is being rate limited.
+#define UTIL_LOG(severity, ...)                                           \
+  if (!::util::LogManager::ShouldLog(::kj::LogSeverity::severity, __FILE__, \
+                                     __LINE__)) {                        \
+  } else                                                                  \
+    KJ_LOG(severity, ##__VA_ARGS__)
+
 namespace util {
 
 // Colorful logging with file support and backward-cpp stack traces.
+//
+// The messages are written by a background thread, so that logging does not
+// block the event loop on the output. The severity can be set for each
+// subsystem, the directory of the source file, with Flags::log_levels, and
+// the INFO messages of a line are limited to Flags::log_rate per second.
 class LogManager : public kj::ExceptionCallback {
  public:
   explicit LogManager(kj::ProcessContext* context);
+  ~LogManager();
   void logMessage(kj::LogSeverity severity, const char* file, int line,
                   int contextDepth, kj::String&& text) override;
   void onRecoverableException(kj::Exception&& exception) override;
   void onFatalException(kj::Exception&& exception) override;
   StackTraceMode stackTraceMode() override { return StackTraceMode::NONE; }
 
+  // Whether a message of the line would be written.
+  static bool ShouldLog(kj::LogSeverity severity, const char* file, int line);
+
  private:
+  struct Entry {
+    std::time_t time;
+    kj::LogSeverity severity;
+    const char* file;
+    int line;
+    kj::String text;
+    // Printed verbatim after the message.
+    std::string trace;
+  };
+  // The rate limiting of the INFO messages of a line.
+  struct Site {
+    std::time_t second = 0;
+    uint32_t count = 0;
+    uint32_t suppressed = 0;
+  };
+
+  bool Enabled(kj::LogSeverity severity, const char* file) const;
+  // Whether the line is over its rate. Requires mutex_.
+  bool Limited(const char* file, int line, std::time_t now);
+  void Push(Entry entry);
+  // Waits until the queued messages are written.
+  void Flush();
+  void Write(const Entry& entry);
+  void Run();
+  std::string Trace();
+
+  static LogManager* instance_;
+
   std::ostream& out;
   backward::SignalHandling sh{};  // Override kj's signal handling.
+  // The process that runs the writer, the forked children write directly.
+  pid_t pid_;
+  kj::LogSeverity default_level_;
+  std::map<std::string, kj::LogSeverity> levels_;
+  std::mutex mutex_;
+  std::condition_variable queued_;
+  std::condition_variable written_;
+  std::deque<Entry> queue_;
+  bool writing_ = false;
+  bool stop_ = false;
+  uint64_t dropped_ = 0;
+  std::unordered_map<const char*, std::unordered_map<int, Site>> sites_;
+  std::thread writer_;
 };
 }  // namespace util
 
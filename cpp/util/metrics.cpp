@@ -0,0 +1,120 @@
+#include "util/metrics.hpp"
+#include <algorithm>
+#include <sstream>
+
+namespace util {
+
+Histogram::Histogram(std::vector<double> bounds)
+    : bounds_(std::move(bounds)), counts_(bounds_.size() + 1) {
+  std::sort(bounds_.begin(), bounds_.end());
+}
+
+void Histogram::Observe(double value) {
+  size_t bucket = std::lower_bound(bounds_.begin(), bounds_.end(), value) -
+                  bounds_.begin();
+  std::lock_guard<std::mutex> lck(mutex_);
+  counts_[bucket]++;
+  count_++;
+  sum_ += value;
+}
+
+std::vector<uint64_t> Histogram::CumulativeCounts() const {
+  std::lock_guard<std::mutex> lck(mutex_);
+  std::vector<uint64_t> cumulative(bounds_.size());
+  uint64_t total = 0;
+  for (size_t i = 0; i < bounds_.size(); i++) {
+    total += counts_[i];
+    cumulative[i] = total;
+  }
+  return cumulative;
+}
+
+uint64_t Histogram::Count() const {
+  std::lock_guard<std::mutex> lck(mutex_);
+  return count_;
+}
+
+double Histogram::Sum() const {
+  std::lock_guard<std::mutex> lck(mutex_);
+  return sum_;
+}
+
+std::vector<double> Histogram::LatencyBounds() {
+  std::vector<double> bounds;
+  for (double bound = 1; bound <= 3600 * 1000; bound *= 4) {
+    bounds.push_back(bound);
+  }
+  return bounds;
+}
+
+Metrics& Metrics::Get() {
+  static Metrics* metrics = new Metrics();
+  return *metrics;
+}
+
+Metrics::Metric* Metrics::GetMetric(const std::string& name,
+                                    const std::string& help) {
+  Metric& metric = metrics_[name];
+  if (metric.help.empty()) metric.help = help;
+  return &metric;
+}
+
+Counter* Metrics::GetCounter(const std::string& name,
+                             const std::string& help) {
+  Metrics& metrics = Get();
+  std::lock_guard<std::mutex> lck(metrics.mutex_);
+  Metric* metric = metrics.GetMetric(name, help);
+  if (!metric->counter) metric->counter = std::make_unique<Counter>();
+  return metric->counter.get();
+}
+
+Histogram* Metrics::GetHistogram(const std::string& name,
+                                 const std::string& help,
+                                 std::vector<double> bounds) {
+  Metrics& metrics = Get();
+  std::lock_guard<std::mutex> lck(metrics.mutex_);
+  Metric* metric = metrics.GetMetric(name, help);
+  if (!metric->histogram) {
+    metric->histogram = std::make_unique<Histogram>(std::move(bounds));
+  }
+  return metric->histogram.get();
+}
+
+void Metrics::SetGauge(const std::string& name, const std::string& help,
+                       double value) {
+  Metrics& metrics = Get();
+  std::lock_guard<std::mutex> lck(metrics.mutex_);
+  metrics.GetMetric(name, help)->gauge = value;
+}
+
+std::string Metrics::Render() {
+  Metrics& metrics = Get();
+  std::lock_guard<std::mutex> lck(metrics.mutex_);
+  std::ostringstream out;
+  for (const auto& kv : metrics.metrics_) {
+    const std::string& name = kv.first;
+    const Metric& metric = kv.second;
+    out << "# HELP " << name << " " << metric.help << "\n";
+    if (metric.counter) {
+      out << "# TYPE " << name << " counter\n";
+      out << name << " " << metric.counter->Value() << "\n";
+    } else if (metric.histogram) {
+      out << "# TYPE " << name << " histogram\n";
+      const Histogram& histogram = *metric.histogram;
+      std::vector<uint64_t> counts = histogram.CumulativeCounts();
+      for (size_t i = 0; i < counts.size(); i++) {
+        out << name << "_bucket{le=\"" << histogram.Bounds()[i] << "\"} "
+            << counts[i] << "\n";
+      }
+      out << name << "_bucket{le=\"+Inf\"} " << histogram.Count() << "\n";
+      out << name << "_sum " << histogram.Sum() << "\n";
+      out << name << "_count " << histogram.Count() << "\n";
+    } else {
+      out << "# TYPE " << name << " gauge\n";
+      out << name << " " << metric.gauge << "\n";
+    }
+  }
+  return out.str();
+}
+
+}  // namespace util
@@ -0,0 +1,82 @@
+#ifndef UTIL_METRICS_HPP
+#define UTIL_METRICS_HPP
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace util {
+
+// Monotonically increasing value.
+class Counter {
+ public:
+  void Add(uint64_t value = 1) {
+    value_.fetch_add(value, std::memory_order_relaxed);
+  }
+  uint64_t Value() const { return value_.load(std::memory_order_relaxed); }
+
+ private:
+  std::atomic<uint64_t> value_{0};
+};
+
+// Distribution of observed values, counted in buckets with the given upper
+// bounds.
+class Histogram {
+ public:
+  explicit Histogram(std::vector<double> bounds);
+
+  void Observe(double value);
+
+  // Number of observations that are less than or equal to each bound.
+  std::vector<uint64_t> CumulativeCounts() const;
+  const std::vector<double>& Bounds() const { return bounds_; }
+  uint64_t Count() const;
+  double Sum() const;
+
+  // Bounds from 1ms to about 1h, for latencies in milliseconds.
+  static std::vector<double> LatencyBounds();
+
+ private:
+  std::vector<double> bounds_;
+  mutable std::mutex mutex_;
+  std::vector<uint64_t> counts_;
+  uint64_t count_ = 0;
+  double sum_ = 0;
+};
+
+// Registry of the metrics of the process. Metrics are created on first use
+// and are never destroyed, so the returned pointers can be cached. All the
+// methods are thread safe.
+class Metrics {
+ public:
+  static Counter* GetCounter(const std::string& name, const std::string& help);
+  static Histogram* GetHistogram(
+      const std::string& name, const std::string& help,
+      std::vector<double> bounds = Histogram::LatencyBounds());
+  static void SetGauge(const std::string& name, const std::string& help,
+                       double value);
+
+  // Returns all the metrics in the Prometheus text format.
+  static std::string Render();
+
+ private:
+  struct Metric {
+    std::string help;
+    std::unique_ptr<Counter> counter;
+    std::unique_ptr<Histogram> histogram;
+    double gauge = 0;
+  };
+
+  static Metrics& Get();
+  Metric* GetMetric(const std::string& name, const std::string& help);
+
+  std::mutex mutex_;
+  std::map<std::string, Metric> metrics_;
+};
+
+}  // namespace util
+
+#endif
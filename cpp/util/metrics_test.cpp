@@ -0,0 +1,50 @@
+#include "util/metrics.hpp"
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+namespace {
+
+using ::testing::ElementsAre;
+using ::testing::HasSubstr;
+
+// NOLINTNEXTLINE
+TEST(Metrics, Counter) {
+  util::Counter* counter = util::Metrics::GetCounter("test_counter", "Help");
+  EXPECT_EQ(counter, util::Metrics::GetCounter("test_counter", "Help"));
+  counter->Add();
+  counter->Add(2);
+  EXPECT_EQ(counter->Value(), 3);
+}
+
+// NOLINTNEXTLINE
+TEST(Metrics, Histogram) {
+  util::Histogram histogram({10, 1, 100});
+  EXPECT_THAT(histogram.Bounds(), ElementsAre(1, 10, 100));
+  histogram.Observe(1);
+  histogram.Observe(5);
+  histogram.Observe(50);
+  histogram.Observe(500);
+  EXPECT_THAT(histogram.CumulativeCounts(), ElementsAre(1, 2, 3));
+  EXPECT_EQ(histogram.Count(), 4);
+  EXPECT_EQ(histogram.Sum(), 556);
+}
+
+// NOLINTNEXTLINE
+TEST(Metrics, Render) {
+  util::Metrics::GetCounter("render_counter", "A counter")->Add(7);
+  util::Metrics::GetHistogram("render_histogram", "A histogram", {1, 2})
+      ->Observe(2);
+  util::Metrics::SetGauge("render_gauge", "A gauge", 1.5);
+  std::string text = util::Metrics::Render();
+  EXPECT_THAT(text, HasSubstr("# HELP render_counter A counter\n"
+                              "# TYPE render_counter counter\n"
+                              "render_counter 7\n"));
+  EXPECT_THAT(text, HasSubstr("render_histogram_bucket{le=\"1\"} 0\n"
+                              "render_histogram_bucket{le=\"2\"} 1\n"
+                              "render_histogram_bucket{le=\"+Inf\"} 1\n"
+                              "render_histogram_sum 2\n"
+                              "render_histogram_count 1\n"));
+  EXPECT_THAT(text, HasSubstr("# TYPE render_gauge gauge\nrender_gauge 1.5\n"));
+}
+
+}  // namespace
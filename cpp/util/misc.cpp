@@ -1,7 +1,27 @@
 #include "util/misc.hpp"
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
 
 namespace util {
 
+int PipeCloexec(int fds[2]) {
+#ifdef __APPLE__
+  if (pipe(fds) == -1) return -1;
+  if (fcntl(fds[0], F_SETFD, FD_CLOEXEC) == -1 ||
+      fcntl(fds[1], F_SETFD, FD_CLOEXEC) == -1) {
+    int err = errno;
+    close(fds[0]);
+    close(fds[1]);
+    errno = err;
+    return -1;
+  }
+  return 0;
+#else
+  return pipe2(fds, O_CLOEXEC);
+#endif
+}
+
 std::vector<std::string> split(const std::string& s, char delim) {
   std::vector<std::string> elems;
   split(s, delim, std::back_inserter(elems));
@@ -21,6 +21,10 @@ void split(const std::string& s, char delim, Out result) {
 // Splits a string into pieces delimited by delim.
 std::vector<std::string> split(const std::string& s, char delim);
 
+// Same as pipe(2), but both ends are closed on exec, so that the processes
+// started by others threads in the meantime do not inherit them.
+int PipeCloexec(int fds[2]);
+
 // Utility methods for argument parsing.
 std::function<bool()> setBool(bool* var);
 std::function<bool(kj::StringPtr)> setString(std::string* var);
@@ -1,4 +1,6 @@
 #include "util/misc.hpp"
+#include <fcntl.h>
+#include <unistd.h>
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
 
@@ -64,4 +66,18 @@ TEST(Misc, SetUInt) {
   EXPECT_EQ(x, 42);
 }
 
+/*
+ * PipeCloexec
+ */
+
+// NOLINTNEXTLINE
+TEST(Misc, PipeCloexec) {
+  int fds[2];
+  ASSERT_EQ(0, util::PipeCloexec(fds));
+  EXPECT_TRUE(fcntl(fds[0], F_GETFD) & FD_CLOEXEC);
+  EXPECT_TRUE(fcntl(fds[1], F_GETFD) & FD_CLOEXEC);
+  close(fds[0]);
+  close(fds[1]);
+}
+
 }  // namespace
@@ -0,0 +1,254 @@
+#include "util/pack_store.hpp"
+#include <fcntl.h>
+#include <kj/debug.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <system_error>
+#include "util/file.hpp"
+#include "util/flags.hpp"
+
+namespace {
+// An index record is the hash, the offset and the size of a file in the pack.
+const constexpr size_t kRecordSize = util::DIGEST_SIZE + 8 + 4;
+const constexpr uint32_t kTombstone = 0xffffffff;
+
+const char kPackPrefix[] = "pack-";
+const char kIndexSuffix[] = ".idx";
+
+void PWriteAll(int fd, const uint8_t* data, size_t size, uint64_t offset,
+               const std::string& path) {
+  while (size > 0) {
+    ssize_t written = pwrite(fd, data, size, offset);
+    if (written == -1 && errno == EINTR) continue;
+    if (written == -1) {
+      throw std::system_error(errno, std::system_category(), "write " + path);
+    }
+    data += written;
+    size -= written;
+    offset += written;
+  }
+}
+
+void PReadAll(int fd, uint8_t* data, size_t size, uint64_t offset,
+              const std::string& path) {
+  while (size > 0) {
+    ssize_t num_read = pread(fd, data, size, offset);
+    if (num_read == -1 && errno == EINTR) continue;
+    if (num_read == -1) {
+      throw std::system_error(errno, std::system_category(), "read " + path);
+    }
+    if (num_read == 0) {
+      throw std::system_error(EIO, std::system_category(),
+                              "Truncated pack " + path);
+    }
+    data += num_read;
+    size -= num_read;
+    offset += num_read;
+  }
+}
+
+void MaybeSync(int fd, const std::string& path) {
+  if (Flags::durability == "file" && fdatasync(fd) == -1) {
+    throw std::system_error(errno, std::system_category(), "fsync " + path);
+  }
+}
+
+kj::AutoCloseFd Open(const std::string& path) {
+  int fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC,  // NOLINT
+                S_IRUSR | S_IWUSR);
+  if (fd == -1) {
+    throw std::system_error(errno, std::system_category(), "open " + path);
+  }
+  return kj::AutoCloseFd(fd);
+}
+
+uint64_t FileSize(int fd) {
+  struct stat st {};
+  if (fstat(fd, &st) == -1) {
+    throw std::system_error(errno, std::system_category(), "fstat");
+  }
+  return st.st_size;
+}
+}  // namespace
+
+namespace util {
+
+PackStore& PackStore::Get() {
+  static PackStore packs(File::JoinPath(Flags::store_directory, "packs"));
+  return packs;
+}
+
+PackStore::PackStore(std::string dir) : dir_(std::move(dir)) {}
+
+std::string PackStore::PackPath(uint32_t id) const {
+  return File::JoinPath(dir_, kPackPrefix + std::to_string(id));
+}
+
+void PackStore::Load() {
+  if (loaded_) return;
+  loaded_ = true;
+  if (!File::Exists(dir_)) return;
+  std::vector<uint32_t> ids;
+  for (const std::string& path : File::ListFiles(dir_)) {
+    std::string name = File::BaseName(path);
+    size_t prefix = sizeof(kPackPrefix) - 1;
+    size_t suffix = sizeof(kIndexSuffix) - 1;
+    if (name.size() <= prefix + suffix ||
+        name.compare(0, prefix, kPackPrefix) != 0 ||
+        name.compare(name.size() - suffix, suffix, kIndexSuffix) != 0) {
+      continue;
+    }
+    try {
+      ids.push_back(std::stoul(name.substr(prefix)));
+    } catch (std::logic_error& /*exc*/) {
+      continue;
+    }
+  }
+  std::sort(ids.begin(), ids.end());
+  for (uint32_t id : ids) {
+    Pack& pack = OpenPack(id);
+    uint64_t index_size = FileSize(pack.index);
+    // A record may be truncated if the process died while writing it.
+    std::vector<uint8_t> records(index_size - index_size % kRecordSize);
+    PReadAll(pack.index, records.data(), records.size(), 0,
+             PackPath(id) + kIndexSuffix);
+    for (size_t pos = 0; pos < records.size(); pos += kRecordSize) {
+      std::array<uint8_t, DIGEST_SIZE> digest;
+      uint64_t offset;
+      uint32_t size;
+      memcpy(digest.data(), &records[pos], DIGEST_SIZE);
+      memcpy(&offset, &records[pos + DIGEST_SIZE], sizeof(offset));
+      memcpy(&size, &records[pos + DIGEST_SIZE + 8], sizeof(size));
+      SHA256_t hash(digest);
+      auto it = files_.find(hash);
+      if (size == kTombstone) {
+        if (it == files_.end() || it->second.pack != id) continue;
+        pack.live -= it->second.size;
+        files_.erase(it);
+        continue;
+      }
+      // The contents of the file may not have reached the disk.
+      if (offset + size > pack.size || it != files_.end()) continue;
+      files_.emplace(hash, Location{id, offset, size});
+      pack.live += size;
+    }
+  }
+  if (!ids.empty()) current_ = ids.back();
+}
+
+PackStore::Pack& PackStore::OpenPack(uint32_t id) {
+  auto it = packs_.find(id);
+  if (it != packs_.end()) return it->second;
+  File::MakeDirs(dir_);
+  Pack& pack = packs_[id];
+  pack.data = Open(PackPath(id));
+  pack.index = Open(PackPath(id) + kIndexSuffix);
+  pack.size = FileSize(pack.data);
+  return pack;
+}
+
+int64_t PackStore::Size(const SHA256_t& hash) {
+  std::lock_guard<std::mutex> lck(mutex_);
+  Load();
+  auto it = files_.find(hash);
+  if (it == files_.end()) return -1;
+  return it->second.size;
+}
+
+void PackStore::Add(const SHA256_t& hash, kj::ArrayPtr<const uint8_t> data) {
+  std::lock_guard<std::mutex> lck(mutex_);
+  Load();
+  AddLocked(hash, data);
+}
+
+void PackStore::AddLocked(const SHA256_t& hash,
+                          kj::ArrayPtr<const uint8_t> data) {
+  KJ_REQUIRE(data.size() < kTombstone);
+  if (files_.count(hash)) return;
+  Pack* pack = &OpenPack(current_);
+  if (pack->size >= kMaxPackSize) pack = &OpenPack(++current_);
+  Location location{current_, pack->size, static_cast<uint32_t>(data.size())};
+  File::PrepareUnsyncedWrite();
+  PWriteAll(pack->data, data.begin(), data.size(), location.offset,
+            PackPath(current_));
+  MaybeSync(pack->data, PackPath(current_));
+  pack->size += data.size();
+  uint8_t record[kRecordSize];
+  memcpy(record, hash.getDigest().data(), DIGEST_SIZE);
+  memcpy(record + DIGEST_SIZE, &location.offset, sizeof(location.offset));
+  memcpy(record + DIGEST_SIZE + 8, &location.size, sizeof(location.size));
+  std::string index_path = PackPath(current_) + kIndexSuffix;
+  PWriteAll(pack->index, record, kRecordSize, FileSize(pack->index),
+            index_path);
+  MaybeSync(pack->index, index_path);
+  files_.emplace(hash, location);
+  pack->live += data.size();
+  File::MarkWritten();
+}
+
+bool PackStore::Read(const SHA256_t& hash, std::vector<uint8_t>* data) {
+  std::lock_guard<std::mutex> lck(mutex_);
+  Load();
+  auto it = files_.find(hash);
+  if (it == files_.end()) return false;
+  ReadLocked(it->second, data);
+  return true;
+}
+
+void PackStore::ReadLocked(const Location& location,
+                           std::vector<uint8_t>* data) {
+  data->resize(location.size);
+  PReadAll(OpenPack(location.pack).data, data->data(), data->size(),
+           location.offset, PackPath(location.pack));
+}
+
+bool PackStore::Remove(const SHA256_t& hash) {
+  std::lock_guard<std::mutex> lck(mutex_);
+  Load();
+  auto it = files_.find(hash);
+  if (it == files_.end()) return false;
+  uint32_t id = it->second.pack;
+  Pack& pack = OpenPack(id);
+  uint8_t record[kRecordSize] = {};
+  memcpy(record, hash.getDigest().data(), DIGEST_SIZE);
+  memcpy(record + DIGEST_SIZE + 8, &kTombstone, sizeof(kTombstone));
+  std::string index_path = PackPath(id) + kIndexSuffix;
+  PWriteAll(pack.index, record, kRecordSize, FileSize(pack.index), index_path);
+  MaybeSync(pack.index, index_path);
+  pack.live -= it->second.size;
+  files_.erase(it);
+  if (id != current_ && pack.live < pack.size / 2) Compact(id);
+  return true;
+}
+
+void PackStore::Compact(uint32_t id) {
+  std::vector<std::pair<SHA256_t, Location>> moved;
+  for (const auto& file : files_) {
+    if (file.second.pack == id) moved.push_back(file);
+  }
+  std::vector<uint8_t> data;
+  for (const auto& file : moved) {
+    ReadLocked(file.second, &data);
+    files_.erase(file.first);
+    AddLocked(file.first, {data.data(), data.size()});
+  }
+  packs_.erase(id);
+  File::Remove(PackPath(id) + kIndexSuffix);
+  File::Remove(PackPath(id));
+}
+
+std::vector<std::pair<SHA256_t, size_t>> PackStore::List() {
+  std::lock_guard<std::mutex> lck(mutex_);
+  Load();
+  std::vector<std::pair<SHA256_t, size_t>> files;
+  files.reserve(files_.size());
+  for (const auto& file : files_) {
+    files.emplace_back(file.first, file.second.size);
+  }
+  return files;
+}
+
+}  // namespace util
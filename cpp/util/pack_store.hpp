@@ -0,0 +1,81 @@
+#ifndef UTIL_PACK_STORE_HPP
+#define UTIL_PACK_STORE_HPP
+#include <kj/array.h>
+#include <kj/common.h>
+#include <kj/io.h>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "util/sha256.hpp"
+
+namespace util {
+
+// Keeps the small files of the store appended to a few pack files, instead of
+// a file each, saving inodes and opens. Next to each pack, an index lists where
+// each file is, and has a tombstone for each removed file. A pack is rewritten
+// once most of its contents were removed. All the methods are thread safe.
+class PackStore {
+ public:
+  // Files are not appended to packs bigger than this.
+  static const constexpr uint64_t kMaxPackSize = 64 * 1024 * 1024;
+
+  // Returns the packs of the store in Flags::store_directory.
+  static PackStore& Get();
+
+  // The packs are loaded from dir, if any.
+  explicit PackStore(std::string dir);
+  KJ_DISALLOW_COPY(PackStore);
+
+  // Returns the size of the file with the given hash, or a negative number if
+  // it is not in the packs.
+  int64_t Size(const SHA256_t& hash);
+
+  // Adds a file to the packs, if it is not already there.
+  void Add(const SHA256_t& hash, kj::ArrayPtr<const uint8_t> data);
+
+  // Reads the file with the given hash. Returns false if it is not in the
+  // packs.
+  bool Read(const SHA256_t& hash, std::vector<uint8_t>* data);
+
+  // Removes the file with the given hash. Returns false if it was not in the
+  // packs.
+  bool Remove(const SHA256_t& hash);
+
+  // Lists the files in the packs, with their sizes.
+  std::vector<std::pair<SHA256_t, size_t>> List();
+
+ private:
+  struct Location {
+    uint32_t pack;
+    uint64_t offset;
+    uint32_t size;
+  };
+  struct Pack {
+    kj::AutoCloseFd data;
+    kj::AutoCloseFd index;
+    uint64_t size = 0;
+    uint64_t live = 0;
+  };
+
+  void Load();
+  Pack& OpenPack(uint32_t id);
+  void AddLocked(const SHA256_t& hash, kj::ArrayPtr<const uint8_t> data);
+  void ReadLocked(const Location& location, std::vector<uint8_t>* data);
+  void Compact(uint32_t id);
+  std::string PackPath(uint32_t id) const;
+
+  std::mutex mutex_;
+  std::string dir_;
+  bool loaded_ = false;
+  std::map<uint32_t, Pack> packs_;
+  uint32_t current_ = 0;
+  std::unordered_map<SHA256_t, Location, SHA256_t::Hasher> files_;
+};
+
+}  // namespace util
+
+#endif
@@ -0,0 +1,88 @@
+#include "util/pack_store.hpp"
+#include <string>
+#include <vector>
+#include "gtest/gtest.h"
+#include "util/file.hpp"
+
+namespace {
+
+const std::string test_tmpdir = "/tmp/task_maker_testdir";
+
+util::SHA256_t Add(util::PackStore* packs, const std::string& data) {
+  util::SHA256 hasher;
+  hasher.update(reinterpret_cast<const unsigned char*>(data.data()),
+                data.size());
+  util::SHA256_t hash = hasher.finalize();
+  packs->Add(hash, {reinterpret_cast<const uint8_t*>(data.data()),
+                    data.size()});
+  return hash;
+}
+
+std::string Read(util::PackStore* packs, const util::SHA256_t& hash) {
+  std::vector<uint8_t> data;
+  EXPECT_TRUE(packs->Read(hash, &data));
+  return std::string(data.begin(), data.end());
+}
+
+// NOLINTNEXTLINE
+TEST(PackStore, AddReadRemove) {
+  util::TempDir tmp(test_tmpdir);
+  util::PackStore packs(tmp.Path());
+  util::SHA256_t hello = Add(&packs, "hello");
+  util::SHA256_t empty = Add(&packs, "");
+  Add(&packs, "hello");
+  EXPECT_EQ(packs.Size(hello), 5);
+  EXPECT_EQ(packs.Size(empty), 0);
+  EXPECT_EQ(Read(&packs, hello), "hello");
+  EXPECT_EQ(Read(&packs, empty), "");
+  EXPECT_EQ(packs.List().size(), 2);
+  EXPECT_TRUE(packs.Remove(hello));
+  EXPECT_FALSE(packs.Remove(hello));
+  EXPECT_LT(packs.Size(hello), 0);
+  std::vector<uint8_t> data;
+  EXPECT_FALSE(packs.Read(hello, &data));
+}
+
+// NOLINTNEXTLINE
+TEST(PackStore, Reload) {
+  util::TempDir tmp(test_tmpdir);
+  util::SHA256_t kept = util::SHA256_t::ZERO;
+  util::SHA256_t removed = util::SHA256_t::ZERO;
+  {
+    util::PackStore packs(tmp.Path());
+    kept = Add(&packs, "kept");
+    removed = Add(&packs, "removed");
+    packs.Remove(removed);
+  }
+  util::PackStore packs(tmp.Path());
+  EXPECT_EQ(Read(&packs, kept), "kept");
+  EXPECT_LT(packs.Size(removed), 0);
+  EXPECT_EQ(packs.List().size(), 1);
+}
+
+// NOLINTNEXTLINE
+TEST(PackStore, Compact) {
+  util::TempDir tmp(test_tmpdir);
+  util::SHA256_t kept = util::SHA256_t::ZERO;
+  std::vector<util::SHA256_t> removed;
+  {
+    util::PackStore packs(tmp.Path());
+    kept = Add(&packs, "kept");
+    // Fill the first pack, so that the next files go to a new one.
+    std::string big(util::PackStore::kMaxPackSize / 4, 'x');
+    for (char c = 'a'; c < 'e'; c++) {
+      big[0] = c;
+      removed.push_back(Add(&packs, big));
+    }
+    Add(&packs, "new pack");
+    for (const auto& hash : removed) packs.Remove(hash);
+    EXPECT_EQ(Read(&packs, kept), "kept");
+    std::string first_pack = util::File::JoinPath(tmp.Path(), "pack-0");
+    EXPECT_FALSE(util::File::Exists(first_pack));
+  }
+  util::PackStore packs(tmp.Path());
+  EXPECT_EQ(Read(&packs, kept), "kept");
+  EXPECT_EQ(packs.List().size(), 2);
+}
+
+}  // namespace
@@ -0,0 +1,98 @@
+#include "util/reclaimer.hpp"
+#include <fcntl.h>
+#include <kj/debug.h>
+#include <kj/io.h>
+#include <unistd.h>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "util/file.hpp"
+#include "util/flags.hpp"
+#include "util/pack_store.hpp"
+
+namespace util {
+
+Reclaimer& Reclaimer::Get() {
+  static Reclaimer reclaimer;
+  return reclaimer;
+}
+
+Reclaimer::~Reclaimer() {
+  {
+    std::unique_lock<std::mutex> lck(mutex_);
+    stop_ = true;
+  }
+  wakeup_.notify_all();
+  if (thread_.joinable()) thread_.join();
+}
+
+void Reclaimer::Schedule(const SHA256_t& hash) {
+  std::unique_lock<std::mutex> lck(mutex_);
+  if (!pending_.insert(hash).second) return;
+  queue_.push_back(hash);
+  if (!thread_.joinable()) thread_ = std::thread(&Reclaimer::Run, this);
+  wakeup_.notify_one();
+}
+
+bool Reclaimer::Cancel(const SHA256_t& hash) {
+  std::unique_lock<std::mutex> lck(mutex_);
+  if (pending_.erase(hash)) return true;
+  batch_done_.wait(lck, [this, &hash]() { return !deleting_.count(hash); });
+  return false;
+}
+
+void Reclaimer::Evict(EvictionQueue* queue, uint64_t max_size) {
+  if (queue->TotalSize() <= max_size) return;
+  while (queue->Evictable() && queue->TotalSize() > max_size * kLowWatermark) {
+    Schedule(queue->Next());
+    queue->PopNext();
+  }
+}
+
+void Reclaimer::Run() {
+  kj::AutoCloseFd store{open(Flags::store_directory.c_str(),  // NOLINT
+                             O_RDONLY | O_DIRECTORY | O_CLOEXEC)};
+  std::vector<SHA256_t> batch;
+  std::unique_lock<std::mutex> lck(mutex_);
+  while (true) {
+    wakeup_.wait(lck, [this]() { return stop_ || !queue_.empty(); });
+    // Pending deletions are completed before stopping.
+    if (queue_.empty()) return;
+    while (!queue_.empty() && batch.size() < kBatchSize) {
+      SHA256_t hash = std::move(queue_.front());
+      queue_.pop_front();
+      // The deletion was canceled.
+      if (!pending_.erase(hash)) continue;
+      deleting_.insert(hash);
+      batch.push_back(std::move(hash));
+    }
+    lck.unlock();
+    for (const auto& hash : batch) {
+      int ret;
+      std::string executable = File::RelativeExecutablePathForHash(hash);
+      if (store.get() != -1) {
+        ret = unlinkat(store, File::RelativePathForHash(hash).c_str(), 0);
+        // The executable copy, if any, goes with the file.
+        unlinkat(store, executable.c_str(), 0);
+      } else {
+        ret = unlink(File::PathForHash(hash).c_str());
+        unlink(File::JoinPath(Flags::store_directory, executable).c_str());
+      }
+      if (ret == -1 && errno == ENOENT) {
+        // Small files may be in the packs instead.
+        KJ_IF_MAYBE(exc, kj::runCatchingExceptions(
+                             [&hash]() { PackStore::Get().Remove(hash); })) {
+          KJ_LOG(WARNING, "Could not remove file", hash.Hex(), *exc);
+        }
+      } else if (ret == -1) {
+        KJ_LOG(WARNING, "Could not remove file", hash.Hex(), strerror(errno));
+      }
+    }
+    batch.clear();
+    lck.lock();
+    deleting_.clear();
+    batch_done_.notify_all();
+  }
+}
+
+}  // namespace util
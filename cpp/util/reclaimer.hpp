@@ -0,0 +1,62 @@
+#ifndef UTIL_RECLAIMER_HPP
+#define UTIL_RECLAIMER_HPP
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <unordered_set>
+#include "util/eviction.hpp"
+#include "util/sha256.hpp"
+
+namespace util {
+
+// Deletes files from the store in a background thread, so that the event loop
+// never blocks on the filesystem while the cache is shrinking. Files stay in
+// the store until they are actually deleted, and a pending deletion can be
+// canceled until then.
+class Reclaimer {
+ public:
+  // When the store grows above its maximum size, files are evicted until it
+  // is below this fraction of the maximum size.
+  static const constexpr double kLowWatermark = 0.9;
+
+  // Maximum number of files deleted without checking for cancellations.
+  static const constexpr size_t kBatchSize = 256;
+
+  // Returns the reclaimer of the store in Flags::store_directory.
+  static Reclaimer& Get();
+
+  // Schedules the deletion of the file with the given hash.
+  void Schedule(const SHA256_t& hash);
+
+  // Cancels the pending deletion of the file with the given hash. Returns true
+  // if the deletion was pending and the file is now kept. If the file is being
+  // deleted, waits for the deletion to complete.
+  bool Cancel(const SHA256_t& hash);
+
+  // If the total size of the files in the queue is above max_size, schedules
+  // the deletion of files in eviction order until it goes below the low
+  // watermark.
+  void Evict(EvictionQueue* queue, uint64_t max_size);
+
+  ~Reclaimer();
+  KJ_DISALLOW_COPY(Reclaimer);
+
+ private:
+  Reclaimer() = default;
+
+  void Run();
+
+  std::mutex mutex_;
+  std::condition_variable wakeup_;
+  std::condition_variable batch_done_;
+  std::deque<SHA256_t> queue_;
+  std::unordered_set<SHA256_t, SHA256_t::Hasher> pending_;
+  std::unordered_set<SHA256_t, SHA256_t::Hasher> deleting_;
+  bool stop_ = false;
+  std::thread thread_;
+};
+
+}  // namespace util
+
+#endif
@@ -0,0 +1,80 @@
+#include "util/reclaimer.hpp"
+#include <chrono>
+#include <thread>
+#include "gtest/gtest.h"
+#include "util/file.hpp"
+#include "util/flags.hpp"
+
+namespace {
+
+util::SHA256_t AddFile(const std::string& content) {
+  std::string path = util::File::JoinPath(Flags::temp_directory, "file");
+  auto receiver = util::File::Write(path, /*overwrite=*/true);
+  receiver(kj::ArrayPtr<const kj::byte>(
+      reinterpret_cast<const kj::byte*>(content.data()),  // NOLINT
+      content.size()));
+  receiver({});
+  util::SHA256_t hash = util::File::Hash(path);
+  util::File::Move(path, util::File::PathForHash(hash), /*overwrite=*/true);
+  return hash;
+}
+
+bool WaitRemoved(const util::SHA256_t& hash) {
+  for (int i = 0; i < 1000; i++) {
+    if (!util::File::Exists(util::File::PathForHash(hash))) return true;
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  return false;
+}
+
+class ReclaimerTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    Flags::store_directory = "/tmp/task_maker_testdir/reclaimer/store";
+    Flags::temp_directory = "/tmp/task_maker_testdir/reclaimer/temp";
+    util::File::MakeDirs(Flags::temp_directory);
+  }
+};
+
+// NOLINTNEXTLINE
+TEST_F(ReclaimerTest, Schedule) {
+  util::SHA256_t hash = AddFile("schedule");
+  util::Reclaimer::Get().Schedule(hash);
+  EXPECT_TRUE(WaitRemoved(hash));
+  EXPECT_FALSE(util::Reclaimer::Get().Cancel(hash));
+}
+
+// NOLINTNEXTLINE
+TEST_F(ReclaimerTest, IngestCancels) {
+  uint32_t pack_threshold = Flags::pack_threshold;
+  Flags::pack_threshold = 0;
+  std::string content = "ingested again";
+  util::SHA256_t hash = AddFile(content);
+  // The file is written to the store again while its deletion is pending.
+  util::Reclaimer::Get().Schedule(hash);
+  util::File::IngestContents(
+      {reinterpret_cast<const uint8_t*>(content.data()),  // NOLINT
+       content.size()});
+  EXPECT_FALSE(util::Reclaimer::Get().Cancel(hash));
+  std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  EXPECT_TRUE(util::File::Exists(util::File::PathForHash(hash)));
+  Flags::pack_threshold = pack_threshold;
+}
+
+// NOLINTNEXTLINE
+TEST_F(ReclaimerTest, Evict) {
+  util::EvictionQueue queue;
+  std::vector<util::SHA256_t> hashes;
+  for (char c = 'a'; c <= 'j'; c++) {
+    hashes.push_back(AddFile(std::string(100, c)));
+    queue.Add(hashes.back(), 100);
+  }
+  util::Reclaimer::Get().Evict(&queue, 1000);
+  EXPECT_EQ(1000, queue.TotalSize());
+  util::Reclaimer::Get().Evict(&queue, 950);
+  EXPECT_LE(queue.TotalSize(), 950 * util::Reclaimer::kLowWatermark);
+  EXPECT_TRUE(WaitRemoved(hashes[0]));
+  EXPECT_TRUE(util::File::Exists(util::File::PathForHash(hashes.back())));
+}
+
+}  // namespace
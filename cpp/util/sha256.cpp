@@ -2,6 +2,26 @@
 #include <stdexcept>
 #include <string.h>
 
+#if (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__GNUC__) || defined(__clang__))
+#define SHA256_X86
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+// The kernel is built only if the compiler targets the cryptography extensions,
+// as on Apple silicon or with -march=armv8-a+crypto, and it is used only if
+// the CPU supports them.
+#if defined(__aarch64__) && \
+    (defined(__ARM_FEATURE_SHA2) || defined(__ARM_FEATURE_CRYPTO))
+#define SHA256_ARM
+#include <arm_neon.h>
+#ifdef __linux__
+#include <asm/hwcap.h>
+#include <sys/auxv.h>
+#endif
+#endif
+
 #define SHA2_SHFR(x, n) (x >> n)
 #define SHA2_ROTR(x, n) ((x >> n) | (x << ((sizeof(x) << 3) - n)))
 #define SHA2_ROTL(x, n) ((x << n) | (x >> ((sizeof(x) << 3) - n)))
@@ -41,7 +61,13 @@ const constexpr uint32_t sha256_k[64] =  // UL = uint32
      0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
      0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
 
-void SHA256::transform(const unsigned char* message, unsigned int block_nb) {
+namespace {
+// Applies the compression function to block_nb consecutive blocks of message.
+using TransformFn = void (*)(uint32_t* state, const unsigned char* message,
+                             unsigned int block_nb);
+
+void TransformPortable(uint32_t* state, const unsigned char* message,
+                       unsigned int block_nb) {
   uint32_t w[64];
   uint32_t wv[8];
   uint32_t t1, t2;
@@ -57,7 +83,7 @@ void SHA256::transform(const unsigned char* message, unsigned int block_nb) {
       w[j] = SHA256_F4(w[j - 2]) + w[j - 7] + SHA256_F3(w[j - 15]) + w[j - 16];
     }
     for (j = 0; j < 8; j++) {
-      wv[j] = m_h[j];
+      wv[j] = state[j];
     }
     for (j = 0; j < 64; j++) {
       t1 = wv[7] + SHA256_F2(wv[4]) + SHA2_CH(wv[4], wv[5], wv[6]) +
@@ -73,11 +99,124 @@ void SHA256::transform(const unsigned char* message, unsigned int block_nb) {
       wv[0] = t1 + t2;
     }
     for (j = 0; j < 8; j++) {
-      m_h[j] += wv[j];
+      state[j] += wv[j];
     }
   }
 }
 
+#ifdef SHA256_X86
+// Uses the SHA extensions of x86. The state is kept as ABEF and CDGH, which
+// is the layout expected by sha256rnds2.
+__attribute__((target("sha,sse4.1,ssse3"))) void TransformShaNi(
+    uint32_t* state, const unsigned char* message, unsigned int block_nb) {
+  const __m128i mask =
+      _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+  __m128i tmp = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&state[0]));
+  __m128i state1 =
+      _mm_loadu_si128(reinterpret_cast<const __m128i*>(&state[4]));
+  tmp = _mm_shuffle_epi32(tmp, 0xB1);                // CDAB
+  state1 = _mm_shuffle_epi32(state1, 0x1B);          // EFGH
+  __m128i state0 = _mm_alignr_epi8(tmp, state1, 8);  // ABEF
+  state1 = _mm_blend_epi16(state1, tmp, 0xF0);       // CDGH
+  for (unsigned int i = 0; i < block_nb; i++) {
+    const unsigned char* sub_block = message + (i << 6);
+    __m128i abef = state0;
+    __m128i cdgh = state1;
+    __m128i w[16];
+    for (int j = 0; j < 16; j++) {
+      if (j < 4) {
+        w[j] = _mm_shuffle_epi8(
+            _mm_loadu_si128(
+                reinterpret_cast<const __m128i*>(sub_block + (j << 4))),
+            mask);
+      } else {
+        w[j] = _mm_sha256msg2_epu32(
+            _mm_add_epi32(_mm_sha256msg1_epu32(w[j - 4], w[j - 3]),
+                          _mm_alignr_epi8(w[j - 1], w[j - 2], 4)),
+            w[j - 1]);
+      }
+      __m128i msg = _mm_add_epi32(
+          w[j], _mm_loadu_si128(
+                    reinterpret_cast<const __m128i*>(&sha256_k[j << 2])));
+      state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+      msg = _mm_shuffle_epi32(msg, 0x0E);
+      state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+    }
+    state0 = _mm_add_epi32(state0, abef);
+    state1 = _mm_add_epi32(state1, cdgh);
+  }
+  tmp = _mm_shuffle_epi32(state0, 0x1B);        // FEBA
+  state1 = _mm_shuffle_epi32(state1, 0xB1);     // DCHG
+  state0 = _mm_blend_epi16(tmp, state1, 0xF0);  // DCBA
+  state1 = _mm_alignr_epi8(state1, tmp, 8);     // HGFE
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(&state[0]), state0);
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(&state[4]), state1);
+}
+
+bool HasShaNi() {
+  unsigned int eax, ebx, ecx, edx;
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) return false;
+  if (!(ecx & bit_SSSE3) || !(ecx & bit_SSE4_1)) return false;
+  if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) return false;
+  return ebx & (1U << 29);
+}
+#endif
+
+#ifdef SHA256_ARM
+// Uses the SHA2 instructions of the ARMv8 cryptography extensions.
+void TransformArmv8(uint32_t* state, const unsigned char* message,
+                    unsigned int block_nb) {
+  uint32x4_t state0 = vld1q_u32(&state[0]);
+  uint32x4_t state1 = vld1q_u32(&state[4]);
+  for (unsigned int i = 0; i < block_nb; i++) {
+    const unsigned char* sub_block = message + (i << 6);
+    uint32x4_t abcd = state0;
+    uint32x4_t efgh = state1;
+    uint32x4_t w[16];
+    for (int j = 0; j < 16; j++) {
+      if (j < 4) {
+        w[j] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(sub_block + (j << 4))));
+      } else {
+        w[j] = vsha256su1q_u32(vsha256su0q_u32(w[j - 4], w[j - 3]), w[j - 2],
+                               w[j - 1]);
+      }
+      uint32x4_t msg = vaddq_u32(w[j], vld1q_u32(&sha256_k[j << 2]));
+      uint32x4_t prev = state0;
+      state0 = vsha256hq_u32(state0, state1, msg);
+      state1 = vsha256h2q_u32(state1, prev, msg);
+    }
+    state0 = vaddq_u32(state0, abcd);
+    state1 = vaddq_u32(state1, efgh);
+  }
+  vst1q_u32(&state[0], state0);
+  vst1q_u32(&state[4], state1);
+}
+
+bool HasArmv8Sha2() {
+#ifdef __linux__
+  return getauxval(AT_HWCAP) & HWCAP_SHA2;
+#else
+  return true;
+#endif
+}
+#endif
+
+TransformFn SelectTransform() {
+#ifdef SHA256_X86
+  if (HasShaNi()) return TransformShaNi;
+#endif
+#ifdef SHA256_ARM
+  if (HasArmv8Sha2()) return TransformArmv8;
+#endif
+  return TransformPortable;
+}
+}  // namespace
+
+void SHA256::transform(const unsigned char* message, unsigned int block_nb) {
+  static const TransformFn transform_fn = SelectTransform();
+  transform_fn(m_h, message, block_nb);
+}
+
 void SHA256::init() {
   m_h[0] = 0x6a09e667;
   m_h[1] = 0xbb67ae85;
@@ -3,6 +3,7 @@
 
 #include <kj/array.h>
 #include <array>
+#include <cstring>
 #include <string>
 #include <vector>
 
@@ -11,6 +12,25 @@
 namespace util {
 static const constexpr uint32_t DIGEST_SIZE = (256 / 8);
 
+// The bytes of a SHA256 hash, without the contents. This is what containers
+// indexed by hash should use as key.
+struct SHA256Key {
+  std::array<uint8_t, DIGEST_SIZE> digest;
+
+  bool operator==(const SHA256Key& other) const {
+    return digest == other.digest;
+  }
+
+  struct Hasher {
+    // The bytes of the hash are already uniformly distributed.
+    uint64_t operator()(const SHA256Key& key) const {
+      uint64_t hash;
+      memcpy(&hash, key.digest.data(), sizeof(hash));
+      return hash;
+    }
+  };
+};
+
 // Represents a SHA256 hash of some string. May contain the string itself if it
 // is small enough.
 class SHA256_t {
@@ -34,6 +54,13 @@ class SHA256_t {
   SHA256_t(capnproto::SHA256::Reader in);  // NOLINT
   void ToCapnp(capnproto::SHA256::Builder out) const;
 
+  // Raw bytes of the hash.
+  const std::array<uint8_t, DIGEST_SIZE>& getDigest() const { return hash_; }
+
+  // Conversion from/to a key, losing the contents.
+  explicit SHA256_t(const SHA256Key& key) : hash_(key.digest) {}
+  SHA256Key Key() const { return SHA256Key{hash_}; }
+
   // True if the hash is all zeros.
   bool isZero() const {
     for (uint32_t i = 0; i < DIGEST_SIZE; i++) {
@@ -62,6 +89,12 @@ class SHA256_t {
     return setContents(data.data(), data.size());
   }
 
+  void clearContents() {
+    contents_.clear();
+    contents_.shrink_to_fit();
+    has_contents_ = false;
+  }
+
   // Hashing implementation.
   friend class Hasher;
   struct Hasher {
@@ -0,0 +1,47 @@
+#include "util/sha256.hpp"
+#include <string>
+#include "gtest/gtest.h"
+
+namespace {
+
+std::string Hash(const std::string& data, size_t piece = std::string::npos) {
+  util::SHA256 hasher;
+  for (size_t pos = 0; pos < data.size(); pos += piece) {
+    std::string chunk = data.substr(pos, piece);
+    hasher.update(reinterpret_cast<const unsigned char*>(chunk.data()),
+                  chunk.size());
+  }
+  return hasher.finalize().Hex();
+}
+
+// NOLINTNEXTLINE
+TEST(SHA256, Empty) {
+  EXPECT_EQ(Hash(""),
+            "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855");
+}
+
+// NOLINTNEXTLINE
+TEST(SHA256, OneBlock) {
+  EXPECT_EQ(Hash("abc"),
+            "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad");
+}
+
+// NOLINTNEXTLINE
+TEST(SHA256, TwoBlocks) {
+  EXPECT_EQ(
+      Hash("abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq"),
+      "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1");
+}
+
+// NOLINTNEXTLINE
+TEST(SHA256, Split) {
+  std::string data(1000000, 'a');
+  const char* expected =
+      "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0";
+  EXPECT_EQ(Hash(data), expected);
+  EXPECT_EQ(Hash(data, 1), expected);
+  EXPECT_EQ(Hash(data, 63), expected);
+  EXPECT_EQ(Hash(data, 4096 + 7), expected);
+}
+
+}  // namespace
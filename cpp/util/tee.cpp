@@ -0,0 +1,150 @@
+#include "util/tee.hpp"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <system_error>
+
+namespace {
+
+const constexpr size_t kBufferSize = 64 * 1024;
+
+// Milliseconds between the attempts to open the outputs without a reader.
+const constexpr int kOpenInterval = 10;
+// Milliseconds between the checks of Stop while the stream is idle.
+const constexpr int kStopInterval = 50;
+
+}  // namespace
+
+namespace util {
+
+Tee::Tee(const std::string& source, const std::string& path,
+         const std::vector<std::string>& outputs)
+    : source_(source), path_(path) {
+  for (const std::string& output : outputs) {
+    outputs_.emplace_back();
+    outputs_.back().path = output;
+  }
+}
+
+Tee::~Tee() {
+  for (Output& output : outputs_) {
+    if (output.fd != -1) close(output.fd);
+  }
+  if (source_fd_ != -1) close(source_fd_);
+  if (file_fd_ != -1) close(file_fd_);
+}
+
+bool Tee::Flush(Output* output, bool eof) {
+  char buf[kBufferSize];
+  while (output->pos < size_) {
+    size_t amount = std::min<uint64_t>(size_ - output->pos, sizeof(buf));
+    ssize_t n = pread(file_fd_, buf, amount, output->pos);
+    if (n <= 0) {
+      if (n == -1 && errno == EINTR) continue;
+      throw std::system_error(errno, std::system_category(), "pread " + path_);
+    }
+    ssize_t written = write(output->fd, buf, n);
+    if (written == -1) {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN) return false;
+      // The readers are gone.
+      close(output->fd);
+      output->fd = -1;
+      output->closed = true;
+      return true;
+    }
+    output->pos += written;
+    if (written < n) return false;
+  }
+  if (eof) {
+    // The readers see the end of the stream.
+    close(output->fd);
+    output->fd = -1;
+    output->closed = true;
+  }
+  return true;
+}
+
+void Tee::Run() {
+  // Opening the source does not wait for a writer. It is not seen as closed
+  // until a writer has opened it and closed it.
+  source_fd_ = open(source_.c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+  if (source_fd_ == -1) {
+    throw std::system_error(errno, std::system_category(), "open " + source_);
+  }
+  file_fd_ = open(path_.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC,
+                  S_IRUSR | S_IWUSR);
+  if (file_fd_ == -1) {
+    throw std::system_error(errno, std::system_category(), "open " + path_);
+  }
+  bool eof = false;
+  std::vector<struct pollfd> fds;
+  while (true) {
+    bool stop = stop_;
+    bool waiting_reader = false;
+    bool pending = false;
+    fds.clear();
+    if (!eof) {
+      fds.push_back({source_fd_, POLLIN, 0});
+    }
+    for (Output& output : outputs_) {
+      if (output.closed) continue;
+      if (output.fd == -1) {
+        output.fd =
+            open(output.path.c_str(), O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+        if (output.fd == -1) {
+          if (errno != ENXIO) {
+            throw std::system_error(errno, std::system_category(),
+                                    "open " + output.path);
+          }
+          waiting_reader = true;
+          pending = true;
+          continue;
+        }
+      }
+      if (!Flush(&output, eof)) {
+        fds.push_back({output.fd, POLLOUT, 0});
+      }
+      if (!output.closed) pending = true;
+    }
+    if (eof && !pending) break;
+    int timeout = stop ? 0 : waiting_reader ? kOpenInterval : kStopInterval;
+    int ret = poll(fds.data(), fds.size(), timeout);
+    if (ret == -1) {
+      if (errno == EINTR) continue;
+      throw std::system_error(errno, std::system_category(), "poll");
+    }
+    if (ret == 0 && stop) break;
+    if (eof || (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) == 0) continue;
+    char buf[kBufferSize];
+    ssize_t n = read(source_fd_, buf, sizeof(buf));
+    if (n == -1) {
+      if (errno == EINTR || errno == EAGAIN) continue;
+      throw std::system_error(errno, std::system_category(), "read " + source_);
+    }
+    if (n == 0) {
+      eof = true;
+      continue;
+    }
+    for (ssize_t done = 0; done < n;) {
+      ssize_t written = pwrite(file_fd_, buf + done, n - done, size_ + done);
+      if (written == -1) {
+        if (errno == EINTR) continue;
+        throw std::system_error(errno, std::system_category(),
+                                "write " + path_);
+      }
+      done += written;
+    }
+    size_ += n;
+  }
+  close(source_fd_);
+  source_fd_ = -1;
+  close(file_fd_);
+  file_fd_ = -1;
+}
+
+}  // namespace util
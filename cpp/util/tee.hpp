@@ -0,0 +1,64 @@
+#ifndef UTIL_TEE_HPP
+#define UTIL_TEE_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace util {
+
+// Copies what is written to a FIFO to a file and to other FIFOs, so that the
+// readers of a stream can start before its writer is done and its contents
+// can still be stored. The file also buffers the stream for the readers, so
+// a slow reader does not slow down the writer or the other readers.
+//
+// Writing to a reader that is gone must fail with EPIPE instead of raising
+// SIGPIPE.
+class Tee {
+ public:
+  Tee(const std::string& source, const std::string& path,
+      const std::vector<std::string>& outputs);
+  ~Tee();
+
+  Tee(const Tee&) = delete;
+  Tee& operator=(const Tee&) = delete;
+
+  // Runs until the writers of source closed it and each output got all the
+  // stream or was closed by its readers, or until Stop is called and there is
+  // nothing left to read. The outputs are opened once they have a reader.
+  // Throws std::system_error if source or the file cannot be opened.
+  void Run();
+
+  // Makes Run return once there is nothing left to read, also if some
+  // outputs were never opened or not read until the end. It should be called
+  // once the processes that use the stream are done. Thread safe.
+  void Stop() { stop_ = true; }
+
+  // Size of the stream so far.
+  uint64_t Size() const { return size_; }
+
+ private:
+  struct Output {
+    std::string path;
+    int fd = -1;
+    uint64_t pos = 0;
+    bool closed = false;
+  };
+
+  // Copies to the output what it did not get yet. Returns false if it is
+  // still waiting for it to be read.
+  bool Flush(Output* output, bool eof);
+
+  std::string source_;
+  std::string path_;
+  std::vector<Output> outputs_;
+  int source_fd_ = -1;
+  int file_fd_ = -1;
+  std::atomic<bool> stop_{false};
+  std::atomic<uint64_t> size_{0};
+};
+
+}  // namespace util
+
+#endif
@@ -0,0 +1,96 @@
+#include "util/tee.hpp"
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <csignal>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "gtest/gtest.h"
+#include "util/file.hpp"
+
+namespace {
+
+std::string ReadAll(const std::string& path) {
+  std::ifstream in(path);
+  std::stringstream contents;
+  contents << in.rdbuf();
+  return contents.str();
+}
+
+void WriteAll(const std::string& path, const std::string& data) {
+  int fd = open(path.c_str(), O_WRONLY);  // NOLINT
+  ASSERT_NE(fd, -1);
+  for (size_t pos = 0; pos < data.size(); pos += 1000) {
+    size_t n = std::min<size_t>(1000, data.size() - pos);
+    ASSERT_EQ(write(fd, data.data() + pos, n), static_cast<ssize_t>(n));
+  }
+  close(fd);
+}
+
+class TeeTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    signal(SIGPIPE, SIG_IGN);  // NOLINT
+    for (int i = 0; i < 3; i++) {
+      paths_.push_back(util::File::JoinPath(tmp_.Path(), std::to_string(i)));
+      ASSERT_EQ(mkfifo(paths_.back().c_str(), S_IRUSR | S_IWUSR), 0);
+    }
+    file_ = util::File::JoinPath(tmp_.Path(), "stream");
+    for (size_t i = 0; i < 1 << 20; i++) data_ += 'a' + i % 23;
+  }
+
+  util::TempDir tmp_{"/tmp"};
+  std::vector<std::string> paths_;
+  std::string file_;
+  std::string data_;
+};
+
+// NOLINTNEXTLINE
+TEST_F(TeeTest, Copy) {
+  util::Tee tee(paths_[0], file_, {paths_[1], paths_[2]});
+  std::thread run([&tee]() { tee.Run(); });
+  std::string first;
+  std::string second;
+  std::thread reader([this, &first]() { first = ReadAll(paths_[1]); });
+  // The writer does not wait for the second reader.
+  WriteAll(paths_[0], data_);
+  second = ReadAll(paths_[2]);
+  reader.join();
+  run.join();
+  EXPECT_EQ(first, data_);
+  EXPECT_EQ(second, data_);
+  EXPECT_EQ(ReadAll(file_), data_);
+  EXPECT_EQ(tee.Size(), data_.size());
+}
+
+// NOLINTNEXTLINE
+TEST_F(TeeTest, ReaderGone) {
+  util::Tee tee(paths_[0], file_, {paths_[1], paths_[2]});
+  std::thread run([&tee]() { tee.Run(); });
+  std::thread reader([this]() {
+    int fd = open(paths_[1].c_str(), O_RDONLY);  // NOLINT
+    char buf[10];
+    EXPECT_EQ(read(fd, buf, sizeof(buf)), 10);
+    close(fd);
+  });
+  WriteAll(paths_[0], data_);
+  reader.join();
+  // The second output is never opened.
+  tee.Stop();
+  run.join();
+  EXPECT_EQ(ReadAll(file_), data_);
+}
+
+// NOLINTNEXTLINE
+TEST_F(TeeTest, NoWriter) {
+  util::Tee tee(paths_[0], file_, {paths_[1]});
+  std::thread run([&tee]() { tee.Run(); });
+  tee.Stop();
+  run.join();
+  EXPECT_EQ(ReadAll(file_), "");
+}
+
+}  // namespace
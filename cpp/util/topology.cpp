@@ -0,0 +1,100 @@
+#include "util/topology.hpp"
+#include <algorithm>
+#include <fstream>
+#include <map>
+#include <set>
+#include <stdexcept>
+#include <thread>
+#include "util/file.hpp"
+#include "util/misc.hpp"
+
+namespace {
+bool ReadLine(const std::string& path, std::string* line) {
+  std::ifstream in(path);
+  return static_cast<bool>(std::getline(in, *line));
+}
+}  // namespace
+
+namespace util {
+
+std::vector<int> ParseCpuList(const std::string& list) {
+  std::vector<int> cpus;
+  for (const std::string& range : split(list, ',')) {
+    size_t dash = range.find('-');
+    int first = std::stoi(range.substr(0, dash));
+    int last =
+        dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+    if (first < 0 || last < first) {
+      throw std::invalid_argument("Invalid cpu range: " + range);
+    }
+    for (int cpu = first; cpu <= last; cpu++) cpus.push_back(cpu);
+  }
+  return cpus;
+}
+
+std::string CpuModel(const std::string& path) {
+  std::ifstream in(path);
+  std::string line;
+  while (std::getline(in, line)) {
+    size_t colon = line.find(':');
+    if (colon == std::string::npos) continue;
+    std::string key = line.substr(0, colon);
+    key.erase(key.find_last_not_of(" \t") + 1);
+    if (key != "model name") continue;
+    size_t start = line.find_first_not_of(' ', colon + 1);
+    return start == std::string::npos ? "" : line.substr(start);
+  }
+  return "";
+}
+
+Topology::Topology(std::vector<Cpu> cpus) : cpus_(std::move(cpus)) {}
+
+Topology Topology::Read(size_t max_cpus, const std::string& root) {
+  std::vector<Cpu> cpus;
+  try {
+    std::string line;
+    if (!ReadLine(File::JoinPath(root, "cpu/online"), &line)) {
+      throw std::runtime_error("Unknown online cpus");
+    }
+    std::map<int, int> nodes;
+    for (int node = 0;; node++) {
+      std::string node_list;
+      std::string path = "node/node" + std::to_string(node) + "/cpulist";
+      if (!ReadLine(File::JoinPath(root, path), &node_list)) break;
+      for (int cpu : ParseCpuList(node_list)) nodes[cpu] = node;
+    }
+    for (int cpu : ParseCpuList(line)) {
+      std::string siblings;
+      std::string path =
+          "cpu/cpu" + std::to_string(cpu) + "/topology/thread_siblings_list";
+      int core = cpu;
+      if (ReadLine(File::JoinPath(root, path), &siblings)) {
+        std::vector<int> ids = ParseCpuList(siblings);
+        if (!ids.empty()) core = *std::min_element(ids.begin(), ids.end());
+      }
+      cpus.push_back(Cpu{cpu, core, nodes.count(cpu) ? nodes[cpu] : 0});
+    }
+  } catch (std::exception& /*exc*/) {
+    cpus.clear();
+    int num_cpus = std::max<int>(std::thread::hardware_concurrency(), 1);
+    for (int cpu = 0; cpu < num_cpus; cpu++) cpus.push_back(Cpu{cpu, cpu, 0});
+  }
+  if (max_cpus && cpus.size() > max_cpus) cpus.resize(max_cpus);
+  return Topology(std::move(cpus));
+}
+
+std::vector<std::vector<int>> Topology::Cores() const {
+  std::map<int, std::vector<int>> cores;
+  for (const Cpu& cpu : cpus_) cores[cpu.core].push_back(cpu.id);
+  std::vector<std::vector<int>> result;
+  for (auto& kv : cores) result.push_back(std::move(kv.second));
+  return result;
+}
+
+std::vector<int> Topology::Nodes() const {
+  std::set<int> nodes;
+  for (const Cpu& cpu : cpus_) nodes.insert(cpu.node);
+  return std::vector<int>(nodes.begin(), nodes.end());
+}
+
+}  // namespace util
@@ -0,0 +1,48 @@
+#ifndef UTIL_TOPOLOGY_HPP
+#define UTIL_TOPOLOGY_HPP
+#include <string>
+#include <vector>
+
+namespace util {
+
+// Parses a list of cpus in the kernel format, like "0-3,8,10-11".
+std::vector<int> ParseCpuList(const std::string& list);
+
+// Reads the model name of the first cpu from a file like /proc/cpuinfo, or
+// returns an empty string if it is not there.
+std::string CpuModel(const std::string& path = "/proc/cpuinfo");
+
+// Logical cpus of the machine, with the physical core and the NUMA node they
+// belong to.
+class Topology {
+ public:
+  struct Cpu {
+    int id;
+    // Smallest id of the cpus that share the physical core with this one.
+    int core;
+    int node;
+  };
+
+  explicit Topology(std::vector<Cpu> cpus);
+
+  // Reads the topology from a sysfs tree like /sys/devices/system, keeping
+  // only the first max_cpus online cpus if max_cpus is not 0. If the tree
+  // cannot be read, every cpu is considered a separate core of a single node.
+  static Topology Read(size_t max_cpus = 0,
+                       const std::string& root = "/sys/devices/system");
+
+  const std::vector<Cpu>& Cpus() const { return cpus_; }
+
+  // Ids of the cpus, grouped by physical core.
+  std::vector<std::vector<int>> Cores() const;
+
+  // Ids of the NUMA nodes, in increasing order.
+  std::vector<int> Nodes() const;
+
+ private:
+  std::vector<Cpu> cpus_;
+};
+
+}  // namespace util
+
+#endif
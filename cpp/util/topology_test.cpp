@@ -0,0 +1,75 @@
+#include "util/topology.hpp"
+#include <fstream>
+#include <stdexcept>
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "util/file.hpp"
+
+namespace {
+
+using ::testing::ElementsAre;
+
+const std::string test_tmpdir = "/tmp/task_maker_testdir";
+
+void writeFile(const std::string& dir, const std::string& name,
+               const std::string& content) {
+  util::File::MakeDirs(dir);
+  std::ofstream of(util::File::JoinPath(dir, name));
+  of << content << "\n";
+}
+
+// NOLINTNEXTLINE
+TEST(Topology, ParseCpuList) {
+  EXPECT_THAT(util::ParseCpuList("0"), ElementsAre(0));
+  EXPECT_THAT(util::ParseCpuList("0-3,8,10-11"),
+              ElementsAre(0, 1, 2, 3, 8, 10, 11));
+  EXPECT_THAT(util::ParseCpuList(""), ElementsAre());
+  EXPECT_THROW(util::ParseCpuList("3-1"), std::invalid_argument);
+  EXPECT_THROW(util::ParseCpuList("a"), std::invalid_argument);
+}
+
+// NOLINTNEXTLINE
+TEST(Topology, Read) {
+  util::TempDir tmp(test_tmpdir);
+  std::string root = tmp.Path();
+  writeFile(root + "/cpu", "online", "0-3");
+  for (int cpu = 0; cpu < 4; cpu++) {
+    writeFile(root + "/cpu/cpu" + std::to_string(cpu) + "/topology",
+              "thread_siblings_list", cpu % 2 ? "1,3" : "0,2");
+  }
+  writeFile(root + "/node/node0", "cpulist", "0-1");
+  writeFile(root + "/node/node1", "cpulist", "2-3");
+
+  util::Topology topology = util::Topology::Read(0, root);
+  ASSERT_EQ(topology.Cpus().size(), 4);
+  EXPECT_EQ(topology.Cpus()[2].core, 0);
+  EXPECT_EQ(topology.Cpus()[2].node, 1);
+  EXPECT_THAT(topology.Cores(),
+              ElementsAre(ElementsAre(0, 2), ElementsAre(1, 3)));
+  EXPECT_THAT(topology.Nodes(), ElementsAre(0, 1));
+
+  util::Topology limited = util::Topology::Read(2, root);
+  EXPECT_THAT(limited.Cores(), ElementsAre(ElementsAre(0), ElementsAre(1)));
+  EXPECT_THAT(limited.Nodes(), ElementsAre(0));
+}
+
+// NOLINTNEXTLINE
+TEST(Topology, Fallback) {
+  util::Topology topology =
+      util::Topology::Read(1, test_tmpdir + "/does/not/exist");
+  ASSERT_EQ(topology.Cpus().size(), 1);
+  EXPECT_EQ(topology.Cpus()[0].core, topology.Cpus()[0].id);
+}
+
+// NOLINTNEXTLINE
+TEST(Topology, CpuModel) {
+  util::TempDir tmp(test_tmpdir);
+  writeFile(tmp.Path(), "cpuinfo",
+            "processor\t: 0\nvendor_id\t: GenuineIntel\n"
+            "model name\t: Intel(R) Xeon(R) CPU @ 2.20GHz\n");
+  EXPECT_EQ(util::CpuModel(tmp.Path() + "/cpuinfo"),
+            "Intel(R) Xeon(R) CPU @ 2.20GHz");
+  EXPECT_EQ(util::CpuModel(tmp.Path() + "/missing"), "");
+}
+
+}  // namespace
@@ -0,0 +1,113 @@
+#include "util/trace.hpp"
+#include <chrono>
+#include <cstdio>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <unordered_map>
+
+namespace util {
+namespace {
+
+std::mutex& TracesMutex() {
+  static std::mutex mutex;
+  return mutex;
+}
+
+std::unordered_map<uint32_t, std::vector<Tracer::Span>>& Traces() {
+  static std::unordered_map<uint32_t, std::vector<Tracer::Span>> traces;
+  return traces;
+}
+
+std::string Quote(const std::string& text) {
+  std::string quoted = "\"";
+  for (char c : text) {
+    if (c == '"' || c == '\\') {
+      quoted += '\\';
+      quoted += c;
+    } else if (static_cast<unsigned char>(c) < 0x20) {
+      char buf[8];
+      snprintf(buf, sizeof(buf), "\\u%04x", c);
+      quoted += buf;
+    } else {
+      quoted += c;
+    }
+  }
+  return quoted + "\"";
+}
+
+}  // namespace
+
+uint64_t Tracer::NowMicros() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::system_clock::now().time_since_epoch())
+      .count();
+}
+
+void Tracer::Start(uint32_t evaluation) {
+  std::lock_guard<std::mutex> lck(TracesMutex());
+  Traces()[evaluation];
+}
+
+bool Tracer::Enabled(uint32_t evaluation) {
+  std::lock_guard<std::mutex> lck(TracesMutex());
+  return Traces().count(evaluation);
+}
+
+void Tracer::Add(uint32_t evaluation, Span span) {
+  std::lock_guard<std::mutex> lck(TracesMutex());
+  auto it = Traces().find(evaluation);
+  if (it == Traces().end()) return;
+  it->second.push_back(std::move(span));
+}
+
+std::string Tracer::Finish(uint32_t evaluation) {
+  std::vector<Span> spans;
+  {
+    std::lock_guard<std::mutex> lck(TracesMutex());
+    auto it = Traces().find(evaluation);
+    if (it == Traces().end()) return ToJson({});
+    spans = std::move(it->second);
+    Traces().erase(it);
+  }
+  return ToJson(spans);
+}
+
+std::string Tracer::ToJson(const std::vector<Span>& spans) {
+  // The processes and the tracks are numbered, and named by metadata events.
+  std::map<std::string, size_t> processes;
+  std::map<std::pair<size_t, std::string>, size_t> tracks;
+  std::ostringstream events;
+  for (const Span& span : spans) {
+    size_t pid = processes.emplace(span.process, processes.size() + 1)
+                     .first->second;
+    size_t tid =
+        tracks.emplace(std::make_pair(pid, span.track), tracks.size() + 1)
+            .first->second;
+    events << ",\n{\"name\":" << Quote(span.name)
+           << ",\"cat\":\"task-maker\",\"ph\":\"X\",\"ts\":" << span.start
+           << ",\"dur\":" << span.duration << ",\"pid\":" << pid
+           << ",\"tid\":" << tid << "}";
+  }
+  std::ostringstream out;
+  out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+  bool first = true;
+  for (const auto& process : processes) {
+    out << (first ? "\n" : ",\n") << "{\"name\":\"process_name\",\"ph\":\"M\","
+        << "\"pid\":" << process.second
+        << ",\"args\":{\"name\":" << Quote(process.first) << "}}";
+    first = false;
+  }
+  for (const auto& track : tracks) {
+    out << (first ? "\n" : ",\n") << "{\"name\":\"thread_name\",\"ph\":\"M\","
+        << "\"pid\":" << track.first.first << ",\"tid\":" << track.second
+        << ",\"args\":{\"name\":" << Quote(track.first.second) << "}}";
+    first = false;
+  }
+  // The spans always follow their metadata, after a comma.
+  out << events.str();
+  out << "\n]}\n";
+  return out.str();
+}
+
+}  // namespace util
@@ -0,0 +1,41 @@
+#ifndef UTIL_TRACE_HPP
+#define UTIL_TRACE_HPP
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace util {
+
+// Collects the spans of the phases of the evaluations, to export them in the
+// Chrome trace event format (chrome://tracing, Perfetto). Only the spans of
+// the evaluations that are started are kept. All the methods are thread
+// safe.
+class Tracer {
+ public:
+  struct Span {
+    std::string name;
+    // The process that ran the phase, like "server" or "worker".
+    std::string process;
+    // The track of the span in the process, like the description of the
+    // execution.
+    std::string track;
+    // In microseconds since the epoch.
+    uint64_t start;
+    uint64_t duration;
+  };
+
+  static uint64_t NowMicros();
+
+  // Starts collecting the spans of the evaluation.
+  static void Start(uint32_t evaluation);
+  static bool Enabled(uint32_t evaluation);
+  static void Add(uint32_t evaluation, Span span);
+  // Stops collecting the spans of the evaluation and returns them in JSON.
+  static std::string Finish(uint32_t evaluation);
+
+  static std::string ToJson(const std::vector<Span>& spans);
+};
+
+}  // namespace util
+
+#endif
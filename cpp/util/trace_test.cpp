@@ -0,0 +1,43 @@
+#include "util/trace.hpp"
+#include <string>
+#include "gtest/gtest.h"
+
+namespace {
+
+// NOLINTNEXTLINE
+TEST(Tracer, OnlyStartedEvaluations) {
+  util::Tracer::Add(1, {"run", "worker", "sol", 10, 5});
+  EXPECT_FALSE(util::Tracer::Enabled(1));
+  util::Tracer::Start(2);
+  EXPECT_TRUE(util::Tracer::Enabled(2));
+  util::Tracer::Add(2, {"run", "worker", "sol", 10, 5});
+  std::string json = util::Tracer::Finish(2);
+  EXPECT_NE(json.find("\"ph\":\"X\",\"ts\":10,\"dur\":5"), std::string::npos);
+  EXPECT_FALSE(util::Tracer::Enabled(2));
+  EXPECT_EQ(util::Tracer::Finish(1), util::Tracer::ToJson({}));
+}
+
+// NOLINTNEXTLINE
+TEST(Tracer, NamesProcessesAndTracks) {
+  std::string json = util::Tracer::ToJson({{"queued", "server", "sol", 1, 2},
+                                            {"run", "worker", "sol", 3, 4},
+                                            {"queued", "server", "chk", 5, 6}});
+  EXPECT_NE(json.find("\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,"
+                      "\"args\":{\"name\":\"server\"}"),
+            std::string::npos);
+  EXPECT_NE(json.find("\"name\":\"process_name\",\"ph\":\"M\",\"pid\":2,"
+                      "\"args\":{\"name\":\"worker\"}"),
+            std::string::npos);
+  EXPECT_NE(json.find("\"pid\":1,\"tid\":3,\"args\":{\"name\":\"chk\"}"),
+            std::string::npos);
+  EXPECT_NE(json.find("\"ts\":5,\"dur\":6,\"pid\":1,\"tid\":3}"),
+            std::string::npos);
+}
+
+// NOLINTNEXTLINE
+TEST(Tracer, QuotesNames) {
+  std::string json = util::Tracer::ToJson({{"a\"b\\c\n", "p", "t", 0, 0}});
+  EXPECT_NE(json.find("\"a\\\"b\\\\c\\u000a\""), std::string::npos);
+}
+
+}  // namespace
@@ -0,0 +1,66 @@
+#include "util/transfer_scheduler.hpp"
+#include <algorithm>
+
+namespace util {
+
+TransferScheduler::Slot::~Slot() { scheduler_->Release(priority_); }
+
+kj::Promise<kj::Own<TransferScheduler::Slot>> TransferScheduler::Acquire(
+    TransferPriority priority, uint64_t peer) {
+  auto pf = kj::newPromiseAndFulfiller<kj::Own<Slot>>();
+  queues_[static_cast<size_t>(priority)].peers[peer].push(
+      std::move(pf.fulfiller));
+  StartNext();
+  return std::move(pf.promise);
+}
+
+bool TransferScheduler::CanStart(TransferPriority priority) const {
+  size_t running = 0;
+  for (size_t count : running_) running += count;
+  if (running >= max_concurrent_) return false;
+  if (priority == TransferPriority::BULK) {
+    size_t max_bulk = std::max<size_t>(max_concurrent_ / 2, 1);
+    return Running(TransferPriority::BULK) < max_bulk;
+  }
+  return true;
+}
+
+void TransferScheduler::StartNext() {
+  for (size_t p = 0; p < kNumPriorities; p++) {
+    auto priority = static_cast<TransferPriority>(p);
+    Queue& queue = queues_[p];
+    while (!queue.peers.empty() && CanStart(priority)) {
+      auto it = queue.peers.lower_bound(queue.next_peer);
+      if (it == queue.peers.end()) it = queue.peers.begin();
+      auto fulfiller = std::move(it->second.front());
+      it->second.pop();
+      queue.next_peer = it->first + 1;
+      if (it->second.empty()) queue.peers.erase(it);
+      // The transfer was canceled while waiting.
+      if (!fulfiller->isWaiting()) continue;
+      running_[p]++;
+      fulfiller->fulfill(kj::heap<Slot>(this, priority));
+    }
+    // Lower priorities wait as long as there are queued transfers here.
+    if (!queue.peers.empty()) return;
+  }
+}
+
+void TransferScheduler::Release(TransferPriority priority) {
+  running_[static_cast<size_t>(priority)]--;
+  StartNext();
+}
+
+int64_t TransferScheduler::SendBulk(size_t bytes, int64_t now_micros) {
+  if (bulk_bandwidth_ == 0) return 0;
+  next_bulk_micros_ = std::max(next_bulk_micros_, now_micros) +
+                      bytes * 1000000 / bulk_bandwidth_;
+  return next_bulk_micros_ - now_micros;
+}
+
+TransferScheduler& TransferScheduler::Get() {
+  static TransferScheduler* scheduler = new TransferScheduler();
+  return *scheduler;
+}
+
+}  // namespace util
@@ -0,0 +1,91 @@
+#ifndef UTIL_TRANSFER_SCHEDULER_HPP
+#define UTIL_TRANSFER_SCHEDULER_HPP
+#include <kj/async.h>
+#include <kj/common.h>
+#include <cstdint>
+#include <map>
+#include <queue>
+
+namespace util {
+
+enum class TransferPriority {
+  // Files that some request is waiting for.
+  INPUT = 0,
+  // Downloads of outputs, that nothing else is waiting for.
+  BULK = 1,
+};
+
+// Limits the number of files that are sent at the same time. Input transfers
+// start before bulk ones, and the transfers with the same priority are started
+// in round robin between the peers that asked for them, so that a peer that
+// asks for many files cannot starve the others. Bulk transfers get at most
+// half of the slots, so that there is always room for the inputs.
+class TransferScheduler {
+ public:
+  // Releases the slot of a transfer when destroyed.
+  class Slot {
+   public:
+    Slot(TransferScheduler* scheduler, TransferPriority priority)
+        : scheduler_(scheduler), priority_(priority) {}
+    ~Slot();
+    KJ_DISALLOW_COPY(Slot);
+
+   private:
+    TransferScheduler* scheduler_;
+    TransferPriority priority_;
+  };
+
+  explicit TransferScheduler(size_t max_concurrent = 128)
+      : max_concurrent_(max_concurrent) {}
+  KJ_DISALLOW_COPY(TransferScheduler);
+
+  // Returns a promise that resolves with a slot when the transfer can start.
+  kj::Promise<kj::Own<Slot>> Acquire(TransferPriority priority,
+                                     uint64_t peer = 0) KJ_WARN_UNUSED_RESULT;
+
+  // Number of transfers of the given priority that are running.
+  size_t Running(TransferPriority priority) const {
+    return running_[static_cast<size_t>(priority)];
+  }
+
+  // Limits the rate of the bulk transfers, 0 means unlimited.
+  void SetBulkBandwidth(uint64_t bytes_per_second) {
+    bulk_bandwidth_ = bytes_per_second;
+  }
+
+  // Accounts for bytes sent by a bulk transfer at the given time, and returns
+  // how many microseconds the bulk transfers should wait before sending more.
+  int64_t SendBulk(size_t bytes, int64_t now_micros);
+
+  // Timer used to delay the bulk transfers, if their bandwidth is limited.
+  void SetTimer(kj::Timer* timer) { timer_ = timer; }
+  kj::Timer* Timer() const { return timer_; }
+
+  // Scheduler of the transfers of this process.
+  static TransferScheduler& Get();
+
+ private:
+  static const constexpr size_t kNumPriorities = 2;
+
+  struct Queue {
+    std::map<uint64_t, std::queue<kj::Own<kj::PromiseFulfiller<kj::Own<Slot>>>>>
+        peers;
+    // Peers before this one have already been served in the current round.
+    uint64_t next_peer = 0;
+  };
+
+  bool CanStart(TransferPriority priority) const;
+  void StartNext();
+  void Release(TransferPriority priority);
+
+  size_t max_concurrent_;
+  size_t running_[kNumPriorities] = {};
+  Queue queues_[kNumPriorities];
+  uint64_t bulk_bandwidth_ = 0;
+  int64_t next_bulk_micros_ = 0;
+  kj::Timer* timer_ = nullptr;
+};
+
+}  // namespace util
+
+#endif
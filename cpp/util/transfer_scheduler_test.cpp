@@ -0,0 +1,96 @@
+#include "util/transfer_scheduler.hpp"
+#include <kj/async.h>
+#include <vector>
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+namespace {
+
+using ::testing::ElementsAre;
+using Slot = kj::Own<util::TransferScheduler::Slot>;
+
+// Runs the events that are already queued.
+void Drain(kj::WaitScope& wait_scope) {
+  kj::evalLater([]() {}).wait(wait_scope);
+}
+
+kj::Promise<Slot> Record(kj::Promise<Slot> promise, std::vector<int>* started,
+                         int id) {
+  return promise
+      .then([started, id](Slot slot) {
+        started->push_back(id);
+        return slot;
+      })
+      .eagerlyEvaluate(nullptr);
+}
+
+// NOLINTNEXTLINE
+TEST(TransferScheduler, Limit) {
+  kj::EventLoop loop;
+  kj::WaitScope wait_scope(loop);
+  util::TransferScheduler scheduler(2);
+  std::vector<int> started;
+  kj::Promise<Slot> a =
+      Record(scheduler.Acquire(util::TransferPriority::INPUT), &started, 1);
+  kj::Promise<Slot> b =
+      Record(scheduler.Acquire(util::TransferPriority::INPUT), &started, 2);
+  kj::Promise<Slot> c =
+      Record(scheduler.Acquire(util::TransferPriority::INPUT), &started, 3);
+  Drain(wait_scope);
+  EXPECT_THAT(started, ElementsAre(1, 2));
+  EXPECT_EQ(scheduler.Running(util::TransferPriority::INPUT), 2);
+  a.wait(wait_scope);  // The slot is released immediately.
+  c.wait(wait_scope);
+  EXPECT_THAT(started, ElementsAre(1, 2, 3));
+}
+
+// NOLINTNEXTLINE
+TEST(TransferScheduler, RoundRobin) {
+  kj::EventLoop loop;
+  kj::WaitScope wait_scope(loop);
+  util::TransferScheduler scheduler(1);
+  std::vector<int> started;
+  Slot first =
+      scheduler.Acquire(util::TransferPriority::INPUT, 1).wait(wait_scope);
+  kj::Promise<Slot> a =
+      Record(scheduler.Acquire(util::TransferPriority::INPUT, 1), &started, 1);
+  kj::Promise<Slot> b =
+      Record(scheduler.Acquire(util::TransferPriority::INPUT, 1), &started, 2);
+  kj::Promise<Slot> c =
+      Record(scheduler.Acquire(util::TransferPriority::INPUT, 2), &started, 3);
+  first = nullptr;
+  Slot slot = c.wait(wait_scope);
+  EXPECT_THAT(started, ElementsAre(3));
+  slot = nullptr;
+  slot = a.wait(wait_scope);
+  EXPECT_THAT(started, ElementsAre(3, 1));
+}
+
+// NOLINTNEXTLINE
+TEST(TransferScheduler, Priorities) {
+  kj::EventLoop loop;
+  kj::WaitScope wait_scope(loop);
+  util::TransferScheduler scheduler(2);
+  std::vector<int> started;
+  kj::Promise<Slot> a =
+      Record(scheduler.Acquire(util::TransferPriority::BULK), &started, 1);
+  kj::Promise<Slot> b =
+      Record(scheduler.Acquire(util::TransferPriority::BULK), &started, 2);
+  kj::Promise<Slot> c =
+      Record(scheduler.Acquire(util::TransferPriority::INPUT), &started, 3);
+  Drain(wait_scope);
+  // Half of the slots are kept for the inputs.
+  EXPECT_THAT(started, ElementsAre(1, 3));
+}
+
+// NOLINTNEXTLINE
+TEST(TransferScheduler, Bandwidth) {
+  util::TransferScheduler scheduler;
+  EXPECT_EQ(scheduler.SendBulk(1000, 0), 0);
+  scheduler.SetBulkBandwidth(1000);
+  EXPECT_EQ(scheduler.SendBulk(500, 0), 500000);
+  EXPECT_EQ(scheduler.SendBulk(500, 0), 1000000);
+  EXPECT_EQ(scheduler.SendBulk(100, 2000000), 100000);
+}
+
+}  // namespace
@@ -1,30 +1,98 @@
 #include "util/which.hpp"
+#include <sys/stat.h>
+#include <chrono>
 #include <cstdlib>
+#include <mutex>
 #include <sstream>
 #include <string>
 #include <unordered_map>
+#include <utility>
 #include <vector>
 #include "util/file.hpp"
 #include "util/misc.hpp"
 
 namespace {
-std::unordered_map<std::string, std::string> cmd_cache;
+// Resolutions are checked again after this long, to notice the programs that
+// are installed or removed.
+const constexpr auto kRevalidateInterval = std::chrono::seconds(5);
+
+// Last modification time of the directory, or -1 if it does not exist.
+int64_t DirectoryTime(const std::string& dir) {
+  struct stat st {};
+  if (stat(dir.c_str(), &st) == -1) return -1;
+  return static_cast<int64_t>(st.st_mtime);
+}
+
+struct Resolution {
+  // Empty if the command was not found.
+  std::string path;
+  // Value of PATH when the command was resolved.
+  std::string env_path;
+  // Directories that were looked into, with their modification times. Adding
+  // or removing a file in them changes their time.
+  std::vector<std::pair<std::string, int64_t>> dirs;
+  std::chrono::steady_clock::time_point checked;
+};
+
+std::mutex cmd_cache_mutex;
+std::unordered_map<std::string, Resolution> cmd_cache;
+
+// Returns true if the resolution would still give the same result.
+bool StillValid(Resolution* resolution, const std::string& env_path) {
+  if (resolution->env_path != env_path) return false;
+  auto now = std::chrono::steady_clock::now();
+  if (now - resolution->checked < kRevalidateInterval) return true;
+  for (const auto& dir : resolution->dirs) {
+    if (DirectoryTime(dir.first) != dir.second) return false;
+  }
+  resolution->checked = now;
+  return true;
+}
 }  // namespace
 
 namespace util {
 
 std::string which(const std::string& cmd, bool use_cache) {
-  static const std::string path = std::getenv("PATH");
-  static const std::vector<std::string> dirs = split(path, ':');
-
-  if (use_cache && cmd_cache.count(cmd) > 0) return cmd_cache[cmd];
+  const char* env = std::getenv("PATH");
+  std::string env_path = env ? env : "";
+  std::lock_guard<std::mutex> lck(cmd_cache_mutex);
+  if (use_cache) {
+    auto it = cmd_cache.find(cmd);
+    if (it != cmd_cache.end() && StillValid(&it->second, env_path)) {
+      return it->second.path;
+    }
+  }
 
-  for (const std::string& dir : dirs) {
+  Resolution resolution;
+  resolution.env_path = env_path;
+  resolution.checked = std::chrono::steady_clock::now();
+  for (const std::string& dir : split(env_path, ':')) {
+    resolution.dirs.emplace_back(dir, DirectoryTime(dir));
     std::string fullpath = util::File::JoinPath(dir, cmd);
-    if (File::Exists(fullpath)) return cmd_cache[cmd] = fullpath;
+    if (File::Exists(fullpath)) {
+      resolution.path = fullpath;
+      break;
+    }
   }
+  std::string path = resolution.path;
+  cmd_cache[cmd] = std::move(resolution);
+  return path;
+}
 
-  return "";
+const std::vector<std::string>& KnownPrograms() {
+  static const std::vector<std::string> programs = {
+      "asy",  "c++",   "cc",     "clang",   "clang++", "fpc",
+      "g++",  "gcc",   "java",   "javac",   "pypy",    "pypy3",
+      "python", "python2", "python3", "rustc"};
+  return programs;
+}
+
+std::vector<std::string> AvailablePrograms() {
+  std::vector<std::string> available;
+  for (const std::string& program : KnownPrograms()) {
+    if (!which(program).empty()) available.push_back(program);
+  }
+  return available;
 }
 
 }  // namespace util
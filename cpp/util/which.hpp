@@ -2,17 +2,24 @@
 #define UTIL_WHICH_HPP
 
 #include <string>
+#include <vector>
 
 namespace util {
 
 // Equivalent to the command-line utility which. Uses caching to speed up
-// lookups, unless explicitly disabled.
-// The cache behavior is very basical, if the file is found it's put in the
-// cache, any other request to that file will come from the cache even if the
-// file is no longer found.
-// TODO consider checking whether the file exists if it cames from the cache
+// lookups, unless explicitly disabled. A cached result is dropped when PATH
+// changes, or when one of the directories that were looked into changes,
+// which is only checked once every few seconds.
 std::string which(const std::string& cmd, bool use_cache = true);
 
+// Compilers and interpreters that the tasks run as system programs, and that
+// not every machine has. The workers advertise which of them they have, so
+// that the requests that need one are only sent to the workers with it.
+const std::vector<std::string>& KnownPrograms();
+
+// Returns the programs of KnownPrograms that are in the PATH.
+std::vector<std::string> AvailablePrograms();
+
 }  // namespace util
 
 #endif
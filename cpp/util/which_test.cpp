@@ -60,4 +60,16 @@ TEST(Which, WhichCacheDisabled) {
   EXPECT_EQ(util::which("cmd", false), "");
 }
 
+// NOLINTNEXTLINE
+TEST(Which, WhichNoticesPathChange) {
+  util::TempDir tmpdir1(test_tmpdir + "/which");
+  util::TempDir tmpdir2(test_tmpdir + "/which");
+  createFile(tmpdir1.Path() + "/cmd");
+  createFile(tmpdir2.Path() + "/cmd");
+  setenv("PATH", tmpdir1.Path().c_str(), 1);
+  EXPECT_EQ(util::which("cmd"), tmpdir1.Path() + "/cmd");
+  setenv("PATH", tmpdir2.Path().c_str(), 1);
+  EXPECT_EQ(util::which("cmd"), tmpdir2.Path() + "/cmd");
+}
+
 }  // namespace
@@ -1,57 +1,72 @@
 #include "worker/cache.hpp"
+#include <algorithm>
 #include "util/file.hpp"
 #include "util/flags.hpp"
-#include <stdexcept>
 
 namespace worker {
 
-Cache::Cache() {
-  for (auto path : util::File::ListFiles(Flags::store_directory)) {
-    try {
-      util::SHA256_t hash(util::File::BaseName(path));
-      KJ_ASSERT(util::File::PathForHash(hash) == path, hash.Hex(), path);
-      size_t fsz = util::File::Size(path);
-      if (!file_sizes_.count(hash)) {
-        file_sizes_.emplace(hash, fsz);
-        total_size_ += fsz;
-      }
-      file_access_times_[hash] = last_access_time_++;
-    } catch (std::invalid_argument& e) {
-      continue;
-    }
-  }
-  for (auto kv : file_access_times_) {
-    sorted_files_.emplace(kv.second, kv.first);
+namespace {
+// Minimum number of changes before the inventory is rebuilt.
+const constexpr size_t kMinInventoryChanges = 64;
+}  // namespace
+
+Cache::Cache(util::ContentStore* files)
+    : owned_files_(files ? nullptr
+                         : std::make_unique<util::ContentStore>(IndexPath())),
+      files_(files ? *files : *owned_files_) {
+  RebuildInventory();
+}
+
+std::string Cache::IndexPath() {
+  return util::File::JoinPath(Flags::store_directory, "index");
+}
+
+void Cache::MaybeRebuildInventory() {
+  if (inventory_changes_ <
+      std::max(kMinInventoryChanges, files_.Count() / 16)) {
+    return;
   }
+  RebuildInventory();
 }
 
-void Cache::Register(util::SHA256_t hash) {
+void Cache::RebuildInventory() {
+  // Leave some room for the files that will be added before the next rebuild.
+  util::BloomFilter inventory(files_.Count() + files_.Count() / 8 + 1024);
+  files_.ForEach([&inventory](const util::SHA256_t& hash, size_t size,
+                              double cost) { inventory.Add(hash); });
+  inventory_ = std::move(inventory);
+  inventory_version_++;
+  inventory_changes_ = 0;
+}
+
+void Cache::Register(util::SHA256_t hash, double cost) {
   if (hash.isZero()) return;
-  if (!file_sizes_.count(hash)) {
-    size_t sz = util::File::Size(util::File::PathForHash(hash));
-    total_size_ += sz;
-    file_sizes_.emplace(hash, sz);
-  } else {
-    sorted_files_.erase(file_access_times_.at(hash));
-  }
-  file_access_times_[hash] = last_access_time_++;
-  sorted_files_.emplace(file_access_times_[hash], hash);
-  while (Flags::cache_size != 0 &&
-         total_size_ > 1024ULL * 1024 * Flags::cache_size) {
-    KJ_ASSERT(!sorted_files_.empty());
-    auto to_del = sorted_files_.begin()->second;
-    try {
-      util::File::Remove(util::File::PathForHash(to_del));
-    } catch (...) {
-      // If we could not remove the file, skip shrinking the cache.
-      break;
-    }
-    sorted_files_.erase(sorted_files_.begin());
-    total_size_ -= file_sizes_.at(to_del);
-    file_sizes_.erase(to_del);
-    file_access_times_.erase(to_del);
+  // The contents are already in the store, there is no need to keep them in
+  // memory or in the index.
+  hash.clearContents();
+  if (files_.Reconcile()) RebuildInventory();
+  int64_t sz = files_.StoreSize(hash);
+  if (sz < 0) {
+    // Using the file will fail anyway.
+    KJ_LOG(WARNING, "Registered file is not in the store", hash.Hex());
+    return;
   }
-  KJ_ASSERT(file_sizes_.count(hash), "Cache size is too small!");
+  bool added = files_.Add(hash, sz, cost);
+  if (added) inventory_.Add(hash);
+  size_t evicted = files_.Evict();
+  KJ_ASSERT(files_.Contains(hash), "Cache size is too small!");
+  inventory_changes_ += added + evicted;
+  MaybeRebuildInventory();
+}
+
+void Cache::Pin(util::SHA256_t hash) {
+  hash.clearContents();
+  files_.Pin(hash);
+}
+
+void Cache::Unpin(util::SHA256_t hash) {
+  hash.clearContents();
+  files_.Unpin(hash);
 }
 
 }  // namespace worker
@@ -1,28 +1,75 @@
 #ifndef WORKER_CACHE_HPP
 #define WORKER_CACHE_HPP
-#include <map>
-#include <unordered_map>
+#include <memory>
+#include <string>
+#include <vector>
+#include "util/bloom_filter.hpp"
+#include "util/content_store.hpp"
 #include "util/sha256.hpp"
 
 namespace worker {
 
 // Manages the file cache ensuring that the total size does not go beyond the
-// limit imposed by Flags::cache_size.
+// limit imposed by Flags::cache_size. The list of the files in the store is
+// kept in an index, which is loaded at startup and reconciled with the actual
+// contents of the store in the background.
+//
+// If files is given, the files are tracked there instead, in a store that is
+// shared with the server running in the same process. The inventory then
+// only follows the changes made through the cache, until it is rebuilt.
 class Cache {
  public:
-  Cache();
+  explicit Cache(util::ContentStore* files = nullptr);
+  KJ_DISALLOW_COPY(Cache);
 
-  // Tracks the file with the given hash in the cache.
-  void Register(util::SHA256_t hash);
+  // Tracks the file with the given hash in the cache. cost is the number of
+  // seconds that were needed to produce the file, if known.
+  void Register(util::SHA256_t hash, double cost = 0);
+
+  // Prevents the file from being evicted while it is used by a running
+  // request. Calls should be matched by calls to Unpin.
+  void Pin(util::SHA256_t hash);
+  void Unpin(util::SHA256_t hash);
+
+  // Approximate set of the files in the store, that is advertised to the
+  // server. It is rebuilt after enough files are added or evicted, and the
+  // version changes every time it is rebuilt.
+  const util::BloomFilter& Inventory() const { return inventory_; }
+  uint64_t InventoryVersion() const { return inventory_version_; }
+
+ private:
+  static std::string IndexPath();
+
+  void MaybeRebuildInventory();
+  void RebuildInventory();
+
+  std::unique_ptr<util::ContentStore> owned_files_;
+  util::ContentStore& files_;
+
+  util::BloomFilter inventory_;
+  uint64_t inventory_version_ = 0;
+  // Number of files added or evicted since the inventory was rebuilt.
+  size_t inventory_changes_ = 0;
+};
+
+// Keeps a set of files pinned in the cache for as long as it is alive.
+class PinnedFiles {
+ public:
+  explicit PinnedFiles(Cache* cache) : cache_(cache) {}
+  ~PinnedFiles() {
+    for (const auto& hash : hashes_) cache_->Unpin(hash);
+  }
+  KJ_DISALLOW_COPY(PinnedFiles);
+
+  void Add(const util::SHA256_t& hash) {
+    if (hash.isZero()) return;
+    cache_->Pin(hash);
+    hashes_.push_back(hash);
+  }
 
  private:
-  std::unordered_map<util::SHA256_t, size_t, util::SHA256_t::Hasher>
-      file_sizes_;
-  std::unordered_map<util::SHA256_t, size_t, util::SHA256_t::Hasher>
-      file_access_times_;
-  std::map<size_t, util::SHA256_t> sorted_files_;
-  size_t total_size_ = 0;
-  size_t last_access_time_ = 0;
+  Cache* cache_;
+  std::vector<util::SHA256_t> hashes_;
 };
 
 }  // namespace worker
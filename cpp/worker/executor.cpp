@@ -1,132 +1,341 @@
 #include "worker/executor.hpp"
+#include "util/batch.hpp"
+#include "util/channel.hpp"
+#include "util/compare.hpp"
 #include "util/file.hpp"
 #include "util/flags.hpp"
-#include "util/union_promise.hpp"
+#include "util/io_pool.hpp"
+#include "util/log_manager.hpp"
+#include "util/tee.hpp"
+#include "util/trace.hpp"
 #include "util/which.hpp"
-#include "whereami++.h"
 
 #include <algorithm>
 #include <cctype>
 #include <fstream>
+#include <functional>
+#include <map>
+#include <memory>
+#include <system_error>
 #include <thread>
+#include <vector>
 
 #include <kj/async-io.h>
 #include <kj/debug.h>
 #include <kj/io.h>
 #include <sys/stat.h>
 #include <sys/types.h>
-#include <sys/wait.h>
 #include <unistd.h>
 #include <csignal>
 
-#include <spawn.h>
-
-// needed on osx
-extern char** environ;  // NOLINT
-
 namespace {
 
 kj::Promise<sandbox::ExecutionInfo> RunSandbox(
     const sandbox::ExecutionOptions& exec_options,
-    kj::LowLevelAsyncIoProvider* async_io_provider, uint32_t frontend_id,
+    worker::SandboxPool* sandboxes, uint32_t frontend_id, uint64_t request_id,
     const std::set<uint32_t>& canceled_frontends,
-    std::unordered_map<uint32_t, std::set<int>>* running) {
-  KJ_LOG(INFO, "Starting sandbox");
-  int options_pipe[2];
-  int ret = pipe(options_pipe);
-  KJ_ASSERT(ret != -1, "pipe", strerror(errno));
-  int outcome_pipe[2];
-  ret = pipe(outcome_pipe);
-  KJ_ASSERT(ret != -1, "pipe", strerror(errno));
-
-  posix_spawn_file_actions_t actions;
-  posix_spawn_file_actions_init(&actions);
-  posix_spawn_file_actions_addclose(&actions, options_pipe[1]);
-  posix_spawn_file_actions_addclose(&actions, outcome_pipe[0]);
-  posix_spawn_file_actions_adddup2(&actions, options_pipe[0], fileno(stdin));
-  posix_spawn_file_actions_adddup2(&actions, outcome_pipe[1], fileno(stdout));
-  posix_spawn_file_actions_addclose(&actions, options_pipe[0]);
-  posix_spawn_file_actions_addclose(&actions, outcome_pipe[1]);
-
-  std::string self = whereami::getExecutablePath();
-#define VPARAM(s) (s), (s) + strlen(s) + 1
-  std::vector<char> self_mut(VPARAM(self.c_str()));
-  std::vector<char> sandbox_mut(VPARAM("sandbox"));
-  std::vector<char> bin_mut(VPARAM("--bin"));
-#undef VPARAM
-  char* args[] = {self_mut.data(), sandbox_mut.data(), bin_mut.data(), nullptr};
-  int pid;
-  KJ_ASSERT(posix_spawn(&pid, args[0], &actions, nullptr, args, environ) == 0,
-            strerror(errno));
-  close(options_pipe[0]);
-  close(outcome_pipe[1]);
-  KJ_ASSERT(pid != -1, strerror(errno));
-
-  (*running)[frontend_id].insert(pid);
-
-  kj::Own<kj::AsyncOutputStream> out =
-      async_io_provider->wrapOutputFd(options_pipe[1]);
-  kj::Own<kj::AsyncInputStream> in =
-      async_io_provider->wrapInputFd(outcome_pipe[0]);
-  kj::Own<sandbox::ExecutionOptions> ex_opts =
-      kj::heap<sandbox::ExecutionOptions>(exec_options);
-  return out->write(ex_opts.get(), sizeof(exec_options))
-      .attach(std::move(out), std::move(ex_opts))
-      .then([fd = options_pipe[1], outcome_pipe, pid, in = std::move(in),
-             running, frontend_id, &canceled_frontends]() mutable {
-        close(fd);
-        auto promise = in->readAllBytes();
-        return promise.attach(std::move(in))
-            .then([pid, fd = outcome_pipe[0], running, &canceled_frontends,
-                   frontend_id](const kj::Array<kj::byte>& data) {
-              close(fd);
-              if (canceled_frontends.count(frontend_id)) {
-                sandbox::ExecutionInfo info;
-                info.killed_external = true;
-                return info;
-              }
-              int ret = 0;
-              int err = waitpid(pid, &ret, 0);
-              (*running)[frontend_id].erase(pid);
-              KJ_ASSERT(err != -1, strerror(errno));
-              KJ_ASSERT(ret == 0, "Sandbox failed");
-              KJ_ASSERT(data.size() >= sizeof(size_t));
-              size_t error_sz =
-                  *reinterpret_cast<const size_t*>(data.begin());  // NOLINT
-              KJ_ASSERT(data.size() >= sizeof(size_t) + error_sz);
-              const char* msg =
-                  reinterpret_cast<const char*>(data.begin()) +  // NOLINT
-                  sizeof(size_t);
-              KJ_ASSERT(!error_sz,
-                        std::string(msg, data.size() - sizeof(size_t)));
-              sandbox::ExecutionInfo outcome;
-              memcpy(&outcome, msg, sizeof(outcome));
-              return outcome;
-            });
+    const std::set<uint64_t>& canceled_requests,
+    std::unordered_map<uint32_t, std::set<int>>* running,
+    std::unordered_map<uint64_t, std::set<int>>* running_requests) {
+  if (request_id && canceled_requests.count(request_id)) {
+    // The request was canceled while waiting for the cores.
+    sandbox::ExecutionInfo info;
+    info.killed_external = true;
+    return info;
+  }
+  UTIL_LOG(INFO, "Starting sandbox");
+  auto pid = std::make_shared<int>(-1);
+  auto on_start = [pid, running, frontend_id, request_id,
+                   running_requests](int child) {
+    *pid = child;
+    (*running)[frontend_id].insert(child);
+    if (request_id) (*running_requests)[request_id].insert(child);
+  };
+  return sandboxes->Run(exec_options, on_start)
+      .then([pid, running, &canceled_frontends, frontend_id, request_id,
+             &canceled_requests,
+             running_requests](worker::SandboxPool::Outcome sandbox_outcome) {
+        (*running)[frontend_id].erase(*pid);
+        if (request_id) {
+          (*running_requests)[request_id].erase(*pid);
+          if ((*running_requests)[request_id].empty()) {
+            running_requests->erase(request_id);
+          }
+        }
+        if (canceled_frontends.count(frontend_id) ||
+            (request_id && canceled_requests.count(request_id))) {
+          sandbox::ExecutionInfo info;
+          info.killed_external = true;
+          return info;
+        }
+        const kj::Array<kj::byte>& data = sandbox_outcome.data;
+        KJ_ASSERT(sandbox_outcome.status == 0, "Sandbox failed");
+        KJ_ASSERT(data.size() >= sizeof(size_t));
+        size_t error_sz =
+            *reinterpret_cast<const size_t*>(data.begin());  // NOLINT
+        KJ_ASSERT(data.size() >= sizeof(size_t) + error_sz);
+        const char* msg =
+            reinterpret_cast<const char*>(data.begin()) +  // NOLINT
+            sizeof(size_t);
+        KJ_ASSERT(!error_sz, std::string(msg, data.size() - sizeof(size_t)));
+        sandbox::ExecutionInfo outcome;
+        KJ_ASSERT(outcome.Parse(
+                      std::string(msg, data.size() - sizeof(size_t))),
+                  "Invalid sandbox outcome");
+        return outcome;
+      });
+}
+
+// Input of a sandbox, that is copied from the store once it is fetched.
+struct InputFile {
+  std::string path;
+  util::SHA256_t hash;
+  bool executable;
+  // Written to path instead, for the inputs that are not in the store.
+  kj::Maybe<std::string> contents = nullptr;
+  // Index of the process of the sandbox.
+  size_t process = 0;
+};
+
+// Inputs to mount in the sandboxes, with the same index as the InputFile.
+using InputMounts = std::vector<kj::Maybe<sandbox::ExecutionOptions::Mount>>;
+
+void WriteFile(const std::string& path, const std::string& contents) {
+  auto receiver = util::File::Write(path);
+  if (!contents.empty()) {
+    receiver({reinterpret_cast<const kj::byte*>(contents.data()),  // NOLINT
+              contents.size()});
+  }
+  receiver({});
+}
+
+void PrepareFile(const InputFile& input,
+                 kj::Maybe<sandbox::ExecutionOptions::Mount>* mount) {
+  KJ_IF_MAYBE(contents, input.contents) {
+    WriteFile(input.path, *contents);
+    util::File::MakeImmutable(input.path);
+    return;
+  }
+  // Packed files have no path to mount, they are copied.
+  if (mount != nullptr && input.executable) {
+    *mount = sandbox::ExecutionOptions::Mount{
+        util::File::StageExecutable(input.hash), input.path, true};
+    return;
+  }
+  std::string stored = util::File::PathForHash(input.hash);
+  if (mount != nullptr && util::File::Exists(stored)) {
+    *mount = sandbox::ExecutionOptions::Mount{stored, input.path, false};
+    return;
+  }
+  if (input.executable) {
+    util::File::CopyExecutableFromStore(input.hash, input.path);
+    return;
+  }
+  util::File::CopyFromStore(input.hash, input.path);
+  util::File::MakeImmutable(input.path);
+}
+
+// Copies the inputs in the sandboxes on the I/O threads. Each input is copied
+// as soon as the promise with its index in fetched resolves. The cache is only
+// touched from the event loop. If mounts is not null, the stored inputs are
+// recorded there instead, to be mounted when the sandbox starts.
+kj::Promise<void> PrepareFiles(const std::vector<InputFile>& inputs,
+                               kj::Array<kj::Promise<void>> fetched,
+                               worker::Cache* cache_, util::IoPool* io_pool,
+                               std::shared_ptr<InputMounts> mounts) {
+  kj::Vector<kj::Promise<void>> copies(inputs.size());
+  for (size_t i = 0; i < inputs.size(); i++) {
+    const InputFile& input = inputs[i];
+    if (input.contents == nullptr && input.hash.isZero()) continue;
+    copies.add(fetched[i].then([input, cache_, io_pool, mounts, i]() {
+      if (input.contents == nullptr) cache_->Register(input.hash);
+      return io_pool->Run([input, mounts, i]() {
+        PrepareFile(input, mounts ? &(*mounts)[i] : nullptr);
+      });
+    }));
+  }
+  return kj::joinPromises(copies.releaseAsArray());
+}
+
+// Output of a sandbox, stored by the I/O threads.
+struct StoredFile {
+  util::SHA256_t hash;
+  kj::Maybe<std::system_error> error;
+};
+
+// Stores an output on the I/O threads with ingest, which returns its hash.
+// If the output cannot be read, on_error is called with the error, or the
+// promise fails if it is null.
+kj::Promise<void> StoreOutput(
+    std::function<util::SHA256_t()> ingest,
+    capnproto::SHA256::Builder hash_out, worker::Cache* cache_,
+    util::IoPool* io_pool, double cost,
+    std::function<void(const std::system_error&)> on_error) {
+  auto stored = std::make_shared<StoredFile>();
+  auto run = [ingest, stored]() {
+    try {
+      stored->hash = ingest();
+      // Small files may have been added to the packs instead.
+      std::string in_store = util::File::PathForHash(stored->hash);
+      if (util::File::Exists(in_store)) util::File::MakeImmutable(in_store);
+    } catch (const std::system_error& exc) {
+      stored->error = exc;
+    }
+  };
+  return io_pool->Run(run).then(
+      [stored, hash_out, cache_, cost, on_error]() mutable {
+        KJ_IF_MAYBE(error, stored->error) {
+          if (!on_error) throw *error;
+          on_error(*error);
+          return;
+        }
+        stored->hash.ToCapnp(hash_out);
+        cache_->Register(stored->hash, cost);
       });
 }
 
-void PrepareFile(const std::string& path, const util::SHA256_t& hash,
-                 bool executable, worker::Cache* cache_) {
-  if (hash.isZero()) return;
-  cache_->Register(hash);
-  util::File::Copy(util::File::PathForHash(hash), path);
-  if (executable) {
-    util::File::MakeExecutable(path);
+// Hashes and stores the file, as StoreOutput.
+kj::Promise<void> RetrieveFile(
+    const std::string& path, capnproto::SHA256::Builder hash_out,
+    worker::Cache* cache_, util::IoPool* io_pool, double cost,
+    std::function<void(const std::system_error&)> on_error = nullptr) {
+  return StoreOutput(
+      [path]() {
+        // Small outputs travel inside the result, saving the server a
+        // round-trip to fetch them.
+        return util::File::Ingest(path, Flags::inline_outputs * 1024);
+      },
+      hash_out, cache_, io_pool, cost, on_error);
+}
+
+// Stores a stream that the sandbox captured in memory, or the file it
+// was written to if it was too long.
+kj::Promise<void> RetrieveStream(bool captured, const std::string& data,
+                                 const std::string& path,
+                                 capnproto::SHA256::Builder hash_out,
+                                 worker::Cache* cache_,
+                                 util::IoPool* io_pool, double cost) {
+  if (!captured) return RetrieveFile(path, hash_out, cache_, io_pool, cost);
+  return StoreOutput(
+      [data]() {
+        return util::File::IngestContents(
+            {reinterpret_cast<const uint8_t*>(data.data()),  // NOLINT
+             data.size()},
+            Flags::inline_outputs * 1024);
+      },
+      hash_out, cache_, io_pool, cost, nullptr);
+}
+
+// Sets the status of a process from the outcome of its sandbox.
+void SetStatus(const sandbox::ExecutionInfo& outcome,
+               capnproto::Resources::Reader limits,
+               capnproto::ProcessResult::Status::Builder status) {
+  // The instructions replace the cpu time when they were counted, since
+  // they do not change with the load of the worker. The cpu time limit is
+  // still enforced by the sandbox, with its margin.
+  bool by_instructions =
+      limits.getInstructions() != 0 && outcome.instructions > 0;
+  bool over_cpu_time = limits.getCpuTime() != 0 &&
+                       outcome.cpu_time_millis + outcome.sys_time_millis >=
+                           limits.getCpuTime() * 1000;
+  if (limits.getMemory() != 0 &&
+      static_cast<uint64_t>(outcome.memory_usage_kb) >= limits.getMemory()) {
+    status.setMemoryLimit();
+  } else if (by_instructions
+                 ? static_cast<uint64_t>(outcome.instructions) >=
+                           limits.getInstructions() ||
+                       (outcome.killed && over_cpu_time)
+                 : over_cpu_time) {
+    status.setTimeLimit();
+  } else if (limits.getWallTime() != 0 &&
+             outcome.wall_time_millis >= limits.getWallTime() * 1000) {
+    status.setWallLimit();
+  } else if (outcome.signal != 0) {
+    status.setSignal(outcome.signal);
+  } else if (outcome.status_code != 0) {
+    status.setReturnCode(outcome.status_code);
   } else {
-    util::File::MakeImmutable(path);
+    status.setSuccess();
   }
 }
 
-void RetrieveFile(const std::string& path, capnproto::SHA256::Builder hash_out,
-                  worker::Cache* cache_) {
-  auto hash = util::File::Hash(path);
-  hash.ToCapnp(hash_out);
-  util::File::Copy(path, util::File::PathForHash(hash));
-  util::File::MakeImmutable(util::File::PathForHash(hash));
-  cache_->Register(hash);
+// Splits the standard output of a batch process in the outputs of its items,
+// that are stored as the other outputs. The items without an output get the
+// status of the process, or missingFiles if it succeeded.
+kj::Promise<void> RetrieveBatch(const std::string& stdout_path,
+                                const std::string& dir,
+                                const sandbox::ExecutionInfo& outcome,
+                                capnproto::ProcessRequest::Reader request,
+                                capnproto::ProcessResult::Builder result,
+                                worker::Cache* cache_, util::IoPool* io_pool,
+                                double cost) {
+  size_t num_items = request.getBatch().size();
+  auto return_codes = std::make_shared<std::vector<uint32_t>>();
+  auto split = [stdout_path, dir, num_items, return_codes]() {
+    std::string data;
+    auto producer = util::File::Read(stdout_path);
+    util::File::Chunk chunk;
+    while ((chunk = producer()).size()) {
+      data.append(chunk.begin(), chunk.end());
+    }
+    auto outputs = util::ParseBatchOutput(data, num_items);
+    for (const auto& output : outputs) {
+      return_codes->push_back(output.return_code);
+    }
+    outputs.resize(num_items);
+    for (size_t i = 0; i < num_items; i++) {
+      std::string name = util::File::JoinPath(dir, std::to_string(i));
+      WriteFile(name + ".stdout", outputs[i].stdout_data);
+      WriteFile(name + ".stderr", outputs[i].stderr_data);
+    }
+  };
+  return io_pool->Run(split).then([dir, outcome, request, result, cache_,
+                                   io_pool, cost, num_items,
+                                   return_codes]() mutable {
+    auto items = result.initBatch(num_items);
+    kj::Vector<kj::Promise<void>> retrieved;
+    for (size_t i = 0; i < num_items; i++) {
+      auto item = items[i];
+      item.setWasKilled(result.getWasKilled());
+      item.setResourceUsage(result.getResourceUsage().asReader());
+      if (i < return_codes->size()) {
+        if ((*return_codes)[i] == 0) {
+          item.getStatus().setSuccess();
+        } else {
+          item.getStatus().setReturnCode((*return_codes)[i]);
+        }
+      } else if (result.getStatus().isSuccess()) {
+        item.getStatus().setMissingFiles();
+      } else {
+        SetStatus(outcome, request.getLimits(), item.getStatus());
+      }
+      std::string name = util::File::JoinPath(dir, std::to_string(i));
+      retrieved.add(RetrieveFile(name + ".stdout", item.initStdout(), cache_,
+                                 io_pool, cost));
+      retrieved.add(RetrieveFile(name + ".stderr", item.initStderr(), cache_,
+                                 io_pool, cost));
+    }
+    return kj::joinPromises(retrieved.releaseAsArray());
+  });
 }
 
+// Copy of a stream FIFO, from the standard output of its writer to the
+// standard inputs of its readers and to a file.
+struct StreamCopy {
+  std::string source;
+  std::string path;
+  std::vector<std::string> outputs;
+};
+
+// Tees of the streams of a request, which are stopped when the request is
+// done or canceled.
+struct StreamTees {
+  std::vector<std::shared_ptr<util::Tee>> tees;
+  ~StreamTees() {
+    for (auto& tee : tees) tee->Stop();
+  }
+};
+
 bool ValidateFileName(std::string name, capnproto::Result::Builder result_) {
   auto set_invalid_request = [&result_](std::string err) {
     for (auto result : result_.getProcesses()) {
@@ -148,14 +357,51 @@ bool ValidateFileName(std::string name, capnproto::Result::Builder result_) {
   return true;
 }
 
+// Times of the phases of a request, sent back if the request is traced.
+class Phases {
+ public:
+  explicit Phases(bool enabled)
+      : enabled_(enabled), last_(util::Tracer::NowMicros()) {}
+
+  // Ends the current phase, and starts the next one.
+  void Mark(const char* name) {
+    if (!enabled_) return;
+    uint64_t now = util::Tracer::NowMicros();
+    spans_.push_back({name, last_, now - last_});
+    last_ = now;
+  }
+
+  void Write(capnproto::Result::Builder result) const {
+    if (!enabled_) return;
+    auto phases = result.initPhases(spans_.size());
+    for (size_t i = 0; i < spans_.size(); i++) {
+      phases[i].setName(spans_[i].name);
+      phases[i].setStart(spans_[i].start);
+      phases[i].setDuration(spans_[i].duration);
+    }
+  }
+
+ private:
+  struct Span {
+    const char* name;
+    uint64_t start;
+    uint64_t duration;
+  };
+  bool enabled_;
+  uint64_t last_;
+  std::vector<Span> spans_;
+};
+
 }  // namespace
 
 namespace worker {
 
 kj::Promise<void> Executor::Execute(capnproto::Request::Reader request_,
+                                    uint64_t request_id,
                                     capnproto::Result::Builder result_) {
   bool scheduled = false;
   KJ_DEFER(if (!scheduled) manager_->CancelPending());
+  auto phases = std::make_shared<Phases>(request_.getTrace());
   for (auto request : request_.getProcesses()) {
     auto executable = request.getExecutable();
     for (const auto& input : request.getInputFiles()) {
@@ -172,6 +418,24 @@ kj::Promise<void> Executor::Execute(capnproto::Request::Reader request_,
         return kj::READY_NOW;
       }
     }
+    for (auto item : request.getBatch()) {
+      for (const std::string& arg : item) {  // NOLINT
+        if (!util::IsValidBatchArg(arg)) {
+          for (auto result : result_.getProcesses()) {
+            result.getStatus().setInvalidRequest(
+                "Arguments of batch items cannot contain white space!");
+          }
+          return kj::READY_NOW;
+        }
+      }
+    }
+  }
+
+  // The builtin comparison does not use any core, so the pending request is
+  // given back right away.
+  if (request_.getProcesses().size() == 1 &&
+      util::IsBuiltinCompare(request_.getProcesses()[0])) {
+    return Compare(request_.getProcesses()[0], result_);
   }
 
   auto fail = [result_](const std::string& error) mutable {
@@ -181,18 +445,27 @@ kj::Promise<void> Executor::Execute(capnproto::Request::Reader request_,
     return kj::READY_NOW;
   };
 
-  util::TempDir fifo_tmp_(Flags::temp_directory);
+  // Only requests with fifos need a directory for them.
+  kj::Maybe<util::TempDir> fifo_tmp_;
 
+  // Shared FIFOs are files that the processes map in memory.
   auto add_fifo = [&fifo_tmp_, fail](const std::string dest,
-                                     uint32_t id) mutable {
+                                     const std::string& name,
+                                     bool shared = false) mutable {
+    if (fifo_tmp_ == nullptr) fifo_tmp_ = util::TempDir(Flags::temp_directory);
     std::string src =
-        util::File::JoinPath(fifo_tmp_.Path(), std::to_string(id));
+        util::File::JoinPath(KJ_ASSERT_NONNULL(fifo_tmp_).Path(), name);
     if (access(src.c_str(), F_OK) == -1) {
       if (errno != ENOENT) {
         fail("access: " + std::string(strerror(errno)));
         return false;
       }
-      if (mkfifo(src.c_str(), S_IRWXU) == -1) {
+      if (shared) {
+        if (!util::Channel::Create(src)) {
+          fail("channel: " + std::string(strerror(errno)));
+          return false;
+        }
+      } else if (mkfifo(src.c_str(), S_IRWXU) == -1) {
         fail("mkfifo: " + std::string(strerror(errno)));
         return false;
       }
@@ -204,16 +477,31 @@ kj::Promise<void> Executor::Execute(capnproto::Request::Reader request_,
     return true;
   };
 
+  // Each reader of a stream has its own FIFO, that the worker writes to.
+  std::map<uint32_t, StreamCopy> streams;
+  for (uint32_t id : request_.getStreams()) streams[id];
+
   size_t num_processes = request_.getProcesses().size();
-  util::UnionPromiseBuilder builder;
+  // The inputs must not be evicted between the moment they are fetched and
+  // the moment they are copied in the sandbox, or until the sandboxes stop
+  // if they are mounted.
+  auto pinned = std::make_shared<PinnedFiles>(cache_);
+  // The inputs are mounted only in sandboxes that are removed afterwards,
+  // so that the kept ones can be inspected without the namespace.
+  std::shared_ptr<InputMounts> mounts;
   std::vector<util::TempDir> tmp;
-  while (tmp.size() < num_processes) tmp.emplace_back(Flags::temp_directory);
+  while (tmp.size() < num_processes) tmp.push_back(manager_->Boxes()->Get());
   std::vector<std::string> cmdlines(num_processes);
   std::vector<std::string> exes(num_processes);
   std::vector<std::string> sandbox_dirs(num_processes);
   std::vector<std::string> stderr_paths(num_processes);
   std::vector<std::string> stdout_paths(num_processes);
+  // Copies of the streams written by the processes, or empty.
+  std::vector<std::string> stream_paths(num_processes);
   std::vector<sandbox::ExecutionOptions> exec_options_v;
+  // The inputs of all the processes are fetched with a single call.
+  std::vector<util::SHA256_t> inputs;
+  std::vector<InputFile> input_files;
   result_.initProcesses(num_processes);
   for (size_t i = 0; i < request_.getProcesses().size(); i++) {
     auto request = request_.getProcesses()[i];
@@ -223,6 +511,7 @@ kj::Promise<void> Executor::Execute(capnproto::Request::Reader request_,
     auto& sandbox_dir = sandbox_dirs[i];
     auto& stdout_path = stdout_paths[i];
     auto& stderr_path = stderr_paths[i];
+    size_t first_input = input_files.size();
     switch (executable.which()) {
       case capnproto::ProcessRequest::Executable::SYSTEM:
         cmdline = executable.getSystem();
@@ -248,15 +537,16 @@ kj::Promise<void> Executor::Execute(capnproto::Request::Reader request_,
     }
 
     for (const auto& input : request.getInputFiles()) {
-      builder.AddPromise(util::File::MaybeGet(input.getHash(), server_));
+      pinned->Add(input.getHash());
+      inputs.emplace_back(input.getHash());
     }
     if (request.getStdin().isHash()) {
-      builder.AddPromise(
-          util::File::MaybeGet(request.getStdin().getHash(), server_));
+      pinned->Add(request.getStdin().getHash());
+      inputs.emplace_back(request.getStdin().getHash());
     }
     if (executable.isLocalFile()) {
-      builder.AddPromise(
-          util::File::MaybeGet(executable.getLocalFile().getHash(), server_));
+      pinned->Add(executable.getLocalFile().getHash());
+      inputs.emplace_back(executable.getLocalFile().getHash());
     }
 
     exe = cmdline;
@@ -272,12 +562,10 @@ kj::Promise<void> Executor::Execute(capnproto::Request::Reader request_,
       cmdline_file << cmdline << std::endl;
     }
 
-    auto log = kj::str("Executing:\n", "\tCommand:        ", cmdline, "\n",
-                       "\tInside sandbox: ", tmp[i].Path());
-    KJ_LOG(INFO, log);
+    UTIL_LOG(INFO, kj::str("Executing:\n", "\tCommand:        ", cmdline, "\n",
+                           "\tInside sandbox: ", tmp[i].Path()));
 
     sandbox_dir = util::File::JoinPath(tmp[i].Path(), kBoxDir);
-    util::File::MakeDirs(sandbox_dir);
 
     exec_options_v.emplace_back(sandbox_dir, exe);
 
@@ -286,44 +574,89 @@ kj::Promise<void> Executor::Execute(capnproto::Request::Reader request_,
     // Folder and arguments.
     exec_options.SetArgs(request.getArgs());
 
+    // Inputs.
+    // The executable is already made executable when it is copied.
     if (executable.isLocalFile()) {
-      exec_options.prepare_executable = true;
+      auto local_file = executable.getLocalFile();
+      input_files.push_back(
+          {util::File::JoinPath(sandbox_dir, local_file.getName()),
+           local_file.getHash(), true});
+    }
+    if (request.getStdin().isHash() &&
+        !util::SHA256_t(request.getStdin().getHash()).isZero()) {
+      auto stdin_path = util::File::JoinPath(tmp[i].Path(), "stdin");
+      input_files.push_back({stdin_path, request.getStdin().getHash(), false});
+      exec_options.stdin_file = stdin_path;
+    } else if (request.getBatch().size() != 0) {
+      std::vector<std::vector<std::string>> items;
+      for (auto item : request.getBatch()) {
+        items.emplace_back(item.begin(), item.end());
+      }
+      auto stdin_path = util::File::JoinPath(tmp[i].Path(), "stdin");
+      input_files.push_back({stdin_path, util::SHA256_t::ZERO, false,
+                             util::BatchInput(items)});
+      exec_options.stdin_file = stdin_path;
+    }
+    for (const auto& input : request.getInputFiles()) {
+      input_files.push_back(
+          {util::File::JoinPath(sandbox_dir, input.getName()), input.getHash(),
+           input.getExecutable()});
     }
 
     // Stdout/err files.
     stdout_path = util::File::JoinPath(tmp[i].Path(), "stdout");
     stderr_path = util::File::JoinPath(tmp[i].Path(), "stderr");
-    sandbox::ExecutionOptions::stringcpy(exec_options.stdout_file, stdout_path);
-    sandbox::ExecutionOptions::stringcpy(exec_options.stderr_file, stderr_path);
+    exec_options.stdout_file = stdout_path;
+    exec_options.stderr_file = stderr_path;
+    // Outputs that would be inlined in the result do not need to go through
+    // a file, unless the sandbox is kept. The batch protocol is split from
+    // the file of stdout.
+    exec_options.capture_stdout =
+        request.getStdout() == 0 && request.getBatch().size() == 0;
+    exec_options.capture_stderr = request.getStderr() == 0;
+    if (!Flags::keep_sandboxes) {
+      exec_options.capture_limit = Flags::inline_outputs * 1024;
+    }
 
     // FIFOs.
     for (auto fifo : request.getFifos()) {
       if (!add_fifo(util::File::JoinPath(sandbox_dir, fifo.getName()),
-                    fifo.getId())) {
+                    std::to_string(fifo.getId()), fifo.getShared())) {
         return kj::READY_NOW;
       }
     }
     if (request.getStdin().isFifo() && request.getStdin().getFifo() != 0) {
+      uint32_t id = request.getStdin().getFifo();
       auto stdin_path = util::File::JoinPath(tmp[i].Path(), "stdin");
-      if (!add_fifo(stdin_path, request.getStdin().getFifo())) {
-        return kj::READY_NOW;
+      auto stream = streams.find(id);
+      std::string name = std::to_string(id);
+      if (stream != streams.end()) {
+        name += "." + std::to_string(i);
+        stream->second.outputs.push_back(stdin_path);
       }
-      sandbox::ExecutionOptions::stringcpy(exec_options_v[i].stdin_file,
-                                           stdin_path);
+      if (!add_fifo(stdin_path, name)) return kj::READY_NOW;
+      exec_options_v[i].stdin_file = stdin_path;
     }
     if (request.getStdout() != 0) {
-      if (!add_fifo(stdout_path, request.getStdout())) {
+      auto stream = streams.find(request.getStdout());
+      if (stream != streams.end()) {
+        if (!stream->second.source.empty()) {
+          return fail("Stream FIFOs can only have one writer");
+        }
+        stream->second.source = stdout_path;
+        stream->second.path = util::File::JoinPath(tmp[i].Path(), "stream");
+        stream_paths[i] = stream->second.path;
+      }
+      if (!add_fifo(stdout_path, std::to_string(request.getStdout()))) {
         return kj::READY_NOW;
       }
-      sandbox::ExecutionOptions::stringcpy(exec_options_v[i].stdout_file,
-                                           stdout_path);
+      exec_options_v[i].stdout_file = stdout_path;
     }
     if (request.getStderr() != 0) {
-      if (!add_fifo(stderr_path, request.getStderr())) {
+      if (!add_fifo(stderr_path, std::to_string(request.getStderr()))) {
         return kj::READY_NOW;
       }
-      sandbox::ExecutionOptions::stringcpy(exec_options_v[i].stderr_file,
-                                           stderr_path);
+      exec_options_v[i].stderr_file = stderr_path;
     }
 
     // Limits.
@@ -339,59 +672,164 @@ kj::Promise<void> Executor::Execute(capnproto::Request::Reader request_,
     exec_options.max_file_size_kb = limits.getFsize();
     exec_options.max_mlock_kb = limits.getMemlock();
     exec_options.max_stack_kb = limits.getStack();
+    exec_options.count_instructions = Flags::count_instructions;
+    for (size_t j = first_input; j < input_files.size(); j++) {
+      input_files[j].process = i;
+    }
+  }
+  std::vector<size_t> input_processes;
+  if (Flags::mount_inputs && !Flags::keep_sandboxes) {
+    mounts = std::make_shared<InputMounts>(input_files.size());
+    for (const auto& input : input_files) {
+      input_processes.push_back(input.process);
+    }
+  }
+  for (const auto& stream : streams) {
+    if (stream.second.source.empty()) {
+      return fail("Stream FIFOs need a writer");
+    }
   }
 
   scheduled = true;
-  return std::move(builder).Finalize().then(
-      [sandbox_dirs, exec_options_v, request_, result_, stderr_paths,
-       stdout_paths, fail, tmp = std::move(tmp), num_processes,
+  phases->Mark("setup sandboxes");
+  // Each input is copied in its sandbox as soon as it arrives, and the cores
+  // are reserved once all of them arrived, while the last ones are still
+  // being copied.
+  std::vector<util::SHA256_t> hashes;
+  for (const auto& input : input_files) {
+    hashes.push_back(input.contents == nullptr ? input.hash
+                                               : util::SHA256_t::ZERO);
+  }
+  // The I/O threads copy the inputs in the boxes, which have to outlive the
+  // copies even when the execution fails early.
+  auto boxes = std::make_shared<std::vector<util::TempDir>>(std::move(tmp));
+  auto prepare_failed = std::make_shared<bool>(false);
+  auto prepared = std::make_shared<kj::ForkedPromise<void>>(
+      PrepareFiles(input_files, util::File::MaybeGetEach(hashes, server_),
+                   cache_, manager_->IoThreads(), mounts)
+          .then([]() {},
+                [prepare_failed](kj::Exception exc) {
+                  *prepare_failed = true;
+                  kj::throwRecoverableException(std::move(exc));
+                })
+          // The sandboxes have their own copies of the inputs then.
+          .attach(mounts ? nullptr : pinned)
+          .fork());
+  // A failure to fetch the inputs also gives back the pending request. The
+  // transfers were started above, this only waits for them.
+  auto fetched = util::File::MaybeGetAll(inputs, server_);
+  return fetched.then(
+      [exec_options_v, request_, result_, stderr_paths, stdout_paths,
+       stream_paths, streams, fail, boxes, num_processes,
+       sandbox_dirs, prepared, prepare_failed, phases, mounts, pinned,
+       input_processes = std::move(input_processes),
        this]() mutable -> kj::Promise<void> {
-        KJ_LOG(INFO, "Files loaded, starting sandbox setup");
-        for (size_t i = 0; i < request_.getProcesses().size(); i++) {
-          auto request = request_.getProcesses()[i];
-          auto executable = request.getExecutable();
-          if (executable.isLocalFile()) {
-            auto local_file = executable.getLocalFile();
-            PrepareFile(
-                util::File::JoinPath(sandbox_dirs[i], local_file.getName()),
-                local_file.getHash(), true, cache_);
-          }
-          if (request.getStdin().isHash() &&
-              !util::SHA256_t(request.getStdin().getHash()).isZero()) {
-            auto stdin_path = util::File::JoinPath(tmp[i].Path(), "stdin");
-            PrepareFile(stdin_path, request.getStdin().getHash(), false,
-                        cache_);
-            sandbox::ExecutionOptions::stringcpy(exec_options_v[i].stdin_file,
-                                                 stdin_path);
+        phases->Mark("fetch inputs");
+        UTIL_LOG(INFO, "Files loaded, waiting for cores");
+
+        // Memory limits are in KiB, as the budget of the manager. The time
+        // limits bound how long the request can run, if all processes have
+        // them.
+        uint64_t memory = 0;
+        int64_t expected_millis = 0;
+        bool all_timed = true;
+        for (auto process : request_.getProcesses()) {
+          auto limits = process.getLimits();
+          memory += limits.getMemory();
+          float limit = std::max(limits.getWallTime(),
+                                 limits.getCpuTime() + process.getExtraTime());
+          all_timed = all_timed &&
+                      (limits.getWallTime() > 0 || limits.getCpuTime() > 0);
+          expected_millis =
+              std::max(expected_millis, static_cast<int64_t>(limit * 1000));
+        }
+        if (!all_timed) expected_millis = 0;
+
+        // Actual execution. Exclusive requests get physical cores to
+        // themselves, the rest of the worker keeps running other requests.
+        // The streams are copied while the processes run, each one on a
+        // thread of its own so that the I/O threads stay available.
+        using Task =
+            std::function<kj::Promise<kj::Array<sandbox::ExecutionInfo>>(
+                const std::vector<int>&)>;
+        Task run = [this, frontend_id = request_.getEvaluationId(), request_id,
+                    exec_options_v, streams, num_processes, mounts,
+                    pins = mounts ? pinned : nullptr,
+                    input_processes](const std::vector<int>& cpus) {
+          auto tees = std::make_shared<StreamTees>();
+          kj::Vector<kj::Promise<void>> copied;
+          for (const auto& stream : streams) {
+            auto tee = std::make_shared<util::Tee>(
+                stream.second.source, stream.second.path,
+                stream.second.outputs);
+            tees->tees.push_back(tee);
+            copied.add(manager_->IoThreads()->RunDedicated(
+                [tee]() { tee->Run(); }));
           }
-          for (const auto& input : request.getInputFiles()) {
-            PrepareFile(util::File::JoinPath(sandbox_dirs[i], input.getName()),
-                        input.getHash(), input.getExecutable(), cache_);
+          kj::Vector<kj::Promise<sandbox::ExecutionInfo>> info_(
+              num_processes);
+          for (size_t i = 0; i < num_processes; i++) {
+            sandbox::ExecutionOptions options = exec_options_v[i];
+            options.SetCpus({cpus[i]});
+            for (size_t j = 0; mounts && j < mounts->size(); j++) {
+              KJ_IF_MAYBE(mount, (*mounts)[j]) {
+                if (input_processes[j] == i) options.mounts.push_back(*mount);
+              }
+            }
+            info_.add(RunSandbox(
+                options, manager_->Sandboxes(), frontend_id,
+                request_id, canceled_evaluations_,
+                canceled_requests_, &running_, &running_requests_));
           }
-        }
-
-        // Actual execution.
+          using Outcomes = kj::Array<sandbox::ExecutionInfo>;
+          return kj::joinPromises(info_.releaseAsArray())
+              .then([tees, copied = copied.releaseAsArray()](
+                        Outcomes outcomes) mutable {
+                for (auto& tee : tees->tees) tee->Stop();
+                auto done = kj::joinPromises(std::move(copied));
+                return done.then(
+                    [outcomes = std::move(outcomes)]() mutable {
+                      return std::move(outcomes);
+                    });
+              })
+              .attach(std::move(tees), pins);
+        };
         return manager_
             ->ScheduleTask(
-                request_.getExclusive() ? manager_->NumCores() : num_processes,
-                std::function<kj::Promise<kj::Array<sandbox::ExecutionInfo>>()>(
-                    [this, frontend_id = request_.getEvaluationId(),
-                     exec_options_v, num_processes]() {
-                      kj::Vector<kj::Promise<sandbox::ExecutionInfo>> info_(
-                          num_processes);
-                      for (size_t i = 0; i < num_processes; i++) {
-                        info_.add(RunSandbox(
-                            exec_options_v[i],
-                            &manager_->Client().getLowLevelIoProvider(),
-                            frontend_id, canceled_evaluations_, &running_));
-                      }
-                      return kj::joinPromises(info_.releaseAsArray());
-                    }))
+                num_processes, request_.getExclusive(), memory,
+                expected_millis,
+                Task([prepared, run, phases](const std::vector<int>& cpus) {
+                  phases->Mark("wait for cores");
+                  return prepared->addBranch().then([run, cpus, phases]() {
+                    phases->Mark("prepare inputs");
+                    return run(cpus);
+                  });
+                }))
             .then(
-                [result_, exec_options_v, stdout_paths, stderr_paths, request_,
-                 sandbox_dirs, tmp = std::move(tmp), num_processes, fail,
-                 this](kj::Array<sandbox::ExecutionInfo> outcomes) mutable {
-                  KJ_LOG(INFO, "Sandbox done, processing results");
+                [result_, exec_options_v, stdout_paths, stderr_paths,
+                 stream_paths, request_, sandbox_dirs, boxes,
+                 num_processes, fail, phases,
+                 this](kj::Array<sandbox::ExecutionInfo> outcomes) mutable
+                -> kj::Promise<void> {
+                  phases->Mark("run");
+                  UTIL_LOG(INFO, "Sandbox done, processing results");
+                  for (const auto& outcome : outcomes) {
+                    if (outcome.killed_external) {
+                      return fail("Killed externally");
+                    }
+                  }
+                  // All the processes need to be executed again to recompute
+                  // any of the outputs.
+                  double cost = 0;
+                  for (const auto& outcome : outcomes) {
+                    cost += std::max(outcome.cpu_time_millis +
+                                         outcome.sys_time_millis,
+                                     outcome.wall_time_millis) /
+                            1000.0;
+                  }
+                  // The outputs are hashed on the I/O threads, and the
+                  // boxes are kept until they are done.
+                  kj::Vector<kj::Promise<void>> retrieved;
                   for (size_t i = 0; i < num_processes; i++) {
                     auto result = result_.getProcesses()[i];
                     auto request = request_.getProcesses()[i];
@@ -399,10 +837,6 @@ kj::Promise<void> Executor::Execute(capnproto::Request::Reader request_,
                     auto& stdout_path = stdout_paths[i];
                     auto& stderr_path = stderr_paths[i];
                     auto& sandbox_dir = sandbox_dirs[i];
-                    if (outcome.killed_external) {
-                      fail("Killed externally");
-                      return;
-                    }
                     result.setWasKilled(outcome.killed);
                     // Resource usage.
                     auto resource_usage = result.initResourceUsage();
@@ -411,46 +845,42 @@ kj::Promise<void> Executor::Execute(capnproto::Request::Reader request_,
                     resource_usage.setWallTime(outcome.wall_time_millis /
                                                1000.0);
                     resource_usage.setMemory(outcome.memory_usage_kb);
+                    resource_usage.setInstructions(outcome.instructions);
 
-                    auto limits = request.getLimits();
-                    if (limits.getMemory() != 0 &&
-                        static_cast<uint64_t>(outcome.memory_usage_kb) >=
-                            limits.getMemory()) {
-                      result.getStatus().setMemoryLimit();
-                    } else if (limits.getCpuTime() != 0 &&
-                               outcome.cpu_time_millis +
-                                       outcome.sys_time_millis >=
-                                   limits.getCpuTime() * 1000) {
-                      result.getStatus().setTimeLimit();
-                    } else if (limits.getWallTime() != 0 &&
-                               outcome.wall_time_millis >=
-                                   limits.getWallTime() * 1000) {
-                      result.getStatus().setWallLimit();
-                    } else if (outcome.signal != 0) {
-                      result.getStatus().setSignal(outcome.signal);
-                    } else if (outcome.status_code != 0) {
-                      result.getStatus().setReturnCode(outcome.status_code);
-                    } else {
-                      result.getStatus().setSuccess();
-                    }
+                    SetStatus(outcome, request.getLimits(),
+                              result.getStatus());
 
                     // Output files.
+                    auto io_pool = manager_->IoThreads();
                     if (request.getStdout() == 0) {
-                      RetrieveFile(stdout_path, result.initStdout(), cache_);
+                      retrieved.add(RetrieveStream(
+                          outcome.stdout_captured, outcome.stdout_data,
+                          stdout_path, result.initStdout(), cache_, io_pool,
+                          cost));
+                    } else if (!stream_paths[i].empty()) {
+                      retrieved.add(RetrieveFile(stream_paths[i],
+                                                 result.initStdout(), cache_,
+                                                 io_pool, cost));
                     }
                     if (request.getStderr() == 0) {
-                      RetrieveFile(stderr_path, result.initStderr(), cache_);
+                      retrieved.add(RetrieveStream(
+                          outcome.stderr_captured, outcome.stderr_data,
+                          stderr_path, result.initStderr(), cache_, io_pool,
+                          cost));
+                    }
+                    if (request.getBatch().size() != 0) {
+                      retrieved.add(RetrieveBatch(
+                          stdout_path,
+                          util::File::JoinPath((*boxes)[i].Path(), "batch"),
+                          outcome, request, result, cache_, io_pool, cost));
                     }
                     auto output_names = request.getOutputFiles();
                     auto outputs = result.initOutputFiles(output_names.size());
                     for (size_t i = 0; i < request.getOutputFiles().size();
                          i++) {
                       outputs[i].setName(output_names[i]);
-                      try {
-                        RetrieveFile(
-                            util::File::JoinPath(sandbox_dir, output_names[i]),
-                            outputs[i].initHash(), cache_);
-                      } catch (const std::system_error& exc) {
+                      auto on_error =
+                          [result](const std::system_error& exc) mutable {
                         if (exc.code().value() !=
                             static_cast<int>(
                                 std::errc::no_such_file_or_directory)) {
@@ -460,25 +890,107 @@ kj::Promise<void> Executor::Execute(capnproto::Request::Reader request_,
                             result.getStatus().setMissingFiles();
                           }
                         }
-                      }
+                      };
+                      retrieved.add(RetrieveFile(
+                          util::File::JoinPath(sandbox_dir, output_names[i]),
+                          outputs[i].initHash(), cache_, io_pool, cost,
+                          on_error));
                     }
                   }
+                  return kj::joinPromises(retrieved.releaseAsArray())
+                      .then([phases, result_]() {
+                        phases->Mark("retrieve outputs");
+                        phases->Write(result_);
+                      })
+                      .attach(boxes);
                 },
-                [fail](kj::Exception exc) mutable {
+                [fail, prepare_failed](
+                    kj::Exception exc) mutable -> kj::Promise<void> {
+                  // The worker could not copy the inputs: another one may.
+                  if (*prepare_failed) return exc;
                   KJ_LOG(WARNING, "Execution failed: ", exc.getDescription());
-                  fail(exc.getDescription());
+                  return fail(exc.getDescription());
                 })
             .eagerlyEvaluate(nullptr);
       },
-      [this](kj::Exception exc) -> kj::Promise<void> {
+      [this, prepared, boxes](kj::Exception exc) -> kj::Promise<void> {
         KJ_LOG(WARNING, "Execution canceled: ", exc.getDescription());
         manager_->CancelPending();
-        return exc;
+        // Wait for the copies already started before removing the boxes.
+        return prepared->addBranch()
+            .then([exc]() -> kj::Promise<void> { return kj::cp(exc); },
+                  [exc](kj::Exception) -> kj::Promise<void> {
+                    return kj::cp(exc);
+                  })
+            .attach(std::move(boxes));
       });
 }
 
+kj::Promise<void> Executor::Compare(capnproto::ProcessRequest::Reader request,
+                                    capnproto::Result::Builder result_) {
+  auto result = result_.initProcesses(1)[0];
+  util::SHA256_t first = util::SHA256_t::ZERO;
+  util::SHA256_t second = util::SHA256_t::ZERO;
+  if (!util::BuiltinCompareInputs(request, &first, &second)) {
+    result.getStatus().setInvalidRequest(
+        "The comparison needs the names of two input files");
+    return kj::READY_NOW;
+  }
+  auto pinned = kj::heap<PinnedFiles>(cache_);
+  pinned->Add(first);
+  pinned->Add(second);
+  auto equal = std::make_shared<bool>(false);
+  return util::File::MaybeGetAll({first, second}, server_)
+      .then([first, second, equal, this]() {
+        cache_->Register(first);
+        cache_->Register(second);
+        return manager_->IoThreads()->Run([first, second, equal]() {
+          *equal = util::StoredFilesEqual(first, second);
+        });
+      })
+      .then([equal, result]() mutable {
+        util::SetBuiltinCompareResult(*equal, result);
+      })
+      .attach(std::move(pinned));
+}
+
+kj::Promise<void> Executor::evaluate(EvaluateContext context) {
+  auto request = context.getParams().getRequest();
+  uint64_t request_id = context.getParams().getRequestId();
+  if (request_id) active_requests_[request_id]++;
+  return Execute(request, request_id, context.getResults().initResult())
+      .attach(kj::defer([this, request_id]() {
+        if (!request_id || --active_requests_[request_id] != 0) return;
+        active_requests_.erase(request_id);
+        canceled_requests_.erase(request_id);
+      }));
+}
+
+kj::Promise<void> Executor::prefetch(PrefetchContext context) {
+  std::vector<util::SHA256_t> hashes;
+  for (auto hash : context.getParams().getHashes()) hashes.emplace_back(hash);
+  // The files arrive one after the other through a single transfer, so that
+  // the ones of the running requests are not slowed down much.
+  return util::File::MaybeGetAll(hashes, server_).then([this, hashes]() {
+    for (const auto& hash : hashes) cache_->Register(hash);
+  });
+}
+
 kj::Promise<void> Executor::cancelRequest(CancelRequestContext context) {
   uint32_t evaluation_id = context.getParams().getEvaluationId();
+  uint64_t request_id = context.getParams().getRequestId();
+  if (request_id) {
+    KJ_LOG(INFO, "Cancelling request " + std::to_string(request_id));
+    // A request that already finished has nothing left to cancel.
+    if (!active_requests_.count(request_id)) return kj::READY_NOW;
+    canceled_requests_.insert(request_id);
+    auto running = running_requests_.find(request_id);
+    if (running == running_requests_.end()) return kj::READY_NOW;
+    for (int pid : running->second) {
+      kill(pid, SIGINT);
+    }
+    return kj::READY_NOW;
+  }
   KJ_LOG(INFO,
          "Cancelling evaluations of frontend " + std::to_string(evaluation_id));
   canceled_evaluations_.insert(evaluation_id);
@@ -17,35 +17,61 @@ class Executor : public capnproto::Evaluator::Server {
  public:
   KJ_DISALLOW_COPY(Executor);
   Executor(capnproto::FileSender::Client server, Manager* manager, Cache* cache)
-      : server_(std::move(server)), manager_(manager), cache_(cache) {}
+      : server_(std::move(server)),
+        manager_(manager),
+        cache_(cache),
+        registered_(manager->Registered()) {}
   Executor(Executor&&) = default;
   Executor& operator=(Executor&&) = default;
   ~Executor() = default;
 
-  kj::Promise<void> evaluate(EvaluateContext context) override {
-    auto request = context.getParams().getRequest();
-    return Execute(request, context.getResults().initResult());
-  }
+  kj::Promise<void> evaluate(EvaluateContext context) override;
 
   kj::Promise<void> cancelRequest(CancelRequestContext context) override;
 
+  kj::Promise<void> heartbeat(HeartbeatContext /*context*/) override {
+    return kj::READY_NOW;
+  }
+
+  kj::Promise<void> prefetch(PrefetchContext context) override;
+
   kj::Promise<void> requestFile(RequestFileContext context) override {
     return util::File::HandleRequestFile(context);
   }
 
+  kj::Promise<void> requestFiles(RequestFilesContext context) override {
+    return util::File::HandleRequestFiles(context);
+  }
+
+  // Subdirectory of the sandboxes where the processes run.
+  static const constexpr char* kBoxDir = "box";
+
  private:
   kj::Promise<void> Execute(capnproto::Request::Reader request_,
+                            uint64_t request_id,
                             capnproto::Result::Builder result_);
 
-  static const constexpr char* kBoxDir = "box";
+  // Runs the builtin comparison on the I/O threads instead of in a sandbox.
+  kj::Promise<void> Compare(capnproto::ProcessRequest::Reader request,
+                            capnproto::Result::Builder result_);
 
   std::unordered_map<uint32_t, std::set<int>> running_;
 
   std::set<uint32_t> canceled_evaluations_;
 
+  // Sandboxes of the requests with a request id, used when cancelling a
+  // single request.
+  std::unordered_map<uint64_t, std::set<int>> running_requests_;
+  // Number of executions of each request id that did not finish yet. A
+  // request id is only kept in canceled_requests_ while it is running.
+  std::unordered_map<uint64_t, size_t> active_requests_;
+  std::set<uint64_t> canceled_requests_;
+
   capnproto::FileSender::Client server_;
   Manager* manager_;
   Cache* cache_;
+  // Keeps the manager from being destroyed while the server holds this.
+  std::shared_ptr<void> registered_;
 };
 
 }  // namespace worker
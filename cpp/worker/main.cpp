@@ -1,19 +1,79 @@
 #include "worker/main.hpp"
 #include <capnp/ez-rpc.h>
+#include <unistd.h>
+#include <list>
+#include <memory>
+#include <random>
 #include <thread>
 
 #include "util/daemon.hpp"
+#include "util/file.hpp"
 #include "util/flags.hpp"
 #include "util/log_manager.hpp"
 #include "util/misc.hpp"
+#include "util/topology.hpp"
 #include "util/version.hpp"
+#include "worker/cache.hpp"
 #include "worker/executor.hpp"
 
 const size_t EXP_BACKOFF_MIN = 1;
 const size_t EXP_BACKOFF_MAX = 60000;
 const size_t EXP_BACKOFF_MAX_RETRIES = 70;
 
+namespace {
+
+util::Topology ReadTopology() {
+  if (!Flags::num_cores) {
+    Flags::num_cores = std::thread::hardware_concurrency();
+  }
+  return util::Topology::Read(Flags::num_cores);
+}
+
+// Memory available to the executions, in KiB.
+uint64_t Memory() {
+  uint64_t memory = static_cast<uint64_t>(Flags::memory) * 1024;
+  if (!memory) {
+    memory = static_cast<uint64_t>(sysconf(_SC_PHYS_PAGES)) *
+             sysconf(_SC_PAGE_SIZE) / 1024;
+  }
+  return memory;
+}
+
+// The server keeps track of the failures of the worker by its id.
+uint64_t RandomId() {
+  return std::random_device()() * (1ULL << 32) + std::random_device()();
+}
+
+}  // namespace
+
 namespace worker {
+void RunEmbedded(capnproto::MainServer::Client server,
+                 kj::LowLevelAsyncIoProvider* io_provider, kj::Timer* timer,
+                 kj::WaitScope* wait_scope, util::ContentStore* files) {
+  const util::Topology topology = ReadTopology();
+  const uint64_t memory = Memory();
+  Cache cache(files);
+  const uint64_t id = RandomId();
+  // A manager that failed is replaced by a new one. The server may still
+  // hold its evaluators, so it is only destroyed once they are all dropped.
+  std::list<std::unique_ptr<Manager>> stopped;
+  while (true) {
+    auto manager = std::make_unique<Manager>(
+        Manager::Local(server, io_provider, timer, wait_scope), topology,
+        memory, Flags::pending_requests, Flags::name, id, &cache);
+    KJ_IF_MAYBE(exc, kj::runCatchingExceptions([&]() { manager->Run(); })) {
+      KJ_LOG(ERROR, "The embedded worker failed, restarting it", *exc);
+    }
+    manager->Stop();
+    stopped.push_back(std::move(manager));
+    stopped.remove_if([](const std::unique_ptr<Manager>& manager) {
+      return manager->Released();
+    });
+    // An error that repeats at once would otherwise take the event loop.
+    timer->afterDelay(1 * kj::SECONDS).wait(*wait_scope);
+  }
+}
+
 kj::MainBuilder::Validity Main::Run() {
   if (Flags::daemon) {
     util::daemonize("worker", Flags::pidfile);
@@ -21,16 +81,25 @@ kj::MainBuilder::Validity Main::Run() {
   if (Flags::server.empty()) {
     return "You need to specify a server!";
   }
-  if (!Flags::num_cores) {
-    Flags::num_cores = std::thread::hardware_concurrency();
+  if (!util::File::ValidDurability(Flags::durability)) {
+    return "--durability must be file, batch or none";
   }
+  const util::Topology topology = ReadTopology();
+  const uint64_t memory = Memory();
   util::LogManager log_manager(&context);
+  util::File::RecoverStore();
+  // The cache outlives the connections to the server, so that the store is
+  // indexed only once.
+  Cache cache;
+  const uint64_t id = RandomId();
+  // The server shares its transfers fairly between the workers.
+  util::File::SetPeerId(id);
   size_t sleepTime = 0;
   size_t numRetries = 0;
   while (true) {
     try {
-      Manager manager(Flags::server, Flags::port, Flags::num_cores,
-                      Flags::pending_requests, Flags::name);
+      Manager manager(Flags::server, Flags::port, topology, memory,
+                      Flags::pending_requests, Flags::name, id, &cache);
       manager.Run();
       return true;
     } catch (std::exception& ex) {
@@ -59,6 +128,13 @@ kj::MainFunc Main::getMain() {
                          "Executes requests pulled from a server")
       .addOptionWithArg({'L', "logfile"}, util::setString(&Flags::log_file),
                         "<LOGFILE>", "Path where the log file should be stored")
+      .addOptionWithArg({"log-levels"}, util::setString(&Flags::log_levels),
+                        "<LEVELS>",
+                        "Severity of the messages of each subsystem, like "
+                        "server=INFO,util=WARNING")
+      .addOptionWithArg({"log-rate"}, util::setUint(&Flags::log_rate), "<N>",
+                        "Maximum INFO messages per second of a line of code. "
+                        "0 means unlimited")
       .addOption({'d', "daemon"}, util::setBool(&Flags::daemon),
                  "Become a daemon")
       .addOptionWithArg({'P', "pidfile"}, util::setString(&Flags::pidfile),
@@ -66,6 +142,17 @@ kj::MainFunc Main::getMain() {
       .addOptionWithArg({'S', "store-dir"},
                         util::setString(&Flags::store_directory), "<DIR>",
                         "Path where the files should be stored")
+      .addOptionWithArg({"durability"}, util::setString(&Flags::durability),
+                        "<MODE>",
+                        "When stored files are flushed to disk: file (each "
+                        "file), batch (periodically) or none")
+      .addOptionWithArg({"sync-interval"},
+                        util::setUint(&Flags::sync_interval), "<MS>",
+                        "Interval between flushes with batch durability")
+      .addOptionWithArg({"pack-threshold"},
+                        util::setUint(&Flags::pack_threshold), "<KiB>",
+                        "Store the files smaller than this in pack files "
+                        "instead of a file each. 0 means never")
       .addOptionWithArg({'T', "temp-dir"},
                         util::setString(&Flags::temp_directory), "<DIR>",
                         "Path where the sandboxes should be crated")
@@ -73,6 +160,14 @@ kj::MainFunc Main::getMain() {
                  "Keep the sandboxes after evaluation")
       .addOptionWithArg({'n', "num-cores"}, util::setInt(&Flags::num_cores),
                         "<N>", "Number of cores to use")
+      .addOptionWithArg({"max-exclusive"},
+                        util::setUint(&Flags::max_exclusive), "<N>",
+                        "Maximum number of exclusive executions running at "
+                        "the same time. 0 means one per NUMA node")
+      .addOptionWithArg({'m', "memory"}, util::setUint(&Flags::memory),
+                        "<MiB>",
+                        "Memory available to the executions, in MiB. 0 means "
+                        "all the physical memory")
       .addOptionWithArg({'s', "server"}, util::setString(&Flags::server),
                         "<ADDRESS>", "Address to connect to")
       .addOptionWithArg({'p', "port"}, util::setInt(&Flags::port), "<PORT>",
@@ -81,7 +176,20 @@ kj::MainFunc Main::getMain() {
                         "Name of this worker")
       .addOptionWithArg({'r', "pending-requests"},
                         util::setInt(&Flags::pending_requests), "<REQS>",
-                        "Maximum number of pending requests")
+                        "Maximum number of pending requests. -1 adapts it "
+                        "to the cores, the duration of the executions and "
+                        "the latency of the server")
+      .addOptionWithArg({"inline-outputs"},
+                        util::setUint(&Flags::inline_outputs), "<KiB>",
+                        "Send the outputs smaller than this together with the "
+                        "results")
+      .addOption({"count-instructions"},
+                 util::setBool(&Flags::count_instructions),
+                 "Count the instructions executed by the programs, which "
+                 "are stable even on a loaded machine")
+      .addOption({"mount-inputs"}, util::setBool(&Flags::mount_inputs),
+                 "Mount the stored inputs read-only in the sandboxes instead "
+                 "of copying them, in a private mount namespace")
       .addOptionWithArg(
           {'c', "cache-size"}, util::setUint(&Flags::cache_size), "<SZ>",
           "Maximum size of the cache, in MiB. 0 means unlimited")
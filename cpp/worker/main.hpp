@@ -1,9 +1,20 @@
 #ifndef WORKER_MAIN_HPP
 #define WORKER_MAIN_HPP
+#include <kj/async-io.h>
 #include <kj/main.h>
 
+#include "capnp/server.capnp.h"
+#include "util/content_store.hpp"
+
 namespace worker {
 
+// Runs a worker that executes the requests of a server in the same process,
+// in the event loop of wait_scope that also runs the server. The worker tracks
+// its files in files, the store of the server. Does not return.
+void RunEmbedded(capnproto::MainServer::Client server,
+                 kj::LowLevelAsyncIoProvider* io_provider, kj::Timer* timer,
+                 kj::WaitScope* wait_scope, util::ContentStore* files);
+
 class Main {
  public:
   explicit Main(kj::ProcessContext* context) : context(*context) {}
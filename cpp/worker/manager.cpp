@@ -7,8 +7,13 @@
 #include <unistd.h>
 #include <csignal>
 
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <map>
 #include <thread>
 #include <unordered_set>
+#include <vector>
 
 #include <capnp/ez-rpc.h>
 #include "capnp/server.capnp.h"
@@ -20,32 +25,294 @@
   }
 
 namespace worker {
+Manager::Connection Manager::Connect(const std::string& server,
+                                     uint32_t port) {
+  auto client = kj::heap<capnp::EzRpcClient>(server, port);
+  auto main = client->getMain<capnproto::MainServer>();
+  kj::LowLevelAsyncIoProvider* io_provider = &client->getLowLevelIoProvider();
+  kj::Timer* timer = &client->getIoProvider().getTimer();
+  kj::WaitScope* wait_scope = &client->getWaitScope();
+  return Connection{std::move(client), std::move(main), io_provider, timer,
+                    wait_scope};
+}
+
+Manager::Connection Manager::Local(capnproto::MainServer::Client server,
+                                   kj::LowLevelAsyncIoProvider* io_provider,
+                                   kj::Timer* timer,
+                                   kj::WaitScope* wait_scope) {
+  return Connection{nullptr, std::move(server), io_provider, timer,
+                    wait_scope};
+}
+
+Manager::Manager(Connection connection, util::Topology topology,
+                 uint64_t memory, int32_t pending_requests, std::string name,
+                 uint64_t id, Cache* cache)
+    : connection_(std::move(connection)),
+      topology_(std::move(topology)),
+      cores_(topology_.Cores()),
+      num_cores_(topology_.Cpus().size()),
+      max_exclusive_(Flags::max_exclusive ? Flags::max_exclusive
+                                          : topology_.Nodes().size()),
+      memory_(memory),
+      max_pending_requests_(pending_requests),
+      name_(std::move(name)),
+      id_(id),
+      cache_(cache),
+      sandboxes_(connection_.io_provider, num_cores_),
+      io_pool_(connection_.io_provider, num_cores_),
+      boxes_(Flags::temp_directory, Executor::kBoxDir, 2 * num_cores_) {
+  int max_cpu = 0;
+  for (const auto& cpu : topology_.Cpus()) max_cpu = std::max(max_cpu, cpu.id);
+  busy_cpus_.resize(max_cpu + 1, false);
+  std::vector<int> node_of(max_cpu + 1, 0);
+  for (const auto& cpu : topology_.Cpus()) node_of[cpu.id] = cpu.node;
+  std::map<int, std::vector<std::vector<int>>> node_cores;
+  for (const auto& core : cores_) node_cores[node_of[core[0]]].push_back(core);
+  for (auto& kv : node_cores) node_cores_.push_back(std::move(kv.second));
+}
+
 void Manager::Run() {
   OnDone();
-  on_error_.promise.wait(client_.getWaitScope());
+  on_error_.promise.wait(*connection_.wait_scope);
 }
 
 void Manager::OnDone() {
-  if (running_cores_ + reserved_cores_ < num_cores_) {
-    while (pending_requests_ < max_pending_requests_) {
-      pending_requests_++;
-      auto server = client_.getMain<capnproto::MainServer>();
-      auto req = server.registerEvaluatorRequest();
-      req.setName(name_ + " " + std::to_string(last_worker_id_++));
-      req.setEvaluator(kj::heap<Executor>(server, this, &cache_));
-      req.send().detach([this](kj::Exception exc) {
-        on_error_.fulfiller->reject(std::move(exc));
-      });
-    }
-  }
-  while (!waiting_tasks_.empty()) {
-    int sz = waiting_tasks_.front().first;
-    if (running_cores_ + sz > num_cores_) break;
-    reserved_cores_ -= sz;
-    running_cores_ += sz;
-    waiting_tasks_.front().second->fulfill();
-    waiting_tasks_.pop();
+  int32_t free_cores = num_cores_ - running_cores_ - reserved_cores_;
+  // Ask for enough requests to fill the free cores, plus some more that will
+  // be ready when the running ones complete, in a single registration.
+  int32_t credits = free_cores + PendingDepth() - pending_requests_;
+  if (!stopped_ && free_cores > 0 && credits > 0) {
+    pending_requests_ += credits;
+    if (registered_at_ == -1) registered_at_ = Now();
+    auto server = connection_.server;
+    auto req = server.registerEvaluatorRequest();
+    req.setName(name_ + " " + std::to_string(last_worker_id_++));
+    req.setEvaluator(kj::heap<Executor>(server, this, cache_));
+    req.setCredits(credits);
+    auto worker = req.initWorker();
+    worker.setId(id_);
+    worker.setMemory(memory_);
+    auto topology = worker.initTopology();
+    topology.setNumCpus(num_cores_);
+    topology.setNumCores(cores_.size());
+    topology.setNumNodes(node_cores_.size());
+    auto programs = worker.initPrograms(programs_.size());
+    for (size_t i = 0; i < programs_.size(); i++) {
+      programs.set(i, programs_[i]);
+    }
+    worker.setCpuModel(cpu_model_);
+    worker.setSpeed(speed_);
+    if (inventory_version_ != cache_->InventoryVersion()) {
+      cache_->Inventory().ToCapnp(worker.initInventory());
+      inventory_version_ = cache_->InventoryVersion();
+    }
+    req.send().detach([this](kj::Exception exc) {
+      on_error_.fulfiller->reject(std::move(exc));
+    });
+  }
+  int64_t now = Now();
+  while (!waiting_tasks_.empty() && Fits(waiting_tasks_.front())) {
+    Start(waiting_tasks_.begin(), now);
+  }
+  if (!waiting_tasks_.empty()) Backfill(now);
+}
+
+int64_t Manager::Now() {
+  return (connection_.timer->now() - kj::origin<kj::TimePoint>()) /
+         kj::MILLISECONDS;
+}
+
+int32_t Manager::Cost(size_t num_processes, bool exclusive) const {
+  if (exclusive && num_processes > cores_.size()) return num_cores_;
+  size_t cost = 0;
+  if (exclusive) {
+    size_t width = 0;
+    for (const auto& core : cores_) width = std::max(width, core.size());
+    cost = num_processes * width;
+  } else {
+    cost = num_processes;
+  }
+  return std::min<int32_t>(cost, num_cores_);
+}
+
+bool Manager::Allocate(const WaitingTask& task, std::vector<int>* process_cpus,
+                       std::vector<int>* reserved) const {
+  if (task.exclusive && running_exclusive_ >= max_exclusive_) return false;
+  // Keep the processes of the task, and their memory, on a single NUMA node
+  // if possible, choosing the node with the fewest free cpus that fits them.
+  const std::vector<std::vector<int>>* best = nullptr;
+  size_t best_free = 0;
+  for (const auto& node : node_cores_) {
+    if (!AllocateAmong(task, node, process_cpus, reserved)) continue;
+    size_t free = 0;
+    for (const auto& core : node) {
+      for (int cpu : core) free += !busy_cpus_[cpu];
+    }
+    if (!best || free < best_free) {
+      best = &node;
+      best_free = free;
+    }
+  }
+  if (best) return AllocateAmong(task, *best, process_cpus, reserved);
+  return AllocateAmong(task, cores_, process_cpus, reserved);
+}
+
+bool Manager::AllocateAmong(const WaitingTask& task,
+                            const std::vector<std::vector<int>>& cores,
+                            std::vector<int>* process_cpus,
+                            std::vector<int>* reserved) const {
+  process_cpus->clear();
+  reserved->clear();
+  if (task.exclusive) {
+    std::vector<const std::vector<int>*> free_cores;
+    for (const auto& core : cores) {
+      bool free = true;
+      for (int cpu : core) free = free && !busy_cpus_[cpu];
+      if (free) free_cores.push_back(&core);
+    }
+    if (static_cast<size_t>(task.num_processes) > cores_.size()) {
+      // The task cannot have enough cores to itself, so it gets the whole
+      // worker.
+      if (cores.size() < cores_.size()) return false;
+      if (free_cores.size() < cores_.size()) return false;
+    } else if (free_cores.size() < static_cast<size_t>(task.num_processes)) {
+      return false;
+    } else {
+      free_cores.resize(task.num_processes);
+    }
+    for (const auto* core : free_cores) {
+      reserved->insert(reserved->end(), core->begin(), core->end());
+    }
+    // The other cpus of the cores stay idle.
+    for (int32_t i = 0; i < task.num_processes; i++) {
+      process_cpus->push_back((*free_cores[i % free_cores.size()])[0]);
+    }
+    return true;
+  }
+  // Fill the cores that are already partially used first, to keep whole
+  // cores free for the exclusive tasks.
+  std::vector<std::pair<size_t, int>> free_cpus;
+  for (const auto& core : cores) {
+    size_t free = 0;
+    for (int cpu : core) free += !busy_cpus_[cpu];
+    for (int cpu : core) {
+      if (!busy_cpus_[cpu]) free_cpus.emplace_back(free, cpu);
+    }
+  }
+  std::stable_sort(free_cpus.begin(), free_cpus.end(),
+                   [](const std::pair<size_t, int>& a,
+                      const std::pair<size_t, int>& b) {
+                     return a.first < b.first;
+                   });
+  if (free_cpus.size() < static_cast<size_t>(task.cores)) return false;
+  for (int32_t i = 0; i < task.cores; i++) {
+    reserved->push_back(free_cpus[i].second);
+  }
+  for (int32_t i = 0; i < task.num_processes; i++) {
+    process_cpus->push_back((*reserved)[i % reserved->size()]);
+  }
+  return true;
+}
+
+bool Manager::Fits(const WaitingTask& task) const {
+  // A task that needs more than the whole budget runs alone.
+  if (running_memory_ > 0 && running_memory_ + task.memory > memory_) {
+    return false;
+  }
+  std::vector<int> process_cpus;
+  std::vector<int> reserved;
+  return Allocate(task, &process_cpus, &reserved);
+}
+
+void Manager::Start(std::list<WaitingTask>::iterator task, int64_t now) {
+  int64_t end = task->expected_millis ? now + task->expected_millis
+                                      : std::numeric_limits<int64_t>::max();
+  std::vector<int> process_cpus;
+  std::vector<int> reserved;
+  KJ_ASSERT(Allocate(*task, &process_cpus, &reserved));
+  for (int cpu : reserved) busy_cpus_[cpu] = true;
+  reserved_cores_ -= task->cores;
+  running_cores_ += reserved.size();
+  running_memory_ += task->memory;
+  if (task->exclusive) running_exclusive_++;
+  running_tasks_.emplace(task->id, RunningTask{std::move(reserved),
+                                               task->exclusive, task->memory,
+                                               end, now});
+  task->fulfiller->fulfill(std::move(process_cpus));
+  waiting_tasks_.erase(task);
+}
+
+void Manager::Backfill(int64_t now) {
+  const WaitingTask& head = waiting_tasks_.front();
+  // Do not delay the first task forever.
+  if (now - head.enqueued > kMaxHeadWaitMillis) return;
+  // Find when enough cores will be free for the first task, and how many
+  // cores it will leave free at that time.
+  std::vector<std::pair<int64_t, int32_t>> ends;
+  for (const auto& kv : running_tasks_) {
+    ends.emplace_back(kv.second.end, kv.second.cpus.size());
+  }
+  std::sort(ends.begin(), ends.end());
+  int64_t shadow = std::numeric_limits<int64_t>::max();
+  int32_t free_cores = num_cores_ - running_cores_;
+  int32_t extra_cores = 0;
+  for (const auto& end : ends) {
+    free_cores += end.second;
+    if (free_cores >= head.cores) {
+      shadow = end.first;
+      extra_cores = free_cores - head.cores;
+      break;
+    }
+  }
+  for (auto it = std::next(waiting_tasks_.begin());
+       it != waiting_tasks_.end();) {
+    auto task = it++;
+    if (!Fits(*task)) continue;
+    bool ends_in_time = task->expected_millis &&
+                        now + task->expected_millis <= shadow;
+    if (!ends_in_time) {
+      if (task->cores > extra_cores) continue;
+      extra_cores -= task->cores;
+    }
+    Start(task, now);
+  }
+}
+
+void Manager::TaskDone(uint64_t id) {
+  auto it = running_tasks_.find(id);
+  KJ_ASSERT(it != running_tasks_.end(), id);
+  for (int cpu : it->second.cpus) busy_cpus_[cpu] = false;
+  running_cores_ -= it->second.cpus.size();
+  running_memory_ -= it->second.memory;
+  if (it->second.exclusive) running_exclusive_--;
+  double duration = Now() - it->second.start;
+  average_task_millis_ = average_task_millis_ == 0
+                             ? duration
+                             : average_task_millis_ * 0.875 + duration * 0.125;
+  running_tasks_.erase(it);
+  OnDone();
+}
+
+void Manager::RequestArrived() {
+  pending_requests_--;
+  if (registered_at_ == -1) return;
+  round_trips_.push_back(Now() - registered_at_);
+  if (round_trips_.size() > kRoundTripWindow) round_trips_.pop_front();
+  registered_at_ = -1;
+}
+
+int32_t Manager::PendingDepth() const {
+  if (max_pending_requests_ >= 0) return max_pending_requests_;
+  if (round_trips_.empty() || average_task_millis_ == 0) {
+    return kDefaultPendingDepth;
   }
+  int64_t round_trip =
+      *std::min_element(round_trips_.begin(), round_trips_.end());
+  // By Little's law, the requests that end on all the cores during a round
+  // trip. Keeping more would leave them waiting here instead of on the
+  // server, where another worker could start them.
+  double depth = std::ceil(num_cores_ * round_trip / average_task_millis_);
+  return std::max<int32_t>(1, std::min<double>(depth, num_cores_));
 }
 
 void Manager::CancelPending() {
@@ -2,52 +2,113 @@
 #define WORKER_MANAGER_HPP
 #include <capnp/ez-rpc.h>
 #include <cstdlib>
+#include <deque>
 #include <functional>
-#include <queue>
+#include <list>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
+#include "capnp/server.capnp.h"
+#include "util/calibration.hpp"
+#include "util/file.hpp"
+#include "util/io_pool.hpp"
+#include "util/topology.hpp"
+#include "util/which.hpp"
 #include "worker/cache.hpp"
+#include "worker/sandbox_pool.hpp"
 
 namespace worker {
 
-// Class that requests work from the server at server:port, keeping at most
-// max_pending_requests requests pending to the server and ensuring that the
-// running requests do not use up more than num_cores.
+// Class that requests work from the server at server:port, keeping enough
+// requests pending to the server to fill the free cores plus at most
+// max_pending_requests more, and ensuring that the running requests do not use
+// up more than the cpus of topology and memory KiB of memory. Requests are
+// asked for in batches, with a single registration that gives the server some
+// credits. cache is shared between the managers created on reconnection, and
+// so is id, which identifies the worker to the server. If
+// max_pending_requests is negative, the requests kept pending beyond the free
+// cores are the ones that the cores complete while new requests come from the
+// server.
 class Manager {
  public:
-  Manager(const std::string& server, uint32_t port, int32_t num_cores,
-          int32_t pending_requests, std::string name)
-      : client_(server, port),
-        num_cores_(num_cores),
-        max_pending_requests_(pending_requests),
-        name_(std::move(name)) {}
+  // The server and the event loop the manager works with.
+  struct Connection {
+    // Only set when the server is reached over the network.
+    kj::Own<capnp::EzRpcClient> client;
+    capnproto::MainServer::Client server;
+    kj::LowLevelAsyncIoProvider* io_provider;
+    kj::Timer* timer;
+    kj::WaitScope* wait_scope;
+  };
+
+  // Connects to the server at server:port, with an event loop of its own.
+  static Connection Connect(const std::string& server, uint32_t port);
+
+  // Uses a server in the same process, calling it directly from the event
+  // loop that runs it. The store is shared with the server, so no file is
+  // copied between them.
+  static Connection Local(capnproto::MainServer::Client server,
+                          kj::LowLevelAsyncIoProvider* io_provider,
+                          kj::Timer* timer, kj::WaitScope* wait_scope);
+
+  Manager(Connection connection, util::Topology topology, uint64_t memory,
+          int32_t pending_requests, std::string name, uint64_t id,
+          Cache* cache);
+  Manager(const std::string& server, uint32_t port, util::Topology topology,
+          uint64_t memory, int32_t pending_requests, std::string name,
+          uint64_t id, Cache* cache)
+      : Manager(Connect(server, port), std::move(topology), memory,
+                pending_requests, std::move(name), id, cache) {}
 
   // Starts the manager.
   void Run();
 
-  // Schedule a task that uses size cores. This should be called following an
-  // answer from the server.
+  // Stops asking the server for requests. The evaluators that are already
+  // registered keep running the requests they get.
+  void Stop() { stopped_ = true; }
+
+  // Held by each evaluator of the manager.
+  std::shared_ptr<void> Registered() const { return registered_; }
+
+  // Returns true once the server dropped all the evaluators of the manager,
+  // after which it can be destroyed.
+  bool Released() const { return registered_.use_count() == 1; }
+
+  // Schedule a task of num_processes processes that uses memory KiB of
+  // memory, and that is expected to run for at most expected_millis
+  // milliseconds (0 if unknown). f is called with the cpu assigned to each
+  // process. The cpus of an exclusive task are on physical cores that nothing
+  // else uses. This should be called following an answer from the server.
+  //
+  // Tasks start in order, but a task can start before one that does not fit
+  // yet if it is expected to end before enough cores are free for the latter,
+  // or if it only uses cores that the latter will not need.
   template <typename T>
-  kj::Promise<T> ScheduleTask(size_t size, std::function<kj::Promise<T>()> f) {
-    kj::PromiseFulfillerPair<void> pf = kj::newPromiseAndFulfiller<void>();
-    reserved_cores_ += size;
-    pending_requests_--;
-    waiting_tasks_.emplace(size, std::move(pf.fulfiller));
+  kj::Promise<T> ScheduleTask(
+      size_t num_processes, bool exclusive, uint64_t memory,
+      int64_t expected_millis,
+      std::function<kj::Promise<T>(const std::vector<int>&)> f) {
+    auto pf = kj::newPromiseAndFulfiller<std::vector<int>>();
+    int32_t cores = Cost(num_processes, exclusive);
+    reserved_cores_ += cores;
+    RequestArrived();
+    uint64_t id = last_task_id_++;
+    waiting_tasks_.push_back(WaitingTask{
+        id, cores, static_cast<int32_t>(num_processes), exclusive, memory,
+        expected_millis, Now(), std::move(pf.fulfiller)});
     OnDone();
     return pf.promise.then(
-        [this, f, size]() {
-          kj::Promise<T> ret = f();
+        [this, f, id](std::vector<int> cpus) {
+          kj::Promise<T> ret = f(cpus);
           return ret.then(
-              [size, this](T r) {
-                running_cores_ -= size;
-                OnDone();
+              [id, this](T r) {
+                TaskDone(id);
                 return r;
               },
-              [size, this](kj::Exception exc) {
+              [id, this](kj::Exception exc) {
                 KJ_LOG(WARNING, "Task failed: ", exc.getDescription());
-                running_cores_ -= size;
-                OnDone();
+                TaskDone(id);
                 return exc;
               });
         },
@@ -66,21 +127,123 @@ class Manager {
 
   int32_t NumCores() const { return num_cores_; }
 
-  capnp::EzRpcClient& Client() { return client_; }
+  SandboxPool* Sandboxes() { return &sandboxes_; }
+
+  // Threads for the filesystem operations of the requests.
+  util::IoPool* IoThreads() { return &io_pool_; }
+
+  // Directories for the sandboxes, created ahead of time.
+  util::TempDirPool* Boxes() { return &boxes_; }
 
  private:
-  capnp::EzRpcClient client_;
+  Connection connection_;
+  // A task that cannot start is overtaken only for kMaxHeadWaitMillis.
+  static const constexpr int64_t kMaxHeadWaitMillis = 60000;
+  // Requests kept pending beyond the free cores until the duration of the
+  // tasks and the round trip to the server are known.
+  static const constexpr int32_t kDefaultPendingDepth = 2;
+  // Number of round trips whose minimum is the estimate.
+  static const constexpr size_t kRoundTripWindow = 16;
+
+  struct WaitingTask {
+    uint64_t id;
+    // Number of cpus the task keeps busy.
+    int32_t cores;
+    int32_t num_processes;
+    bool exclusive;
+    uint64_t memory;
+    int64_t expected_millis;
+    int64_t enqueued;
+    kj::Own<kj::PromiseFulfiller<std::vector<int>>> fulfiller;
+  };
+
+  struct RunningTask {
+    // Cpus reserved for the task.
+    std::vector<int> cpus;
+    bool exclusive;
+    uint64_t memory;
+    // Expected end of the task, or INT64_MAX if unknown.
+    int64_t end;
+    int64_t start;
+  };
+
+  int64_t Now();
+  // Number of cpus used by a task.
+  int32_t Cost(size_t num_processes, bool exclusive) const;
+  // Chooses the cpus for the processes of the task among the free ones, and
+  // the cpus to reserve for it. Returns false if there are not enough.
+  bool Allocate(const WaitingTask& task, std::vector<int>* process_cpus,
+                std::vector<int>* reserved) const;
+  // Same as Allocate, using only the given cores.
+  bool AllocateAmong(const WaitingTask& task,
+                     const std::vector<std::vector<int>>& cores,
+                     std::vector<int>* process_cpus,
+                     std::vector<int>* reserved) const;
+  // Whether the task fits in the cores and memory that are free.
+  bool Fits(const WaitingTask& task) const;
+  void Start(std::list<WaitingTask>::iterator task, int64_t now);
+  // Starts the tasks that can overtake the first waiting one.
+  void Backfill(int64_t now);
+  void TaskDone(uint64_t id);
+  // Accounts for a request received from the server.
+  void RequestArrived();
+  // Number of requests to keep pending beyond the free cores.
+  int32_t PendingDepth() const;
+
+  const util::Topology topology_;
+  // Cpus grouped by physical core.
+  const std::vector<std::vector<int>> cores_;
+  // Cores of each NUMA node.
+  std::vector<std::vector<std::vector<int>>> node_cores_;
   const int32_t num_cores_;
+  // Maximum number of exclusive tasks running at the same time, since they
+  // still share the memory bandwidth.
+  const size_t max_exclusive_;
+  const uint64_t memory_;
+  // Advertised at registration, so that the server sends only the requests
+  // this worker can run.
+  const std::vector<std::string> programs_ = util::AvailablePrograms();
+  const std::string cpu_model_ = util::CpuModel();
+  // Measured before any task runs.
+  const double speed_ = util::CalibrationScore();
+  std::vector<bool> busy_cpus_;
+  size_t running_exclusive_ = 0;
   const int32_t max_pending_requests_;
   int32_t reserved_cores_ = 0;
   int32_t running_cores_ = 0;
+  uint64_t running_memory_ = 0;
   int32_t pending_requests_ = 0;
-  std::queue<std::pair<int32_t, kj::Own<kj::PromiseFulfiller<void>>>>
-      waiting_tasks_;
+  // Moving average of the duration of the tasks, in milliseconds, or 0 before
+  // any ends.
+  double average_task_millis_ = 0;
+  // Times between the last registrations and the first request that followed
+  // each, in milliseconds. The ones that were waiting for work on the server
+  // are longer: the minimum estimates the round trip.
+  std::deque<int64_t> round_trips_;
+  // When the last registration was sent, or -1 once a request followed it.
+  int64_t registered_at_ = -1;
+  std::list<WaitingTask> waiting_tasks_;
+  std::unordered_map<uint64_t, RunningTask> running_tasks_;
+  uint64_t last_task_id_ = 0;
   size_t last_worker_id_ = 0;
   std::string name_;
+  // Identifies this worker to the server across its registrations.
+  const uint64_t id_;
   kj::PromiseFulfillerPair<void> on_error_ = kj::newPromiseAndFulfiller<void>();
-  Cache cache_;
+  Cache* cache_;
+  // Version of the cache inventory that was last sent to the server.
+  uint64_t inventory_version_ = 0;
+  // One sandbox helper for each core that can run a process.
+  SandboxPool sandboxes_;
+  // Inputs and outputs of the sandboxes finishing together are copied and
+  // hashed in parallel.
+  util::IoPool io_pool_;
+  bool stopped_ = false;
+  std::shared_ptr<void> registered_ = std::make_shared<bool>(true);
+  // Boxes are created ahead of time and removed in the background, since
+  // both take a few syscalls for each file that should not block the event
+  // loop.
+  util::TempDirPool boxes_;
 };
 
 }  // namespace worker
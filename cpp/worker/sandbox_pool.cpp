@@ -0,0 +1,121 @@
+#include "worker/sandbox_pool.hpp"
+#include "whereami++.h"
+
+#include <kj/debug.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <csignal>
+#include <cstring>
+#include <string>
+
+#include <spawn.h>
+
+#include "util/misc.hpp"
+
+// needed on osx
+extern char** environ;  // NOLINT
+
+namespace worker {
+
+SandboxPool::Helper::~Helper() {
+  if (pid == -1) return;
+  kill(pid, SIGKILL);
+  while (waitpid(pid, nullptr, 0) == -1 && errno == EINTR) {
+  }
+}
+
+SandboxPool::SandboxPool(kj::LowLevelAsyncIoProvider* async_io_provider,
+                         size_t size)
+    : async_io_provider_(async_io_provider), size_(size) {
+  for (size_t i = 0; i < size_; i++) idle_.push_back(Spawn());
+}
+
+kj::Own<SandboxPool::Helper> SandboxPool::Spawn() {
+  // The pipes are closed on exec, so each helper gets only its own ends, as
+  // its standard input and output.
+  int options_pipe[2];
+  int ret = util::PipeCloexec(options_pipe);
+  KJ_ASSERT(ret != -1, "pipe", strerror(errno));
+  int outcome_pipe[2];
+  ret = util::PipeCloexec(outcome_pipe);
+  if (ret == -1) {
+    int err = errno;
+    close(options_pipe[0]);
+    close(options_pipe[1]);
+    KJ_FAIL_ASSERT("pipe", strerror(err));
+  }
+
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_adddup2(&actions, options_pipe[0], fileno(stdin));
+  posix_spawn_file_actions_adddup2(&actions, outcome_pipe[1], fileno(stdout));
+
+  std::string self = whereami::getExecutablePath();
+#define VPARAM(s) (s), (s) + strlen(s) + 1
+  std::vector<char> self_mut(VPARAM(self.c_str()));
+  std::vector<char> sandbox_mut(VPARAM("sandbox"));
+  std::vector<char> zygote_mut(VPARAM("--zygote"));
+#undef VPARAM
+  char* args[] = {self_mut.data(), sandbox_mut.data(), zygote_mut.data(),
+                  nullptr};
+  int pid;
+  int err = posix_spawn(&pid, args[0], &actions, nullptr, args, environ);
+  posix_spawn_file_actions_destroy(&actions);
+  close(options_pipe[0]);
+  close(outcome_pipe[1]);
+  if (err != 0) {
+    close(options_pipe[1]);
+    close(outcome_pipe[0]);
+    KJ_FAIL_ASSERT("posix_spawn", strerror(err));
+  }
+
+  auto helper = kj::refcounted<Helper>();
+  helper->pid = pid;
+  helper->out = async_io_provider_->wrapOutputFd(
+      options_pipe[1], kj::LowLevelAsyncIoProvider::TAKE_OWNERSHIP);
+  helper->in = async_io_provider_->wrapInputFd(
+      outcome_pipe[0], kj::LowLevelAsyncIoProvider::TAKE_OWNERSHIP);
+  return helper;
+}
+
+kj::Promise<SandboxPool::Outcome> SandboxPool::Run(
+    const sandbox::ExecutionOptions& options,
+    std::function<void(int)> on_start) {
+  kj::Own<Helper> helper;
+  if (idle_.empty()) {
+    helper = Spawn();
+  } else {
+    helper = std::move(idle_.back());
+    idle_.pop_back();
+  }
+  Helper* h = helper.get();
+  // The options are preceded by their size.
+  std::string data = options.Serialize();
+  uint64_t size = data.size();
+  auto message = kj::heap<std::string>(
+      reinterpret_cast<const char*>(&size), sizeof(size));  // NOLINT
+  *message += data;
+  // A helper that fails in the middle of an execution is dropped, and killed
+  // with the last reference to it.
+  return h->out->write(message->data(), message->size())
+      .attach(std::move(message))
+      .then([h]() { return h->in->read(&h->child, sizeof(h->child)); })
+      .then([h, on_start]() {
+        on_start(h->child);
+        return h->in->read(&h->result, sizeof(h->result));
+      })
+      .then([h]() {
+        auto data = kj::heapArray<kj::byte>(h->result.size);
+        auto promise = h->in->read(data.begin(), data.size());
+        return promise.then(
+            [data = std::move(data)]() mutable { return std::move(data); });
+      })
+      .then([this, h](kj::Array<kj::byte> data) {
+        if (idle_.size() < size_) idle_.push_back(kj::addRef(*h));
+        return Outcome{h->result.status, std::move(data)};
+      })
+      .attach(std::move(helper));
+}
+
+}  // namespace worker
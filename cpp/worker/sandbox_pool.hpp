@@ -0,0 +1,53 @@
+#ifndef WORKER_SANDBOX_POOL_HPP
+#define WORKER_SANDBOX_POOL_HPP
+#include <kj/async-io.h>
+#include <kj/refcount.h>
+#include <functional>
+#include <vector>
+#include "sandbox/main.hpp"
+#include "sandbox/sandbox.hpp"
+
+namespace worker {
+
+// Pool of long-lived sandbox helpers, started as "sandbox --zygote", that fork
+// a sandbox for each set of options they receive. This avoids starting and
+// initializing the whole binary for every process that is executed. At most
+// size idle helpers are kept; more are started if needed.
+class SandboxPool {
+ public:
+  SandboxPool(kj::LowLevelAsyncIoProvider* async_io_provider, size_t size);
+  KJ_DISALLOW_COPY(SandboxPool);
+
+  struct Outcome {
+    // Exit status of the sandbox, as returned by waitpid.
+    int status;
+    // Output of the sandbox, in the format of "sandbox --bin".
+    kj::Array<kj::byte> data;
+  };
+
+  // Runs a sandbox with the given options. on_start is called with the pid of
+  // the sandbox, that can be signaled to stop it, as soon as it is known.
+  kj::Promise<Outcome> Run(const sandbox::ExecutionOptions& options,
+                           std::function<void(int)> on_start);
+
+ private:
+  struct Helper : public kj::Refcounted {
+    ~Helper();
+    int pid = -1;
+    kj::Own<kj::AsyncOutputStream> out;
+    kj::Own<kj::AsyncInputStream> in;
+    // Buffers for the messages of the helper.
+    int32_t child = 0;
+    sandbox::ZygoteResult result{};
+  };
+
+  kj::Own<Helper> Spawn();
+
+  kj::LowLevelAsyncIoProvider* async_io_provider_;
+  const size_t size_;
+  std::vector<kj::Own<Helper>> idle_;
+};
+
+}  // namespace worker
+
+#endif
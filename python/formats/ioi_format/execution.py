@@ -9,12 +9,12 @@ from task_maker.sanity_checks.ioi import sanity_pre_checks, sanity_post_checks
 from task_maker.solution import Solution
 from task_maker.source_file import SourceFile
 from task_maker.statements.oii_tex import OIITexStatement
-from task_maker.task_maker_frontend import File, Frontend
+from task_maker.task_maker_frontend import File, Frontend, ExecutionGroup
 from task_maker.uis.ioi import IOIUIInterface, TestcaseGenerationStatus
 from task_maker.uis.ioi_curses_ui import IOICursesUI
 from task_maker.uis.ioi_finish_ui import IOIFinishUI
 from task_maker.uis.ioi_finish_ui_json import IOIFinishUIJSON
-from typing import Dict, List, Tuple
+from typing import Dict, List, Tuple, Optional
 
 
 def evaluate_task(frontend: Frontend, task: IOITask, solutions: List[Solution],
@@ -58,6 +58,42 @@ def evaluate_task(frontend: Frontend, task: IOITask, solutions: List[Solution],
     return ui_interface
 
 
+def provide_static_files(pool: ExecutionPool, task: IOITask
+                         ) -> (Dict[Tuple[int, int], File],
+                               Dict[Tuple[int, int], File]):
+    """
+    Provide all the static input and output files at once, so that they are
+    hashed in parallel. Will return 2 dicts: one for input and one for output.
+    If some file cannot be provided the dicts are empty, and the files are left
+    to be provided one by one.
+    """
+    keys = []  # type: List[Tuple[bool, Tuple[int, int]]]
+    paths = []  # type: List[str]
+    descriptions = []  # type: List[str]
+    for st_num, subtask in task.subtasks.items():
+        for tc_num, testcase in subtask.testcases.items():
+            if testcase.input_file:
+                keys.append((True, (st_num, tc_num)))
+                paths.append(testcase.input_file)
+                descriptions.append("Static input %d" % tc_num)
+            if task.task_type == TaskType.Batch and testcase.output_file:
+                keys.append((False, (st_num, tc_num)))
+                paths.append(testcase.output_file)
+                descriptions.append("Static output %d" % tc_num)
+    inputs = dict()  # type: Dict[Tuple[int, int], File]
+    outputs = dict()  # type: Dict[Tuple[int, int], File]
+    try:
+        files = pool.frontend.provideFiles(paths, descriptions, False)
+    except RuntimeError:
+        return inputs, outputs
+    for (is_input, testcase_id), file in zip(keys, files):
+        if is_input:
+            inputs[testcase_id] = file
+        else:
+            outputs[testcase_id] = file
+    return inputs, outputs
+
+
 def generate_inputs(
         pool: ExecutionPool, task: IOITask, interface: IOIUIInterface
 ) -> (Dict[Tuple[int, int], File], Dict[Tuple[int, int], File],
@@ -73,9 +109,25 @@ def generate_inputs(
             source.prepare(pool)
             interface.add_non_solution(source)
 
+    # With batch_validator each validator is started once for each subtask,
+    # and validates all of its inputs with the protocol of util/batch.hpp.
+    batch_validator = bool((task.yaml or dict()).get("batch_validator", False))
+    validator_batches = dict()  # type: Dict[Tuple[int, str], ExecutionGroup]
+
+    def validation_group(st_num: int,
+                         validator: SourceFile) -> Optional[ExecutionGroup]:
+        if not batch_validator:
+            return None
+        key = (st_num, validator.path)
+        if key not in validator_batches:
+            validator_batches[key] = pool.frontend.addExecutionGroup(
+                "Validation of subtask %d" % st_num, True)
+        return validator_batches[key]
+
     inputs = dict()  # type: Dict[Tuple[int, int], File]
     outputs = dict()  # type: Dict[Tuple[int, int], File]
     validations = dict()  # type: Dict[Tuple[int, int], File]
+    static_inputs, static_outputs = provide_static_files(pool, task)
     for st_num, subtask in task.subtasks.items():
         for tc_num, testcase in subtask.testcases.items():
             testcase_id = (st_num, tc_num)
@@ -86,8 +138,12 @@ def generate_inputs(
             # static input file
             if testcase.input_file:
                 try:
-                    inputs[testcase_id] = pool.frontend.provideFile(
-                        testcase.input_file, "Static input %d" % tc_num, False)
+                    if testcase_id in static_inputs:
+                        inputs[testcase_id] = static_inputs[testcase_id]
+                    else:
+                        inputs[testcase_id] = pool.frontend.provideFile(
+                            testcase.input_file, "Static input %d" % tc_num,
+                            False)
 
                     if testcase.validator:
                         val = Execution(
@@ -100,6 +156,8 @@ def generate_inputs(
                                 "subtask": st_num,
                                 "testcase": tc_num
                             },
+                            group=validation_group(
+                                st_num, testcase.validator.source_file),
                             inputs={
                                 VALIDATION_INPUT_NAME: inputs[testcase_id]
                             },
@@ -145,6 +203,8 @@ def generate_inputs(
                         "subtask": st_num,
                         "testcase": tc_num
                     },
+                    group=validation_group(st_num,
+                                           testcase.validator.source_file),
                     inputs={VALIDATION_INPUT_NAME: inputs[testcase_id]},
                     store_stderr=True)
                 validations[testcase_id] = val.stdout
@@ -156,7 +216,9 @@ def generate_inputs(
 
             if task.task_type == TaskType.Batch:
                 # static output file
-                if testcase.output_file:
+                if testcase_id in static_outputs:
+                    outputs[testcase_id] = static_outputs[testcase_id]
+                elif testcase.output_file:
                     outputs[testcase_id] = pool.frontend.provideFile(
                         testcase.output_file, "Static output %d" % tc_num,
                         False)
@@ -301,6 +301,8 @@ def get_task_solutions(config: Config, task: IOITask) -> List[Solution]:
     """
     data = parse_task_yaml()
     num_processes = get_options(data, ["num_processes"], 1)
+    shared_channels = bool(data.get("shared_channels", False))
+    batch_checker = bool(data.get("batch_checker", False))
     graders = get_graders(task)
     solutions = get_solutions(config.solutions, "sol/", graders)
     sols = []  # type: List[Solution]
@@ -310,10 +312,12 @@ def get_task_solutions(config: Config, task: IOITask) -> List[Solution]:
                                       "bin/" + path + "_" + ext[1:],
                                       Arch.DEFAULT, task.grader_map)
         if task.task_type == TaskType.Batch:
-            sols.append(BatchSolution(source, task, config, task.checker))
+            sols.append(
+                BatchSolution(source, task, config, task.checker,
+                              batch_checker))
         else:
             sols.append(
                 CommunicationSolution(source, task, config, task.checker,
-                                      num_processes))
+                                      num_processes, shared_channels))
 
     return sols
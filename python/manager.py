@@ -1,5 +1,6 @@
 #!/usr/bin/env python3
 
+import hashlib
 import sys
 import time
 
@@ -40,9 +41,11 @@ def spawn_backend(type: str, args: List[str], daemonize: bool):
         stderr=streams)
 
 
-def spawn_server(config: Config):
+def spawn_server(config: Config, embedded_worker: bool = False):
     """
-    Spawn the server, passing its arguments from the config
+    Spawn the server, passing its arguments from the config. With
+    embedded_worker the server also runs a worker in the same process, that
+    shares its store and does not talk to it over the network
     """
     args = []
     if config.server_logfile is not None:
@@ -61,6 +64,17 @@ def spawn_server(config: Config):
         args += ["--port", str(config.server_port)]
     if config.server_verbose:
         args += ["--verbose"]
+    if embedded_worker:
+        args += ["--embedded-worker"]
+        if config.worker_keep_sandboxes:
+            args += ["--keep_sandboxes"]
+        if config.worker_num_cores is not None:
+            args += ["--num-cores", str(config.worker_num_cores)]
+        if config.worker_pending_requests is not None:
+            args += [
+                "--pending-requests",
+                str(config.worker_pending_requests)
+            ]
     spawn_backend("server", args, not config.run_server)
 
 
@@ -101,23 +115,27 @@ def get_frontend(config: Config) -> Frontend:
     Run the frontend module connecting to the server and eventually spawning it
     if needed.
     """
+    hash_cache = os.path.join(os.path.dirname(config.storedir), "hashes")
+    # The runs on the same task send only the changes of their DAG
+    session = os.path.join(
+        os.path.dirname(config.storedir), "sessions",
+        hashlib.sha256(config.task_dir.encode()).hexdigest()[:16])
     try:
-        return Frontend(config.host, config.port)
+        return Frontend(config.host, config.port, hash_cache, session)
     except:
         if config.no_spawn:
             raise RuntimeError(
                 "Cannot connect to the server and spawning is forbidden")
-        spawn_server(config)
-        print(
-            "Spawning server and workers", end="", flush=True, file=sys.stderr)
+        # A local server runs its worker in the same process
+        spawn_server(config, embedded_worker=True)
+        print("Spawning server", end="", flush=True, file=sys.stderr)
         for _ in range(3):
             print(".", end="", flush=True, file=sys.stderr)
             time.sleep(SERVER_SPAWN_TIME / 3)
         print(file=sys.stderr)
-        spawn_worker(config)
         for t in range(MAX_SPAWN_ATTEMPT):
             try:
-                return Frontend(config.host, config.port)
+                return Frontend(config.host, config.port, hash_cache, session)
             except:
                 print("Attempt {} failed".format(t + 1), file=sys.stderr)
                 time.sleep(1)
@@ -1,5 +1,6 @@
 #!/usr/bin/env python3
 
+import asyncio
 import time
 
 import signal
@@ -25,6 +26,26 @@ class ExecutionPool:
         self.ui_printer = ui_printer
         self.running = dict()  # type: Dict[Execution, float]
         self.stopped = False
+        self._events = None  # type: Optional[asyncio.Queue]
+
+    @property
+    def events(self) -> asyncio.Queue:
+        """
+        Queue of the (state, execution) pairs of the evaluation, where state is
+        START, SUCCESS, FAILURE or SKIPPED, terminated by None. It belongs to
+        the asyncio loop that first accesses it, and it is filled only by
+        start_async.
+        """
+        if self._events is None:
+            self._events = asyncio.Queue()
+        return self._events
+
+    def push_event(self, state: str, execution: "Execution"):
+        """
+        Add the new state of `execution` to the events, if they are used
+        """
+        if self._events is not None:
+            self._events.put_nowait((state, execution))
 
     def execution_start(self, execution: "Execution"):
         """
@@ -54,6 +75,27 @@ class ExecutionPool:
 
         self.frontend.evaluate()
 
+    async def start_async(self, poll_interval: float = 0.01):
+        """
+        Same as start, but the evaluation runs in the current asyncio loop,
+        which is given back every poll_interval seconds: the callbacks are
+        called between the other tasks, and the events can be awaited.
+        """
+        loop = asyncio.get_event_loop()
+        events = self.events
+        for sig in (signal.SIGINT, signal.SIGTERM):
+            loop.add_signal_handler(sig, self.stop)
+        try:
+            # The event loop of the frontend belongs to this thread, so it is
+            # polled here instead of waited on by another thread.
+            self.frontend.startEvaluation()
+            while not self.frontend.poll():
+                await asyncio.sleep(poll_interval)
+        finally:
+            for sig in (signal.SIGINT, signal.SIGTERM):
+                loop.remove_signal_handler(sig)
+            events.put_nowait(None)
+
     def stop(self):
         """
         Stop the current evaluation
@@ -164,8 +206,10 @@ class Execution:
         # execution generic settings
         if self.pool.config.cache not in self.cache_on:
             self._execution.disableCache()
-        if self.can_exclusive and self.pool.config.exclusive:
-            self._execution.makeExclusive()
+        if self.can_exclusive:
+            self._execution.setTimed()
+            if self.pool.config.exclusive:
+                self._execution.makeExclusive()
         if self.limits is not None:
             self._execution.setLimits(self.limits)
         if self.extra_time:
@@ -267,6 +311,7 @@ class Execution:
         self.pool.ui_printer.print(self.name, self.ui_print_tag, "START",
                                    self.ui_print_data)
         self.pool.execution_start(self)
+        self.pool.push_event("START", self)
         if self._on_start_cb:
             self._on_start_cb()
 
@@ -281,11 +326,13 @@ class Execution:
         })
         self.pool.execution_done(self)
         self._result = result
+        self.pool.push_event(state, self)
         self._on_done_internal()
 
     def _skipped_internal(self):
         self.pool.ui_printer.print(self.name, self.ui_print_tag, "SKIPPED",
                                    self.ui_print_data)
+        self.pool.push_event("SKIPPED", self)
         if self._on_skip_cb:
             self._on_skip_cb()
 
@@ -6,9 +6,14 @@ from task_maker.config import Config
 from task_maker.formats import IOITask
 from task_maker.remote import Execution, ExecutionPool
 from task_maker.source_file import SourceFile
-from task_maker.task_maker_frontend import File, Resources, Fifo
+from task_maker.task_maker_frontend import File, Resources, Fifo, \
+    ExecutionGroup
 from typing import Optional, List, Dict
 
+# Name of the builtin comparison of the workers, as builtinCompare in
+# evaluation.capnp.
+BUILTIN_COMPARE = "task-maker:compare"
+
 
 def get_checker_execution(pool: ExecutionPool,
                           task: IOITask,
@@ -20,10 +25,14 @@ def get_checker_execution(pool: ExecutionPool,
                           output: File,
                           correct_output: File,
                           message: str,
-                          extra_data: Dict = None) -> Execution:
+                          extra_data: Dict = None,
+                          group: Optional[ExecutionGroup] = None
+                          ) -> Execution:
     """
     Build the execution of the checker, it could be a custom checker or the
-    default diff one.
+    default one, that compares the outputs as diff -w in the workers without
+    starting a process. If group is a batch, the custom checker is one of its
+    items.
     """
     if not extra_data:
         extra_data = dict()
@@ -34,8 +43,8 @@ def get_checker_execution(pool: ExecutionPool,
         args = ["input", "output", "contestant_output"]
         inputs["input"] = input
     else:
-        cmd = "diff"
-        args = ["-w", "output", "contestant_output"]
+        cmd = BUILTIN_COMPARE
+        args = ["output", "contestant_output"]
     inputs["output"] = correct_output
     inputs["contestant_output"] = output
     limits = Resources()
@@ -53,6 +62,7 @@ def get_checker_execution(pool: ExecutionPool,
             "testcase": testcase,
             **extra_data
         },
+        group=group,
         cache_on=[CacheMode.ALL],
         limits=limits,
         inputs=inputs,
@@ -92,13 +102,27 @@ class Solution(ABC):
 class BatchSolution(Solution):
     """
     The task type is Batch, the evaluation consists in executing the solution
-    giving the input, taking the output and checking it.
+    giving the input, taking the output and checking it. With batch_checker
+    the checker is started once for each subtask, and checks all of its
+    testcases with the protocol of util/batch.hpp.
     """
 
     def __init__(self, solution: SourceFile, task: IOITask, config: Config,
-                 checker: SourceFile):
+                 checker: SourceFile, batch_checker: bool = False):
         super().__init__(solution, task, config)
         self.checker = checker
+        self.batch_checker = batch_checker
+        self.checker_batches = dict()  # type: Dict[int, ExecutionGroup]
+
+    def _checker_batch(self, subtask: int) -> Optional[ExecutionGroup]:
+        if not self.batch_checker or not self.checker:
+            return None
+        if subtask not in self.checker_batches:
+            self.checker_batches[subtask] = \
+                self.solution.pool.frontend.addExecutionGroup(
+                    "Checking solution %s for subtask %d" %
+                    (self.solution.name, subtask), True)
+        return self.checker_batches[subtask]
 
     def evaluate(self, testcase: int, subtask: int, input: File,
                  validation: Optional[File], correct_output: Optional[File]
@@ -143,7 +167,8 @@ class BatchSolution(Solution):
             self.solution.pool, self.task, self.solution.name, subtask,
             testcase, self.checker, input, output, correct_output,
             "Checking solution %s for testcase %d" % (self.solution.name,
-                                                      testcase))
+                                                      testcase),
+            group=self._checker_batch(subtask))
 
         return [eval], check
 
@@ -151,14 +176,18 @@ class BatchSolution(Solution):
 class CommunicationSolution(Solution):
     """
     The task type is Communication, a number of solutions and a manager are
-    spawned, giving to them an input file.
+    spawned, giving to them an input file. With shared_channels the pipes are
+    ring buffers in shared memory, to be opened with util/channel.hpp, instead
+    of FIFOs.
     """
 
     def __init__(self, solution: SourceFile, task: IOITask, config: Config,
-                 manager: SourceFile, num_processes: int):
+                 manager: SourceFile, num_processes: int,
+                 shared_channels: bool = False):
         super().__init__(solution, task, config)
         self.manager = manager
         self.num_processes = num_processes
+        self.shared_channels = shared_channels
 
     def evaluate(self, testcase: int, subtask: int, input: File,
                  validation: Optional[File], correct_output: Optional[File]
@@ -171,8 +200,8 @@ class CommunicationSolution(Solution):
         pipes_m_2_sol_names = []  # type: List[str]
         pipes_sol_2_m_names = []  # type: List[str]
         for p in range(self.num_processes):
-            pipes_m_2_sol.append(group.createFifo())
-            pipes_sol_2_m.append(group.createFifo())
+            pipes_m_2_sol.append(group.createFifo(self.shared_channels))
+            pipes_sol_2_m.append(group.createFifo(self.shared_channels))
             pipes_m_2_sol_names.append("pipe_m_2_sol%d" % p)
             pipes_sol_2_m_names.append("pipe_sol%d_2_m" % p)
 
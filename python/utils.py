@@ -17,7 +17,8 @@ def resources_to_dict(res: Optional[Resources]) -> Optional[dict]:
         "cpu_time": res.cpu_time,
         "sys_time": res.sys_time,
         "wall_time": res.wall_time,
-        "memory": res.memory
+        "memory": res.memory,
+        "instructions": res.instructions
     }
 
 